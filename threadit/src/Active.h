@@ -36,7 +36,73 @@
 // Includes
 #include <windows.h>
 #include <string.h>
+#include <string>
+#include <vector>
 #include <log4cpp/Category.hh>
+
+class CActive;
+
+/**
+ * ActiveInfo is a snapshot of a live active object taken from the registry of
+ * active objects (see CActive::getRegistrySnapshot). The work queue attributes are
+ * only filled in for a CThreadIt.
+ */
+typedef struct ActiveInfoTag
+{
+	/** theName is the textual identity of the thread. */
+	std::string theName;
+	/** theThreadId is the identity of the thread within the process. */
+	UINT theThreadId;
+	/** theInstance is the instance count of the thread (see CActive::getThreadInstance). */
+	UINT theInstance;
+	/** isRunning is true while the thread handle is open. */
+	bool isRunning;
+	/** theKernelTime is the CPU time in microseconds the thread has spent in the kernel. */
+	ULONGLONG theKernelTime;
+	/** theUserTime is the CPU time in microseconds the thread has spent in user mode. */
+	ULONGLONG theUserTime;
+	/** theWallTime is the time in microseconds since the thread routine started, up to
+	 * the time it ended. */
+	ULONGLONG theWallTime;
+	/** theWaitTime is the part of theWallTime in microseconds that the thread routine spent
+	 * waiting for work (see CActive::beginWait). The rest is the time it was busy. */
+	ULONGLONG theWaitTime;
+	/** theWaitCount is the number of waits for work. */
+	LONG theWaitCount;
+	/** isWaiting is true if the thread routine is waiting for work. */
+	bool isWaiting;
+	/** isThreadIt is true if the active object is a CThreadIt. */
+	bool isThreadIt;
+	/** theWorkQDepth is the number of work packages waiting to be processed. */
+	LONG theWorkQDepth;
+	/** theDoneQDepth is the number of results waiting to be collected with getWork. */
+	LONG theDoneQDepth;
+	/** theProcessedCount is the number of work packages processed. */
+	LONG theProcessedCount;
+	/** theAllocationCount is the number of heap blocks allocated by the worker methods
+	 * (see CThreadIt::getAllocationCount). */
+	LONGLONG theAllocationCount;
+	/** theAllocatedBytes is the number of bytes allocated by the worker methods. */
+	LONGLONG theAllocatedBytes;
+	/** thePeakAllocatedBytes is the most bytes a run of a worker method held at one time. */
+	LONGLONG thePeakAllocatedBytes;
+	/** theCurrentInstruction is the instruction of the worker method running or -1
+	 * if the thread is not in a worker method. */
+	LONG theCurrentInstruction;
+	/** theCurrentTime is the time in milliseconds the worker method has been running. */
+	DWORD theCurrentTime;
+	/** theCurrentTimeAllowed is the time in milliseconds given to the run of the worker
+	 * method or zero if there is no limit. */
+	DWORD theCurrentTimeAllowed;
+	/** theCurrentThreadId is the thread running the worker method. It differs from
+	 * theThreadId for a helper thread of a CThreadItPool. It is zero if there is none. */
+	UINT theCurrentThreadId;
+} ActiveInfo;
+
+/** ActiveInfoMethod is a function that fills in the attributes of ActiveInfo that a
+ * class derived from CActive adds (see CActive::setInfoMethod). */
+typedef void (*ActiveInfoMethod) (CActive* ptheActive, ActiveInfo& theInfo);
+
 /**
  * Class CActive is used as the base class that manages the lifecycle
  * of a thread within the application. Support is provided to 
@@ -69,6 +135,24 @@ class CActive
 	  std::string m_theThreadName;
 	  /** m_ptheLogger is the logger used to log information and errors for each instance of this class */	
 	  log4cpp::Category* m_ptheLogger;
+	  /** m_theInfoMethod fills in the attributes of a derived class for the registry snapshot. */
+	  ActiveInfoMethod m_theInfoMethod;
+	  /** m_theStartTime is the performance counter value when the thread routine started
+	    or zero if it has not started. */
+	  volatile LONGLONG m_theStartTime;
+	  /** m_theStopTime is the performance counter value when the thread routine ended
+	    or zero if it has not ended. */
+	  volatile LONGLONG m_theStopTime;
+	  /** m_theWaitStart is the performance counter value when the wait in progress started
+	    or zero if the thread is not waiting. */
+	  volatile LONGLONG m_theWaitStart;
+	  /** m_theWaitTime is the number of performance counter ticks spent in the waits that
+	    have ended. */
+	  volatile LONGLONG m_theWaitTime;
+	  /** m_theWaitCount is the number of waits. */
+	  volatile LONG m_theWaitCount;
+	  /** m_theCounterFrequency is the frequency of the performance counter. */
+	  static LONGLONG m_theCounterFrequency;
 	  /** m_theThreadCount is the current total number of created CActive instances. */
 	  static volatile UINT m_theThreadCount;
     /** m_theRunningThreadCount is the number of created CActive instances currently running. */
@@ -80,6 +164,9 @@ class CActive
 	  static int InitcsHandleSet;
 	  // set for all the active thread handle, only used by KillAllThreads
 	  static std::set<HANDLE> m_HandleSet;
+	  /** m_theActiveSet is the registry of all live CActive instances. It is protected
+	   * by m_csHandleSet. */
+	  static std::set<CActive*> m_theActiveSet;
 
 	// Methods
   public:
@@ -190,6 +277,15 @@ class CActive
 	   */
 	  static bool waitForZeroThreads (const ULONG theTimeOut);
 
+	  /**
+	   * Method getRegistrySnapshot returns a snapshot of each live CActive instance.
+	   * The snapshot is taken under the registry lock, which the threads of the
+	   * instances never take while they run, so the workers are not stopped. The
+	   * values of each instance are read as they are and need not agree with each other.
+	   * @param[out] theSnapshot receives one entry per instance.
+	   */
+	  static void getRegistrySnapshot (std::vector<ActiveInfo>& theSnapshot);
+
 	  /**
  	   * Method setThreadName is called to set the name of a thread.
  	   * @param[in] theThreadName is the name to set for the the thread.
@@ -201,6 +297,29 @@ class CActive
 	   */
   void setThreadName (const std::string& theThreadName, const DWORD theThreadId /* = -1*/);
 
+  protected:
+
+	  /**
+	   * Method setInfoMethod sets the function that fills in the attributes of a derived
+	   * class for the registry snapshot. A derived class sets it in its constructor and
+	   * clears it at the start of its destructor so that the snapshot does not read
+	   * attributes that are being destroyed.
+	   * @param[in] theInfoMethod is the function or NULL.
+	   */
+	  void setInfoMethod (ActiveInfoMethod theInfoMethod);
+
+	  /**
+	   * Method beginWait is called by the thread routine before it waits for work so that
+	   * the registry snapshot can tell the time the thread is busy from the time it is
+	   * idle. A thread routine that does not call it is counted as busy all the time.
+	   */
+	  void beginWait ();
+
+	  /**
+	   * Method endWait is called by the thread routine once its wait for work returns.
+	   */
+	  void endWait ();
+
   private:
 
 	  /**
@@ -231,6 +350,24 @@ class CActive
 	   */
 	  errno_t initialiseThread (int thePriority);
 
+	  /**
+	   * Method getCounterFrequency returns the frequency of the performance counter. It
+	   * is used to set m_theCounterFrequency.
+	   */
+	  static LONGLONG getCounterFrequency ();
+
+	  /**
+	   * Method getMicroseconds returns a number of performance counter ticks in microseconds.
+	   */
+	  static ULONGLONG getMicroseconds (LONGLONG theTicks);
+
+	  /**
+	   * Method closeThreadHandle closes the thread handle and removes it from the set of
+	   * handles. The registry lock is held so that a snapshot does not use the handle
+	   * while it is closed.
+	   */
+	  void closeThreadHandle ();
+
 		/**
 		 * Method getInstanceLogger returns the logger for this class instance and allows 
 		 * the instance to be used by the associated CActive thread.
@@ -0,0 +1,283 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CMpscRing
+ * Description: class CMpscRing is a template for a bounded multiple producer,
+ * single consumer ring of item pointers. The ring is preallocated when it is
+ * constructed and no locks are taken to insert or remove items. Any number of
+ * threads may insert items but exactly one thread may remove items.
+ *
+ * Each slot carries a sequence number that tells whose turn it is to use the slot.
+ * A producer claims the next slot with an interlocked compare exchange of the tail
+ * and then publishes the item by advancing the sequence of the slot. The consumer
+ * reads the item once the sequence shows it has been published and then hands the
+ * slot back to the producers of the next lap. Producers therefore only contend on
+ * the tail and never wait for each other to finish writing.
+ *
+ * The ring has no signals. It is used with a wait policy of CBasicThreadIt or with
+ * a signal of the owners choosing.
+ *
+ * The implementation relies on the MSVC volatile semantics (/volatile:ms, the
+ * default for x86 and x64) for acquire and release ordering of the sequences.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#ifndef MPSC_RING_H
+#define MPSC_RING_H
+
+// Include files
+#include <windows.h>
+
+/** MPSC_CACHE_LINE is the size of the cache line that the ring positions are padded to. */
+#define MPSC_CACHE_LINE 64
+
+/**
+ * Class CMpscRing is a template class that implements a bounded ring of pointers
+ * to the specified type for use between many producers and one consumer thread.
+ */
+template <class T> class CMpscRing
+{
+	// types
+private:
+	/** Slot is one entry of the ring. */
+	struct Slot
+	{
+		/** theSequence is the position the slot is next written at, or that position
+		 * plus one once the item has been published. */
+		volatile LONG theSequence;
+		/** ptheItem is the item held by the slot. */
+		T* ptheItem;
+	}; // struct Slot
+
+	// Attributes
+private:
+	/** m_ptheSlots is the preallocated array of slots. */
+	Slot* m_ptheSlots;
+	/** m_theMask is the capacity less one. The capacity is always a power of two. */
+	ULONG m_theMask;
+	char m_thePad0[MPSC_CACHE_LINE];
+	/** m_theTail is the next position to be claimed. Written by the producers. */
+	volatile LONG m_theTail;
+	char m_thePad1[MPSC_CACHE_LINE];
+	/** m_theHead is the next position to be read. Written by the consumer only. */
+	volatile LONG m_theHead;
+	char m_thePad2[MPSC_CACHE_LINE];
+
+	// Constructors and destructors
+public:
+	/**
+	 * Constructor CMpscRing allocates the slots for the ring.
+	 * theCapacity is the number of items the ring can hold. It is rounded up to the
+	 * next power of two.
+	 */
+	CMpscRing (ULONG theCapacity);
+
+	/**
+	 * ~CMpscRing frees the slots. Items still in the ring are not freed as the ring
+	 * does not own them.
+	 */
+	~CMpscRing (void);
+
+	// Methods
+public:
+	/**
+	 * Method push inserts an item at the tail of the ring. Any thread may call it.
+	 * Method push returns false if the ring is full.
+	 */
+	bool push (T* ptheItem);
+
+	/**
+	 * Method pop removes the item at the head of the ring. Consumer only.
+	 * Method pop returns NULL if the ring is empty or if the next item has been
+	 * claimed but not yet published.
+	 */
+	T* pop (void);
+
+	/**
+	 * Method size returns the number of items in the ring. The value is a snapshot
+	 * and can be called from any thread.
+	 */
+	ULONG size (void) const;
+
+	/**
+	 * Method isEmpty returns true if there is no published item at the head of the
+	 * ring. Consumer only.
+	 */
+	bool isEmpty (void) const;
+
+	/**
+	 * Method capacity returns the number of slots in the ring.
+	 */
+	ULONG capacity (void) const;
+
+private:
+	/// not copiable
+	CMpscRing (const CMpscRing&);
+	const CMpscRing& operator= (const CMpscRing&);
+
+}; // template <class T> class CMpscRing
+
+
+/**
+ * Implementation of template <class T> class CMpscRing.
+ */
+
+/**
+ * Constructor CMpscRing allocates the slots for the ring.
+ * theCapacity is the number of items the ring can hold. It is rounded up to the
+ * next power of two.
+ */
+template <class T> CMpscRing<T>::CMpscRing (ULONG theCapacity)
+{
+	ULONG theSize = 2;
+
+	while (theSize < theCapacity)
+	{
+		theSize <<= 1;
+	} // while
+	m_ptheSlots = new Slot [theSize];
+	for (ULONG theIndex = 0; theIndex < theSize; theIndex++)
+	{
+		m_ptheSlots[theIndex].theSequence = (LONG)theIndex;
+		m_ptheSlots[theIndex].ptheItem = NULL;
+	} // for
+	m_theMask = theSize - 1;
+	m_theTail = 0;
+	m_theHead = 0;
+} // constructor CMpscRing
+
+/**
+ * ~CMpscRing frees the slots.
+ */
+template <class T> CMpscRing<T>::~CMpscRing ()
+{
+	delete [] m_ptheSlots;
+} // destructor ~CMpscRing
+
+/**
+ * Method push inserts an item at the tail of the ring. Any thread may call it.
+ * Method push returns false if the ring is full.
+ */
+template <class T> bool CMpscRing<T>::push (T* ptheItem)
+{
+	bool isSuccess = false;
+	bool isDone = false;
+	LONG thePosition = m_theTail;
+	LONG theClaimed = 0;
+	LONG theDifference = 0;
+	Slot* ptheSlot = NULL;
+
+	while (!isDone)
+	{
+		ptheSlot = &m_ptheSlots[(ULONG)thePosition & m_theMask];
+		theDifference = ptheSlot->theSequence - thePosition;
+		if (theDifference == 0)
+		{
+			// The slot is free for this lap so try to claim it.
+			theClaimed = InterlockedCompareExchange (&m_theTail, thePosition + 1, thePosition);
+			if (theClaimed == thePosition)
+			{
+				isSuccess = true;
+				isDone = true;
+			}
+			else
+			{
+				thePosition = theClaimed;
+			} // if
+		}
+		else if (theDifference < 0)
+		{
+			// The consumer has not freed the slot from the previous lap so the ring is full.
+			isDone = true;
+		}
+		else
+		{
+			// Another producer claimed the slot first.
+			thePosition = m_theTail;
+		} // if
+	} // while
+	if (isSuccess)
+	{
+		ptheSlot->ptheItem = ptheItem;
+		// Publish the item. The volatile store orders the item before the sequence.
+		ptheSlot->theSequence = thePosition + 1;
+	} // if
+	return isSuccess;
+} // push
+
+/**
+ * Method pop removes the item at the head of the ring. Consumer only.
+ * Method pop returns NULL if the ring is empty or if the next item has been
+ * claimed but not yet published.
+ */
+template <class T> T* CMpscRing<T>::pop (void)
+{
+	T* theItem = NULL;
+	LONG thePosition = m_theHead;
+	Slot* ptheSlot = &m_ptheSlots[(ULONG)thePosition & m_theMask];
+
+	if ((ptheSlot->theSequence - (thePosition + 1)) == 0)
+	{
+		theItem = ptheSlot->ptheItem;
+		ptheSlot->ptheItem = NULL;
+		// Hand the slot to the producers of the next lap.
+		ptheSlot->theSequence = thePosition + (LONG)m_theMask + 1;
+		m_theHead = thePosition + 1;
+	} // if
+	return theItem;
+} // pop
+
+/**
+ * Method size returns the number of items in the ring. The value is a snapshot
+ * and can be called from any thread.
+ */
+template <class T> ULONG CMpscRing<T>::size (void) const
+{
+	LONG theSize = m_theTail - m_theHead;
+
+	if (theSize < 0)
+	{
+		theSize = 0;
+	} // if
+	return (ULONG)theSize;
+} // size
+
+/**
+ * Method isEmpty returns true if there is no published item at the head of the
+ * ring. Consumer only.
+ */
+template <class T> bool CMpscRing<T>::isEmpty (void) const
+{
+	LONG thePosition = m_theHead;
+
+	return ((m_ptheSlots[(ULONG)thePosition & m_theMask].theSequence - (thePosition + 1)) != 0);
+} // isEmpty
+
+/**
+ * Method capacity returns the number of slots in the ring.
+ */
+template <class T> ULONG CMpscRing<T>::capacity (void) const
+{
+	return m_theMask + 1;
+} // capacity
+
+#endif // MPSC_RING_H
@@ -0,0 +1,409 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CSpscRing
+ * Description: class CSpscRing is a template for a bounded single producer,
+ * single consumer ring of item pointers. The ring is preallocated when it is
+ * constructed and no locks are taken to insert or remove items. Exactly one
+ * thread may insert items and exactly one thread may remove items.
+ *
+ * The free slots in the ring are the credits available to the producer. The
+ * producer keeps a cached copy of the consumer position and only refreshes it
+ * when the cached credits run out, so the two threads touch each others cache
+ * line once per batch rather than once per item. Two auto-reset events are
+ * provided so that either side can wait: the data signal is raised when the
+ * ring goes from empty to non-empty and the space signal is raised when the
+ * consumer frees slots while the producer has asked to be told about space.
+ *
+ * The implementation relies on the MSVC volatile semantics (/volatile:ms, the
+ * default for x86 and x64) for acquire and release ordering of the positions
+ * and uses MemoryBarrier where a store must be visible before a load.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+// Include files
+#include <windows.h>
+
+/** SPSC_CACHE_LINE is the size of the cache line that the ring positions are padded to. */
+#define SPSC_CACHE_LINE 64
+
+/**
+ * Class CSpscRing is a template class that implements a bounded ring of pointers
+ * to the specified type for use between one producer and one consumer thread.
+ */
+template <class T> class CSpscRing
+{
+	// Attributes
+private:
+	/** m_ptheSlots is the preallocated array of item pointers. */
+	T** m_ptheSlots;
+	/** m_theMask is the capacity less one. The capacity is always a power of two. */
+	ULONG m_theMask;
+	/** m_theDataSignal is raised when the ring changes from empty to non-empty. */
+	HANDLE m_theDataSignal;
+	/** m_theSpaceSignal is raised when slots are freed and the producer is waiting. */
+	HANDLE m_theSpaceSignal;
+	char m_thePad0[SPSC_CACHE_LINE];
+	/** m_theTail is the next slot to be written. Written by the producer only. */
+	volatile ULONG m_theTail;
+	/** m_theCachedHead is the producers copy of m_theHead used to count credits. */
+	ULONG m_theCachedHead;
+	/** m_isSpaceWanted is set by the producer when it wants the space signal raised. */
+	volatile LONG m_isSpaceWanted;
+	char m_thePad1[SPSC_CACHE_LINE];
+	/** m_theHead is the next slot to be read. Written by the consumer only. */
+	volatile ULONG m_theHead;
+	/** m_theCachedTail is the consumers copy of m_theTail. */
+	ULONG m_theCachedTail;
+	char m_thePad2[SPSC_CACHE_LINE];
+
+	// Constructors and destructors
+public:
+	/**
+	 * Constructor CSpscRing allocates the slots for the ring and creates the signals.
+	 * theCapacity is the number of items the ring can hold. It is rounded up to the
+	 * next power of two.
+	 */
+	CSpscRing (ULONG theCapacity);
+
+	/**
+	 * ~CSpscRing frees the slots and closes the signals. Items still in the ring are
+	 * not freed as the ring does not own them.
+	 */
+	~CSpscRing (void);
+
+	// Methods
+public:
+	/**
+	 * Method push inserts an item at the tail of the ring. Producer only.
+	 * Method push returns false if there are no credits available.
+	 */
+	bool push (T* ptheItem);
+
+	/**
+	 * Method pushBatch inserts up to theCount items and publishes them together.
+	 * Producer only. Method pushBatch returns the number of items inserted.
+	 */
+	ULONG pushBatch (T** ptheItems, ULONG theCount);
+
+	/**
+	 * Method pop removes the item at the head of the ring. Consumer only.
+	 * Method pop returns NULL if the ring is empty.
+	 */
+	T* pop (void);
+
+	/**
+	 * Method popBatch removes up to theMax items from the head of the ring. Consumer only.
+	 * Method popBatch returns the number of items removed.
+	 */
+	ULONG popBatch (T** ptheItems, ULONG theMax);
+
+	/**
+	 * Method getCredits returns the number of items the producer can insert without
+	 * waiting. Producer only.
+	 */
+	ULONG getCredits (void);
+
+	/**
+	 * Method requestSpace is called by the producer when it has run out of credits.
+	 * The space signal will be raised once the consumer frees a slot. The method
+	 * returns true if credits became available in the meantime in which case no
+	 * signal should be expected.
+	 */
+	bool requestSpace (void);
+
+	/**
+	 * Method size returns the number of items in the ring. The value is a snapshot
+	 * and can be called from any thread.
+	 */
+	ULONG size (void) const;
+
+	/**
+	 * Method isEmpty returns true if the ring has no items. Consumer only.
+	 */
+	bool isEmpty (void);
+
+	/**
+	 * Method capacity returns the number of slots in the ring.
+	 */
+	ULONG capacity (void) const;
+
+	/**
+	 * Method getDataSignal returns the auto-reset event raised when items arrive.
+	 */
+	HANDLE getDataSignal (void) const;
+
+	/**
+	 * Method getSpaceSignal returns the auto-reset event raised when space is freed.
+	 */
+	HANDLE getSpaceSignal (void) const;
+
+private:
+	/** Method publish makes the slots up to theTail visible and signals the consumer if needed. */
+	void publish (ULONG theOldTail, ULONG theTail);
+
+	/** Method release frees the slots up to theHead and signals the producer if needed. */
+	void release (ULONG theHead);
+
+	/// not copiable
+	CSpscRing (const CSpscRing&);
+	const CSpscRing& operator= (const CSpscRing&);
+
+}; // template <class T> class CSpscRing
+
+
+/**
+ * Implementation of template <class T> class CSpscRing.
+ */
+
+/**
+ * Constructor CSpscRing allocates the slots for the ring and creates the signals.
+ * theCapacity is the number of items the ring can hold. It is rounded up to the
+ * next power of two.
+ */
+template <class T> CSpscRing<T>::CSpscRing (ULONG theCapacity)
+{
+	ULONG theSize = 2;
+
+	while (theSize < theCapacity)
+	{
+		theSize <<= 1;
+	} // while
+	m_ptheSlots = new T* [theSize];
+	memset (m_ptheSlots, 0, sizeof (T*) * theSize);
+	m_theMask = theSize - 1;
+	m_theTail = 0;
+	m_theCachedHead = 0;
+	m_isSpaceWanted = 0;
+	m_theHead = 0;
+	m_theCachedTail = 0;
+	m_theDataSignal = CreateEvent (NULL, FALSE, FALSE, NULL);
+	m_theSpaceSignal = CreateEvent (NULL, FALSE, FALSE, NULL);
+} // constructor CSpscRing
+
+/**
+ * ~CSpscRing frees the slots and closes the signals.
+ */
+template <class T> CSpscRing<T>::~CSpscRing ()
+{
+	CloseHandle (m_theDataSignal);
+	CloseHandle (m_theSpaceSignal);
+	delete [] m_ptheSlots;
+} // destructor ~CSpscRing
+
+/**
+ * Method push inserts an item at the tail of the ring. Producer only.
+ * Method push returns false if there are no credits available.
+ */
+template <class T> bool CSpscRing<T>::push (T* ptheItem)
+{
+	return (pushBatch (&ptheItem, 1) == 1);
+} // push
+
+/**
+ * Method pushBatch inserts up to theCount items and publishes them together.
+ * Producer only. Method pushBatch returns the number of items inserted.
+ */
+template <class T> ULONG CSpscRing<T>::pushBatch (T** ptheItems, ULONG theCount)
+{
+	ULONG theTail = m_theTail;
+	ULONG theCredits = getCredits ();
+	ULONG theIndex = 0;
+
+	if (theCount > theCredits)
+	{
+		theCount = theCredits;
+	} // if
+	for (theIndex = 0; theIndex < theCount; theIndex++)
+	{
+		m_ptheSlots[(theTail + theIndex) & m_theMask] = ptheItems[theIndex];
+	} // for
+	if (theCount > 0)
+	{
+		publish (theTail, theTail + theCount);
+	} // if
+	return theCount;
+} // pushBatch
+
+/**
+ * Method pop removes the item at the head of the ring. Consumer only.
+ * Method pop returns NULL if the ring is empty.
+ */
+template <class T> T* CSpscRing<T>::pop (void)
+{
+	T* theItem = NULL;
+
+	if (popBatch (&theItem, 1) == 0)
+	{
+		theItem = NULL;
+	} // if
+	return theItem;
+} // pop
+
+/**
+ * Method popBatch removes up to theMax items from the head of the ring. Consumer only.
+ * Method popBatch returns the number of items removed.
+ */
+template <class T> ULONG CSpscRing<T>::popBatch (T** ptheItems, ULONG theMax)
+{
+	ULONG theHead = m_theHead;
+	ULONG theAvailable = m_theCachedTail - theHead;
+	ULONG theIndex = 0;
+
+	if (theAvailable < theMax)
+	{
+		// Refresh our copy of the producer position.
+		m_theCachedTail = m_theTail;
+		theAvailable = m_theCachedTail - theHead;
+	} // if
+	if (theMax > theAvailable)
+	{
+		theMax = theAvailable;
+	} // if
+	for (theIndex = 0; theIndex < theMax; theIndex++)
+	{
+		ptheItems[theIndex] = m_ptheSlots[(theHead + theIndex) & m_theMask];
+	} // for
+	if (theMax > 0)
+	{
+		release (theHead + theMax);
+	} // if
+	return theMax;
+} // popBatch
+
+/**
+ * Method getCredits returns the number of items the producer can insert without
+ * waiting. Producer only.
+ */
+template <class T> ULONG CSpscRing<T>::getCredits (void)
+{
+	ULONG theCredits = (m_theMask + 1) - (m_theTail - m_theCachedHead);
+
+	if (theCredits == 0)
+	{
+		// Our credits are used up so collect those returned by the consumer.
+		m_theCachedHead = m_theHead;
+		theCredits = (m_theMask + 1) - (m_theTail - m_theCachedHead);
+	} // if
+	return theCredits;
+} // getCredits
+
+/**
+ * Method requestSpace is called by the producer when it has run out of credits.
+ * The space signal will be raised once the consumer frees a slot. The method
+ * returns true if credits became available in the meantime in which case no
+ * signal should be expected.
+ */
+template <class T> bool CSpscRing<T>::requestSpace (void)
+{
+	bool isSpace = false;
+
+	InterlockedExchange (&m_isSpaceWanted, 1);
+	// Check again now that the consumer is guaranteed to see the request.
+	if (getCredits () > 0)
+	{
+		InterlockedExchange (&m_isSpaceWanted, 0);
+		isSpace = true;
+	} // if
+	return isSpace;
+} // requestSpace
+
+/**
+ * Method size returns the number of items in the ring.
+ */
+template <class T> ULONG CSpscRing<T>::size (void) const
+{
+	ULONG theHead = m_theHead;
+	ULONG theTail = m_theTail;
+
+	return (theTail - theHead) & ((m_theMask << 1) | 1);
+} // size
+
+/**
+ * Method isEmpty returns true if the ring has no items. Consumer only.
+ */
+template <class T> bool CSpscRing<T>::isEmpty (void)
+{
+	m_theCachedTail = m_theTail;
+	return (m_theCachedTail == m_theHead);
+} // isEmpty
+
+/**
+ * Method capacity returns the number of slots in the ring.
+ */
+template <class T> ULONG CSpscRing<T>::capacity (void) const
+{
+	return m_theMask + 1;
+} // capacity
+
+/**
+ * Method getDataSignal returns the auto-reset event raised when items arrive.
+ */
+template <class T> HANDLE CSpscRing<T>::getDataSignal (void) const
+{
+	return m_theDataSignal;
+} // getDataSignal
+
+/**
+ * Method getSpaceSignal returns the auto-reset event raised when space is freed.
+ */
+template <class T> HANDLE CSpscRing<T>::getSpaceSignal (void) const
+{
+	return m_theSpaceSignal;
+} // getSpaceSignal
+
+/**
+ * Method publish makes the slots up to theTail visible and signals the consumer
+ * if the ring was empty before the publish. The consumer checks for items after
+ * it has moved the head so at least one of the two sides sees the other.
+ */
+template <class T> void CSpscRing<T>::publish (ULONG theOldTail, ULONG theTail)
+{
+	m_theTail = theTail;
+	MemoryBarrier ();
+	if (m_theHead == theOldTail)
+	{
+		SetEvent (m_theDataSignal);
+	} // if
+} // publish
+
+/**
+ * Method release frees the slots up to theHead and raises the space signal if the
+ * producer has asked for it.
+ */
+template <class T> void CSpscRing<T>::release (ULONG theHead)
+{
+	m_theHead = theHead;
+	MemoryBarrier ();
+	if (m_isSpaceWanted)
+	{
+		if (InterlockedExchange (&m_isSpaceWanted, 0) != 0)
+		{
+			SetEvent (m_theSpaceSignal);
+		} // if
+	} // if
+} // release
+
+#endif	// SPSC_RING_H
@@ -57,6 +57,8 @@ volatile long CActive::m_theRunningThreadCount = 0;
 CRITICAL_SECTION CActive::m_csHandleSet;
 int InitcsHandleSet = CActive::InitCSHandleSet();
 std::set<HANDLE> CActive::m_HandleSet;
+std::set<CActive*> CActive::m_theActiveSet;
+LONGLONG CActive::m_theCounterFrequency = CActive::getCounterFrequency ();
 /** 
  * Method initializeThread is called to set the initial state of the thread
  * as required by the various constructors.
@@ -72,12 +74,19 @@ errno_t CActive::initialiseThread (int thePriority)
 	m_isThreadRunning = false;
 	m_theThreadId = 0;
 	m_isThreadStarted = false;
+	m_theInfoMethod = NULL;
+	m_theStartTime = 0;
+	m_theStopTime = 0;
+	m_theWaitStart = 0;
+	m_theWaitTime = 0;
+	m_theWaitCount = 0;
 	// Set an empty thread name.
 	m_theThreadName = "CActive";
 	// Create the thread of execution for the instance and set it state to suspended.
 	m_theThread = (HANDLE)_beginthreadex (NULL,0, threadStub, this, CREATE_SUSPENDED, &m_theThreadId);
 	::EnterCriticalSection (&m_csHandleSet);
   m_HandleSet.insert(static_cast<HANDLE>(m_theThread));
+	m_theActiveSet.insert (this);
 	::LeaveCriticalSection (&m_csHandleSet);
 	// We have added another thread.
 	m_theThreadInstanceCount = ++m_theThreadCount;
@@ -110,6 +119,33 @@ errno_t CActive::initialiseThread (int thePriority)
 	 ::InitializeCriticalSection(&m_csHandleSet);
 	 return 0;
  }
+
+/**
+ * Method getCounterFrequency returns the frequency of the performance counter.
+ */
+LONGLONG CActive::getCounterFrequency ()
+{
+	LARGE_INTEGER theFrequency;
+
+	theFrequency.QuadPart = 0;
+	QueryPerformanceFrequency (&theFrequency);
+	return theFrequency.QuadPart;
+} // getCounterFrequency
+
+/**
+ * Method getMicroseconds returns a number of performance counter ticks in microseconds.
+ */
+ULONGLONG CActive::getMicroseconds (LONGLONG theTicks)
+{
+	ULONGLONG theTime = 0;
+
+	if ((theTicks > 0) && (m_theCounterFrequency != 0))
+	{
+		// Split the division so that a long run does not overflow.
+		theTime = ((theTicks / m_theCounterFrequency) * 1000000) + (((theTicks % m_theCounterFrequency) * 1000000) / m_theCounterFrequency);
+	} // if
+	return theTime;
+} // getMicroseconds
 /**
  * Method cActive is the constructor for the class. The method sets the
  * default thread priority for the active instance and starts the thread of
@@ -214,6 +250,10 @@ CActive::~CActive ()
 	{
 		m_ptheLogger->debugStream() << "release thread instance=" << m_theThreadInstanceCount << ", Id=" << m_theThreadId;
 	} // if
+	// Leave the registry before the instance is gone.
+	::EnterCriticalSection (&m_csHandleSet);
+	m_theActiveSet.erase (this);
+	::LeaveCriticalSection (&m_csHandleSet);
 	// Check that the thread of execution has terminated otherwise stop the
 	// program execution (in debug mode).
 	assert (m_theThread == INVALID_HANDLE_VALUE);
@@ -252,7 +292,7 @@ void CActive::waitForThreadToStop(ULONG timeout)
 		{
 			if (m_ptheLogger->isErrorEnabled ()) {m_ptheLogger->error ("thread failed to terminate in a timely fashion"); } // if
 		}	 // if
-		CloseHandle (m_theThread);
+		closeThreadHandle ();
 		if (m_ptheLogger->isInfoEnabled ()) {m_ptheLogger->info ("closing thread handle"); } // if
 	}
 	else
@@ -261,7 +301,7 @@ void CActive::waitForThreadToStop(ULONG timeout)
 		if (m_theThread != INVALID_HANDLE_VALUE)
 		{
 			TerminateThread (m_theThread, 0);
-			CloseHandle (m_theThread);
+			closeThreadHandle ();
 		  if (m_ptheLogger->isErrorEnabled ()) {m_ptheLogger->error ("thread handle closed after terminating the thread"); } // if
 		}
 		else
@@ -332,7 +372,10 @@ bool CActive::setThreadName (const string& theThreadName)
 
 	if (!m_isThreadStarted || GetCurrentThreadId() == m_theThreadId)
 	{
+		// The registry snapshot may be reading the name.
+		::EnterCriticalSection (&m_csHandleSet);
 		m_theThreadName = theThreadName + string(".CActive.") + strutil::toString (m_theThreadId); 
+		::LeaveCriticalSection (&m_csHandleSet);
 		// Replace the logger with a new one with the thread name.
 		m_ptheLogger = &(log4cpp::Category::getInstance (m_theThreadName));
 		isSuccess = true;
@@ -391,6 +434,138 @@ bool CActive::waitForZeroThreads (ULONG theTimeOut)
 	return isSuccess;
 } // waitForZeroThreads
 
+/**
+ * Method getRegistrySnapshot returns a snapshot of each live CActive instance. The
+ * CPU times come from GetThreadTimes in units of 100 nanoseconds. The wait in
+ * progress is counted up to now. The wait time is read after the wait start, as
+ * endWait changes them in the other order, so a wait that ends during the snapshot
+ * is left out rather than counted twice.
+ */
+void CActive::getRegistrySnapshot (std::vector<ActiveInfo>& theSnapshot)
+{
+	ActiveInfo theInfo;
+	CActive* ptheActive = NULL;
+	FILETIME theCreationTime;
+	FILETIME theExitTime;
+	FILETIME theKernelTime;
+	FILETIME theUserTime;
+	LARGE_INTEGER theNow;
+	LONGLONG theStartTime = 0;
+	LONGLONG theStopTime = 0;
+	LONGLONG theWaitStart = 0;
+	LONGLONG theWaitTime = 0;
+
+	theSnapshot.clear ();
+	::EnterCriticalSection (&m_csHandleSet);
+	theSnapshot.reserve (m_theActiveSet.size ());
+	for (std::set<CActive*>::iterator theIter = m_theActiveSet.begin (); theIter != m_theActiveSet.end (); theIter++)
+	{
+		ptheActive = *theIter;
+		theInfo.theName = ptheActive->m_theThreadName;
+		theInfo.theThreadId = ptheActive->m_theThreadId;
+		theInfo.theInstance = ptheActive->m_theThreadInstanceCount;
+		theInfo.isRunning = (ptheActive->m_theThread != INVALID_HANDLE_VALUE);
+		theInfo.theKernelTime = 0;
+		theInfo.theUserTime = 0;
+		if ((theInfo.isRunning) && (GetThreadTimes (ptheActive->m_theThread, &theCreationTime, &theExitTime, &theKernelTime, &theUserTime)))
+		{
+			theInfo.theKernelTime = ((((ULONGLONG)theKernelTime.dwHighDateTime) << 32) | theKernelTime.dwLowDateTime) / 10;
+			theInfo.theUserTime = ((((ULONGLONG)theUserTime.dwHighDateTime) << 32) | theUserTime.dwLowDateTime) / 10;
+		} // if
+		QueryPerformanceCounter (&theNow);
+		theStartTime = InterlockedCompareExchange64 (&ptheActive->m_theStartTime, 0, 0);
+		theStopTime = InterlockedCompareExchange64 (&ptheActive->m_theStopTime, 0, 0);
+		theWaitStart = InterlockedCompareExchange64 (&ptheActive->m_theWaitStart, 0, 0);
+		theWaitTime = InterlockedCompareExchange64 (&ptheActive->m_theWaitTime, 0, 0);
+		if (theStopTime == 0)
+		{
+			theStopTime = theNow.QuadPart;
+		} // if
+		theInfo.isWaiting = (theWaitStart != 0);
+		if (theInfo.isWaiting)
+		{
+			theWaitTime += theNow.QuadPart - theWaitStart;
+		} // if
+		theInfo.theWallTime = (theStartTime != 0) ? getMicroseconds (theStopTime - theStartTime) : 0;
+		theInfo.theWaitTime = getMicroseconds (theWaitTime);
+		// The waits are read apart from the start time so the wait may not be longer.
+		if (theInfo.theWaitTime > theInfo.theWallTime)
+		{
+			theInfo.theWaitTime = theInfo.theWallTime;
+		} // if
+		theInfo.theWaitCount = ptheActive->m_theWaitCount;
+		theInfo.isThreadIt = false;
+		theInfo.theWorkQDepth = 0;
+		theInfo.theDoneQDepth = 0;
+		theInfo.theProcessedCount = 0;
+		theInfo.theAllocationCount = 0;
+		theInfo.theAllocatedBytes = 0;
+		theInfo.thePeakAllocatedBytes = 0;
+		theInfo.theCurrentInstruction = -1;
+		theInfo.theCurrentTime = 0;
+		theInfo.theCurrentTimeAllowed = 0;
+		theInfo.theCurrentThreadId = 0;
+		if (ptheActive->m_theInfoMethod != NULL)
+		{
+			ptheActive->m_theInfoMethod (ptheActive, theInfo);
+		} // if
+		theSnapshot.push_back (theInfo);
+	} // for
+	::LeaveCriticalSection (&m_csHandleSet);
+} // getRegistrySnapshot
+
+/**
+ * Method setInfoMethod sets the function that fills in the attributes of a derived
+ * class for the registry snapshot.
+ */
+void CActive::setInfoMethod (ActiveInfoMethod theInfoMethod)
+{
+	::EnterCriticalSection (&m_csHandleSet);
+	m_theInfoMethod = theInfoMethod;
+	::LeaveCriticalSection (&m_csHandleSet);
+} // setInfoMethod
+
+/**
+ * Method beginWait is called by the thread routine before it waits for work.
+ */
+void CActive::beginWait ()
+{
+	LARGE_INTEGER theNow;
+
+	QueryPerformanceCounter (&theNow);
+	InterlockedIncrement (&m_theWaitCount);
+	InterlockedExchange64 (&m_theWaitStart, theNow.QuadPart);
+} // beginWait
+
+/**
+ * Method endWait is called by the thread routine once its wait for work returns. The
+ * wait start is cleared before the time is added (see getRegistrySnapshot).
+ */
+void CActive::endWait ()
+{
+	LARGE_INTEGER theNow;
+	LONGLONG theWaitStart = InterlockedExchange64 (&m_theWaitStart, 0);
+
+	if (theWaitStart != 0)
+	{
+		QueryPerformanceCounter (&theNow);
+		InterlockedExchangeAdd64 (&m_theWaitTime, theNow.QuadPart - theWaitStart);
+	} // if
+} // endWait
+
+/**
+ * Method closeThreadHandle closes the thread handle and removes it from the set of
+ * handles so that KillAllThreads does not use a closed handle.
+ */
+void CActive::closeThreadHandle ()
+{
+	::EnterCriticalSection (&m_csHandleSet);
+	m_HandleSet.erase (static_cast<HANDLE> (m_theThread));
+	CloseHandle (m_theThread);
+	m_theThread = INVALID_HANDLE_VALUE;
+	::LeaveCriticalSection (&m_csHandleSet);
+} // closeThreadHandle
+
 /**
  * Method ThreadStub is the method that is used to identify the function
  * that represents the thread for the instance.
@@ -402,6 +577,7 @@ unsigned int __stdcall CActive::threadStub (void* pObject)
 	int theNumThreads = 0;
 	log4cpp::Category* ptheLogger = NULL;
 	CActive* pThreadObject = NULL;
+	LARGE_INTEGER theNow;
 
 	// Get the name of the thread allocated to CActive instance.
 	pThreadObject = static_cast<CActive*>(pObject);
@@ -419,6 +595,9 @@ unsigned int __stdcall CActive::threadStub (void* pObject)
 		::performanceLogger.debugStream() << "Count=" << m_theThreadCount << ", Running=" << m_theRunningThreadCount << ", Handles=" << m_HandleSet.size();
 	::LeaveCriticalSection (&m_csHandleSet);
 	}
+	// Start the wall clock of the thread routine for the utilisation of the thread.
+	QueryPerformanceCounter (&theNow);
+	InterlockedExchange64 (&pThreadObject->m_theStartTime, theNow.QuadPart);
 	try
 	{
 		// The thread of execution is represented by the Thread method of the derived
@@ -441,6 +620,9 @@ unsigned int __stdcall CActive::threadStub (void* pObject)
 	} // if
 	// On exit from the method that represents the thread of control, stop
 	// thread execution.
+	pThreadObject->endWait ();
+	QueryPerformanceCounter (&theNow);
+	InterlockedExchange64 (&pThreadObject->m_theStopTime, theNow.QuadPart);
 	pThreadObject->m_isThreadRunning = false;
 	InterlockedDecrementAcquire(&m_theRunningThreadCount);
 
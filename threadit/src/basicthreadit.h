@@ -0,0 +1,891 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CBasicThreadIt
+ * Description: class CBasicThreadIt is a template for a thread that processes
+ * CWorkPackIt work packages where the work queue, the way the thread waits for
+ * work, the clock and the way work is dispatched are chosen at compile time:
+ *
+ * QueuePolicy    - CLockedQueuePolicy (the unbounded queue of CThreadIt) or
+ *                  CMpscRing (a bounded lock free ring).
+ * WaitPolicy     - CEventWaitPolicy (blocks on an event), CHybridWaitPolicy (spins
+ *                  for a while and then blocks) or CSpinWaitPolicy (spins and keeps
+ *                  a core busy).
+ * ClockPolicy    - CTickClockPolicy (GetTickCount), CCounterClockPolicy (the
+ *                  performance counter) or CTscClockPolicy (the time stamp counter).
+ * DispatchPolicy - CTableDispatchPolicy (the worker method table of CThreadIt),
+ *                  CVirtualDispatchPolicy (a virtual doWork) or CStaticDispatchPolicy
+ *                  (a doWork of the derived class called without a virtual call).
+ *
+ * The template is derived from its dispatch policy and a class is derived from the
+ * template in the same way as from CThreadIt. For example:
+ *
+ * class CFastWorker : public CBasicThreadIt <CMpscRing <CWorkPackIt>, CSpinWaitPolicy,
+ *     CTscClockPolicy, CStaticDispatchPolicy <CFastWorker> >
+ *
+ * CClassicThreadIt gives the policies that match the behaviour of CThreadIt.
+ *
+ * Only the core work protocol is provided: startWork, processing by the worker
+ * and the return of results through the done queue or the queue of the work
+ * package. Callbacks, periodic and event methods, admission control, rate limits
+ * and result caching remain features of CThreadIt. The thread is started by start
+ * once the derived class has been built and a derived class must call stop in its
+ * destructor before its worker methods are destroyed.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (BASIC_THREADIT_H)
+#define BASIC_THREADIT_H
+
+// Includes
+#include <deque>
+#include <process.h>
+#include <intrin.h>
+#include "threadit.h"
+#include "MpscRing.h"
+
+/** THREADIT_BASIC_QUEUE_SIZE is the default capacity of a bounded work queue. */
+#define THREADIT_BASIC_QUEUE_SIZE 4096
+/** THREADIT_BASIC_IDLE_WAIT is the longest time in milliseconds the thread waits before
+ * it checks whether it has been stopped. */
+#define THREADIT_BASIC_IDLE_WAIT 100
+/** THREADIT_HYBRID_SPINS is the number of times CHybridWaitPolicy spins before it blocks. */
+#define THREADIT_HYBRID_SPINS 4000
+
+// Queue policies
+
+/**
+ * Class CLockedQueuePolicy is an unbounded queue guarded by a critical section. The
+ * number of items is also kept with interlocked operations so that the wait policies
+ * can check for work without the lock.
+ */
+template <class T> class CLockedQueuePolicy
+{
+	// Attributes
+private:
+	/** m_theQueue holds the items. */
+	std::deque<T*> m_theQueue;
+	/** m_theAccess guards m_theQueue. */
+	CRITICAL_SECTION m_theAccess;
+	/** m_theSize is the number of items in the queue. */
+	volatile LONG m_theSize;
+
+	// Methods
+public:
+	/**
+	 * Constructor CLockedQueuePolicy sets up the queue. The capacity is ignored as the
+	 * queue is unbounded.
+	 */
+	CLockedQueuePolicy (ULONG theCapacity)
+	{
+		InitializeCriticalSection (&m_theAccess);
+		m_theSize = 0;
+	} // constructor CLockedQueuePolicy
+
+	~CLockedQueuePolicy ()
+	{
+		DeleteCriticalSection (&m_theAccess);
+	} // destructor ~CLockedQueuePolicy
+
+	/**
+	 * Method push adds an item to the tail of the queue. It always returns true.
+	 */
+	bool push (T* ptheItem)
+	{
+		EnterCriticalSection (&m_theAccess);
+		m_theQueue.push_back (ptheItem);
+		InterlockedIncrement (&m_theSize);
+		LeaveCriticalSection (&m_theAccess);
+		return true;
+	} // push
+
+	/**
+	 * Method pop removes the item at the head of the queue or returns NULL if the
+	 * queue is empty.
+	 */
+	T* pop ()
+	{
+		T* theItem = NULL;
+
+		if (m_theSize > 0)
+		{
+			EnterCriticalSection (&m_theAccess);
+			if (!m_theQueue.empty ())
+			{
+				theItem = m_theQueue.front ();
+				m_theQueue.pop_front ();
+				InterlockedDecrement (&m_theSize);
+			} // if
+			LeaveCriticalSection (&m_theAccess);
+		} // if
+		return theItem;
+	} // pop
+
+	/**
+	 * Method size returns the number of items in the queue.
+	 */
+	ULONG size () const
+	{
+		return (ULONG)m_theSize;
+	} // size
+
+	/**
+	 * Method isEmpty returns true if the queue has no items.
+	 */
+	bool isEmpty () const
+	{
+		return (m_theSize == 0);
+	} // isEmpty
+
+private:
+	/// not copiable
+	CLockedQueuePolicy (const CLockedQueuePolicy&);
+	const CLockedQueuePolicy& operator= (const CLockedQueuePolicy&);
+
+}; // template <class T> class CLockedQueuePolicy
+
+// Wait policies
+
+/**
+ * Class CEventWaitPolicy blocks the thread on an auto-reset event when there is no
+ * work. The event is only raised when the thread is waiting so a busy thread costs
+ * the producers no system calls. It can spin for a number of checks first.
+ */
+class CEventWaitPolicy
+{
+	// Attributes
+private:
+	/** m_theSignal is raised when work arrives while the thread is waiting. */
+	HANDLE m_theSignal;
+	/** m_isWaiting is set while the thread is about to block or is blocked. */
+	volatile LONG m_isWaiting;
+	/** m_theSpinCount is the number of checks made before blocking. */
+	ULONG m_theSpinCount;
+
+	// Methods
+public:
+	/**
+	 * Constructor CEventWaitPolicy creates the signal.
+	 * @param[in] theSpinCount is the number of checks made before blocking.
+	 */
+	CEventWaitPolicy (ULONG theSpinCount = 0)
+	{
+		m_theSignal = CreateEvent (NULL, FALSE, FALSE, NULL);
+		m_isWaiting = 0;
+		m_theSpinCount = theSpinCount;
+	} // constructor CEventWaitPolicy
+
+	~CEventWaitPolicy ()
+	{
+		CloseHandle (m_theSignal);
+	} // destructor ~CEventWaitPolicy
+
+	/**
+	 * Method notify is called by a producer after it has added work. The thread is
+	 * only signalled if it is waiting.
+	 */
+	void notify ()
+	{
+		// The work must be visible before the flag is read.
+		MemoryBarrier ();
+		if ((m_isWaiting != 0) && (InterlockedExchange (&m_isWaiting, 0) != 0))
+		{
+			SetEvent (m_theSignal);
+		} // if
+	} // notify
+
+	/**
+	 * Method wake releases the thread from its wait so that it can stop.
+	 */
+	void wake ()
+	{
+		InterlockedExchange (&m_isWaiting, 0);
+		SetEvent (m_theSignal);
+	} // wake
+
+	/**
+	 * Method wait returns when theQueue has work, when woken or after theTimeout
+	 * milliseconds.
+	 */
+	template <class Q> void wait (const Q& theQueue, DWORD theTimeout)
+	{
+		ULONG theSpins = 0;
+
+		while ((theSpins < m_theSpinCount) && theQueue.isEmpty ())
+		{
+			YieldProcessor ();
+			theSpins++;
+		} // while
+		if (theQueue.isEmpty ())
+		{
+			// Announce the wait before the last check so that a producer that adds work
+			// after the check is sure to see the flag.
+			InterlockedExchange (&m_isWaiting, 1);
+			if (theQueue.isEmpty ())
+			{
+				WaitForSingleObject (m_theSignal, theTimeout);
+			} // if
+			m_isWaiting = 0;
+		} // if
+	} // wait
+
+private:
+	/// not copiable
+	CEventWaitPolicy (const CEventWaitPolicy&);
+	const CEventWaitPolicy& operator= (const CEventWaitPolicy&);
+
+}; // class CEventWaitPolicy
+
+/**
+ * Class CHybridWaitPolicy spins for THREADIT_HYBRID_SPINS checks before it blocks.
+ */
+class CHybridWaitPolicy : public CEventWaitPolicy
+{
+public:
+	CHybridWaitPolicy () : CEventWaitPolicy (THREADIT_HYBRID_SPINS)
+	{
+	} // constructor CHybridWaitPolicy
+
+}; // class CHybridWaitPolicy
+
+/**
+ * Class CSpinWaitPolicy never blocks. The thread spins on the queue and yields its
+ * time slice now and then, so it keeps a core busy and is meant for a thread that
+ * has a core to itself.
+ */
+class CSpinWaitPolicy
+{
+	// Attributes
+private:
+	/** m_isWoken is set to end the wait. */
+	volatile LONG m_isWoken;
+
+	// Methods
+public:
+	CSpinWaitPolicy ()
+	{
+		m_isWoken = 0;
+	} // constructor CSpinWaitPolicy
+
+	/**
+	 * Method notify does nothing as the thread is always checking the queue.
+	 */
+	void notify ()
+	{
+	} // notify
+
+	/**
+	 * Method wake ends the wait so that the thread can stop.
+	 */
+	void wake ()
+	{
+		m_isWoken = 1;
+	} // wake
+
+	/**
+	 * Method wait returns when theQueue has work, when woken or after theTimeout
+	 * milliseconds.
+	 */
+	template <class Q> void wait (const Q& theQueue, DWORD theTimeout)
+	{
+		DWORD theStart = GetTickCount ();
+		ULONG theSpins = 0;
+		bool isTimedOut = false;
+
+		while (theQueue.isEmpty () && (m_isWoken == 0) && !isTimedOut)
+		{
+			YieldProcessor ();
+			theSpins++;
+			if ((theSpins % 1024) == 0)
+			{
+				SwitchToThread ();
+				isTimedOut = ((GetTickCount () - theStart) >= theTimeout);
+			} // if
+		} // while
+		m_isWoken = 0;
+	} // wait
+
+}; // class CSpinWaitPolicy
+
+// Clock policies
+
+/**
+ * Class CTickClockPolicy reads GetTickCount. It is cheap but only has a resolution
+ * of 10 to 16 milliseconds.
+ */
+class CTickClockPolicy
+{
+public:
+	/** Method now returns the time in ticks. */
+	LONGLONG now () const
+	{
+		return (LONGLONG)GetTickCount ();
+	} // now
+
+	/** Method getFrequency returns the number of ticks per second. */
+	LONGLONG getFrequency () const
+	{
+		return 1000;
+	} // getFrequency
+
+}; // class CTickClockPolicy
+
+/**
+ * Class CCounterClockPolicy reads the performance counter.
+ */
+class CCounterClockPolicy
+{
+	// Attributes
+private:
+	/** m_theFrequency is the frequency of the performance counter. */
+	LONGLONG m_theFrequency;
+
+	// Methods
+public:
+	CCounterClockPolicy ()
+	{
+		LARGE_INTEGER theFrequency;
+
+		QueryPerformanceFrequency (&theFrequency);
+		m_theFrequency = theFrequency.QuadPart;
+	} // constructor CCounterClockPolicy
+
+	/** Method now returns the time in ticks. */
+	LONGLONG now () const
+	{
+		LARGE_INTEGER theCounter;
+
+		QueryPerformanceCounter (&theCounter);
+		return theCounter.QuadPart;
+	} // now
+
+	/** Method getFrequency returns the number of ticks per second. */
+	LONGLONG getFrequency () const
+	{
+		return m_theFrequency;
+	} // getFrequency
+
+}; // class CCounterClockPolicy
+
+/**
+ * Class CTscClockPolicy reads the time stamp counter of the processor. It is the
+ * cheapest clock but needs a processor with an invariant time stamp counter. The
+ * frequency is measured against the performance counter over about 10 milliseconds
+ * when the clock is built.
+ */
+class CTscClockPolicy
+{
+	// Attributes
+private:
+	/** m_theFrequency is the measured frequency of the time stamp counter. */
+	LONGLONG m_theFrequency;
+
+	// Methods
+public:
+	CTscClockPolicy ()
+	{
+		LARGE_INTEGER theFrequency;
+		LARGE_INTEGER theStart;
+		LARGE_INTEGER theNow;
+		ULONGLONG theTscStart = 0;
+
+		QueryPerformanceFrequency (&theFrequency);
+		QueryPerformanceCounter (&theStart);
+		theTscStart = __rdtsc ();
+		do
+		{
+			QueryPerformanceCounter (&theNow);
+		} while ((theNow.QuadPart - theStart.QuadPart) < (theFrequency.QuadPart / 100));
+		m_theFrequency = (LONGLONG)(((double)(__rdtsc () - theTscStart) * theFrequency.QuadPart) / (theNow.QuadPart - theStart.QuadPart));
+	} // constructor CTscClockPolicy
+
+	/** Method now returns the time in ticks. */
+	LONGLONG now () const
+	{
+		return (LONGLONG)__rdtsc ();
+	} // now
+
+	/** Method getFrequency returns the number of ticks per second. */
+	LONGLONG getFrequency () const
+	{
+		return m_theFrequency;
+	} // getFrequency
+
+}; // class CTscClockPolicy
+
+// Dispatch policies
+
+/**
+ * Class CTableDispatchPolicy calls the worker method registered for the instruction
+ * of the work package in the same way as CThreadIt.
+ */
+template <class Derived> class CTableDispatchPolicy
+{
+	// types
+public:
+	/** WorkerMethod is a worker method of the derived class. */
+	typedef bool (Derived::*WorkerMethod) (CWorkPackIt*, CWorkPackIt*&);
+
+	// Attributes
+private:
+	/** m_theWorkerMethods holds the worker method of each instruction. */
+	WorkerMethod m_theWorkerMethods[CThreadIt::MAX_WORK_METHODS + 1];
+
+	// Methods
+public:
+	CTableDispatchPolicy ()
+	{
+		for (UINT theIndex = 0; theIndex <= CThreadIt::MAX_WORK_METHODS; theIndex++)
+		{
+			m_theWorkerMethods[theIndex] = NULL;
+		} // for
+	} // constructor CTableDispatchPolicy
+
+	/**
+	 * Method setWorkerMethod registers theMethod for theInstruction. It returns false
+	 * if the instruction is not from 1 to MAX_WORK_METHODS.
+	 */
+	bool setWorkerMethod (WorkerMethod theMethod, ULONG theInstruction)
+	{
+		bool isSuccess = false;
+
+		if ((theInstruction > 0) && (theInstruction <= CThreadIt::MAX_WORK_METHODS))
+		{
+			m_theWorkerMethods[theInstruction] = theMethod;
+			isSuccess = true;
+		} // if
+		return isSuccess;
+	} // setWorkerMethod
+
+protected:
+	/**
+	 * Method dispatch calls the worker method for the instruction of pWorkPack. The
+	 * status of pWorkDone is set if there is no such method.
+	 */
+	bool dispatch (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		bool isSuccess = false;
+		ULONG theInstruction = pWorkPack->m_theInstruction;
+
+		if (theInstruction > CThreadIt::MAX_WORK_METHODS)
+		{
+			pWorkDone->m_theStatus = CThreadIt::WORKDONE_INVALID_INSTRUCTION;
+		}
+		else if (m_theWorkerMethods[theInstruction] == NULL)
+		{
+			pWorkDone->m_theStatus = CThreadIt::WORKDONE_NO_METHOD;
+		}
+		else
+		{
+			isSuccess = (static_cast<Derived*> (this)->*m_theWorkerMethods[theInstruction]) (pWorkPack, pWorkDone);
+		} // if
+		return isSuccess;
+	} // dispatch
+
+}; // template <class Derived> class CTableDispatchPolicy
+
+/**
+ * Class CVirtualDispatchPolicy calls the virtual doWork of the derived class for
+ * every work package.
+ */
+class CVirtualDispatchPolicy
+{
+public:
+	virtual ~CVirtualDispatchPolicy ()
+	{
+	} // destructor ~CVirtualDispatchPolicy
+
+protected:
+	/**
+	 * Method doWork processes pWorkPack in the same way as a worker method.
+	 */
+	virtual bool doWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone) = 0;
+
+	/** Method dispatch calls doWork. */
+	bool dispatch (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		return doWork (pWorkPack, pWorkDone);
+	} // dispatch
+
+}; // class CVirtualDispatchPolicy
+
+/**
+ * Class CStaticDispatchPolicy calls the doWork of the derived class for every work
+ * package. The call is resolved at compile time and can be inlined. The derived
+ * class provides a public method bool doWork (CWorkPackIt*, CWorkPackIt*&).
+ */
+template <class Derived> class CStaticDispatchPolicy
+{
+protected:
+	/** Method dispatch calls doWork of the derived class. */
+	bool dispatch (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		return static_cast<Derived*> (this)->doWork (pWorkPack, pWorkDone);
+	} // dispatch
+
+}; // template <class Derived> class CStaticDispatchPolicy
+
+/**
+ * Class CBasicThreadIt is a thread that processes work packages with the given
+ * policies.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+class CBasicThreadIt : public DispatchPolicy
+{
+	// Attributes
+private:
+	/** m_ptheLogger is the logger of the instance. */
+	log4cpp::Category* m_ptheLogger;
+	/** m_theThread is the handle of the thread of execution. It is NULL when stopped. */
+	HANDLE m_theThread;
+	/** m_theClock stamps and measures the work packages. */
+	ClockPolicy m_theClock;
+	char m_thePad0[THREADIT_CACHE_LINE];
+	// Written by the clients that send work.
+	/** m_theWorkPackID is the identifier given to the last work package. */
+	volatile LONG m_theWorkPackID;
+	/** m_theWorkQ holds the work packages to be processed. */
+	QueuePolicy m_theWorkQ;
+	/** m_theWait is how the thread waits for work. */
+	WaitPolicy m_theWait;
+	char m_thePad1[THREADIT_CACHE_LINE];
+	// Written by the thread of execution.
+	/** m_isExitThread is set to true when the thread of execution must exit. */
+	volatile bool m_isExitThread;
+	/** m_theProcessedCount is the number of work packages processed. */
+	volatile LONG m_theProcessedCount;
+	/** m_theLatencyTotal is the sum of the time in clock ticks from startWork to the
+	 * end of processing of the work packages. */
+	volatile LONGLONG m_theLatencyTotal;
+	char m_thePad2[THREADIT_CACHE_LINE];
+	/** m_theDoneQ receives the results for the clients. */
+	CProtectedQueue <CWorkPackIt> m_theDoneQ;
+
+	// Methods
+public:
+	/**
+	 * Constructor CBasicThreadIt sets up the instance. The thread is started by start.
+	 * @param[in] theThreadName is the name of the instance used for logging.
+	 * @param[in] theCapacity is the capacity of a bounded work queue.
+	 */
+	CBasicThreadIt (const std::string& theThreadName, ULONG theCapacity = THREADIT_BASIC_QUEUE_SIZE);
+
+	/**
+	 * Method ~CBasicThreadIt stops the thread if a derived class has not done so and
+	 * frees the work packages still queued.
+	 */
+	virtual ~CBasicThreadIt ();
+
+	/**
+	 * Method start starts the thread of execution. It is called once the derived
+	 * class has been built.
+	 * \return true if the thread is running.
+	 */
+	bool start ();
+
+	/**
+	 * Method stop stops the thread of execution and waits for it to exit. The work
+	 * package being processed is finished first.
+	 */
+	void stop ();
+
+	/**
+	 * Method startWork queues a work package for the thread. The work package is
+	 * stamped with the time of the clock policy in m_theEnqueueTime.
+	 * @param[in] pWorkPack is the work package. It belongs to the instance once queued.
+	 * @param[out] WorkPackID is the identifier given to the work package.
+	 * \return false if pWorkPack is NULL or a bounded queue is full, in which case the
+	 * work package still belongs to the caller.
+	 */
+	bool startWork (CWorkPackIt* pWorkPack, ULONG& WorkPackID);
+
+	/**
+	 * Method getWork waits up to TimeOut milliseconds for a result in the done queue.
+	 * \return the result or NULL. The result belongs to the caller.
+	 */
+	CWorkPackIt* getWork (UINT TimeOut);
+
+	/**
+	 * Method getWorkQDepth returns the number of work packages waiting.
+	 */
+	ULONG getWorkQDepth () const;
+
+	/**
+	 * Method getProcessedCount returns the number of work packages processed.
+	 */
+	LONG getProcessedCount () const;
+
+	/**
+	 * Method getMeanLatency returns the mean time in microseconds from startWork to
+	 * the end of processing.
+	 */
+	LONGLONG getMeanLatency () const;
+
+private:
+	/**
+	 * Method threadStub is the thread function.
+	 * @param[in] ptheThreadIt is the instance.
+	 */
+	static unsigned int __stdcall threadStub (void* ptheThreadIt);
+
+	/**
+	 * Method threadRoutine processes work packages until the thread is stopped.
+	 */
+	void threadRoutine ();
+
+	/**
+	 * Method processWorkPack dispatches a work package and returns or frees the result.
+	 */
+	void processWorkPack (CWorkPackIt* pWorkPack);
+
+	/// not copiable
+	CBasicThreadIt (const CBasicThreadIt&);
+	const CBasicThreadIt& operator= (const CBasicThreadIt&);
+
+}; // class CBasicThreadIt
+
+/**
+ * CClassicThreadIt is the set of policies that behaves as CThreadIt: a locked queue,
+ * a blocking wait, GetTickCount and a worker method table.
+ */
+template <class Derived>
+using CClassicThreadIt = CBasicThreadIt <CLockedQueuePolicy <CWorkPackIt>, CEventWaitPolicy, CTickClockPolicy, CTableDispatchPolicy <Derived> >;
+
+
+/**
+ * Implementation of class CBasicThreadIt.
+ */
+
+/**
+ * Constructor CBasicThreadIt sets up the instance. The thread is started by start.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::CBasicThreadIt (const std::string& theThreadName, ULONG theCapacity) : m_theWorkQ (theCapacity)
+{
+	m_ptheLogger = &(log4cpp::Category::getInstance (theThreadName + std::string (".CBasicThreadIt")));
+	m_theThread = NULL;
+	m_theWorkPackID = 0;
+	m_isExitThread = false;
+	m_theProcessedCount = 0;
+	m_theLatencyTotal = 0;
+} // constructor CBasicThreadIt
+
+/**
+ * Method ~CBasicThreadIt stops the thread if a derived class has not done so and
+ * frees the work packages still queued.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::~CBasicThreadIt ()
+{
+	CWorkPackIt* pWorkPack = NULL;
+
+	stop ();
+	pWorkPack = m_theWorkQ.pop ();
+	while (pWorkPack != NULL)
+	{
+		delete pWorkPack;
+		pWorkPack = m_theWorkQ.pop ();
+	} // while
+	pWorkPack = m_theDoneQ.getItem ();
+	while (pWorkPack != NULL)
+	{
+		delete pWorkPack;
+		pWorkPack = m_theDoneQ.getItem ();
+	} // while
+} // destructor ~CBasicThreadIt
+
+/**
+ * Method start starts the thread of execution.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+bool CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::start ()
+{
+	bool isSuccess = true;
+
+	if (m_theThread == NULL)
+	{
+		m_isExitThread = false;
+		m_theThread = (HANDLE)_beginthreadex (NULL, 0, &threadStub, this, 0, NULL);
+		if (m_theThread == NULL)
+		{
+			m_ptheLogger->error ("Unable to start the thread of execution");
+			isSuccess = false;
+		} // if
+	} // if
+	return isSuccess;
+} // start
+
+/**
+ * Method stop stops the thread of execution and waits for it to exit.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+void CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::stop ()
+{
+	if (m_theThread != NULL)
+	{
+		m_isExitThread = true;
+		m_theWait.wake ();
+		WaitForSingleObject (m_theThread, INFINITE);
+		CloseHandle (m_theThread);
+		m_theThread = NULL;
+	} // if
+} // stop
+
+/**
+ * Method startWork queues a work package for the thread.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+bool CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::startWork (CWorkPackIt* pWorkPack, ULONG& WorkPackID)
+{
+	bool isSuccess = false;
+	ULONG theWorkPackID = 0;
+
+	if (pWorkPack != NULL)
+	{
+		theWorkPackID = (ULONG)InterlockedIncrement (&m_theWorkPackID);
+		pWorkPack->m_theWorkPackID = theWorkPackID;
+		pWorkPack->m_theEnqueueTime = m_theClock.now ();
+		if (m_theWorkQ.push (pWorkPack))
+		{
+			WorkPackID = theWorkPackID;
+			m_theWait.notify ();
+			isSuccess = true;
+		} // if
+	} // if
+	return isSuccess;
+} // startWork
+
+/**
+ * Method getWork waits up to TimeOut milliseconds for a result in the done queue.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+CWorkPackIt* CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::getWork (UINT TimeOut)
+{
+	return m_theDoneQ.waitItem (TimeOut);
+} // getWork
+
+/**
+ * Method getWorkQDepth returns the number of work packages waiting.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+ULONG CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::getWorkQDepth () const
+{
+	return m_theWorkQ.size ();
+} // getWorkQDepth
+
+/**
+ * Method getProcessedCount returns the number of work packages processed.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+LONG CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::getProcessedCount () const
+{
+	return m_theProcessedCount;
+} // getProcessedCount
+
+/**
+ * Method getMeanLatency returns the mean time in microseconds from startWork to
+ * the end of processing.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+LONGLONG CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::getMeanLatency () const
+{
+	LONGLONG theMean = 0;
+	LONG theCount = m_theProcessedCount;
+
+	if (theCount > 0)
+	{
+		theMean = (LONGLONG)(((double)m_theLatencyTotal * 1000000.0) / ((double)m_theClock.getFrequency () * theCount));
+	} // if
+	return theMean;
+} // getMeanLatency
+
+/**
+ * Method threadStub is the thread function.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+unsigned int __stdcall CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::threadStub (void* ptheThreadIt)
+{
+	((CBasicThreadIt*)ptheThreadIt)->threadRoutine ();
+	return 0;
+} // threadStub
+
+/**
+ * Method threadRoutine processes work packages until the thread is stopped.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+void CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::threadRoutine ()
+{
+	CWorkPackIt* pWorkPack = NULL;
+
+	while (!m_isExitThread)
+	{
+		pWorkPack = m_theWorkQ.pop ();
+		if (pWorkPack != NULL)
+		{
+			processWorkPack (pWorkPack);
+		}
+		else
+		{
+			m_theWait.wait (m_theWorkQ, THREADIT_BASIC_IDLE_WAIT);
+		} // if
+	} // while
+} // threadRoutine
+
+/**
+ * Method processWorkPack dispatches a work package and returns or frees the result.
+ */
+template <class QueuePolicy, class WaitPolicy, class ClockPolicy, class DispatchPolicy>
+void CBasicThreadIt<QueuePolicy, WaitPolicy, ClockPolicy, DispatchPolicy>::processWorkPack (CWorkPackIt* pWorkPack)
+{
+	CWorkPackIt* pWorkDone = pWorkPack;
+	LONGLONG theEnqueueTime = pWorkPack->m_theEnqueueTime;
+
+	// The work package belongs to the worker method which returns the result.
+	this->dispatch (pWorkPack, pWorkDone);
+	m_theLatencyTotal = m_theLatencyTotal + (m_theClock.now () - theEnqueueTime);
+	InterlockedIncrement (&m_theProcessedCount);
+	if (pWorkDone != NULL)
+	{
+		if (pWorkDone->m_isSendResult)
+		{
+			if (pWorkDone->m_isUseDefaultQ)
+			{
+				m_theDoneQ.insertItem (pWorkDone);
+			}
+			else if (pWorkDone->m_ptheWorkDoneQ != NULL)
+			{
+				pWorkDone->m_ptheWorkDoneQ->insertItem (pWorkDone);
+			}
+			else
+			{
+				m_ptheLogger->error ("No queue given for the result");
+				delete pWorkDone;
+			} // if
+		}
+		else
+		{
+			delete pWorkDone;
+		} // if
+	} // if
+} // processWorkPack
+
+#endif // !defined (BASIC_THREADIT_H)
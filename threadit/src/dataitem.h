@@ -20,6 +20,7 @@
 #define DATAITEM_H
 
 #include <memory>
+#include <windows.h>
 class CDataItem;
 
 /** WorkOutput is the a queued protected by a critical section. This queue
@@ -37,6 +38,36 @@ class CDataItem
     {
     } // ~CUintDataItem
 
+    /**
+     * Method getHash returns a hash of the payload so that the results of the
+     * instructions that use it can be cached (see CThreadItResultCache). A payload
+     * that returns a hash must also provide isEqual.
+     * @param[out] theHash is the hash of the payload.
+     * \return false if the payload cannot be cached. This is the default.
+     */
+    virtual bool getHash (ULONG& theHash) const
+    {
+      theHash = 0;
+      return false;
+    } // getHash
+
+    /**
+     * Method isEqual returns true if another payload is the same as this one. It
+     * is only called for payloads of the same hash.
+     */
+    virtual bool isEqual (const CDataItem& theOther) const
+    {
+      return false;
+    } // isEqual
+
+    /**
+     * Method getSizeHint returns the approximate number of bytes used by the
+     * payload. It is counted against the memory budget of a result cache.
+     */
+    virtual ULONG getSizeHint () const
+    {
+      return sizeof (CDataItem);
+    } // getSizeHint
 
 }; // CUintDataItem
 
@@ -195,7 +195,7 @@ bool CISafeThreadItInterface::sendMessage (UINT theServiceId, void* ptheMessage)
   if (sptheWorker)
   {
 	  CThreadItMessage aWorkMessage (theServiceId);
-		aWorkMessage.getWork ()->m_wptheSource = m_ptheSender;
+		aWorkMessage.setSourceInfo (m_ptheSender, 0);
 	  aWorkMessage.getWork ()->m_ptheObject = ptheMessage;
 	  aWorkMessage.sendWithNoReplyTo (sptheWorker.get ());
     isSuccess = true;
@@ -223,7 +223,7 @@ bool CISafeThreadItInterface::sendMessage (UINT theServiceId, const DataItemPtr&
   if (sptheWorker)
   {
 	  CThreadItMessage aWorkMessage (theServiceId);
-		aWorkMessage.getWork ()->m_wptheSource = m_ptheSender;
+		aWorkMessage.setSourceInfo (m_ptheSender, 0);
 	  aWorkMessage.getWork ()->m_ptheDataItem = theDataItem;
 	  aWorkMessage.sendWithNoReplyTo (sptheWorker.get ());
     isSuccess = true;
@@ -173,7 +173,7 @@ bool CIThreadItInterface::sendMessage (UINT theServiceId, void* ptheMessage)
 	  CThreadItMessage aWorkMessage (theServiceId);
 		if (m_ptheSender)
 		{
-			aWorkMessage.getWork ()->m_ptheSource = m_ptheSender;
+			aWorkMessage.setSourceInfo (m_ptheSender, 0);
 		} // if 
 	  aWorkMessage.getWork ()->m_ptheObject = ptheMessage;
 	  aWorkMessage.sendWithNoReplyTo (m_ptheWorker);
@@ -61,13 +61,27 @@
 
 // Includes
 #include "stdafx.h"
+#include <malloc.h>
+#include <new>
 #include "dataitem.h"
 #include "ThreadIt.h"
+#include "threaditresultcache.h"
+#include "threaditratelimiter.h"
+#include "threadithistogram.h"
+#include "threadittrace.h"
+#include "threaditcontext.h"
 
 static char const * const PARENT_CATEGORY = "threadit.";
 	/** MODULE_NAME Name allocated to this module. This is used for logging and component
 	  * identification purpose */
 const std::string CThreadIt::MODULE_NAME = "CThreadIt";
+// The trace context of the work package being processed is kept for each thread.
+DWORD CThreadIt::m_theContextTlsIndex = TlsAlloc ();
+volatile LONG CThreadIt::m_theNextTraceId = 0;
+volatile LONG CThreadIt::m_theNextSpanId = 0;
+// The cycle counter of a thread is only found from Windows Vista on.
+CThreadIt::QueryThreadCycleTimeType CThreadIt::m_pQueryThreadCycleTime =
+	(CThreadIt::QueryThreadCycleTimeType)GetProcAddress (GetModuleHandle (TEXT ("kernel32.dll")), "QueryThreadCycleTime");
 
 /**
  * Method CThreadIt is the constructor for the class. The method sets the
@@ -137,6 +151,7 @@ CThreadIt::CThreadIt (const std::string& theThreadName, int thePriority) : CActi
 void CThreadIt::threadItInit (const std::string& theThreadName)
 {
 	int Cntr = 0;
+	LARGE_INTEGER theFrequency;
 
 	m_ptheLogger = &(log4cpp::Category::getInstance (theThreadName));
 	if (m_ptheLogger->isDebugEnabled ()) { m_ptheLogger->debug ("starting instance"); }
@@ -172,6 +187,53 @@ void CThreadIt::threadItInit (const std::string& theThreadName)
 	m_PeriodicMethod = NULL;
 	// The event information is setup.
 	m_ResetEventInfo = FALSE;
+	m_theWakeEvent = CreateEvent (NULL, FALSE, FALSE, NULL);
+	m_theWorkQDepth = 0;
+	m_theLatencyEwma = 0;
+	QueryPerformanceFrequency (&theFrequency);
+	m_theCounterFrequency = theFrequency.QuadPart;
+	// Admission control is off.
+	m_theShedTarget = 0;
+	m_theShedInterval = 100000;
+	m_isOverloaded = false;
+	m_theFirstAboveTime = 0;
+	m_theShedIntervalEnd = 0;
+	m_theMinSojourn = 0;
+	m_theShedCount = 0;
+	// Each run of a worker method has the time allowed of its work package.
+	m_theTimeSlice = 0;
+	m_theContinueCount = 0;
+	// Work sent to this instance by its own thread is queued by default.
+	m_theSelfSendMode = SELF_SEND_QUEUE;
+	m_theMaxInlineDepth = THREADIT_INLINE_DEPTH;
+	m_theInlineDepth = 0;
+	m_theInlineCount = 0;
+	m_theDeferredCount = 0;
+	m_theProcessedCount = 0;
+	for (ULONG theSlot = 0; theSlot < THREADIT_RUN_SLOTS; theSlot++)
+	{
+		m_theRuns[theSlot].theThreadId = 0;
+		m_theRuns[theSlot].theInstruction = -1;
+		m_theRuns[theSlot].theStart = 0;
+		m_theRuns[theSlot].theTimeAllowed = 0;
+	} // for
+	// Take part in the registry snapshot of the active objects.
+	setInfoMethod (&CThreadIt::getActiveInfo);
+	// The latency histograms are created as each instruction is first processed.
+	m_isLatencyStats = true;
+	for (UINT theInstruction = 0; theInstruction < MAX_WORK_METHODS; theInstruction++)
+	{
+		m_ptheLatencyStats[theInstruction] = NULL;
+	} // for
+	m_isCycleStats = false;
+	m_theCycleCount = 0;
+	m_theAllocationCount = 0;
+	m_theAllocatedBytes = 0;
+	m_thePeakAllocatedBytes = 0;
+	// Keep the recent work packages where they can be found after a crash.
+	m_ptheFlightSlot = CThreadItFlightRecorder::acquire (this);
+	InitializeCriticalSection (&m_theShedAccess);
+	InitializeCriticalSection (&m_theCallbackAccess);
 } // threadItInit
 
 /**
@@ -181,12 +243,28 @@ void CThreadIt::threadItInit (const std::string& theThreadName)
  */
 CThreadIt::~CThreadIt ()
 {
+	// The registry snapshot must no longer read the attributes of this class.
+	setInfoMethod (NULL);
 	// Clear all queues.
 	m_WorkQ.clear ();
 	m_DoneQ.clear ();
+	// The work this instance sent to itself was never seen by anyone else so it is freed.
+	while (!m_theSelfQ.empty ())
+	{
+		delete m_theSelfQ.front ();
+		m_theSelfQ.pop_front ();
+	} // while
+	for (UINT theInstruction = 0; theInstruction < MAX_WORK_METHODS; theInstruction++)
+	{
+		delete m_ptheLatencyStats[theInstruction];
+	} // for
 	// Close open handles.
 	CloseHandle (m_Access);
 	CloseHandle (m_TimeAccess);
+	CloseHandle (m_theWakeEvent);
+	DeleteCriticalSection (&m_theShedAccess);
+	DeleteCriticalSection (&m_theCallbackAccess);
+	CThreadItFlightRecorder::release (m_ptheFlightSlot);
 } // ~CThreadIt
 
 // Client Interface Methods
@@ -249,38 +327,135 @@ void CThreadIt::clearObservers ()
  * WorkPackID is a unique reference to the work package. The caller can use
  * this value to track this work.
  * Method startWork returns true if the work package is placed in the work
- * queue successfully.
+ * queue successfully. A work package over a rate limit (see setRateLimiter) that
+ * expects a response is still queued, and true returned, and it is returned with
+ * the status WORKDONE_THROTTLED. Otherwise a throttled work package is freed,
+ * pWorkPack is set to NULL and false is returned.
  */
 bool CThreadIt::startWork (CWorkPackIt*& pWorkPack, ULONG& WorkPackID)
 {
 	bool	Success = TRUE;
-	DWORD Result;
+	bool isAdmitted = true;
+	LARGE_INTEGER theNow;
+	TimingInfo theOuterTiming;
 
-	// Get a unique work packet number for this caller.
-	Result = WaitForSingleObject (m_Access, INFINITE);
-	// Check if the value can be incremented.
-	if (m_WorkPackID >= ULONG_MAX)
+	// Check the rate limits of the sender and of the instruction.
+	if (m_ptheRateLimiter)
 	{
-		// Reset the counter.
-		m_WorkPackID = 0;
+		isAdmitted = m_ptheRateLimiter->admit (pWorkPack);
+	} // if
+	pWorkPack->m_isThrottled = !isAdmitted;
+	if ((isAdmitted) || (pWorkPack->m_isSendResult) || (pWorkPack->m_isNotifyWithCallback) || (pWorkPack->m_ptheCompletion != NULL))
+	{
+		// Get a unique work packet number for this caller. The number wraps to zero
+		// after ULONG_MAX.
+		WorkPackID = (ULONG)InterlockedIncrement ((volatile LONG*)&m_WorkPackID);
+		// Setup the work package identity.
+		pWorkPack->m_theWorkPackID = WorkPackID;
+		// Time stamp the work package.
+		QueryPerformanceCounter (&theNow);
+		pWorkPack->m_theEnqueueTime = theNow.QuadPart;
+		pWorkPack->m_theRequeueTime = theNow.QuadPart;
+		beginSpan (pWorkPack, theNow.QuadPart);
+		CThreadItTrace::trace (CThreadItTrace::TRACE_ENQUEUE, this, pWorkPack->m_theInstruction, WorkPackID, pWorkPack->m_ptheSource);
+		if ((m_theSelfSendMode != SELF_SEND_QUEUE) && (GetCurrentThreadId () == getThreadId ()))
+		{
+			// The thread of execution is sending work to itself.
+			if ((m_theSelfSendMode == SELF_SEND_INLINE) && (m_theInlineDepth < m_theMaxInlineDepth))
+			{
+				// The run in progress keeps its own time allowed once the inline run returns.
+				saveTiming (theOuterTiming);
+				m_theInlineDepth++;
+				InterlockedIncrement (&m_theInlineCount);
+				processWorkPack (pWorkPack);
+				m_theInlineDepth--;
+				restoreTiming (theOuterTiming);
+			}
+			else
+			{
+				m_theSelfQ.push_back (pWorkPack);
+				InterlockedIncrement (&m_theDeferredCount);
+			} // if
+		}
+		else
+		{
+			// Count the work package before it can be taken by the thread.
+			InterlockedIncrement (&m_theWorkQDepth);
+			// Now send the work package on for execution.
+			m_WorkQ.insertItem (pWorkPack);
+		} // if
 	}
 	else
 	{
-		// Now increment the value.
-		m_WorkPackID++;
+		// Nobody expects a response so the throttled work package is dropped.
+		if (pWorkPack->m_ptheObject != NULL)
+		{
+			releaseObject (pWorkPack);
+		} // if
+		delete pWorkPack;
+		pWorkPack = NULL;
+		WorkPackID = 0;
+		Success = false;
 	} // if
-	// Return this to the caller.
-	WorkPackID = m_WorkPackID;
-	// Setup the work package identity.
-	pWorkPack->m_theWorkPackID = WorkPackID;
-	// Release the mutex.
-	ReleaseMutex (m_Access);
-	// Now send the work package on for execution.
-	m_WorkQ.insertItem (pWorkPack);
 	// Return the method status.
 	return Success;
 } // startWork
 
+/**
+ * Method beginSpan gives a work package that is being sent a new span of the request
+ * it belongs to. A work package that already has a context becomes a child of its own
+ * span, so that a work package forwarded by a worker method is a hop of the request.
+ */
+void CThreadIt::beginSpan (CWorkPackIt* pWorkPack, LONGLONG theNow)
+{
+	ThreadItTraceContext& theContext = pWorkPack->m_theTraceContext;
+	const ThreadItTraceContext* ptheCurrent = NULL;
+
+	if (theContext.theTraceId == 0)
+	{
+		ptheCurrent = (const ThreadItTraceContext*)TlsGetValue (m_theContextTlsIndex);
+		if ((ptheCurrent != NULL) && (ptheCurrent->theTraceId != 0))
+		{
+			// The work package is sent on behalf of the one being processed.
+			theContext = *ptheCurrent;
+		}
+		else
+		{
+			// The work package starts a new request.
+			theContext.theTraceId = ((ULONGLONG)GetCurrentProcessId () << 32) | (ULONG)InterlockedIncrement (&m_theNextTraceId);
+			theContext.theSpanId = 0;
+			theContext.theHopCount = 0;
+			theContext.theRequestType = pWorkPack->m_theInstruction;
+			theContext.theOriginTime = theNow;
+		} // if
+	} // if
+	// The span the context holds, if any, is the parent of the new one.
+	if (theContext.theSpanId != 0)
+	{
+		theContext.theHopCount++;
+	} // if
+	theContext.theParentSpanId = theContext.theSpanId;
+	theContext.theSpanId = (ULONG)InterlockedIncrement (&m_theNextSpanId);
+	CThreadItCriticalPath::onSpanStart (theContext);
+} // beginSpan
+
+/**
+ * Method getTraceContext returns the trace context of the work package being processed
+ * by the calling thread.
+ */
+bool CThreadIt::getTraceContext (ThreadItTraceContext& theContext)
+{
+	bool isSuccess = false;
+	const ThreadItTraceContext* ptheCurrent = (const ThreadItTraceContext*)TlsGetValue (m_theContextTlsIndex);
+
+	if (ptheCurrent != NULL)
+	{
+		theContext = *ptheCurrent;
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // getTraceContext
+
 /**
  * Method getWork waits for work processing to be completed and returns
  * a WorkDoneIt package that describes the status of the work performed.
@@ -300,6 +475,10 @@ CWorkPackIt* CThreadIt::getWork (UINT TimeOut)
 	CWorkPackIt* pWork = NULL;
 
 	pWork = m_DoneQ.waitItem (TimeOut);
+	if (pWork != NULL)
+	{
+		CThreadItTrace::trace (CThreadItTrace::TRACE_REPLY_RECEIVE, this, pWork->m_theInstruction, pWork->m_theWorkPackID, NULL);
+	} // if
 	// Return the method status.
 	return pWork;
 } // GetWork
@@ -324,6 +503,274 @@ void CThreadIt::getWorkQ (CProtectedQueue <CWorkPackIt>* pWorkQ)
 	pWorkQ = &m_WorkQ;
 } // GetWorkQ
 
+/**
+ * Method getWorkQDepth returns the number of work packages waiting in the work
+ * queue. It does not take a lock and can be called from any thread.
+ */
+LONG CThreadIt::getWorkQDepth () const
+{
+	return m_theWorkQDepth;
+} // getWorkQDepth
+
+/**
+ * Method getLatencyEwma returns the moving average of the time in microseconds from
+ * startWork to the completion of a work package.
+ */
+LONG CThreadIt::getLatencyEwma () const
+{
+	return m_theLatencyEwma;
+} // getLatencyEwma
+
+/**
+ * Method setResultCache sets the cache looked up before the worker method of an
+ * enabled instruction is called.
+ */
+void CThreadIt::setResultCache (const ThreadItResultCachePtr& ptheResultCache)
+{
+	m_ptheResultCache = ptheResultCache;
+} // setResultCache
+
+/**
+ * Method getResultCache returns the result cache or an empty pointer.
+ */
+ThreadItResultCachePtr CThreadIt::getResultCache () const
+{
+	return m_ptheResultCache;
+} // getResultCache
+
+/**
+ * Method setRateLimiter sets the rate limiter checked by startWork.
+ */
+void CThreadIt::setRateLimiter (const ThreadItRateLimiterPtr& ptheRateLimiter)
+{
+	m_ptheRateLimiter = ptheRateLimiter;
+} // setRateLimiter
+
+/**
+ * Method getRateLimiter returns the rate limiter or an empty pointer.
+ */
+ThreadItRateLimiterPtr CThreadIt::getRateLimiter () const
+{
+	return m_ptheRateLimiter;
+} // getRateLimiter
+
+/**
+ * Method setAdmissionControl turns on admission control based on the time work
+ * packages wait in the work queue.
+ */
+void CThreadIt::setAdmissionControl (ULONG theTarget, ULONG theInterval)
+{
+	InterlockedExchange (&m_theShedInterval, (LONG)theInterval);
+	InterlockedExchange (&m_theShedTarget, (LONG)theTarget);
+} // setAdmissionControl
+
+/**
+ * Method getShedCount returns the number of work packages shed by admission control.
+ */
+LONG CThreadIt::getShedCount () const
+{
+	return m_theShedCount;
+} // getShedCount
+
+/**
+ * Method setSelfSendMode sets what startWork does with work packages that the
+ * thread of execution sends to its own instance.
+ */
+void CThreadIt::setSelfSendMode (SelfSendMode theMode, UINT theMaxDepth)
+{
+	m_theMaxInlineDepth = theMaxDepth;
+	m_theSelfSendMode = theMode;
+} // setSelfSendMode
+
+/**
+ * Method getSelfSendMode returns what startWork does with work packages that the
+ * thread of execution sends to its own instance.
+ */
+CThreadIt::SelfSendMode CThreadIt::getSelfSendMode () const
+{
+	return m_theSelfSendMode;
+} // getSelfSendMode
+
+/**
+ * Method getInlineCount returns the number of work packages processed within startWork.
+ */
+LONG CThreadIt::getInlineCount () const
+{
+	return m_theInlineCount;
+} // getInlineCount
+
+/**
+ * Method getDeferredCount returns the number of work packages kept in the list of
+ * the thread of execution.
+ */
+LONG CThreadIt::getDeferredCount () const
+{
+	return m_theDeferredCount;
+} // getDeferredCount
+
+/**
+ * Method getProcessedCount returns the number of work packages processed.
+ */
+LONG CThreadIt::getProcessedCount () const
+{
+	return m_theProcessedCount;
+} // getProcessedCount
+
+/**
+ * Method setLatencyStats turns the latency histograms on or off.
+ */
+void CThreadIt::setLatencyStats (bool isEnabled)
+{
+	m_isLatencyStats = isEnabled;
+} // setLatencyStats
+
+/**
+ * Method isLatencyStats returns true if the latency histograms are recorded.
+ */
+bool CThreadIt::isLatencyStats () const
+{
+	return m_isLatencyStats;
+} // isLatencyStats
+
+/**
+ * Method setCycleStats turns the counting of the CPU cycles used by the worker methods on or off.
+ */
+void CThreadIt::setCycleStats (bool isEnabled)
+{
+	m_isCycleStats = isEnabled;
+} // setCycleStats
+
+/**
+ * Method isCycleStats returns true if the CPU cycles of the worker methods are counted.
+ */
+bool CThreadIt::isCycleStats () const
+{
+	return m_isCycleStats;
+} // isCycleStats
+
+/**
+ * Method getCycleCount returns the number of CPU cycles used by the worker methods.
+ */
+LONGLONG CThreadIt::getCycleCount () const
+{
+	return m_theCycleCount;
+} // getCycleCount
+
+/**
+ * Method isCycleStatsSupported returns true if the system can count the CPU cycles of a thread.
+ */
+bool CThreadIt::isCycleStatsSupported ()
+{
+	return (m_pQueryThreadCycleTime != NULL);
+} // isCycleStatsSupported
+
+/**
+ * Method getAllocationCount returns the number of heap blocks allocated by the worker methods.
+ */
+LONGLONG CThreadIt::getAllocationCount () const
+{
+	return m_theAllocationCount;
+} // getAllocationCount
+
+/**
+ * Method getAllocatedBytes returns the number of bytes allocated by the worker methods.
+ */
+LONGLONG CThreadIt::getAllocatedBytes () const
+{
+	return m_theAllocatedBytes;
+} // getAllocatedBytes
+
+/**
+ * Method getPeakAllocatedBytes returns the highest peak of a run of a worker method.
+ */
+LONGLONG CThreadIt::getPeakAllocatedBytes () const
+{
+	return m_thePeakAllocatedBytes;
+} // getPeakAllocatedBytes
+
+/**
+ * Method getStats returns a snapshot of the latency histograms of each instruction
+ * that has been recorded. Copying a histogram takes the snapshot.
+ */
+void CThreadIt::getStats (std::vector<CThreadItLatencyStats>& theStats) const
+{
+	CThreadItLatencyStats* ptheStats = NULL;
+
+	theStats.clear ();
+	for (UINT theInstruction = 0; theInstruction < MAX_WORK_METHODS; theInstruction++)
+	{
+		ptheStats = m_ptheLatencyStats[theInstruction];
+		if (ptheStats != NULL)
+		{
+			theStats.push_back (*ptheStats);
+		} // if
+	} // for
+} // getStats
+
+/**
+ * Method getStats returns a snapshot of the latency histograms of an instruction.
+ */
+bool CThreadIt::getStats (ULONG theInstruction, CThreadItLatencyStats& theStats) const
+{
+	bool isSuccess = false;
+	CThreadItLatencyStats* ptheStats = NULL;
+
+	if (theInstruction < MAX_WORK_METHODS)
+	{
+		ptheStats = m_ptheLatencyStats[theInstruction];
+		if (ptheStats != NULL)
+		{
+			theStats = *ptheStats;
+			theStats.m_theInstruction = theInstruction;
+			isSuccess = true;
+		} // if
+	} // if
+	return isSuccess;
+} // getStats
+
+/**
+ * Method resetStats clears the latency histograms.
+ */
+void CThreadIt::resetStats ()
+{
+	CThreadItLatencyStats* ptheStats = NULL;
+
+	for (UINT theInstruction = 0; theInstruction < MAX_WORK_METHODS; theInstruction++)
+	{
+		ptheStats = m_ptheLatencyStats[theInstruction];
+		if (ptheStats != NULL)
+		{
+			ptheStats->reset ();
+		} // if
+	} // for
+} // resetStats
+
+/**
+ * Method setTimeSlice sets the time in milliseconds given to each run of a worker
+ * method. Zero gives each run the time allowed of its work package.
+ */
+void CThreadIt::setTimeSlice (DWORD theTimeSlice)
+{
+	m_theTimeSlice = theTimeSlice;
+} // setTimeSlice
+
+/**
+ * Method getTimeSlice returns the time in milliseconds given to each run of a worker method.
+ */
+DWORD CThreadIt::getTimeSlice () const
+{
+	return m_theTimeSlice;
+} // getTimeSlice
+
+/**
+ * Method getContinueCount returns the number of times work packages have been
+ * queued again with the status WORKDONE_CONTINUE.
+ */
+LONG CThreadIt::getContinueCount () const
+{
+	return m_theContinueCount;
+} // getContinueCount
+
 /**
  * Method getSelfThreadItPtr returns a shared pointer to this instance - that is to itself.
  * This is useful when telling other instances to reply to to me in response to a message.
@@ -357,10 +804,10 @@ void CThreadIt::threadRoutine ()
 	CWorkPackIt* pWorkPack = NULL;
 	CWorkPackIt* pWorkDone = NULL;
 	// hEventList is the list of events that we wait on.
-	HANDLE hEventList[MAX_EVENT_METHODS + 1];
+	HANDLE hEventList[MAX_EVENT_METHODS + 2];
 
 	// Initialise the event list.
-	for (int i = 0; i < MAX_EVENT_METHODS + 1; i++)
+	for (int i = 0; i < MAX_EVENT_METHODS + 2; i++)
 	{
 		hEventList[i] = NULL;
 	} // for
@@ -390,6 +837,8 @@ void CThreadIt::threadRoutine ()
 					theEventCounter++;
 				} // if
 			} // while
+			// The wake event is last so that the event identities are unchanged.
+			hEventList[theEventCounter] = m_theWakeEvent;
 			// Event information has been setup.
 			m_ResetEventInfo = FALSE;
 		} // if (m_ResetEventInfo)
@@ -397,9 +846,19 @@ void CThreadIt::threadRoutine ()
 		// The following change was made to support asynchronous callbacks.
 		// Result = WaitForMultipleObjects	(theEventCounter, hEventList, FALSE, m_TimeOut);
 		// End of change
+		// Work the thread sent to itself goes ahead of the work queue and the wait
+		// does not block while some of it is left.
+		if (!m_theSelfQ.empty ())
+		{
+			drainSelfQueue ();
+		} // if
 		if (!m_isExitThread)
 		{
-			Result = WaitForMultipleObjectsEx	 (theEventCounter, hEventList, FALSE, m_TimeOut, TRUE);
+			// The wait is the idle time of the thread. Completion routines run by the
+			// alertable wait are counted in it.
+			beginWait ();
+			Result = WaitForMultipleObjectsEx	 (theEventCounter + 1, hEventList, FALSE, m_theSelfQ.empty () ? m_TimeOut : 0, TRUE);
+			endWait ();
 		} // if
 		// Process the outcome of the wait.
 		if ((!m_isExitThread) && (Result == WAIT_OBJECT_0))
@@ -410,47 +869,8 @@ void CThreadIt::threadRoutine ()
 			pWorkPack = m_WorkQ.getItemNoDec ();
 			if (pWorkPack != NULL)
 			{
-				// Copy the WorkPack into the WorkDone structure. This caters for the case where there
-				// is no pWorkDone returned or provided due to error conditions. There may be better ways
-				// to handle this condition such as write a log record rather than return a result.
-				pWorkDone = pWorkPack;
-				// Set the work instruction status.
-				Success = FALSE;
-				// Perform the work according to the work instruction given.
-				WorkInstruction =	 pWorkPack->getWorkInstruction ();
-				// Check that a valid work instruction has been given.
-				if ((WorkInstruction >= 0) && (WorkInstruction < MAX_WORK_METHODS))
-				{
-					// Make sure that a method has been provided to perform the work
-					// instruction.
-					if (m_WorkerMethod[WorkInstruction] != NULL)
-					{
-						// Measure the execution time of this work.
-						startTiming (pWorkPack->m_theTimeAllowed);
-						// Execute the work according to the work instruction.
-						Success = (this->*m_WorkerMethod[WorkInstruction])(pWorkPack, pWorkDone);
-						// pWorkDone must not be null here.
-						if (pWorkDone != NULL)
-						{
-							// Get the time to completion.
-							stopTiming (pWorkDone->m_theTimeElapsed);
-						} // if
-					}
-					else
-					{
-						// No method specified for this work instruction.
-						pWorkDone->m_theStatus = WORKDONE_NO_METHOD;
-						m_ptheLogger->error ("No method specified for work instruction");
-					} // if
-				}
-				else
-				{
-					// Invalid work instruction given.
-					pWorkDone->m_theStatus = WORKDONE_INVALID_INSTRUCTION;
-					m_ptheLogger->error ("Invalid work instruction specified");
-				} // if
-				// Now that the work is done. Send a response back the issuer. Send a result to the user if requested.
-				sendResponse (pWorkDone, WorkInstruction, false);
+				InterlockedDecrement (&m_theWorkQDepth);
+				processWorkPack (pWorkPack);
 			}
 			else
 			{
@@ -458,10 +878,11 @@ void CThreadIt::threadRoutine ()
 			} // if (IsWorkToDo)
 		} // if (Result == WAIT_OBJECT_0)
 		// Check if an event has occured.
-		if ((!m_isExitThread) && (Result > WAIT_OBJECT_0) && (Result <= WAIT_OBJECT_0 + theEventCounter))
+		if ((!m_isExitThread) && (Result > WAIT_OBJECT_0) && (Result < WAIT_OBJECT_0 + theEventCounter))
 		{
 			// Determine the event identification.
 			EventId = Result - WAIT_OBJECT_0;
+			CThreadItTrace::trace (CThreadItTrace::TRACE_EVENT_WAKE, this, EventId, 0, NULL);
 			// Make sure that an evetn method has been provided handle the event.
 			if ((EventId > 0) && (EventId < theEventCounter) && (m_EventMethod[EventId - 1].theEventHandler != NULL))
 			{
@@ -500,6 +921,7 @@ void CThreadIt::threadRoutine ()
 		{
 			// There is a time out waiting for an incoming message or the threads period timer has expired.
 			// Execute the periodic mehtod and measure the execution time of this work.
+			CThreadItTrace::trace (CThreadItTrace::TRACE_PERIODIC_TICK, this, THREADIT_PERIOD_TIMER, 0, NULL);
 			startTiming (m_TimePeriod);
 			// Setup the work request.
 			TimedWork.initialise ();
@@ -545,6 +967,390 @@ void CThreadIt::threadRoutine ()
 	// Notify any interested parties that this thread is now exiting.
 } // ThreadRoutine
 
+/**
+ * Method processWorkPack performs the work described by a work package taken from
+ * the work queue and sends the response. The work package is returned unprocessed
+ * if it was throttled or shed, looked up in the result cache if there is one and
+ * otherwise passed to the worker method of its work instruction.
+ */
+void CThreadIt::processWorkPack (CWorkPackIt* pWorkPack)
+{
+	bool Success = FALSE;
+	ULONG WorkInstruction = 0;
+	DWORD theStart = 0;
+	DWORD theBudget = 0;
+	bool isContinue = false;
+	bool isUnprocessed = false;
+	RunInfo* ptheRun = NULL;
+	RunInfo theOuterRun;
+	CWorkPackIt* pWorkDone = NULL;
+	CThreadItCompletion* ptheCompletion = NULL;
+	ULONG theCompletionTag = 0;
+	LONGLONG theEnqueueTime = 0;
+	LONGLONG theRequeueTime = 0;
+	ULONG theElapsedBefore = 0;
+	CThreadItResultCache::LookupResult theCacheResult = CThreadItResultCache::RESULT_UNCACHED;
+	CThreadItResultCache::Flight theFlight;
+	CThreadItResultCache::WaiterList theWaiters;
+	CThreadIt* ptheOwner = NULL;
+	CThreadItLatencyStats* ptheStats = NULL;
+	LARGE_INTEGER theNow;
+	LONGLONG theServiceStart = 0;
+	bool isCycles = false;
+	ULONG64 theCycleStart = 0;
+	ULONG64 theCycleEnd = 0;
+	LONGLONG theCycles = 0;
+	LONGLONG theLatency = 0;
+	ULONG theWorkPackID = 0;
+	CThreadIt* ptheSource = NULL;
+	ThreadItTraceContext theContext;
+	LPVOID ptheOuterContext = NULL;
+	LONGLONG theDispatchTime = 0;
+	ULONG theFlightSequence = 0;
+	ULONG theFlightStatus = THREADIT_FLIGHT_NO_RESULT;
+#if defined (THREADIT_ALLOC_TRACKING)
+	ThreadItAllocRun theAllocRun;
+#endif
+
+	theEnqueueTime = pWorkPack->m_theEnqueueTime;
+	theRequeueTime = pWorkPack->m_theRequeueTime;
+	// Keep the identity of the work package for the trace as the worker method frees it.
+	theWorkPackID = pWorkPack->m_theWorkPackID;
+	ptheSource = pWorkPack->m_ptheSource;
+	// Work sent by this thread until the reply is sent belongs to the request of this work
+	// package. The outer context is put back for a work package processed inline.
+	theContext = pWorkPack->m_theTraceContext;
+	ptheOuterContext = TlsGetValue (m_theContextTlsIndex);
+	TlsSetValue (m_theContextTlsIndex, &theContext);
+	// Copy the WorkPack into the WorkDone structure. This caters for the case where there
+	// is no pWorkDone returned or provided due to error conditions. There may be better ways
+	// to handle this condition such as write a log record rather than return a result.
+	pWorkDone = pWorkPack;
+	// Keep the completion as the worker method frees the work package.
+	ptheCompletion = pWorkPack->m_ptheCompletion;
+	theCompletionTag = pWorkPack->m_theCompletionTag;
+	// Perform the work according to the work instruction given.
+	WorkInstruction =	 pWorkPack->getWorkInstruction ();
+	CThreadItTrace::trace (CThreadItTrace::TRACE_DEQUEUE, this, WorkInstruction, theWorkPackID, ptheSource);
+	QueryPerformanceCounter (&theNow);
+	theDispatchTime = theNow.QuadPart;
+	if (m_ptheFlightSlot != NULL)
+	{
+		theFlightSequence = CThreadItFlightRecorder::begin (m_ptheFlightSlot, theDispatchTime, WorkInstruction, theWorkPackID, ptheSource);
+	} // if
+	// Record the wait in the work queue.
+	if ((m_isLatencyStats) && (WorkInstruction < MAX_WORK_METHODS) && (theRequeueTime != 0) && (m_theCounterFrequency != 0))
+	{
+		ptheStats = getLatencyStats (WorkInstruction);
+		ptheStats->m_theQueueWait.record (((theDispatchTime - theRequeueTime) * 1000000) / m_theCounterFrequency);
+	} // if
+	// Return the work package unprocessed if it was over a rate limit or if the queue is
+	// overloaded and it has waited too long, otherwise check that a valid work instruction
+	// has been given.
+	if (pWorkPack->m_isThrottled)
+	{
+		pWorkDone->m_theStatus = WORKDONE_THROTTLED;
+		isUnprocessed = true;
+	}
+	else if (isShedWork (theRequeueTime))
+	{
+		// A work package that continued may be producing a result that others wait for.
+		if ((m_ptheResultCache) && (pWorkPack->m_theStatus == WORKDONE_CONTINUE))
+		{
+			m_ptheResultCache->abandon (pWorkPack, theWaiters);
+		} // if
+		pWorkDone->m_theStatus = WORKDONE_SHED;
+		isUnprocessed = true;
+	}
+	else if ((WorkInstruction >= 0) && (WorkInstruction < MAX_WORK_METHODS))
+	{
+		// Make sure that a method has been provided to perform the work
+		// instruction.
+		if (m_WorkerMethod[WorkInstruction] != NULL)
+		{
+			// Look for a cached result or an identical work package in progress.
+			if (m_ptheResultCache)
+			{
+				theCacheResult = m_ptheResultCache->lookup (pWorkPack, this, Success, theFlight);
+			} // if
+			if (theCacheResult == CThreadItResultCache::RESULT_WAITING)
+			{
+				// The work package now belongs to the cache and is answered with the
+				// result of the identical one.
+				pWorkDone = NULL;
+				ptheCompletion = NULL;
+			}
+			else if (theCacheResult != CThreadItResultCache::RESULT_HIT)
+			{
+				// Measure the execution time of this work. The helper threads of a CThreadItPool
+				// share the timing variables so the elapsed time is also kept here.
+				startTiming (pWorkPack->m_theTimeAllowed);
+				theStart = GetTickCount ();
+				// A work package that continued adds this run to the time of its earlier runs.
+				if (pWorkPack->m_theStatus == WORKDONE_CONTINUE)
+				{
+					theElapsedBefore = pWorkPack->m_theTimeElapsed;
+				} // if
+				// Give this run the time slice or the time allowed, whichever is smaller, for isTimeLeft.
+				theBudget = m_theTimeSlice;
+				if ((pWorkPack->m_theTimeAllowed != 0) && ((theBudget == 0) || (pWorkPack->m_theTimeAllowed < theBudget)))
+				{
+					theBudget = pWorkPack->m_theTimeAllowed;
+				} // if
+				pWorkPack->m_theDeadline = 0;
+				if (theBudget != 0)
+				{
+					// Zero means no limit so a deadline that lands on it is moved on a tick.
+					pWorkPack->m_theDeadline = theStart + theBudget;
+					if (pWorkPack->m_theDeadline == 0)
+					{
+						pWorkPack->m_theDeadline = 1;
+					} // if
+				} // if
+				if (ptheStats != NULL)
+				{
+					QueryPerformanceCounter (&theNow);
+					theServiceStart = theNow.QuadPart;
+				} // if
+				// The cycles are those of the calling thread, which may be a helper of a CThreadItPool.
+				isCycles = ((m_isCycleStats) && (m_pQueryThreadCycleTime != NULL) && (m_pQueryThreadCycleTime (GetCurrentThread (), &theCycleStart) != FALSE));
+				// Show the instruction in progress in the registry snapshot.
+				ptheRun = beginRun ((LONG)WorkInstruction, theStart, theBudget, theOuterRun);
+				// Execute the work according to the work instruction.
+				CThreadItTrace::trace (CThreadItTrace::TRACE_HANDLER_BEGIN, this, WorkInstruction, theWorkPackID, ptheSource);
+#if defined (THREADIT_ALLOC_TRACKING)
+				CThreadItAlloc::startRun (theAllocRun);
+#endif
+				Success = (this->*m_WorkerMethod[WorkInstruction])(pWorkPack, pWorkDone);
+#if defined (THREADIT_ALLOC_TRACKING)
+				CThreadItAlloc::endRun (theAllocRun);
+				recordAllocations (ptheStats, theAllocRun);
+#endif
+				CThreadItTrace::trace (CThreadItTrace::TRACE_HANDLER_END, this, WorkInstruction, theWorkPackID, ptheSource);
+				endRun (ptheRun, theOuterRun);
+				if ((isCycles) && (m_pQueryThreadCycleTime (GetCurrentThread (), &theCycleEnd) != FALSE))
+				{
+					theCycles = (LONGLONG)(theCycleEnd - theCycleStart);
+					InterlockedExchangeAdd64 (&m_theCycleCount, theCycles);
+					if (ptheStats != NULL)
+					{
+						ptheStats->m_theCycles.record (theCycles);
+					} // if
+				} // if
+				if (ptheStats != NULL)
+				{
+					QueryPerformanceCounter (&theNow);
+					ptheStats->m_theService.record (((theNow.QuadPart - theServiceStart) * 1000000) / m_theCounterFrequency);
+				} // if
+				// The worker method may have run out of time and want to be called again.
+				isContinue = ((pWorkDone != NULL) && (pWorkDone == pWorkPack) && (pWorkDone->m_theStatus == WORKDONE_CONTINUE));
+				// pWorkDone must not be null here.
+				if (pWorkDone != NULL)
+				{
+					// Get the time to completion.
+					stopTiming (pWorkDone->m_theTimeElapsed);
+					pWorkDone->m_theTimeElapsed = theElapsedBefore + (GetTickCount () - theStart);
+				} // if
+				// A work package that continues keeps its result in flight and the waiters
+				// parked until its final run.
+				if ((theCacheResult == CThreadItResultCache::RESULT_MISS) && !isContinue)
+				{
+					m_ptheResultCache->complete (theFlight, pWorkDone, Success, theWaiters);
+				} // if
+				// Queue the work package behind the waiting work rather than respond to it.
+				if (isContinue)
+				{
+					continueWork (pWorkDone);
+					pWorkDone = NULL;
+					ptheCompletion = NULL;
+				} // if
+			} // if
+		}
+		else
+		{
+			// No method specified for this work instruction.
+			pWorkDone->m_theStatus = WORKDONE_NO_METHOD;
+			m_ptheLogger->error ("No method specified for work instruction");
+		} // if
+	}
+	else
+	{
+		// Invalid work instruction given.
+		pWorkDone->m_theStatus = WORKDONE_INVALID_INSTRUCTION;
+		m_ptheLogger->error ("Invalid work instruction specified");
+	} // if
+	// Complete the flight record before the result is sent or freed.
+	if (m_ptheFlightSlot != NULL)
+	{
+		if (isContinue)
+		{
+			theFlightStatus = WORKDONE_CONTINUE;
+		}
+		else if (pWorkDone != NULL)
+		{
+			theFlightStatus = pWorkDone->m_theStatus;
+		} // if
+		QueryPerformanceCounter (&theNow);
+		CThreadItFlightRecorder::end (m_ptheFlightSlot, theFlightSequence, theFlightStatus,
+			(m_theCounterFrequency != 0) ? (ULONG)(((theNow.QuadPart - theDispatchTime) * 1000000) / m_theCounterFrequency) : 0);
+	} // if
+	// Update the latency average and the histogram with the time since the work package was queued.
+	if ((theCacheResult != CThreadItResultCache::RESULT_WAITING) && !isContinue)
+	{
+		theLatency = updateLatency (theEnqueueTime);
+		if (ptheStats != NULL)
+		{
+			ptheStats->m_theEndToEnd.record (theLatency);
+		} // if
+	} // if
+	// Tell the completion before the result is sent or freed.
+	if (ptheCompletion != NULL)
+	{
+		ptheCompletion->onWorkDone (this, theCompletionTag, pWorkDone, Success);
+	} // if
+	// The object of an unprocessed work package that is not returned would be lost. A
+	// cache hit is answered without the worker method so it is not processed either.
+	if (((isUnprocessed) || (theCacheResult == CThreadItResultCache::RESULT_HIT)) && (pWorkDone != NULL) && (!pWorkDone->m_isSendResult) && (pWorkDone->m_ptheObject != NULL))
+	{
+		releaseObject (pWorkDone);
+	} // if
+	// Now that the work is done. Send a response back the issuer. Send a result to the user if requested.
+	sendResponse (pWorkDone, WorkInstruction, false);
+	if ((theCacheResult != CThreadItResultCache::RESULT_WAITING) && !isContinue)
+	{
+		CThreadItCriticalPath::onSpanEnd (theContext);
+	} // if
+	// Answer the identical work packages that waited for this result through the
+	// instance each was sent to, which may be another user of a shared cache.
+	for (size_t theWaiter = 0; theWaiter < theWaiters.size (); theWaiter++)
+	{
+		pWorkDone = theWaiters[theWaiter].pWorkPack;
+		ptheOwner = theWaiters[theWaiter].ptheOwner;
+		ptheCompletion = pWorkDone->m_ptheCompletion;
+		if (ptheCompletion != NULL)
+		{
+			ptheCompletion->onWorkDone (ptheOwner, pWorkDone->m_theCompletionTag, pWorkDone, Success);
+		} // if
+		CThreadItCriticalPath::onSpanEnd (pWorkDone->m_theTraceContext);
+		// The worker method did not see the waiter either.
+		if ((!pWorkDone->m_isSendResult) && (pWorkDone->m_ptheObject != NULL))
+		{
+			ptheOwner->releaseObject (pWorkDone);
+		} // if
+		ptheOwner->sendResponse (pWorkDone, WorkInstruction, false);
+	} // for
+	TlsSetValue (m_theContextTlsIndex, ptheOuterContext);
+	InterlockedIncrement (&m_theProcessedCount);
+} // processWorkPack
+
+/**
+ * Method beginRun shows the run of a worker method by the calling thread. A thread
+ * that is already in a worker method of the instance, because the work package is
+ * processed inline, keeps its slot and the values of the outer run are saved. The
+ * start and time allowed are written before the instruction that marks the run.
+ */
+CThreadIt::RunInfo* CThreadIt::beginRun (LONG theInstruction, DWORD theStart, DWORD theTimeAllowed, RunInfo& theOuterRun)
+{
+	RunInfo* ptheRun = NULL;
+	LONG theThreadId = (LONG)GetCurrentThreadId ();
+
+	theOuterRun.theThreadId = 0;
+	for (ULONG theSlot = 0; (theSlot < THREADIT_RUN_SLOTS) && (ptheRun == NULL); theSlot++)
+	{
+		if (m_theRuns[theSlot].theThreadId == theThreadId)
+		{
+			ptheRun = &m_theRuns[theSlot];
+			theOuterRun.theThreadId = theThreadId;
+			theOuterRun.theInstruction = ptheRun->theInstruction;
+			theOuterRun.theStart = ptheRun->theStart;
+			theOuterRun.theTimeAllowed = ptheRun->theTimeAllowed;
+		} // if
+	} // for
+	for (ULONG theSlot = 0; (theSlot < THREADIT_RUN_SLOTS) && (ptheRun == NULL); theSlot++)
+	{
+		if ((m_theRuns[theSlot].theThreadId == 0) && (InterlockedCompareExchange (&m_theRuns[theSlot].theThreadId, theThreadId, 0) == 0))
+		{
+			ptheRun = &m_theRuns[theSlot];
+		} // if
+	} // for
+	if (ptheRun != NULL)
+	{
+		ptheRun->theInstruction = -1;
+		ptheRun->theStart = theStart;
+		ptheRun->theTimeAllowed = theTimeAllowed;
+		InterlockedExchange (&ptheRun->theInstruction, theInstruction);
+	} // if
+	return ptheRun;
+} // beginRun
+
+/**
+ * Method endRun puts back the run the ended one was nested in or frees the slot.
+ */
+void CThreadIt::endRun (RunInfo* ptheRun, const RunInfo& theOuterRun)
+{
+	if (ptheRun != NULL)
+	{
+		ptheRun->theInstruction = -1;
+		if (theOuterRun.theThreadId != 0)
+		{
+			ptheRun->theStart = theOuterRun.theStart;
+			ptheRun->theTimeAllowed = theOuterRun.theTimeAllowed;
+			InterlockedExchange (&ptheRun->theInstruction, theOuterRun.theInstruction);
+		}
+		else
+		{
+			InterlockedExchange (&ptheRun->theThreadId, 0);
+		} // if
+	} // if
+} // endRun
+
+/**
+ * Method releaseObject is called to free the object of a work package that is freed
+ * without being processed. The type of the object is only known to the worker
+ * method so a derived class that sends objects overrides it.
+ */
+void CThreadIt::releaseObject (CWorkPackIt* pWorkPack)
+{
+	m_ptheLogger->warnStream () << "the object of unprocessed work instruction " << pWorkPack->m_theInstruction << " is not freed - releaseObject is not overridden";
+} // releaseObject
+
+/**
+ * Method continueWork queues a work package that returned WORKDONE_CONTINUE behind
+ * the work that is waiting.
+ */
+void CThreadIt::continueWork (CWorkPackIt* pWorkPack)
+{
+	LARGE_INTEGER theNow;
+
+	// The queue wait starts again so that the admission control sees the new wait. The
+	// latency is still measured from the time the work package was first queued.
+	QueryPerformanceCounter (&theNow);
+	pWorkPack->m_theRequeueTime = theNow.QuadPart;
+	pWorkPack->m_theDeadline = 0;
+	CThreadItTrace::trace (CThreadItTrace::TRACE_ENQUEUE, this, pWorkPack->m_theInstruction, pWorkPack->m_theWorkPackID, this);
+	InterlockedIncrement (&m_theContinueCount);
+	InterlockedIncrement (&m_theWorkQDepth);
+	m_WorkQ.insertItem (pWorkPack);
+} // continueWork
+
+/**
+ * Method drainSelfQueue processes the work packages the thread of execution has
+ * sent to its own instance.
+ */
+void CThreadIt::drainSelfQueue ()
+{
+	size_t theCount = m_theSelfQ.size ();
+	CWorkPackIt* pWorkPack = NULL;
+
+	while ((theCount > 0) && !m_isExitThread)
+	{
+		pWorkPack = m_theSelfQ.front ();
+		m_theSelfQ.pop_front ();
+		processWorkPack (pWorkPack);
+		theCount--;
+	} // while
+} // drainSelfQueue
+
 /**
  * Method SendResponse checks if a response to work is required and then
  * interprets the work done settings to send off the response. This method
@@ -561,6 +1367,8 @@ bool CThreadIt::sendResponse (CWorkPackIt*& pWorkDone, ULONG WorkId, bool isPeri
 {
 	bool isSuccess = false;
 	bool m_isNotifyWithCallback = false;
+	ULONG theInstruction = 0;
+	DataItemPtr ptheDataItem;
 
 	// There is a timing issue in that if you send a response and do a callback you
 	// may get the response before the callback is complete. For this reason the callback is checked
@@ -582,6 +1390,10 @@ bool CThreadIt::sendResponse (CWorkPackIt*& pWorkDone, ULONG WorkId, bool isPeri
 		m_isNotifyWithCallback = pWorkDone->m_isNotifyWithCallback;
 		if (m_isNotifyWithCallback)
 		{
+			// The callback is shared by the helper threads of a CThreadItPool so it is only
+			// held while it is filled in. The observers are given a copy of this response
+			// so that a slow observer does not hold up the other threads.
+			EnterCriticalSection (&m_theCallbackAccess);
 			// Setup for callback first (in case workpack is deleted quickly before this method completes.
 			m_theCallback.setWorkInstruction (pWorkDone->m_theInstruction);
 			m_theCallback.setWorkId (WorkId);
@@ -590,13 +1402,18 @@ bool CThreadIt::sendResponse (CWorkPackIt*& pWorkDone, ULONG WorkId, bool isPeri
 			if (pWorkDone->m_isObjectInCallback)
 			{
 				m_theCallback.setDataItem (pWorkDone->m_ptheDataItem);
+			} // if
+			theInstruction = m_theCallback.getWorkInstruction ();
+			m_theCallback.getDataItem (ptheDataItem);
+			LeaveCriticalSection (&m_theCallbackAccess);
 		} // if
-	} // if
 		// Send a result to the user if requested.
 		if (pWorkDone->m_isSendResult)
 		{
 			// Return a reference to this instance of CThreadIt
 			pWorkDone->m_ptheSource = this;
+			// Trace the reply while the work package still belongs to this instance.
+			CThreadItTrace::trace (CThreadItTrace::TRACE_REPLY_SEND, this, pWorkDone->m_theInstruction, pWorkDone->m_theWorkPackID, this);
 			// Insert it into the queue for the issuer to pick up.
 			if (pWorkDone->m_isUseDefaultQ)
 			{
@@ -623,11 +1440,15 @@ bool CThreadIt::sendResponse (CWorkPackIt*& pWorkDone, ULONG WorkId, bool isPeri
 		} // if (WorkDone.SendResult)
 		if (m_isNotifyWithCallback)
 		{
+			CThreadItCallback theChange (isPeriodic, theInstruction, WorkId);
+
+			theChange.setDataItem (ptheDataItem);
+			CThreadItTrace::trace (CThreadItTrace::TRACE_OBSERVER_NOTIFY, this, theInstruction, WorkId, NULL);
 			// Make sure that we can catch any exception that is thrown. Unfortunately
 			// we are unable to identify the particular cause from the client code.
 			try
 			{
-				m_theCallback.notifyOnChange (m_theCallback);
+				m_theCallback.notifyOnChange (theChange);
 			} // try
 			catch (...)
 			{
@@ -692,7 +1513,8 @@ bool CThreadIt::setPeriodicMethod (PeriodicMethodType Method)
  * Method SetEventMethod associates member functions of a derived class with
  * events. This implies that when a waitable event occurs, the member
  * function associated with the event will be invoked to handle the event.
- * This method must only be called by the associated thread.
+ * This method should be called by the associated thread. If it is called from
+ * another thread the associated thread is woken up to pick up the new event.
  * theEventId is the location of the waitable object in the array
  * of waitable events. There must not be any gaps in this array.
  * EventHandler is the method that will be invoked in response to the event.
@@ -715,6 +1537,10 @@ bool CThreadIt::setEventMethod (ULONG& theEventId, EventMethodType EventHandler,
 		isSuccess = true;
 		// The event information needs to be setup again.
 		m_ResetEventInfo = true;
+		if (GetCurrentThreadId () != getThreadId ())
+		{
+			wakeThread ();
+		} // if
 	} // if
 	// Return the method status.
 	return isSuccess;
@@ -796,6 +1622,18 @@ bool CThreadIt::isAvailableTime (DWORD& Elapsed)
 	return StillTime;
 } // IsAvailableTime
 
+/**
+ * Method isTimeLeft is a cheap check for use in a worker method of whether the
+ * current run of pWorkPack still has time. It takes no lock.
+ */
+bool CThreadIt::isTimeLeft (const CWorkPackIt* pWorkPack) const
+{
+	DWORD theDeadline = pWorkPack->m_theDeadline;
+
+	// The difference is taken as signed so that the tick count can wrap.
+	return ((theDeadline == 0) || ((LONG)(theDeadline - GetTickCount ()) > 0));
+} // isTimeLeft
+
 /**
  * Method StartTiming is called to record the start of work execution timing.
  * TimeAllowed specifies the time allocated for work to be executed.
@@ -831,6 +1669,35 @@ void CThreadIt::stopTiming (DWORD& Elapsed)
 	ReleaseMutex (m_TimeAccess);
 } // StopTiming
 
+/**
+ * Method saveTiming keeps the execution timing of the current run so that a work
+ * package run inline does not take over the timing of the run it is nested in.
+ */
+void CThreadIt::saveTiming (TimingInfo& theTiming)
+{
+	// Secure access to the timing variables.
+	WaitForSingleObject (m_TimeAccess, INFINITE);
+	theTiming.theStart = m_TStart;
+	theTiming.theTimeAllowed = m_TimeAllowed;
+	theTiming.isTiming = m_IsTiming;
+	// Release the mutex.
+	ReleaseMutex (m_TimeAccess);
+} // saveTiming
+
+/**
+ * Method restoreTiming puts back the execution timing kept by saveTiming.
+ */
+void CThreadIt::restoreTiming (const TimingInfo& theTiming)
+{
+	// Secure access to the timing variables.
+	WaitForSingleObject (m_TimeAccess, INFINITE);
+	m_TStart = theTiming.theStart;
+	m_TimeAllowed = theTiming.theTimeAllowed;
+	m_IsTiming = theTiming.isTiming;
+	// Release the mutex.
+	ReleaseMutex (m_TimeAccess);
+} // restoreTiming
+
 /**
  * Method TimeElapsed calculates how much time has so far elapsed since timing
  * was started.
@@ -878,20 +1745,202 @@ void CThreadIt::waitForThreadToStop ()
  */
 void CThreadIt::stopThread ()
 {
-	HANDLE WorkQSem;
-
 	// Indicate that the thread must now terminate execution.
 	m_isExitThread = true;
-	// We also need to get the thread to release from any waiting it is doing.
-	// Get the semaphore that indicates the arrival of work instructions.
-	WorkQSem = m_WorkQ.getQSemaphore ();
 	// Now release the thread from the wait for at least one iteration sufficient
 	// to determine that the thread needs to exit.
-	if (WorkQSem != NULL)
+	SetEvent (m_theWakeEvent);
+} // StopThread
+
+/**
+ * Method wakeThread releases the thread from its wait without providing a work
+ * package. This is used when the event methods are changed from another thread
+ * so that the new wait objects are picked up straight away rather than at the
+ * next time out.
+ */
+void CThreadIt::wakeThread ()
+{
+	SetEvent (m_theWakeEvent);
+} // wakeThread
+
+/**
+ * Method updateLatency adds the latency of a completed work package to the moving
+ * average with a weight of 1/8. The new value is simply published with an interlocked
+ * exchange. If the helper threads of a CThreadItPool complete work at the same time
+ * one of the samples may be lost, which does not matter for an average.
+ */
+LONGLONG CThreadIt::updateLatency (LONGLONG theEnqueueTime)
+{
+	LARGE_INTEGER theNow;
+	LONGLONG theLatency = 0;
+
+	if ((theEnqueueTime != 0) && (m_theCounterFrequency != 0))
 	{
-		ReleaseSemaphore (WorkQSem, 1, NULL);
+		QueryPerformanceCounter (&theNow);
+		theLatency = ((theNow.QuadPart - theEnqueueTime) * 1000000) / m_theCounterFrequency;
+		if (theLatency > LONG_MAX)
+		{
+			theLatency = LONG_MAX;
+		} // if
+		InterlockedExchange (&m_theLatencyEwma, m_theLatencyEwma + (LONG)((theLatency - m_theLatencyEwma) / 8));
 	} // if
-} // StopThread
+	return theLatency;
+} // updateLatency
+
+/**
+ * Method getActiveInfo fills in the work queue attributes of the registry snapshot.
+ * It is called by CActive::getRegistrySnapshot while the instance is registered and
+ * only reads attributes that the thread of execution writes without a lock, apart
+ * from the size of the work done queue. The run shown is the one that has been
+ * running longest, which may be on a helper thread of a CThreadItPool.
+ */
+void CThreadIt::getActiveInfo (CActive* ptheActive, ActiveInfo& theInfo)
+{
+	CThreadIt* ptheThreadIt = static_cast<CThreadIt*> (ptheActive);
+	RunInfo* ptheRun = NULL;
+	LONG theInstruction = -1;
+	DWORD theTime = 0;
+	DWORD theNow = GetTickCount ();
+
+	theInfo.isThreadIt = true;
+	theInfo.theWorkQDepth = ptheThreadIt->m_theWorkQDepth;
+	theInfo.theDoneQDepth = ptheThreadIt->m_DoneQ.size ();
+	theInfo.theProcessedCount = ptheThreadIt->m_theProcessedCount;
+	theInfo.theAllocationCount = ptheThreadIt->m_theAllocationCount;
+	theInfo.theAllocatedBytes = ptheThreadIt->m_theAllocatedBytes;
+	theInfo.thePeakAllocatedBytes = ptheThreadIt->m_thePeakAllocatedBytes;
+	theInfo.theCurrentInstruction = -1;
+	theInfo.theCurrentTime = 0;
+	theInfo.theCurrentTimeAllowed = 0;
+	theInfo.theCurrentThreadId = 0;
+	for (ULONG theSlot = 0; theSlot < THREADIT_RUN_SLOTS; theSlot++)
+	{
+		ptheRun = &ptheThreadIt->m_theRuns[theSlot];
+		theInstruction = ptheRun->theInstruction;
+		if (theInstruction >= 0)
+		{
+			theTime = theNow - ptheRun->theStart;
+			if ((theInfo.theCurrentInstruction < 0) || (theTime > theInfo.theCurrentTime))
+			{
+				theInfo.theCurrentInstruction = theInstruction;
+				theInfo.theCurrentTime = theTime;
+				theInfo.theCurrentTimeAllowed = ptheRun->theTimeAllowed;
+				theInfo.theCurrentThreadId = (UINT)ptheRun->theThreadId;
+			} // if
+		} // if
+	} // for
+} // getActiveInfo
+
+/**
+ * Method getLatencyStats returns the latency histograms of an instruction and
+ * creates them if this is the first time recorded for it. The helper threads of a
+ * CThreadItPool may race to create them, in which case the loser frees its copy.
+ */
+CThreadItLatencyStats* CThreadIt::getLatencyStats (ULONG theInstruction)
+{
+	CThreadItLatencyStats* ptheStats = m_ptheLatencyStats[theInstruction];
+
+	if (ptheStats == NULL)
+	{
+		ptheStats = new CThreadItLatencyStats (theInstruction);
+		if (InterlockedCompareExchangePointer ((void* volatile*)&m_ptheLatencyStats[theInstruction], ptheStats, NULL) != NULL)
+		{
+			delete ptheStats;
+			ptheStats = m_ptheLatencyStats[theInstruction];
+		} // if
+	} // if
+	return ptheStats;
+} // getLatencyStats
+
+/**
+ * Method recordAllocations charges the allocations of a run of a worker method. The
+ * helper threads of a CThreadItPool may race to raise the peak, in which case the
+ * higher one is kept.
+ */
+void CThreadIt::recordAllocations (CThreadItLatencyStats* ptheStats, const ThreadItAllocRun& theRun)
+{
+	LONGLONG thePeak = m_thePeakAllocatedBytes;
+
+	InterlockedExchangeAdd64 (&m_theAllocationCount, theRun.theAllocations);
+	InterlockedExchangeAdd64 (&m_theAllocatedBytes, theRun.theBytes);
+	while ((theRun.thePeakBytes > thePeak) && (InterlockedCompareExchange64 (&m_thePeakAllocatedBytes, theRun.thePeakBytes, thePeak) != thePeak))
+	{
+		thePeak = m_thePeakAllocatedBytes;
+	} // while
+	if (ptheStats != NULL)
+	{
+		ptheStats->m_theAllocations.record (theRun.theAllocations);
+		ptheStats->m_theAllocatedBytes.record (theRun.theBytes);
+		ptheStats->m_thePeakBytes.record (theRun.thePeakBytes);
+	} // if
+} // recordAllocations
+
+/**
+ * Method isShedWork applies the admission control to a work package as it is
+ * dequeued. The queue becomes overloaded once the wait has stayed above the target
+ * for an interval, which means that the shortest wait of the interval is above the
+ * target. While it is overloaded the work packages that waited more than twice the
+ * target are shed so the rest wait between one and two targets. Those still count
+ * towards the shortest wait so the overload is kept until the work slows down.
+ */
+bool CThreadIt::isShedWork (LONGLONG theEnqueueTime)
+{
+	bool isShed = false;
+	LARGE_INTEGER theNow;
+	LONGLONG theSojourn = 0;
+	LONGLONG theTarget = ((LONGLONG)m_theShedTarget * m_theCounterFrequency) / 1000000;
+	LONGLONG theInterval = ((LONGLONG)m_theShedInterval * m_theCounterFrequency) / 1000000;
+
+	if (theTarget <= 0)
+	{
+		m_isOverloaded = false;
+		m_theFirstAboveTime = 0;
+	}
+	else if (theEnqueueTime != 0)
+	{
+		// The state is shared by the helper threads of a CThreadItPool.
+		EnterCriticalSection (&m_theShedAccess);
+		QueryPerformanceCounter (&theNow);
+		theSojourn = theNow.QuadPart - theEnqueueTime;
+		if (m_isOverloaded)
+		{
+			if (theSojourn < m_theMinSojourn)
+			{
+				m_theMinSojourn = theSojourn;
+			} // if
+			if (theNow.QuadPart >= m_theShedIntervalEnd)
+			{
+				// Review the overload once an interval has passed.
+				m_isOverloaded = (m_theMinSojourn > theTarget);
+				m_theMinSojourn = theSojourn;
+				m_theShedIntervalEnd = theNow.QuadPart + theInterval;
+			} // if
+		}
+		else if (theSojourn <= theTarget)
+		{
+			m_theFirstAboveTime = 0;
+		}
+		else if (m_theFirstAboveTime == 0)
+		{
+			m_theFirstAboveTime = theNow.QuadPart + theInterval;
+		}
+		else if (theNow.QuadPart >= m_theFirstAboveTime)
+		{
+			m_ptheLogger->infoStream () << "work queue overloaded - shedding work that has waited more than " << (2 * m_theShedTarget) << "us";
+			m_isOverloaded = true;
+			m_theFirstAboveTime = 0;
+			m_theMinSojourn = theSojourn;
+			m_theShedIntervalEnd = theNow.QuadPart + theInterval;
+		} // if
+		if (m_isOverloaded && (theSojourn > 2 * theTarget))
+		{
+			InterlockedIncrement (&m_theShedCount);
+			isShed = true;
+		} // if
+		LeaveCriticalSection (&m_theShedAccess);
+	} // if
+	return isShed;
+} // isShedWork
 
 /**
  * Method isExitThread is called internally to check if the thread of
@@ -1067,6 +2116,15 @@ std::string CThreadIt::toParameterErrorStr (long theStatus) const
 		case THREADIT_STATUS_PARAM_WORK_PACK_NULL :
 			theStr = "ThreadIt: input work pack is null";
 			break;
+		case WORKDONE_SHED :
+			theStr = "ThreadIt: work shed by admission control";
+			break;
+		case WORKDONE_THROTTLED :
+			theStr = "ThreadIt: work throttled by rate limit";
+			break;
+		case WORKDONE_CONTINUE :
+			theStr = "ThreadIt: work to be continued";
+			break;
 		case THREADIT_STATUS_LAST :
 			theStr = "ThreadIt: status last";
 			break;
@@ -1111,6 +2169,16 @@ int CWorkPackIt::initialise ()
 	m_isObjectInCallback = false;
 //	m_ptheDataItem = DataItemPtr (new CDataItem ());
 	m_ptheDataItem = DataItemPtr ();
+	// There is no completion by default.
+	m_ptheCompletion = NULL;
+	m_theCompletionTag = 0;
+	m_theKey = 0;
+	m_theEnqueueTime = 0;
+	m_theRequeueTime = 0;
+	m_isThrottled = false;
+	m_theDeadline = 0;
+	m_theProgress = 0;
+	ZeroMemory (&m_theTraceContext, sizeof (m_theTraceContext));
   return 0;
 } // CWorkPackIt
 
@@ -1136,6 +2204,18 @@ CWorkPackIt::CWorkPackIt (const CWorkPackIt& theWorkPack)
 	m_isObjectInCallback = theWorkPack.m_isObjectInCallback;
 	m_ptheDataItem = theWorkPack.m_ptheDataItem;
   m_isNotifyWithCallback = theWorkPack.m_isNotifyWithCallback;
+	// The completion belongs to the original work request.
+	m_ptheCompletion = NULL;
+	m_theCompletionTag = 0;
+	m_theKey = theWorkPack.m_theKey;
+	m_theEnqueueTime = theWorkPack.m_theEnqueueTime;
+	m_theRequeueTime = theWorkPack.m_theRequeueTime;
+	// A copy is checked against the rate limits when it is sent.
+	m_isThrottled = false;
+	m_theDeadline = 0;
+	m_theProgress = theWorkPack.m_theProgress;
+	// A copy that is sent on is a hop of the same request.
+	m_theTraceContext = theWorkPack.m_theTraceContext;
 } // constructor CWorkPackIt
 
 /**
@@ -1150,6 +2230,29 @@ CWorkPackIt::~CWorkPackIt ()
 	m_ptheDataItem.reset ();
 } // ~CWorkPackIt
 
+/**
+ * Method operator new allocates an instance on a cache line boundary so that the
+ * attributes at the front of the instance share one cache line.
+ */
+void* CWorkPackIt::operator new (size_t theSize)
+{
+	void* pWorkPack = _aligned_malloc (theSize, THREADIT_CACHE_LINE);
+
+	if (pWorkPack == NULL)
+	{
+		throw std::bad_alloc ();
+	} // if
+	return pWorkPack;
+} // operator new
+
+/**
+ * Method operator delete frees an instance allocated by operator new.
+ */
+void CWorkPackIt::operator delete (void* pWorkPack)
+{
+	_aligned_free (pWorkPack);
+} // operator delete
+
 /**
  * Method operator = assigns the values of a cWorkPacktIt object to
  * another instance.
@@ -1172,6 +2275,10 @@ CWorkPackIt &CWorkPackIt::operator=(CWorkPackIt &theWorkPack)
 	m_isObjectInCallback = theWorkPack.m_isObjectInCallback;
 	m_ptheDataItem = theWorkPack.m_ptheDataItem;
   m_isNotifyWithCallback  = theWorkPack.m_isNotifyWithCallback;
+	m_theKey = theWorkPack.m_theKey;
+	m_theEnqueueTime = theWorkPack.m_theEnqueueTime;
+	m_theRequeueTime = theWorkPack.m_theRequeueTime;
+	m_theTraceContext = theWorkPack.m_theTraceContext;
   return *this;
 } // CWorkPackIt
 
@@ -54,6 +54,8 @@
 
 // Includes
 #include <memory>
+#include <deque>
+#include <vector>
 #include <log4cpp/Category.hh>
 #include "Active.h"
 #include "ProtectedQueue.h"
@@ -61,11 +63,30 @@
 #include "TimeIt.h"
 #include "threaditcallback.h"
 #include "observer.h"
+#include "threaditcompletion.h"
+#include "threaditcontext.h"
+#include "threaditflight.h"
+#include "threaditalloc.h"
 #include "threadit.h"
 
+/** THREADIT_CACHE_LINE is the size of the cache line that work packages are aligned
+ * to and that the attributes of a CThreadIt are padded to. */
+#define THREADIT_CACHE_LINE 64
+
+/** THREADIT_INLINE_DEPTH is the default nesting limit of work packages a CThreadIt
+ * processes inline when it sends them to itself. */
+#define THREADIT_INLINE_DEPTH 4
+
+/** THREADIT_RUN_SLOTS is the number of threads of an instance whose worker method
+ * runs are shown in the registry snapshot at the same time. */
+#define THREADIT_RUN_SLOTS 16
+
 // ThreadIt: Forward Declarations
 class	 CWorkPackIt;
 class	 CThreadIt;
+class	 CThreadItResultCache;
+class	 CThreadItRateLimiter;
+class	 CThreadItLatencyStats;
 
 // ThreadIt: Type Definitions
 /** RequestId is a value used to match up request and response pairs. */
@@ -90,6 +111,13 @@ typedef std::shared_ptr <CThreadIt> ThreadItPtr;
 /** ThreadItWeakPtr is a weak pointer to a CThreadIt instance. */
 typedef std::weak_ptr <CThreadIt> ThreadItWeakPtr;
 
+/** ThreadItResultCachePtr is a shared pointer to a result cache that may be shared
+ * by several CThreadIt instances. */
+typedef std::shared_ptr <CThreadItResultCache> ThreadItResultCachePtr;
+
+/** ThreadItRateLimiterPtr is a shared pointer to a rate limiter. */
+typedef std::shared_ptr <CThreadItRateLimiter> ThreadItRateLimiterPtr;
+
 /** WorkerMethodType is a pointer to a member function of the CThreadIt class
  * that accepts a CWorkPackIt parameter and returns a CWorkPackIt parameter.
  * The member function returns a bool value.
@@ -134,6 +162,9 @@ class	 CWorkPackIt
 {
 	// Attributes
 public:
+	// The attributes read or written by the thread for every work package are kept
+	// together at the front so that they fit in the first cache line of the instance.
+	// The instance is allocated on a cache line boundary by operator new.
 	/** m_Instruction is the instruction of work to perform. The value starts
 	 * from one onwards. A value of zero implies no work to be performed.
 	 * The instruction is assigned to a method that performs work that
@@ -146,12 +177,40 @@ public:
 	 * placed in the queue of work to be done. The originator of the
 	 * WorkPackIt can use this number to track the progress. */
 	ULONG m_theWorkPackID;
-	/** m_isNotifyWithCallback is set to true if notification of work completion
-	 * is required. If m_NotifyWindow is true, then the m_pWnd value and the
-	 * m_WM_USER value will be used to send a PostMessage. The PostMessage
-	 * will have an wParam equal to the m_Instruction and a lParam equal to
-	 * the m_WorkPackID value. */
-	bool	m_isNotifyWithCallback;
+	/** m_Status returns the operation status of the work performed.  */
+	ULONG m_theStatus;
+	/** m_TimeAllowed indicates the time allowed to perform the work package.
+	 * If the work package cannot be done in this time period, then the
+	 * work method must stop execution as soon as it recognises that the
+	 * time allowed period expired and return the status WORKDONE_TIME_OUT
+	 * as part of the CWorkPackIt response. A time value of zero implies
+	 * no time restriction on the processing. The value is in milliseconds and
+	 * the value selected should be based on a resolution of approx 10
+	 * milliseconds. */
+	ULONG m_theTimeAllowed;
+	/** m_TimeElapsed is the time take for the work to complete. It is monitored
+	 * automatically. The value returned is in milliseconds. */
+	ULONG m_theTimeElapsed;
+	/** m_theKey identifies the entity (session, device and so on) that the work package
+	 * belongs to. It is zero by default. CThreadItStrandGroup runs work packages with
+	 * the same key one at a time in the order they were submitted. */
+	ULONG m_theKey;
+	/** m_theEnqueueTime is the performance counter value when the work package was
+	 * placed in the work queue by startWork. The latency of the request is measured
+	 * from it, including the runs of a work package that continued. */
+	LONGLONG m_theEnqueueTime;
+	/** m_theRequeueTime is the performance counter value when the work package was
+	 * last placed in the work queue, either by startWork or after it returned the
+	 * status WORKDONE_CONTINUE. The queue wait is measured from it. */
+	LONGLONG m_theRequeueTime;
+	/** m_pWorkDoneQ receives work done packages for return to the initiator
+	 * of the work request if the value of this member is not NULL and
+	 * m_UseDefaultQ is false. */
+	CProtectedQueue <CWorkPackIt>* m_ptheWorkDoneQ;
+	/** m_ptheCompletion is called on the worker thread once this work package has been
+	 * processed and before the response is sent. It is NULL by default. The completion
+	 * belongs to the work request and is not copied to other instances. */
+	CThreadItCompletion* m_ptheCompletion;
 	/** m_SendResult is set to true if a CWorkPackIt object is to be returned
 	 * in the work done queue after the work is completed. A thread waiting
 	 * on this queue will be signalled when the CWorkPackIt object is placed
@@ -160,64 +219,69 @@ public:
 	/** m_UseDefaultQ is set to true if the in-built work done queue is used
 	 *	to return the Work Done results. This value is set to TRUE by default. */
 	bool m_isUseDefaultQ;
-	/** m_pWorkDoneQ receives work done packages for return to the initiator
-	 * of the work request if the value of this member is not NULL and
-	 * m_UseDefaultQ is false. */
-	CProtectedQueue <CWorkPackIt>* m_ptheWorkDoneQ;
+	/** m_isNotifyWithCallback is set to true if notification of work completion
+	 * is required. If m_NotifyWindow is true, then the m_pWnd value and the
+	 * m_WM_USER value will be used to send a PostMessage. The PostMessage
+	 * will have an wParam equal to the m_Instruction and a lParam equal to
+	 * the m_WorkPackID value. */
+	bool	m_isNotifyWithCallback;
+	/** m_isObjectInCallback indicates if a shared_ptr reference to m_ptheObject is
+	 * returned as part of the callback. If this value is true then a reference to
+	 * m_ptheObject can be obtained from within the callback. The default is false. */
+	bool m_isObjectInCallback;
+	/** m_isThrottled is set by startWork if the work package is over a rate limit (see
+	 * CThreadItRateLimiter). The thread then returns it with the status
+	 * WORKDONE_THROTTLED without processing it. It is not copied. */
+	bool m_isThrottled;
 	// 2009-05-03 - Addition of shared_ptr for shared queue.
-    /** m_UseSharedQ is set to true if the in-built work done queue is used
-     *  to return the output of work methods. This value is set to false by default. */
-    bool m_isUseSharedQ;
-    /** m_pSharedQ receives work items for return to the initiator
-     * of the work request if the value of this member is not NULL and
-     * m_isUseSharedQ is true. The queue can be used to transfer any type of element
-		 * or item */
-		std::shared_ptr<ItemQ> m_pSharedQ;
-		// 2009-05-03 - End of addition of shared_ptr for shared queue.
-		// 2010-05-31 - Addition of the real shared queue.
-		/** m_isUseSharedPtrQ is set to true to use the m_ptheSharedPtrQ. */
-    bool m_isUseSharedPtrQ;
-		/** m_ptheSharedPtrQ is a queue of DataItemPtr that can be used to
-		 * transfer around DataItem types. These can then type cast to
-		 * subclass types that inherit from DataItem. */
-		std::shared_ptr<DataItemPtrQ> m_ptheSharedPtrQ;
-		// 2010-05-31 - End of the addition of the real shared queue.
-    /** m_pObject is a general pointer for passing information to the
-     * method that will perform the work. It is user defined. */
-    void* m_ptheObject;
-		/** m_isObjectInCallback indicates if a shared_ptr reference to m_ptheObject is
-		 * returned as part of the callback. If this value is true then a reference to
-		 * m_ptheObject can be obtained from within the callback. The default is false. */
-		bool m_isObjectInCallback;
-		/** m_ptheDataItem holds a shared pointer based data item. */
-		DataItemPtr m_ptheDataItem;
-		/** m_ptheSource is a reference to the instance from which this CWorkPackIt has
-		 * been sent. It is null for incoming CWorkPackIt instances. Note that the reference
-	   * may not be valid if the originating instance has been destroyed since the CWorkPackIt
-	   * has been sent. If this is a worry use the m_sptheSource version below. */
-		CThreadIt* m_ptheSource;
-		/** m_sptheSource is the weak pointer version reference to the instance from which this CWorkPackIt has
-		 * been sent. Once there you can obtain a shared pointer from m_wptheSource and use that defensively. If you hold on to this
-		 * shared reference then you can prolong the life of other CThreadIt more than you should or could be intended.
-		 */
-		std::weak_ptr<CThreadIt> m_wptheSource;
-		/** m_theReplyInstructionId is set if m_ptheSource is set and specifies the return work
-		 * instruction the receiver of this work packit can use to reply to the work request. */
-		UINT m_theReplyInstructionId;
-    /** m_TimeAllowed indicates the time allowed to perform the work package.
-     * If the work package cannot be done in this time period, then the
-     * work method must stop execution as soon as it recognises that the
-     * time allowed period expired and return the status WORKDONE_TIME_OUT
-     * as part of the CWorkPackIt response. A time value of zero implies
-     * no time restriction on the processing. The value is in milliseconds and
-     * the value selected should be based on a resolution of approx 10
-     * milliseconds. */
-    ULONG m_theTimeAllowed;
-    /** m_TimeElapsed is the time take for the work to complete. It is monitored
-     * automatically. The value returned is in milliseconds. */
-    ULONG m_theTimeElapsed;
-    /** m_Status returns the operation status of the work performed.  */
-    ULONG m_theStatus;
+	/** m_UseSharedQ is set to true if the in-built work done queue is used
+	 *  to return the output of work methods. This value is set to false by default. */
+	bool m_isUseSharedQ;
+	// 2010-05-31 - Addition of the real shared queue.
+	/** m_isUseSharedPtrQ is set to true to use the m_ptheSharedPtrQ. */
+	bool m_isUseSharedPtrQ;
+	// The attributes below are only used by some work packages.
+	/** m_theCompletionTag is passed to m_ptheCompletion to identify the work package. */
+	ULONG m_theCompletionTag;
+	/** m_theReplyInstructionId is set if m_ptheSource is set and specifies the return work
+	 * instruction the receiver of this work packit can use to reply to the work request. */
+	UINT m_theReplyInstructionId;
+	/** m_theDeadline is the tick count at which the time for the current run of the
+	 * worker method ends. It is set by the thread before each run and is zero if there
+	 * is no limit. See CThreadIt::isTimeLeft. */
+	DWORD m_theDeadline;
+	/** m_theProgress is for the worker method to record how far it has got when it
+	 * returns the status WORKDONE_CONTINUE. It is zero by default. */
+	ULONG m_theProgress;
+	/** m_theTraceContext identifies the request the work package belongs to. It is set
+	 * by startWork (see ThreadItTraceContext) and is empty until then. */
+	ThreadItTraceContext m_theTraceContext;
+	/** m_pObject is a general pointer for passing information to the
+	 * method that will perform the work. It is user defined. */
+	void* m_ptheObject;
+	/** m_ptheDataItem holds a shared pointer based data item. */
+	DataItemPtr m_ptheDataItem;
+	/** m_ptheSource is a reference to the instance from which this CWorkPackIt has
+	 * been sent. It is null for incoming CWorkPackIt instances. Note that the reference
+	 * may not be valid if the originating instance has been destroyed since the CWorkPackIt
+	 * has been sent. If this is a worry use the m_sptheSource version below. */
+	CThreadIt* m_ptheSource;
+	/** m_sptheSource is the weak pointer version reference to the instance from which this CWorkPackIt has
+	 * been sent. Once there you can obtain a shared pointer from m_wptheSource and use that defensively. If you hold on to this
+	 * shared reference then you can prolong the life of other CThreadIt more than you should or could be intended.
+	 */
+	std::weak_ptr<CThreadIt> m_wptheSource;
+	/** m_pSharedQ receives work items for return to the initiator
+	 * of the work request if the value of this member is not NULL and
+	 * m_isUseSharedQ is true. The queue can be used to transfer any type of element
+	 * or item */
+	std::shared_ptr<ItemQ> m_pSharedQ;
+	// 2009-05-03 - End of addition of shared_ptr for shared queue.
+	/** m_ptheSharedPtrQ is a queue of DataItemPtr that can be used to
+	 * transfer around DataItem types. These can then type cast to
+	 * subclass types that inherit from DataItem. */
+	std::shared_ptr<DataItemPtrQ> m_ptheSharedPtrQ;
+	// 2010-05-31 - End of the addition of the real shared queue.
 
 	// Services
 public:
@@ -245,6 +309,17 @@ public:
 	 */
 	virtual ~CWorkPackIt ();
 
+	/**
+	 * Method operator new allocates an instance on a cache line boundary so that the
+	 * attributes at the front of the instance share one cache line.
+	 */
+	static void* operator new (size_t theSize);
+
+	/**
+	 * Method operator delete frees an instance allocated by operator new.
+	 */
+	static void operator delete (void* pWorkPack);
+
 	/**
 	 * Method operator = assigns the values of a cWorkPacktIt object to
 	 * another instance.
@@ -307,6 +382,18 @@ private:
 	/** MODULE_NAME Name allocated to this module. This is used for logging and component
 	  * identification purpose */
 	static const std::string MODULE_NAME;
+	/** m_theContextTlsIndex is the thread local slot that holds the trace context of the
+	 * work package being processed by each thread. */
+	static DWORD m_theContextTlsIndex;
+	/** m_theNextTraceId is the last trace ID given out. */
+	static volatile LONG m_theNextTraceId;
+	/** m_theNextSpanId is the last span ID given out. */
+	static volatile LONG m_theNextSpanId;
+	/** QueryThreadCycleTimeType is the type of QueryThreadCycleTime, which is only found
+	 * from Windows Vista on and so is looked up when the library is loaded. */
+	typedef BOOL (WINAPI *QueryThreadCycleTimeType) (HANDLE hThread, PULONG64 CycleTime);
+	/** m_pQueryThreadCycleTime is QueryThreadCycleTime or NULL if there is none. */
+	static QueryThreadCycleTimeType m_pQueryThreadCycleTime;
 
 public:
 	/** COPY_PARAMS is used as input to the checkParams methods used to assist applications
@@ -316,6 +403,20 @@ public:
 	 */
 	static const bool COPY_PARAMS = true;
 
+	/** SelfSendMode selects what startWork does with a work package sent by the thread
+	 * of execution to its own instance. */
+	enum SelfSendMode
+	{
+		/** The work package is placed in the work queue as for any other sender. */
+		SELF_SEND_QUEUE = 0,
+		/** The work package is processed within startWork while the nesting of such
+		 * calls is below the limit. Beyond the limit it is deferred. */
+		SELF_SEND_INLINE,
+		/** The work package is kept in a list of the thread of execution that is
+		 * processed before the work queue is next checked. */
+		SELF_SEND_DEFERRED
+	}; // enum SelfSendMode
+
 	// ThreadIt: WorkDoneIt Status Constants
 	enum StatusIds
 	{
@@ -340,9 +441,17 @@ public:
 		/** An event has occurred for which there is no handler.	*/
 		WORKDONE_NO_EVENT_METHOD = 157,
 		/** A general successful status report. */
-		THREADIT_STATUS_OK,
-		THREADIT_STATUS_PARAM_OBJECT_NULL,
-	  THREADIT_STATUS_PARAM_WORK_PACK_NULL,
+		THREADIT_STATUS_OK = 158,
+		THREADIT_STATUS_PARAM_OBJECT_NULL = 159,
+	  THREADIT_STATUS_PARAM_WORK_PACK_NULL = 160,
+		// The values are explicit so that the codes stay the same when more are added.
+		/** The work package was shed by admission control without being processed. */
+		WORKDONE_SHED = 161,
+		/** The work package was over a rate limit and was not processed. */
+		WORKDONE_THROTTLED = 162,
+		/** The worker method has run out of time and is to be called again with the same
+		 * work package once the work already waiting has been processed. */
+		WORKDONE_CONTINUE = 163,
 		THREADIT_STATUS_LAST // Last kid off the block - used for looping.
 	}; // enum StatusIds
 
@@ -359,24 +468,43 @@ protected:
 		EventMethodType theEventHandler;
 	} EventInfo;
 
+	/** RunInfo is the worker method run in progress on a thread of the instance. A slot
+	 * is claimed by a thread for its outermost run and a nested run saves and restores
+	 * the values of the run it is nested in. */
+	typedef struct RunInfoTag
+	{
+		/** theThreadId is the thread that holds the slot or zero if it is free. */
+		volatile LONG theThreadId;
+		/** theInstruction is the instruction of the worker method running or -1. */
+		volatile LONG theInstruction;
+		/** theStart is the tick count at which the worker method was started. */
+		volatile DWORD theStart;
+		/** theTimeAllowed is the time in milliseconds given to the run or zero. */
+		volatile DWORD theTimeAllowed;
+	} RunInfo;
+
+	/** TimingInfo is the execution timing of the run a work package sent inline is
+	 * nested in (see startTiming). */
+	typedef struct TimingInfoTag
+	{
+		/** theStart is m_TStart of the outer run. */
+		DWORD theStart;
+		/** theTimeAllowed is m_TimeAllowed of the outer run. */
+		DWORD theTimeAllowed;
+		/** isTiming is m_IsTiming of the outer run. */
+		bool isTiming;
+	} TimingInfo;
+
 	// attributes
+	// The attributes are kept in groups by the threads that write them. Each group is
+	// followed by a cache line of padding so that the clients sending work, the thread
+	// of execution and the clients collecting results do not write to the same cache
+	// lines. The first group is set up when the instance is built and is then mostly read.
 protected:
 	/** m_Access is a critical section for the global data of the instance. */
 	HANDLE m_Access;
 	/** m_TimeAccess is a critical section for the global timing data of the instance.*/
 	HANDLE m_TimeAccess;
-	/** m_WorkPackID is a running number used to uniquely identify work
-	 * packages in the system. It should just reset itself when incremented
-	 * beyond its limit. This allows the system to handle work packages of
-	 * the same work instruction. */
-	ULONG m_WorkPackID;
-	/** m_isExitThread is set to true when the thread of execution must exit. */
-	volatile bool m_isExitThread;
-	/** m_WorkQueue represents the queue that receives work packages to execute
-	 *	that is then processed by the thread. */
-	CProtectedQueue <CWorkPackIt> m_WorkQ;
-	/** m_DoneQ receives work done packages for return to the initiators of work. */
-	CProtectedQueue <CWorkPackIt> m_DoneQ;
 	/** m_WorkerMethod is the array of member functions of the WorkerMethodType
 	 * signature that are called to process work packages. These member
 	 * functions are declared in a derived class. */
@@ -386,15 +514,116 @@ protected:
 	PeriodicMethodType m_PeriodicMethod;
 	/** m_EventMethod is the array of member functions and associated waitable objects. */
 	EventInfo m_EventMethod[MAX_EVENT_METHODS];
-	/** m_theEventMethodCount is the running count of the number of event method handlers
-	 * installed. */
-	volatile UINT m_theEventMethodCount;
+	/** m_theCounterFrequency is the frequency of the performance counter. */
+	LONGLONG m_theCounterFrequency;
+	/** m_theShedTarget is the queue wait in microseconds above which the work queue is
+	 * considered to be standing. Zero turns admission control off. */
+	volatile LONG m_theShedTarget;
+	/** m_theShedInterval is the time in microseconds the queue wait must stay above
+	 * the target before work is shed. */
+	volatile LONG m_theShedInterval;
+	/** m_theTimeSlice is the time in milliseconds given to each run of a worker method.
+	 * Zero gives each run the time allowed of its work package. */
+	volatile DWORD m_theTimeSlice;
+	/** m_theSelfSendMode is what startWork does with work sent by the thread of
+	 * execution to its own instance. */
+	volatile SelfSendMode m_theSelfSendMode;
+	/** m_theMaxInlineDepth is the most inline calls of startWork that may be nested. */
+	volatile UINT m_theMaxInlineDepth;
+	/** m_isLatencyStats is true while the latency histograms are recorded. */
+	volatile bool m_isLatencyStats;
+	/** m_ptheLatencyStats are the latency histograms of each instruction. They are
+	 * created by the thread that first records a time for the instruction. */
+	CThreadItLatencyStats* volatile m_ptheLatencyStats[MAX_WORK_METHODS];
+	/** m_isCycleStats is true while the CPU cycles of the worker methods are counted. */
+	volatile bool m_isCycleStats;
+	/** m_ptheFlightSlot holds the recent work packages dispatched (see
+	 * CThreadItFlightRecorder). It is NULL if every slot was in use. */
+	CThreadItFlightRecorder::FlightSlot* m_ptheFlightSlot;
+	/** m_ptheResultCache caches the results of idempotent instructions. It is empty if
+	 * there is no cache. */
+	ThreadItResultCachePtr m_ptheResultCache;
+	/** m_ptheRateLimiter limits the rate of work from each sender and of each
+	 * instruction. It is empty if there are no limits. */
+	ThreadItRateLimiterPtr m_ptheRateLimiter;
+	/** m_ptheLogger is the logger used to log information and errors for each instance of
+	 * this class */
+	log4cpp::Category* m_ptheLogger;
+	char m_thePad0[THREADIT_CACHE_LINE];
+	// Written by the clients that send work.
+	/** m_WorkPackID is a running number used to uniquely identify work
+	 * packages in the system. It should just reset itself when incremented
+	 * beyond its limit. This allows the system to handle work packages of
+	 * the same work instruction. */
+	ULONG m_WorkPackID;
+	/** m_theWorkQDepth is the number of work packages in the work queue. It is kept
+	 * with interlocked operations so that it can be read without a lock. */
+	volatile LONG m_theWorkQDepth;
+	/** m_WorkQueue represents the queue that receives work packages to execute
+	 *	that is then processed by the thread. */
+	CProtectedQueue <CWorkPackIt> m_WorkQ;
+	char m_thePad1[THREADIT_CACHE_LINE];
+	// Written by the thread of execution.
+	/** m_isExitThread is set to true when the thread of execution must exit. */
+	volatile bool m_isExitThread;
 	/** m_ResetEventInfo is set to true when the event associations has been
 	 * modified. This implies that it must be setup on the next wait
 	 * function invocation. */
 	volatile bool m_ResetEventInfo;
-	/** m_theCallback is the instance used for managing callbacks to interested clients */
-	CThreadItCallback m_theCallback;
+	/** m_isOverloaded is true while work packages are being shed. */
+	bool m_isOverloaded;
+	/** m_theEventMethodCount is the running count of the number of event method handlers
+	 * installed. */
+	volatile UINT m_theEventMethodCount;
+	/** m_theWakeEvent releases the thread of execution from its wait without a work
+	 * package so that it can pick up changes to the event methods or stop. It is kept
+	 * apart from the work queue semaphore so that the helper threads of a CThreadItPool
+	 * only ever take signals that come with a work package. */
+	HANDLE m_theWakeEvent;
+	/** m_theLatencyEwma is the exponentially weighted moving average of the time in
+	 * microseconds from startWork to the completion of a work package. */
+	volatile LONG m_theLatencyEwma;
+	/** m_theShedCount is the number of work packages shed. */
+	volatile LONG m_theShedCount;
+	/** m_theContinueCount is the number of times work packages have been queued again
+	 * with the status WORKDONE_CONTINUE. */
+	volatile LONG m_theContinueCount;
+	/** m_theInlineDepth is the number of inline calls of startWork in progress. It is
+	 * only used by the thread of execution. */
+	UINT m_theInlineDepth;
+	/** m_theInlineCount is the number of work packages processed within startWork. */
+	volatile LONG m_theInlineCount;
+	/** m_theDeferredCount is the number of work packages placed in m_theSelfQ. */
+	volatile LONG m_theDeferredCount;
+	/** m_theProcessedCount is the number of work packages processed. */
+	volatile LONG m_theProcessedCount;
+	/** m_theCycleCount is the number of CPU cycles used by the worker methods while the
+	 * cycle stats are on. */
+	volatile LONGLONG m_theCycleCount;
+	/** m_theAllocationCount is the number of blocks allocated by the worker methods. */
+	volatile LONGLONG m_theAllocationCount;
+	/** m_theAllocatedBytes is the number of bytes allocated by the worker methods. */
+	volatile LONGLONG m_theAllocatedBytes;
+	/** m_thePeakAllocatedBytes is the highest peak of a run of a worker method. */
+	volatile LONGLONG m_thePeakAllocatedBytes;
+	/** m_theRuns are the worker method runs in progress, one for each thread of the
+	 * instance that is in a worker method. The helper threads of a CThreadItPool each
+	 * take a slot and a run is not shown if they are all taken. */
+	RunInfo m_theRuns[THREADIT_RUN_SLOTS];
+	/** m_theSelfQ holds the work packages the thread of execution has sent to its own
+	 * instance. It is only used by the thread of execution so it needs no lock. */
+	std::deque<CWorkPackIt*> m_theSelfQ;
+	/** m_theFirstAboveTime is the performance counter at which the queue becomes
+	 * overloaded if the wait stays above the target. It is zero if the wait is below. */
+	LONGLONG m_theFirstAboveTime;
+	/** m_theShedIntervalEnd is the performance counter at which the overload is reviewed. */
+	LONGLONG m_theShedIntervalEnd;
+	/** m_theMinSojourn is the shortest queue wait in the current interval in
+	 * performance counter ticks. */
+	LONGLONG m_theMinSojourn;
+	/** m_theShedAccess protects the admission control state from the helper threads
+	 * of a CThreadItPool. */
+	CRITICAL_SECTION m_theShedAccess;
 	// Exectution Timing variables.
 	/** m_TStart measures the start of a timing operation. */
 	DWORD m_TStart;
@@ -410,9 +639,16 @@ protected:
 	DWORD m_TimeOut;
 	/** m_Period is the timer for determining when the periodic method should execute.*/
 	CTimeIt m_Period;
-	/** m_ptheLogger is the logger used to log information and errors for each instance of
-	 * this class */
-	log4cpp::Category* m_ptheLogger;
+	/** m_theCallback is the instance used for managing callbacks to interested clients */
+	CThreadItCallback m_theCallback;
+	/** m_theCallbackAccess holds m_theCallback while it is filled in for a response.
+	 * The observers are notified with a copy after it is released. */
+	CRITICAL_SECTION m_theCallbackAccess;
+	char m_thePad2[THREADIT_CACHE_LINE];
+	// Written by the thread of execution and the clients that collect results.
+	/** m_DoneQ receives work done packages for return to the initiators of work. */
+	CProtectedQueue <CWorkPackIt> m_DoneQ;
+	char m_thePad3[THREADIT_CACHE_LINE];
 
 	// Methods
 public:
@@ -494,7 +730,13 @@ public:
 	 * WorkPackID is a unique reference to the work package. The caller can use
 	 * this value to track this work.
 	 * Method StartWork returns true if the work package is placed in the work
-	 * queue successfully.
+	 * queue successfully. A work package over a rate limit (see setRateLimiter)
+	 * that expects a response (a result, a callback or a completion) is still
+	 * queued, so true is returned, and it is returned unprocessed with the status
+	 * WORKDONE_THROTTLED. A throttled work package that expects no response is
+	 * freed, its object through releaseObject, WorkPack is set to NULL and false is
+	 * returned. When the thread of execution sends work to its own instance the
+	 * work package is processed as set by setSelfSendMode.
 	 */
 	bool startWork (CWorkPackIt*& pWorkPack, ULONG& WorkPackID);
 
@@ -528,6 +770,102 @@ public:
 	 */
 	void getWorkQ (CProtectedQueue <CWorkPackIt>* pWorkQ);
 
+	/**
+	 * Method getWorkQDepth returns the number of work packages waiting in the work
+	 * queue. It does not take a lock and can be called from any thread.
+	 */
+	LONG getWorkQDepth () const;
+
+	/**
+	 * Method getLatencyEwma returns the moving average of the time in microseconds from
+	 * startWork to the completion of a work package. Each new work package has a
+	 * weight of 1/8. It does not take a lock and can be called from any thread.
+	 */
+	LONG getLatencyEwma () const;
+
+	/**
+	 * Method setResultCache sets the cache looked up before the worker method of an
+	 * enabled instruction is called (see CThreadItResultCache). The cache may be
+	 * shared by several instances. It must be set before work is sent.
+	 * @param[in] ptheResultCache is the cache. An empty pointer removes the cache.
+	 */
+	void setResultCache (const ThreadItResultCachePtr& ptheResultCache);
+
+	/**
+	 * Method getResultCache returns the result cache or an empty pointer.
+	 */
+	ThreadItResultCachePtr getResultCache () const;
+
+	/**
+	 * Method setAdmissionControl turns on admission control based on the time work
+	 * packages wait in the work queue. When no work package has waited less than
+	 * theTarget for theInterval, the queue is overloaded and work packages that have
+	 * waited more than twice theTarget are shed as they are dequeued. They are not
+	 * processed and are returned with the status WORKDONE_SHED. The overload ends
+	 * once a work package of an interval waits less than theTarget. This keeps a
+	 * standing queue from building up when the work arrives faster than it is done.
+	 * It can be called from any thread.
+	 * @param[in] theTarget is the acceptable queue wait in microseconds. Zero turns
+	 * admission control off, which is the default.
+	 * @param[in] theInterval is the time in microseconds the wait must stay above the
+	 * target. It should be about the time taken by a burst of work.
+	 */
+	void setAdmissionControl (ULONG theTarget, ULONG theInterval = 100000);
+
+	/**
+	 * Method setRateLimiter sets the rate limiter checked by startWork (see
+	 * CThreadItRateLimiter). It must be set before work is sent. Under the policy
+	 * LIMIT_DELAY startWork sleeps on the thread of the sender until the work
+	 * package is due, which holds up a sender that is itself a CThreadIt.
+	 * @param[in] ptheRateLimiter is the limiter. An empty pointer removes the limits.
+	 */
+	void setRateLimiter (const ThreadItRateLimiterPtr& ptheRateLimiter);
+
+	/**
+	 * Method getRateLimiter returns the rate limiter or an empty pointer.
+	 */
+	ThreadItRateLimiterPtr getRateLimiter () const;
+
+	/**
+	 * Method getShedCount returns the number of work packages shed by admission control.
+	 */
+	LONG getShedCount () const;
+
+	/**
+	 * Method getProcessedCount returns the number of work packages processed.
+	 */
+	LONG getProcessedCount () const;
+
+	/**
+	 * Method setSelfSendMode sets what startWork does with work packages that the
+	 * thread of execution sends to its own instance, such as the messages of a state
+	 * machine to itself. Both SELF_SEND_INLINE and SELF_SEND_DEFERRED skip the work
+	 * queue, its lock and its semaphore, and run the work package ahead of the work
+	 * that is already queued. Work sent from any other thread, including the helper
+	 * threads of a CThreadItPool, is always queued.
+	 * @param[in] theMode is the mode. The default is SELF_SEND_QUEUE.
+	 * @param[in] theMaxDepth is the most inline calls that may be nested within each
+	 * other before work packages are deferred instead.
+	 */
+	void setSelfSendMode (SelfSendMode theMode, UINT theMaxDepth = THREADIT_INLINE_DEPTH);
+
+	/**
+	 * Method getSelfSendMode returns what startWork does with work packages that the
+	 * thread of execution sends to its own instance.
+	 */
+	SelfSendMode getSelfSendMode () const;
+
+	/**
+	 * Method getInlineCount returns the number of work packages processed within startWork.
+	 */
+	LONG getInlineCount () const;
+
+	/**
+	 * Method getDeferredCount returns the number of work packages kept in the list of
+	 * the thread of execution.
+	 */
+	LONG getDeferredCount () const;
+
 	/**
 	 * Method SetWorkerMethod associates member functions of a derived class with
 	 * work instructions. This implies that when a work instruction is received
@@ -559,7 +897,8 @@ public:
 	 * Method SetEventMethod associates member functions of a derived class with
 	 * events. This implies that when a waitable event occurs, the member
 	 * function associated with the event will be invoked to handle the event.
-	 * This method must only be called by the associated thread.
+	 * This method should be called by the associated thread. If it is called from
+	 * another thread the associated thread is woken up to pick up the new event.
 	 * theEventId is the location of the waitable object in the array
 	 * of waitable events. There must not be any gaps in this array.
 	 * EventHandler is the method that will be invoked in response to the event.
@@ -594,6 +933,133 @@ public:
 	 */
 	bool isAvailableTime (DWORD& Elapsed);
 
+	/**
+	 * Method isTimeLeft is a cheap check for use in a worker method of whether the
+	 * current run of pWorkPack still has time. It reads the deadline of the work package
+	 * and the tick count and takes no lock, so it can be called often and from the
+	 * helper threads of a CThreadItPool. The time of a run is the time slice of the
+	 * instance or else the time allowed of the work package, whichever is smaller.
+	 * A worker method that runs out of time can save its progress in the work package,
+	 * set the status WORKDONE_CONTINUE and return the work package as the result. It is
+	 * then queued behind the work that is waiting and the worker method is called again
+	 * with it later. With a result cache the identical work packages keep waiting
+	 * while the work package continues and are answered with its final result. They
+	 * are only answered with WORKDONE_NO_RESULT if the continued work package is shed.
+	 * @param[in] pWorkPack is the work package being processed.
+	 * \return true if there is no limit or the deadline has not passed.
+	 */
+	bool isTimeLeft (const CWorkPackIt* pWorkPack) const;
+
+	/**
+	 * Method setTimeSlice sets the time in milliseconds given to each run of a worker
+	 * method. See isTimeLeft. Zero gives each run the time allowed of its work package.
+	 */
+	void setTimeSlice (DWORD theTimeSlice);
+
+	/**
+	 * Method getTimeSlice returns the time in milliseconds given to each run of a worker method.
+	 */
+	DWORD getTimeSlice () const;
+
+	/**
+	 * Method getContinueCount returns the number of times work packages have been
+	 * queued again with the status WORKDONE_CONTINUE.
+	 */
+	LONG getContinueCount () const;
+
+	/**
+	 * Method setLatencyStats turns the latency histograms on or off. They are on by
+	 * default and cost three reads of the performance counter and a few interlocked
+	 * operations for each work package.
+	 * @param[in] isEnabled is true to record the histograms.
+	 */
+	void setLatencyStats (bool isEnabled);
+
+	/**
+	 * Method isLatencyStats returns true if the latency histograms are recorded.
+	 */
+	bool isLatencyStats () const;
+
+	/**
+	 * Method setCycleStats turns the counting of the CPU cycles used by the worker methods
+	 * on or off. It is off by default as it costs two calls of QueryThreadCycleTime for
+	 * each run of a worker method. The cycles of each run are recorded in the m_theCycles
+	 * histogram of its instruction while the latency histograms are on, and added to the
+	 * total of the instance (see getCycleCount). Cycles divided by the service time give
+	 * the share of the time in the worker method that was spent running rather than
+	 * waiting. It has no effect where isCycleStatsSupported returns false.
+	 * @param[in] isEnabled is true to count the cycles.
+	 */
+	void setCycleStats (bool isEnabled);
+
+	/**
+	 * Method isCycleStats returns true if the CPU cycles of the worker methods are counted.
+	 */
+	bool isCycleStats () const;
+
+	/**
+	 * Method getCycleCount returns the number of CPU cycles used by the worker methods
+	 * of the instance while the cycle stats were on.
+	 */
+	LONGLONG getCycleCount () const;
+
+	/**
+	 * Method isCycleStatsSupported returns true if the system can count the CPU cycles of
+	 * a thread, which is from Windows Vista on.
+	 */
+	static bool isCycleStatsSupported ();
+
+	/**
+	 * Method getAllocationCount returns the number of heap blocks allocated with operator
+	 * new by the worker methods of the instance. The allocations are only counted when the
+	 * library is built with THREADIT_ALLOC_TRACKING (see CThreadItAlloc). The allocations
+	 * of each run are also recorded in the m_theAllocations histogram of its instruction
+	 * while the latency histograms are on, whose mean is the allocations per message.
+	 */
+	LONGLONG getAllocationCount () const;
+
+	/**
+	 * Method getAllocatedBytes returns the number of bytes allocated with operator new by
+	 * the worker methods of the instance.
+	 */
+	LONGLONG getAllocatedBytes () const;
+
+	/**
+	 * Method getPeakAllocatedBytes returns the most bytes a run of a worker method of the
+	 * instance had allocated and not yet freed at one time.
+	 */
+	LONGLONG getPeakAllocatedBytes () const;
+
+	/**
+	 * Method getStats returns a snapshot of the latency histograms of each instruction
+	 * that has been recorded (see CThreadItLatencyStats). The percentiles are taken
+	 * from the histograms of the snapshot.
+	 * @param[out] theStats receives the histograms, one entry per instruction.
+	 */
+	void getStats (std::vector<CThreadItLatencyStats>& theStats) const;
+
+	/**
+	 * Method getStats returns a snapshot of the latency histograms of an instruction.
+	 * @param[in] theInstruction is the instruction.
+	 * @param[out] theStats receives the histograms.
+	 * \return false if nothing has been recorded for the instruction.
+	 */
+	bool getStats (ULONG theInstruction, CThreadItLatencyStats& theStats) const;
+
+	/**
+	 * Method resetStats clears the latency histograms. Times recorded while they are
+	 * cleared may be kept or lost.
+	 */
+	void resetStats ();
+
+	/**
+	 * Method getTraceContext returns the trace context of the work package being processed
+	 * by the calling thread. A worker method can use it to log the request it is part of.
+	 * @param[out] theContext receives the context.
+	 * \return false if the calling thread is not processing a work package.
+	 */
+	static bool getTraceContext (ThreadItTraceContext& theContext);
+
 	/**
 	 * Method StopThread stops the execution of the thread of control for the instance.
 	 */
@@ -715,12 +1181,114 @@ protected:
 	 */
 	virtual void threadRoutine ();
 
+	/**
+	 * Method processWorkPack performs the work described by a work package taken from
+	 * the work queue and sends the response. It is called by the thread of execution
+	 * and by the helper threads of a CThreadItPool.
+	 * @param[in] pWorkPack is the work package. Ownership passes to the method.
+	 */
+	virtual void processWorkPack (CWorkPackIt* pWorkPack);
+
+	/**
+	 * Method releaseObject is called to free the m_ptheObject of a work package that
+	 * is freed without being returned or processed by the worker method, because it was
+	 * throttled or shed or was answered by the result cache. The object belongs to the
+	 * worker method of the instruction, so a class whose work packages carry
+	 * m_ptheObject overrides this method to free it. The default only logs a warning as
+	 * the type of the object is not known here. A work package that is returned as a
+	 * result still holds its object and the receiver of the result frees it.
+	 * @param[in] pWorkPack is the work package. It is freed after the call.
+	 */
+	virtual void releaseObject (CWorkPackIt* pWorkPack);
+
+	/**
+	 * Method beginSpan gives a work package that is being sent a new span of the request
+	 * it belongs to. The request is the one of the work package being processed by the
+	 * calling thread if it has none, or a new request if there is neither.
+	 * @param[in] pWorkPack is the work package.
+	 * @param[in] theNow is the performance counter value when it was sent.
+	 */
+	void beginSpan (CWorkPackIt* pWorkPack, LONGLONG theNow);
+
+	/**
+	 * Method beginRun shows the run of a worker method by the calling thread in the
+	 * registry snapshot.
+	 * @param[in] theInstruction is the instruction.
+	 * @param[in] theStart is the tick count at which the run starts.
+	 * @param[in] theTimeAllowed is the time given to the run or zero.
+	 * @param[out] theOuterRun receives the run the new one is nested in, if any.
+	 * \return the slot of the run or NULL if every slot is taken.
+	 */
+	RunInfo* beginRun (LONG theInstruction, DWORD theStart, DWORD theTimeAllowed, RunInfo& theOuterRun);
+
+	/**
+	 * Method endRun puts back the run the ended one was nested in or frees the slot.
+	 * @param[in] ptheRun is the slot returned by beginRun. It may be NULL.
+	 * @param[in] theOuterRun is the run returned by beginRun.
+	 */
+	void endRun (RunInfo* ptheRun, const RunInfo& theOuterRun);
+
+	/**
+	 * Method continueWork queues a work package that returned WORKDONE_CONTINUE behind
+	 * the work that is waiting.
+	 * @param[in] pWorkPack is the work package. Ownership passes to the work queue.
+	 */
+	void continueWork (CWorkPackIt* pWorkPack);
+
+	/**
+	 * Method drainSelfQueue processes the work packages the thread of execution has
+	 * sent to its own instance. Work packages deferred while it runs are left for the
+	 * next call so that the work queue is not held up.
+	 */
+	void drainSelfQueue ();
+
 	/**
 	 * Method isExitThread is called internally to check if the thread of
 	 * execution is required to stop.
 	 */
 	bool isExitThread ();
 
+	/**
+	 * Method wakeThread releases the thread from its wait without providing a work
+	 * package. This is used when the event methods are changed from another thread
+	 * so that the new wait objects are picked up straight away rather than at the
+	 * next time out.
+	 */
+	void wakeThread ();
+
+	/**
+	 * Method updateLatency adds the latency of a completed work package to the moving
+	 * average. It is called by the threads that process work packages.
+	 * @param[in] theEnqueueTime is the performance counter value when the work package
+	 * was queued. Nothing is done if it is zero.
+	 * \return the latency in microseconds.
+	 */
+	LONGLONG updateLatency (LONGLONG theEnqueueTime);
+
+	/**
+	 * Method getLatencyStats returns the latency histograms of an instruction and
+	 * creates them if this is the first time recorded for it.
+	 * @param[in] theInstruction is a valid instruction.
+	 */
+	CThreadItLatencyStats* getLatencyStats (ULONG theInstruction);
+
+	/**
+	 * Method recordAllocations charges the allocations of a run of a worker method to the
+	 * instance and to the histograms of its instruction.
+	 * @param[in] ptheStats are the histograms of the instruction or NULL.
+	 * @param[in] theRun are the allocations of the run.
+	 */
+	void recordAllocations (CThreadItLatencyStats* ptheStats, const ThreadItAllocRun& theRun);
+
+	/**
+	 * Method isShedWork applies the admission control to a work package as it is
+	 * dequeued. It is called by the threads that process work packages.
+	 * @param[in] theEnqueueTime is the performance counter value when the work package
+	 * was queued.
+	 * \return true if the work package must be shed.
+	 */
+	bool isShedWork (LONGLONG theEnqueueTime);
+
 	/**
 	 * Method StartTiming is called to record the start of work execution timing.
 	 * TimeAllowed specifies the time allocated for work to be executed.
@@ -734,6 +1302,19 @@ protected:
 	 */
 	void stopTiming (DWORD& Elapsed);
 
+	/**
+	 * Method saveTiming keeps the execution timing of the current run so that a work
+	 * package run inline does not take over the timing of the run it is nested in.
+	 * @param[out] theTiming receives the execution timing.
+	 */
+	void saveTiming (TimingInfo& theTiming);
+
+	/**
+	 * Method restoreTiming puts back the execution timing kept by saveTiming.
+	 * @param[in] theTiming is the execution timing.
+	 */
+	void restoreTiming (const TimingInfo& theTiming);
+
 	/**
 	 * Method TimeElapsed calculates how much time has so far elapsed since timing
 	 * was started.
@@ -742,6 +1323,15 @@ protected:
 	 */
 	bool timeElapsed (DWORD& Elapsed);
 
+private:
+	/**
+	 * Method getActiveInfo fills in the work queue attributes of the registry snapshot
+	 * (see CActive::getRegistrySnapshot).
+	 * @param[in] ptheActive is the CThreadIt.
+	 * @param[in,out] theInfo is the snapshot of the instance.
+	 */
+	static void getActiveInfo (CActive* ptheActive, ActiveInfo& theInfo);
+
 }; // class ThreadIt
 
 #endif // !defined (THREADIT_H)
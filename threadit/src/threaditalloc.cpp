@@ -0,0 +1,153 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItAlloc
+ * Description: Class CThreadItAlloc counts the heap allocations of each thread. See
+ * the header file for how they are charged to the CThreadIt instances. The global
+ * operator new and operator delete are replaced here when THREADIT_ALLOC_TRACKING is
+ * defined.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <malloc.h>
+#include <new>
+#include "threaditalloc.h"
+
+// Class: CThreadItAlloc Implementation
+
+// Initialise the static attributes.
+__declspec (thread) ThreadItAllocCounters CThreadItAlloc::m_theCounters = { 0, 0, 0, 0, 0 };
+
+/**
+ * Method isEnabled returns true if the allocations are counted.
+ */
+bool CThreadItAlloc::isEnabled ()
+{
+#if defined (THREADIT_ALLOC_TRACKING)
+	return true;
+#else
+	return false;
+#endif
+} // isEnabled
+
+/**
+ * Method getCounters returns the counters of the calling thread.
+ */
+void CThreadItAlloc::getCounters (ThreadItAllocCounters& theCounters)
+{
+	theCounters = m_theCounters;
+} // getCounters
+
+/**
+ * Method startRun starts counting the allocations of a run. The peak of the thread is
+ * restarted for the run and the peak of an outer run is kept to be put back.
+ */
+void CThreadItAlloc::startRun (ThreadItAllocRun& theRun)
+{
+	theRun.theStart = m_theCounters;
+	theRun.theOuterPeak = m_theCounters.thePeakBytes;
+	theRun.theAllocations = 0;
+	theRun.theBytes = 0;
+	theRun.thePeakBytes = 0;
+	m_theCounters.thePeakBytes = m_theCounters.theLiveBytes;
+} // startRun
+
+/**
+ * Method endRun fills in the allocations of a run.
+ */
+void CThreadItAlloc::endRun (ThreadItAllocRun& theRun)
+{
+	theRun.theAllocations = m_theCounters.theAllocations - theRun.theStart.theAllocations;
+	theRun.theBytes = m_theCounters.theBytes - theRun.theStart.theBytes;
+	theRun.thePeakBytes = m_theCounters.thePeakBytes - theRun.theStart.theLiveBytes;
+	// The peak of an outer run includes the peak of this one.
+	if (theRun.theOuterPeak > m_theCounters.thePeakBytes)
+	{
+		m_theCounters.thePeakBytes = theRun.theOuterPeak;
+	} // if
+} // endRun
+
+#if defined (THREADIT_ALLOC_TRACKING)
+
+// The global operator new and operator delete. The sized and aligned forms of later
+// compilers call these by default.
+
+void* operator new (size_t theSize)
+{
+	void* ptheBlock = malloc ((theSize == 0) ? 1 : theSize);
+
+	if (ptheBlock == NULL)
+	{
+		throw std::bad_alloc ();
+	} // if
+	CThreadItAlloc::onAllocate (_msize (ptheBlock));
+	return ptheBlock;
+} // operator new
+
+void* operator new[] (size_t theSize)
+{
+	return operator new (theSize);
+} // operator new[]
+
+void* operator new (size_t theSize, const std::nothrow_t&) throw ()
+{
+	void* ptheBlock = malloc ((theSize == 0) ? 1 : theSize);
+
+	if (ptheBlock != NULL)
+	{
+		CThreadItAlloc::onAllocate (_msize (ptheBlock));
+	} // if
+	return ptheBlock;
+} // operator new
+
+void* operator new[] (size_t theSize, const std::nothrow_t& theNoThrow) throw ()
+{
+	return operator new (theSize, theNoThrow);
+} // operator new[]
+
+void operator delete (void* ptheBlock) throw ()
+{
+	if (ptheBlock != NULL)
+	{
+		CThreadItAlloc::onFree (_msize (ptheBlock));
+		free (ptheBlock);
+	} // if
+} // operator delete
+
+void operator delete[] (void* ptheBlock) throw ()
+{
+	operator delete (ptheBlock);
+} // operator delete[]
+
+void operator delete (void* ptheBlock, const std::nothrow_t&) throw ()
+{
+	operator delete (ptheBlock);
+} // operator delete
+
+void operator delete[] (void* ptheBlock, const std::nothrow_t&) throw ()
+{
+	operator delete (ptheBlock);
+} // operator delete[]
+
+#endif // defined (THREADIT_ALLOC_TRACKING)
@@ -0,0 +1,160 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItAlloc
+ * Description: Class CThreadItAlloc counts the heap allocations made with operator
+ * new on each thread so that they can be charged to the CThreadIt instance and the
+ * instruction of the worker method that made them. The counting is only built when
+ * the library is compiled with THREADIT_ALLOC_TRACKING defined, in which case the
+ * library replaces the global operator new and operator delete of the program. Without
+ * it there are no hooks and CThreadIt does no work for it at all. The DebugAllocTracking
+ * configuration of the solution builds the library and threadittest with it.
+ *
+ * The counters of a thread are thread local and are only changed by the thread, so an
+ * allocation costs a few increments and no interlocked operation. Each run of a worker
+ * method reads the counters of its thread before and after the call (see
+ * CThreadIt::processWorkPack) and charges the difference to the instance, and to the
+ * histograms of the instruction while the latency histograms are on (see
+ * CThreadItLatencyStats). The peak of a run is the most bytes the run had allocated and
+ * not yet freed at any one time. The size of a block is the size the heap reports for
+ * it, so that a block freed on another thread is taken off the counters of that thread
+ * with the same size.
+ *
+ * Only allocations made through operator new are seen, as those made with malloc or
+ * the Win32 heap functions do not pass through it. The counters are held in static
+ * thread local storage, which threads of a DLL loaded with LoadLibrary cannot use
+ * before Windows Vista.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_ALLOC_H)
+#define THREADIT_ALLOC_H
+
+// Includes
+#include <windows.h>
+
+/** ThreadItAllocCounters are the allocation counters of a thread. */
+typedef struct ThreadItAllocCountersTag
+{
+	/** theAllocations is the number of blocks allocated. */
+	LONGLONG theAllocations;
+	/** theBytes is the number of bytes allocated. */
+	LONGLONG theBytes;
+	/** theFrees is the number of blocks freed. */
+	LONGLONG theFrees;
+	/** theLiveBytes is the bytes allocated less the bytes freed by the thread. It may be
+	 * negative for a thread that frees the blocks of others. */
+	LONGLONG theLiveBytes;
+	/** thePeakBytes is the highest value of theLiveBytes since the run in progress started. */
+	LONGLONG thePeakBytes;
+} ThreadItAllocCounters;
+
+/** ThreadItAllocRun holds the allocations of a run of a worker method. */
+typedef struct ThreadItAllocRunTag
+{
+	/** theStart are the counters of the thread when the run started. */
+	ThreadItAllocCounters theStart;
+	/** theOuterPeak is the peak of the run the run was started within, if it is nested. */
+	LONGLONG theOuterPeak;
+	/** theAllocations is the number of blocks allocated by the run. */
+	LONGLONG theAllocations;
+	/** theBytes is the number of bytes allocated by the run. */
+	LONGLONG theBytes;
+	/** thePeakBytes is the most bytes the run had allocated and not freed at one time. */
+	LONGLONG thePeakBytes;
+} ThreadItAllocRun;
+
+/**
+ * Class CThreadItAlloc keeps the allocation counters of each thread.
+ */
+class CThreadItAlloc
+{
+	// Attributes
+private:
+	/** m_theCounters are the counters of the thread. */
+	static __declspec (thread) ThreadItAllocCounters m_theCounters;
+
+	// Methods
+public:
+	/**
+	 * Method isEnabled returns true if the library was built with THREADIT_ALLOC_TRACKING
+	 * and the allocations are counted.
+	 */
+	static bool isEnabled ();
+
+	/**
+	 * Method getCounters returns the counters of the calling thread. They are zero if the
+	 * allocations are not counted.
+	 * @param[out] theCounters receives the counters.
+	 */
+	static void getCounters (ThreadItAllocCounters& theCounters);
+
+	/**
+	 * Method startRun starts counting the allocations of a run on the calling thread.
+	 * Runs may be nested, such as a work package processed inline within startWork,
+	 * in which case the outer run includes the inner one.
+	 * @param[out] theRun is the run.
+	 */
+	static void startRun (ThreadItAllocRun& theRun);
+
+	/**
+	 * Method endRun fills in the allocations of a run started on the calling thread.
+	 * @param[in,out] theRun is the run.
+	 */
+	static void endRun (ThreadItAllocRun& theRun);
+
+	/**
+	 * Method onAllocate counts a block allocated by the calling thread. It is called by
+	 * operator new.
+	 * @param[in] theSize is the size of the block.
+	 */
+	static void onAllocate (size_t theSize)
+	{
+		m_theCounters.theAllocations++;
+		m_theCounters.theBytes += theSize;
+		m_theCounters.theLiveBytes += theSize;
+		if (m_theCounters.theLiveBytes > m_theCounters.thePeakBytes)
+		{
+			m_theCounters.thePeakBytes = m_theCounters.theLiveBytes;
+		} // if
+	} // onAllocate
+
+	/**
+	 * Method onFree counts a block freed by the calling thread. It is called by operator
+	 * delete.
+	 * @param[in] theSize is the size of the block.
+	 */
+	static void onFree (size_t theSize)
+	{
+		m_theCounters.theFrees++;
+		m_theCounters.theLiveBytes -= theSize;
+	} // onFree
+
+private:
+	/// not copiable
+	CThreadItAlloc ();
+	CThreadItAlloc (const CThreadItAlloc&);
+	const CThreadItAlloc& operator= (const CThreadItAlloc&);
+
+}; // class CThreadItAlloc
+
+#endif // !defined (THREADIT_ALLOC_H)
@@ -0,0 +1,74 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItCompletion
+ * Description: Class CThreadItCompletion is the interface called by the worker
+ * thread of a CThreadIt when a work package that names the completion has been
+ * processed. It is called on the worker thread after the worker method returns
+ * and before the response is sent, so the implementation sees the result before
+ * it is queued or freed and may change how it is returned.
+ *
+ * The completion is provided for executors built on top of CThreadIt (task graphs,
+ * scatter-gather and the like) that need to act as soon as a work package is done
+ * without a thread of their own waiting on a work done queue. Implementations must
+ * be quick and must not block as they run on the worker thread.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_COMPLETION_H)
+#define THREADIT_COMPLETION_H
+
+// Includes
+#include <windows.h>
+
+// Forward Declarations
+class CThreadIt;
+class CWorkPackIt;
+
+/**
+ * Class CThreadItCompletion is notified by CThreadIt when a work package is done.
+ */
+class CThreadItCompletion
+{
+public:
+	/**
+	 * Method ~CThreadItCompletion is the destructor for the instance.
+	 */
+	virtual ~CThreadItCompletion ()
+	{
+	} // ~CThreadItCompletion
+
+	/**
+	 * Method onWorkDone is called on the worker thread once the work package has been
+	 * processed.
+	 * @param[in] ptheWorker is the CThreadIt that performed the work.
+	 * @param[in] theTag is the m_theCompletionTag value of the work package.
+	 * @param[in] ptheWorkDone is the result returned by the worker method. It may be NULL.
+	 * The result is still owned by the worker and is sent or freed after this call.
+	 * @param[in] isSuccess is the value returned by the worker method. It is false if
+	 * there was no worker method for the instruction.
+	 */
+	virtual void onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess) = 0;
+
+}; // class CThreadItCompletion
+
+#endif // !defined (THREADIT_COMPLETION_H)
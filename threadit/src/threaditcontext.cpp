@@ -0,0 +1,275 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItCriticalPath
+ * Description: Class CThreadItCriticalPath follows the spans of requests to measure
+ * the length of their critical path. See the header file for the trace context.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include "threaditcontext.h"
+
+// Class: CThreadItCriticalPathStats Implementation
+
+/**
+ * Constructor CThreadItCriticalPathStats creates empty histograms for a request type.
+ */
+CThreadItCriticalPathStats::CThreadItCriticalPathStats (ULONG theRequestType)
+{
+	m_theRequestType = theRequestType;
+} // constructor CThreadItCriticalPathStats
+
+// Class: CThreadItCriticalPath Implementation
+
+// Initialise the static attributes.
+volatile bool CThreadItCriticalPath::m_isEnabled = false;
+std::map<ULONGLONG, CThreadItCriticalPath::OpenTrace> CThreadItCriticalPath::m_theOpenTraces;
+std::map<ULONG, CThreadItCriticalPathStats*> CThreadItCriticalPath::m_theStats;
+ULONG CThreadItCriticalPath::m_theExpiredCount = 0;
+LONGLONG CThreadItCriticalPath::m_theFrequency = 0;
+CRITICAL_SECTION CThreadItCriticalPath::m_theAccess;
+int CThreadItCriticalPath::m_theInit = CThreadItCriticalPath::initialise ();
+
+/**
+ * Method initialise sets up the static attributes. It always returns zero.
+ */
+int CThreadItCriticalPath::initialise ()
+{
+	LARGE_INTEGER theFrequency;
+
+	InitializeCriticalSection (&m_theAccess);
+	QueryPerformanceFrequency (&theFrequency);
+	m_theFrequency = theFrequency.QuadPart;
+	return 0;
+} // initialise
+
+/**
+ * Method start starts following the requests that start from now on.
+ */
+void CThreadItCriticalPath::start ()
+{
+	m_isEnabled = (m_theFrequency != 0);
+} // start
+
+/**
+ * Method stop stops following requests. The requests in progress are dropped.
+ */
+void CThreadItCriticalPath::stop ()
+{
+	m_isEnabled = false;
+	EnterCriticalSection (&m_theAccess);
+	m_theOpenTraces.clear ();
+	LeaveCriticalSection (&m_theAccess);
+} // stop
+
+/**
+ * Method isEnabled returns true while requests are followed.
+ */
+bool CThreadItCriticalPath::isEnabled ()
+{
+	return m_isEnabled;
+} // isEnabled
+
+/**
+ * Method reset clears the histograms and the requests in progress.
+ */
+void CThreadItCriticalPath::reset ()
+{
+	std::map<ULONG, CThreadItCriticalPathStats*>::iterator theStat;
+
+	EnterCriticalSection (&m_theAccess);
+	for (theStat = m_theStats.begin (); theStat != m_theStats.end (); theStat++)
+	{
+		delete theStat->second;
+	} // for
+	m_theStats.clear ();
+	m_theOpenTraces.clear ();
+	m_theExpiredCount = 0;
+	LeaveCriticalSection (&m_theAccess);
+} // reset
+
+/**
+ * Method getStats returns a snapshot of the histograms of each request type.
+ */
+void CThreadItCriticalPath::getStats (std::vector<CThreadItCriticalPathStats>& theStats)
+{
+	std::map<ULONG, CThreadItCriticalPathStats*>::const_iterator theStat;
+
+	theStats.clear ();
+	EnterCriticalSection (&m_theAccess);
+	for (theStat = m_theStats.begin (); theStat != m_theStats.end (); theStat++)
+	{
+		theStats.push_back (*theStat->second);
+	} // for
+	LeaveCriticalSection (&m_theAccess);
+} // getStats
+
+/**
+ * Method getStats returns a snapshot of the histograms of a request type.
+ */
+bool CThreadItCriticalPath::getStats (ULONG theRequestType, CThreadItCriticalPathStats& theStats)
+{
+	bool isSuccess = false;
+	std::map<ULONG, CThreadItCriticalPathStats*>::const_iterator theStat;
+
+	EnterCriticalSection (&m_theAccess);
+	theStat = m_theStats.find (theRequestType);
+	if (theStat != m_theStats.end ())
+	{
+		theStats = *theStat->second;
+		isSuccess = true;
+	} // if
+	LeaveCriticalSection (&m_theAccess);
+	return isSuccess;
+} // getStats
+
+/**
+ * Method getOpenCount returns the number of requests in progress.
+ */
+ULONG CThreadItCriticalPath::getOpenCount ()
+{
+	ULONG theCount = 0;
+
+	EnterCriticalSection (&m_theAccess);
+	theCount = (ULONG)m_theOpenTraces.size ();
+	LeaveCriticalSection (&m_theAccess);
+	return theCount;
+} // getOpenCount
+
+/**
+ * Method getExpiredCount returns the number of requests given up.
+ */
+ULONG CThreadItCriticalPath::getExpiredCount ()
+{
+	ULONG theCount = 0;
+
+	EnterCriticalSection (&m_theAccess);
+	theCount = m_theExpiredCount;
+	LeaveCriticalSection (&m_theAccess);
+	return theCount;
+} // getExpiredCount
+
+/**
+ * Method spanStarted counts a span of a request. A request is only followed if its
+ * first span is seen so that requests started before start are not half counted.
+ */
+void CThreadItCriticalPath::spanStarted (const ThreadItTraceContext& theContext)
+{
+	std::map<ULONGLONG, OpenTrace>::iterator theTrace;
+	OpenTrace theNewTrace;
+
+	EnterCriticalSection (&m_theAccess);
+	if (theContext.theParentSpanId == 0)
+	{
+		if (m_theOpenTraces.size () >= THREADIT_CRITICAL_PATH_OPEN)
+		{
+			expire (theContext.theOriginTime);
+		} // if
+		if (m_theOpenTraces.size () < THREADIT_CRITICAL_PATH_OPEN)
+		{
+			theNewTrace.theRequestType = theContext.theRequestType;
+			theNewTrace.theOpenSpans = 1;
+			theNewTrace.theSpans = 1;
+			theNewTrace.theLastHop = 0;
+			theNewTrace.theOriginTime = theContext.theOriginTime;
+			m_theOpenTraces[theContext.theTraceId] = theNewTrace;
+		}
+		else
+		{
+			m_theExpiredCount++;
+		} // if
+	}
+	else
+	{
+		theTrace = m_theOpenTraces.find (theContext.theTraceId);
+		if (theTrace != m_theOpenTraces.end ())
+		{
+			theTrace->second.theOpenSpans++;
+			theTrace->second.theSpans++;
+		} // if
+	} // if
+	LeaveCriticalSection (&m_theAccess);
+} // spanStarted
+
+/**
+ * Method spanEnded counts the end of a span and records the request once it has no
+ * spans left. The spans a span sends are counted before it ends so the count only
+ * reaches zero once the last span of the request has ended.
+ */
+void CThreadItCriticalPath::spanEnded (const ThreadItTraceContext& theContext)
+{
+	std::map<ULONGLONG, OpenTrace>::iterator theTrace;
+	std::map<ULONG, CThreadItCriticalPathStats*>::iterator theStat;
+	CThreadItCriticalPathStats* ptheStats = NULL;
+	LARGE_INTEGER theNow;
+
+	QueryPerformanceCounter (&theNow);
+	EnterCriticalSection (&m_theAccess);
+	theTrace = m_theOpenTraces.find (theContext.theTraceId);
+	if (theTrace != m_theOpenTraces.end ())
+	{
+		theTrace->second.theLastHop = theContext.theHopCount;
+		theTrace->second.theOpenSpans--;
+		if (theTrace->second.theOpenSpans == 0)
+		{
+			theStat = m_theStats.find (theTrace->second.theRequestType);
+			if (theStat == m_theStats.end ())
+			{
+				ptheStats = new CThreadItCriticalPathStats (theTrace->second.theRequestType);
+				m_theStats[theTrace->second.theRequestType] = ptheStats;
+			}
+			else
+			{
+				ptheStats = theStat->second;
+			} // if
+			ptheStats->m_theLatency.record (((theNow.QuadPart - theTrace->second.theOriginTime) * 1000000) / m_theFrequency);
+			ptheStats->m_theHops.record (theTrace->second.theLastHop);
+			ptheStats->m_theSpans.record (theTrace->second.theSpans);
+			m_theOpenTraces.erase (theTrace);
+		} // if
+	} // if
+	LeaveCriticalSection (&m_theAccess);
+} // spanEnded
+
+/**
+ * Method expire gives up the requests older than THREADIT_CRITICAL_PATH_EXPIRY.
+ */
+void CThreadItCriticalPath::expire (LONGLONG theNow)
+{
+	std::map<ULONGLONG, OpenTrace>::iterator theTrace = m_theOpenTraces.begin ();
+	LONGLONG theOldest = theNow - ((m_theFrequency * THREADIT_CRITICAL_PATH_EXPIRY) / 1000);
+
+	while (theTrace != m_theOpenTraces.end ())
+	{
+		if (theTrace->second.theOriginTime < theOldest)
+		{
+			m_theOpenTraces.erase (theTrace++);
+			m_theExpiredCount++;
+		}
+		else
+		{
+			theTrace++;
+		} // if
+	} // while
+} // expire
@@ -0,0 +1,247 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: ThreadItTraceContext
+ * Description: ThreadItTraceContext identifies the request a work package belongs to
+ * as it passes from one CThreadIt to the next. The request keeps one trace ID and the
+ * time it started, and each work package sent for it is a span with an ID of its own,
+ * the ID of the span that sent it and the number of hops from the first.
+ *
+ * CThreadIt::startWork fills in the context. A work package sent while a worker
+ * method, its reply or the notification of its observers is running on the thread
+ * is a child of the work package being processed, so the context follows the
+ * messages sent with CThreadItMessage, CISafeThreadItInterface and CThreadItObserver
+ * without any change to them. Work sent from any other place starts a new request.
+ * A work package that already has a context, such as one forwarded by a worker method,
+ * becomes a child of its own span.
+ *
+ * Class CThreadItCriticalPath follows the spans of each request while it is turned
+ * on. A request is complete once every span sent for it has been processed, and the
+ * time from its start to the end of the last span, which is the length of its critical
+ * path, is counted for the instruction of its first work package.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_CONTEXT_H)
+#define THREADIT_CONTEXT_H
+
+// Includes
+#include <windows.h>
+#include <map>
+#include <vector>
+#include "threadithistogram.h"
+
+/** THREADIT_CRITICAL_PATH_OPEN is the most requests followed at once. */
+#define THREADIT_CRITICAL_PATH_OPEN 65536
+/** THREADIT_CRITICAL_PATH_EXPIRY is the time in milliseconds after which a request
+ * that has not completed is given up, such as when its work packages are discarded. */
+#define THREADIT_CRITICAL_PATH_EXPIRY 60000
+
+/** ThreadItTraceContext identifies the request and the span of a work package. */
+typedef struct ThreadItTraceContextTag
+{
+	/** theTraceId is the ID of the request. It is zero if there is no context. */
+	ULONGLONG theTraceId;
+	/** theSpanId is the ID of the work package within the process. */
+	ULONG theSpanId;
+	/** theParentSpanId is the span that sent the work package or zero for the first. */
+	ULONG theParentSpanId;
+	/** theHopCount is the number of hops from the first work package of the request. */
+	ULONG theHopCount;
+	/** theRequestType is the instruction of the first work package of the request. */
+	ULONG theRequestType;
+	/** theOriginTime is the performance counter value when the request started. */
+	LONGLONG theOriginTime;
+} ThreadItTraceContext;
+
+/**
+ * Class CThreadItCriticalPathStats holds the histograms of the requests of one type.
+ */
+class CThreadItCriticalPathStats
+{
+	// Attributes
+public:
+	/** m_theRequestType is the instruction of the first work package of the requests. */
+	ULONG m_theRequestType;
+	/** m_theLatency is the time in microseconds from the start of a request to the end
+	 * of its last span. */
+	CThreadItHistogram m_theLatency;
+	/** m_theHops is the hop count of the last span of a request, which is the number of
+	 * hops on its critical path. */
+	CThreadItHistogram m_theHops;
+	/** m_theSpans is the number of spans of a request. */
+	CThreadItHistogram m_theSpans;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItCriticalPathStats creates empty histograms for a request type.
+	 * @param[in] theRequestType is the request type.
+	 */
+	CThreadItCriticalPathStats (ULONG theRequestType = 0);
+
+}; // class CThreadItCriticalPathStats
+
+/**
+ * Class CThreadItCriticalPath follows the spans of requests to measure their critical path.
+ */
+class CThreadItCriticalPath
+{
+	// types
+private:
+	/** OpenTrace is the state of a request that has spans in progress. */
+	typedef struct OpenTraceTag
+	{
+		/** theRequestType is the type of the request. */
+		ULONG theRequestType;
+		/** theOpenSpans is the number of spans sent and not yet processed. */
+		ULONG theOpenSpans;
+		/** theSpans is the number of spans sent. */
+		ULONG theSpans;
+		/** theLastHop is the hop count of the span that ended last. */
+		ULONG theLastHop;
+		/** theOriginTime is the performance counter value when the request started. */
+		LONGLONG theOriginTime;
+	} OpenTrace;
+
+	// Attributes
+private:
+	/** m_isEnabled is true while requests are followed. */
+	static volatile bool m_isEnabled;
+	/** m_theOpenTraces are the requests with spans in progress by trace ID. */
+	static std::map<ULONGLONG, OpenTrace> m_theOpenTraces;
+	/** m_theStats are the histograms of each request type. */
+	static std::map<ULONG, CThreadItCriticalPathStats*> m_theStats;
+	/** m_theExpiredCount is the number of requests given up. */
+	static ULONG m_theExpiredCount;
+	/** m_theFrequency is the frequency of the performance counter. */
+	static LONGLONG m_theFrequency;
+	/** m_theAccess protects the requests and the histograms. */
+	static CRITICAL_SECTION m_theAccess;
+	/** m_theInit is only used to set up the static attributes. */
+	static int m_theInit;
+
+	// Methods
+public:
+	/**
+	 * Method onSpanStart is called when a work package is sent. It costs one test of a
+	 * flag while the requests are not followed.
+	 * @param[in] theContext is the context of the work package.
+	 */
+	static void onSpanStart (const ThreadItTraceContext& theContext)
+	{
+		if (m_isEnabled)
+		{
+			spanStarted (theContext);
+		} // if
+	} // onSpanStart
+
+	/**
+	 * Method onSpanEnd is called once a work package has been processed and its reply sent.
+	 * @param[in] theContext is the context of the work package.
+	 */
+	static void onSpanEnd (const ThreadItTraceContext& theContext)
+	{
+		if (m_isEnabled)
+		{
+			spanEnded (theContext);
+		} // if
+	} // onSpanEnd
+
+	/**
+	 * Method start starts following the requests that start from now on.
+	 */
+	static void start ();
+
+	/**
+	 * Method stop stops following requests. The requests in progress are dropped and
+	 * the histograms are kept.
+	 */
+	static void stop ();
+
+	/**
+	 * Method isEnabled returns true while requests are followed.
+	 */
+	static bool isEnabled ();
+
+	/**
+	 * Method reset clears the histograms and the requests in progress.
+	 */
+	static void reset ();
+
+	/**
+	 * Method getStats returns a snapshot of the histograms of each request type.
+	 * @param[out] theStats receives the histograms, one entry per request type.
+	 */
+	static void getStats (std::vector<CThreadItCriticalPathStats>& theStats);
+
+	/**
+	 * Method getStats returns a snapshot of the histograms of a request type.
+	 * @param[in] theRequestType is the instruction of the first work package.
+	 * @param[out] theStats receives the histograms.
+	 * \return false if no request of the type has completed.
+	 */
+	static bool getStats (ULONG theRequestType, CThreadItCriticalPathStats& theStats);
+
+	/**
+	 * Method getOpenCount returns the number of requests in progress.
+	 */
+	static ULONG getOpenCount ();
+
+	/**
+	 * Method getExpiredCount returns the number of requests given up because they did
+	 * not complete within THREADIT_CRITICAL_PATH_EXPIRY or there were too many.
+	 */
+	static ULONG getExpiredCount ();
+
+private:
+	/**
+	 * Method spanStarted counts a span of a request.
+	 */
+	static void spanStarted (const ThreadItTraceContext& theContext);
+
+	/**
+	 * Method spanEnded counts the end of a span and records the request once it has no
+	 * spans left.
+	 */
+	static void spanEnded (const ThreadItTraceContext& theContext);
+
+	/**
+	 * Method expire gives up the requests older than THREADIT_CRITICAL_PATH_EXPIRY. It is
+	 * called with the lock held.
+	 * @param[in] theNow is the performance counter value now.
+	 */
+	static void expire (LONGLONG theNow);
+
+	/**
+	 * Method initialise sets up the static attributes. It always returns zero.
+	 */
+	static int initialise ();
+
+	/// not copiable
+	CThreadItCriticalPath ();
+	CThreadItCriticalPath (const CThreadItCriticalPath&);
+	const CThreadItCriticalPath& operator= (const CThreadItCriticalPath&);
+
+}; // class CThreadItCriticalPath
+
+#endif // !defined (THREADIT_CONTEXT_H)
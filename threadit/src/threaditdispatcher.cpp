@@ -0,0 +1,269 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItDispatcher
+ * Description: Class CThreadItDispatcher balances work packages over a set of
+ * identical CThreadIt replicas. See the header file for the policies.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include "threaditdispatcher.h"
+#include "threaditmessage.h"
+
+// Class: CThreadItDispatcher Implementation
+
+/**
+ * Constructor CThreadItDispatcher creates a dispatcher without replicas.
+ */
+CThreadItDispatcher::CThreadItDispatcher (DispatchPolicy thePolicy)
+{
+	m_ptheLogger = &(log4cpp::Category::getInstance ("threadit.CThreadItDispatcher"));
+	m_thePolicy = thePolicy;
+	m_theNext = 0;
+	m_theRandom = 0;
+} // constructor CThreadItDispatcher
+
+/**
+ * Method ~CThreadItDispatcher releases the replicas.
+ */
+CThreadItDispatcher::~CThreadItDispatcher ()
+{
+	m_theReplicas.clear ();
+} // ~CThreadItDispatcher
+
+/**
+ * Method addReplica adds a replica.
+ */
+void CThreadItDispatcher::addReplica (const ThreadItPtr& ptheReplica)
+{
+	if (ptheReplica)
+	{
+		m_theReplicas.push_back (ptheReplica);
+	} // if
+} // addReplica
+
+/**
+ * Method getReplicaCount returns the number of replicas.
+ */
+ULONG CThreadItDispatcher::getReplicaCount () const
+{
+	return (ULONG)m_theReplicas.size ();
+} // getReplicaCount
+
+/**
+ * Method getReplica returns a replica or an empty pointer if there is none.
+ */
+ThreadItPtr CThreadItDispatcher::getReplica (ULONG theReplica) const
+{
+	ThreadItPtr ptheReplica;
+
+	if (theReplica < m_theReplicas.size ())
+	{
+		ptheReplica = m_theReplicas[theReplica];
+	} // if
+	return ptheReplica;
+} // getReplica
+
+/**
+ * Method setPolicy changes the policy used to select a replica.
+ */
+void CThreadItDispatcher::setPolicy (DispatchPolicy thePolicy)
+{
+	if ((thePolicy >= DISPATCH_ROUND_ROBIN) && (thePolicy < DISPATCH_LAST))
+	{
+		InterlockedExchange (&m_thePolicy, thePolicy);
+	} // if
+} // setPolicy
+
+/**
+ * Method getPolicy returns the policy used to select a replica.
+ */
+CThreadItDispatcher::DispatchPolicy CThreadItDispatcher::getPolicy () const
+{
+	return (DispatchPolicy)m_thePolicy;
+} // getPolicy
+
+/**
+ * Method getRandom returns a random number shared by all the sending threads. The
+ * state is a counter so that concurrent callers get different numbers; the counter
+ * is mixed to spread the numbers out.
+ */
+ULONG CThreadItDispatcher::getRandom ()
+{
+	ULONG theValue = (ULONG)InterlockedIncrement (&m_theRandom) * 0x9e3779b9;
+
+	theValue ^= theValue >> 16;
+	theValue *= 0x85ebca6b;
+	theValue ^= theValue >> 13;
+	return theValue;
+} // getRandom
+
+/**
+ * Method selectReplica returns the replica the next work package would be sent to.
+ */
+ULONG CThreadItDispatcher::selectReplica ()
+{
+	ULONG theCount = (ULONG)m_theReplicas.size ();
+	ULONG theBest = ULONG_MAX;
+	ULONG theReplica = 0;
+	ULONG theOther = 0;
+	ULONG theStart = 0;
+	LONGLONG theCost = 0;
+	LONGLONG theBestCost = 0;
+
+	if (theCount > 0)
+	{
+		theStart = (ULONG)InterlockedIncrement (&m_theNext) % theCount;
+		switch (m_thePolicy)
+		{
+			case DISPATCH_LEAST_DEPTH :
+				for (ULONG i = 0; i < theCount; i++)
+				{
+					theReplica = (theStart + i) % theCount;
+					theCost = m_theReplicas[theReplica]->getWorkQDepth ();
+					if ((theBest == ULONG_MAX) || (theCost < theBestCost))
+					{
+						theBest = theReplica;
+						theBestCost = theCost;
+					} // if
+				} // for
+				break;
+			case DISPATCH_TWO_CHOICES :
+				theReplica = getRandom () % theCount;
+				theOther = (theCount > 1) ? (theReplica + 1 + (getRandom () % (theCount - 1))) % theCount : theReplica;
+				theBest = (m_theReplicas[theOther]->getWorkQDepth () < m_theReplicas[theReplica]->getWorkQDepth ()) ? theOther : theReplica;
+				break;
+			case DISPATCH_LATENCY_EWMA :
+				for (ULONG i = 0; i < theCount; i++)
+				{
+					theReplica = (theStart + i) % theCount;
+					// A replica that has not completed any work yet is treated as fast.
+					theCost = (LONGLONG)(m_theReplicas[theReplica]->getWorkQDepth () + 1) * (m_theReplicas[theReplica]->getLatencyEwma () + 1);
+					if ((theBest == ULONG_MAX) || (theCost < theBestCost))
+					{
+						theBest = theReplica;
+						theBestCost = theCost;
+					} // if
+				} // for
+				break;
+			default :
+				theBest = theStart;
+				break;
+		} // switch
+	} // if
+	return theBest;
+} // selectReplica
+
+/**
+ * Method setSender sets the instance given as the source of the work packages sent
+ * by sendMessage.
+ */
+void CThreadItDispatcher::setSender (const std::weak_ptr<CThreadIt>& ptheSender)
+{
+	m_ptheSender = ptheSender;
+} // setSender
+
+/**
+ * Method startWork sends a work package to the replica selected by the policy.
+ */
+bool CThreadItDispatcher::startWork (CWorkPackIt*& pWorkPack, ULONG& WorkPackID)
+{
+	bool isSuccess = false;
+	ULONG theReplica = selectReplica ();
+
+	if ((theReplica != ULONG_MAX) && (pWorkPack != NULL))
+	{
+		isSuccess = m_theReplicas[theReplica]->startWork (pWorkPack, WorkPackID);
+	}
+	else
+	{
+		m_ptheLogger->error ("work package not sent - no work package or no replicas");
+	} // if
+	return isSuccess;
+} // startWork
+
+/**
+ * Method sendMessage sends a work request with an object payload and no reply.
+ */
+bool CThreadItDispatcher::sendMessage (UINT theServiceId, void* ptheMessage)
+{
+	bool isSuccess = false;
+	ULONG theReplica = selectReplica ();
+
+	if (theReplica != ULONG_MAX)
+	{
+		CThreadItMessage aWorkMessage (theServiceId);
+		aWorkMessage.setSourceInfo (m_ptheSender, 0);
+		aWorkMessage.getWork ()->m_ptheObject = ptheMessage;
+		aWorkMessage.sendWithNoReplyTo (m_theReplicas[theReplica].get ());
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // sendMessage
+
+/**
+ * Method sendMessage sends a work request with a data item payload and no reply.
+ */
+bool CThreadItDispatcher::sendMessage (UINT theServiceId, const DataItemPtr& theDataItem)
+{
+	bool isSuccess = false;
+	ULONG theReplica = selectReplica ();
+
+	if (theReplica != ULONG_MAX)
+	{
+		CThreadItMessage aWorkMessage (theServiceId);
+		aWorkMessage.setSourceInfo (m_ptheSender, 0);
+		aWorkMessage.getWork ()->m_ptheDataItem = theDataItem;
+		aWorkMessage.sendWithNoReplyTo (m_theReplicas[theReplica].get ());
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // sendMessage
+
+/**
+ * Method toPolicyStr returns the name of a policy.
+ */
+std::string CThreadItDispatcher::toPolicyStr (DispatchPolicy thePolicy)
+{
+	std::string thePolicyStr = "unknown";
+
+	switch (thePolicy)
+	{
+		case DISPATCH_ROUND_ROBIN :
+			thePolicyStr = "round robin";
+			break;
+		case DISPATCH_LEAST_DEPTH :
+			thePolicyStr = "least depth";
+			break;
+		case DISPATCH_TWO_CHOICES :
+			thePolicyStr = "two choices";
+			break;
+		case DISPATCH_LATENCY_EWMA :
+			thePolicyStr = "latency ewma";
+			break;
+		default :
+			break;
+	} // switch
+	return thePolicyStr;
+} // toPolicyStr
@@ -0,0 +1,172 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItDispatcher
+ * Description: Class CThreadItDispatcher fronts a set of identical stateless
+ * CThreadIt replicas and sends each work package to one of them according to a
+ * selectable policy:
+ *
+ * DISPATCH_ROUND_ROBIN sends to the replicas in turn.
+ * DISPATCH_LEAST_DEPTH sends to the replica with the fewest work packages queued.
+ * DISPATCH_TWO_CHOICES picks two replicas at random and sends to the one with the
+ * fewer work packages queued. It keeps most of the benefit of DISPATCH_LEAST_DEPTH
+ * without reading the depth of every replica.
+ * DISPATCH_LATENCY_EWMA sends to the replica with the lowest expected wait, that is
+ * its queue depth plus one multiplied by its moving average latency.
+ *
+ * The queue depth and the latency average are kept by each CThreadIt without a
+ * lock (see getWorkQDepth and getLatencyEwma) so selecting a replica takes no
+ * lock. The dispatcher offers the same startWork and sendMessage methods as
+ * CThreadIt and CISafeThreadItInterface so it can be used in their place. The
+ * replicas must be added before work is sent.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_DISPATCHER_H)
+#define THREADIT_DISPATCHER_H
+
+// Includes
+#include <vector>
+#include "threadit.h"
+
+/**
+ * Class CThreadItDispatcher balances work packages over replicas.
+ */
+class CThreadItDispatcher
+{
+	// types
+public:
+	/** DispatchPolicy selects how a replica is chosen. */
+	enum DispatchPolicy
+	{
+		DISPATCH_ROUND_ROBIN = 0,
+		DISPATCH_LEAST_DEPTH,
+		DISPATCH_TWO_CHOICES,
+		DISPATCH_LATENCY_EWMA,
+		DISPATCH_LAST
+	};
+
+	// Attributes
+private:
+	/** m_theReplicas are the replicas work is sent to. */
+	std::vector<ThreadItPtr> m_theReplicas;
+	/** m_thePolicy is the current DispatchPolicy. */
+	volatile LONG m_thePolicy;
+	/** m_theNext is the round robin position. It also starts the search of the other
+	 * policies so that equally loaded replicas share the work. */
+	volatile LONG m_theNext;
+	/** m_theRandom is the state of the random choice of DISPATCH_TWO_CHOICES. */
+	volatile LONG m_theRandom;
+	/** m_ptheSender is set as the source of the work packages sent by sendMessage. */
+	std::weak_ptr<CThreadIt> m_ptheSender;
+	/** m_ptheLogger is the logger used to log information and errors. */
+	log4cpp::Category* m_ptheLogger;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItDispatcher creates a dispatcher without replicas.
+	 * @param[in] thePolicy is the policy used to select a replica.
+	 */
+	CThreadItDispatcher (DispatchPolicy thePolicy = DISPATCH_LEAST_DEPTH);
+
+	/**
+	 * Method ~CThreadItDispatcher releases the replicas.
+	 */
+	virtual ~CThreadItDispatcher ();
+
+	/**
+	 * Method addReplica adds a replica. All replicas must be added before work is sent.
+	 */
+	void addReplica (const ThreadItPtr& ptheReplica);
+
+	/**
+	 * Method getReplicaCount returns the number of replicas.
+	 */
+	ULONG getReplicaCount () const;
+
+	/**
+	 * Method getReplica returns a replica or an empty pointer if there is none.
+	 */
+	ThreadItPtr getReplica (ULONG theReplica) const;
+
+	/**
+	 * Method setPolicy changes the policy used to select a replica. It can be called
+	 * while work is being sent.
+	 */
+	void setPolicy (DispatchPolicy thePolicy);
+
+	/**
+	 * Method getPolicy returns the policy used to select a replica.
+	 */
+	DispatchPolicy getPolicy () const;
+
+	/**
+	 * Method selectReplica returns the replica the next work package would be sent to
+	 * or ULONG_MAX if there are no replicas.
+	 */
+	ULONG selectReplica ();
+
+	/**
+	 * Method setSender sets the instance given as the source of the work packages sent
+	 * by sendMessage.
+	 */
+	void setSender (const std::weak_ptr<CThreadIt>& ptheSender);
+
+	/**
+	 * Method startWork sends a work package to the replica selected by the policy.
+	 * @param[in] pWorkPack is the work package. Ownership passes to the replica.
+	 * @param[out] WorkPackID is the identity given to the work package by the replica.
+	 * \return true if the work package is sent.
+	 */
+	bool startWork (CWorkPackIt*& pWorkPack, ULONG& WorkPackID);
+
+	/**
+	 * Method sendMessage sends a work request with an object payload and no reply to
+	 * the replica selected by the policy. See CISafeThreadItInterface::sendMessage.
+	 */
+	bool sendMessage (UINT theServiceId, void* ptheMessage);
+
+	/**
+	 * Method sendMessage sends a work request with a data item payload and no reply to
+	 * the replica selected by the policy. See CISafeThreadItInterface::sendMessage.
+	 */
+	bool sendMessage (UINT theServiceId, const DataItemPtr& theDataItem);
+
+	/**
+	 * Method toPolicyStr returns the name of a policy.
+	 */
+	static std::string toPolicyStr (DispatchPolicy thePolicy);
+
+private:
+	/**
+	 * Method getRandom returns a random number shared by all the sending threads.
+	 */
+	ULONG getRandom ();
+
+	/// not copiable
+	CThreadItDispatcher (const CThreadItDispatcher&);
+	const CThreadItDispatcher& operator= (const CThreadItDispatcher&);
+
+}; // class CThreadItDispatcher
+
+#endif // !defined (THREADIT_DISPATCHER_H)
@@ -0,0 +1,269 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItFlightRecorder
+ * Description: Class CThreadItFlightRecorder keeps the recent work packages of each
+ * CThreadIt in shared memory. See the header file for the layout of the region.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <iomanip>
+#include "Active.h"
+#include "strutil.h"
+#include "threaditflight.h"
+
+// Class: CThreadItFlightRecorder Implementation
+
+// Initialise the static attributes.
+HANDLE CThreadItFlightRecorder::m_theMapping = NULL;
+CThreadItFlightRecorder::FlightHeader* CThreadItFlightRecorder::m_ptheHeader = NULL;
+CThreadItFlightRecorder::FlightSlot* CThreadItFlightRecorder::m_ptheSlots = NULL;
+char CThreadItFlightRecorder::m_theCrashFile[MAX_PATH] = "";
+LPTOP_LEVEL_EXCEPTION_FILTER CThreadItFlightRecorder::m_thePreviousFilter = NULL;
+bool CThreadItFlightRecorder::m_isCrashHandler = false;
+int CThreadItFlightRecorder::m_theInit = CThreadItFlightRecorder::initialise ();
+
+/**
+ * Method initialise creates the region. The section is backed by the paging file so
+ * its pages are only committed as the slots are used.
+ */
+int CThreadItFlightRecorder::initialise ()
+{
+	LARGE_INTEGER theFrequency;
+
+	m_theMapping = CreateFileMappingA (INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, getRegionSize (), getMappingName (GetCurrentProcessId ()).c_str ());
+	if (m_theMapping != NULL)
+	{
+		m_ptheHeader = (FlightHeader*)MapViewOfFile (m_theMapping, FILE_MAP_ALL_ACCESS, 0, 0, getRegionSize ());
+	} // if
+	if (m_ptheHeader != NULL)
+	{
+		QueryPerformanceFrequency (&theFrequency);
+		m_ptheSlots = (FlightSlot*)(m_ptheHeader + 1);
+		m_ptheHeader->theVersion = THREADIT_FLIGHT_VERSION;
+		m_ptheHeader->theProcessId = GetCurrentProcessId ();
+		m_ptheHeader->theSlotCount = THREADIT_FLIGHT_SLOTS;
+		m_ptheHeader->theRecordCount = THREADIT_FLIGHT_RECORDS;
+		m_ptheHeader->theSlotSize = sizeof (FlightSlot);
+		m_ptheHeader->theFrequency = theFrequency.QuadPart;
+		m_ptheHeader->theMagic = THREADIT_FLIGHT_MAGIC;
+	} // if
+	return 0;
+} // initialise
+
+/**
+ * Method getRegionSize returns the size of the region in bytes.
+ */
+DWORD CThreadItFlightRecorder::getRegionSize ()
+{
+	return (DWORD)(sizeof (FlightHeader) + (THREADIT_FLIGHT_SLOTS * sizeof (FlightSlot)));
+} // getRegionSize
+
+/**
+ * Method acquire gives a slot to an instance and clears its records. The slot is
+ * claimed with an interlocked exchange so instances may be created on any thread.
+ */
+CThreadItFlightRecorder::FlightSlot* CThreadItFlightRecorder::acquire (CActive* ptheObject)
+{
+	FlightSlot* ptheSlot = NULL;
+	std::string theName;
+
+	if (m_ptheSlots != NULL)
+	{
+		for (ULONG theIndex = 0; (theIndex < THREADIT_FLIGHT_SLOTS) && (ptheSlot == NULL); theIndex++)
+		{
+			if (InterlockedCompareExchange (&m_ptheSlots[theIndex].isInUse, 1, 0) == 0)
+			{
+				ptheSlot = &m_ptheSlots[theIndex];
+			} // if
+		} // for
+	} // if
+	if (ptheSlot != NULL)
+	{
+		theName = ptheObject->getThreadName ();
+		ptheSlot->theThreadId = ptheObject->getThreadId ();
+		ZeroMemory (ptheSlot->theName, sizeof (ptheSlot->theName));
+		strncpy_s (ptheSlot->theName, sizeof (ptheSlot->theName), theName.c_str (), _TRUNCATE);
+		ZeroMemory (ptheSlot->theRecords, sizeof (ptheSlot->theRecords));
+		ptheSlot->theHead = 0;
+	} // if
+	return ptheSlot;
+} // acquire
+
+/**
+ * Method release gives up the slot of an instance. Its records are kept.
+ */
+void CThreadItFlightRecorder::release (FlightSlot* ptheSlot)
+{
+	if (ptheSlot != NULL)
+	{
+		InterlockedExchange (&ptheSlot->isInUse, 0);
+	} // if
+} // release
+
+/**
+ * Method isAvailable returns true if the region was created.
+ */
+bool CThreadItFlightRecorder::isAvailable ()
+{
+	return (m_ptheHeader != NULL);
+} // isAvailable
+
+/**
+ * Method getMappingName returns the name of the shared memory section of a process.
+ */
+std::string CThreadItFlightRecorder::getMappingName (DWORD theProcessId)
+{
+	return std::string ("Local\\threadit.flight.") + strutil::toString (theProcessId);
+} // getMappingName
+
+/**
+ * Method write writes the records of every slot that has been used as text. A record
+ * that is being written while it is read is left out.
+ */
+void CThreadItFlightRecorder::write (std::ostream& theStream)
+{
+	FlightSlot* ptheSlot = NULL;
+	FlightRecord theRecord;
+	ULONG theHead = 0;
+	ULONG theFirst = 0;
+	double theFrequency = 0.0;
+
+	if (m_ptheHeader != NULL)
+	{
+		theFrequency = (double)m_ptheHeader->theFrequency;
+		for (ULONG theIndex = 0; theIndex < THREADIT_FLIGHT_SLOTS; theIndex++)
+		{
+			ptheSlot = &m_ptheSlots[theIndex];
+			theHead = (ULONG)ptheSlot->theHead;
+			if (theHead > 0)
+			{
+				theStream << ptheSlot->theName << " thread " << ptheSlot->theThreadId << (ptheSlot->isInUse ? "" : " (destroyed)")
+					<< " " << theHead << " work packages\n";
+				theFirst = (theHead > THREADIT_FLIGHT_RECORDS) ? (theHead - THREADIT_FLIGHT_RECORDS + 1) : 1;
+				for (ULONG theSequence = theFirst; theSequence <= theHead; theSequence++)
+				{
+					theRecord = ptheSlot->theRecords[(theSequence - 1) & (THREADIT_FLIGHT_RECORDS - 1)];
+					if (theRecord.theSequence == theSequence)
+					{
+						theStream << "  #" << theSequence << " at " << std::fixed << std::setprecision (6) << (theRecord.theTime / theFrequency)
+							<< "s instruction " << theRecord.theInstruction << " work pack " << theRecord.theWorkPackID
+							<< " source 0x" << std::hex << theRecord.theSource << std::dec;
+						if (theRecord.theStatus == THREADIT_FLIGHT_RUNNING)
+						{
+							theStream << " running\n";
+						}
+						else if (theRecord.theStatus == THREADIT_FLIGHT_NO_RESULT)
+						{
+							theStream << " no result " << theRecord.theElapsed << "us\n";
+						}
+						else
+						{
+							theStream << " status " << theRecord.theStatus << " " << theRecord.theElapsed << "us\n";
+						} // if
+					} // if
+				} // for
+			} // if
+		} // for
+	} // if
+} // write
+
+/**
+ * Method save writes the region as it is to a file.
+ */
+bool CThreadItFlightRecorder::save (const std::string& theFileName)
+{
+	return saveRegion (theFileName.c_str ());
+} // save
+
+/**
+ * Method installCrashHandler installs an unhandled exception filter that writes the
+ * region to a file. The name is copied now so the filter need not allocate memory.
+ */
+bool CThreadItFlightRecorder::installCrashHandler (const std::string& theFileName)
+{
+	bool isSuccess = false;
+
+	if ((m_ptheHeader != NULL) && (theFileName.size () < sizeof (m_theCrashFile)))
+	{
+		strncpy_s (m_theCrashFile, sizeof (m_theCrashFile), theFileName.c_str (), _TRUNCATE);
+		if (!m_isCrashHandler)
+		{
+			m_thePreviousFilter = SetUnhandledExceptionFilter (onCrash);
+			m_isCrashHandler = true;
+		} // if
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // installCrashHandler
+
+/**
+ * Method removeCrashHandler puts back the filter installed before installCrashHandler.
+ */
+void CThreadItFlightRecorder::removeCrashHandler ()
+{
+	if (m_isCrashHandler)
+	{
+		SetUnhandledExceptionFilter (m_thePreviousFilter);
+		m_thePreviousFilter = NULL;
+		m_isCrashHandler = false;
+	} // if
+} // removeCrashHandler
+
+/**
+ * Method onCrash is the unhandled exception filter. It writes the region and passes
+ * the exception on.
+ */
+LONG WINAPI CThreadItFlightRecorder::onCrash (EXCEPTION_POINTERS* ptheException)
+{
+	LONG theResult = EXCEPTION_CONTINUE_SEARCH;
+
+	saveRegion (m_theCrashFile);
+	if (m_thePreviousFilter != NULL)
+	{
+		theResult = m_thePreviousFilter (ptheException);
+	} // if
+	return theResult;
+} // onCrash
+
+/**
+ * Method saveRegion writes the region to a file without allocating memory.
+ */
+bool CThreadItFlightRecorder::saveRegion (const char* ptheFileName)
+{
+	bool isSuccess = false;
+	HANDLE theFile = INVALID_HANDLE_VALUE;
+	DWORD theWritten = 0;
+
+	if ((m_ptheHeader != NULL) && (ptheFileName[0] != '\0'))
+	{
+		theFile = CreateFileA (ptheFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (theFile != INVALID_HANDLE_VALUE)
+		{
+			isSuccess = ((WriteFile (theFile, m_ptheHeader, getRegionSize (), &theWritten, NULL) != FALSE) && (theWritten == getRegionSize ()));
+			CloseHandle (theFile);
+		} // if
+	} // if
+	return isSuccess;
+} // saveRegion
@@ -0,0 +1,280 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItFlightRecorder
+ * Description: Class CThreadItFlightRecorder keeps the last THREADIT_FLIGHT_RECORDS work
+ * packages dispatched by each CThreadIt so that the work in flight can be found after
+ * an instance wedges or the process crashes. It is always on. Each instance is given a
+ * slot when it is created and a record is claimed with one interlocked increment when
+ * a work package is dispatched, so no lock is taken. The record is completed with the
+ * status and the elapsed time once the worker method returns, so the work in progress
+ * is the record with the status THREADIT_FLIGHT_RUNNING.
+ *
+ * The slots are held in a region of THREADIT_FLIGHT_SLOTS slots set aside when the
+ * library is loaded. The region is a named shared memory section, "Local\threadit.flight.<pid>",
+ * so a tool can open it with OpenFileMapping and read it while the process runs, and
+ * it is part of a full memory dump of the process. The region starts with a
+ * FlightHeader that describes its layout. installCrashHandler installs an unhandled
+ * exception filter that writes the region to a file before the process ends, and
+ * write gives the records as text.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_FLIGHT_H)
+#define THREADIT_FLIGHT_H
+
+// Includes
+#include <windows.h>
+#include <string>
+#include <ostream>
+
+/** THREADIT_FLIGHT_SLOTS is the number of instances that can have a flight recorder at once. */
+#define THREADIT_FLIGHT_SLOTS 256
+/** THREADIT_FLIGHT_RECORDS is the number of records kept for each instance. It must be a power of two. */
+#define THREADIT_FLIGHT_RECORDS 64
+/** THREADIT_FLIGHT_NAME is the size of the name kept for each instance. */
+#define THREADIT_FLIGHT_NAME 48
+/** THREADIT_FLIGHT_MAGIC marks the start of the region ("TIFR"). */
+#define THREADIT_FLIGHT_MAGIC 0x52464954
+/** THREADIT_FLIGHT_VERSION is the version of the layout of the region. */
+#define THREADIT_FLIGHT_VERSION 1
+/** THREADIT_FLIGHT_RUNNING is the status of a record whose worker method has not returned. */
+#define THREADIT_FLIGHT_RUNNING 0xFFFFFFFF
+/** THREADIT_FLIGHT_NO_RESULT is the status of a record whose work package was kept by
+ * the worker method or by the result cache. */
+#define THREADIT_FLIGHT_NO_RESULT 0xFFFFFFFE
+
+// Forward Declarations
+class CActive;
+
+/**
+ * Class CThreadItFlightRecorder keeps the recent work packages of each CThreadIt in
+ * shared memory.
+ */
+class CThreadItFlightRecorder
+{
+	// types
+public:
+	/** FlightHeader describes the layout of the region. */
+	typedef struct FlightHeaderTag
+	{
+		/** theMagic is THREADIT_FLIGHT_MAGIC. */
+		DWORD theMagic;
+		/** theVersion is THREADIT_FLIGHT_VERSION. */
+		DWORD theVersion;
+		/** theProcessId is the process that writes the region. */
+		DWORD theProcessId;
+		/** theSlotCount is the number of slots that follow the header. */
+		DWORD theSlotCount;
+		/** theRecordCount is the number of records in each slot. */
+		DWORD theRecordCount;
+		/** theSlotSize is the size of a slot in bytes. */
+		DWORD theSlotSize;
+		/** theFrequency is the frequency of the performance counter of the record times. */
+		LONGLONG theFrequency;
+	} FlightHeader;
+
+	/** FlightRecord is the dispatch of a work package. */
+	typedef struct FlightRecordTag
+	{
+		/** theTime is the performance counter value when the work package was dispatched. */
+		LONGLONG theTime;
+		/** theSource is the address of the instance that sent the work package or zero. */
+		ULONGLONG theSource;
+		/** theSequence is the number of the record within the slot from one. It is
+		 * written last so a record whose sequence does not match its place is being written. */
+		volatile ULONG theSequence;
+		/** theInstruction is the instruction of the work package. */
+		ULONG theInstruction;
+		/** theWorkPackID is the ID given to the work package by startWork. */
+		ULONG theWorkPackID;
+		/** theStatus is the status of the result, THREADIT_FLIGHT_RUNNING or THREADIT_FLIGHT_NO_RESULT. */
+		volatile ULONG theStatus;
+		/** theElapsed is the time in microseconds from the dispatch to the return of the worker method. */
+		volatile ULONG theElapsed;
+		/** thePad keeps the records aligned. */
+		ULONG thePad;
+	} FlightRecord;
+
+	/** FlightSlot holds the records of an instance. */
+	typedef struct FlightSlotTag
+	{
+		/** isInUse is one while the slot belongs to an instance. The records of an
+		 * instance that has been destroyed are kept until the slot is used again. */
+		volatile LONG isInUse;
+		/** theThreadId is the thread of the instance. */
+		DWORD theThreadId;
+		/** theHead is the number of records written. */
+		volatile LONG theHead;
+		/** thePad keeps the records aligned. */
+		DWORD thePad;
+		/** theName is the name of the instance. */
+		char theName[THREADIT_FLIGHT_NAME];
+		/** theRecords are the records. Record n is kept at n - 1 modulo THREADIT_FLIGHT_RECORDS. */
+		FlightRecord theRecords[THREADIT_FLIGHT_RECORDS];
+	} FlightSlot;
+
+	// Attributes
+private:
+	/** m_theMapping is the shared memory section of the region. */
+	static HANDLE m_theMapping;
+	/** m_ptheHeader is the start of the region or NULL if it could not be created. */
+	static FlightHeader* m_ptheHeader;
+	/** m_ptheSlots are the slots of the region. */
+	static FlightSlot* m_ptheSlots;
+	/** m_theCrashFile is the file the region is written to by the crash handler. */
+	static char m_theCrashFile[MAX_PATH];
+	/** m_thePreviousFilter is the unhandled exception filter that was installed before. */
+	static LPTOP_LEVEL_EXCEPTION_FILTER m_thePreviousFilter;
+	/** m_isCrashHandler is true while the crash handler is installed. */
+	static bool m_isCrashHandler;
+	/** m_theInit is only used to set up the static attributes. */
+	static int m_theInit;
+
+	// Methods
+public:
+	/**
+	 * Method acquire gives a slot to an instance and clears its records.
+	 * @param[in] ptheObject is the instance.
+	 * \return the slot or NULL if there is no region or every slot is in use.
+	 */
+	static FlightSlot* acquire (CActive* ptheObject);
+
+	/**
+	 * Method release gives up the slot of an instance. Its records are kept.
+	 * @param[in] ptheSlot is the slot or NULL.
+	 */
+	static void release (FlightSlot* ptheSlot);
+
+	/**
+	 * Method begin claims a record for a work package that is dispatched.
+	 * @param[in] ptheSlot is the slot of the instance.
+	 * @param[in] theTime is the performance counter value now.
+	 * @param[in] theInstruction is the instruction of the work package.
+	 * @param[in] theWorkPackID is the ID of the work package.
+	 * @param[in] ptheSource is the instance that sent the work package or NULL.
+	 * \return the sequence of the record, which is passed to end.
+	 */
+	static ULONG begin (FlightSlot* ptheSlot, LONGLONG theTime, ULONG theInstruction, ULONG theWorkPackID, const void* ptheSource)
+	{
+		ULONG theSequence = (ULONG)InterlockedIncrement (&ptheSlot->theHead);
+		FlightRecord* ptheRecord = &ptheSlot->theRecords[(theSequence - 1) & (THREADIT_FLIGHT_RECORDS - 1)];
+
+		ptheRecord->theSequence = 0;
+		ptheRecord->theTime = theTime;
+		ptheRecord->theSource = (ULONGLONG)(ULONG_PTR)ptheSource;
+		ptheRecord->theInstruction = theInstruction;
+		ptheRecord->theWorkPackID = theWorkPackID;
+		ptheRecord->theStatus = THREADIT_FLIGHT_RUNNING;
+		ptheRecord->theElapsed = 0;
+		ptheRecord->theSequence = theSequence;
+		return theSequence;
+	} // begin
+
+	/**
+	 * Method end completes a record unless it has been claimed again since.
+	 * @param[in] ptheSlot is the slot of the instance.
+	 * @param[in] theSequence is the sequence returned by begin.
+	 * @param[in] theStatus is the status of the result.
+	 * @param[in] theElapsed is the time in microseconds since the dispatch.
+	 */
+	static void end (FlightSlot* ptheSlot, ULONG theSequence, ULONG theStatus, ULONG theElapsed)
+	{
+		FlightRecord* ptheRecord = &ptheSlot->theRecords[(theSequence - 1) & (THREADIT_FLIGHT_RECORDS - 1)];
+
+		if (ptheRecord->theSequence == theSequence)
+		{
+			ptheRecord->theElapsed = theElapsed;
+			ptheRecord->theStatus = theStatus;
+		} // if
+	} // end
+
+	/**
+	 * Method isAvailable returns true if the region was created.
+	 */
+	static bool isAvailable ();
+
+	/**
+	 * Method getMappingName returns the name of the shared memory section of a process.
+	 * @param[in] theProcessId is the process.
+	 */
+	static std::string getMappingName (DWORD theProcessId);
+
+	/**
+	 * Method write writes the records of every slot that has been used as text, the
+	 * oldest first for each instance.
+	 * @param[in] theStream is the stream written to.
+	 */
+	static void write (std::ostream& theStream);
+
+	/**
+	 * Method save writes the region as it is to a file.
+	 * @param[in] theFileName is the name of the file.
+	 * \return true if the file was written.
+	 */
+	static bool save (const std::string& theFileName);
+
+	/**
+	 * Method installCrashHandler installs an unhandled exception filter that writes the
+	 * region to a file and then passes the exception to the filter installed before.
+	 * @param[in] theFileName is the name of the file.
+	 * \return false if the name is too long or there is no region.
+	 */
+	static bool installCrashHandler (const std::string& theFileName);
+
+	/**
+	 * Method removeCrashHandler puts back the filter installed before installCrashHandler.
+	 */
+	static void removeCrashHandler ();
+
+private:
+	/**
+	 * Method onCrash is the unhandled exception filter. It only calls functions of the
+	 * system as the heap may be damaged.
+	 */
+	static LONG WINAPI onCrash (EXCEPTION_POINTERS* ptheException);
+
+	/**
+	 * Method saveRegion writes the region to a file without allocating memory.
+	 * @param[in] ptheFileName is the name of the file.
+	 * \return true if the file was written.
+	 */
+	static bool saveRegion (const char* ptheFileName);
+
+	/**
+	 * Method getRegionSize returns the size of the region in bytes.
+	 */
+	static DWORD getRegionSize ();
+
+	/**
+	 * Method initialise creates the region. It always returns zero.
+	 */
+	static int initialise ();
+
+	/// not copiable
+	CThreadItFlightRecorder ();
+	CThreadItFlightRecorder (const CThreadItFlightRecorder&);
+	const CThreadItFlightRecorder& operator= (const CThreadItFlightRecorder&);
+
+}; // class CThreadItFlightRecorder
+
+#endif // !defined (THREADIT_FLIGHT_H)
@@ -0,0 +1,429 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItHedger
+ * Description: Class CThreadItHedger sends hedged requests to replicas. See the
+ * header file for the description of the hedging and the budget.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <algorithm>
+#include "threadithedger.h"
+
+// Class: CThreadItHedgeTimer Implementation
+
+/**
+ * Constructor CThreadItHedgeTimer starts the periodic check of the hedger.
+ */
+CThreadItHedgeTimer::CThreadItHedgeTimer (CThreadItHedger* ptheHedger) : CThreadIt ("threadit.CThreadItHedgeTimer")
+{
+	m_ptheHedger = ptheHedger;
+	setPeriodicMethod ((PeriodicMethodType)&CThreadItHedgeTimer::checkHedges);
+	setPeriod (THREADIT_HEDGE_PERIOD);
+} // constructor CThreadItHedgeTimer
+
+/**
+ * Method ~CThreadItHedgeTimer stops the thread.
+ */
+CThreadItHedgeTimer::~CThreadItHedgeTimer ()
+{
+	stopThread ();
+	waitForThreadToStop ();
+} // ~CThreadItHedgeTimer
+
+/**
+ * Method checkHedges is the periodic method. It asks the hedger to send the hedges
+ * that are due.
+ */
+bool CThreadItHedgeTimer::checkHedges (CWorkPackIt theTimedWork, CWorkPackIt*& ptheWorkDone)
+{
+	ptheWorkDone = NULL;
+	m_ptheHedger->sendHedges ();
+	// There is no result to send.
+	return false;
+} // checkHedges
+
+// Class: CThreadItHedger Implementation
+
+/**
+ * Constructor CThreadItHedger creates a hedger without replicas.
+ */
+CThreadItHedger::CThreadItHedger (ULONG theBudgetPercent)
+{
+	LARGE_INTEGER theFrequency;
+
+	m_ptheLogger = &(log4cpp::Category::getInstance ("threadit.CThreadItHedger"));
+	for (UINT theInstruction = 0; theInstruction < CThreadIt::MAX_WORK_METHODS; theInstruction++)
+	{
+		m_isIdempotent[theInstruction] = false;
+	} // for
+	m_theBudgetPercent = (LONG)std::min<ULONG> (theBudgetPercent, 100);
+	m_theBudget = 0;
+	m_theNextRequest = 0;
+	m_theNext = 0;
+	m_theLatencies.resize (THREADIT_HEDGE_WINDOW);
+	m_theSorted.reserve (THREADIT_HEDGE_WINDOW);
+	m_theLatencyCount = 0;
+	m_theHedgeDelay = 0;
+	QueryPerformanceFrequency (&theFrequency);
+	m_theFrequency = theFrequency.QuadPart;
+	m_theRequestCount = 0;
+	m_theHedgesIssued = 0;
+	m_theHedgesWon = 0;
+	InitializeCriticalSection (&m_theAccess);
+	m_ptheTimer = new CThreadItHedgeTimer (this);
+} // constructor CThreadItHedger
+
+/**
+ * Method ~CThreadItHedger stops the timer, frees the copies kept for hedges and
+ * releases the replicas.
+ */
+CThreadItHedger::~CThreadItHedger ()
+{
+	delete m_ptheTimer;
+	m_ptheTimer = NULL;
+	if (!m_theRequests.empty ())
+	{
+		m_ptheLogger->error ("hedger destroyed while work is in progress");
+	} // if
+	for (RequestMap::iterator theRequest = m_theRequests.begin (); theRequest != m_theRequests.end (); theRequest++)
+	{
+		delete theRequest->second.ptheCopy;
+	} // for
+	m_theRequests.clear ();
+	m_theReplicas.clear ();
+	DeleteCriticalSection (&m_theAccess);
+} // ~CThreadItHedger
+
+/**
+ * Method addReplica adds a replica.
+ */
+void CThreadItHedger::addReplica (const ThreadItPtr& ptheReplica)
+{
+	if (ptheReplica)
+	{
+		m_theReplicas.push_back (ptheReplica);
+	} // if
+} // addReplica
+
+/**
+ * Method getReplicaCount returns the number of replicas.
+ */
+ULONG CThreadItHedger::getReplicaCount () const
+{
+	return (ULONG)m_theReplicas.size ();
+} // getReplicaCount
+
+/**
+ * Method getReplica returns a replica or an empty pointer if there is none.
+ */
+ThreadItPtr CThreadItHedger::getReplica (ULONG theReplica) const
+{
+	ThreadItPtr ptheReplica;
+
+	if (theReplica < m_theReplicas.size ())
+	{
+		ptheReplica = m_theReplicas[theReplica];
+	} // if
+	return ptheReplica;
+} // getReplica
+
+/**
+ * Method setIdempotent marks an instruction as safe to process twice.
+ */
+bool CThreadItHedger::setIdempotent (UINT theInstruction, bool isIdempotent)
+{
+	bool isSuccess = false;
+
+	if (theInstruction < CThreadIt::MAX_WORK_METHODS)
+	{
+		m_isIdempotent[theInstruction] = isIdempotent;
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // setIdempotent
+
+/**
+ * Method isIdempotent returns true if an instruction may be hedged.
+ */
+bool CThreadItHedger::isIdempotent (UINT theInstruction) const
+{
+	return ((theInstruction < CThreadIt::MAX_WORK_METHODS) && m_isIdempotent[theInstruction]);
+} // isIdempotent
+
+/**
+ * Method selectReplica returns the replica with the fewest work packages queued
+ * other than theExcluded. The search starts at a different replica each time so
+ * that equally loaded replicas share the work.
+ */
+ULONG CThreadItHedger::selectReplica (ULONG theExcluded)
+{
+	ULONG theCount = (ULONG)m_theReplicas.size ();
+	ULONG theBest = ULONG_MAX;
+	ULONG theReplica = 0;
+	ULONG theStart = 0;
+	LONG theDepth = 0;
+	LONG theBestDepth = 0;
+
+	if (theCount > 0)
+	{
+		theStart = (ULONG)InterlockedIncrement (&m_theNext) % theCount;
+		for (ULONG i = 0; i < theCount; i++)
+		{
+			theReplica = (theStart + i) % theCount;
+			if (theReplica != theExcluded)
+			{
+				theDepth = m_theReplicas[theReplica]->getWorkQDepth ();
+				if ((theBest == ULONG_MAX) || (theDepth < theBestDepth))
+				{
+					theBest = theReplica;
+					theBestDepth = theDepth;
+				} // if
+			} // if
+		} // for
+	} // if
+	return theBest;
+} // selectReplica
+
+/**
+ * Method startWork sends a work package to the least loaded replica. A copy is kept
+ * for a hedge if the instruction is idempotent, there is another replica and the
+ * work package can be processed twice safely.
+ */
+bool CThreadItHedger::startWork (CWorkPackIt*& pWorkPack, ULONG& WorkPackID)
+{
+	bool isSuccess = false;
+	ULONG theReplica = selectReplica (ULONG_MAX);
+	ULONG theReplicaWorkPackID = 0;
+	LARGE_INTEGER theNow;
+	Request theRequest;
+
+	if ((theReplica != ULONG_MAX) && (pWorkPack != NULL))
+	{
+		theRequest.ptheCopy = NULL;
+		// The object of a work package is freed by the replica that processes it and a
+		// result sent to the default queue would be left with the replica that won.
+		if ((m_theReplicas.size () > 1) && isIdempotent (pWorkPack->m_theInstruction) && (pWorkPack->m_ptheObject == NULL) &&
+			(!pWorkPack->m_isSendResult || !pWorkPack->m_isUseDefaultQ))
+		{
+			// The copy does not take the completion of the work package.
+			theRequest.ptheCopy = new CWorkPackIt (*pWorkPack);
+		} // if
+		theRequest.theReplica = theReplica;
+		theRequest.theOutstanding = 1;
+		theRequest.isDone = false;
+		// The completion of the work package is called by the hedger for the result that wins.
+		theRequest.ptheCompletion = pWorkPack->m_ptheCompletion;
+		theRequest.theCompletionTag = pWorkPack->m_theCompletionTag;
+		QueryPerformanceCounter (&theNow);
+		theRequest.theSendTime = theNow.QuadPart;
+		// Record the request before it is sent as it may complete straight away.
+		EnterCriticalSection (&m_theAccess);
+		m_theNextRequest = (m_theNextRequest == ULONG_MAX) ? 1 : m_theNextRequest + 1;
+		WorkPackID = m_theNextRequest;
+		m_theRequests[WorkPackID] = theRequest;
+		if (theRequest.ptheCopy != NULL)
+		{
+			m_theBudget = std::min<LONG> (m_theBudget + m_theBudgetPercent, THREADIT_HEDGE_BURST * 100);
+		} // if
+		LeaveCriticalSection (&m_theAccess);
+		InterlockedIncrement (&m_theRequestCount);
+		pWorkPack->m_ptheCompletion = this;
+		pWorkPack->m_theCompletionTag = WorkPackID;
+		isSuccess = m_theReplicas[theReplica]->startWork (pWorkPack, theReplicaWorkPackID);
+	}
+	else
+	{
+		m_ptheLogger->error ("work package not sent - no work package or no replicas");
+	} // if
+	return isSuccess;
+} // startWork
+
+/**
+ * Method onWorkDone is called on the replica thread when a copy of a request is
+ * done. The first result is given the identity of the request and returned and the
+ * completion of the work package is told of it. The result of the other copy is
+ * freed instead of being sent.
+ */
+void CThreadItHedger::onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess)
+{
+	LARGE_INTEGER theNow;
+	RequestMap::iterator theRequest;
+	CThreadItCompletion* ptheCompletion = NULL;
+	ULONG theCompletionTag = 0;
+
+	QueryPerformanceCounter (&theNow);
+	EnterCriticalSection (&m_theAccess);
+	theRequest = m_theRequests.find (theTag);
+	if (theRequest != m_theRequests.end ())
+	{
+		theRequest->second.theOutstanding--;
+		if (!theRequest->second.isDone)
+		{
+			theRequest->second.isDone = true;
+			// A hedge that has not been sent is no longer needed.
+			delete theRequest->second.ptheCopy;
+			theRequest->second.ptheCopy = NULL;
+			if (ptheWorker != m_theReplicas[theRequest->second.theReplica].get ())
+			{
+				InterlockedIncrement (&m_theHedgesWon);
+			} // if
+			m_theLatencies[m_theLatencyCount % THREADIT_HEDGE_WINDOW] = theNow.QuadPart - theRequest->second.theSendTime;
+			m_theLatencyCount++;
+			if (ptheWorkDone != NULL)
+			{
+				ptheWorkDone->m_theWorkPackID = theTag;
+				// The result is returned with the completion the work package named.
+				ptheWorkDone->m_ptheCompletion = theRequest->second.ptheCompletion;
+				ptheWorkDone->m_theCompletionTag = theRequest->second.theCompletionTag;
+			} // if
+			ptheCompletion = theRequest->second.ptheCompletion;
+			theCompletionTag = theRequest->second.theCompletionTag;
+		}
+		else if (ptheWorkDone != NULL)
+		{
+			// The other copy has won so the result is discarded.
+			ptheWorkDone->m_isSendResult = false;
+			ptheWorkDone->m_isNotifyWithCallback = false;
+		} // if
+		if (theRequest->second.theOutstanding == 0)
+		{
+			m_theRequests.erase (theRequest);
+		} // if
+	} // if
+	LeaveCriticalSection (&m_theAccess);
+	// The completion of the caller is told once the lock is released as it may send work.
+	if (ptheCompletion != NULL)
+	{
+		ptheCompletion->onWorkDone (ptheWorker, theCompletionTag, ptheWorkDone, isSuccess);
+	} // if
+} // onWorkDone
+
+/**
+ * Method updateHedgeDelay sets the hedge delay to the 95th percentile of the recent
+ * latencies. It is called with m_theAccess held.
+ */
+void CThreadItHedger::updateHedgeDelay ()
+{
+	ULONG theSamples = std::min<ULONG> (m_theLatencyCount, THREADIT_HEDGE_WINDOW);
+	ULONG thePercentile = 0;
+
+	if (theSamples >= THREADIT_HEDGE_MIN_SAMPLES)
+	{
+		m_theSorted.assign (m_theLatencies.begin (), m_theLatencies.begin () + theSamples);
+		thePercentile = (theSamples * 95) / 100;
+		std::nth_element (m_theSorted.begin (), m_theSorted.begin () + thePercentile, m_theSorted.end ());
+		m_theHedgeDelay = m_theSorted[thePercentile];
+	} // if
+} // updateHedgeDelay
+
+/**
+ * Method sendHedges sends a copy of each request that has waited longer than the
+ * hedge delay while the budget allows. The copies are sent once the lock is released.
+ */
+void CThreadItHedger::sendHedges ()
+{
+	LARGE_INTEGER theNow;
+	ULONG theWorkPackID = 0;
+	ULONG theReplica = 0;
+	CWorkPackIt* ptheHedge = NULL;
+	std::vector<std::pair<CWorkPackIt*, ULONG> > theHedges;
+
+	QueryPerformanceCounter (&theNow);
+	EnterCriticalSection (&m_theAccess);
+	updateHedgeDelay ();
+	if (m_theHedgeDelay > 0)
+	{
+		for (RequestMap::iterator theRequest = m_theRequests.begin (); (theRequest != m_theRequests.end ()) && (m_theBudget >= 100); theRequest++)
+		{
+			if ((theRequest->second.ptheCopy != NULL) && (theNow.QuadPart - theRequest->second.theSendTime > m_theHedgeDelay))
+			{
+				theReplica = selectReplica (theRequest->second.theReplica);
+				ptheHedge = theRequest->second.ptheCopy;
+				ptheHedge->m_ptheCompletion = this;
+				ptheHedge->m_theCompletionTag = theRequest->first;
+				theRequest->second.ptheCopy = NULL;
+				theRequest->second.theOutstanding++;
+				m_theBudget -= 100;
+				InterlockedIncrement (&m_theHedgesIssued);
+				theHedges.push_back (std::make_pair (ptheHedge, theReplica));
+			} // if
+		} // for
+	} // if
+	LeaveCriticalSection (&m_theAccess);
+	for (size_t theHedge = 0; theHedge < theHedges.size (); theHedge++)
+	{
+		m_theReplicas[theHedges[theHedge].second]->startWork (theHedges[theHedge].first, theWorkPackID);
+	} // for
+} // sendHedges
+
+/**
+ * Method getHedgeDelay returns the time after which a request is hedged in microseconds.
+ */
+LONGLONG CThreadItHedger::getHedgeDelay ()
+{
+	LONGLONG theDelay = 0;
+
+	EnterCriticalSection (&m_theAccess);
+	theDelay = (m_theHedgeDelay * 1000000) / m_theFrequency;
+	LeaveCriticalSection (&m_theAccess);
+	return theDelay;
+} // getHedgeDelay
+
+/**
+ * Method getRequestCount returns the number of requests sent.
+ */
+LONG CThreadItHedger::getRequestCount () const
+{
+	return m_theRequestCount;
+} // getRequestCount
+
+/**
+ * Method getHedgesIssued returns the number of hedges sent.
+ */
+LONG CThreadItHedger::getHedgesIssued () const
+{
+	return m_theHedgesIssued;
+} // getHedgesIssued
+
+/**
+ * Method getHedgesWon returns the number of hedges that returned the result.
+ */
+LONG CThreadItHedger::getHedgesWon () const
+{
+	return m_theHedgesWon;
+} // getHedgesWon
+
+/**
+ * Method getOutstandingCount returns the number of requests with a copy still in progress.
+ */
+ULONG CThreadItHedger::getOutstandingCount ()
+{
+	ULONG theCount = 0;
+
+	EnterCriticalSection (&m_theAccess);
+	theCount = (ULONG)m_theRequests.size ();
+	LeaveCriticalSection (&m_theAccess);
+	return theCount;
+} // getOutstandingCount
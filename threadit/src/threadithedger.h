@@ -0,0 +1,289 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItHedger
+ * Description: Class CThreadItHedger fronts a set of identical CThreadIt replicas
+ * and sends hedged requests to cut the tail latency of idempotent work. A work
+ * package is sent to the replica with the fewest work packages queued. If it has
+ * not completed once the observed 95th percentile latency of the group has passed
+ * and its instruction is marked idempotent, a copy is sent to another replica. The
+ * first result is returned and the other is discarded when it completes.
+ *
+ * The extra load is capped by a budget. Each request earns a share of a hedge (5%
+ * by default) and a hedge is only sent when a whole one has been earned, so the
+ * hedges never exceed the budget fraction of the requests. Up to
+ * THREADIT_HEDGE_BURST hedges can be saved up for a burst of slow requests.
+ *
+ * The hedger tracks each request with the completion of the work package (see
+ * CThreadItCompletion). A completion named by the work package is kept by the
+ * hedger and called once, for the result that wins. The identity returned by
+ * startWork is given by the hedger and is set as m_theWorkPackID of the result
+ * whichever replica wins.
+ *
+ * A work package is only hedged if both copies can be processed safely. A work
+ * package that carries m_ptheObject is never hedged as the object is freed by the
+ * replica that processes it and cannot be shared by two copies; use m_ptheDataItem
+ * for the data of an idempotent request. A result may come from any replica so a
+ * work package that asks for its result must name m_ptheWorkDoneQ to be hedged;
+ * one that uses the default queue of the replica is sent without a hedge. The
+ * copies are checked by a timer thread every THREADIT_HEDGE_PERIOD milliseconds
+ * so a hedge is sent up to a timer tick after the delay has passed. The replicas
+ * must be added before work is sent and the hedger must not be destroyed while
+ * work sent through it is in progress.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_HEDGER_H)
+#define THREADIT_HEDGER_H
+
+// Includes
+#include <vector>
+#include <unordered_map>
+#include "threadit.h"
+#include "threaditcompletion.h"
+
+/** THREADIT_HEDGE_WINDOW is the number of recent latencies the percentile is taken from. */
+#define THREADIT_HEDGE_WINDOW 256
+/** THREADIT_HEDGE_MIN_SAMPLES is the number of latencies needed before hedging starts. */
+#define THREADIT_HEDGE_MIN_SAMPLES 32
+/** THREADIT_HEDGE_BURST is the number of unused hedges that can be saved up. */
+#define THREADIT_HEDGE_BURST 10
+/** THREADIT_HEDGE_PERIOD is the period in milliseconds of the hedge check. */
+#define THREADIT_HEDGE_PERIOD 1
+
+// Forward Declarations
+class CThreadItHedger;
+
+/**
+ * Class CThreadItHedgeTimer is the timer thread of a CThreadItHedger.
+ */
+class CThreadItHedgeTimer : public CThreadIt
+{
+	// Attributes
+private:
+	/** m_ptheHedger is the hedger whose requests are checked. */
+	CThreadItHedger* m_ptheHedger;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItHedgeTimer starts the periodic check of the hedger.
+	 */
+	CThreadItHedgeTimer (CThreadItHedger* ptheHedger);
+
+	/**
+	 * Method ~CThreadItHedgeTimer stops the thread.
+	 */
+	virtual ~CThreadItHedgeTimer ();
+
+protected:
+	/**
+	 * Method checkHedges is the periodic method. It asks the hedger to send the
+	 * hedges that are due.
+	 */
+	bool checkHedges (CWorkPackIt theTimedWork, CWorkPackIt*& ptheWorkDone);
+
+}; // class CThreadItHedgeTimer
+
+/**
+ * Class CThreadItHedger sends hedged requests to replicas.
+ */
+class CThreadItHedger : public CThreadItCompletion
+{
+	friend class CThreadItHedgeTimer;
+
+	// types
+private:
+	/** Request is a work package sent through the hedger that has not completed. */
+	typedef struct RequestTag
+	{
+		/** ptheCopy is the copy kept for a hedge. It is NULL if the instruction is not
+		 * idempotent or once the hedge is sent. */
+		CWorkPackIt* ptheCopy;
+		/** theSendTime is the performance counter when the request was sent. */
+		LONGLONG theSendTime;
+		/** theReplica is the replica the request was sent to first. */
+		ULONG theReplica;
+		/** theOutstanding is the number of copies of the request not yet completed. */
+		LONG theOutstanding;
+		/** isDone is true once the first result has been returned. */
+		bool isDone;
+		/** ptheCompletion is the completion named by the work package. It is called
+		 * for the result that wins. */
+		CThreadItCompletion* ptheCompletion;
+		/** theCompletionTag is the completion tag named by the work package. */
+		ULONG theCompletionTag;
+	} Request;
+
+	/** RequestMap holds the requests in progress by their identity. */
+	typedef std::unordered_map<ULONG, Request> RequestMap;
+
+	// Attributes
+private:
+	/** m_theReplicas are the replicas work is sent to. */
+	std::vector<ThreadItPtr> m_theReplicas;
+	/** m_isIdempotent marks the instructions that may be hedged. */
+	bool m_isIdempotent[CThreadIt::MAX_WORK_METHODS];
+	/** m_theBudgetPercent is the share of a hedge earned by each request in percent. */
+	LONG m_theBudgetPercent;
+	/** m_theBudget is the budget saved up in hundredths of a hedge. */
+	LONG m_theBudget;
+	/** m_theRequests are the requests in progress. */
+	RequestMap m_theRequests;
+	/** m_theNextRequest is the identity of the last request. */
+	ULONG m_theNextRequest;
+	/** m_theNext is the position the search for the least loaded replica starts at. */
+	volatile LONG m_theNext;
+	/** m_theLatencies are the most recent latencies in performance counter ticks. */
+	std::vector<LONGLONG> m_theLatencies;
+	/** m_theSorted is used to find the percentile without changing m_theLatencies. */
+	std::vector<LONGLONG> m_theSorted;
+	/** m_theLatencyCount is the number of latencies recorded. */
+	ULONG m_theLatencyCount;
+	/** m_theHedgeDelay is the time after which a request is hedged in performance
+	 * counter ticks. It is zero until there are enough latencies. */
+	LONGLONG m_theHedgeDelay;
+	/** m_theFrequency is the performance counter frequency. */
+	LONGLONG m_theFrequency;
+	/** m_theRequestCount is the number of requests sent. */
+	volatile LONG m_theRequestCount;
+	/** m_theHedgesIssued is the number of hedges sent. */
+	volatile LONG m_theHedgesIssued;
+	/** m_theHedgesWon is the number of hedges that returned the result. */
+	volatile LONG m_theHedgesWon;
+	/** m_theAccess protects the requests, the budget and the latencies. */
+	CRITICAL_SECTION m_theAccess;
+	/** m_ptheTimer checks the requests for hedges that are due. */
+	CThreadItHedgeTimer* m_ptheTimer;
+	/** m_ptheLogger is the logger used to log information and errors. */
+	log4cpp::Category* m_ptheLogger;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItHedger creates a hedger without replicas.
+	 * @param[in] theBudgetPercent is the most hedges sent as a percentage of the requests.
+	 */
+	CThreadItHedger (ULONG theBudgetPercent = 5);
+
+	/**
+	 * Method ~CThreadItHedger stops the timer, frees the copies kept for hedges and
+	 * releases the replicas.
+	 */
+	virtual ~CThreadItHedger ();
+
+	/**
+	 * Method addReplica adds a replica. All replicas must be added before work is sent.
+	 */
+	void addReplica (const ThreadItPtr& ptheReplica);
+
+	/**
+	 * Method getReplicaCount returns the number of replicas.
+	 */
+	ULONG getReplicaCount () const;
+
+	/**
+	 * Method getReplica returns a replica or an empty pointer if there is none.
+	 */
+	ThreadItPtr getReplica (ULONG theReplica) const;
+
+	/**
+	 * Method setIdempotent marks an instruction as safe to process twice. Only the
+	 * work packages of idempotent instructions are hedged.
+	 * \return true if the instruction is valid.
+	 */
+	bool setIdempotent (UINT theInstruction, bool isIdempotent);
+
+	/**
+	 * Method isIdempotent returns true if an instruction may be hedged.
+	 */
+	bool isIdempotent (UINT theInstruction) const;
+
+	/**
+	 * Method startWork sends a work package to the least loaded replica.
+	 * @param[in] pWorkPack is the work package. Ownership passes to the replica.
+	 * @param[out] WorkPackID is the identity of the request. It is set as the
+	 * m_theWorkPackID of the result.
+	 * \return true if the work package is sent.
+	 */
+	bool startWork (CWorkPackIt*& pWorkPack, ULONG& WorkPackID);
+
+	/**
+	 * Method onWorkDone is called on the replica thread when a copy of a request is
+	 * done. The first result of a request is returned and the other is discarded.
+	 */
+	virtual void onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess);
+
+	/**
+	 * Method getHedgeDelay returns the time after which a request is hedged in
+	 * microseconds. It is zero until enough requests have completed.
+	 */
+	LONGLONG getHedgeDelay ();
+
+	/**
+	 * Method getRequestCount returns the number of requests sent.
+	 */
+	LONG getRequestCount () const;
+
+	/**
+	 * Method getHedgesIssued returns the number of hedges sent.
+	 */
+	LONG getHedgesIssued () const;
+
+	/**
+	 * Method getHedgesWon returns the number of hedges that returned the result
+	 * before the request they copied.
+	 */
+	LONG getHedgesWon () const;
+
+	/**
+	 * Method getOutstandingCount returns the number of requests with a copy still
+	 * in progress.
+	 */
+	ULONG getOutstandingCount ();
+
+private:
+	/**
+	 * Method selectReplica returns the replica with the fewest work packages queued
+	 * other than theExcluded.
+	 */
+	ULONG selectReplica (ULONG theExcluded);
+
+	/**
+	 * Method updateHedgeDelay sets the hedge delay to the 95th percentile of the
+	 * recent latencies. It is called with m_theAccess held.
+	 */
+	void updateHedgeDelay ();
+
+	/**
+	 * Method sendHedges sends a copy of each request that has waited longer than the
+	 * hedge delay while the budget allows. It is called by the timer.
+	 */
+	void sendHedges ();
+
+	/// not copiable
+	CThreadItHedger (const CThreadItHedger&);
+	const CThreadItHedger& operator= (const CThreadItHedger&);
+
+}; // class CThreadItHedger
+
+#endif // !defined (THREADIT_HEDGER_H)
@@ -0,0 +1,322 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItHistogram
+ * Description: Class CThreadItHistogram counts times in log-linear buckets. See the
+ * header file for the layout of the buckets.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <intrin.h>
+#include <limits.h>
+#include "threadithistogram.h"
+
+// Class: CThreadItHistogram Implementation
+
+/**
+ * Constructor CThreadItHistogram creates an empty histogram.
+ */
+CThreadItHistogram::CThreadItHistogram ()
+{
+	reset ();
+} // constructor CThreadItHistogram
+
+/**
+ * Constructor CThreadItHistogram creates a snapshot of another histogram.
+ */
+CThreadItHistogram::CThreadItHistogram (const CThreadItHistogram& theOther)
+{
+	reset ();
+	merge (theOther);
+} // constructor CThreadItHistogram
+
+/**
+ * Method operator= replaces the counts with a snapshot of another histogram.
+ */
+CThreadItHistogram& CThreadItHistogram::operator= (const CThreadItHistogram& theOther)
+{
+	if (this != &theOther)
+	{
+		reset ();
+		merge (theOther);
+	} // if
+	return *this;
+} // operator=
+
+/**
+ * Method record counts a time. It may be called from any thread.
+ */
+void CThreadItHistogram::record (LONGLONG theTime)
+{
+	ULONG theValue = 0;
+	LONG theNewMax = 0;
+	LONG theMax = 0;
+	LONG theSeen = 0;
+
+	if (theTime > 0)
+	{
+		theValue = (theTime > ULONG_MAX) ? ULONG_MAX : (ULONG)theTime;
+	} // if
+	InterlockedIncrement (&m_theCounts[getBucket (theValue)]);
+	InterlockedExchangeAdd64 (&m_theTotal, theValue);
+	// The longest time seldom changes so it is read before it is swapped.
+	theNewMax = (theValue > LONG_MAX) ? LONG_MAX : (LONG)theValue;
+	theMax = m_theMax;
+	while (theMax < theNewMax)
+	{
+		theSeen = InterlockedCompareExchange (&m_theMax, theNewMax, theMax);
+		theMax = (theSeen == theMax) ? theNewMax : theSeen;
+	} // while
+} // record
+
+/**
+ * Method merge adds the counts of another histogram to this one.
+ */
+void CThreadItHistogram::merge (const CThreadItHistogram& theOther)
+{
+	LONG theCount = 0;
+	LONG theMax = theOther.m_theMax;
+
+	for (ULONG theBucket = 0; theBucket < THREADIT_HISTOGRAM_BUCKETS; theBucket++)
+	{
+		theCount = theOther.m_theCounts[theBucket];
+		if (theCount != 0)
+		{
+			InterlockedExchangeAdd (&m_theCounts[theBucket], theCount);
+		} // if
+	} // for
+	InterlockedExchangeAdd64 (&m_theTotal, theOther.m_theTotal);
+	if (theMax > m_theMax)
+	{
+		InterlockedExchange (&m_theMax, theMax);
+	} // if
+} // merge
+
+/**
+ * Method subtract takes the counts of an older snapshot away from this snapshot.
+ */
+void CThreadItHistogram::subtract (const CThreadItHistogram& theOlder)
+{
+	LONG theCount = 0;
+	LONGLONG theTotal = theOlder.m_theTotal;
+
+	for (ULONG theBucket = 0; theBucket < THREADIT_HISTOGRAM_BUCKETS; theBucket++)
+	{
+		theCount = theOlder.m_theCounts[theBucket];
+		m_theCounts[theBucket] = (m_theCounts[theBucket] > theCount) ? (m_theCounts[theBucket] - theCount) : 0;
+	} // for
+	m_theTotal = (m_theTotal > theTotal) ? (m_theTotal - theTotal) : 0;
+} // subtract
+
+/**
+ * Method reset clears the counts.
+ */
+void CThreadItHistogram::reset ()
+{
+	for (ULONG theBucket = 0; theBucket < THREADIT_HISTOGRAM_BUCKETS; theBucket++)
+	{
+		m_theCounts[theBucket] = 0;
+	} // for
+	m_theTotal = 0;
+	m_theMax = 0;
+} // reset
+
+/**
+ * Method getCount returns the number of times recorded.
+ */
+ULONG CThreadItHistogram::getCount () const
+{
+	ULONG theCount = 0;
+
+	for (ULONG theBucket = 0; theBucket < THREADIT_HISTOGRAM_BUCKETS; theBucket++)
+	{
+		theCount += (ULONG)m_theCounts[theBucket];
+	} // for
+	return theCount;
+} // getCount
+
+/**
+ * Method getMean returns the mean of the times recorded in microseconds.
+ */
+LONGLONG CThreadItHistogram::getMean () const
+{
+	LONGLONG theMean = 0;
+	ULONG theCount = getCount ();
+
+	if (theCount > 0)
+	{
+		theMean = m_theTotal / theCount;
+	} // if
+	return theMean;
+} // getMean
+
+/**
+ * Method getMax returns the longest time recorded in microseconds.
+ */
+LONGLONG CThreadItHistogram::getMax () const
+{
+	return m_theMax;
+} // getMax
+
+/**
+ * Method getPercentile returns the time in microseconds that the given percentage
+ * of the times recorded did not exceed.
+ */
+LONGLONG CThreadItHistogram::getPercentile (double thePercentile) const
+{
+	LONGLONG theTime = 0;
+	ULONG theCounts[THREADIT_HISTOGRAM_BUCKETS];
+	ULONG theCount = 0;
+	ULONG theRank = 0;
+	ULONG theSeen = 0;
+	ULONG theBucket = 0;
+	bool isFound = false;
+
+	// Take one copy of the counts so that the rank and the search agree.
+	for (theBucket = 0; theBucket < THREADIT_HISTOGRAM_BUCKETS; theBucket++)
+	{
+		theCounts[theBucket] = (ULONG)m_theCounts[theBucket];
+		theCount += theCounts[theBucket];
+	} // for
+	if (theCount > 0)
+	{
+		if (thePercentile < 0.0)
+		{
+			thePercentile = 0.0;
+		}
+		else if (thePercentile > 100.0)
+		{
+			thePercentile = 100.0;
+		} // if
+		// The rank is the number of times at or below the percentile, at least one.
+		theRank = (ULONG)(((thePercentile * theCount) / 100.0) + 0.5);
+		if (theRank == 0)
+		{
+			theRank = 1;
+		} // if
+		theBucket = 0;
+		while ((theBucket < THREADIT_HISTOGRAM_BUCKETS) && !isFound)
+		{
+			theSeen += theCounts[theBucket];
+			if (theSeen >= theRank)
+			{
+				theTime = getBucketHigh (theBucket);
+				isFound = true;
+			} // if
+			theBucket++;
+		} // while
+		if (theTime > m_theMax)
+		{
+			theTime = m_theMax;
+		} // if
+	} // if
+	return theTime;
+} // getPercentile
+
+/**
+ * Method getBucket returns the bucket a time is counted in. Times below
+ * THREADIT_HISTOGRAM_SUB_BUCKETS are their own bucket. Otherwise the highest bit
+ * selects the power of two and the bits below it select the bucket within it.
+ */
+ULONG CThreadItHistogram::getBucket (ULONG theTime)
+{
+	ULONG theBucket = theTime;
+	ULONG theHighBit = 0;
+
+	if (theTime >= THREADIT_HISTOGRAM_SUB_BUCKETS)
+	{
+		_BitScanReverse (&theHighBit, theTime);
+		theBucket = ((theHighBit - THREADIT_HISTOGRAM_SUB_BITS + 1) * THREADIT_HISTOGRAM_SUB_BUCKETS) +
+			((theTime >> (theHighBit - THREADIT_HISTOGRAM_SUB_BITS)) & (THREADIT_HISTOGRAM_SUB_BUCKETS - 1));
+	} // if
+	return theBucket;
+} // getBucket
+
+/**
+ * Method getBucketLow returns the lowest time counted in a bucket.
+ */
+ULONG CThreadItHistogram::getBucketLow (ULONG theBucket)
+{
+	ULONG theLow = theBucket;
+	ULONG theGroup = theBucket / THREADIT_HISTOGRAM_SUB_BUCKETS;
+
+	if (theGroup > 0)
+	{
+		theLow = (THREADIT_HISTOGRAM_SUB_BUCKETS + (theBucket % THREADIT_HISTOGRAM_SUB_BUCKETS)) << (theGroup - 1);
+	} // if
+	return theLow;
+} // getBucketLow
+
+/**
+ * Method getBucketHigh returns the highest time counted in a bucket.
+ */
+ULONG CThreadItHistogram::getBucketHigh (ULONG theBucket)
+{
+	ULONG theHigh = theBucket;
+	ULONG theGroup = theBucket / THREADIT_HISTOGRAM_SUB_BUCKETS;
+
+	if (theGroup > 0)
+	{
+		theHigh = getBucketLow (theBucket) + ((1UL << (theGroup - 1)) - 1);
+	} // if
+	return theHigh;
+} // getBucketHigh
+
+// Class: CThreadItLatencyStats Implementation
+
+/**
+ * Constructor CThreadItLatencyStats creates empty histograms for an instruction.
+ */
+CThreadItLatencyStats::CThreadItLatencyStats (ULONG theInstruction)
+{
+	m_theInstruction = theInstruction;
+} // constructor CThreadItLatencyStats
+
+/**
+ * Method merge adds the counts of the histograms of another instance.
+ */
+void CThreadItLatencyStats::merge (const CThreadItLatencyStats& theOther)
+{
+	m_theQueueWait.merge (theOther.m_theQueueWait);
+	m_theService.merge (theOther.m_theService);
+	m_theEndToEnd.merge (theOther.m_theEndToEnd);
+	m_theCycles.merge (theOther.m_theCycles);
+	m_theAllocations.merge (theOther.m_theAllocations);
+	m_theAllocatedBytes.merge (theOther.m_theAllocatedBytes);
+	m_thePeakBytes.merge (theOther.m_thePeakBytes);
+} // merge
+
+/**
+ * Method reset clears the histograms.
+ */
+void CThreadItLatencyStats::reset ()
+{
+	m_theQueueWait.reset ();
+	m_theService.reset ();
+	m_theEndToEnd.reset ();
+	m_theCycles.reset ();
+	m_theAllocations.reset ();
+	m_theAllocatedBytes.reset ();
+	m_thePeakBytes.reset ();
+} // reset
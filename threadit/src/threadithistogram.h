@@ -0,0 +1,217 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItHistogram
+ * Description: Class CThreadItHistogram counts times in microseconds in log-linear
+ * buckets in the manner of an HDR histogram. Times below THREADIT_HISTOGRAM_SUB_BUCKETS
+ * have a bucket each. Above that each power of two is split into
+ * THREADIT_HISTOGRAM_SUB_BUCKETS buckets of equal width, so a time is known to within
+ * 1/16 of its value from a microsecond up to the 71 minutes that fit in a ULONG.
+ * Longer times are counted as the longest.
+ *
+ * The bucket of a time is found with one bit scan and a shift, and recording takes
+ * an interlocked increment of the bucket and an interlocked add of the total. No
+ * lock is taken so the helper threads of a CThreadItPool may record into the same
+ * histogram. A copy of a histogram is a snapshot that is read bucket by bucket
+ * without stopping the threads that record. Snapshots from several instances may be
+ * merged and percentiles taken from the result, and an older snapshot may be
+ * subtracted from a newer one to find the times of a window.
+ *
+ * Class CThreadItLatencyStats holds the histograms a CThreadIt keeps for each
+ * instruction (see CThreadIt::getStats): the wait in the work queue, the time spent
+ * in the worker method and the time from startWork to the reply. While the cycle
+ * stats of the instance are on it also holds the CPU cycles used by each run of the
+ * worker method, which is counted in the same buckets as the times, and where the
+ * allocations are counted the heap blocks and bytes allocated by each run.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_HISTOGRAM_H)
+#define THREADIT_HISTOGRAM_H
+
+// Includes
+#include <windows.h>
+
+/** THREADIT_HISTOGRAM_SUB_BITS is the number of bits of a time kept below its highest bit. */
+#define THREADIT_HISTOGRAM_SUB_BITS 4
+/** THREADIT_HISTOGRAM_SUB_BUCKETS is the number of buckets each power of two is split into. */
+#define THREADIT_HISTOGRAM_SUB_BUCKETS (1 << THREADIT_HISTOGRAM_SUB_BITS)
+/** THREADIT_HISTOGRAM_BUCKETS is the number of buckets needed for the times of a ULONG. */
+#define THREADIT_HISTOGRAM_BUCKETS ((32 - THREADIT_HISTOGRAM_SUB_BITS + 1) * THREADIT_HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * Class CThreadItHistogram counts times in log-linear buckets.
+ */
+class CThreadItHistogram
+{
+	// Attributes
+private:
+	/** m_theCounts are the counts of the buckets. */
+	volatile LONG m_theCounts[THREADIT_HISTOGRAM_BUCKETS];
+	/** m_theTotal is the sum of the times recorded. */
+	volatile LONGLONG m_theTotal;
+	/** m_theMax is the longest time recorded. */
+	volatile LONG m_theMax;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItHistogram creates an empty histogram.
+	 */
+	CThreadItHistogram ();
+
+	/**
+	 * Constructor CThreadItHistogram creates a snapshot of another histogram.
+	 */
+	CThreadItHistogram (const CThreadItHistogram& theOther);
+
+	/**
+	 * Method operator= replaces the counts with a snapshot of another histogram.
+	 */
+	CThreadItHistogram& operator= (const CThreadItHistogram& theOther);
+
+	/**
+	 * Method record counts a time. It may be called from any thread.
+	 * @param[in] theTime is the time in microseconds.
+	 */
+	void record (LONGLONG theTime);
+
+	/**
+	 * Method merge adds the counts of another histogram to this one.
+	 * @param[in] theOther is the histogram to add.
+	 */
+	void merge (const CThreadItHistogram& theOther);
+
+	/**
+	 * Method subtract takes the counts of an older snapshot of the same histogram away
+	 * from this snapshot, which leaves the times recorded between the two. A bucket with
+	 * fewer counts than the older snapshot, such as after a reset, is left empty. The
+	 * longest time is kept as it is and is the longest of the whole histogram. It should
+	 * only be called on a snapshot that no other thread records into.
+	 * @param[in] theOlder is the older snapshot.
+	 */
+	void subtract (const CThreadItHistogram& theOlder);
+
+	/**
+	 * Method reset clears the counts.
+	 */
+	void reset ();
+
+	/**
+	 * Method getCount returns the number of times recorded.
+	 */
+	ULONG getCount () const;
+
+	/**
+	 * Method getMean returns the mean of the times recorded in microseconds.
+	 */
+	LONGLONG getMean () const;
+
+	/**
+	 * Method getMax returns the longest time recorded in microseconds.
+	 */
+	LONGLONG getMax () const;
+
+	/**
+	 * Method getPercentile returns the time in microseconds that the given percentage
+	 * of the times recorded did not exceed. The time is the highest time of its bucket
+	 * and no higher than the longest time recorded. Zero is returned if there are no
+	 * times.
+	 * @param[in] thePercentile is the percentage from 0 to 100.
+	 */
+	LONGLONG getPercentile (double thePercentile) const;
+
+	/**
+	 * Method getBucket returns the bucket a time is counted in.
+	 * @param[in] theTime is the time in microseconds.
+	 */
+	static ULONG getBucket (ULONG theTime);
+
+	/**
+	 * Method getBucketLow returns the lowest time counted in a bucket.
+	 * @param[in] theBucket is the bucket.
+	 */
+	static ULONG getBucketLow (ULONG theBucket);
+
+	/**
+	 * Method getBucketHigh returns the highest time counted in a bucket.
+	 * @param[in] theBucket is the bucket.
+	 */
+	static ULONG getBucketHigh (ULONG theBucket);
+
+}; // class CThreadItHistogram
+
+/**
+ * Class CThreadItLatencyStats holds the histograms kept for one instruction.
+ */
+class CThreadItLatencyStats
+{
+	// Attributes
+public:
+	/** m_theInstruction is the instruction the times were recorded for. */
+	ULONG m_theInstruction;
+	/** m_theQueueWait is the time from startWork until the work package is taken from
+	 * the work queue. A work package that returns WORKDONE_CONTINUE is counted again
+	 * for each time it is queued. */
+	CThreadItHistogram m_theQueueWait;
+	/** m_theService is the time spent in each run of the worker method. */
+	CThreadItHistogram m_theService;
+	/** m_theEndToEnd is the time from startWork, or from the last time the work package
+	 * was queued again, until the reply is sent. */
+	CThreadItHistogram m_theEndToEnd;
+	/** m_theCycles is the number of CPU cycles charged to the thread in each run of the
+	 * worker method (see CThreadIt::setCycleStats). Unlike the service time it leaves out
+	 * the time the thread was waiting or preempted. Runs of more than ULONG_MAX cycles
+	 * are counted as ULONG_MAX. */
+	CThreadItHistogram m_theCycles;
+	/** m_theAllocations is the number of heap blocks allocated in each run of the worker
+	 * method, whose mean is the allocations per message. It is only recorded when the
+	 * library is built with THREADIT_ALLOC_TRACKING (see CThreadItAlloc). */
+	CThreadItHistogram m_theAllocations;
+	/** m_theAllocatedBytes is the number of bytes allocated in each run of the worker method. */
+	CThreadItHistogram m_theAllocatedBytes;
+	/** m_thePeakBytes is the most bytes each run of the worker method had allocated and
+	 * not freed at one time. */
+	CThreadItHistogram m_thePeakBytes;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItLatencyStats creates empty histograms for an instruction.
+	 * @param[in] theInstruction is the instruction.
+	 */
+	CThreadItLatencyStats (ULONG theInstruction = 0);
+
+	/**
+	 * Method merge adds the counts of the histograms of another instance.
+	 * @param[in] theOther is the histograms to add.
+	 */
+	void merge (const CThreadItLatencyStats& theOther);
+
+	/**
+	 * Method reset clears the histograms.
+	 */
+	void reset ();
+
+}; // class CThreadItLatencyStats
+
+#endif // THREADIT_HISTOGRAM_H
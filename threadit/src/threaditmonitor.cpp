@@ -0,0 +1,258 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItMonitor
+ * Description: Class CThreadItMonitor samples the registry snapshot to find the
+ * utilisation of the threads. See the header file for the figures.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include "threaditmonitor.h"
+
+// Class: CThreadItMonitor Implementation
+
+/**
+ * Constructor CThreadItMonitor takes the first sample and starts the periodic sampling.
+ */
+CThreadItMonitor::CThreadItMonitor (DWORD thePeriod, ULONG theSampleLimit) : CThreadIt ("threadit.CThreadItMonitor")
+{
+	InitializeCriticalSection (&m_theSampleAccess);
+	// A window needs two samples.
+	m_theSampleLimit = (theSampleLimit < 2) ? 2 : theSampleLimit;
+	sample ();
+	setPeriodicMethod ((PeriodicMethodType)&CThreadItMonitor::onPeriod);
+	setPeriod (thePeriod);
+} // constructor CThreadItMonitor
+
+/**
+ * Method ~CThreadItMonitor stops the thread.
+ */
+CThreadItMonitor::~CThreadItMonitor ()
+{
+	stopThread ();
+	waitForThreadToStop ();
+	DeleteCriticalSection (&m_theSampleAccess);
+} // ~CThreadItMonitor
+
+/**
+ * Method sample takes a sample now. The snapshot is taken outside the lock of the samples.
+ */
+void CThreadItMonitor::sample ()
+{
+	Sample theSample;
+
+	CActive::getRegistrySnapshot (theSample.theSnapshot);
+	EnterCriticalSection (&m_theSampleAccess);
+	theSample.theTime = GetTickCount ();
+	m_theSamples.push_back (theSample);
+	while (m_theSamples.size () > m_theSampleLimit)
+	{
+		m_theSamples.pop_front ();
+	} // while
+	LeaveCriticalSection (&m_theSampleAccess);
+} // sample
+
+/**
+ * Method getSampleCount returns the number of samples kept.
+ */
+ULONG CThreadItMonitor::getSampleCount () const
+{
+	ULONG theCount = 0;
+
+	EnterCriticalSection (&m_theSampleAccess);
+	theCount = (ULONG)m_theSamples.size ();
+	LeaveCriticalSection (&m_theSampleAccess);
+	return theCount;
+} // getSampleCount
+
+/**
+ * Method getUtilisation returns the utilisation of each active object over the window
+ * that ends with the latest sample.
+ */
+bool CThreadItMonitor::getUtilisation (DWORD theWindow, std::vector<ActiveUtilisation>& theUtilisation) const
+{
+	bool isSuccess = false;
+	size_t theOlder = 0;
+	size_t theNewer = 0;
+
+	theUtilisation.clear ();
+	EnterCriticalSection (&m_theSampleAccess);
+	if (m_theSamples.size () >= 2)
+	{
+		theNewer = m_theSamples.size () - 1;
+		theOlder = theNewer - 1;
+		while ((theOlder > 0) && ((m_theSamples[theNewer].theTime - m_theSamples[theOlder - 1].theTime) <= theWindow))
+		{
+			theOlder--;
+		} // while
+		getUtilisation (m_theSamples[theOlder].theSnapshot, m_theSamples[theNewer].theSnapshot,
+			m_theSamples[theNewer].theTime - m_theSamples[theOlder].theTime, theUtilisation);
+		isSuccess = true;
+	} // if
+	LeaveCriticalSection (&m_theSampleAccess);
+	return isSuccess;
+} // getUtilisation
+
+/**
+ * Method getTop returns a table of the busiest active objects over a window.
+ */
+std::string CThreadItMonitor::getTop (DWORD theWindow, size_t theCount) const
+{
+	std::vector<ActiveUtilisation> theUtilisation;
+
+	getUtilisation (theWindow, theUtilisation);
+	return toTop (theUtilisation, theCount);
+} // getTop
+
+/**
+ * Method getUtilisation compares two registry snapshots. The times of the snapshot
+ * are in microseconds.
+ */
+void CThreadItMonitor::getUtilisation (const std::vector<ActiveInfo>& theOlder, const std::vector<ActiveInfo>& theNewer, DWORD theWindow,
+	std::vector<ActiveUtilisation>& theUtilisation)
+{
+	ActiveUtilisation theEntry;
+	ActiveInfo theStart;
+	ULONGLONG theWallTime = 0;
+	ULONGLONG theWaitTime = 0;
+	double theSeconds = theWindow / 1000.0;
+
+	theUtilisation.clear ();
+	theUtilisation.reserve (theNewer.size ());
+	for (size_t theIndex = 0; theIndex < theNewer.size (); theIndex++)
+	{
+		const ActiveInfo& theEnd = theNewer[theIndex];
+		// An active object that started within the window is compared with nothing.
+		theStart.theKernelTime = 0;
+		theStart.theUserTime = 0;
+		theStart.theWallTime = 0;
+		theStart.theWaitTime = 0;
+		theStart.theWaitCount = 0;
+		theStart.theProcessedCount = 0;
+		for (size_t theOld = 0; theOld < theOlder.size (); theOld++)
+		{
+			if ((theOlder[theOld].theThreadId == theEnd.theThreadId) && (theOlder[theOld].theInstance == theEnd.theInstance))
+			{
+				theStart = theOlder[theOld];
+				break;
+			} // if
+		} // for
+		theEntry.theName = theEnd.theName;
+		theEntry.theThreadId = theEnd.theThreadId;
+		theEntry.theInstance = theEnd.theInstance;
+		theEntry.theWindow = theWindow;
+		theEntry.theBusyPercent = 0.0;
+		theEntry.theCpuPercent = 0.0;
+		theEntry.theKernelPercent = 0.0;
+		theWallTime = getDelta (theEnd.theWallTime, theStart.theWallTime);
+		theWaitTime = getDelta (theEnd.theWaitTime, theStart.theWaitTime);
+		if (theWallTime > 0)
+		{
+			theEntry.theBusyPercent = ((theWallTime - ((theWaitTime < theWallTime) ? theWaitTime : theWallTime)) * 100.0) / theWallTime;
+			theEntry.theCpuPercent = ((getDelta (theEnd.theUserTime, theStart.theUserTime) + getDelta (theEnd.theKernelTime, theStart.theKernelTime)) * 100.0) / theWallTime;
+			theEntry.theKernelPercent = (getDelta (theEnd.theKernelTime, theStart.theKernelTime) * 100.0) / theWallTime;
+		} // if
+		theEntry.theWaitRate = 0.0;
+		theEntry.theProcessedRate = 0.0;
+		if (theSeconds > 0.0)
+		{
+			theEntry.theWaitRate = getDelta ((ULONGLONG)theEnd.theWaitCount, (ULONGLONG)theStart.theWaitCount) / theSeconds;
+			theEntry.theProcessedRate = getDelta ((ULONGLONG)theEnd.theProcessedCount, (ULONGLONG)theStart.theProcessedCount) / theSeconds;
+		} // if
+		theEntry.isThreadIt = theEnd.isThreadIt;
+		theEntry.theWorkQDepth = theEnd.theWorkQDepth;
+		theUtilisation.push_back (theEntry);
+	} // for
+	std::stable_sort (theUtilisation.begin (), theUtilisation.end (), isBusier);
+} // getUtilisation
+
+/**
+ * Method toTop returns a table of the utilisation of active objects in the manner of top.
+ */
+std::string CThreadItMonitor::toTop (const std::vector<ActiveUtilisation>& theUtilisation, size_t theCount)
+{
+	std::ostringstream theText;
+	DWORD theWindow = theUtilisation.empty () ? 0 : theUtilisation[0].theWindow;
+
+	theText << "active objects over " << (theWindow / 1000.0) << "s\n";
+	theText << std::setw (8) << "TID" << std::setw (7) << "BUSY%" << std::setw (7) << "CPU%" << std::setw (7) << "SYS%"
+		<< std::setw (10) << "WAITS/S" << std::setw (10) << "WORK/S" << std::setw (7) << "QUEUE" << "  NAME\n";
+	theText << std::fixed << std::setprecision (1);
+	for (size_t theIndex = 0; (theIndex < theUtilisation.size ()) && (theIndex < theCount); theIndex++)
+	{
+		const ActiveUtilisation& theEntry = theUtilisation[theIndex];
+		theText << std::setw (8) << theEntry.theThreadId << std::setw (7) << theEntry.theBusyPercent << std::setw (7) << theEntry.theCpuPercent
+			<< std::setw (7) << theEntry.theKernelPercent << std::setw (10) << theEntry.theWaitRate;
+		if (theEntry.isThreadIt)
+		{
+			theText << std::setw (10) << theEntry.theProcessedRate << std::setw (7) << theEntry.theWorkQDepth;
+		}
+		else
+		{
+			theText << std::setw (10) << "-" << std::setw (7) << "-";
+		} // if
+		theText << "  " << theEntry.theName << "\n";
+	} // for
+	return theText.str ();
+} // toTop
+
+/**
+ * Method onPeriod is the periodic method. It takes a sample.
+ */
+bool CThreadItMonitor::onPeriod (CWorkPackIt theTimedWork, CWorkPackIt*& ptheWorkDone)
+{
+	ptheWorkDone = NULL;
+	sample ();
+	// There is no result to send.
+	return false;
+} // onPeriod
+
+/**
+ * Method getDelta returns the increase of a counter or zero if it went down.
+ */
+ULONGLONG CThreadItMonitor::getDelta (ULONGLONG theNewer, ULONGLONG theOlder)
+{
+	return (theNewer > theOlder) ? (theNewer - theOlder) : 0;
+} // getDelta
+
+/**
+ * Method isBusier orders the utilisation the busiest first and then by processor use.
+ */
+bool CThreadItMonitor::isBusier (const ActiveUtilisation& theFirst, const ActiveUtilisation& theSecond)
+{
+	bool isFirst = false;
+
+	if (theFirst.theBusyPercent != theSecond.theBusyPercent)
+	{
+		isFirst = (theFirst.theBusyPercent > theSecond.theBusyPercent);
+	}
+	else
+	{
+		isFirst = (theFirst.theCpuPercent > theSecond.theCpuPercent);
+	} // if
+	return isFirst;
+} // isBusier
@@ -0,0 +1,197 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItMonitor
+ * Description: Class CThreadItMonitor is a CThreadIt that samples the registry snapshot
+ * of the active objects of the process (see CActive::getRegistrySnapshot) each period
+ * and keeps the samples for a few minutes so that the utilisation of each thread can
+ * be found over a sliding window such as the last second, ten seconds or minute.
+ *
+ * The utilisation of a thread is the share of the wall time its thread routine was
+ * busy rather than waiting for work, and the share it spent on a processor. A thread
+ * that is busy most of the time is saturated and its queue will grow under more load.
+ * A thread that is busy but uses little of the processor is blocked in its worker
+ * methods. The rate of the waits, which is the rate at which the thread gives up the
+ * processor of its own accord, and the rate of the work processed are given as well.
+ * For example
+ *   CThreadItMonitor theMonitor;
+ *   ... run the load ...
+ *   std::cout << theMonitor.getTop (10000, 10);
+ * prints the ten busiest threads of the last ten seconds.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_MONITOR_H)
+#define THREADIT_MONITOR_H
+
+// Includes
+#include <deque>
+#include <string>
+#include <vector>
+#include "threadit.h"
+
+/** THREADIT_MONITOR_PERIOD is the default time in milliseconds between samples. */
+#define THREADIT_MONITOR_PERIOD 1000
+/** THREADIT_MONITOR_SAMPLES is the default number of samples kept, which covers five
+ * minutes at the default period. */
+#define THREADIT_MONITOR_SAMPLES 301
+
+/** ActiveUtilisation is the utilisation of an active object over a window. */
+typedef struct ActiveUtilisationTag
+{
+	/** theName is the textual identity of the thread. */
+	std::string theName;
+	/** theThreadId is the identity of the thread within the process. */
+	UINT theThreadId;
+	/** theInstance is the instance count of the thread. */
+	UINT theInstance;
+	/** theWindow is the time in milliseconds between the samples compared. */
+	DWORD theWindow;
+	/** theBusyPercent is the share of the wall time the thread routine was not waiting for work. */
+	double theBusyPercent;
+	/** theCpuPercent is the share of the wall time the thread was on a processor. */
+	double theCpuPercent;
+	/** theKernelPercent is the share of the wall time the thread was in the kernel. */
+	double theKernelPercent;
+	/** theWaitRate is the number of waits for work per second. */
+	double theWaitRate;
+	/** isThreadIt is true if the active object is a CThreadIt. */
+	bool isThreadIt;
+	/** theProcessedRate is the number of work packages processed per second. */
+	double theProcessedRate;
+	/** theWorkQDepth is the number of work packages waiting at the end of the window. */
+	LONG theWorkQDepth;
+} ActiveUtilisation;
+
+/**
+ * Class CThreadItMonitor samples the registry snapshot to find the utilisation of the threads.
+ */
+class CThreadItMonitor : public CThreadIt
+{
+	// types
+private:
+	/** Sample is a registry snapshot and the time it was taken. */
+	typedef struct SampleTag
+	{
+		/** theTime is the tick count when the snapshot was taken. */
+		DWORD theTime;
+		/** theSnapshot is the snapshot. */
+		std::vector<ActiveInfo> theSnapshot;
+	} Sample;
+
+	// Attributes
+private:
+	/** m_theSamples are the samples from the oldest. */
+	std::deque<Sample> m_theSamples;
+	/** m_theSampleLimit is the most samples kept. */
+	ULONG m_theSampleLimit;
+	/** m_theSampleAccess protects the samples. */
+	mutable CRITICAL_SECTION m_theSampleAccess;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItMonitor takes the first sample and starts the periodic sampling.
+	 * @param[in] thePeriod is the time in milliseconds between samples.
+	 * @param[in] theSampleLimit is the most samples kept. The longest window is the
+	 * period times one less than the limit.
+	 */
+	CThreadItMonitor (DWORD thePeriod = THREADIT_MONITOR_PERIOD, ULONG theSampleLimit = THREADIT_MONITOR_SAMPLES);
+
+	/**
+	 * Method ~CThreadItMonitor stops the thread.
+	 */
+	virtual ~CThreadItMonitor ();
+
+	/**
+	 * Method sample takes a sample now. It is called each period and may be called at
+	 * any other time.
+	 */
+	void sample ();
+
+	/**
+	 * Method getSampleCount returns the number of samples kept.
+	 */
+	ULONG getSampleCount () const;
+
+	/**
+	 * Method getUtilisation returns the utilisation of each active object over the window
+	 * that ends with the latest sample, the busiest first. The window starts at the oldest
+	 * sample that is no older than the window or at the sample before the latest one.
+	 * @param[in] theWindow is the length of the window in milliseconds.
+	 * @param[out] theUtilisation receives one entry per active object of the latest sample.
+	 * \return false if there are fewer than two samples.
+	 */
+	bool getUtilisation (DWORD theWindow, std::vector<ActiveUtilisation>& theUtilisation) const;
+
+	/**
+	 * Method getTop returns a table of the busiest active objects over a window in the
+	 * manner of top.
+	 * @param[in] theWindow is the length of the window in milliseconds.
+	 * @param[in] theCount is the most active objects listed.
+	 */
+	std::string getTop (DWORD theWindow, size_t theCount) const;
+
+	/**
+	 * Method getUtilisation compares two registry snapshots. An active object that is
+	 * not in the older snapshot is taken to have started within the window.
+	 * @param[in] theOlder is the snapshot at the start of the window.
+	 * @param[in] theNewer is the snapshot at the end of the window.
+	 * @param[in] theWindow is the time in milliseconds between the snapshots.
+	 * @param[out] theUtilisation receives one entry per active object of the newer
+	 * snapshot, the busiest first.
+	 */
+	static void getUtilisation (const std::vector<ActiveInfo>& theOlder, const std::vector<ActiveInfo>& theNewer, DWORD theWindow,
+		std::vector<ActiveUtilisation>& theUtilisation);
+
+	/**
+	 * Method toTop returns a table of the utilisation of active objects in the manner of top.
+	 * @param[in] theUtilisation is the utilisation, the busiest first.
+	 * @param[in] theCount is the most active objects listed.
+	 */
+	static std::string toTop (const std::vector<ActiveUtilisation>& theUtilisation, size_t theCount);
+
+protected:
+	/**
+	 * Method onPeriod is the periodic method. It takes a sample.
+	 */
+	bool onPeriod (CWorkPackIt theTimedWork, CWorkPackIt*& ptheWorkDone);
+
+private:
+	/**
+	 * Method getDelta returns the increase of a counter or zero if it went down, as the
+	 * CPU times of a thread whose handle is closed are read as zero.
+	 */
+	static ULONGLONG getDelta (ULONGLONG theNewer, ULONGLONG theOlder);
+
+	/**
+	 * Method isBusier orders the utilisation the busiest first.
+	 */
+	static bool isBusier (const ActiveUtilisation& theFirst, const ActiveUtilisation& theSecond);
+
+	/// not copiable
+	CThreadItMonitor (const CThreadItMonitor&);
+	const CThreadItMonitor& operator= (const CThreadItMonitor&);
+
+}; // class CThreadItMonitor
+
+#endif // !defined (THREADIT_MONITOR_H)
@@ -0,0 +1,494 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItPipeline
+ * Description: Class CThreadItPipeline connects a sequence of CThreadItStage
+ * instances with bounded single producer, single consumer rings. See the header
+ * file for a description of the flow of items and credits between stages.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include "threaditpipeline.h"
+
+// Class: CThreadItStage Implementation
+
+/**
+ * Constructor CThreadItStage initialises the stage and starts the thread.
+ * @param[in] theThreadName is the name allocated to the stage thread.
+ */
+CThreadItStage::CThreadItStage (const std::string& theThreadName) : CThreadIt (theThreadName)
+{
+	m_theStageMethod = NULL;
+	m_ptheInRing = NULL;
+	m_ptheOutRing = NULL;
+	m_theBatchSize = 0;
+	m_ptheItems = NULL;
+	m_ptheResults = NULL;
+	m_isStalled = false;
+	m_theItemCount = 0;
+	m_theBatchCount = 0;
+	m_theStallCount = 0;
+	m_theBusyTicks = 0;
+} // constructor CThreadItStage
+
+/**
+ * Method ~CThreadItStage stops the stage thread and frees the batch storage.
+ */
+CThreadItStage::~CThreadItStage ()
+{
+	// The thread uses the batch storage so it must stop first.
+	stopThread ();
+	waitForThreadToStop ();
+	delete [] m_ptheItems;
+	delete [] m_ptheResults;
+} // ~CThreadItStage
+
+/**
+ * Method setStageMethod sets the method that processes each item. This should be
+ * called from the constructor of the derived class.
+ * @param[in] theMethod is the stage method.
+ * \return true if the stage method is set.
+ */
+bool CThreadItStage::setStageMethod (StageMethodType theMethod)
+{
+	bool isSuccess = false;
+
+	if (theMethod != NULL)
+	{
+		m_theStageMethod = theMethod;
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // setStageMethod
+
+/**
+ * Method connect is called by the pipeline to attach the stage to its rings.
+ * @param[in] ptheInRing is the ring from which the stage takes items.
+ * @param[in] ptheOutRing is the ring into which the stage places results. It may be NULL.
+ * @param[in] theBatchSize is the maximum number of items taken at a time.
+ * \return true if the stage is connected.
+ */
+bool CThreadItStage::connect (PipelineRing* ptheInRing, PipelineRing* ptheOutRing, UINT theBatchSize)
+{
+	bool isSuccess = false;
+	ULONG theEventId = 0;
+
+	if ((ptheInRing != NULL) && (m_ptheInRing == NULL) && (m_theStageMethod != NULL))
+	{
+		if (theBatchSize == 0)
+		{
+			theBatchSize = DEFAULT_BATCH_SIZE;
+		} // if
+		m_theBatchSize = theBatchSize;
+		m_ptheItems = new void* [theBatchSize];
+		m_ptheResults = new void* [theBatchSize];
+		m_ptheOutRing = ptheOutRing;
+		m_ptheInRing = ptheInRing;
+		// The rings must be set before the events can fire.
+		isSuccess = setEventMethod (theEventId, (EventMethodType)&CThreadItStage::onDataAvailable, m_ptheInRing->getDataSignal ());
+		if ((isSuccess) && (m_ptheOutRing != NULL))
+		{
+			isSuccess = setEventMethod (theEventId, (EventMethodType)&CThreadItStage::onSpaceAvailable, m_ptheOutRing->getSpaceSignal ());
+		} // if
+	} // if
+	return isSuccess;
+} // connect
+
+/**
+ * Method onDataAvailable is the event method called when items arrive in the input ring.
+ */
+bool CThreadItStage::onDataAvailable (CWorkPackIt theWorkPack, CWorkPackIt*& ptheWorkDone)
+{
+	ptheWorkDone = NULL;
+	drain ();
+	return true;
+} // onDataAvailable
+
+/**
+ * Method onSpaceAvailable is the event method called when output credits are returned.
+ */
+bool CThreadItStage::onSpaceAvailable (CWorkPackIt theWorkPack, CWorkPackIt*& ptheWorkDone)
+{
+	ptheWorkDone = NULL;
+	m_isStalled = false;
+	drain ();
+	return true;
+} // onSpaceAvailable
+
+/**
+ * Method drain takes a batch of items from the input ring, processes them and
+ * places the results in the output ring. Only as many items are taken as there
+ * are output credits so a result never has to be held back. If items remain in
+ * the input ring the data signal is raised again so that the stage carries on
+ * after it has looked at its work queue.
+ */
+void CThreadItStage::drain ()
+{
+	ULONG theMax = m_theBatchSize;
+	ULONG theCount = 0;
+	ULONG theResultCount = 0;
+	ULONG theIndex = 0;
+	ULONG theCredits = 0;
+	void* ptheResult = NULL;
+	LARGE_INTEGER theStart;
+	LARGE_INTEGER theStop;
+
+	if ((m_ptheInRing != NULL) && (!m_isStalled))
+	{
+		if (m_ptheOutRing != NULL)
+		{
+			theCredits = m_ptheOutRing->getCredits ();
+			if (theCredits < theMax)
+			{
+				theMax = theCredits;
+			} // if
+		} // if
+		if (theMax > 0)
+		{
+			theCount = m_ptheInRing->popBatch (m_ptheItems, theMax);
+		} // if
+		if (theCount > 0)
+		{
+			QueryPerformanceCounter (&theStart);
+			for (theIndex = 0; theIndex < theCount; theIndex++)
+			{
+				ptheResult = NULL;
+				if (((this->*m_theStageMethod) (m_ptheItems[theIndex], ptheResult)) && (ptheResult != NULL) && (m_ptheOutRing != NULL))
+				{
+					m_ptheResults[theResultCount] = ptheResult;
+					theResultCount++;
+				} // if
+			} // for
+			QueryPerformanceCounter (&theStop);
+			if (theResultCount > 0)
+			{
+				// The credits were taken before the batch so all the results fit.
+				m_ptheOutRing->pushBatch (m_ptheResults, theResultCount);
+			} // if
+			InterlockedExchangeAdd64 (&m_theItemCount, theCount);
+			InterlockedExchangeAdd64 (&m_theBusyTicks, theStop.QuadPart - theStart.QuadPart);
+			InterlockedIncrement64 (&m_theBatchCount);
+		} // if
+		if (!m_ptheInRing->isEmpty ())
+		{
+			if ((m_ptheOutRing != NULL) && (m_ptheOutRing->getCredits () == 0))
+			{
+				stall ();
+			}
+			else
+			{
+				SetEvent (m_ptheInRing->getDataSignal ());
+			} // if
+		} // if
+	} // if
+} // drain
+
+/**
+ * Method stall records that the output ring has no credits and asks for the space
+ * signal. If credits were returned while asking the stage carries on at once.
+ */
+void CThreadItStage::stall ()
+{
+	InterlockedIncrement64 (&m_theStallCount);
+	m_isStalled = true;
+	if (m_ptheOutRing->requestSpace ())
+	{
+		m_isStalled = false;
+		SetEvent (m_ptheInRing->getDataSignal ());
+	} // if
+} // stall
+
+/**
+ * Method getStats returns the counters of the stage.
+ * @param[out] theStats receives the item, batch and stall counts and the service time.
+ * @param[in] theFrequency is the performance counter frequency.
+ */
+void CThreadItStage::getStats (PipelineStageStats& theStats, LONGLONG theFrequency)
+{
+	LONGLONG theBusyTicks = InterlockedCompareExchange64 (&m_theBusyTicks, 0, 0);
+
+	theStats.theItemCount = InterlockedCompareExchange64 (&m_theItemCount, 0, 0);
+	theStats.theBatchCount = InterlockedCompareExchange64 (&m_theBatchCount, 0, 0);
+	theStats.theStallCount = InterlockedCompareExchange64 (&m_theStallCount, 0, 0);
+	theStats.theServiceTime = 0.0;
+	if ((theStats.theItemCount > 0) && (theFrequency > 0))
+	{
+		theStats.theServiceTime = ((double)theBusyTicks * 1000000.0) / ((double)theFrequency * (double)theStats.theItemCount);
+	} // if
+	// The busy time is returned in the utilisation until the elapsed time is known.
+	theStats.theUtilisation = (theFrequency > 0) ? ((double)theBusyTicks / (double)theFrequency) : 0.0;
+} // getStats
+
+// Class: CThreadItPipeline Implementation
+
+/**
+ * Constructor CThreadItPipeline creates an empty pipeline.
+ * @param[in] theRingCapacity is the capacity of the rings between the stages.
+ */
+CThreadItPipeline::CThreadItPipeline (ULONG theRingCapacity)
+{
+	m_ptheLogger = &(log4cpp::Category::getInstance ("threadit.CThreadItPipeline"));
+	m_theRingCapacity = theRingCapacity;
+	m_isBuilt = false;
+	m_theStartTime.QuadPart = 0;
+	QueryPerformanceFrequency (&m_theFrequency);
+} // constructor CThreadItPipeline
+
+/**
+ * Method ~CThreadItPipeline stops the stages and frees the rings. Items still in
+ * the rings are not freed.
+ */
+CThreadItPipeline::~CThreadItPipeline ()
+{
+	std::vector<PipelineRing*>::iterator theRing;
+
+	// The stages use the rings so they must stop first.
+	stop ();
+	for (theRing = m_theRings.begin (); theRing != m_theRings.end (); theRing++)
+	{
+		delete *theRing;
+	} // for
+	m_theRings.clear ();
+} // ~CThreadItPipeline
+
+/**
+ * Method addStage adds a stage to the end of the pipeline. Stages cannot be added
+ * once the pipeline is built.
+ * @param[in] ptheStage is the stage to add.
+ * @param[in] theBatchSize is the maximum number of items the stage takes at a time.
+ * \return true if the stage is added.
+ */
+bool CThreadItPipeline::addStage (const StagePtr& ptheStage, UINT theBatchSize)
+{
+	bool isSuccess = false;
+
+	if ((!m_isBuilt) && (ptheStage))
+	{
+		m_theStages.push_back (ptheStage);
+		m_theBatchSizes.push_back (theBatchSize);
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // addStage
+
+/**
+ * Method build creates the rings and connects the stages.
+ * @param[in] isCollectOutput is true if the results of the last stage are placed in
+ * an output ring to be taken using pop.
+ * \return true if the pipeline is built.
+ */
+bool CThreadItPipeline::build (bool isCollectOutput)
+{
+	bool isSuccess = false;
+	UINT theStage = 0;
+	UINT theRingCount = 0;
+	PipelineRing* ptheOutRing = NULL;
+
+	if ((!m_isBuilt) && (!m_theStages.empty ()))
+	{
+		theRingCount = (UINT)m_theStages.size () + (isCollectOutput ? 1 : 0);
+		for (theStage = 0; theStage < theRingCount; theStage++)
+		{
+			m_theRings.push_back (new PipelineRing (m_theRingCapacity));
+		} // for
+		isSuccess = true;
+		for (theStage = 0; (isSuccess) && (theStage < m_theStages.size ()); theStage++)
+		{
+			ptheOutRing = (theStage + 1 < m_theRings.size ()) ? m_theRings[theStage + 1] : NULL;
+			isSuccess = m_theStages[theStage]->connect (m_theRings[theStage], ptheOutRing, m_theBatchSizes[theStage]);
+		} // for
+		if (isSuccess)
+		{
+			QueryPerformanceCounter (&m_theStartTime);
+			m_isBuilt = true;
+		}
+		else
+		{
+			m_ptheLogger->errorStream () << "unable to connect stage " << theStage << " - check the stage method is set";
+		} // if
+	} // if
+	return isSuccess;
+} // build
+
+/**
+ * Method push places an item at the start of the pipeline. It must only be called
+ * from one thread.
+ * @param[in] ptheItem is the item to process. It must not be NULL.
+ * @param[in] theTimeOut is the time in milliseconds to wait for a credit.
+ * \return true if the item is placed in the pipeline.
+ */
+bool CThreadItPipeline::push (void* ptheItem, DWORD theTimeOut)
+{
+	bool isSuccess = false;
+	PipelineRing* ptheRing = NULL;
+
+	if ((m_isBuilt) && (ptheItem != NULL))
+	{
+		ptheRing = m_theRings[0];
+		isSuccess = ptheRing->push (ptheItem);
+		while ((!isSuccess) && (theTimeOut > 0))
+		{
+			// Out of credits. Wait for the first stage to hand some back.
+			if (!ptheRing->requestSpace ())
+			{
+				if (WaitForSingleObject (ptheRing->getSpaceSignal (), theTimeOut) != WAIT_OBJECT_0)
+				{
+					theTimeOut = 0;
+				} // if
+			} // if
+			isSuccess = ptheRing->push (ptheItem);
+		} // while
+	} // if
+	return isSuccess;
+} // push
+
+/**
+ * Method pop takes an item from the end of the pipeline. It must only be called
+ * from one thread.
+ * @param[in] theTimeOut is the time in milliseconds to wait for an item.
+ * \return the item or NULL if no item arrived in the time given.
+ */
+void* CThreadItPipeline::pop (DWORD theTimeOut)
+{
+	void* ptheItem = NULL;
+	PipelineRing* ptheRing = NULL;
+
+	if ((m_isBuilt) && (m_theRings.size () > m_theStages.size ()))
+	{
+		ptheRing = m_theRings.back ();
+		ptheItem = ptheRing->pop ();
+		while ((ptheItem == NULL) && (theTimeOut > 0))
+		{
+			if (WaitForSingleObject (ptheRing->getDataSignal (), theTimeOut) != WAIT_OBJECT_0)
+			{
+				theTimeOut = 0;
+			} // if
+			ptheItem = ptheRing->pop ();
+		} // while
+	} // if
+	return ptheItem;
+} // pop
+
+/**
+ * Method getStageCount returns the number of stages in the pipeline.
+ */
+UINT CThreadItPipeline::getStageCount () const
+{
+	return (UINT)m_theStages.size ();
+} // getStageCount
+
+/**
+ * Method getStageStats returns the statistics of a stage.
+ * @param[in] theStage is the index of the stage starting from zero.
+ * @param[out] theStats receives the statistics of the stage.
+ * \return true if the statistics are returned.
+ */
+bool CThreadItPipeline::getStageStats (UINT theStage, PipelineStageStats& theStats)
+{
+	bool isSuccess = false;
+	LARGE_INTEGER theNow;
+	double theElapsed = 0.0;
+
+	if ((m_isBuilt) && (theStage < m_theStages.size ()))
+	{
+		QueryPerformanceCounter (&theNow);
+		theElapsed = (double)(theNow.QuadPart - m_theStartTime.QuadPart) / (double)m_theFrequency.QuadPart;
+		m_theStages[theStage]->getStats (theStats, m_theFrequency.QuadPart);
+		theStats.theOccupancy = m_theRings[theStage]->size ();
+		theStats.theCapacity = m_theRings[theStage]->capacity ();
+		theStats.theThroughput = 0.0;
+		if (theElapsed > 0.0)
+		{
+			theStats.theThroughput = (double)theStats.theItemCount / theElapsed;
+			theStats.theUtilisation = theStats.theUtilisation / theElapsed;
+		} // if
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // getStageStats
+
+/**
+ * Method getBottleneck returns the index of the stage with the highest utilisation.
+ * \return the stage index or -1 if the pipeline is not built.
+ */
+int CThreadItPipeline::getBottleneck ()
+{
+	int theBottleneck = -1;
+	double theHighest = -1.0;
+	UINT theStage = 0;
+	PipelineStageStats theStats;
+
+	for (theStage = 0; theStage < getStageCount (); theStage++)
+	{
+		if ((getStageStats (theStage, theStats)) && (theStats.theUtilisation > theHighest))
+		{
+			theHighest = theStats.theUtilisation;
+			theBottleneck = (int)theStage;
+		} // if
+	} // for
+	return theBottleneck;
+} // getBottleneck
+
+/**
+ * Method logStats writes the statistics of each stage to the log.
+ */
+void CThreadItPipeline::logStats ()
+{
+	UINT theStage = 0;
+	PipelineStageStats theStats;
+
+	if (m_ptheLogger->isInfoEnabled ())
+	{
+		for (theStage = 0; theStage < getStageCount (); theStage++)
+		{
+			if (getStageStats (theStage, theStats))
+			{
+				m_ptheLogger->infoStream () << "stage " << theStage << ": items=" << theStats.theItemCount
+					<< ", batches=" << theStats.theBatchCount << ", stalls=" << theStats.theStallCount
+					<< ", occupancy=" << theStats.theOccupancy << "/" << theStats.theCapacity
+					<< ", items/s=" << theStats.theThroughput << ", service us=" << theStats.theServiceTime
+					<< ", utilisation=" << theStats.theUtilisation;
+			} // if
+		} // for
+		m_ptheLogger->infoStream () << "bottleneck stage " << getBottleneck ();
+	} // if
+} // logStats
+
+/**
+ * Method stop stops the stage threads. The pipeline cannot be used after it is stopped.
+ */
+void CThreadItPipeline::stop ()
+{
+	std::vector<StagePtr>::iterator theStage;
+
+	for (theStage = m_theStages.begin (); theStage != m_theStages.end (); theStage++)
+	{
+		(*theStage)->stopThread ();
+	} // for
+	for (theStage = m_theStages.begin (); theStage != m_theStages.end (); theStage++)
+	{
+		(*theStage)->waitForThreadToStop ();
+	} // for
+	m_isBuilt = false;
+} // stop
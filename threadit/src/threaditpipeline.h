@@ -0,0 +1,301 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItPipeline
+ * Description: Class CThreadItPipeline connects a sequence of CThreadItStage
+ * instances with bounded single producer, single consumer rings. Each stage
+ * takes items from its input ring, processes them with its stage method and
+ * places the results in its output ring which is the input ring of the next
+ * stage. No work packages are allocated and no locks are taken as items move
+ * between stages.
+ *
+ * The stage thread waits on the data signal of its input ring and on the space
+ * signal of its output ring as CThreadIt event methods so that the stage is
+ * still able to service its work queue and periodic method. A stage only takes
+ * as many items from its input ring as there are credits (free slots) in its
+ * output ring. When the credits run out the stage stops draining its input and
+ * waits for the space signal. The input ring then fills and the back pressure
+ * flows upstream to the producer.
+ *
+ * Each stage drains its input in batches of a configurable size. The cost of
+ * the signals and of moving the ring positions between caches is spread over
+ * the batch. Per stage statistics of throughput, queue occupancy and service
+ * time are kept so that the bottleneck stage can be found.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_PIPELINE_H)
+#define THREADIT_PIPELINE_H
+
+// Includes
+#include <vector>
+#include "threadit.h"
+#include "SpscRing.h"
+
+// Forward Declarations
+class CThreadItStage;
+
+/** PipelineRing is the ring used to connect two stages. */
+typedef CSpscRing <void> PipelineRing;
+
+/** StagePtr is a shared pointer to a CThreadItStage instance. */
+typedef std::shared_ptr <CThreadItStage> StagePtr;
+
+/** StageMethodType is a pointer to a member function of a CThreadItStage derived
+ * class that processes one item taken from the input ring of the stage. The first
+ * parameter is the item. The second parameter returns the item to be passed on to
+ * the next stage. If the result is NULL or the method returns false nothing is
+ * passed on. The stage method is responsible for the memory of items it does not
+ * pass on. */
+typedef bool (CThreadIt::*StageMethodType)(void*, void*&);
+
+/** PipelineStageStats describes the performance of a single pipeline stage. */
+typedef struct PipelineStageStatsTag
+{
+	/** theItemCount is the number of items processed by the stage. */
+	LONGLONG theItemCount;
+	/** theBatchCount is the number of batches taken from the input ring. */
+	LONGLONG theBatchCount;
+	/** theStallCount is the number of times the stage ran out of output credits. */
+	LONGLONG theStallCount;
+	/** theOccupancy is the number of items waiting in the input ring of the stage. */
+	ULONG theOccupancy;
+	/** theCapacity is the capacity of the input ring of the stage. */
+	ULONG theCapacity;
+	/** theThroughput is the number of items processed per second since the pipeline was built. */
+	double theThroughput;
+	/** theServiceTime is the average time in microseconds spent in the stage method per item. */
+	double theServiceTime;
+	/** theUtilisation is the fraction of the elapsed time spent in the stage method. */
+	double theUtilisation;
+} PipelineStageStats;
+
+/**
+ * Class CThreadItStage is a CThreadIt that processes items flowing through a
+ * CThreadItPipeline. Derived classes provide the stage method.
+ */
+class CThreadItStage : public CThreadIt
+{
+	friend class CThreadItPipeline;
+
+public:
+	/** DEFAULT_BATCH_SIZE is the number of items taken from the input ring at a time. */
+	static const UINT DEFAULT_BATCH_SIZE = 32;
+
+	// Attributes
+protected:
+	/** m_theStageMethod is the method called for each item taken from the input ring. */
+	StageMethodType m_theStageMethod;
+	/** m_ptheInRing is the ring from which items are taken. It belongs to the pipeline. */
+	PipelineRing* m_ptheInRing;
+	/** m_ptheOutRing is the ring into which results are placed. It belongs to the pipeline
+	 * and is NULL for the last stage when the output is not collected. */
+	PipelineRing* m_ptheOutRing;
+	/** m_theBatchSize is the maximum number of items taken from the input ring at a time. */
+	UINT m_theBatchSize;
+	/** m_ptheItems holds the items of the current batch. */
+	void** m_ptheItems;
+	/** m_ptheResults holds the results of the current batch. */
+	void** m_ptheResults;
+	/** m_isStalled is true while the stage is waiting for output credits. */
+	bool m_isStalled;
+	/** m_theItemCount is the number of items processed. */
+	volatile LONGLONG m_theItemCount;
+	/** m_theBatchCount is the number of batches processed. */
+	volatile LONGLONG m_theBatchCount;
+	/** m_theStallCount is the number of times the stage ran out of output credits. */
+	volatile LONGLONG m_theStallCount;
+	/** m_theBusyTicks is the time spent in the stage method in performance counter ticks. */
+	volatile LONGLONG m_theBusyTicks;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItStage initialises the stage and starts the thread.
+	 * @param[in] theThreadName is the name allocated to the stage thread.
+	 */
+	CThreadItStage (const std::string& theThreadName);
+
+	/**
+	 * Method ~CThreadItStage stops the stage thread and frees the batch storage.
+	 */
+	virtual ~CThreadItStage ();
+
+	/**
+	 * Method setStageMethod sets the method that processes each item. This should be
+	 * called from the constructor of the derived class.
+	 * @param[in] theMethod is the stage method.
+	 * \return true if the stage method is set.
+	 */
+	bool setStageMethod (StageMethodType theMethod);
+
+protected:
+	/**
+	 * Method connect is called by the pipeline to attach the stage to its rings.
+	 * @param[in] ptheInRing is the ring from which the stage takes items.
+	 * @param[in] ptheOutRing is the ring into which the stage places results. It may be NULL.
+	 * @param[in] theBatchSize is the maximum number of items taken at a time.
+	 * \return true if the stage is connected.
+	 */
+	bool connect (PipelineRing* ptheInRing, PipelineRing* ptheOutRing, UINT theBatchSize);
+
+	/**
+	 * Method onDataAvailable is the event method called when items arrive in the input ring.
+	 */
+	bool onDataAvailable (CWorkPackIt theWorkPack, CWorkPackIt*& ptheWorkDone);
+
+	/**
+	 * Method onSpaceAvailable is the event method called when output credits are returned.
+	 */
+	bool onSpaceAvailable (CWorkPackIt theWorkPack, CWorkPackIt*& ptheWorkDone);
+
+	/**
+	 * Method drain takes a batch of items from the input ring, processes them and
+	 * places the results in the output ring.
+	 */
+	void drain ();
+
+	/**
+	 * Method stall records that the output ring has no credits and asks for the space signal.
+	 */
+	void stall ();
+
+	/**
+	 * Method getStats returns the counters of the stage.
+	 * @param[out] theStats receives the item, batch and stall counts and the service time.
+	 * @param[in] theFrequency is the performance counter frequency.
+	 */
+	void getStats (PipelineStageStats& theStats, LONGLONG theFrequency);
+
+}; // class CThreadItStage
+
+/**
+ * Class CThreadItPipeline builds and runs a pipeline of CThreadItStage instances.
+ * The items are pushed into the pipeline by a single producer thread and are
+ * taken from the pipeline by a single consumer thread.
+ */
+class CThreadItPipeline
+{
+public:
+	/** DEFAULT_RING_CAPACITY is the default capacity of the rings between stages. */
+	static const ULONG DEFAULT_RING_CAPACITY = 1024;
+
+	// Attributes
+private:
+	/** m_theStages are the stages in pipeline order. */
+	std::vector<StagePtr> m_theStages;
+	/** m_theBatchSizes are the batch sizes of the stages. */
+	std::vector<UINT> m_theBatchSizes;
+	/** m_theRings are the rings in front of each stage and the output ring. */
+	std::vector<PipelineRing*> m_theRings;
+	/** m_theRingCapacity is the capacity of each ring. */
+	ULONG m_theRingCapacity;
+	/** m_isBuilt is true once the stages have been connected. */
+	bool m_isBuilt;
+	/** m_theStartTime is the performance counter value when the pipeline was built. */
+	LARGE_INTEGER m_theStartTime;
+	/** m_theFrequency is the performance counter frequency. */
+	LARGE_INTEGER m_theFrequency;
+	/** m_ptheLogger is the logger used to log information and errors. */
+	log4cpp::Category* m_ptheLogger;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItPipeline creates an empty pipeline.
+	 * @param[in] theRingCapacity is the capacity of the rings between the stages.
+	 */
+	CThreadItPipeline (ULONG theRingCapacity = DEFAULT_RING_CAPACITY);
+
+	/**
+	 * Method ~CThreadItPipeline stops the stages and frees the rings. Items still in
+	 * the rings are not freed.
+	 */
+	virtual ~CThreadItPipeline ();
+
+	/**
+	 * Method addStage adds a stage to the end of the pipeline. Stages cannot be added
+	 * once the pipeline is built.
+	 * @param[in] ptheStage is the stage to add.
+	 * @param[in] theBatchSize is the maximum number of items the stage takes at a time.
+	 * \return true if the stage is added.
+	 */
+	bool addStage (const StagePtr& ptheStage, UINT theBatchSize = CThreadItStage::DEFAULT_BATCH_SIZE);
+
+	/**
+	 * Method build creates the rings and connects the stages.
+	 * @param[in] isCollectOutput is true if the results of the last stage are placed in
+	 * an output ring to be taken using pop. If false the results of the last stage are
+	 * discarded and the last stage is responsible for the memory of the items.
+	 * \return true if the pipeline is built.
+	 */
+	bool build (bool isCollectOutput = true);
+
+	/**
+	 * Method push places an item at the start of the pipeline. It must only be called
+	 * from one thread.
+	 * @param[in] ptheItem is the item to process. It must not be NULL.
+	 * @param[in] theTimeOut is the time in milliseconds to wait for a credit.
+	 * \return true if the item is placed in the pipeline.
+	 */
+	bool push (void* ptheItem, DWORD theTimeOut);
+
+	/**
+	 * Method pop takes an item from the end of the pipeline. It must only be called
+	 * from one thread.
+	 * @param[in] theTimeOut is the time in milliseconds to wait for an item.
+	 * \return the item or NULL if no item arrived in the time given.
+	 */
+	void* pop (DWORD theTimeOut);
+
+	/**
+	 * Method getStageCount returns the number of stages in the pipeline.
+	 */
+	UINT getStageCount () const;
+
+	/**
+	 * Method getStageStats returns the statistics of a stage.
+	 * @param[in] theStage is the index of the stage starting from zero.
+	 * @param[out] theStats receives the statistics of the stage.
+	 * \return true if the statistics are returned.
+	 */
+	bool getStageStats (UINT theStage, PipelineStageStats& theStats);
+
+	/**
+	 * Method getBottleneck returns the index of the stage with the highest utilisation.
+	 * \return the stage index or -1 if the pipeline is not built.
+	 */
+	int getBottleneck ();
+
+	/**
+	 * Method logStats writes the statistics of each stage to the log.
+	 */
+	void logStats ();
+
+	/**
+	 * Method stop stops the stage threads. The pipeline cannot be used after it is stopped.
+	 */
+	void stop ();
+
+}; // class CThreadItPipeline
+
+#endif // !defined (THREADIT_PIPELINE_H)
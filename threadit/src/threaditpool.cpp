@@ -0,0 +1,433 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItPool
+ * Description: Class CThreadItPool is a CThreadIt served by an elastic pool of
+ * threads. See the header file for the growth and retirement of the helpers.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <process.h>
+#include "threaditpool.h"
+
+// Class: CThreadItPoolMonitor Implementation
+
+/**
+ * Constructor CThreadItPoolMonitor starts the periodic check of the pool.
+ */
+CThreadItPoolMonitor::CThreadItPoolMonitor (CThreadItPool* pthePool) : CThreadIt ("threadit.CThreadItPoolMonitor")
+{
+	m_pthePool = pthePool;
+	setPeriodicMethod ((PeriodicMethodType)&CThreadItPoolMonitor::checkPool);
+	setPeriod (THREADIT_POOL_PERIOD);
+} // constructor CThreadItPoolMonitor
+
+/**
+ * Method ~CThreadItPoolMonitor stops the thread.
+ */
+CThreadItPoolMonitor::~CThreadItPoolMonitor ()
+{
+	stopThread ();
+	waitForThreadToStop ();
+} // ~CThreadItPoolMonitor
+
+/**
+ * Method checkPool is the periodic method. It asks the pool to check its pressure.
+ */
+bool CThreadItPoolMonitor::checkPool (CWorkPackIt theTimedWork, CWorkPackIt*& ptheWorkDone)
+{
+	ptheWorkDone = NULL;
+	m_pthePool->checkPressure ();
+	// There is no result to send.
+	return false;
+} // checkPool
+
+// Class: CThreadItPool Implementation
+
+/**
+ * Constructor CThreadItPool starts the thread of execution, the helpers needed for
+ * the minimum and the monitor.
+ */
+CThreadItPool::CThreadItPool (const std::string& theThreadName, UINT theMinThreads, UINT theMaxThreads) : CThreadIt (theThreadName)
+{
+	SYSTEM_INFO theInfo;
+
+	InitializeCriticalSection (&m_theHelperAccess);
+	if (theMinThreads < 1)
+	{
+		theMinThreads = 1;
+	} // if
+	if (theMaxThreads == 0)
+	{
+		GetSystemInfo (&theInfo);
+		theMaxThreads = theInfo.dwNumberOfProcessors;
+	} // if
+	if (theMaxThreads < theMinThreads)
+	{
+		theMaxThreads = theMinThreads;
+	} // if
+	m_theMinThreads = (LONG)theMinThreads;
+	m_theMaxThreads = (LONG)theMaxThreads;
+	// The thread of execution is the first thread of the pool.
+	m_theThreadCount = 1;
+	m_thePeakThreadCount = 1;
+	m_theBusyCount = 0;
+	m_theGrowCount = 0;
+	m_theShrinkCount = 0;
+	m_theWaitEwma = 0;
+	m_theWaitTarget = 10000;
+	m_theDepthTarget = 4;
+	m_theGrowSamples = 3;
+	m_theHighSamples = 0;
+	m_theLinger = 5000;
+	for (LONG theHelper = 1; theHelper < m_theMinThreads; theHelper++)
+	{
+		addHelper ();
+	} // for
+	// The helpers for the minimum are not resize events.
+	m_theGrowCount = 0;
+	m_ptheMonitor = new CThreadItPoolMonitor (this);
+} // constructor CThreadItPool
+
+/**
+ * Method ~CThreadItPool stops the monitor, the helpers and the thread of execution.
+ */
+CThreadItPool::~CThreadItPool ()
+{
+	stopThread ();
+	waitForThreadToStop ();
+	delete m_ptheMonitor;
+	m_ptheMonitor = NULL;
+	DeleteCriticalSection (&m_theHelperAccess);
+} // ~CThreadItPool
+
+/**
+ * Method setGrowthPolicy sets when the pool grows.
+ */
+void CThreadItPool::setGrowthPolicy (ULONG theWaitTarget, ULONG theDepthTarget, UINT theGrowSamples)
+{
+	if (theGrowSamples < 1)
+	{
+		theGrowSamples = 1;
+	} // if
+	InterlockedExchange (&m_theWaitTarget, (LONG)theWaitTarget);
+	InterlockedExchange (&m_theDepthTarget, (LONG)theDepthTarget);
+	InterlockedExchange (&m_theGrowSamples, (LONG)theGrowSamples);
+} // setGrowthPolicy
+
+/**
+ * Method setLinger sets the time in milliseconds a helper waits for work before it retires.
+ */
+void CThreadItPool::setLinger (DWORD theLinger)
+{
+	m_theLinger = theLinger;
+} // setLinger
+
+/**
+ * Method getPoolSize returns the number of threads in the pool.
+ */
+UINT CThreadItPool::getPoolSize () const
+{
+	return (UINT)m_theThreadCount;
+} // getPoolSize
+
+/**
+ * Method getPeakPoolSize returns the most threads the pool has had.
+ */
+UINT CThreadItPool::getPeakPoolSize () const
+{
+	return (UINT)m_thePeakThreadCount;
+} // getPeakPoolSize
+
+/**
+ * Method getMinPoolSize returns the fewest threads in the pool.
+ */
+UINT CThreadItPool::getMinPoolSize () const
+{
+	return (UINT)m_theMinThreads;
+} // getMinPoolSize
+
+/**
+ * Method getMaxPoolSize returns the most threads in the pool.
+ */
+UINT CThreadItPool::getMaxPoolSize () const
+{
+	return (UINT)m_theMaxThreads;
+} // getMaxPoolSize
+
+/**
+ * Method getBusyCount returns the number of threads processing a work package.
+ */
+LONG CThreadItPool::getBusyCount () const
+{
+	return m_theBusyCount;
+} // getBusyCount
+
+/**
+ * Method getGrowCount returns the number of helpers added.
+ */
+LONG CThreadItPool::getGrowCount () const
+{
+	return m_theGrowCount;
+} // getGrowCount
+
+/**
+ * Method getShrinkCount returns the number of helpers retired.
+ */
+LONG CThreadItPool::getShrinkCount () const
+{
+	return m_theShrinkCount;
+} // getShrinkCount
+
+/**
+ * Method getQueueWait returns the moving average of the queue wait in microseconds.
+ */
+LONG CThreadItPool::getQueueWait () const
+{
+	return m_theWaitEwma;
+} // getQueueWait
+
+/**
+ * Method waitForThreadToStop stops the monitor and the helpers once stopThread has
+ * been called and then waits for the thread of execution to stop.
+ */
+void CThreadItPool::waitForThreadToStop ()
+{
+	LONG theHelperCount = 0;
+
+	if (m_isExitThread)
+	{
+		// The monitor must not add helpers while they are being stopped.
+		if (m_ptheMonitor != NULL)
+		{
+			m_ptheMonitor->stopThread ();
+			m_ptheMonitor->waitForThreadToStop ();
+		} // if
+		// Release each helper from its wait so that it sees the pool is stopping.
+		EnterCriticalSection (&m_theHelperAccess);
+		theHelperCount = (LONG)m_theHelpers.size ();
+		LeaveCriticalSection (&m_theHelperAccess);
+		if (theHelperCount > 0)
+		{
+			ReleaseSemaphore (m_WorkQ.getQSemaphore (), theHelperCount, NULL);
+		} // if
+		reapHelpers (true);
+	} // if
+	CThreadIt::waitForThreadToStop ();
+} // waitForThreadToStop
+
+/**
+ * Method processWorkPack records the queue wait and the busy threads around the
+ * processing of a work package. The moving average has a weight of 1/8.
+ */
+void CThreadItPool::processWorkPack (CWorkPackIt* pWorkPack)
+{
+	LARGE_INTEGER theNow;
+	LONGLONG theWait = 0;
+
+	if ((pWorkPack->m_theRequeueTime != 0) && (m_theCounterFrequency != 0))
+	{
+		QueryPerformanceCounter (&theNow);
+		theWait = ((theNow.QuadPart - pWorkPack->m_theRequeueTime) * 1000000) / m_theCounterFrequency;
+		if (theWait > LONG_MAX)
+		{
+			theWait = LONG_MAX;
+		} // if
+		InterlockedExchange (&m_theWaitEwma, m_theWaitEwma + (LONG)((theWait - m_theWaitEwma) / 8));
+	} // if
+	InterlockedIncrement (&m_theBusyCount);
+	CThreadIt::processWorkPack (pWorkPack);
+	InterlockedDecrement (&m_theBusyCount);
+} // processWorkPack
+
+/**
+ * Method checkPressure is called by the monitor. It adds a helper once the pool has
+ * been under pressure for long enough and reaps the helpers that retired. The
+ * queue wait only counts while work is waiting as the average is not updated once
+ * the queue is empty.
+ */
+void CThreadItPool::checkPressure ()
+{
+	bool isHigh = false;
+	LONG theDepth = m_theWorkQDepth;
+	LONG theThreadCount = m_theThreadCount;
+
+	if ((m_theDepthTarget > 0) && (theDepth > theThreadCount * m_theDepthTarget))
+	{
+		isHigh = true;
+	}
+	else if ((m_theWaitTarget > 0) && (theDepth > 0) && (m_theWaitEwma > m_theWaitTarget))
+	{
+		isHigh = true;
+	} // if
+	if (isHigh)
+	{
+		m_theHighSamples++;
+	}
+	else
+	{
+		m_theHighSamples = 0;
+	} // if
+	if ((m_theHighSamples >= m_theGrowSamples) && (theThreadCount < m_theMaxThreads) && (!m_isExitThread))
+	{
+		if (addHelper ())
+		{
+			m_ptheLogger->infoStream () << "pool grown to " << m_theThreadCount << " threads - queue depth " << theDepth << " wait " << m_theWaitEwma << "us";
+		} // if
+		// Look for the pressure again with the new helper.
+		m_theHighSamples = 0;
+	} // if
+	reapHelpers (false);
+} // checkPressure
+
+/**
+ * Method addHelper starts a helper thread.
+ */
+bool CThreadItPool::addHelper ()
+{
+	bool isSuccess = false;
+	LONG theThreadCount = 0;
+	unsigned int theThreadId = 0;
+	HANDLE theThread = NULL;
+
+	// Count the helper first so that it can retire as soon as it starts.
+	theThreadCount = InterlockedIncrement (&m_theThreadCount);
+	theThread = (HANDLE)_beginthreadex (NULL, 0, helperStub, this, 0, &theThreadId);
+	if (theThread != NULL)
+	{
+		EnterCriticalSection (&m_theHelperAccess);
+		m_theHelpers.push_back (theThread);
+		LeaveCriticalSection (&m_theHelperAccess);
+		InterlockedIncrement (&m_theGrowCount);
+		if (theThreadCount > m_thePeakThreadCount)
+		{
+			InterlockedExchange (&m_thePeakThreadCount, theThreadCount);
+		} // if
+		isSuccess = true;
+	}
+	else
+	{
+		InterlockedDecrement (&m_theThreadCount);
+		m_ptheLogger->error ("unable to start a helper thread");
+	} // if
+	return isSuccess;
+} // addHelper
+
+/**
+ * Method reapHelpers closes the handles of the helpers that have stopped.
+ */
+void CThreadItPool::reapHelpers (bool isWait)
+{
+	std::vector<HANDLE>::iterator theHelper;
+
+	EnterCriticalSection (&m_theHelperAccess);
+	theHelper = m_theHelpers.begin ();
+	while (theHelper != m_theHelpers.end ())
+	{
+		if (WaitForSingleObject (*theHelper, isWait ? INFINITE : 0) == WAIT_OBJECT_0)
+		{
+			CloseHandle (*theHelper);
+			theHelper = m_theHelpers.erase (theHelper);
+		}
+		else
+		{
+			theHelper++;
+		} // if
+	} // while
+	LeaveCriticalSection (&m_theHelperAccess);
+} // reapHelpers
+
+/**
+ * Method helperStub is the thread function of a helper.
+ */
+unsigned int __stdcall CThreadItPool::helperStub (void* pthePool)
+{
+	CThreadItPool* ptheThreadItPool = static_cast<CThreadItPool*> (pthePool);
+
+	try
+	{
+		ptheThreadItPool->helperRoutine ();
+	} // try
+	catch (...)
+	{
+		InterlockedDecrement (&ptheThreadItPool->m_theThreadCount);
+		ptheThreadItPool->m_ptheLogger->error ("helper thread has exited with an exception condition");
+	} // catch
+	return 0;
+} // helperStub
+
+/**
+ * Method helperRoutine processes work packages from the work queue until the helper
+ * retires or the pool stops. The helpers wait on the work queue semaphore with the
+ * thread of execution. The thread of execution is woken and stopped through its own
+ * event (see CThreadIt::wakeThread and CThreadIt::stopThread) so each signal of the
+ * semaphore comes with a work package, apart from the release of the helpers when
+ * the pool stops.
+ */
+void CThreadItPool::helperRoutine ()
+{
+	bool isRetired = false;
+	DWORD Result = 0;
+	LONG theThreadCount = 0;
+	CWorkPackIt* pWorkPack = NULL;
+	HANDLE WorkQSem = m_WorkQ.getQSemaphore ();
+
+	while (!isRetired)
+	{
+		Result = WaitForSingleObject (WorkQSem, m_theLinger);
+		if (m_isExitThread)
+		{
+			if (Result == WAIT_OBJECT_0)
+			{
+				ReleaseSemaphore (WorkQSem, 1, NULL);
+			} // if
+			InterlockedDecrement (&m_theThreadCount);
+			isRetired = true;
+		}
+		else if (Result == WAIT_OBJECT_0)
+		{
+			pWorkPack = m_WorkQ.getItemNoDec ();
+			if (pWorkPack != NULL)
+			{
+				InterlockedDecrement (&m_theWorkQDepth);
+				processWorkPack (pWorkPack);
+			}
+			else
+			{
+				m_ptheLogger->error ("The work pack input is null - work cannot be performed");
+			} // if
+		}
+		else
+		{
+			// There has been no work for the linger time so retire if the pool is above its minimum.
+			theThreadCount = m_theThreadCount;
+			if ((theThreadCount > m_theMinThreads) && (InterlockedCompareExchange (&m_theThreadCount, theThreadCount - 1, theThreadCount) == theThreadCount))
+			{
+				InterlockedIncrement (&m_theShrinkCount);
+				m_ptheLogger->infoStream () << "pool shrunk to " << (theThreadCount - 1) << " threads";
+				isRetired = true;
+			} // if
+		} // if
+	} // while
+} // helperRoutine
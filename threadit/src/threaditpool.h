@@ -0,0 +1,267 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItPool
+ * Description: Class CThreadItPool is a CThreadIt whose worker methods are served
+ * by between a minimum and a maximum number of threads. It is derived from in the
+ * same way as CThreadIt and keeps its startWork, getWork and observer semantics,
+ * but the worker methods may be called on several threads at once and must be
+ * safe to do so. Periodic and event methods are still only called on the thread of
+ * execution of the CThreadIt.
+ *
+ * The thread of execution counts as the first thread of the pool. The others are
+ * helper threads that wait on the same work queue and process work packages with
+ * CThreadIt::processWorkPack, so throttling, admission control, the result cache
+ * and completions behave as they do for a single thread.
+ *
+ * A monitor thread samples the pool every THREADIT_POOL_PERIOD milliseconds. The
+ * pool is under pressure if the work queue is deeper than the depth target for
+ * each thread, or if work is waiting and the moving average of the queue wait is
+ * above the wait target. A helper is added once the pressure has been seen for the
+ * number of samples given by the growth policy, and the count starts again after
+ * each helper is added so the pool grows one thread at a time. A helper that finds
+ * no work for the linger time retires while the pool is above its minimum. The
+ * pool therefore grows only under sustained pressure and shrinks only after a
+ * sustained quiet spell, which keeps it from thrashing.
+ *
+ * Each resize is logged and counted. The size, peak size, number of busy threads
+ * and queue wait can be read at any time.
+ *
+ * A derived class must call stopThread and waitForThreadToStop in its destructor
+ * as usual. The helpers are stopped by waitForThreadToStop before the worker
+ * methods of the derived class are destroyed.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_POOL_H)
+#define THREADIT_POOL_H
+
+// Includes
+#include <vector>
+#include "threadit.h"
+
+/** THREADIT_POOL_PERIOD is the period in milliseconds of the pool monitor. */
+#define THREADIT_POOL_PERIOD 10
+
+// Forward Declarations
+class CThreadItPool;
+
+/**
+ * Class CThreadItPoolMonitor is the monitor thread of a CThreadItPool.
+ */
+class CThreadItPoolMonitor : public CThreadIt
+{
+	// Attributes
+private:
+	/** m_pthePool is the pool that is monitored. */
+	CThreadItPool* m_pthePool;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItPoolMonitor starts the periodic check of the pool.
+	 */
+	CThreadItPoolMonitor (CThreadItPool* pthePool);
+
+	/**
+	 * Method ~CThreadItPoolMonitor stops the thread.
+	 */
+	virtual ~CThreadItPoolMonitor ();
+
+protected:
+	/**
+	 * Method checkPool is the periodic method. It asks the pool to check its pressure.
+	 */
+	bool checkPool (CWorkPackIt theTimedWork, CWorkPackIt*& ptheWorkDone);
+
+}; // class CThreadItPoolMonitor
+
+/**
+ * Class CThreadItPool is a CThreadIt served by an elastic pool of threads.
+ */
+class CThreadItPool : public CThreadIt
+{
+	friend class CThreadItPoolMonitor;
+
+	// Attributes
+private:
+	/** m_theHelpers are the thread handles of the helpers that have been started and
+	 * not yet reaped. */
+	std::vector<HANDLE> m_theHelpers;
+	/** m_theHelperAccess protects m_theHelpers. */
+	CRITICAL_SECTION m_theHelperAccess;
+	/** m_theMinThreads is the fewest threads in the pool. */
+	LONG m_theMinThreads;
+	/** m_theMaxThreads is the most threads in the pool. */
+	LONG m_theMaxThreads;
+	/** m_theThreadCount is the number of threads in the pool including the thread of execution. */
+	volatile LONG m_theThreadCount;
+	/** m_thePeakThreadCount is the most threads the pool has had. */
+	volatile LONG m_thePeakThreadCount;
+	/** m_theBusyCount is the number of threads processing a work package. */
+	volatile LONG m_theBusyCount;
+	/** m_theGrowCount is the number of helpers added. */
+	volatile LONG m_theGrowCount;
+	/** m_theShrinkCount is the number of helpers retired. */
+	volatile LONG m_theShrinkCount;
+	/** m_theWaitEwma is the moving average of the queue wait in microseconds. */
+	volatile LONG m_theWaitEwma;
+	/** m_theWaitTarget is the queue wait in microseconds above which the pool is under
+	 * pressure. Zero ignores the queue wait. */
+	volatile LONG m_theWaitTarget;
+	/** m_theDepthTarget is the queue depth for each thread above which the pool is
+	 * under pressure. Zero ignores the queue depth. */
+	volatile LONG m_theDepthTarget;
+	/** m_theGrowSamples is the number of samples in a row under pressure before a helper is added. */
+	volatile LONG m_theGrowSamples;
+	/** m_theHighSamples is the number of samples in a row under pressure. It is only
+	 * used by the monitor. */
+	LONG m_theHighSamples;
+	/** m_theLinger is the time in milliseconds a helper waits for work before it retires. */
+	volatile DWORD m_theLinger;
+	/** m_ptheMonitor samples the pressure on the pool. */
+	CThreadItPoolMonitor* m_ptheMonitor;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItPool starts the thread of execution, the helpers needed
+	 * for the minimum and the monitor.
+	 * @param[in] theThreadName is the name of the thread of execution.
+	 * @param[in] theMinThreads is the fewest threads in the pool. It is at least one.
+	 * @param[in] theMaxThreads is the most threads in the pool. Zero uses one per processor.
+	 */
+	CThreadItPool (const std::string& theThreadName, UINT theMinThreads = 1, UINT theMaxThreads = 0);
+
+	/**
+	 * Method ~CThreadItPool stops the monitor, the helpers and the thread of execution.
+	 */
+	virtual ~CThreadItPool ();
+
+	/**
+	 * Method setGrowthPolicy sets when the pool grows.
+	 * @param[in] theWaitTarget is the queue wait in microseconds above which the pool
+	 * is under pressure. Zero ignores the queue wait.
+	 * @param[in] theDepthTarget is the queue depth for each thread above which the pool
+	 * is under pressure. Zero ignores the queue depth.
+	 * @param[in] theGrowSamples is the number of samples in a row under pressure
+	 * before a helper is added.
+	 */
+	void setGrowthPolicy (ULONG theWaitTarget, ULONG theDepthTarget, UINT theGrowSamples);
+
+	/**
+	 * Method setLinger sets the time in milliseconds a helper waits for work before
+	 * it retires. It applies from the next wait of each helper.
+	 */
+	void setLinger (DWORD theLinger);
+
+	/**
+	 * Method getPoolSize returns the number of threads in the pool.
+	 */
+	UINT getPoolSize () const;
+
+	/**
+	 * Method getPeakPoolSize returns the most threads the pool has had.
+	 */
+	UINT getPeakPoolSize () const;
+
+	/**
+	 * Method getMinPoolSize returns the fewest threads in the pool.
+	 */
+	UINT getMinPoolSize () const;
+
+	/**
+	 * Method getMaxPoolSize returns the most threads in the pool.
+	 */
+	UINT getMaxPoolSize () const;
+
+	/**
+	 * Method getBusyCount returns the number of threads processing a work package.
+	 */
+	LONG getBusyCount () const;
+
+	/**
+	 * Method getGrowCount returns the number of helpers added.
+	 */
+	LONG getGrowCount () const;
+
+	/**
+	 * Method getShrinkCount returns the number of helpers retired.
+	 */
+	LONG getShrinkCount () const;
+
+	/**
+	 * Method getQueueWait returns the moving average of the queue wait in microseconds.
+	 */
+	LONG getQueueWait () const;
+
+	/**
+	 * Method waitForThreadToStop stops the monitor and the helpers once stopThread
+	 * has been called and then waits for the thread of execution to stop.
+	 */
+	virtual void waitForThreadToStop ();
+
+protected:
+	/**
+	 * Method processWorkPack records the queue wait and the busy threads around the
+	 * processing of a work package.
+	 */
+	virtual void processWorkPack (CWorkPackIt* pWorkPack);
+
+private:
+	/**
+	 * Method checkPressure is called by the monitor. It adds a helper once the pool
+	 * has been under pressure for long enough and reaps the helpers that retired.
+	 */
+	void checkPressure ();
+
+	/**
+	 * Method addHelper starts a helper thread.
+	 * \return true if the helper is started.
+	 */
+	bool addHelper ();
+
+	/**
+	 * Method reapHelpers closes the handles of the helpers that have stopped.
+	 * @param[in] isWait waits for every helper to stop.
+	 */
+	void reapHelpers (bool isWait);
+
+	/**
+	 * Method helperStub is the thread function of a helper.
+	 * @param[in] pthePool is the pool.
+	 */
+	static unsigned int __stdcall helperStub (void* pthePool);
+
+	/**
+	 * Method helperRoutine processes work packages from the work queue until the
+	 * helper retires or the pool stops.
+	 */
+	void helperRoutine ();
+
+	/// not copiable
+	CThreadItPool (const CThreadItPool&);
+	const CThreadItPool& operator= (const CThreadItPool&);
+
+}; // class CThreadItPool
+
+#endif // !defined (THREADIT_POOL_H)
@@ -0,0 +1,489 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItRateLimiter
+ * Description: Class CThreadItRateLimiter limits the rate of work per sender and
+ * per instruction. See the header file for the token buckets and the policies.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <intrin.h>
+#include "threaditratelimiter.h"
+
+// Class: CThreadItRateLimiter Implementation
+
+/**
+ * Constructor CThreadItRateLimiter creates a limiter with no limits.
+ */
+CThreadItRateLimiter::CThreadItRateLimiter (LimitPolicy thePolicy, DWORD theMaxDelay)
+{
+	LARGE_INTEGER theFrequency;
+
+	m_ptheLogger = &(log4cpp::Category::getInstance ("threadit.CThreadItRateLimiter"));
+	QueryPerformanceFrequency (&theFrequency);
+	m_theFrequency = theFrequency.QuadPart;
+	for (ULONG theSlot = 0; theSlot < THREADIT_LIMIT_SENDERS; theSlot++)
+	{
+		m_theSenders[theSlot].ptheSender = NULL;
+		m_theSenders[theSlot].theLastUse = 0;
+		m_theSenders[theSlot].isOwnLimit = false;
+		setLimit (m_theSenders[theSlot].theBucket, 0, 0);
+	} // for
+	m_theSenderAge = (m_theFrequency * THREADIT_LIMIT_SENDER_AGE) / 1000;
+	InitializeCriticalSection (&m_theSenderAccess);
+	for (UINT theInstruction = 0; theInstruction < CThreadIt::MAX_WORK_METHODS; theInstruction++)
+	{
+		setLimit (m_theInstructions[theInstruction], 0, 0);
+	} // for
+	setLimit (m_theOtherSenders, 0, 0);
+	m_theDefaultInterval = 0;
+	m_theDefaultTolerance = 0;
+	m_isTrackSenders = false;
+	setPolicy (thePolicy, theMaxDelay);
+} // constructor CThreadItRateLimiter
+
+/**
+ * Method ~CThreadItRateLimiter is the destructor for the class.
+ */
+CThreadItRateLimiter::~CThreadItRateLimiter ()
+{
+	DeleteCriticalSection (&m_theSenderAccess);
+} // ~CThreadItRateLimiter
+
+/**
+ * Method setPolicy sets the policy applied to work over a limit.
+ */
+void CThreadItRateLimiter::setPolicy (LimitPolicy thePolicy, DWORD theMaxDelay)
+{
+	m_theMaxDelay = (m_theFrequency * theMaxDelay) / 1000;
+	m_thePolicy = thePolicy;
+} // setPolicy
+
+/**
+ * Method getPolicy returns the policy applied to work over a limit.
+ */
+CThreadItRateLimiter::LimitPolicy CThreadItRateLimiter::getPolicy () const
+{
+	return m_thePolicy;
+} // getPolicy
+
+/**
+ * Method setSenderLimit sets the limit of a sender.
+ */
+bool CThreadItRateLimiter::setSenderLimit (const CThreadIt* ptheSender, ULONG theRate, ULONG theBurst)
+{
+	bool isSuccess = true;
+	Bucket* ptheBucket = &m_theOtherSenders;
+	Sender* ptheSlot = NULL;
+
+	if (ptheSender != NULL)
+	{
+		ptheBucket = NULL;
+		ptheSlot = findSender (ptheSender, true);
+		if (ptheSlot != NULL)
+		{
+			// The slot keeps the limit until the sender is removed.
+			ptheSlot->isOwnLimit = true;
+			ptheBucket = &ptheSlot->theBucket;
+		} // if
+	} // if
+	if (ptheBucket != NULL)
+	{
+		setLimit (*ptheBucket, theRate, theBurst);
+		m_isTrackSenders = true;
+	}
+	else
+	{
+		m_ptheLogger->warnStream () << "setSenderLimit - the table of " << THREADIT_LIMIT_SENDERS << " senders is full";
+		isSuccess = false;
+	} // if
+	return isSuccess;
+} // setSenderLimit
+
+/**
+ * Method setDefaultSenderLimit sets the limit given to each sender that has no
+ * limit of its own.
+ */
+void CThreadItRateLimiter::setDefaultSenderLimit (ULONG theRate, ULONG theBurst)
+{
+	Bucket theDefault;
+
+	setLimit (theDefault, theRate, theBurst);
+	m_theDefaultInterval = theDefault.theInterval;
+	m_theDefaultTolerance = theDefault.theTolerance;
+	m_isTrackSenders = true;
+} // setDefaultSenderLimit
+
+/**
+ * Method removeSender gives up the slot of a sender. The slot is marked with the
+ * address of the limiter, which is never a sender, so that the probe for other
+ * senders still passes it, and it is given to the next sender once the table is full.
+ */
+bool CThreadItRateLimiter::removeSender (const CThreadIt* ptheSender)
+{
+	bool isSuccess = false;
+	Sender* ptheSlot = NULL;
+
+	if (ptheSender != NULL)
+	{
+		EnterCriticalSection (&m_theSenderAccess);
+		ptheSlot = findSender (ptheSender, false);
+		if (ptheSlot != NULL)
+		{
+			ptheSlot->isOwnLimit = false;
+			ptheSlot->theLastUse = 0;
+			InterlockedExchangePointer (&ptheSlot->ptheSender, this);
+			isSuccess = true;
+		} // if
+		LeaveCriticalSection (&m_theSenderAccess);
+	} // if
+	return isSuccess;
+} // removeSender
+
+/**
+ * Method setInstructionLimit sets the limit of an instruction over all senders.
+ */
+bool CThreadItRateLimiter::setInstructionLimit (UINT theInstruction, ULONG theRate, ULONG theBurst)
+{
+	bool isSuccess = false;
+
+	if (theInstruction < CThreadIt::MAX_WORK_METHODS)
+	{
+		setLimit (m_theInstructions[theInstruction], theRate, theBurst);
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // setInstructionLimit
+
+/**
+ * Method admit checks a work package against the limits of its sender and its
+ * instruction and takes a token from each. The token of the sender is given back
+ * if the instruction limit throttles the work package.
+ */
+bool CThreadItRateLimiter::admit (const CWorkPackIt* pWorkPack)
+{
+	bool isAdmitted = true;
+	LONGLONG theWait = 0;
+	LONGLONG theInstructionWait = 0;
+	LARGE_INTEGER theNow;
+	const void* ptheSource = NULL;
+	Sender* ptheSlot = NULL;
+	Bucket* ptheSender = NULL;
+	Bucket* ptheInstruction = NULL;
+
+	// Find the bucket of the sender.
+	if (m_isTrackSenders)
+	{
+		ptheSource = pWorkPack->m_ptheSource;
+		if (ptheSource == NULL)
+		{
+			ptheSource = pWorkPack->m_wptheSource.lock ().get ();
+		} // if
+		if (ptheSource != NULL)
+		{
+			ptheSlot = findSender (ptheSource, true);
+		} // if
+		if (ptheSlot != NULL)
+		{
+			ptheSender = &ptheSlot->theBucket;
+		}
+		else
+		{
+			ptheSender = &m_theOtherSenders;
+		} // if
+	} // if
+	if ((pWorkPack->m_theInstruction < CThreadIt::MAX_WORK_METHODS) && (m_theInstructions[pWorkPack->m_theInstruction].theInterval > 0))
+	{
+		ptheInstruction = &m_theInstructions[pWorkPack->m_theInstruction];
+	} // if
+	if ((ptheSender != NULL) || (ptheInstruction != NULL))
+	{
+		QueryPerformanceCounter (&theNow);
+		if (ptheSlot != NULL)
+		{
+			ptheSlot->theLastUse = theNow.QuadPart;
+		} // if
+		// The sender is checked first so that a throttled sender takes no token from the instruction.
+		if (ptheSender != NULL)
+		{
+			isAdmitted = takeToken (*ptheSender, theNow.QuadPart, theWait);
+		} // if
+		if ((isAdmitted) && (ptheInstruction != NULL))
+		{
+			isAdmitted = takeToken (*ptheInstruction, theNow.QuadPart, theInstructionWait);
+			if (theInstructionWait > theWait)
+			{
+				theWait = theInstructionWait;
+			} // if
+			if ((!isAdmitted) && (ptheSender != NULL))
+			{
+				// The work package is throttled so the sender keeps its token.
+				returnToken (*ptheSender);
+			} // if
+			if (isAdmitted)
+			{
+				InterlockedIncrement (&ptheInstruction->theAdmitted);
+			} // if
+			if ((!isAdmitted) || (theInstructionWait > 0))
+			{
+				InterlockedIncrement (&ptheInstruction->theThrottled);
+			} // if
+		} // if
+		if (ptheSender != NULL)
+		{
+			if (isAdmitted)
+			{
+				InterlockedIncrement (&ptheSender->theAdmitted);
+			} // if
+			if ((!isAdmitted) || (theWait > 0))
+			{
+				InterlockedIncrement (&ptheSender->theThrottled);
+			} // if
+		} // if
+		// Under LIMIT_DELAY the tokens are reserved and the sender waits until they are due.
+		if ((isAdmitted) && (theWait > 0))
+		{
+			Sleep ((DWORD)(((theWait * 1000) + m_theFrequency - 1) / m_theFrequency));
+		} // if
+	} // if
+	return isAdmitted;
+} // admit
+
+/**
+ * Method getSenderCounts returns the counts of a sender.
+ */
+bool CThreadItRateLimiter::getSenderCounts (const CThreadIt* ptheSender, LONG& theAdmitted, LONG& theThrottled)
+{
+	bool isSuccess = false;
+	Bucket* ptheBucket = &m_theOtherSenders;
+	Sender* ptheSlot = NULL;
+
+	theAdmitted = 0;
+	theThrottled = 0;
+	if (ptheSender != NULL)
+	{
+		ptheSlot = findSender (ptheSender, false);
+		ptheBucket = (ptheSlot != NULL) ? &ptheSlot->theBucket : NULL;
+	} // if
+	if (ptheBucket != NULL)
+	{
+		theAdmitted = ptheBucket->theAdmitted;
+		theThrottled = ptheBucket->theThrottled;
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // getSenderCounts
+
+/**
+ * Method getInstructionCounts returns the counts of an instruction.
+ */
+bool CThreadItRateLimiter::getInstructionCounts (UINT theInstruction, LONG& theAdmitted, LONG& theThrottled) const
+{
+	bool isSuccess = false;
+
+	theAdmitted = 0;
+	theThrottled = 0;
+	if (theInstruction < CThreadIt::MAX_WORK_METHODS)
+	{
+		theAdmitted = m_theInstructions[theInstruction].theAdmitted;
+		theThrottled = m_theInstructions[theInstruction].theThrottled;
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // getInstructionCounts
+
+/**
+ * Method findSender returns the slot of a sender. The table is probed from the
+ * hash of the sender without a lock. A sender that has no slot is given one under
+ * the lock by claimSender.
+ */
+CThreadItRateLimiter::Sender* CThreadItRateLimiter::findSender (const void* ptheSender, bool isClaim)
+{
+	Sender* ptheSlot = NULL;
+	void* ptheSlotSender = NULL;
+	ULONG theSlot = hashSender (ptheSender);
+
+	for (ULONG theProbe = 0; (theProbe < THREADIT_LIMIT_SENDERS) && (ptheSlot == NULL); theProbe++)
+	{
+		ptheSlotSender = m_theSenders[theSlot].ptheSender;
+		if (ptheSlotSender == ptheSender)
+		{
+			ptheSlot = &m_theSenders[theSlot];
+		}
+		else if (ptheSlotSender == NULL)
+		{
+			// The sender would have been in this slot.
+			break;
+		} // if
+		theSlot = (theSlot + 1) % THREADIT_LIMIT_SENDERS;
+	} // for
+	if ((ptheSlot == NULL) && (isClaim))
+	{
+		EnterCriticalSection (&m_theSenderAccess);
+		ptheSlot = claimSender (ptheSender);
+		LeaveCriticalSection (&m_theSenderAccess);
+	} // if
+	return ptheSlot;
+} // findSender
+
+/**
+ * Method hashSender returns the slot at which the probe for a sender starts.
+ */
+ULONG CThreadItRateLimiter::hashSender (const void* ptheSender)
+{
+	return (ULONG)((((ULONG_PTR)ptheSender) >> 4) * 2654435761u) % THREADIT_LIMIT_SENDERS;
+} // hashSender
+
+/**
+ * Method claimSender claims a slot for a sender. The sender takes the first free
+ * slot of its probe. A slot is never freed so once there is no free slot the table
+ * stays full and every probe passes every slot. The sender is then given the slot
+ * of a removed sender or of the sender on the default limit that has been idle the
+ * longest, if that is longer than THREADIT_LIMIT_SENDER_AGE.
+ */
+CThreadItRateLimiter::Sender* CThreadItRateLimiter::claimSender (const void* ptheSender)
+{
+	Sender* ptheSlot = NULL;
+	Sender* ptheOldest = NULL;
+	Sender* ptheCandidate = NULL;
+	bool isFound = false;
+	ULONG theSlot = hashSender (ptheSender);
+	LARGE_INTEGER theNow;
+
+	QueryPerformanceCounter (&theNow);
+	for (ULONG theProbe = 0; (theProbe < THREADIT_LIMIT_SENDERS) && (ptheSlot == NULL); theProbe++)
+	{
+		ptheCandidate = &m_theSenders[theSlot];
+		if (ptheCandidate->ptheSender == ptheSender)
+		{
+			// Another thread claimed the slot first.
+			ptheSlot = ptheCandidate;
+			isFound = true;
+		}
+		else if (ptheCandidate->ptheSender == NULL)
+		{
+			ptheSlot = ptheCandidate;
+		}
+		else if ((!ptheCandidate->isOwnLimit) && (theNow.QuadPart - ptheCandidate->theLastUse > m_theSenderAge) &&
+			((ptheOldest == NULL) || (ptheCandidate->theLastUse < ptheOldest->theLastUse)))
+		{
+			ptheOldest = ptheCandidate;
+		} // if
+		theSlot = (theSlot + 1) % THREADIT_LIMIT_SENDERS;
+	} // for
+	if (ptheSlot == NULL)
+	{
+		ptheSlot = ptheOldest;
+	} // if
+	if ((ptheSlot != NULL) && (!isFound))
+	{
+		// The slot is ours so give it the default limit before the sender can find it.
+		setLimit (ptheSlot->theBucket, 0, 0);
+		ptheSlot->theBucket.theInterval = m_theDefaultInterval;
+		ptheSlot->theBucket.theTolerance = m_theDefaultTolerance;
+		ptheSlot->theLastUse = theNow.QuadPart;
+		ptheSlot->isOwnLimit = false;
+		InterlockedExchangePointer (&ptheSlot->ptheSender, (void*)ptheSender);
+	} // if
+	return ptheSlot;
+} // claimSender
+
+/**
+ * Method setLimit sets the interval and tolerance of a bucket. A burst of one
+ * allows no work package to arrive early.
+ */
+void CThreadItRateLimiter::setLimit (Bucket& theBucket, ULONG theRate, ULONG theBurst)
+{
+	theBucket.theArrival = 0;
+	theBucket.theInterval = 0;
+	theBucket.theTolerance = 0;
+	if (theRate > 0)
+	{
+		theBucket.theInterval = m_theFrequency / theRate;
+		if (theBucket.theInterval < 1)
+		{
+			theBucket.theInterval = 1;
+		} // if
+		if (theBurst > 1)
+		{
+			theBucket.theTolerance = theBucket.theInterval * (theBurst - 1);
+		} // if
+	} // if
+	theBucket.theAdmitted = 0;
+	theBucket.theThrottled = 0;
+} // setLimit
+
+/**
+ * Method takeToken takes a token from a bucket. A work package conforms if it does
+ * not arrive before the theoretical arrival time less the tolerance. Taking the
+ * token moves the arrival time on by one interval from the later of the arrival
+ * time and now.
+ */
+bool CThreadItRateLimiter::takeToken (Bucket& theBucket, LONGLONG theNow, LONGLONG& theWait)
+{
+	bool isTaken = true;
+	LONGLONG theArrival = 0;
+	LONGLONG theNext = 0;
+	LONGLONG theInterval = theBucket.theInterval;
+
+	theWait = 0;
+	if (theInterval > 0)
+	{
+		do
+		{
+			theArrival = theBucket.theArrival;
+			theWait = theArrival - theBucket.theTolerance - theNow;
+			if (theWait <= 0)
+			{
+				theWait = 0;
+				isTaken = true;
+			}
+			else
+			{
+				isTaken = (m_thePolicy == LIMIT_DELAY) && (theWait <= m_theMaxDelay);
+			} // if
+			if (theArrival > theNow)
+			{
+				theNext = theArrival + theInterval;
+			}
+			else
+			{
+				theNext = theNow + theInterval;
+			} // if
+		} while ((isTaken) && (_InterlockedCompareExchange64 (&theBucket.theArrival, theNext, theArrival) != theArrival));
+	} // if
+	return isTaken;
+} // takeToken
+
+/**
+ * Method returnToken gives back a token by moving the theoretical arrival time
+ * back by one interval.
+ */
+void CThreadItRateLimiter::returnToken (Bucket& theBucket)
+{
+	if (theBucket.theInterval > 0)
+	{
+		InterlockedExchangeAdd64 (&theBucket.theArrival, -theBucket.theInterval);
+	} // if
+} // returnToken
@@ -0,0 +1,288 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItRateLimiter
+ * Description: Class CThreadItRateLimiter limits the rate at which work is sent to a
+ * CThreadIt (see CThreadIt::setRateLimiter). Limits are set per sender and per
+ * instruction as a rate in work packages per second and a burst. The sender is the
+ * CThreadIt in m_ptheSource or m_wptheSource of the work package. Work packages with
+ * no sender share one limit.
+ *
+ * Each limit is a token bucket kept as the theoretical arrival time of the next
+ * work package (the generic cell rate algorithm). A work package conforms if it
+ * does not arrive earlier than that time less the burst tolerance, and taking a
+ * token moves the time on by one interval with a single compare and swap, so a
+ * check costs one atomic operation per limit and no lock. The sender limit is
+ * checked before the instruction limit so that a throttled sender does not use up
+ * the tokens of the instruction that other senders share, and the token of the
+ * sender is given back if the instruction limit then throttles the work package.
+ *
+ * Under LIMIT_REJECT a work package over a limit is throttled. Under LIMIT_DELAY the
+ * sending thread waits for its token if that is no longer than the most delay
+ * allowed and is throttled otherwise, which slows the sender down to the limit.
+ * The wait is a Sleep within CThreadIt::startWork on the thread that sends the work.
+ * A CThreadIt that sends work under LIMIT_DELAY stops processing its own queue for
+ * up to the most delay allowed for each work package, so LIMIT_REJECT should be used
+ * for senders that must stay responsive.
+ *
+ * The senders are kept in a fixed table of THREADIT_LIMIT_SENDERS slots. A sender is
+ * found without a lock and a slot is claimed under a lock on first use. Senders
+ * without a limit of their own are given the default sender limit. Once the table
+ * is full the slot of a sender on the default limit that has sent nothing for
+ * THREADIT_LIMIT_SENDER_AGE milliseconds is given to the new sender, and a sender
+ * that is destroyed should be removed with removeSender so that another sender at
+ * the same address does not take over its limit. Senders for which there is no slot
+ * share the limit of the senders with no identity. Limits should be set before work
+ * is sent.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_RATE_LIMITER_H)
+#define THREADIT_RATE_LIMITER_H
+
+// Includes
+#include "threadit.h"
+
+/** THREADIT_LIMIT_SENDERS is the number of senders tracked by a rate limiter. */
+#define THREADIT_LIMIT_SENDERS 64
+/** THREADIT_LIMIT_SENDER_AGE is the time in milliseconds a sender on the default
+ * limit must be idle before its slot may be given to another sender. */
+#define THREADIT_LIMIT_SENDER_AGE 60000
+
+/**
+ * Class CThreadItRateLimiter limits the rate of work per sender and per instruction.
+ */
+class CThreadItRateLimiter
+{
+	// types
+public:
+	/** LimitPolicy is what happens to a work package over a limit. */
+	enum LimitPolicy
+	{
+		/** The work package is throttled at once. */
+		LIMIT_REJECT = 0,
+		/** The sender waits for a token up to the most delay allowed. The sending
+		 * thread sleeps within startWork. */
+		LIMIT_DELAY
+	};
+
+private:
+	/** Bucket is a token bucket. It fills a cache line so that the buckets of busy
+	 * senders do not share one. */
+	typedef struct BucketTag
+	{
+		/** theArrival is the theoretical arrival time in performance counter ticks. */
+		volatile LONGLONG theArrival;
+		/** theInterval is the time in ticks to earn a token. Zero means no limit. */
+		LONGLONG theInterval;
+		/** theTolerance is how far in ticks a work package may arrive early (the burst). */
+		LONGLONG theTolerance;
+		/** theAdmitted is the number of work packages admitted. */
+		volatile LONG theAdmitted;
+		/** theThrottled is the number of work packages throttled or delayed. */
+		volatile LONG theThrottled;
+		/** thePadding fills the cache line. */
+		char thePadding[32];
+	} Bucket;
+
+	/** Sender is a slot of the sender table. */
+	typedef struct SenderTag
+	{
+		/** ptheSender is the sender. It is set when the slot is claimed and is never
+		 * set back to NULL so that the probe for a sender passes the slot. */
+		void* volatile ptheSender;
+		/** theLastUse is the performance counter when the sender last sent work. */
+		volatile LONGLONG theLastUse;
+		/** isOwnLimit is true if the limit was set by setSenderLimit. Such a slot is
+		 * only given to another sender once the sender is removed. */
+		volatile bool isOwnLimit;
+		/** theBucket is the limit of the sender. */
+		Bucket theBucket;
+	} Sender;
+
+	// Attributes
+private:
+	/** m_theSenders are the senders with a limit. */
+	Sender m_theSenders[THREADIT_LIMIT_SENDERS];
+	/** m_theSenderAccess serialises the claims of the slots of the sender table. */
+	CRITICAL_SECTION m_theSenderAccess;
+	/** m_theSenderAge is THREADIT_LIMIT_SENDER_AGE in performance counter ticks. */
+	LONGLONG m_theSenderAge;
+	/** m_theOtherSenders is the limit shared by the senders with no identity or no slot. */
+	Bucket m_theOtherSenders;
+	/** m_theInstructions are the limits of the instructions. */
+	Bucket m_theInstructions[CThreadIt::MAX_WORK_METHODS];
+	/** m_theDefaultInterval is the interval of senders with no limit of their own. */
+	LONGLONG m_theDefaultInterval;
+	/** m_theDefaultTolerance is the tolerance of senders with no limit of their own. */
+	LONGLONG m_theDefaultTolerance;
+	/** m_isTrackSenders is true once a sender limit has been set. */
+	volatile bool m_isTrackSenders;
+	/** m_thePolicy is the policy applied to work over a limit. */
+	volatile LimitPolicy m_thePolicy;
+	/** m_theMaxDelay is the most time in ticks a sender waits under LIMIT_DELAY. */
+	LONGLONG m_theMaxDelay;
+	/** m_theFrequency is the performance counter frequency. */
+	LONGLONG m_theFrequency;
+	/** m_ptheLogger is the logger used to log information and errors. */
+	log4cpp::Category* m_ptheLogger;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItRateLimiter creates a limiter with no limits.
+	 * @param[in] thePolicy is the policy applied to work over a limit.
+	 * @param[in] theMaxDelay is the most time in milliseconds a sender waits under
+	 * LIMIT_DELAY.
+	 */
+	CThreadItRateLimiter (LimitPolicy thePolicy = LIMIT_REJECT, DWORD theMaxDelay = 100);
+
+	/**
+	 * Method ~CThreadItRateLimiter is the destructor for the class.
+	 */
+	virtual ~CThreadItRateLimiter ();
+
+	/**
+	 * Method setPolicy sets the policy applied to work over a limit.
+	 * @param[in] thePolicy is the policy.
+	 * @param[in] theMaxDelay is the most time in milliseconds a sender waits under
+	 * LIMIT_DELAY.
+	 */
+	void setPolicy (LimitPolicy thePolicy, DWORD theMaxDelay);
+
+	/**
+	 * Method getPolicy returns the policy applied to work over a limit.
+	 */
+	LimitPolicy getPolicy () const;
+
+	/**
+	 * Method setSenderLimit sets the limit of a sender.
+	 * @param[in] ptheSender is the sender. NULL sets the limit shared by the senders
+	 * with no identity.
+	 * @param[in] theRate is the rate in work packages per second. Zero removes the limit.
+	 * @param[in] theBurst is the number of work packages that may be sent at once.
+	 * \return false if the sender table is full.
+	 */
+	bool setSenderLimit (const CThreadIt* ptheSender, ULONG theRate, ULONG theBurst);
+
+	/**
+	 * Method setDefaultSenderLimit sets the limit given to each sender that has no
+	 * limit of its own when it first sends work.
+	 * @param[in] theRate is the rate in work packages per second. Zero means no limit.
+	 * @param[in] theBurst is the number of work packages that may be sent at once.
+	 */
+	void setDefaultSenderLimit (ULONG theRate, ULONG theBurst);
+
+	/**
+	 * Method removeSender gives up the slot of a sender, for instance when the sender
+	 * is destroyed. The slot is given to another sender once the table is full.
+	 * @param[in] ptheSender is the sender.
+	 * \return false if the sender is not tracked.
+	 */
+	bool removeSender (const CThreadIt* ptheSender);
+
+	/**
+	 * Method setInstructionLimit sets the limit of an instruction over all senders.
+	 * @param[in] theInstruction is the instruction.
+	 * @param[in] theRate is the rate in work packages per second. Zero removes the limit.
+	 * @param[in] theBurst is the number of work packages that may be sent at once.
+	 * \return false if the instruction is not valid.
+	 */
+	bool setInstructionLimit (UINT theInstruction, ULONG theRate, ULONG theBurst);
+
+	/**
+	 * Method admit checks a work package against the limits of its sender and its
+	 * instruction and takes a token from each. No token is taken if either limit
+	 * throttles the work package. It is called by CThreadIt::startWork on the
+	 * sending thread, which sleeps under LIMIT_DELAY until its tokens are due.
+	 * @param[in] pWorkPack is the work package.
+	 * \return true if the work package is admitted.
+	 */
+	bool admit (const CWorkPackIt* pWorkPack);
+
+	/**
+	 * Method getSenderCounts returns the counts of a sender.
+	 * @param[in] ptheSender is the sender. NULL returns the counts of the senders
+	 * with no identity or no slot.
+	 * @param[out] theAdmitted is the number of work packages admitted.
+	 * @param[out] theThrottled is the number of work packages throttled or delayed.
+	 * \return false if the sender is not tracked.
+	 */
+	bool getSenderCounts (const CThreadIt* ptheSender, LONG& theAdmitted, LONG& theThrottled);
+
+	/**
+	 * Method getInstructionCounts returns the counts of an instruction.
+	 * @param[in] theInstruction is the instruction.
+	 * @param[out] theAdmitted is the number of work packages admitted.
+	 * @param[out] theThrottled is the number of work packages throttled or delayed.
+	 * \return false if the instruction is not valid.
+	 */
+	bool getInstructionCounts (UINT theInstruction, LONG& theAdmitted, LONG& theThrottled) const;
+
+private:
+	/**
+	 * Method findSender returns the slot of a sender.
+	 * @param[in] ptheSender is the sender.
+	 * @param[in] isClaim claims a slot with the default limit if the sender has none.
+	 * \return the slot or NULL if the sender has no slot.
+	 */
+	Sender* findSender (const void* ptheSender, bool isClaim);
+
+	/**
+	 * Method hashSender returns the slot at which the probe for a sender starts.
+	 */
+	static ULONG hashSender (const void* ptheSender);
+
+	/**
+	 * Method claimSender claims a slot for a sender that has none. It is called with
+	 * m_theSenderAccess held.
+	 * \return the slot or NULL if the table is full.
+	 */
+	Sender* claimSender (const void* ptheSender);
+
+	/**
+	 * Method setLimit sets the interval and tolerance of a bucket.
+	 */
+	void setLimit (Bucket& theBucket, ULONG theRate, ULONG theBurst);
+
+	/**
+	 * Method takeToken takes a token from a bucket.
+	 * @param[in] theBucket is the bucket.
+	 * @param[in] theNow is the current time in ticks.
+	 * @param[out] theWait is the time in ticks before the token is due.
+	 * \return true if the token was taken now or reserved within the most delay allowed.
+	 */
+	bool takeToken (Bucket& theBucket, LONGLONG theNow, LONGLONG& theWait);
+
+	/**
+	 * Method returnToken gives back a token taken from a bucket for a work package
+	 * that was throttled by another limit.
+	 */
+	void returnToken (Bucket& theBucket);
+
+	/// not copiable
+	CThreadItRateLimiter (const CThreadItRateLimiter&);
+	const CThreadItRateLimiter& operator= (const CThreadItRateLimiter&);
+
+}; // class CThreadItRateLimiter
+
+#endif // !defined (THREADIT_RATE_LIMITER_H)
@@ -0,0 +1,504 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItResultCache
+ * Description: Class CThreadItResultCache keeps the results of idempotent
+ * instructions. See the header file for the lookup, coalescing and eviction.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include "threaditresultcache.h"
+
+// Class: CThreadItResultCache Implementation
+
+/**
+ * Constructor CThreadItResultCache creates an empty cache with no instructions enabled.
+ */
+CThreadItResultCache::CThreadItResultCache (ULONG theBudget)
+{
+	m_ptheLogger = &(log4cpp::Category::getInstance ("threadit.CThreadItResultCache"));
+	for (ULONG theStripe = 0; theStripe < THREADIT_CACHE_STRIPES; theStripe++)
+	{
+		InitializeCriticalSection (&m_theStripes[theStripe].theAccess);
+		m_theStripes[theStripe].theSize = 0;
+	} // for
+	for (UINT theInstruction = 0; theInstruction < CThreadIt::MAX_WORK_METHODS; theInstruction++)
+	{
+		m_theTimeToLive[theInstruction] = 0;
+	} // for
+	m_theStripeBudget = theBudget / THREADIT_CACHE_STRIPES;
+	m_theHits = 0;
+	m_theMisses = 0;
+	m_theCoalesced = 0;
+	m_theEvictions = 0;
+} // constructor CThreadItResultCache
+
+/**
+ * Method ~CThreadItResultCache frees the entries and any parked work packages.
+ */
+CThreadItResultCache::~CThreadItResultCache ()
+{
+	for (ULONG theStripe = 0; theStripe < THREADIT_CACHE_STRIPES; theStripe++)
+	{
+		for (EntryList::iterator theEntry = m_theStripes[theStripe].theEntries.begin (); theEntry != m_theStripes[theStripe].theEntries.end (); theEntry++)
+		{
+			if (!theEntry->theWaiters.empty ())
+			{
+				m_ptheLogger->error ("result cache destroyed with work packages waiting for a result");
+			} // if
+			for (size_t theWaiter = 0; theWaiter < theEntry->theWaiters.size (); theWaiter++)
+			{
+				delete theEntry->theWaiters[theWaiter].pWorkPack;
+			} // for
+		} // for
+		m_theStripes[theStripe].theIndex.clear ();
+		m_theStripes[theStripe].theEntries.clear ();
+		DeleteCriticalSection (&m_theStripes[theStripe].theAccess);
+	} // for
+} // ~CThreadItResultCache
+
+/**
+ * Method enable caches the results of an instruction.
+ */
+bool CThreadItResultCache::enable (UINT theInstruction, DWORD theTimeToLive)
+{
+	bool isSuccess = false;
+
+	if ((theInstruction < CThreadIt::MAX_WORK_METHODS) && (theTimeToLive != 0))
+	{
+		m_theTimeToLive[theInstruction] = theTimeToLive;
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // enable
+
+/**
+ * Method disable stops caching the results of an instruction.
+ */
+void CThreadItResultCache::disable (UINT theInstruction)
+{
+	if (theInstruction < CThreadIt::MAX_WORK_METHODS)
+	{
+		m_theTimeToLive[theInstruction] = 0;
+	} // if
+} // disable
+
+/**
+ * Method isEnabled returns true if the results of an instruction are cached.
+ */
+bool CThreadItResultCache::isEnabled (UINT theInstruction) const
+{
+	return ((theInstruction < CThreadIt::MAX_WORK_METHODS) && (m_theTimeToLive[theInstruction] != 0));
+} // isEnabled
+
+/**
+ * Method getStripe returns the stripe of a key. The key is mixed so that hashes that
+ * differ only in their high bits use different stripes.
+ */
+ULONG CThreadItResultCache::getStripe (ULONGLONG theKey)
+{
+	ULONG theValue = (ULONG)(theKey ^ (theKey >> 32));
+
+	theValue ^= theValue >> 16;
+	theValue *= 0x85ebca6b;
+	theValue ^= theValue >> 13;
+	return theValue % THREADIT_CACHE_STRIPES;
+} // getStripe
+
+/**
+ * Method setResult gives a work package the data item and status of a result.
+ */
+void CThreadItResultCache::setResult (CWorkPackIt* ptheWorkDone, const DataItemPtr& ptheResult, ULONG theStatus)
+{
+	ptheWorkDone->m_ptheDataItem = ptheResult;
+	ptheWorkDone->m_theStatus = theStatus;
+	ptheWorkDone->m_theTimeElapsed = 0;
+} // setResult
+
+/**
+ * Method getKey returns the key of a work package, which combines the instruction
+ * and the hash of the payload.
+ */
+bool CThreadItResultCache::getKey (const CWorkPackIt* pWorkPack, ULONGLONG& theKey)
+{
+	bool isSuccess = false;
+	ULONG theHash = 0;
+
+	if (pWorkPack->m_ptheDataItem && pWorkPack->m_ptheDataItem->getHash (theHash))
+	{
+		theKey = ((ULONGLONG)pWorkPack->m_theInstruction << 32) | theHash;
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // getKey
+
+/**
+ * Method findProducer returns the entry in flight for a work package that returned
+ * WORKDONE_CONTINUE. It is called with the stripe locked.
+ */
+CThreadItResultCache::EntryList::iterator CThreadItResultCache::findProducer (Stripe& theStripe, ULONGLONG theKey, const CWorkPackIt* pWorkPack)
+{
+	EntryList::iterator theEntry = theStripe.theEntries.end ();
+	std::pair<EntryIndex::iterator, EntryIndex::iterator> theRange = theStripe.theIndex.equal_range (theKey);
+
+	for (EntryIndex::iterator theItem = theRange.first; (theItem != theRange.second) && (theEntry == theStripe.theEntries.end ()); theItem++)
+	{
+		if ((theItem->second->isInFlight) && (theItem->second->ptheProducer == pWorkPack))
+		{
+			theEntry = theItem->second;
+		} // if
+	} // for
+	return theEntry;
+} // findProducer
+
+/**
+ * Method lookup looks up a work package before it is processed. An expired result
+ * is replaced by the result of this work package. A work package that returned
+ * WORKDONE_CONTINUE is looked up even if the instruction has since been disabled,
+ * so that the work packages waiting for it are answered.
+ */
+CThreadItResultCache::LookupResult CThreadItResultCache::lookup (CWorkPackIt* pWorkPack, CThreadIt* ptheOwner, bool& isSuccess, Flight& theFlight)
+{
+	LookupResult theResult = RESULT_UNCACHED;
+	UINT theInstruction = pWorkPack->m_theInstruction;
+	bool isContinue = (pWorkPack->m_theStatus == CThreadIt::WORKDONE_CONTINUE);
+	bool isResumed = false;
+	ULONGLONG theKey = 0;
+	DWORD theTimeToLive = 0;
+	Stripe* ptheStripe = NULL;
+	EntryList::iterator theEntry;
+	std::pair<EntryIndex::iterator, EntryIndex::iterator> theRange;
+	Entry theNewEntry;
+	Waiter theWaiter;
+
+	if ((isEnabled (theInstruction) || isContinue) && (theInstruction < CThreadIt::MAX_WORK_METHODS) && getKey (pWorkPack, theKey))
+	{
+		theTimeToLive = m_theTimeToLive[theInstruction];
+		theFlight.theStripe = getStripe (theKey);
+		ptheStripe = &m_theStripes[theFlight.theStripe];
+		EnterCriticalSection (&ptheStripe->theAccess);
+		theEntry = ptheStripe->theEntries.end ();
+		if (isContinue)
+		{
+			theEntry = findProducer (*ptheStripe, theKey, pWorkPack);
+			isResumed = (theEntry != ptheStripe->theEntries.end ());
+		} // if
+		theRange = ptheStripe->theIndex.equal_range (theKey);
+		for (EntryIndex::iterator theItem = theRange.first; (theItem != theRange.second) && (theEntry == ptheStripe->theEntries.end ()); theItem++)
+		{
+			if (theItem->second->ptheRequest->isEqual (*pWorkPack->m_ptheDataItem))
+			{
+				theEntry = theItem->second;
+			} // if
+		} // for
+		if (isResumed)
+		{
+			// The work package continues to produce the result the others wait for.
+			theFlight.theEntry = theEntry;
+			theResult = RESULT_MISS;
+		}
+		else if (theTimeToLive == 0)
+		{
+			// The instruction has been disabled since the work package was continued.
+			theResult = RESULT_UNCACHED;
+		}
+		else if (theEntry == ptheStripe->theEntries.end ())
+		{
+			// This is the first work package for the payload.
+			theNewEntry.theKey = theKey;
+			theNewEntry.theInstruction = theInstruction;
+			theNewEntry.ptheRequest = pWorkPack->m_ptheDataItem;
+			theNewEntry.theStatus = 0;
+			theNewEntry.isSuccess = false;
+			theNewEntry.isInFlight = true;
+			theNewEntry.ptheProducer = pWorkPack;
+			theNewEntry.theStoredAt = 0;
+			theNewEntry.theSize = 0;
+			ptheStripe->theEntries.push_front (theNewEntry);
+			ptheStripe->theIndex.insert (std::make_pair (theKey, ptheStripe->theEntries.begin ()));
+			theFlight.theEntry = ptheStripe->theEntries.begin ();
+			theResult = RESULT_MISS;
+		}
+		else if (theEntry->isInFlight)
+		{
+			// An identical work package is being processed so wait for its result.
+			theWaiter.pWorkPack = pWorkPack;
+			theWaiter.ptheOwner = ptheOwner;
+			theEntry->theWaiters.push_back (theWaiter);
+			theResult = RESULT_WAITING;
+		}
+		else if ((theTimeToLive == INFINITE) || ((GetTickCount () - theEntry->theStoredAt) < theTimeToLive))
+		{
+			setResult (pWorkPack, theEntry->ptheResult, theEntry->theStatus);
+			isSuccess = theEntry->isSuccess;
+			ptheStripe->theEntries.splice (ptheStripe->theEntries.begin (), ptheStripe->theEntries, theEntry);
+			theResult = RESULT_HIT;
+		}
+		else
+		{
+			// The result has expired so this work package produces the next one.
+			ptheStripe->theSize -= theEntry->theSize;
+			theEntry->theSize = 0;
+			theEntry->ptheResult.reset ();
+			theEntry->ptheRequest = pWorkPack->m_ptheDataItem;
+			theEntry->isInFlight = true;
+			theEntry->ptheProducer = pWorkPack;
+			theFlight.theEntry = theEntry;
+			theResult = RESULT_MISS;
+		} // if
+		LeaveCriticalSection (&ptheStripe->theAccess);
+		switch (theResult)
+		{
+			case RESULT_HIT :
+				InterlockedIncrement (&m_theHits);
+				break;
+			case RESULT_MISS :
+				if (!isResumed)
+				{
+					InterlockedIncrement (&m_theMisses);
+				} // if
+				break;
+			case RESULT_WAITING :
+				InterlockedIncrement (&m_theCoalesced);
+				break;
+			default :
+				break;
+		} // switch
+	} // if
+	return theResult;
+} // lookup
+
+/**
+ * Method complete stores the result of a work package that missed and returns the
+ * work packages that waited for it. A waiting work package gets the status
+ * WORKDONE_NO_RESULT if the worker method returned no result.
+ */
+void CThreadItResultCache::complete (Flight& theFlight, CWorkPackIt* pWorkDone, bool isSuccess, WaiterList& theWaiters)
+{
+	Stripe& theStripe = m_theStripes[theFlight.theStripe];
+	EntryList::iterator theEntry = theFlight.theEntry;
+
+	EnterCriticalSection (&theStripe.theAccess);
+	theWaiters.swap (theEntry->theWaiters);
+	for (size_t theWaiter = 0; theWaiter < theWaiters.size (); theWaiter++)
+	{
+		if (pWorkDone != NULL)
+		{
+			setResult (theWaiters[theWaiter].pWorkPack, pWorkDone->m_ptheDataItem, pWorkDone->m_theStatus);
+		}
+		else
+		{
+			theWaiters[theWaiter].pWorkPack->m_theStatus = CThreadIt::WORKDONE_NO_RESULT;
+		} // if
+	} // for
+	if ((pWorkDone != NULL) && isSuccess)
+	{
+		theEntry->ptheResult = pWorkDone->m_ptheDataItem;
+		theEntry->theStatus = pWorkDone->m_theStatus;
+		theEntry->isSuccess = isSuccess;
+		theEntry->isInFlight = false;
+		theEntry->ptheProducer = NULL;
+		theEntry->theStoredAt = GetTickCount ();
+		theEntry->theSize = sizeof (Entry) + theEntry->ptheRequest->getSizeHint ();
+		if (theEntry->ptheResult)
+		{
+			theEntry->theSize += theEntry->ptheResult->getSizeHint ();
+		} // if
+		theStripe.theSize += theEntry->theSize;
+		evict (theStripe);
+	}
+	else
+	{
+		// A failure is not cached so that the next work package tries again.
+		remove (theStripe, theEntry);
+	} // if
+	LeaveCriticalSection (&theStripe.theAccess);
+} // complete
+
+/**
+ * Method abandon ends the flight of a work package that returned WORKDONE_CONTINUE
+ * and is not processed again. The work packages that waited for it are given the
+ * status WORKDONE_NO_RESULT.
+ */
+bool CThreadItResultCache::abandon (CWorkPackIt* pWorkPack, WaiterList& theWaiters)
+{
+	bool isAbandoned = false;
+	ULONGLONG theKey = 0;
+	Stripe* ptheStripe = NULL;
+	EntryList::iterator theEntry;
+
+	if ((pWorkPack->m_theStatus == CThreadIt::WORKDONE_CONTINUE) && getKey (pWorkPack, theKey))
+	{
+		ptheStripe = &m_theStripes[getStripe (theKey)];
+		EnterCriticalSection (&ptheStripe->theAccess);
+		theEntry = findProducer (*ptheStripe, theKey, pWorkPack);
+		if (theEntry != ptheStripe->theEntries.end ())
+		{
+			theWaiters.swap (theEntry->theWaiters);
+			for (size_t theWaiter = 0; theWaiter < theWaiters.size (); theWaiter++)
+			{
+				theWaiters[theWaiter].pWorkPack->m_theStatus = CThreadIt::WORKDONE_NO_RESULT;
+			} // for
+			remove (*ptheStripe, theEntry);
+			isAbandoned = true;
+		} // if
+		LeaveCriticalSection (&ptheStripe->theAccess);
+	} // if
+	return isAbandoned;
+} // abandon
+
+/**
+ * Method remove removes an entry from a stripe. It is called with the stripe locked.
+ */
+void CThreadItResultCache::remove (Stripe& theStripe, EntryList::iterator theEntry)
+{
+	std::pair<EntryIndex::iterator, EntryIndex::iterator> theRange = theStripe.theIndex.equal_range (theEntry->theKey);
+	EntryIndex::iterator theItem = theRange.first;
+
+	while ((theItem != theRange.second) && (theItem->second != theEntry))
+	{
+		theItem++;
+	} // while
+	if (theItem != theRange.second)
+	{
+		theStripe.theIndex.erase (theItem);
+	} // if
+	theStripe.theSize -= theEntry->theSize;
+	theStripe.theEntries.erase (theEntry);
+} // remove
+
+/**
+ * Method evict removes the least recently used results of a stripe until it is
+ * within its budget. The results in flight are passed over. It is called with the
+ * stripe locked.
+ */
+void CThreadItResultCache::evict (Stripe& theStripe)
+{
+	EntryList::iterator theEntry = theStripe.theEntries.end ();
+	EntryList::iterator theVictim;
+
+	while ((theStripe.theSize > m_theStripeBudget) && (theEntry != theStripe.theEntries.begin ()))
+	{
+		theEntry--;
+		if (!theEntry->isInFlight)
+		{
+			theVictim = theEntry;
+			// Step back to the next entry before the victim is erased.
+			theEntry++;
+			remove (theStripe, theVictim);
+			InterlockedIncrement (&m_theEvictions);
+		} // if
+	} // while
+} // evict
+
+/**
+ * Method clear removes every cached result. Results in flight are kept.
+ */
+void CThreadItResultCache::clear ()
+{
+	EntryList::iterator theEntry;
+	EntryList::iterator theNext;
+
+	for (ULONG theStripe = 0; theStripe < THREADIT_CACHE_STRIPES; theStripe++)
+	{
+		EnterCriticalSection (&m_theStripes[theStripe].theAccess);
+		theEntry = m_theStripes[theStripe].theEntries.begin ();
+		while (theEntry != m_theStripes[theStripe].theEntries.end ())
+		{
+			theNext = theEntry;
+			theNext++;
+			if (!theEntry->isInFlight)
+			{
+				remove (m_theStripes[theStripe], theEntry);
+			} // if
+			theEntry = theNext;
+		} // while
+		LeaveCriticalSection (&m_theStripes[theStripe].theAccess);
+	} // for
+} // clear
+
+/**
+ * Method getHitCount returns the number of lookups that found a result.
+ */
+LONG CThreadItResultCache::getHitCount () const
+{
+	return m_theHits;
+} // getHitCount
+
+/**
+ * Method getMissCount returns the number of lookups that processed the work package.
+ */
+LONG CThreadItResultCache::getMissCount () const
+{
+	return m_theMisses;
+} // getMissCount
+
+/**
+ * Method getCoalescedCount returns the number of work packages that waited for an
+ * identical one.
+ */
+LONG CThreadItResultCache::getCoalescedCount () const
+{
+	return m_theCoalesced;
+} // getCoalescedCount
+
+/**
+ * Method getEvictionCount returns the number of results evicted for the budget.
+ */
+LONG CThreadItResultCache::getEvictionCount () const
+{
+	return m_theEvictions;
+} // getEvictionCount
+
+/**
+ * Method getSize returns the number of bytes held by the cache.
+ */
+ULONG CThreadItResultCache::getSize ()
+{
+	ULONG theSize = 0;
+
+	for (ULONG theStripe = 0; theStripe < THREADIT_CACHE_STRIPES; theStripe++)
+	{
+		EnterCriticalSection (&m_theStripes[theStripe].theAccess);
+		theSize += m_theStripes[theStripe].theSize;
+		LeaveCriticalSection (&m_theStripes[theStripe].theAccess);
+	} // for
+	return theSize;
+} // getSize
+
+/**
+ * Method getEntryCount returns the number of entries including those in flight.
+ */
+ULONG CThreadItResultCache::getEntryCount ()
+{
+	ULONG theCount = 0;
+
+	for (ULONG theStripe = 0; theStripe < THREADIT_CACHE_STRIPES; theStripe++)
+	{
+		EnterCriticalSection (&m_theStripes[theStripe].theAccess);
+		theCount += (ULONG)m_theStripes[theStripe].theEntries.size ();
+		LeaveCriticalSection (&m_theStripes[theStripe].theAccess);
+	} // for
+	return theCount;
+} // getEntryCount
@@ -0,0 +1,333 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItResultCache
+ * Description: Class CThreadItResultCache keeps the results of instructions whose
+ * worker methods are pure functions of their payload. A CThreadIt given a cache
+ * (see CThreadIt::setResultCache) looks up each work package of an enabled
+ * instruction before the worker method is called. The key is the instruction and
+ * the hash of the payload (see CDataItem::getHash) and payloads of the same hash are
+ * told apart with CDataItem::isEqual.
+ *
+ * A hit returns the work package with the data item and the status of the cached
+ * result without calling the worker method. The data item is shared by every hit
+ * so it must not be changed by the receivers, and the worker method must not
+ * change the payload. On a miss the work package is processed and a successful
+ * result is kept for the time to live of the instruction.
+ *
+ * Identical work packages are coalesced while one is being processed. They are
+ * parked on the entry and the thread that processes the first one sends the
+ * result to each of them when it completes, so N identical requests in flight
+ * call the worker method once. This matters when one cache is shared by several
+ * replicas of a component. Each parked work package keeps the CThreadIt it was
+ * sent to and is answered through it, so its result goes to the work done queue,
+ * observers and completion of that replica. The replicas that share a cache must
+ * not be destroyed while another replica is processing work.
+ *
+ * A worker method that returns WORKDONE_CONTINUE keeps its result in flight. The
+ * entry remembers the work package producing it, which resumes the flight when it
+ * is processed again, so the parked work packages get the result of the final run.
+ * If the work package is shed instead they get the status WORKDONE_NO_RESULT (see
+ * abandon).
+ *
+ * The entries are spread over THREADIT_CACHE_STRIPES stripes, each with its own
+ * lock and least recently used list, so that lookups from several threads rarely
+ * wait for each other. Each stripe holds an equal share of the memory budget and
+ * evicts its least recently used results to stay within it. The size of an entry
+ * is taken from CDataItem::getSizeHint of the payload and of the result.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_RESULT_CACHE_H)
+#define THREADIT_RESULT_CACHE_H
+
+// Includes
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include "threadit.h"
+
+/** THREADIT_CACHE_STRIPES is the number of independently locked stripes of a cache. */
+#define THREADIT_CACHE_STRIPES 16
+
+/**
+ * Class CThreadItResultCache caches the results of idempotent instructions.
+ */
+class CThreadItResultCache
+{
+	// types
+public:
+	/** LookupResult is the outcome of a lookup. */
+	enum LookupResult
+	{
+		/** The work package is not cached and is processed as usual. */
+		RESULT_UNCACHED = 0,
+		/** The work package has been given the cached result. */
+		RESULT_HIT,
+		/** The work package must be processed and its result passed to complete. */
+		RESULT_MISS,
+		/** The work package is parked until an identical one completes. */
+		RESULT_WAITING
+	};
+
+	/** Waiter is a work package parked until an identical one completes. */
+	typedef struct WaiterTag
+	{
+		/** pWorkPack is the parked work package. */
+		CWorkPackIt* pWorkPack;
+		/** ptheOwner is the CThreadIt the work package was sent to. The result is
+		 * sent through it. */
+		CThreadIt* ptheOwner;
+	} Waiter;
+
+	/** WaiterList holds the work packages parked on an entry. */
+	typedef std::vector<Waiter> WaiterList;
+
+private:
+	/** Entry is a cached result or a result being produced. */
+	typedef struct EntryTag
+	{
+		/** theKey combines the instruction and the hash of the payload. */
+		ULONGLONG theKey;
+		/** theInstruction is the instruction of the entry. */
+		UINT theInstruction;
+		/** ptheRequest is the payload the result is for. */
+		DataItemPtr ptheRequest;
+		/** ptheResult is the data item of the result. */
+		DataItemPtr ptheResult;
+		/** theStatus is the status of the result. */
+		ULONG theStatus;
+		/** isSuccess is the value returned by the worker method. */
+		bool isSuccess;
+		/** isInFlight is true while the result is being produced. */
+		bool isInFlight;
+		/** ptheProducer is the work package producing the result while it is in flight. */
+		CWorkPackIt* ptheProducer;
+		/** theStoredAt is the tick count when the result was stored. */
+		DWORD theStoredAt;
+		/** theSize is the number of bytes counted against the budget. */
+		ULONG theSize;
+		/** theWaiters are the identical work packages waiting for the result. */
+		WaiterList theWaiters;
+	} Entry;
+
+	/** EntryList holds the entries of a stripe with the most recently used first. */
+	typedef std::list<Entry> EntryList;
+
+	/** EntryIndex finds the entries of a stripe by key. */
+	typedef std::unordered_multimap<ULONGLONG, EntryList::iterator> EntryIndex;
+
+	/** Stripe is an independently locked part of the cache. */
+	typedef struct StripeTag
+	{
+		/** theAccess protects the stripe. */
+		CRITICAL_SECTION theAccess;
+		/** theEntries are the entries of the stripe. */
+		EntryList theEntries;
+		/** theIndex finds the entries by key. */
+		EntryIndex theIndex;
+		/** theSize is the number of bytes held by the stripe. */
+		ULONG theSize;
+	} Stripe;
+
+public:
+	/** Flight identifies the entry of a work package that is being processed. */
+	typedef struct FlightTag
+	{
+		/** theStripe is the stripe of the entry. */
+		ULONG theStripe;
+		/** theEntry is the entry. */
+		EntryList::iterator theEntry;
+	} Flight;
+
+	// Attributes
+private:
+	/** m_theStripes are the stripes of the cache. */
+	Stripe m_theStripes[THREADIT_CACHE_STRIPES];
+	/** m_theTimeToLive is the time to live in milliseconds of the results of each
+	 * instruction. Zero means that the instruction is not cached. */
+	volatile DWORD m_theTimeToLive[CThreadIt::MAX_WORK_METHODS];
+	/** m_theStripeBudget is the number of bytes each stripe may hold. */
+	ULONG m_theStripeBudget;
+	/** m_theHits is the number of lookups that found a result. */
+	volatile LONG m_theHits;
+	/** m_theMisses is the number of lookups that had to process the work package. */
+	volatile LONG m_theMisses;
+	/** m_theCoalesced is the number of work packages that waited for an identical one. */
+	volatile LONG m_theCoalesced;
+	/** m_theEvictions is the number of results evicted to stay within the budget. */
+	volatile LONG m_theEvictions;
+	/** m_ptheLogger is the logger used to log information and errors. */
+	log4cpp::Category* m_ptheLogger;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItResultCache creates an empty cache with no instructions enabled.
+	 * @param[in] theBudget is the most bytes held by the cache.
+	 */
+	CThreadItResultCache (ULONG theBudget = 16 * 1024 * 1024);
+
+	/**
+	 * Method ~CThreadItResultCache frees the entries and any parked work packages.
+	 */
+	virtual ~CThreadItResultCache ();
+
+	/**
+	 * Method enable caches the results of an instruction.
+	 * @param[in] theInstruction is the instruction. Its worker method must be a pure
+	 * function of the payload.
+	 * @param[in] theTimeToLive is the time in milliseconds a result is kept. INFINITE
+	 * keeps results until they are evicted.
+	 * \return true if the instruction is valid.
+	 */
+	bool enable (UINT theInstruction, DWORD theTimeToLive);
+
+	/**
+	 * Method disable stops caching the results of an instruction. Results already
+	 * cached are evicted in time.
+	 */
+	void disable (UINT theInstruction);
+
+	/**
+	 * Method isEnabled returns true if the results of an instruction are cached.
+	 */
+	bool isEnabled (UINT theInstruction) const;
+
+	/**
+	 * Method lookup looks up a work package before it is processed.
+	 * @param[in] pWorkPack is the work package. On a hit it is given the cached
+	 * result. On RESULT_WAITING it is kept by the cache until complete is called for
+	 * the identical work package. A work package that returned WORKDONE_CONTINUE
+	 * gets RESULT_MISS and the entry it is producing.
+	 * @param[in] ptheOwner is the CThreadIt processing the work package. A parked
+	 * work package is answered through it.
+	 * @param[out] isSuccess is the value the worker method returned on a hit.
+	 * @param[out] theFlight identifies the entry on a miss.
+	 * \return the outcome of the lookup.
+	 */
+	LookupResult lookup (CWorkPackIt* pWorkPack, CThreadIt* ptheOwner, bool& isSuccess, Flight& theFlight);
+
+	/**
+	 * Method complete stores the result of a work package that missed and returns
+	 * the work packages that waited for it. The result is only kept if the worker
+	 * method succeeded.
+	 * @param[in] theFlight is the entry returned by lookup.
+	 * @param[in] pWorkDone is the result. It may be NULL.
+	 * @param[in] isSuccess is the value returned by the worker method.
+	 * @param[out] theWaiters receives the waiting work packages given the result. The
+	 * caller sends their responses through their owners.
+	 */
+	void complete (Flight& theFlight, CWorkPackIt* pWorkDone, bool isSuccess, WaiterList& theWaiters);
+
+	/**
+	 * Method abandon ends the flight of a work package that returned WORKDONE_CONTINUE
+	 * and is not processed again, for instance because it was shed. The entry is
+	 * removed and the work packages that waited for it are given the status
+	 * WORKDONE_NO_RESULT.
+	 * @param[in] pWorkPack is the work package.
+	 * @param[out] theWaiters receives the waiting work packages. The caller sends
+	 * their responses through their owners.
+	 * \return true if the work package was producing a result.
+	 */
+	bool abandon (CWorkPackIt* pWorkPack, WaiterList& theWaiters);
+
+	/**
+	 * Method clear removes every cached result. Results in flight are kept.
+	 */
+	void clear ();
+
+	/**
+	 * Method getHitCount returns the number of lookups that found a result.
+	 */
+	LONG getHitCount () const;
+
+	/**
+	 * Method getMissCount returns the number of lookups that processed the work package.
+	 */
+	LONG getMissCount () const;
+
+	/**
+	 * Method getCoalescedCount returns the number of work packages that waited for
+	 * an identical one.
+	 */
+	LONG getCoalescedCount () const;
+
+	/**
+	 * Method getEvictionCount returns the number of results evicted for the budget.
+	 */
+	LONG getEvictionCount () const;
+
+	/**
+	 * Method getSize returns the number of bytes held by the cache.
+	 */
+	ULONG getSize ();
+
+	/**
+	 * Method getEntryCount returns the number of entries including those in flight.
+	 */
+	ULONG getEntryCount ();
+
+private:
+	/**
+	 * Method getStripe returns the stripe of a key.
+	 */
+	static ULONG getStripe (ULONGLONG theKey);
+
+	/**
+	 * Method setResult gives a work package the data item and status of a result.
+	 */
+	static void setResult (CWorkPackIt* ptheWorkDone, const DataItemPtr& ptheResult, ULONG theStatus);
+
+	/**
+	 * Method getKey returns the key of a work package of an instruction.
+	 * @param[in] pWorkPack is the work package.
+	 * @param[out] theKey receives the key.
+	 * \return true if the payload has a hash.
+	 */
+	static bool getKey (const CWorkPackIt* pWorkPack, ULONGLONG& theKey);
+
+	/**
+	 * Method findProducer returns the entry in flight for a work package that
+	 * returned WORKDONE_CONTINUE. It is called with the stripe locked.
+	 * \return the entry or the end of the entries of the stripe.
+	 */
+	EntryList::iterator findProducer (Stripe& theStripe, ULONGLONG theKey, const CWorkPackIt* pWorkPack);
+
+	/**
+	 * Method remove removes an entry from a stripe. It is called with the stripe locked.
+	 */
+	void remove (Stripe& theStripe, EntryList::iterator theEntry);
+
+	/**
+	 * Method evict removes the least recently used results of a stripe until it is
+	 * within its budget. It is called with the stripe locked.
+	 */
+	void evict (Stripe& theStripe);
+
+	/// not copiable
+	CThreadItResultCache (const CThreadItResultCache&);
+	const CThreadItResultCache& operator= (const CThreadItResultCache&);
+
+}; // class CThreadItResultCache
+
+#endif // !defined (THREADIT_RESULT_CACHE_H)
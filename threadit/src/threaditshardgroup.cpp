@@ -0,0 +1,480 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItShardGroup
+ * Description: Class CThreadItShardGroup routes work packages to shards by key using
+ * consistent hashing. See the header file for a description of the migration that
+ * follows a change of the shards.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <algorithm>
+#include "threaditshardgroup.h"
+
+// Class: CThreadItShardGroup Implementation
+
+/**
+ * Constructor CThreadItShardGroup creates an empty group.
+ */
+CThreadItShardGroup::CThreadItShardGroup (ULONG theVirtualNodes)
+{
+	m_ptheLogger = &(log4cpp::Category::getInstance ("threadit.CThreadItShardGroup"));
+	m_theVirtualNodes = (theVirtualNodes > 0) ? theVirtualNodes : 1;
+	for (ULONG theShard = 0; theShard < THREADIT_MAX_SHARDS; theShard++)
+	{
+		m_theSlots[theShard].isActive = false;
+		m_theSlots[theShard].theInProgress[0] = 0;
+		m_theSlots[theShard].theInProgress[1] = 0;
+	} // for
+	m_theEpoch = 0;
+	m_isMigrating = false;
+	m_isFlushing = false;
+	m_theCaller = 0;
+	InitializeCriticalSection (&m_theRingAccess);
+	InitializeCriticalSection (&m_theCallerAccess);
+	InitializeCriticalSection (&m_theHeldAccess);
+	InitializeCriticalSection (&m_theChangeAccess);
+	m_theMigrated = CreateEvent (NULL, TRUE, TRUE, NULL);
+} // constructor CThreadItShardGroup
+
+/**
+ * Method ~CThreadItShardGroup releases the shards and frees any held work packages.
+ * The shards should be idle.
+ */
+CThreadItShardGroup::~CThreadItShardGroup ()
+{
+	while (!m_theHeld.empty ())
+	{
+		delete m_theHeld.front ();
+		m_theHeld.pop_front ();
+	} // while
+	for (ULONG theShard = 0; theShard < THREADIT_MAX_SHARDS; theShard++)
+	{
+		m_theSlots[theShard].ptheShard.reset ();
+	} // for
+	DeleteCriticalSection (&m_theRingAccess);
+	DeleteCriticalSection (&m_theCallerAccess);
+	DeleteCriticalSection (&m_theHeldAccess);
+	DeleteCriticalSection (&m_theChangeAccess);
+	CloseHandle (m_theMigrated);
+} // ~CThreadItShardGroup
+
+/**
+ * Method hash mixes a value so that it is spread evenly over the ring. This is the
+ * 32 bit finaliser of MurmurHash3.
+ */
+ULONG CThreadItShardGroup::hash (ULONG theValue)
+{
+	theValue ^= theValue >> 16;
+	theValue *= 0x85ebca6b;
+	theValue ^= theValue >> 13;
+	theValue *= 0xc2b2ae35;
+	theValue ^= theValue >> 16;
+	return theValue;
+} // hash
+
+/**
+ * Method isPointBefore orders the points of the ring by hash.
+ */
+bool CThreadItShardGroup::isPointBefore (const RingPoint& thePoint, const RingPoint& theOther)
+{
+	return (thePoint.theHash < theOther.theHash);
+} // isPointBefore
+
+/**
+ * Method findShard returns the shard of the first point at or after the hash of
+ * the key, wrapping round to the first point of the ring.
+ */
+ULONG CThreadItShardGroup::findShard (const Ring& theRing, ULONG theKey)
+{
+	ULONG theShard = ULONG_MAX;
+	RingPoint theKeyPoint;
+	Ring::const_iterator thePoint;
+
+	if (!theRing.empty ())
+	{
+		theKeyPoint.theHash = hash (theKey);
+		theKeyPoint.theShard = 0;
+		thePoint = std::lower_bound (theRing.begin (), theRing.end (), theKeyPoint, isPointBefore);
+		if (thePoint == theRing.end ())
+		{
+			thePoint = theRing.begin ();
+		} // if
+		theShard = thePoint->theShard;
+	} // if
+	return theShard;
+} // findShard
+
+/**
+ * Method buildRing places the active shards on the ring. The points of a shard
+ * depend only on its identity so the points of the other shards do not move.
+ */
+void CThreadItShardGroup::buildRing ()
+{
+	RingPoint thePoint;
+
+	m_theRing.clear ();
+	for (ULONG theShard = 0; theShard < THREADIT_MAX_SHARDS; theShard++)
+	{
+		if (m_theSlots[theShard].isActive)
+		{
+			for (ULONG theNode = 0; theNode < m_theVirtualNodes; theNode++)
+			{
+				thePoint.theHash = hash ((theShard << 16) + theNode + 0x9e3779b9);
+				thePoint.theShard = theShard;
+				m_theRing.push_back (thePoint);
+			} // for
+		} // if
+	} // for
+	std::sort (m_theRing.begin (), m_theRing.end (), isPointBefore);
+} // buildRing
+
+/**
+ * Method changeRing rebuilds the ring and starts a migration. The caller holds
+ * m_theChangeAccess and no migration is in progress.
+ */
+void CThreadItShardGroup::changeRing ()
+{
+	EnterCriticalSection (&m_theRingAccess);
+	m_theOldRing = m_theRing;
+	buildRing ();
+	m_theEpoch++;
+	ResetEvent (m_theMigrated);
+	m_isMigrating = true;
+	LeaveCriticalSection (&m_theRingAccess);
+	// The previous epoch may already be drained.
+	checkMigration ();
+} // changeRing
+
+/**
+ * Method checkMigration ends the migration once every work package of the previous
+ * epoch has completed. The held work packages are sent in the order they arrived
+ * before the migration is marked as complete so that later work packages for the
+ * same keys follow them. They are sent outside m_theHeldAccess as a shard may process
+ * them inline and call back into the group. Work packages for moved keys that arrive
+ * meanwhile are still held and are sent in turn.
+ */
+void CThreadItShardGroup::checkMigration ()
+{
+	bool isDrained = true;
+	bool isFlushing = false;
+	ULONG theWorkPackId = 0;
+	ULONG theParity = 0;
+	CWorkPackIt* pWorkPack = NULL;
+	std::deque<CWorkPackIt*> theSending;
+
+	EnterCriticalSection (&m_theHeldAccess);
+	if ((m_isMigrating) && (!m_isFlushing))
+	{
+		theParity = (m_theEpoch - 1) & 1;
+		for (ULONG theShard = 0; theShard < THREADIT_MAX_SHARDS; theShard++)
+		{
+			if (m_theSlots[theShard].theInProgress[theParity] != 0)
+			{
+				isDrained = false;
+			} // if
+		} // for
+		if (isDrained)
+		{
+			m_isFlushing = true;
+			isFlushing = true;
+		} // if
+	} // if
+	while (isFlushing)
+	{
+		theSending.swap (m_theHeld);
+		if (theSending.empty ())
+		{
+			m_theOldRing.clear ();
+			m_isMigrating = false;
+			m_isFlushing = false;
+			SetEvent (m_theMigrated);
+			isFlushing = false;
+		}
+		else
+		{
+			// The ring does not change until the migration is complete.
+			LeaveCriticalSection (&m_theHeldAccess);
+			while (!theSending.empty ())
+			{
+				pWorkPack = theSending.front ();
+				theSending.pop_front ();
+				countWork (pWorkPack, findShard (m_theRing, pWorkPack->m_theKey))->startWork (pWorkPack, theWorkPackId);
+			} // while
+			EnterCriticalSection (&m_theHeldAccess);
+		} // if
+	} // while
+	LeaveCriticalSection (&m_theHeldAccess);
+} // checkMigration
+
+/**
+ * Method releaseRetired releases the removed shards whose work has drained. It is
+ * called by a change of the group once no migration is in progress.
+ */
+void CThreadItShardGroup::releaseRetired ()
+{
+	for (ULONG theShard = 0; theShard < THREADIT_MAX_SHARDS; theShard++)
+	{
+		if ((!m_theSlots[theShard].isActive) && (m_theSlots[theShard].ptheShard) &&
+			(m_theSlots[theShard].theInProgress[0] == 0) && (m_theSlots[theShard].theInProgress[1] == 0))
+		{
+			m_theSlots[theShard].ptheShard.reset ();
+		} // if
+	} // for
+} // releaseRetired
+
+/**
+ * Method addShard adds a shard to the group.
+ */
+ULONG CThreadItShardGroup::addShard (const ThreadItPtr& ptheShard)
+{
+	ULONG theShard = 0;
+
+	EnterCriticalSection (&m_theChangeAccess);
+	waitForMigration (INFINITE);
+	releaseRetired ();
+	while ((theShard < THREADIT_MAX_SHARDS) && (m_theSlots[theShard].ptheShard))
+	{
+		theShard++;
+	} // while
+	if ((theShard < THREADIT_MAX_SHARDS) && (ptheShard))
+	{
+		m_theSlots[theShard].ptheShard = ptheShard;
+		m_theSlots[theShard].isActive = true;
+		changeRing ();
+		m_ptheLogger->infoStream () << "shard " << theShard << " added";
+	}
+	else
+	{
+		theShard = ULONG_MAX;
+		m_ptheLogger->error ("shard not added - the group is full or the shard is empty");
+	} // if
+	LeaveCriticalSection (&m_theChangeAccess);
+	return theShard;
+} // addShard
+
+/**
+ * Method removeShard removes a shard from the group.
+ */
+bool CThreadItShardGroup::removeShard (ULONG theShard)
+{
+	bool isSuccess = false;
+
+	EnterCriticalSection (&m_theChangeAccess);
+	waitForMigration (INFINITE);
+	releaseRetired ();
+	if ((theShard < THREADIT_MAX_SHARDS) && (m_theSlots[theShard].isActive))
+	{
+		// The shard is kept until its work has drained.
+		m_theSlots[theShard].isActive = false;
+		changeRing ();
+		m_ptheLogger->infoStream () << "shard " << theShard << " removed";
+		isSuccess = true;
+	}
+	else
+	{
+		m_ptheLogger->errorStream () << "shard " << theShard << " not removed - not in the group";
+	} // if
+	LeaveCriticalSection (&m_theChangeAccess);
+	return isSuccess;
+} // removeShard
+
+/**
+ * Method countWork counts a work package in the current epoch of a shard and sets the
+ * completion so that it is counted out again. A completion named by the work package
+ * is kept under a number that is added to the completion tag. The caller holds
+ * m_theRingAccess or is ending a migration, so the epoch does not change.
+ */
+ThreadItPtr CThreadItShardGroup::countWork (CWorkPackIt* pWorkPack, ULONG theShard)
+{
+	ULONG theParity = m_theEpoch & 1;
+	ULONG theCaller = 0;
+	Caller theEntry;
+
+	InterlockedIncrement (&m_theSlots[theShard].theInProgress[theParity]);
+	if (pWorkPack->m_ptheCompletion != NULL)
+	{
+		theEntry.ptheCompletion = pWorkPack->m_ptheCompletion;
+		theEntry.theCompletionTag = pWorkPack->m_theCompletionTag;
+		EnterCriticalSection (&m_theCallerAccess);
+		// Zero means no caller so the number skips it when it wraps.
+		do
+		{
+			m_theCaller = (m_theCaller + 1) & (ULONG_MAX >> CALLER_SHIFT);
+		} while ((m_theCaller == 0) || (m_theCallers.find (m_theCaller) != m_theCallers.end ()));
+		theCaller = m_theCaller;
+		m_theCallers[theCaller] = theEntry;
+		LeaveCriticalSection (&m_theCallerAccess);
+	} // if
+	pWorkPack->m_ptheCompletion = this;
+	pWorkPack->m_theCompletionTag = (theCaller << CALLER_SHIFT) | (theShard << 1) | theParity;
+	return m_theSlots[theShard].ptheShard;
+} // countWork
+
+/**
+ * Method startWork sends a work package to the shard that owns its key. While a
+ * migration is in progress a work package whose key has moved is held back.
+ */
+bool CThreadItShardGroup::startWork (CWorkPackIt* pWorkPack, ULONG& WorkPackID)
+{
+	bool isSuccess = false;
+	bool isHeld = false;
+	ULONG theShard = ULONG_MAX;
+	ThreadItPtr ptheShard;
+
+	WorkPackID = 0;
+	if (pWorkPack != NULL)
+	{
+		EnterCriticalSection (&m_theRingAccess);
+		theShard = findShard (m_theRing, pWorkPack->m_theKey);
+		if ((theShard != ULONG_MAX) && (m_isMigrating))
+		{
+			EnterCriticalSection (&m_theHeldAccess);
+			if ((m_isMigrating) && (findShard (m_theOldRing, pWorkPack->m_theKey) != theShard))
+			{
+				m_theHeld.push_back (pWorkPack);
+				isHeld = true;
+			} // if
+			LeaveCriticalSection (&m_theHeldAccess);
+		} // if
+		if ((theShard != ULONG_MAX) && (!isHeld))
+		{
+			ptheShard = countWork (pWorkPack, theShard);
+		} // if
+		LeaveCriticalSection (&m_theRingAccess);
+		// The work package is counted so the shard is kept and a change of the ring
+		// waits for it. It is sent outside the lock as the shard may process it inline.
+		if (ptheShard)
+		{
+			ptheShard->startWork (pWorkPack, WorkPackID);
+		} // if
+		isSuccess = (theShard != ULONG_MAX);
+	} // if
+	if (!isSuccess)
+	{
+		m_ptheLogger->error ("work package not sent - no work package or no shards");
+	} // if
+	return isSuccess;
+} // startWork
+
+/**
+ * Method onWorkDone is called on the shard thread when a work package is done. The
+ * tag holds the caller number, the shard and the epoch parity the work package was
+ * counted in. The completion of the caller is called before the work package is
+ * counted out so that a migration waits for it.
+ */
+void CThreadItShardGroup::onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess)
+{
+	ULONG theShard = (theTag & ((1 << CALLER_SHIFT) - 1)) >> 1;
+	ULONG theCaller = theTag >> CALLER_SHIFT;
+	Caller theEntry;
+	CallerMap::iterator theFound;
+
+	theEntry.ptheCompletion = NULL;
+	theEntry.theCompletionTag = 0;
+	if (theCaller != 0)
+	{
+		EnterCriticalSection (&m_theCallerAccess);
+		theFound = m_theCallers.find (theCaller);
+		if (theFound != m_theCallers.end ())
+		{
+			theEntry = theFound->second;
+			m_theCallers.erase (theFound);
+		} // if
+		LeaveCriticalSection (&m_theCallerAccess);
+	} // if
+	// The caller sees its own completion on the result, which is sent after this call.
+	if (ptheWorkDone != NULL)
+	{
+		ptheWorkDone->m_ptheCompletion = theEntry.ptheCompletion;
+		ptheWorkDone->m_theCompletionTag = theEntry.theCompletionTag;
+	} // if
+	if (theEntry.ptheCompletion != NULL)
+	{
+		theEntry.ptheCompletion->onWorkDone (ptheWorker, theEntry.theCompletionTag, ptheWorkDone, isSuccess);
+	} // if
+	if (theShard < THREADIT_MAX_SHARDS)
+	{
+		if ((InterlockedDecrement (&m_theSlots[theShard].theInProgress[theTag & 1]) == 0) && (m_isMigrating))
+		{
+			checkMigration ();
+		} // if
+	} // if
+} // onWorkDone
+
+/**
+ * Method getShardForKey returns the shard that owns a key.
+ */
+ULONG CThreadItShardGroup::getShardForKey (ULONG theKey)
+{
+	ULONG theShard = ULONG_MAX;
+
+	EnterCriticalSection (&m_theRingAccess);
+	theShard = findShard (m_theRing, theKey);
+	LeaveCriticalSection (&m_theRingAccess);
+	return theShard;
+} // getShardForKey
+
+/**
+ * Method getShard returns a shard of the group.
+ */
+ThreadItPtr CThreadItShardGroup::getShard (ULONG theShard)
+{
+	ThreadItPtr ptheShard;
+
+	EnterCriticalSection (&m_theChangeAccess);
+	if (theShard < THREADIT_MAX_SHARDS)
+	{
+		ptheShard = m_theSlots[theShard].ptheShard;
+	} // if
+	LeaveCriticalSection (&m_theChangeAccess);
+	return ptheShard;
+} // getShard
+
+/**
+ * Method getShardCount returns the number of shards on the ring.
+ */
+ULONG CThreadItShardGroup::getShardCount ()
+{
+	ULONG theCount = 0;
+
+	EnterCriticalSection (&m_theRingAccess);
+	for (ULONG theShard = 0; theShard < THREADIT_MAX_SHARDS; theShard++)
+	{
+		if (m_theSlots[theShard].isActive)
+		{
+			theCount++;
+		} // if
+	} // for
+	LeaveCriticalSection (&m_theRingAccess);
+	return theCount;
+} // getShardCount
+
+/**
+ * Method waitForMigration waits for a migration in progress to complete.
+ */
+bool CThreadItShardGroup::waitForMigration (DWORD theTimeOut)
+{
+	return (WaitForSingleObject (m_theMigrated, theTimeOut) == WAIT_OBJECT_0);
+} // waitForMigration
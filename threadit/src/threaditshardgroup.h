@@ -0,0 +1,265 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItShardGroup
+ * Description: Class CThreadItShardGroup owns a number of CThreadIt replicas of one
+ * component (the shards) and sends each work package to the shard that owns the key
+ * of the work package (m_theKey of CWorkPackIt). A key is always processed by the
+ * same shard so the state and the cache lines of the key stay on one thread.
+ *
+ * The keys are mapped to shards with consistent hashing. Each shard is placed on a
+ * ring of hash values at a number of points (virtual nodes) and a key belongs to the
+ * shard of the first point at or after the hash of the key. When a shard is added or
+ * removed only the keys between its points and the points before them move, which
+ * is about 1/N of the keys.
+ *
+ * Shards can be added and removed while work is being sent. A change of the ring
+ * starts a migration. The work packages sent before the change belong to the old
+ * epoch and the shards count them as they complete (see CThreadItCompletion). Until
+ * every work package of the old epoch has completed, a work package whose key has
+ * moved is held back. The held work packages are then sent to their new shards in
+ * the order they arrived. So the work packages of a moved key are never processed
+ * by two shards at the same time and are processed in order. Work packages for keys
+ * that have not moved are sent straight away throughout.
+ *
+ * The group sets m_ptheCompletion and m_theCompletionTag of the work packages it
+ * sends to count them. A completion named by the work package is kept by the group,
+ * set on the result again and called when the work package is done. A removed shard is kept until its work has drained and is released by the
+ * next change of the group or when the group is destroyed.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_SHARD_GROUP_H)
+#define THREADIT_SHARD_GROUP_H
+
+// Includes
+#include <vector>
+#include <deque>
+#include <map>
+#include "threadit.h"
+#include "threaditcompletion.h"
+
+/** THREADIT_MAX_SHARDS is the maximum number of shards in a group. */
+#define THREADIT_MAX_SHARDS 64
+
+/**
+ * Class CThreadItShardGroup routes work packages to shards by key.
+ */
+class CThreadItShardGroup : public CThreadItCompletion
+{
+	// types
+private:
+	/** RingPoint is a virtual node of a shard on the ring. */
+	typedef struct RingPointTag
+	{
+		/** theHash is the position of the point on the ring. */
+		ULONG theHash;
+		/** theShard is the shard that owns the keys up to the point. */
+		ULONG theShard;
+	} RingPoint;
+
+	/** Ring is the list of points sorted by hash. */
+	typedef std::vector<RingPoint> Ring;
+
+	/** Caller is the completion named by a work package sent through the group. */
+	typedef struct CallerTag
+	{
+		/** ptheCompletion is the completion of the work package. */
+		CThreadItCompletion* ptheCompletion;
+		/** theCompletionTag is the completion tag of the work package. */
+		ULONG theCompletionTag;
+	} Caller;
+
+	/** CallerMap holds the completions of the work packages in progress by their
+	 * number in the completion tag of the group. */
+	typedef std::map<ULONG, Caller> CallerMap;
+
+	/** CALLER_SHIFT is the position of the caller number in the completion tag, above
+	 * the shard and the epoch parity. */
+	static const ULONG CALLER_SHIFT = 7;
+
+	/** ShardSlot holds a shard and the number of its work packages in progress in the
+	 * current and the previous epoch. */
+	typedef struct ShardSlotTag
+	{
+		/** ptheShard is the shard. It is empty if the slot is free. */
+		ThreadItPtr ptheShard;
+		/** isActive is true if the shard is on the ring. */
+		bool isActive;
+		/** theInProgress counts the work packages in progress by epoch parity. */
+		volatile LONG theInProgress[2];
+	} ShardSlot;
+
+	// Attributes
+private:
+	/** m_theSlots hold the shards. The index of a slot is the shard identity. */
+	ShardSlot m_theSlots[THREADIT_MAX_SHARDS];
+	/** m_theVirtualNodes is the number of points of each shard on the ring. */
+	ULONG m_theVirtualNodes;
+	/** m_theRing is the current ring. */
+	Ring m_theRing;
+	/** m_theOldRing is the ring before the migration in progress. */
+	Ring m_theOldRing;
+	/** m_theEpoch is incremented when the ring changes. */
+	ULONG m_theEpoch;
+	/** m_isMigrating is true until the work of the previous epoch has completed. */
+	volatile bool m_isMigrating;
+	/** m_isFlushing is true while the held work packages are being sent. */
+	bool m_isFlushing;
+	/** m_theHeld are the work packages for moved keys waiting for the migration. */
+	std::deque<CWorkPackIt*> m_theHeld;
+	/** m_theRingAccess protects the ring and the epoch. */
+	CRITICAL_SECTION m_theRingAccess;
+	/** m_theHeldAccess protects the held work packages and the end of a migration.
+	 * It is taken after m_theRingAccess. Neither is held while a shard is sent work
+	 * as the shard may process it inline. */
+	CRITICAL_SECTION m_theHeldAccess;
+	/** m_theChangeAccess allows one change of the group at a time. */
+	CRITICAL_SECTION m_theChangeAccess;
+	/** m_theCallers are the completions of the work packages in progress that named one. */
+	CallerMap m_theCallers;
+	/** m_theCaller is the number given to the last caller. */
+	ULONG m_theCaller;
+	/** m_theCallerAccess protects the callers. */
+	CRITICAL_SECTION m_theCallerAccess;
+	/** m_theMigrated is a manual reset event signalled when no migration is in progress. */
+	HANDLE m_theMigrated;
+	/** m_ptheLogger is the logger used to log information and errors. */
+	log4cpp::Category* m_ptheLogger;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItShardGroup creates an empty group.
+	 * @param[in] theVirtualNodes is the number of points of each shard on the ring.
+	 */
+	CThreadItShardGroup (ULONG theVirtualNodes = 128);
+
+	/**
+	 * Method ~CThreadItShardGroup releases the shards and frees any held work packages.
+	 */
+	virtual ~CThreadItShardGroup ();
+
+	/**
+	 * Method addShard adds a shard to the group. It waits for a migration in progress
+	 * to complete and must not be called from a shard.
+	 * @param[in] ptheShard is the shard. It must process the same work instructions as
+	 * the other shards.
+	 * \return the identity of the shard or ULONG_MAX if the group is full.
+	 */
+	ULONG addShard (const ThreadItPtr& ptheShard);
+
+	/**
+	 * Method removeShard removes a shard from the group. Its keys move to the other
+	 * shards once its work has drained. It waits for a migration in progress to
+	 * complete and must not be called from a shard.
+	 * \return true if the shard is removed.
+	 */
+	bool removeShard (ULONG theShard);
+
+	/**
+	 * Method startWork sends a work package to the shard that owns its key.
+	 * @param[in] pWorkPack is the work package. Ownership passes to the shard.
+	 * @param[out] WorkPackID is the identity given by the shard. It is zero if the
+	 * work package is held by a migration.
+	 * \return true if the work package is accepted.
+	 */
+	bool startWork (CWorkPackIt* pWorkPack, ULONG& WorkPackID);
+
+	/**
+	 * Method onWorkDone is called on the shard thread when a work package is done.
+	 */
+	virtual void onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess);
+
+	/**
+	 * Method getShardForKey returns the shard that owns a key or ULONG_MAX if there
+	 * are no shards.
+	 */
+	ULONG getShardForKey (ULONG theKey);
+
+	/**
+	 * Method getShard returns a shard of the group.
+	 */
+	ThreadItPtr getShard (ULONG theShard);
+
+	/**
+	 * Method getShardCount returns the number of shards on the ring.
+	 */
+	ULONG getShardCount ();
+
+	/**
+	 * Method waitForMigration waits for a migration in progress to complete.
+	 * \return true if no migration is in progress.
+	 */
+	bool waitForMigration (DWORD theTimeOut);
+
+private:
+	/**
+	 * Method hash mixes a value so that it is spread evenly over the ring.
+	 */
+	static ULONG hash (ULONG theValue);
+
+	/**
+	 * Method isPointBefore orders the points of the ring by hash.
+	 */
+	static bool isPointBefore (const RingPoint& thePoint, const RingPoint& theOther);
+
+	/**
+	 * Method findShard returns the shard of a key on a ring.
+	 */
+	static ULONG findShard (const Ring& theRing, ULONG theKey);
+
+	/**
+	 * Method buildRing places the active shards on the ring.
+	 */
+	void buildRing ();
+
+	/**
+	 * Method changeRing rebuilds the ring and starts a migration.
+	 */
+	void changeRing ();
+
+	/**
+	 * Method checkMigration ends the migration once the work of the previous epoch
+	 * has completed.
+	 */
+	void checkMigration ();
+
+	/**
+	 * Method releaseRetired releases the removed shards whose work has drained.
+	 */
+	void releaseRetired ();
+
+	/**
+	 * Method countWork counts a work package in the current epoch of a shard and keeps
+	 * the completion it names.
+	 * \return the shard to send the work package to.
+	 */
+	ThreadItPtr countWork (CWorkPackIt* pWorkPack, ULONG theShard);
+
+	/// not copiable
+	CThreadItShardGroup (const CThreadItShardGroup&);
+	const CThreadItShardGroup& operator= (const CThreadItShardGroup&);
+
+}; // class CThreadItShardGroup
+
+#endif // !defined (THREADIT_SHARD_GROUP_H)
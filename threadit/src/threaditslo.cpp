@@ -0,0 +1,318 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItSloMonitor
+ * Description: Class CThreadItSloMonitor checks the latency objectives of instructions
+ * over sliding windows. See the header file for how the windows are found.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <vector>
+#include "threaditobserver.h"
+#include "threaditslo.h"
+
+// Class: CThreadItSloEvent Implementation
+
+/**
+ * Constructor CThreadItSloEvent creates an event of an objective that is met.
+ */
+CThreadItSloEvent::CThreadItSloEvent ()
+{
+	m_theSloId = 0;
+	m_theInstruction = 0;
+	m_thePercentile = 0.0;
+	m_theThreshold = 0;
+	m_theValue = 0;
+	m_theCount = 0;
+	m_isBreached = false;
+	m_theTime = 0;
+} // constructor CThreadItSloEvent
+
+/**
+ * Method ~CThreadItSloEvent is the destructor.
+ */
+CThreadItSloEvent::~CThreadItSloEvent ()
+{
+} // ~CThreadItSloEvent
+
+/**
+ * Method getClone returns a copy of the event that the receiver deletes.
+ */
+CICloneable* CThreadItSloEvent::getClone ()
+{
+	return new CThreadItSloEvent (*this);
+} // getClone
+
+/**
+ * Method fromWorkPack returns the event sent in a work package. The notifier places
+ * the clone in m_ptheObject as a CICloneable.
+ */
+CThreadItSloEvent* CThreadItSloEvent::fromWorkPack (CWorkPackIt* pWorkPack)
+{
+	CThreadItSloEvent* ptheEvent = NULL;
+
+	if ((pWorkPack != NULL) && (pWorkPack->m_ptheObject != NULL))
+	{
+		ptheEvent = static_cast<CThreadItSloEvent*> ((CICloneable*)pWorkPack->m_ptheObject);
+		pWorkPack->m_ptheObject = NULL;
+	} // if
+	return ptheEvent;
+} // fromWorkPack
+
+// Class: CThreadItSloMonitor Implementation
+
+/**
+ * Constructor CThreadItSloMonitor starts the periodic check.
+ */
+CThreadItSloMonitor::CThreadItSloMonitor (DWORD thePeriod) : CThreadIt ("threadit.CThreadItSloMonitor")
+{
+	InitializeCriticalSection (&m_theSloAccess);
+	InitializeCriticalSection (&m_theSubscriberAccess);
+	m_theNextSloId = 1;
+	m_theBreachCount = 0;
+	m_theRecoveryCount = 0;
+	setPeriodicMethod ((PeriodicMethodType)&CThreadItSloMonitor::onPeriod);
+	setPeriod (thePeriod);
+} // constructor CThreadItSloMonitor
+
+/**
+ * Method ~CThreadItSloMonitor stops the thread.
+ */
+CThreadItSloMonitor::~CThreadItSloMonitor ()
+{
+	stopThread ();
+	waitForThreadToStop ();
+	m_theSubscribers.removeObservers ();
+	DeleteCriticalSection (&m_theSubscriberAccess);
+	DeleteCriticalSection (&m_theSloAccess);
+} // ~CThreadItSloMonitor
+
+/**
+ * Method addSlo declares an objective. The first snapshot of its histogram is taken
+ * at the next check.
+ */
+ULONG CThreadItSloMonitor::addSlo (const std::string& theName, const std::shared_ptr<CThreadIt>& ptheThreadIt, ULONG theInstruction,
+	double thePercentile, LONGLONG theThreshold, DWORD theWindow, SloMetric theMetric, ULONG theMinCount)
+{
+	ULONG theSloId = 0;
+	Slo theSlo;
+
+	if ((ptheThreadIt) && (theInstruction < MAX_WORK_METHODS))
+	{
+		theSlo.wptheThreadIt = ptheThreadIt;
+		theSlo.theMetric = theMetric;
+		theSlo.theWindow = theWindow;
+		theSlo.theMinCount = (theMinCount == 0) ? 1 : theMinCount;
+		theSlo.theStatus.m_theName = theName;
+		theSlo.theStatus.m_theInstruction = theInstruction;
+		theSlo.theStatus.m_thePercentile = thePercentile;
+		theSlo.theStatus.m_theThreshold = theThreshold;
+		EnterCriticalSection (&m_theSloAccess);
+		theSloId = m_theNextSloId;
+		m_theNextSloId++;
+		theSlo.theStatus.m_theSloId = theSloId;
+		m_theSlos[theSloId] = theSlo;
+		LeaveCriticalSection (&m_theSloAccess);
+	} // if
+	return theSloId;
+} // addSlo
+
+/**
+ * Method removeSlo removes an objective.
+ */
+bool CThreadItSloMonitor::removeSlo (ULONG theSloId)
+{
+	bool isSuccess = false;
+
+	EnterCriticalSection (&m_theSloAccess);
+	isSuccess = (m_theSlos.erase (theSloId) > 0);
+	LeaveCriticalSection (&m_theSloAccess);
+	return isSuccess;
+} // removeSlo
+
+/**
+ * Method getStatus returns the latest state of an objective.
+ */
+bool CThreadItSloMonitor::getStatus (ULONG theSloId, CThreadItSloEvent& theStatus) const
+{
+	bool isSuccess = false;
+	std::map<ULONG, Slo>::const_iterator theSlo;
+
+	EnterCriticalSection (&m_theSloAccess);
+	theSlo = m_theSlos.find (theSloId);
+	if (theSlo != m_theSlos.end ())
+	{
+		theStatus = theSlo->second.theStatus;
+		isSuccess = true;
+	} // if
+	LeaveCriticalSection (&m_theSloAccess);
+	return isSuccess;
+} // getStatus
+
+/**
+ * Method subscribe sends the changes of state to a CThreadIt.
+ */
+void CThreadItSloMonitor::subscribe (const std::shared_ptr<CThreadIt>& ptheThreadIt, UINT theWorkInstruction)
+{
+	EnterCriticalSection (&m_theSubscriberAccess);
+	m_theSubscribers.attach (CThreadItObserver (ptheThreadIt, theWorkInstruction));
+	LeaveCriticalSection (&m_theSubscriberAccess);
+} // subscribe
+
+/**
+ * Method unsubscribe stops sending the changes of state to a CThreadIt.
+ */
+void CThreadItSloMonitor::unsubscribe (const std::shared_ptr<CThreadIt>& ptheThreadIt)
+{
+	EnterCriticalSection (&m_theSubscriberAccess);
+	m_theSubscribers.detach (CThreadItObserver (ptheThreadIt, 0));
+	LeaveCriticalSection (&m_theSubscriberAccess);
+} // unsubscribe
+
+/**
+ * Method getBreachCount returns the number of breaches found.
+ */
+LONG CThreadItSloMonitor::getBreachCount () const
+{
+	return m_theBreachCount;
+} // getBreachCount
+
+/**
+ * Method getRecoveryCount returns the number of recoveries found.
+ */
+LONG CThreadItSloMonitor::getRecoveryCount () const
+{
+	return m_theRecoveryCount;
+} // getRecoveryCount
+
+/**
+ * Method check checks the objectives now. The changes of state are found under the
+ * lock of the objectives and sent once it has been released.
+ */
+void CThreadItSloMonitor::check ()
+{
+	std::map<ULONG, Slo>::iterator theSlo;
+	std::vector<CThreadItSloEvent> theEvents;
+	DWORD theNow = GetTickCount ();
+
+	EnterCriticalSection (&m_theSloAccess);
+	theSlo = m_theSlos.begin ();
+	while (theSlo != m_theSlos.end ())
+	{
+		// Drop the objectives of the instances that have gone.
+		if (theSlo->second.wptheThreadIt.expired ())
+		{
+			m_theSlos.erase (theSlo++);
+		}
+		else
+		{
+			if (checkSlo (theSlo->second, theNow))
+			{
+				theEvents.push_back (theSlo->second.theStatus);
+			} // if
+			theSlo++;
+		} // if
+	} // while
+	LeaveCriticalSection (&m_theSloAccess);
+	for (size_t theIndex = 0; theIndex < theEvents.size (); theIndex++)
+	{
+		if (theEvents[theIndex].m_isBreached)
+		{
+			InterlockedIncrement (&m_theBreachCount);
+		}
+		else
+		{
+			InterlockedIncrement (&m_theRecoveryCount);
+		} // if
+		EnterCriticalSection (&m_theSubscriberAccess);
+		m_theSubscribers.cleanExpiredObservers ();
+		m_theSubscribers.notify (theEvents[theIndex]);
+		LeaveCriticalSection (&m_theSubscriberAccess);
+	} // for
+} // check
+
+/**
+ * Method checkSlo takes a snapshot of the histogram of an objective and finds its
+ * state over the window. The snapshots kept are those within the window and the
+ * newest one taken at or before its start, which is subtracted from the newest.
+ */
+bool CThreadItSloMonitor::checkSlo (Slo& theSlo, DWORD theNow)
+{
+	bool isChanged = false;
+	bool isBreached = false;
+	std::shared_ptr<CThreadIt> sptheThreadIt = theSlo.wptheThreadIt.lock ();
+	CThreadItLatencyStats theStats;
+	Snapshot theSnapshot;
+	CThreadItHistogram theWindow;
+
+	// An instruction that has not been processed yet has empty histograms.
+	if (sptheThreadIt)
+	{
+		sptheThreadIt->getStats (theSlo.theStatus.m_theInstruction, theStats);
+	} // if
+	theSnapshot.theTime = theNow;
+	switch (theSlo.theMetric)
+	{
+	case SLO_SERVICE:
+		theSnapshot.theHistogram = theStats.m_theService;
+		break;
+	case SLO_QUEUE_WAIT:
+		theSnapshot.theHistogram = theStats.m_theQueueWait;
+		break;
+	default:
+		theSnapshot.theHistogram = theStats.m_theEndToEnd;
+		break;
+	} // switch
+	theSlo.theSnapshots.push_back (theSnapshot);
+	while ((theSlo.theSnapshots.size () > 2) && ((theNow - theSlo.theSnapshots[1].theTime) >= theSlo.theWindow))
+	{
+		theSlo.theSnapshots.pop_front ();
+	} // while
+	if (theSlo.theSnapshots.size () >= 2)
+	{
+		theWindow = theSlo.theSnapshots.back ().theHistogram;
+		theWindow.subtract (theSlo.theSnapshots.front ().theHistogram);
+		theSlo.theStatus.m_theCount = theWindow.getCount ();
+		theSlo.theStatus.m_theTime = theNow;
+		if (theSlo.theStatus.m_theCount >= theSlo.theMinCount)
+		{
+			theSlo.theStatus.m_theValue = theWindow.getPercentile (theSlo.theStatus.m_thePercentile);
+			isBreached = (theSlo.theStatus.m_theValue > theSlo.theStatus.m_theThreshold);
+			isChanged = (isBreached != theSlo.theStatus.m_isBreached);
+			theSlo.theStatus.m_isBreached = isBreached;
+		} // if
+	} // if
+	return isChanged;
+} // checkSlo
+
+/**
+ * Method onPeriod is the periodic method. It checks the objectives.
+ */
+bool CThreadItSloMonitor::onPeriod (CWorkPackIt theTimedWork, CWorkPackIt*& ptheWorkDone)
+{
+	ptheWorkDone = NULL;
+	check ();
+	// There is no result to send.
+	return false;
+} // onPeriod
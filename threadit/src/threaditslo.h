@@ -0,0 +1,279 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItSloMonitor
+ * Description: Class CThreadItSloMonitor is a CThreadIt that checks latency objectives
+ * declared for the instructions of CThreadIt instances, such as "instruction 7 p99 <
+ * 2 ms over 10 s", and tells its subscribers when an objective is breached and when it
+ * recovers. For example
+ *   theMonitor.addSlo ("orders", sptheWorker, 7, 99.0, 2000, 10000);
+ *   theMonitor.subscribe (sptheScaler, SCALER_SLO_EVENT);
+ *
+ * An objective is checked against the latency histograms that each CThreadIt records
+ * for its instructions (see CThreadIt::getStats), so nothing is added to the path of a
+ * work package and no lock is taken on it. Each period the monitor takes a snapshot of
+ * the histogram of each objective and keeps the snapshots that cover the window. The
+ * oldest is subtracted from the newest to give the times recorded within the window
+ * (see CThreadItHistogram::subtract), and the percentile of those is compared with the
+ * threshold. The percentile is the highest time of its bucket, so it is known to
+ * within 1/16 of its value. A window without enough times leaves the state of the
+ * objective as it is.
+ * The latency histograms of the instance must be on, which they are by default.
+ *
+ * A change of state is sent to each subscriber as a work package of the instruction
+ * given with subscribe, through a CThreadItNotifier and CThreadItObserver, with a
+ * CThreadItSloEvent in m_ptheObject. The worker method owns the event and deletes it,
+ * for example
+ *   CThreadItSloEvent* ptheEvent = CThreadItSloEvent::fromWorkPack (pWorkPack);
+ *   ...
+ *   delete ptheEvent;
+ * The instances are held with weak references, so an objective of an instance that
+ * has gone is dropped and a subscriber that has gone is no longer sent events.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_SLO_H)
+#define THREADIT_SLO_H
+
+// Includes
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include "threadit.h"
+#include "threadithistogram.h"
+#include "threaditnotifier.h"
+#include "icloneable.h"
+
+/** THREADIT_SLO_PERIOD is the default time in milliseconds between checks. */
+#define THREADIT_SLO_PERIOD 1000
+
+/**
+ * Class CThreadItSloEvent is the state of an objective sent to the subscribers.
+ */
+class CThreadItSloEvent : public CICloneable
+{
+	// Attributes
+public:
+	/** m_theSloId is the ID of the objective given by addSlo. */
+	ULONG m_theSloId;
+	/** m_theName is the name of the objective. */
+	std::string m_theName;
+	/** m_theInstruction is the instruction the objective is declared for. */
+	ULONG m_theInstruction;
+	/** m_thePercentile is the percentile of the objective. */
+	double m_thePercentile;
+	/** m_theThreshold is the time in microseconds the percentile should not exceed. */
+	LONGLONG m_theThreshold;
+	/** m_theValue is the percentile of the times in the window in microseconds. */
+	LONGLONG m_theValue;
+	/** m_theCount is the number of times in the window. */
+	ULONG m_theCount;
+	/** m_isBreached is true if the objective is breached and false if it is met. */
+	bool m_isBreached;
+	/** m_theTime is the tick count at which the state was found. */
+	DWORD m_theTime;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItSloEvent creates an event of an objective that is met.
+	 */
+	CThreadItSloEvent ();
+
+	/**
+	 * Method ~CThreadItSloEvent is the destructor.
+	 */
+	virtual ~CThreadItSloEvent ();
+
+	/**
+	 * Method getClone returns a copy of the event that the receiver deletes.
+	 */
+	virtual CICloneable* getClone ();
+
+	/**
+	 * Method fromWorkPack returns the event sent in a work package.
+	 * @param[in] pWorkPack is the work package received by the subscriber.
+	 * \return the event, which the caller deletes, or NULL if there is none.
+	 */
+	static CThreadItSloEvent* fromWorkPack (CWorkPackIt* pWorkPack);
+
+}; // class CThreadItSloEvent
+
+/**
+ * Class CThreadItSloMonitor checks the latency objectives of instructions.
+ */
+class CThreadItSloMonitor : public CThreadIt
+{
+	// types
+public:
+	/** SloMetric is the latency histogram an objective is checked against. */
+	enum SloMetric
+	{
+		/** The time from startWork to the reply. */
+		SLO_END_TO_END = 0,
+		/** The time spent in the worker method. */
+		SLO_SERVICE,
+		/** The wait in the work queue. */
+		SLO_QUEUE_WAIT
+	};
+
+private:
+	/** Snapshot is a snapshot of the histogram of an objective. */
+	typedef struct SnapshotTag
+	{
+		/** theTime is the tick count at which the snapshot was taken. */
+		DWORD theTime;
+		/** theHistogram is the snapshot. */
+		CThreadItHistogram theHistogram;
+	} Snapshot;
+
+	/** Slo is an objective and the snapshots of its window. */
+	typedef struct SloTag
+	{
+		/** wptheThreadIt is the instance the objective is declared for. */
+		std::weak_ptr<CThreadIt> wptheThreadIt;
+		/** theMetric is the histogram checked. */
+		SloMetric theMetric;
+		/** theWindow is the time in milliseconds the percentile is taken over. */
+		DWORD theWindow;
+		/** theMinCount is the fewest times in the window for the objective to be checked. */
+		ULONG theMinCount;
+		/** theSnapshots are the snapshots that cover the window from the oldest. */
+		std::deque<Snapshot> theSnapshots;
+		/** theStatus is the latest state of the objective. */
+		CThreadItSloEvent theStatus;
+	} Slo;
+
+	// Attributes
+private:
+	/** m_theSlos are the objectives by ID. */
+	std::map<ULONG, Slo> m_theSlos;
+	/** m_theNextSloId is the ID given to the next objective. */
+	ULONG m_theNextSloId;
+	/** m_theSloAccess protects the objectives. */
+	mutable CRITICAL_SECTION m_theSloAccess;
+	/** m_theSubscribers are sent the changes of state. */
+	CThreadItNotifier m_theSubscribers;
+	/** m_theSubscriberAccess protects the subscribers. */
+	CRITICAL_SECTION m_theSubscriberAccess;
+	/** m_theBreachCount is the number of breaches found. */
+	volatile LONG m_theBreachCount;
+	/** m_theRecoveryCount is the number of recoveries found. */
+	volatile LONG m_theRecoveryCount;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItSloMonitor starts the periodic check.
+	 * @param[in] thePeriod is the time in milliseconds between checks.
+	 */
+	CThreadItSloMonitor (DWORD thePeriod = THREADIT_SLO_PERIOD);
+
+	/**
+	 * Method ~CThreadItSloMonitor stops the thread.
+	 */
+	virtual ~CThreadItSloMonitor ();
+
+	/**
+	 * Method addSlo declares an objective that a percentile of the latency of an
+	 * instruction stays at or below a threshold.
+	 * @param[in] theName is the name of the objective.
+	 * @param[in] ptheThreadIt is the instance.
+	 * @param[in] theInstruction is the instruction.
+	 * @param[in] thePercentile is the percentile from 0 to 100, such as 99.0.
+	 * @param[in] theThreshold is the time in microseconds.
+	 * @param[in] theWindow is the time in milliseconds the percentile is taken over.
+	 * @param[in] theMetric is the histogram checked.
+	 * @param[in] theMinCount is the fewest times in the window for it to be checked.
+	 * \return the ID of the objective or zero if the instruction is not valid.
+	 */
+	ULONG addSlo (const std::string& theName, const std::shared_ptr<CThreadIt>& ptheThreadIt, ULONG theInstruction, double thePercentile,
+		LONGLONG theThreshold, DWORD theWindow, SloMetric theMetric = SLO_END_TO_END, ULONG theMinCount = 1);
+
+	/**
+	 * Method removeSlo removes an objective.
+	 * @param[in] theSloId is the ID of the objective.
+	 * \return false if there is no such objective.
+	 */
+	bool removeSlo (ULONG theSloId);
+
+	/**
+	 * Method getStatus returns the latest state of an objective.
+	 * @param[in] theSloId is the ID of the objective.
+	 * @param[out] theStatus receives the state.
+	 * \return false if there is no such objective.
+	 */
+	bool getStatus (ULONG theSloId, CThreadItSloEvent& theStatus) const;
+
+	/**
+	 * Method subscribe sends the changes of state to a CThreadIt. A CThreadIt that has
+	 * already subscribed keeps the instruction it subscribed with.
+	 * @param[in] ptheThreadIt is the subscriber.
+	 * @param[in] theWorkInstruction is the instruction of the work packages sent.
+	 */
+	void subscribe (const std::shared_ptr<CThreadIt>& ptheThreadIt, UINT theWorkInstruction);
+
+	/**
+	 * Method unsubscribe stops sending the changes of state to a CThreadIt.
+	 * @param[in] ptheThreadIt is the subscriber.
+	 */
+	void unsubscribe (const std::shared_ptr<CThreadIt>& ptheThreadIt);
+
+	/**
+	 * Method getBreachCount returns the number of breaches found.
+	 */
+	LONG getBreachCount () const;
+
+	/**
+	 * Method getRecoveryCount returns the number of recoveries found.
+	 */
+	LONG getRecoveryCount () const;
+
+	/**
+	 * Method check checks the objectives now. It is called each period.
+	 */
+	void check ();
+
+protected:
+	/**
+	 * Method onPeriod is the periodic method. It checks the objectives.
+	 */
+	bool onPeriod (CWorkPackIt theTimedWork, CWorkPackIt*& ptheWorkDone);
+
+private:
+	/**
+	 * Method checkSlo takes a snapshot of the histogram of an objective and finds its
+	 * state over the window.
+	 * @param[in,out] theSlo is the objective.
+	 * @param[in] theNow is the tick count now.
+	 * \return true if the state of the objective has changed.
+	 */
+	static bool checkSlo (Slo& theSlo, DWORD theNow);
+
+	/// not copiable
+	CThreadItSloMonitor (const CThreadItSloMonitor&);
+	const CThreadItSloMonitor& operator= (const CThreadItSloMonitor&);
+
+}; // class CThreadItSloMonitor
+
+#endif // !defined (THREADIT_SLO_H)
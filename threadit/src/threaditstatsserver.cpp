@@ -0,0 +1,425 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItStatsServer
+ * Description: Class CThreadItStatsServer serves the registry snapshot of the active
+ * objects on a named pipe. See the header file for the protocol.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <sstream>
+#include <stdio.h>
+#include <sddl.h>
+#include "threaditstatsserver.h"
+
+// Class: CThreadItStatsServer Implementation
+
+/**
+ * Constructor CThreadItStatsServer creates the named pipe and waits for clients.
+ */
+CThreadItStatsServer::CThreadItStatsServer (const std::string& thePipeName, StatsFormat theFormat) : CThreadIt ("threadit.CThreadItStatsServer")
+{
+	ULONG theEventId = 0;
+	DWORD thePipeMode = PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT;
+	SECURITY_ATTRIBUTES theSecurity;
+	PSECURITY_DESCRIPTOR ptheDescriptor = NULL;
+
+#if defined (PIPE_REJECT_REMOTE_CLIENTS)
+	thePipeMode |= PIPE_REJECT_REMOTE_CLIENTS;
+#endif
+	m_theFormat = theFormat;
+	m_theServedCount = 0;
+	m_isPending = false;
+	ZeroMemory (&m_theConnect, sizeof (m_theConnect));
+	ZeroMemory (&m_theTransfer, sizeof (m_theTransfer));
+	// The events are manual reset as required for overlapped operations.
+	m_theConnect.hEvent = CreateEvent (NULL, TRUE, FALSE, NULL);
+	m_theTransfer.hEvent = CreateEvent (NULL, TRUE, FALSE, NULL);
+	// PIPE_REJECT_REMOTE_CLIENTS is not on every system so network logons are also
+	// denied by the security descriptor. The pipe is not created without it.
+	m_thePipe = INVALID_HANDLE_VALUE;
+	if (ConvertStringSecurityDescriptorToSecurityDescriptorA (THREADIT_STATS_SDDL, SDDL_REVISION_1, &ptheDescriptor, NULL))
+	{
+		theSecurity.nLength = sizeof (theSecurity);
+		theSecurity.lpSecurityDescriptor = ptheDescriptor;
+		theSecurity.bInheritHandle = FALSE;
+		m_thePipe = CreateNamedPipeA (getPipePath (thePipeName).c_str (), PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+			thePipeMode, 1, THREADIT_STATS_BUFFER, 0, 0, &theSecurity);
+		LocalFree (ptheDescriptor);
+	} // if
+	if (m_thePipe == INVALID_HANDLE_VALUE)
+	{
+		m_ptheLogger->errorStream () << "unable to create the pipe " << getPipePath (thePipeName) << " - error " << GetLastError ();
+	}
+	else if (setEventMethod (theEventId, (EventMethodType)&CThreadItStatsServer::onConnect, m_theConnect.hEvent))
+	{
+		listen ();
+	} // if
+} // constructor CThreadItStatsServer
+
+/**
+ * Method ~CThreadItStatsServer stops the server thread and closes the pipe. A client
+ * that has not read its snapshot is disconnected first so that the server thread is
+ * not left waiting for it. Closing the pipe cancels the wait for a client, which must
+ * complete before the overlapped structure and its event are released.
+ */
+CThreadItStatsServer::~CThreadItStatsServer ()
+{
+	if (m_thePipe != INVALID_HANDLE_VALUE)
+	{
+		DisconnectNamedPipe (m_thePipe);
+	} // if
+	stopThread ();
+	waitForThreadToStop ();
+	if (m_thePipe != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle (m_thePipe);
+		if (m_isPending)
+		{
+			WaitForSingleObject (m_theConnect.hEvent, THREADIT_STATS_TIMEOUT);
+		} // if
+	} // if
+	CloseHandle (m_theConnect.hEvent);
+	CloseHandle (m_theTransfer.hEvent);
+} // ~CThreadItStatsServer
+
+/**
+ * Method isListening returns true if the pipe was created.
+ */
+bool CThreadItStatsServer::isListening () const
+{
+	return (m_thePipe != INVALID_HANDLE_VALUE);
+} // isListening
+
+/**
+ * Method getServedCount returns the number of snapshots sent.
+ */
+LONG CThreadItStatsServer::getServedCount () const
+{
+	return m_theServedCount;
+} // getServedCount
+
+/**
+ * Method getPipePath returns the full path of a named pipe.
+ */
+std::string CThreadItStatsServer::getPipePath (const std::string& thePipeName)
+{
+	return std::string ("\\\\.\\pipe\\") + thePipeName;
+} // getPipePath
+
+/**
+ * Method onConnect is the event method called when a client connects.
+ */
+bool CThreadItStatsServer::onConnect (CWorkPackIt theWorkPack, CWorkPackIt*& ptheWorkDone)
+{
+	DWORD theBytes = 0;
+
+	ptheWorkDone = NULL;
+	m_isPending = false;
+	if (GetOverlappedResult (m_thePipe, &m_theConnect, &theBytes, FALSE))
+	{
+		send ();
+	} // if
+	DisconnectNamedPipe (m_thePipe);
+	if (!listen ())
+	{
+		// Do not spin on the event of a pipe that can no longer take clients.
+		ResetEvent (m_theConnect.hEvent);
+		m_ptheLogger->errorStream () << "unable to wait for the next client - error " << GetLastError ();
+	} // if
+	return true;
+} // onConnect
+
+/**
+ * Method listen starts the wait for the next client. ConnectNamedPipe clears the
+ * event when it starts. A client that connected in between is reported by
+ * ERROR_PIPE_CONNECTED without the event being set, so it is set here.
+ */
+bool CThreadItStatsServer::listen ()
+{
+	bool isSuccess = false;
+	DWORD theError = 0;
+
+	if (ConnectNamedPipe (m_thePipe, &m_theConnect))
+	{
+		isSuccess = true;
+	}
+	else
+	{
+		theError = GetLastError ();
+		if (theError == ERROR_IO_PENDING)
+		{
+			m_isPending = true;
+			isSuccess = true;
+		}
+		else if (theError == ERROR_PIPE_CONNECTED)
+		{
+			SetEvent (m_theConnect.hEvent);
+			isSuccess = true;
+		} // if
+	} // if
+	return isSuccess;
+} // listen
+
+/**
+ * Method send writes the snapshot to the connected client and waits for the client
+ * to read it so that it is not discarded by DisconnectNamedPipe. The client then
+ * sees the end of the pipe when the server disconnects.
+ */
+void CThreadItStatsServer::send ()
+{
+	std::vector<ActiveInfo> theSnapshot;
+	std::string theText;
+
+	CActive::getRegistrySnapshot (theSnapshot);
+	if (m_theFormat == STATS_PROMETHEUS)
+	{
+		theText = toPrometheus (theSnapshot);
+	}
+	else
+	{
+		theText = toJson (theSnapshot);
+	} // if
+	if (completeTransfer (WriteFile (m_thePipe, theText.data (), (DWORD)theText.size (), NULL, &m_theTransfer)))
+	{
+		InterlockedIncrement (&m_theServedCount);
+		FlushFileBuffers (m_thePipe);
+	} // if
+} // send
+
+/**
+ * Method completeTransfer waits for the transfer in progress to complete and
+ * cancels it if it takes longer than THREADIT_STATS_TIMEOUT. The transfers are
+ * started on the server thread so CancelIo can cancel them.
+ */
+bool CThreadItStatsServer::completeTransfer (BOOL isStarted)
+{
+	bool isSuccess = false;
+	DWORD theBytes = 0;
+
+	if ((isStarted) || (GetLastError () == ERROR_IO_PENDING))
+	{
+		if (WaitForSingleObject (m_theTransfer.hEvent, THREADIT_STATS_TIMEOUT) != WAIT_OBJECT_0)
+		{
+			CancelIo (m_thePipe);
+		} // if
+		// The overlapped structure is in use until the transfer is complete.
+		isSuccess = (GetOverlappedResult (m_thePipe, &m_theTransfer, &theBytes, TRUE) != FALSE);
+	} // if
+	return isSuccess;
+} // completeTransfer
+
+/**
+ * Method toJson returns a snapshot as a JSON object.
+ */
+std::string CThreadItStatsServer::toJson (const std::vector<ActiveInfo>& theSnapshot)
+{
+	std::ostringstream theText;
+
+	theText << "{\"pid\":" << GetCurrentProcessId () << ",\"threads\":[";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		const ActiveInfo& theInfo = theSnapshot[theIndex];
+		if (theIndex > 0)
+		{
+			theText << ",";
+		} // if
+		theText << "{\"name\":\"" << escape (theInfo.theName) << "\""
+			<< ",\"threadId\":" << theInfo.theThreadId
+			<< ",\"instance\":" << theInfo.theInstance
+			<< ",\"running\":" << (theInfo.isRunning ? "true" : "false")
+			<< ",\"cpuUserUs\":" << theInfo.theUserTime
+			<< ",\"cpuKernelUs\":" << theInfo.theKernelTime
+			<< ",\"wallUs\":" << theInfo.theWallTime
+			<< ",\"waitUs\":" << theInfo.theWaitTime
+			<< ",\"waits\":" << theInfo.theWaitCount
+			<< ",\"waiting\":" << (theInfo.isWaiting ? "true" : "false")
+			<< ",\"threadIt\":" << (theInfo.isThreadIt ? "true" : "false");
+		if (theInfo.isThreadIt)
+		{
+			theText << ",\"workQDepth\":" << theInfo.theWorkQDepth
+				<< ",\"doneQDepth\":" << theInfo.theDoneQDepth
+				<< ",\"processed\":" << theInfo.theProcessedCount
+				<< ",\"currentInstruction\":" << theInfo.theCurrentInstruction
+				<< ",\"currentMs\":" << theInfo.theCurrentTime
+				<< ",\"allocs\":" << theInfo.theAllocationCount
+				<< ",\"allocBytes\":" << theInfo.theAllocatedBytes
+				<< ",\"allocPeakBytes\":" << theInfo.thePeakAllocatedBytes
+				<< ",\"allocsPerMsg\":" << ((theInfo.theProcessedCount > 0) ? ((double)theInfo.theAllocationCount / theInfo.theProcessedCount) : 0.0);
+		} // if
+		theText << "}";
+	} // for
+	theText << "]}\n";
+	return theText.str ();
+} // toJson
+
+/**
+ * Method toPrometheus returns a snapshot in the Prometheus text exposition format.
+ * Each metric is labelled with the name and the thread identity of the instance.
+ */
+std::string CThreadItStatsServer::toPrometheus (const std::vector<ActiveInfo>& theSnapshot)
+{
+	std::ostringstream theText;
+	std::vector<std::string> theLabels;
+
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		std::ostringstream theLabel;
+		theLabel << "{name=\"" << escape (theSnapshot[theIndex].theName) << "\",thread_id=\"" << theSnapshot[theIndex].theThreadId << "\"}";
+		theLabels.push_back (theLabel.str ());
+	} // for
+	theText << "# HELP threadit_running 1 if the thread of the active object is running.\n# TYPE threadit_running gauge\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		theText << "threadit_running" << theLabels[theIndex] << " " << (theSnapshot[theIndex].isRunning ? 1 : 0) << "\n";
+	} // for
+	theText << "# HELP threadit_cpu_user_seconds_total CPU time spent in user mode.\n# TYPE threadit_cpu_user_seconds_total counter\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		theText << "threadit_cpu_user_seconds_total" << theLabels[theIndex] << " " << (theSnapshot[theIndex].theUserTime / 1000000.0) << "\n";
+	} // for
+	theText << "# HELP threadit_cpu_kernel_seconds_total CPU time spent in the kernel.\n# TYPE threadit_cpu_kernel_seconds_total counter\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		theText << "threadit_cpu_kernel_seconds_total" << theLabels[theIndex] << " " << (theSnapshot[theIndex].theKernelTime / 1000000.0) << "\n";
+	} // for
+	theText << "# HELP threadit_wall_seconds_total Time since the thread routine started.\n# TYPE threadit_wall_seconds_total counter\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		theText << "threadit_wall_seconds_total" << theLabels[theIndex] << " " << (theSnapshot[theIndex].theWallTime / 1000000.0) << "\n";
+	} // for
+	theText << "# HELP threadit_wait_seconds_total Time the thread routine spent waiting for work.\n# TYPE threadit_wait_seconds_total counter\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		theText << "threadit_wait_seconds_total" << theLabels[theIndex] << " " << (theSnapshot[theIndex].theWaitTime / 1000000.0) << "\n";
+	} // for
+	theText << "# HELP threadit_waits_total Waits for work.\n# TYPE threadit_waits_total counter\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		theText << "threadit_waits_total" << theLabels[theIndex] << " " << theSnapshot[theIndex].theWaitCount << "\n";
+	} // for
+	theText << "# HELP threadit_work_queue_depth Work packages waiting to be processed.\n# TYPE threadit_work_queue_depth gauge\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		if (theSnapshot[theIndex].isThreadIt)
+		{
+			theText << "threadit_work_queue_depth" << theLabels[theIndex] << " " << theSnapshot[theIndex].theWorkQDepth << "\n";
+		} // if
+	} // for
+	theText << "# HELP threadit_done_queue_depth Results waiting to be collected.\n# TYPE threadit_done_queue_depth gauge\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		if (theSnapshot[theIndex].isThreadIt)
+		{
+			theText << "threadit_done_queue_depth" << theLabels[theIndex] << " " << theSnapshot[theIndex].theDoneQDepth << "\n";
+		} // if
+	} // for
+	theText << "# HELP threadit_processed_total Work packages processed.\n# TYPE threadit_processed_total counter\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		if (theSnapshot[theIndex].isThreadIt)
+		{
+			theText << "threadit_processed_total" << theLabels[theIndex] << " " << theSnapshot[theIndex].theProcessedCount << "\n";
+		} // if
+	} // for
+	theText << "# HELP threadit_current_instruction Instruction of the worker method running, -1 if idle.\n# TYPE threadit_current_instruction gauge\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		if (theSnapshot[theIndex].isThreadIt)
+		{
+			theText << "threadit_current_instruction" << theLabels[theIndex] << " " << theSnapshot[theIndex].theCurrentInstruction << "\n";
+		} // if
+	} // for
+	theText << "# HELP threadit_current_instruction_seconds Time the worker method has been running.\n# TYPE threadit_current_instruction_seconds gauge\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		if (theSnapshot[theIndex].isThreadIt)
+		{
+			theText << "threadit_current_instruction_seconds" << theLabels[theIndex] << " " << (theSnapshot[theIndex].theCurrentTime / 1000.0) << "\n";
+		} // if
+	} // for
+	theText << "# HELP threadit_allocations_total Heap blocks allocated by the worker methods.\n# TYPE threadit_allocations_total counter\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		if (theSnapshot[theIndex].isThreadIt)
+		{
+			theText << "threadit_allocations_total" << theLabels[theIndex] << " " << theSnapshot[theIndex].theAllocationCount << "\n";
+		} // if
+	} // for
+	theText << "# HELP threadit_allocated_bytes_total Bytes allocated by the worker methods.\n# TYPE threadit_allocated_bytes_total counter\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		if (theSnapshot[theIndex].isThreadIt)
+		{
+			theText << "threadit_allocated_bytes_total" << theLabels[theIndex] << " " << theSnapshot[theIndex].theAllocatedBytes << "\n";
+		} // if
+	} // for
+	theText << "# HELP threadit_allocation_peak_bytes Most bytes a run of a worker method held at one time.\n# TYPE threadit_allocation_peak_bytes gauge\n";
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		if (theSnapshot[theIndex].isThreadIt)
+		{
+			theText << "threadit_allocation_peak_bytes" << theLabels[theIndex] << " " << theSnapshot[theIndex].thePeakAllocatedBytes << "\n";
+		} // if
+	} // for
+	return theText.str ();
+} // toPrometheus
+
+/**
+ * Method escape returns a string with the characters that JSON strings and
+ * Prometheus label values do not allow escaped.
+ */
+std::string CThreadItStatsServer::escape (const std::string& theText)
+{
+	std::string theEscaped;
+	char theCode[8];
+
+	for (size_t theIndex = 0; theIndex < theText.size (); theIndex++)
+	{
+		switch (theText[theIndex])
+		{
+			case '\\':
+				theEscaped += "\\\\";
+				break;
+			case '"':
+				theEscaped += "\\\"";
+				break;
+			case '\n':
+				theEscaped += "\\n";
+				break;
+			default:
+				if ((unsigned char)theText[theIndex] < 0x20)
+				{
+					sprintf_s (theCode, sizeof (theCode), "\\u%04x", (unsigned int)(unsigned char)theText[theIndex]);
+					theEscaped += theCode;
+				}
+				else
+				{
+					theEscaped += theText[theIndex];
+				} // if
+				break;
+		} // switch
+	} // for
+	return theEscaped;
+} // escape
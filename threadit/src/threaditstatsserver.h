@@ -0,0 +1,173 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItStatsServer
+ * Description: Class CThreadItStatsServer is a CThreadIt that serves the registry
+ * snapshot of the active objects of the process (see CActive::getRegistrySnapshot)
+ * on a local named pipe so that a process can be inspected while it is under load.
+ * Each client that connects is sent one snapshot, as JSON or in the Prometheus text
+ * format, and the pipe is then made ready for the next client. For example
+ *   type \\.\pipe\myprocess.stats
+ * prints the snapshot of a server created with the pipe name "myprocess.stats".
+ *
+ * The pipe is created with FILE_FLAG_OVERLAPPED and the wait for a client is an
+ * event method of the server, so the server thread is free between clients and is
+ * stopped like any other CThreadIt. Remote clients are refused by the security
+ * descriptor of the pipe, which denies access to the NETWORK group (S-1-5-2), as
+ * well as by PIPE_REJECT_REMOTE_CLIENTS where the system supports it. The snapshot
+ * is written with a limit of THREADIT_STATS_TIMEOUT milliseconds and the server then
+ * waits for the client to read it before it disconnects, which the client sees as the
+ * end of the pipe. Clients are served one at a time.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_STATS_SERVER_H)
+#define THREADIT_STATS_SERVER_H
+
+// Includes
+#include <string>
+#include <vector>
+#include "threadit.h"
+
+/** THREADIT_STATS_TIMEOUT is the most time in milliseconds taken to write a snapshot. */
+#define THREADIT_STATS_TIMEOUT 1000
+/** THREADIT_STATS_SDDL is the security descriptor of the pipe. Network logons are
+ * denied, and the system, the administrators and the owner have full access, with
+ * read access for everyone else on the computer. */
+#define THREADIT_STATS_SDDL "D:(D;;GA;;;NU)(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;OW)(A;;GR;;;WD)"
+/** THREADIT_STATS_BUFFER is the size of the output buffer of the pipe. */
+#define THREADIT_STATS_BUFFER 65536
+
+/**
+ * Class CThreadItStatsServer serves the registry snapshot on a named pipe.
+ */
+class CThreadItStatsServer : public CThreadIt
+{
+	// types
+public:
+	/** StatsFormat is the format of the snapshot. */
+	enum StatsFormat
+	{
+		/** The snapshot is a JSON object. */
+		STATS_JSON = 0,
+		/** The snapshot is in the Prometheus text exposition format. */
+		STATS_PROMETHEUS
+	};
+
+	// Attributes
+private:
+	/** m_thePipe is the server end of the named pipe. */
+	HANDLE m_thePipe;
+	/** m_theConnect is the overlapped structure of the wait for a client. */
+	OVERLAPPED m_theConnect;
+	/** m_theTransfer is the overlapped structure used to write the snapshot. */
+	OVERLAPPED m_theTransfer;
+	/** m_isPending is true while the wait for a client is in progress. */
+	bool m_isPending;
+	/** m_theFormat is the format of the snapshot. */
+	StatsFormat m_theFormat;
+	/** m_theServedCount is the number of snapshots sent. */
+	volatile LONG m_theServedCount;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItStatsServer creates the named pipe and waits for clients.
+	 * @param[in] thePipeName is the name of the pipe without the \\.\pipe\ prefix.
+	 * @param[in] theFormat is the format of the snapshot.
+	 */
+	CThreadItStatsServer (const std::string& thePipeName, StatsFormat theFormat = STATS_JSON);
+
+	/**
+	 * Method ~CThreadItStatsServer stops the server thread and closes the pipe.
+	 */
+	virtual ~CThreadItStatsServer ();
+
+	/**
+	 * Method isListening returns true if the pipe was created.
+	 */
+	bool isListening () const;
+
+	/**
+	 * Method getServedCount returns the number of snapshots sent.
+	 */
+	LONG getServedCount () const;
+
+	/**
+	 * Method getPipePath returns the full path of a named pipe.
+	 * @param[in] thePipeName is the name of the pipe.
+	 */
+	static std::string getPipePath (const std::string& thePipeName);
+
+	/**
+	 * Method toJson returns a snapshot as a JSON object.
+	 * @param[in] theSnapshot is the snapshot.
+	 */
+	static std::string toJson (const std::vector<ActiveInfo>& theSnapshot);
+
+	/**
+	 * Method toPrometheus returns a snapshot in the Prometheus text exposition format.
+	 * @param[in] theSnapshot is the snapshot.
+	 */
+	static std::string toPrometheus (const std::vector<ActiveInfo>& theSnapshot);
+
+protected:
+	/**
+	 * Method onConnect is the event method called when a client connects. The
+	 * snapshot is sent and the pipe made ready for the next client.
+	 */
+	bool onConnect (CWorkPackIt theWorkPack, CWorkPackIt*& ptheWorkDone);
+
+	/**
+	 * Method listen starts the wait for the next client.
+	 * \return true if the wait has started or a client is already connected.
+	 */
+	bool listen ();
+
+	/**
+	 * Method send writes the snapshot to the connected client and waits for the
+	 * client to read it.
+	 */
+	void send ();
+
+	/**
+	 * Method completeTransfer waits for the transfer in progress to complete and
+	 * cancels it if it takes longer than THREADIT_STATS_TIMEOUT.
+	 * @param[in] isStarted is the result of the WriteFile call.
+	 * \return true if the transfer completed successfully.
+	 */
+	bool completeTransfer (BOOL isStarted);
+
+private:
+	/**
+	 * Method escape returns a string with the characters that JSON strings and
+	 * Prometheus label values do not allow escaped.
+	 */
+	static std::string escape (const std::string& theText);
+
+	/// not copiable
+	CThreadItStatsServer (const CThreadItStatsServer&);
+	const CThreadItStatsServer& operator= (const CThreadItStatsServer&);
+
+}; // class CThreadItStatsServer
+
+#endif // !defined (THREADIT_STATS_SERVER_H)
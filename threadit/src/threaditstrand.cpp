@@ -0,0 +1,260 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItStrandGroup
+ * Description: Class CThreadItStrandGroup runs work packages with the same key one
+ * at a time in order on a group of CThreadIt workers. See the header file for a
+ * description of the strands.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include "threaditstrand.h"
+
+// Class: CThreadItStrandGroup Implementation
+
+/**
+ * Constructor CThreadItStrandGroup creates a group over the workers given.
+ */
+CThreadItStrandGroup::CThreadItStrandGroup (const std::vector<CThreadIt*>& theWorkers)
+{
+	m_ptheLogger = &(log4cpp::Category::getInstance ("threadit.CThreadItStrandGroup"));
+	for (ULONG theStripe = 0; theStripe < THREADIT_STRAND_STRIPES; theStripe++)
+	{
+		InitializeCriticalSection (&m_theStripes[theStripe].theAccess);
+	} // for
+	m_theWorkerCount = (ULONG)theWorkers.size ();
+	m_theWorkers = new StrandWorker[m_theWorkerCount];
+	for (ULONG theWorker = 0; theWorker < m_theWorkerCount; theWorker++)
+	{
+		m_theWorkers[theWorker].ptheWorker = theWorkers[theWorker];
+		m_theWorkers[theWorker].theInProgress = 0;
+	} // for
+	m_theNextWorker = 0;
+	m_theSubmitted = 0;
+	m_theCompleted = 0;
+} // constructor CThreadItStrandGroup
+
+/**
+ * Method ~CThreadItStrandGroup frees the work packages that are still waiting.
+ */
+CThreadItStrandGroup::~CThreadItStrandGroup ()
+{
+	StrandMap::iterator theStrand;
+
+	for (ULONG theStripe = 0; theStripe < THREADIT_STRAND_STRIPES; theStripe++)
+	{
+		for (theStrand = m_theStripes[theStripe].theStrands.begin (); theStrand != m_theStripes[theStripe].theStrands.end (); theStrand++)
+		{
+			while (!theStrand->second.theWaiting.empty ())
+			{
+				delete theStrand->second.theWaiting.front ();
+				theStrand->second.theWaiting.pop_front ();
+			} // while
+		} // for
+		m_theStripes[theStripe].theStrands.clear ();
+		DeleteCriticalSection (&m_theStripes[theStripe].theAccess);
+	} // for
+	delete [] m_theWorkers;
+} // ~CThreadItStrandGroup
+
+/**
+ * Method getStripe returns the stripe that holds the strand of a key. The key is
+ * mixed first so that consecutive keys are spread over the stripes.
+ */
+CThreadItStrandGroup::StrandStripe& CThreadItStrandGroup::getStripe (ULONG theKey)
+{
+	return m_theStripes[((theKey * 2654435761UL) >> 16) & (THREADIT_STRAND_STRIPES - 1)];
+} // getStripe
+
+/**
+ * Method submit sends a work package for processing after the work packages
+ * already submitted with the same key.
+ */
+bool CThreadItStrandGroup::submit (CWorkPackIt* ptheWorkPack)
+{
+	bool isSuccess = false;
+	bool isDispatch = false;
+	StrandMap::iterator theStrand;
+
+	if ((ptheWorkPack != NULL) && (m_theWorkerCount > 0))
+	{
+		StrandStripe& theStripe = getStripe (ptheWorkPack->m_theKey);
+		InterlockedIncrement (&m_theSubmitted);
+		EnterCriticalSection (&theStripe.theAccess);
+		theStrand = theStripe.theStrands.find (ptheWorkPack->m_theKey);
+		if (theStrand == theStripe.theStrands.end ())
+		{
+			// The key is idle. Record that it is in progress and send the work package.
+			setCompletion (theStripe.theStrands[ptheWorkPack->m_theKey], ptheWorkPack);
+			isDispatch = true;
+		}
+		else
+		{
+			theStrand->second.theWaiting.push_back (ptheWorkPack);
+		} // if
+		LeaveCriticalSection (&theStripe.theAccess);
+		if (isDispatch)
+		{
+			dispatch (ptheWorkPack);
+		} // if
+		isSuccess = true;
+	}
+	else
+	{
+		m_ptheLogger->error ("work package not submitted - no work package or no workers");
+	} // if
+	return isSuccess;
+} // submit
+
+/**
+ * Method setCompletion keeps the completion the caller gave the work package that is
+ * about to be sent for a strand, as dispatch replaces it with the group.
+ */
+void CThreadItStrandGroup::setCompletion (Strand& theStrand, const CWorkPackIt* ptheWorkPack)
+{
+	theStrand.ptheCompletion = ptheWorkPack->m_ptheCompletion;
+	theStrand.theCompletionTag = ptheWorkPack->m_theCompletionTag;
+} // setCompletion
+
+/**
+ * Method dispatch sends a work package to the worker with the fewest work packages
+ * in progress. The search starts from a different worker each time so that the
+ * workers share the load when they are equally loaded.
+ */
+void CThreadItStrandGroup::dispatch (CWorkPackIt* ptheWorkPack)
+{
+	ULONG theWorkPackId = 0;
+	ULONG theBest = 0;
+	ULONG theWorker = 0;
+	LONG theLoad = LONG_MAX;
+	ULONG theStart = (ULONG)InterlockedIncrement (&m_theNextWorker);
+
+	for (ULONG theCount = 0; theCount < m_theWorkerCount; theCount++)
+	{
+		theWorker = (theStart + theCount) % m_theWorkerCount;
+		if (m_theWorkers[theWorker].theInProgress < theLoad)
+		{
+			theLoad = m_theWorkers[theWorker].theInProgress;
+			theBest = theWorker;
+		} // if
+	} // for
+	InterlockedIncrement (&m_theWorkers[theBest].theInProgress);
+	ptheWorkPack->m_ptheCompletion = this;
+	ptheWorkPack->m_theCompletionTag = ptheWorkPack->m_theKey;
+	m_theWorkers[theBest].ptheWorker->startWork (ptheWorkPack, theWorkPackId);
+} // dispatch
+
+/**
+ * Method onWorkDone is called on the worker thread when a work package is done. The
+ * tag is the key of the work package. The completion of the caller is called, with
+ * the completion and tag of the work package put back, and then the next work
+ * package of the strand is sent or the strand is removed if there is none.
+ */
+void CThreadItStrandGroup::onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess)
+{
+	ULONG theWorker = 0;
+	CWorkPackIt* ptheNext = NULL;
+	CThreadItCompletion* ptheCompletion = NULL;
+	ULONG theCompletionTag = 0;
+	StrandMap::iterator theStrand;
+	StrandStripe& theStripe = getStripe (theTag);
+
+	while ((theWorker < m_theWorkerCount) && (m_theWorkers[theWorker].ptheWorker != ptheWorker))
+	{
+		theWorker++;
+	} // while
+	if (theWorker < m_theWorkerCount)
+	{
+		InterlockedDecrement (&m_theWorkers[theWorker].theInProgress);
+	} // if
+	EnterCriticalSection (&theStripe.theAccess);
+	theStrand = theStripe.theStrands.find (theTag);
+	if (theStrand != theStripe.theStrands.end ())
+	{
+		ptheCompletion = theStrand->second.ptheCompletion;
+		theCompletionTag = theStrand->second.theCompletionTag;
+		if (theStrand->second.theWaiting.empty ())
+		{
+			theStripe.theStrands.erase (theStrand);
+		}
+		else
+		{
+			ptheNext = theStrand->second.theWaiting.front ();
+			theStrand->second.theWaiting.pop_front ();
+			setCompletion (theStrand->second, ptheNext);
+		} // if
+	}
+	else
+	{
+		m_ptheLogger->error ("work package completed for a key without a strand");
+	} // if
+	LeaveCriticalSection (&theStripe.theAccess);
+	// The caller sees its own completion on the result, which is sent after this call.
+	if (ptheWorkDone != NULL)
+	{
+		ptheWorkDone->m_ptheCompletion = ptheCompletion;
+		ptheWorkDone->m_theCompletionTag = theCompletionTag;
+	} // if
+	if (ptheCompletion != NULL)
+	{
+		ptheCompletion->onWorkDone (ptheWorker, theCompletionTag, ptheWorkDone, isSuccess);
+	} // if
+	InterlockedIncrement (&m_theCompleted);
+	if (ptheNext != NULL)
+	{
+		dispatch (ptheNext);
+	} // if
+} // onWorkDone
+
+/**
+ * Method getActiveKeyCount returns the number of keys with a work package in progress.
+ */
+ULONG CThreadItStrandGroup::getActiveKeyCount ()
+{
+	ULONG theCount = 0;
+
+	for (ULONG theStripe = 0; theStripe < THREADIT_STRAND_STRIPES; theStripe++)
+	{
+		EnterCriticalSection (&m_theStripes[theStripe].theAccess);
+		theCount += (ULONG)m_theStripes[theStripe].theStrands.size ();
+		LeaveCriticalSection (&m_theStripes[theStripe].theAccess);
+	} // for
+	return theCount;
+} // getActiveKeyCount
+
+/**
+ * Method getSubmittedCount returns the number of work packages submitted.
+ */
+LONG CThreadItStrandGroup::getSubmittedCount () const
+{
+	return m_theSubmitted;
+} // getSubmittedCount
+
+/**
+ * Method getCompletedCount returns the number of work packages that have completed.
+ */
+LONG CThreadItStrandGroup::getCompletedCount () const
+{
+	return m_theCompleted;
+} // getCompletedCount
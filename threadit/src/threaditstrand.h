@@ -0,0 +1,192 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItStrandGroup
+ * Description: Class CThreadItStrandGroup runs work packages on a group of
+ * identical CThreadIt workers so that work packages with the same key
+ * (m_theKey of CWorkPackIt) are processed one at a time in the order they were
+ * submitted while work packages with different keys are processed in parallel.
+ *
+ * A key that has a work package in progress has a strand: the list of the work
+ * packages with that key that are waiting. A work package submitted for a key
+ * without a strand is sent straight away to the worker with the fewest work
+ * packages in progress. Otherwise it is added to the end of the strand. When a
+ * work package completes (see CThreadItCompletion) the next work package of the
+ * strand is sent to the least loaded worker, which need not be the worker that
+ * processed the previous one. The strand is removed once it is empty so a key
+ * that is idle costs no memory. The strands are held in striped maps so that
+ * submitting and completing work packages with different keys rarely contend.
+ *
+ * Because the next work package of a key is only sent once the previous one has
+ * been processed, a hot key cannot hold up the other keys: the workers are free
+ * to take work packages for other keys in the mean time. This is unlike static
+ * sharding on the key where every key that maps to the worker of a hot key waits.
+ *
+ * The group sets m_ptheCompletion and m_theCompletionTag of the work packages it
+ * sends. A completion given by the caller is kept with the strand while its work
+ * package is in progress, and is put back and called when the work package is done,
+ * before the next work package of the key is sent. The other fields are left as
+ * given so the results are returned in the usual way.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_STRAND_H)
+#define THREADIT_STRAND_H
+
+// Includes
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include "threadit.h"
+#include "threaditcompletion.h"
+
+/** THREADIT_STRAND_STRIPES is the number of maps the strands are spread over. It
+ * must be a power of two. */
+#define THREADIT_STRAND_STRIPES 32
+
+/**
+ * Class CThreadItStrandGroup runs work packages with the same key in order.
+ */
+class CThreadItStrandGroup : public CThreadItCompletion
+{
+	// types
+private:
+	/** Strand holds the work packages of a key that are waiting and the completion
+	 * the caller gave the work package in progress. */
+	typedef struct StrandTag
+	{
+		/** theWaiting are the work packages waiting in the order they were submitted. */
+		std::deque<CWorkPackIt*> theWaiting;
+		/** ptheCompletion is the completion of the work package in progress or NULL. */
+		CThreadItCompletion* ptheCompletion;
+		/** theCompletionTag is the tag of ptheCompletion. */
+		ULONG theCompletionTag;
+	} Strand;
+	/** StrandMap maps a key that has a work package in progress to its strand. */
+	typedef std::unordered_map<ULONG, Strand> StrandMap;
+
+	/** StrandStripe is a map of strands and the lock that protects it. */
+	typedef struct StrandStripeTag
+	{
+		/** theAccess protects theStrands. */
+		CRITICAL_SECTION theAccess;
+		/** theStrands are the strands of the keys in this stripe. */
+		StrandMap theStrands;
+	} StrandStripe;
+
+	/** StrandWorker is a worker of the group and its load. Each is given its
+	 * own cache line as the load is updated by every worker thread. */
+	typedef struct StrandWorkerTag
+	{
+		/** ptheWorker is the worker. */
+		CThreadIt* ptheWorker;
+		/** theInProgress is the number of work packages sent to the worker that have not completed. */
+		volatile LONG theInProgress;
+		char thePad[64 - sizeof (CThreadIt*) - sizeof (LONG)];
+	} StrandWorker;
+
+	// Attributes
+private:
+	/** m_theStripes hold the strands. */
+	StrandStripe m_theStripes[THREADIT_STRAND_STRIPES];
+	/** m_theWorkers are the workers of the group. */
+	StrandWorker* m_theWorkers;
+	/** m_theWorkerCount is the number of workers. */
+	ULONG m_theWorkerCount;
+	/** m_theNextWorker rotates the worker the search for the least loaded worker starts from. */
+	volatile LONG m_theNextWorker;
+	/** m_theSubmitted is the number of work packages submitted. */
+	volatile LONG m_theSubmitted;
+	/** m_theCompleted is the number of work packages that have completed. */
+	volatile LONG m_theCompleted;
+	/** m_ptheLogger is the logger used to log information and errors. */
+	log4cpp::Category* m_ptheLogger;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItStrandGroup creates a group over the workers given. Every
+	 * worker must be able to process every work instruction submitted to the group and
+	 * must stay valid for the life of the group.
+	 */
+	CThreadItStrandGroup (const std::vector<CThreadIt*>& theWorkers);
+
+	/**
+	 * Method ~CThreadItStrandGroup frees the work packages that are still waiting.
+	 * The work packages in progress must have completed.
+	 */
+	virtual ~CThreadItStrandGroup ();
+
+	/**
+	 * Method submit sends a work package for processing after the work packages
+	 * already submitted with the same key.
+	 * @param[in] ptheWorkPack is the work package. Ownership passes to the group.
+	 * \return true if the work package is accepted.
+	 */
+	bool submit (CWorkPackIt* ptheWorkPack);
+
+	/**
+	 * Method onWorkDone is called on the worker thread when a work package is done.
+	 * It calls the completion the caller gave the work package and then sends the
+	 * next work package of the strand.
+	 */
+	virtual void onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess);
+
+	/**
+	 * Method getActiveKeyCount returns the number of keys with a work package in progress.
+	 */
+	ULONG getActiveKeyCount ();
+
+	/**
+	 * Method getSubmittedCount returns the number of work packages submitted.
+	 */
+	LONG getSubmittedCount () const;
+
+	/**
+	 * Method getCompletedCount returns the number of work packages that have completed.
+	 */
+	LONG getCompletedCount () const;
+
+private:
+	/**
+	 * Method getStripe returns the stripe that holds the strand of a key.
+	 */
+	StrandStripe& getStripe (ULONG theKey);
+
+	/**
+	 * Method setCompletion keeps the completion the caller gave the work package that
+	 * is about to be sent for a strand. It is called with the stripe locked.
+	 */
+	static void setCompletion (Strand& theStrand, const CWorkPackIt* ptheWorkPack);
+
+	/**
+	 * Method dispatch sends a work package to the least loaded worker.
+	 */
+	void dispatch (CWorkPackIt* ptheWorkPack);
+
+	/// not copiable
+	CThreadItStrandGroup (const CThreadItStrandGroup&);
+	const CThreadItStrandGroup& operator= (const CThreadItStrandGroup&);
+
+}; // class CThreadItStrandGroup
+
+#endif // !defined (THREADIT_STRAND_H)
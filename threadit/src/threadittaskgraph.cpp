@@ -0,0 +1,436 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItTaskGraph
+ * Description: Class CThreadItTaskGraph executes a graph of work requests where
+ * each node is a work instruction sent to a CThreadIt instance and each edge is
+ * a dependency between two nodes. See the header file for a description of how
+ * the nodes are released as their inputs complete.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include "threadittaskgraph.h"
+
+// Class: CThreadItTaskRun Implementation
+
+/**
+ * Constructor CThreadItTaskRun allocates the counters for the nodes of the graph.
+ */
+CThreadItTaskRun::CThreadItTaskRun (CThreadItTaskGraph* ptheGraph)
+{
+	ULONG theCount = ptheGraph->getNodeCount ();
+
+	m_ptheGraph = ptheGraph;
+	m_theDependencies = new LONG[theCount + 1];
+	m_theFailedInputs = new LONG[theCount + 1];
+	m_theResults.resize (theCount);
+	m_theStatus.resize (theCount);
+	m_theRemaining = 0;
+	m_theFailures = 0;
+	m_theDone = CreateEvent (NULL, TRUE, FALSE, NULL);
+} // constructor CThreadItTaskRun
+
+/**
+ * Method ~CThreadItTaskRun frees the counters and closes the event.
+ */
+CThreadItTaskRun::~CThreadItTaskRun ()
+{
+	delete [] m_theDependencies;
+	delete [] m_theFailedInputs;
+	CloseHandle (m_theDone);
+} // ~CThreadItTaskRun
+
+/**
+ * Method reset prepares the run for a new execution. The dependency counters are
+ * set from the compiled graph and the results of the previous execution released.
+ */
+void CThreadItTaskRun::reset ()
+{
+	ULONG theNode = 0;
+	ULONG theCount = m_ptheGraph->getNodeCount ();
+
+	for (theNode = 0; theNode < theCount; theNode++)
+	{
+		m_theDependencies[theNode] = (LONG)m_ptheGraph->m_theNodes[theNode].theInputs.size ();
+		m_theFailedInputs[theNode] = 0;
+		m_theResults[theNode].reset ();
+		m_theStatus[theNode] = CThreadIt::WORKDONE_NO_RESULT;
+	} // for
+	m_theFailures = 0;
+	m_theRemaining = (LONG)theCount;
+	if (theCount > 0)
+	{
+		ResetEvent (m_theDone);
+	}
+	else
+	{
+		SetEvent (m_theDone);
+	} // if
+} // reset
+
+/**
+ * Method dispatch sends a node to its worker. The run is the completion of the
+ * work package and the node identity is the completion tag.
+ */
+void CThreadItTaskRun::dispatch (ULONG theNode)
+{
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+	CThreadItTaskGraph::TaskNode& theTaskNode = m_ptheGraph->m_theNodes[theNode];
+
+	ptheWorkPack->m_theInstruction = theTaskNode.theInstruction;
+	ptheWorkPack->m_ptheDataItem = theTaskNode.ptheDataItem;
+	ptheWorkPack->m_ptheObject = this;
+	ptheWorkPack->m_ptheCompletion = this;
+	ptheWorkPack->m_theCompletionTag = theNode;
+	ptheWorkPack->m_isSendResult = false;
+	theTaskNode.ptheWorker->startWork (ptheWorkPack, theWorkPackId);
+} // dispatch
+
+/**
+ * Method complete records that a node is done and releases its successors. A
+ * successor whose last input has completed is sent to its worker unless one of its
+ * inputs failed in which case it is completed as failed without being sent. The
+ * remaining count is decremented last as the run may be released as soon as it
+ * reaches zero.
+ */
+void CThreadItTaskRun::complete (ULONG theNode, bool isSuccess)
+{
+	std::vector<ULONG>& theOutputs = m_ptheGraph->m_theNodes[theNode].theOutputs;
+	std::vector<ULONG>::iterator theOutput;
+
+	if (!isSuccess)
+	{
+		InterlockedIncrement (&m_theFailures);
+	} // if
+	for (theOutput = theOutputs.begin (); theOutput != theOutputs.end (); theOutput++)
+	{
+		if (!isSuccess)
+		{
+			InterlockedExchange (&m_theFailedInputs[*theOutput], 1);
+		} // if
+		if (InterlockedDecrement (&m_theDependencies[*theOutput]) == 0)
+		{
+			if (m_theFailedInputs[*theOutput] != 0)
+			{
+				complete (*theOutput, false);
+			}
+			else
+			{
+				dispatch (*theOutput);
+			} // if
+		} // if
+	} // for
+	if (InterlockedDecrement (&m_theRemaining) == 0)
+	{
+		SetEvent (m_theDone);
+	} // if
+} // complete
+
+/**
+ * Method onWorkDone is called on the worker thread when a node work package is done.
+ */
+void CThreadItTaskRun::onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess)
+{
+	if (theTag < m_theResults.size ())
+	{
+		if (ptheWorkDone != NULL)
+		{
+			m_theResults[theTag] = ptheWorkDone->m_ptheDataItem;
+			m_theStatus[theTag] = ptheWorkDone->m_theStatus;
+		} // if
+		complete (theTag, isSuccess);
+	} // if
+} // onWorkDone
+
+/**
+ * Method wait waits for every node of the run to complete.
+ * @param[in] theTimeOut is the time in milliseconds to wait.
+ * \return true if the run completed in the time given.
+ */
+bool CThreadItTaskRun::wait (DWORD theTimeOut)
+{
+	return (WaitForSingleObject (m_theDone, theTimeOut) == WAIT_OBJECT_0);
+} // wait
+
+/**
+ * Method isSuccess returns true if every node of the completed run succeeded.
+ */
+bool CThreadItTaskRun::isSuccess () const
+{
+	return ((m_theRemaining == 0) && (m_theFailures == 0));
+} // isSuccess
+
+/**
+ * Method getResult returns the result of a node.
+ * @param[in] theNode is the node identity returned by addNode.
+ * @param[out] ptheResult receives the data item returned by the node.
+ * @param[out] theStatus receives the status returned by the node.
+ * \return true if the node identity is valid.
+ */
+bool CThreadItTaskRun::getResult (ULONG theNode, DataItemPtr& ptheResult, ULONG& theStatus) const
+{
+	bool isSuccess = false;
+
+	if (theNode < m_theResults.size ())
+	{
+		ptheResult = m_theResults[theNode];
+		theStatus = m_theStatus[theNode];
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // getResult
+
+/**
+ * Method getInputs returns the results of the nodes that theNode depends on in
+ * the order the edges were added.
+ * @param[in] theNode is the node identity.
+ * @param[out] theInputs receives the data items.
+ * \return true if the node identity is valid.
+ */
+bool CThreadItTaskRun::getInputs (ULONG theNode, std::vector<DataItemPtr>& theInputs) const
+{
+	bool isSuccess = false;
+	std::vector<ULONG>::const_iterator theInput;
+
+	theInputs.clear ();
+	if (theNode < m_theResults.size ())
+	{
+		const std::vector<ULONG>& theNodeInputs = m_ptheGraph->m_theNodes[theNode].theInputs;
+		for (theInput = theNodeInputs.begin (); theInput != theNodeInputs.end (); theInput++)
+		{
+			theInputs.push_back (m_theResults[*theInput]);
+		} // for
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // getInputs
+
+/**
+ * Method getRun returns the run that sent the work package.
+ * @param[in] ptheWorkPack is the work package received by a worker method.
+ * \return the run or NULL if the work package was not sent by a run.
+ */
+CThreadItTaskRun* CThreadItTaskRun::getRun (CWorkPackIt* ptheWorkPack)
+{
+	CThreadItTaskRun* ptheRun = NULL;
+
+	if ((ptheWorkPack != NULL) && (ptheWorkPack->m_ptheCompletion != NULL) && (ptheWorkPack->m_ptheCompletion == ptheWorkPack->m_ptheObject))
+	{
+		ptheRun = (CThreadItTaskRun*)ptheWorkPack->m_ptheObject;
+	} // if
+	return ptheRun;
+} // getRun
+
+// Class: CThreadItTaskGraph Implementation
+
+/**
+ * Constructor CThreadItTaskGraph creates an empty graph.
+ */
+CThreadItTaskGraph::CThreadItTaskGraph ()
+{
+	m_ptheLogger = &(log4cpp::Category::getInstance ("threadit.CThreadItTaskGraph"));
+	m_isCompiled = false;
+	m_theRunCount = 0;
+	InitializeCriticalSection (&m_theRunAccess);
+} // constructor CThreadItTaskGraph
+
+/**
+ * Method ~CThreadItTaskGraph frees the pooled runs. All runs must have been
+ * released before the graph is destroyed.
+ */
+CThreadItTaskGraph::~CThreadItTaskGraph ()
+{
+	std::vector<CThreadItTaskRun*>::iterator theRun;
+
+	if (m_theFreeRuns.size () != m_theRunCount)
+	{
+		m_ptheLogger->error ("task graph destroyed while runs are still in use");
+	} // if
+	for (theRun = m_theFreeRuns.begin (); theRun != m_theFreeRuns.end (); theRun++)
+	{
+		delete *theRun;
+	} // for
+	m_theFreeRuns.clear ();
+	DeleteCriticalSection (&m_theRunAccess);
+} // ~CThreadItTaskGraph
+
+/**
+ * Method addNode adds a node to the graph.
+ * @param[in] ptheWorker is the instance that performs the work of the node.
+ * @param[in] theInstruction is the work instruction sent to the worker.
+ * @param[in] ptheDataItem is the data item sent with the work instruction.
+ * \return the identity of the node.
+ */
+ULONG CThreadItTaskGraph::addNode (CThreadIt* ptheWorker, ULONG theInstruction, const DataItemPtr& ptheDataItem)
+{
+	ULONG theNodeId = ULONG_MAX;
+	TaskNode theNode;
+
+	if (!m_isCompiled)
+	{
+		theNode.ptheWorker = ptheWorker;
+		theNode.theInstruction = theInstruction;
+		theNode.ptheDataItem = ptheDataItem;
+		m_theNodes.push_back (theNode);
+		theNodeId = (ULONG)(m_theNodes.size () - 1);
+	}
+	else
+	{
+		m_ptheLogger->error ("nodes cannot be added to a compiled task graph");
+	} // if
+	return theNodeId;
+} // addNode
+
+/**
+ * Method addEdge makes theTo depend on theFrom.
+ * \return true if the edge is added.
+ */
+bool CThreadItTaskGraph::addEdge (ULONG theFrom, ULONG theTo)
+{
+	bool isSuccess = false;
+
+	if ((!m_isCompiled) && (theFrom < m_theNodes.size ()) && (theTo < m_theNodes.size ()) && (theFrom != theTo))
+	{
+		m_theNodes[theFrom].theOutputs.push_back (theTo);
+		m_theNodes[theTo].theInputs.push_back (theFrom);
+		isSuccess = true;
+	} // if
+	return isSuccess;
+} // addEdge
+
+/**
+ * Method compile checks that the graph has no cycles and works out the nodes that
+ * can be sent first. The check removes nodes without outstanding inputs one at a
+ * time. If any node is left it is part of a cycle.
+ * \return true if the graph is compiled.
+ */
+bool CThreadItTaskGraph::compile ()
+{
+	bool isValid = true;
+	ULONG theNode = 0;
+	ULONG theVisited = 0;
+	std::vector<ULONG> theReady;
+	std::vector<ULONG> theInputCount (m_theNodes.size ());
+	std::vector<ULONG>::iterator theOutput;
+
+	if (!m_isCompiled)
+	{
+		m_theRoots.clear ();
+		for (theNode = 0; theNode < m_theNodes.size (); theNode++)
+		{
+			if (m_theNodes[theNode].ptheWorker == NULL)
+			{
+				m_ptheLogger->errorStream () << "task graph node " << theNode << " has no worker";
+				isValid = false;
+			} // if
+			theInputCount[theNode] = (ULONG)m_theNodes[theNode].theInputs.size ();
+			if (theInputCount[theNode] == 0)
+			{
+				m_theRoots.push_back (theNode);
+				theReady.push_back (theNode);
+			} // if
+		} // for
+		while (!theReady.empty ())
+		{
+			theNode = theReady.back ();
+			theReady.pop_back ();
+			theVisited++;
+			for (theOutput = m_theNodes[theNode].theOutputs.begin (); theOutput != m_theNodes[theNode].theOutputs.end (); theOutput++)
+			{
+				if (--theInputCount[*theOutput] == 0)
+				{
+					theReady.push_back (*theOutput);
+				} // if
+			} // for
+		} // while
+		if (theVisited == m_theNodes.size ())
+		{
+			m_isCompiled = isValid;
+		}
+		else
+		{
+			m_ptheLogger->error ("task graph contains a cycle");
+		} // if
+	} // if
+	return m_isCompiled;
+} // compile
+
+/**
+ * Method getNodeCount returns the number of nodes in the graph.
+ */
+ULONG CThreadItTaskGraph::getNodeCount () const
+{
+	return (ULONG)m_theNodes.size ();
+} // getNodeCount
+
+/**
+ * Method start takes a run from the pool and sends the nodes without inputs.
+ * \return the run or NULL if the graph is not compiled.
+ */
+CThreadItTaskRun* CThreadItTaskGraph::start ()
+{
+	CThreadItTaskRun* ptheRun = NULL;
+	std::vector<ULONG>::iterator theRoot;
+
+	if (m_isCompiled)
+	{
+		EnterCriticalSection (&m_theRunAccess);
+		if (!m_theFreeRuns.empty ())
+		{
+			ptheRun = m_theFreeRuns.back ();
+			m_theFreeRuns.pop_back ();
+		}
+		else
+		{
+			ptheRun = new CThreadItTaskRun (this);
+			m_theRunCount++;
+		} // if
+		LeaveCriticalSection (&m_theRunAccess);
+		ptheRun->reset ();
+		for (theRoot = m_theRoots.begin (); theRoot != m_theRoots.end (); theRoot++)
+		{
+			ptheRun->dispatch (*theRoot);
+		} // for
+	} // if
+	return ptheRun;
+} // start
+
+/**
+ * Method release returns a completed run to the pool.
+ * @param[in] ptheRun is the run to release. The run must have completed.
+ */
+void CThreadItTaskGraph::release (CThreadItTaskRun* ptheRun)
+{
+	if ((ptheRun != NULL) && (ptheRun->m_ptheGraph == this))
+	{
+		if (ptheRun->m_theRemaining != 0)
+		{
+			m_ptheLogger->error ("task run released before it completed");
+		} // if
+		EnterCriticalSection (&m_theRunAccess);
+		m_theFreeRuns.push_back (ptheRun);
+		LeaveCriticalSection (&m_theRunAccess);
+	} // if
+} // release
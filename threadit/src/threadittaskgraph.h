@@ -0,0 +1,254 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItTaskGraph
+ * Description: Class CThreadItTaskGraph executes a graph of work requests where
+ * each node is a work instruction sent to a CThreadIt instance and each edge is
+ * a dependency between two nodes. A node is sent to its worker as soon as all the
+ * nodes it depends on have completed.
+ *
+ * The graph is described once with addNode and addEdge and then compiled. The
+ * compiled graph holds the successor lists and the initial dependency count of
+ * every node and can be executed many times. Each execution is a CThreadItTaskRun
+ * taken from a pool held by the graph so that the per run allocation is limited
+ * to the work packages sent to the workers.
+ *
+ * There is no thread or lock that drives the graph. The run is the completion
+ * (see CThreadItCompletion) of every work package it sends. When a node completes
+ * the worker thread records the result, decrements the dependency counters of
+ * the successors with InterlockedDecrement and sends each successor whose counter
+ * reaches zero. The thread that completes the last node signals the run.
+ *
+ * A worker method of a node can find the results of the nodes it depends on with
+ * CThreadItTaskRun::getRun and getInputs. The m_ptheObject of a node work package
+ * refers to the run and must not be freed by the worker method. If a node fails
+ * the nodes that depend on it are not sent and are reported as not done.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_TASK_GRAPH_H)
+#define THREADIT_TASK_GRAPH_H
+
+// Includes
+#include <vector>
+#include "threadit.h"
+#include "threaditcompletion.h"
+
+// Forward Declarations
+class CThreadItTaskGraph;
+
+/**
+ * Class CThreadItTaskRun is a single execution of a compiled CThreadItTaskGraph.
+ */
+class CThreadItTaskRun : public CThreadItCompletion
+{
+	friend class CThreadItTaskGraph;
+
+	// Attributes
+private:
+	/** m_ptheGraph is the compiled graph that this run executes. */
+	CThreadItTaskGraph* m_ptheGraph;
+	/** m_theDependencies holds the number of outstanding inputs of each node. */
+	volatile LONG* m_theDependencies;
+	/** m_theFailedInputs is set for a node when one of its inputs failed. */
+	volatile LONG* m_theFailedInputs;
+	/** m_theResults holds the data item returned by each node. */
+	std::vector<DataItemPtr> m_theResults;
+	/** m_theStatus holds the status returned by each node. */
+	std::vector<ULONG> m_theStatus;
+	/** m_theRemaining is the number of nodes that have not yet completed. */
+	volatile LONG m_theRemaining;
+	/** m_theFailures is the number of nodes that failed or were not sent. */
+	volatile LONG m_theFailures;
+	/** m_theDone is the manual reset event signalled when every node has completed. */
+	HANDLE m_theDone;
+
+	// Methods
+private:
+	/**
+	 * Constructor CThreadItTaskRun allocates the counters for the nodes of the graph.
+	 */
+	CThreadItTaskRun (CThreadItTaskGraph* ptheGraph);
+
+	/**
+	 * Method ~CThreadItTaskRun frees the counters and closes the event.
+	 */
+	virtual ~CThreadItTaskRun ();
+
+	/**
+	 * Method reset prepares the run for a new execution.
+	 */
+	void reset ();
+
+	/**
+	 * Method dispatch sends a node to its worker.
+	 */
+	void dispatch (ULONG theNode);
+
+	/**
+	 * Method complete records that a node is done and releases its successors.
+	 */
+	void complete (ULONG theNode, bool isSuccess);
+
+public:
+	/**
+	 * Method onWorkDone is called on the worker thread when a node work package is done.
+	 */
+	virtual void onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess);
+
+	/**
+	 * Method wait waits for every node of the run to complete.
+	 * @param[in] theTimeOut is the time in milliseconds to wait.
+	 * \return true if the run completed in the time given.
+	 */
+	bool wait (DWORD theTimeOut);
+
+	/**
+	 * Method isSuccess returns true if every node of the completed run succeeded.
+	 */
+	bool isSuccess () const;
+
+	/**
+	 * Method getResult returns the result of a node. It must only be called once the
+	 * run has completed or for a node that is an input of the calling node.
+	 * @param[in] theNode is the node identity returned by addNode.
+	 * @param[out] ptheResult receives the data item returned by the node.
+	 * @param[out] theStatus receives the status returned by the node.
+	 * \return true if the node identity is valid.
+	 */
+	bool getResult (ULONG theNode, DataItemPtr& ptheResult, ULONG& theStatus) const;
+
+	/**
+	 * Method getInputs returns the results of the nodes that theNode depends on in
+	 * the order the edges were added.
+	 * @param[in] theNode is the node identity. In a worker method this is the
+	 * m_theCompletionTag of the work package.
+	 * @param[out] theInputs receives the data items.
+	 * \return true if the node identity is valid.
+	 */
+	bool getInputs (ULONG theNode, std::vector<DataItemPtr>& theInputs) const;
+
+	/**
+	 * Method getRun returns the run that sent the work package.
+	 * @param[in] ptheWorkPack is the work package received by a worker method.
+	 * \return the run or NULL if the work package was not sent by a run.
+	 */
+	static CThreadItTaskRun* getRun (CWorkPackIt* ptheWorkPack);
+
+}; // class CThreadItTaskRun
+
+/**
+ * Class CThreadItTaskGraph describes and compiles a graph of work requests.
+ */
+class CThreadItTaskGraph
+{
+	friend class CThreadItTaskRun;
+
+	// types
+private:
+	/** TaskNode describes a node of the graph. */
+	typedef struct TaskNodeTag
+	{
+		/** ptheWorker is the instance that performs the work. */
+		CThreadIt* ptheWorker;
+		/** theInstruction is the work instruction sent to the worker. */
+		ULONG theInstruction;
+		/** ptheDataItem is the data item sent with the work instruction. */
+		DataItemPtr ptheDataItem;
+		/** theInputs are the nodes this node depends on. */
+		std::vector<ULONG> theInputs;
+		/** theOutputs are the nodes that depend on this node. */
+		std::vector<ULONG> theOutputs;
+	} TaskNode;
+
+	// Attributes
+private:
+	/** m_theNodes are the nodes of the graph. */
+	std::vector<TaskNode> m_theNodes;
+	/** m_theRoots are the nodes without inputs. Set by compile. */
+	std::vector<ULONG> m_theRoots;
+	/** m_isCompiled is true once the graph has been compiled. */
+	bool m_isCompiled;
+	/** m_theFreeRuns are the runs available for reuse. */
+	std::vector<CThreadItTaskRun*> m_theFreeRuns;
+	/** m_theRunCount is the number of runs allocated. */
+	ULONG m_theRunCount;
+	/** m_theRunAccess protects the pool of runs. It is not taken while a run executes. */
+	CRITICAL_SECTION m_theRunAccess;
+	/** m_ptheLogger is the logger used to log information and errors. */
+	log4cpp::Category* m_ptheLogger;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItTaskGraph creates an empty graph.
+	 */
+	CThreadItTaskGraph ();
+
+	/**
+	 * Method ~CThreadItTaskGraph frees the pooled runs. All runs must have been
+	 * released before the graph is destroyed.
+	 */
+	virtual ~CThreadItTaskGraph ();
+
+	/**
+	 * Method addNode adds a node to the graph.
+	 * @param[in] ptheWorker is the instance that performs the work of the node.
+	 * @param[in] theInstruction is the work instruction sent to the worker.
+	 * @param[in] ptheDataItem is the data item sent with the work instruction.
+	 * \return the identity of the node or ULONG_MAX if the graph is already compiled.
+	 */
+	ULONG addNode (CThreadIt* ptheWorker, ULONG theInstruction, const DataItemPtr& ptheDataItem = DataItemPtr ());
+
+	/**
+	 * Method addEdge makes theTo depend on theFrom.
+	 * \return true if the edge is added.
+	 */
+	bool addEdge (ULONG theFrom, ULONG theTo);
+
+	/**
+	 * Method compile checks that the graph has no cycles and works out the nodes that
+	 * can be sent first. Nodes and edges cannot be added once the graph is compiled.
+	 * \return true if the graph is compiled.
+	 */
+	bool compile ();
+
+	/**
+	 * Method getNodeCount returns the number of nodes in the graph.
+	 */
+	ULONG getNodeCount () const;
+
+	/**
+	 * Method start takes a run from the pool and sends the nodes without inputs.
+	 * \return the run or NULL if the graph is not compiled.
+	 */
+	CThreadItTaskRun* start ();
+
+	/**
+	 * Method release returns a completed run to the pool.
+	 * @param[in] ptheRun is the run to release. The run must have completed.
+	 */
+	void release (CThreadItTaskRun* ptheRun);
+
+}; // class CThreadItTaskGraph
+
+#endif // !defined (THREADIT_TASK_GRAPH_H)
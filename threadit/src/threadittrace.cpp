@@ -0,0 +1,395 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItTrace
+ * Description: Class CThreadItTrace records the events of work packages in rings per
+ * thread and writes them in the Chrome trace event format.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include "Active.h"
+#include "threadittrace.h"
+
+namespace
+{
+	/** TRACE_NAMES are the names of the events in the trace. */
+	static char const * const TRACE_NAMES[CThreadItTrace::TRACE_TYPE_LAST] =
+	{
+		"enqueue", "dequeue", "handler", "handler", "reply", "receive", "notify", "tick", "wake"
+	};
+
+	/**
+	 * Method escapeJson returns a string with the characters JSON strings do not allow escaped.
+	 */
+	std::string escapeJson (const std::string& theText)
+	{
+		std::string theEscaped;
+		char theCode[8];
+
+		for (size_t theIndex = 0; theIndex < theText.size (); theIndex++)
+		{
+			if ((theText[theIndex] == '"') || (theText[theIndex] == '\\'))
+			{
+				theEscaped += '\\';
+				theEscaped += theText[theIndex];
+			}
+			else if ((unsigned char)theText[theIndex] < 0x20)
+			{
+				sprintf_s (theCode, sizeof (theCode), "\\u%04x", (unsigned int)(unsigned char)theText[theIndex]);
+				theEscaped += theCode;
+			}
+			else
+			{
+				theEscaped += theText[theIndex];
+			} // if
+		} // for
+		return theEscaped;
+	} // escapeJson
+}
+
+// Initialise the static attributes. The rings are defined before the call that sets up
+// the lock and the thread local slot.
+volatile bool CThreadItTrace::m_isTracing = false;
+volatile ULONG CThreadItTrace::m_theCapacity = THREADIT_TRACE_EVENTS;
+DWORD CThreadItTrace::m_theTlsIndex = TLS_OUT_OF_INDEXES;
+std::vector<CThreadItTrace::TraceRing*> CThreadItTrace::m_theRings;
+CRITICAL_SECTION CThreadItTrace::m_theRingAccess;
+int CThreadItTrace::m_theInit = CThreadItTrace::initialise ();
+
+/**
+ * Method initialise sets up the static attributes. It always returns zero.
+ */
+int CThreadItTrace::initialise ()
+{
+	InitializeCriticalSection (&m_theRingAccess);
+	m_theTlsIndex = TlsAlloc ();
+	return 0;
+} // initialise
+
+/**
+ * Method start turns tracing on for every thread of the process.
+ */
+void CThreadItTrace::start (ULONG theCapacity)
+{
+	if (theCapacity > 0)
+	{
+		m_theCapacity = theCapacity;
+	} // if
+	m_isTracing = (m_theTlsIndex != TLS_OUT_OF_INDEXES);
+} // start
+
+/**
+ * Method stop turns tracing off. The events recorded are kept.
+ */
+void CThreadItTrace::stop ()
+{
+	m_isTracing = false;
+} // stop
+
+/**
+ * Method isTracing returns true while events are recorded.
+ */
+bool CThreadItTrace::isTracing ()
+{
+	return m_isTracing;
+} // isTracing
+
+/**
+ * Method clear discards the events recorded and frees the rings of the threads that
+ * have ended. The thread local slot of an ended thread is gone so its ring is no
+ * longer reachable by anyone else.
+ */
+void CThreadItTrace::clear ()
+{
+	std::vector<TraceRing*> theLiveRings;
+	TraceRing* ptheRing = NULL;
+
+	EnterCriticalSection (&m_theRingAccess);
+	for (size_t theIndex = 0; theIndex < m_theRings.size (); theIndex++)
+	{
+		ptheRing = m_theRings[theIndex];
+		if ((ptheRing->htheThread != NULL) && (WaitForSingleObject (ptheRing->htheThread, 0) == WAIT_OBJECT_0))
+		{
+			CloseHandle (ptheRing->htheThread);
+			delete [] ptheRing->ptheEvents;
+			delete ptheRing;
+		}
+		else
+		{
+			InterlockedExchange (&ptheRing->theHead, 0);
+			theLiveRings.push_back (ptheRing);
+		} // if
+	} // for
+	m_theRings.swap (theLiveRings);
+	LeaveCriticalSection (&m_theRingAccess);
+} // clear
+
+/**
+ * Method getEventCount returns the number of events held in the rings.
+ */
+ULONG CThreadItTrace::getEventCount ()
+{
+	ULONG theCount = 0;
+	ULONG theHead = 0;
+
+	EnterCriticalSection (&m_theRingAccess);
+	for (size_t theIndex = 0; theIndex < m_theRings.size (); theIndex++)
+	{
+		theHead = (ULONG)m_theRings[theIndex]->theHead;
+		theCount += (theHead < m_theRings[theIndex]->theCapacity) ? theHead : m_theRings[theIndex]->theCapacity;
+	} // for
+	LeaveCriticalSection (&m_theRingAccess);
+	return theCount;
+} // getEventCount
+
+/**
+ * Method record writes an event to the ring of the calling thread. Only the calling
+ * thread writes to its ring so the event is filled in without a lock and then
+ * published by moving the head on.
+ */
+void CThreadItTrace::record (TraceType theType, CActive* ptheObject, ULONG theInstruction, ULONG theWorkPackID, const void* ptheSource)
+{
+	TraceRing* ptheRing = NULL;
+	TraceEvent* ptheEvent = NULL;
+	LARGE_INTEGER theNow;
+	ULONG theHead = 0;
+
+	ptheRing = (TraceRing*)TlsGetValue (m_theTlsIndex);
+	if (ptheRing == NULL)
+	{
+		ptheRing = createRing (ptheObject);
+	} // if
+	if (ptheRing != NULL)
+	{
+		QueryPerformanceCounter (&theNow);
+		theHead = (ULONG)ptheRing->theHead;
+		ptheEvent = &ptheRing->ptheEvents[theHead % ptheRing->theCapacity];
+		ptheEvent->theTime = theNow.QuadPart;
+		ptheEvent->ptheObject = ptheObject;
+		ptheEvent->ptheSource = ptheSource;
+		ptheEvent->theInstruction = theInstruction;
+		ptheEvent->theWorkPackID = theWorkPackID;
+		ptheEvent->theType = (ULONG)theType;
+		InterlockedExchange (&ptheRing->theHead, (LONG)(theHead + 1));
+	} // if
+} // record
+
+/**
+ * Method createRing creates the ring of the calling thread.
+ */
+CThreadItTrace::TraceRing* CThreadItTrace::createRing (CActive* ptheObject)
+{
+	TraceRing* ptheRing = new TraceRing ();
+
+	ptheRing->theThreadId = GetCurrentThreadId ();
+	ptheRing->htheThread = OpenThread (SYNCHRONIZE, FALSE, ptheRing->theThreadId);
+	ptheRing->theCapacity = m_theCapacity;
+	ptheRing->theHead = 0;
+	ptheRing->ptheEvents = new TraceEvent[ptheRing->theCapacity];
+	// Threads that are not the thread of an active object, such as the helper threads of
+	// a CThreadItPool and the main thread, are named by their ID when the trace is written.
+	if ((ptheObject != NULL) && (ptheObject->getThreadId () == ptheRing->theThreadId))
+	{
+		ptheRing->theName = ptheObject->getThreadName ();
+	} // if
+	TlsSetValue (m_theTlsIndex, ptheRing);
+	EnterCriticalSection (&m_theRingAccess);
+	m_theRings.push_back (ptheRing);
+	LeaveCriticalSection (&m_theRingAccess);
+	return ptheRing;
+} // createRing
+
+/**
+ * Method readRing copies the events of a ring that are not overwritten while it is
+ * read. The head is read again after the copy and the events the thread may have
+ * written over since are dropped.
+ */
+void CThreadItTrace::readRing (const TraceRing* ptheRing, std::vector<TraceEvent>& theEvents)
+{
+	ULONG theHead = (ULONG)ptheRing->theHead;
+	ULONG theFirst = (theHead > ptheRing->theCapacity) ? theHead - ptheRing->theCapacity : 0;
+	ULONG theValid = 0;
+
+	theEvents.clear ();
+	for (ULONG theIndex = theFirst; theIndex != theHead; theIndex++)
+	{
+		theEvents.push_back (ptheRing->ptheEvents[theIndex % ptheRing->theCapacity]);
+	} // for
+	MemoryBarrier ();
+	// The slot after the new head may be half written.
+	theHead = (ULONG)ptheRing->theHead + 1;
+	theValid = (theHead > ptheRing->theCapacity) ? theHead - ptheRing->theCapacity : 0;
+	if (theValid > theFirst)
+	{
+		theEvents.erase (theEvents.begin (), theEvents.begin () + ((theValid - theFirst < theEvents.size ()) ? theValid - theFirst : theEvents.size ()));
+	} // if
+} // readRing
+
+/**
+ * Method write writes the events held in the rings in the Chrome trace event format.
+ * The worker methods are slices and the other events are slices of no length so that
+ * the flow events have a slice to bind to. A flow starts at each enqueue and reply
+ * and ends at the dequeue and getWork that match it by instance and work package ID.
+ */
+void CThreadItTrace::write (std::ostream& theStream)
+{
+	std::vector<TraceRing> theRings;
+	std::vector<std::vector<TraceEvent> > theEvents;
+	std::ios::fmtflags theFlags = theStream.flags ();
+	std::streamsize thePrecision = theStream.precision ();
+	LARGE_INTEGER theFrequency;
+	LONGLONG theBase = 0;
+	DWORD theProcessId = GetCurrentProcessId ();
+	bool isFirst = true;
+	double theTime = 0.0;
+	const char* theFlow = NULL;
+	const char* theFlowSuffix = NULL;
+
+	QueryPerformanceFrequency (&theFrequency);
+	// Copy the events under the lock so that clear cannot free a ring being read.
+	EnterCriticalSection (&m_theRingAccess);
+	theEvents.resize (m_theRings.size ());
+	for (size_t theIndex = 0; theIndex < m_theRings.size (); theIndex++)
+	{
+		theRings.push_back (*m_theRings[theIndex]);
+		readRing (m_theRings[theIndex], theEvents[theIndex]);
+	} // for
+	LeaveCriticalSection (&m_theRingAccess);
+	for (size_t theIndex = 0; theIndex < theRings.size (); theIndex++)
+	{
+		if ((!theEvents[theIndex].empty ()) && ((theBase == 0) || (theEvents[theIndex].front ().theTime < theBase)))
+		{
+			theBase = theEvents[theIndex].front ().theTime;
+		} // if
+	} // for
+	theStream << std::fixed << std::setprecision (3);
+	theStream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	for (size_t theIndex = 0; theIndex < theRings.size (); theIndex++)
+	{
+		if (!isFirst)
+		{
+			theStream << ",";
+		} // if
+		isFirst = false;
+		theStream << "\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << theProcessId << ",\"tid\":" << theRings[theIndex].theThreadId
+			<< ",\"args\":{\"name\":\"";
+		if (theRings[theIndex].theName.empty ())
+		{
+			theStream << "thread " << theRings[theIndex].theThreadId;
+		}
+		else
+		{
+			theStream << escapeJson (theRings[theIndex].theName);
+		} // if
+		theStream << "\"}}";
+		for (size_t theEvent = 0; theEvent < theEvents[theIndex].size (); theEvent++)
+		{
+			const TraceEvent& theTrace = theEvents[theIndex][theEvent];
+
+			theTime = ((double)(theTrace.theTime - theBase) * 1000000.0) / (double)theFrequency.QuadPart;
+			theStream << ",\n{\"cat\":\"threadit\",\"pid\":" << theProcessId << ",\"tid\":" << theRings[theIndex].theThreadId << ",\"ts\":" << theTime;
+			switch (theTrace.theType)
+			{
+			case TRACE_HANDLER_BEGIN:
+				theStream << ",\"ph\":\"B\",\"name\":\"instruction " << theTrace.theInstruction << "\"";
+				break;
+			case TRACE_HANDLER_END:
+				theStream << ",\"ph\":\"E\",\"name\":\"instruction " << theTrace.theInstruction << "\"";
+				break;
+			default:
+				theStream << ",\"ph\":\"X\",\"dur\":0,\"name\":\"" << ((theTrace.theType < TRACE_TYPE_LAST) ? TRACE_NAMES[theTrace.theType] : "unknown") << "\"";
+				break;
+			} // switch
+			theStream << ",\"args\":{\"instruction\":" << theTrace.theInstruction << ",\"workPackId\":" << theTrace.theWorkPackID
+				<< ",\"object\":\"0x" << std::hex << (ULONG_PTR)theTrace.ptheObject << "\"";
+			if (theTrace.ptheSource != NULL)
+			{
+				theStream << ",\"source\":\"0x" << (ULONG_PTR)theTrace.ptheSource << "\"";
+			} // if
+			theStream << std::dec << "}}";
+			// Join the two ends of a hand over between threads.
+			theFlow = NULL;
+			theFlowSuffix = "";
+			switch (theTrace.theType)
+			{
+			case TRACE_ENQUEUE:
+				theFlow = "s";
+				break;
+			case TRACE_DEQUEUE:
+				theFlow = "f";
+				break;
+			case TRACE_REPLY_SEND:
+				theFlow = "s";
+				theFlowSuffix = ".reply";
+				break;
+			case TRACE_REPLY_RECEIVE:
+				theFlow = "f";
+				theFlowSuffix = ".reply";
+				break;
+			default:
+				break;
+			} // switch
+			if (theFlow != NULL)
+			{
+				theStream << ",\n{\"cat\":\"threadit\",\"name\":\"" << ((*theFlowSuffix == '\0') ? "work" : "reply") << "\",\"ph\":\"" << theFlow
+					<< "\"" << ((*theFlow == 'f') ? ",\"bp\":\"e\"" : "") << ",\"pid\":" << theProcessId << ",\"tid\":" << theRings[theIndex].theThreadId << ",\"ts\":" << theTime
+					<< ",\"id\":\"0x" << std::hex << (ULONG_PTR)theTrace.ptheObject << std::dec << "." << theTrace.theWorkPackID << theFlowSuffix << "\"}";
+			} // if
+		} // for
+	} // for
+	theStream << "\n]}\n";
+	theStream.flags (theFlags);
+	theStream.precision (thePrecision);
+} // write
+
+/**
+ * Method toJson returns the events held in the rings in the Chrome trace event format.
+ */
+std::string CThreadItTrace::toJson ()
+{
+	std::ostringstream theStream;
+
+	write (theStream);
+	return theStream.str ();
+} // toJson
+
+/**
+ * Method save writes the events held in the rings to a file in the Chrome trace event format.
+ */
+bool CThreadItTrace::save (const std::string& theFileName)
+{
+	bool isSuccess = false;
+	std::ofstream theFile (theFileName.c_str (), std::ios::out | std::ios::trunc);
+
+	if (theFile.is_open ())
+	{
+		write (theFile);
+		theFile.close ();
+		isSuccess = !theFile.fail ();
+	} // if
+	return isSuccess;
+} // save
@@ -0,0 +1,245 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItTrace
+ * Description: Class CThreadItTrace records the life of work packages as they pass
+ * between CThreadIt instances so that a stall can be traced to the instance that
+ * holds up the others. Tracing is off by default and is turned on for the whole
+ * process with start. Each thread that records an event is given a ring of events
+ * of its own, so recording takes no lock, and the oldest events of a ring are
+ * overwritten once it is full. While tracing is off each trace point costs one test
+ * of a flag.
+ *
+ * The events recorded are the enqueue of a work package by startWork, its dequeue,
+ * the begin and end of the worker method, the reply sent to the done queue and
+ * collected by getWork, the notification of the observers, the run of the periodic
+ * method and the wake for an event method. Each event carries the instruction, the
+ * work package ID and the instance that sent it.
+ *
+ * The trace is written in the Chrome trace event format that chrome://tracing and
+ * the Perfetto UI load. Each thread is a track and flow arrows join the enqueue of a
+ * work package to its dequeue and the reply to the getWork that collected it. For
+ * example
+ *   CThreadItTrace::start ();
+ *   ... run the load ...
+ *   CThreadItTrace::stop ();
+ *   CThreadItTrace::save ("threadit.json");
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_TRACE_H)
+#define THREADIT_TRACE_H
+
+// Includes
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <ostream>
+
+/** THREADIT_TRACE_EVENTS is the default number of events kept for each thread. */
+#define THREADIT_TRACE_EVENTS 16384
+
+// Forward Declarations
+class CActive;
+
+/**
+ * Class CThreadItTrace records the events of work packages in rings per thread.
+ */
+class CThreadItTrace
+{
+	// types
+public:
+	/** TraceType is the point in the life of a work package that an event records. */
+	enum TraceType
+	{
+		/** The work package was placed in the work queue. */
+		TRACE_ENQUEUE = 0,
+		/** The work package was taken from the work queue to be processed. */
+		TRACE_DEQUEUE,
+		/** The worker method was called. */
+		TRACE_HANDLER_BEGIN,
+		/** The worker method returned. */
+		TRACE_HANDLER_END,
+		/** The result was placed in a done queue. */
+		TRACE_REPLY_SEND,
+		/** The result was collected by getWork. */
+		TRACE_REPLY_RECEIVE,
+		/** The observers were notified. */
+		TRACE_OBSERVER_NOTIFY,
+		/** The periodic method was run. */
+		TRACE_PERIODIC_TICK,
+		/** The thread woke for an event method. The instruction is the event ID. */
+		TRACE_EVENT_WAKE,
+		TRACE_TYPE_LAST
+	}; // enum TraceType
+
+	/** TraceEvent is an event recorded in the ring of a thread. */
+	typedef struct TraceEventTag
+	{
+		/** theTime is the performance counter value of the event. */
+		LONGLONG theTime;
+		/** ptheObject is the instance the event happened to. */
+		const void* ptheObject;
+		/** ptheSource is the instance that sent the work package or NULL. It is only
+		 * an identity and is never used to reach the instance. */
+		const void* ptheSource;
+		/** theInstruction is the instruction of the work package. */
+		ULONG theInstruction;
+		/** theWorkPackID is the ID given to the work package by startWork. */
+		ULONG theWorkPackID;
+		/** theType is the TraceType of the event. */
+		ULONG theType;
+	} TraceEvent;
+
+	/** TraceRing is the ring of events of a thread. */
+	typedef struct TraceRingTag
+	{
+		/** theThreadId is the thread that writes the ring. */
+		DWORD theThreadId;
+		/** htheThread is used to find out whether the thread has ended. */
+		HANDLE htheThread;
+		/** theName is the name of the active object the thread belongs to. */
+		std::string theName;
+		/** theCapacity is the number of events in the ring. */
+		ULONG theCapacity;
+		/** theHead is the number of events written. It is only changed by the thread. */
+		volatile LONG theHead;
+		/** ptheEvents are the events. */
+		TraceEvent* ptheEvents;
+	} TraceRing;
+
+	// Attributes
+private:
+	/** m_isTracing is true while events are recorded. */
+	static volatile bool m_isTracing;
+	/** m_theCapacity is the number of events in the rings created from now on. */
+	static volatile ULONG m_theCapacity;
+	/** m_theTlsIndex is the thread local slot that holds the ring of each thread. */
+	static DWORD m_theTlsIndex;
+	/** m_theRings are the rings of all the threads that have recorded events. */
+	static std::vector<TraceRing*> m_theRings;
+	/** m_theRingAccess protects m_theRings. */
+	static CRITICAL_SECTION m_theRingAccess;
+	/** m_theInit is only used to set up the static attributes. */
+	static int m_theInit;
+
+	// Methods
+public:
+	/**
+	 * Method trace records an event if tracing is on. It is the trace point placed in
+	 * the code and is inlined so that it costs one test of a flag while tracing is off.
+	 * @param[in] theType is the point in the life of the work package.
+	 * @param[in] ptheObject is the instance the event happened to.
+	 * @param[in] theInstruction is the instruction of the work package.
+	 * @param[in] theWorkPackID is the ID of the work package.
+	 * @param[in] ptheSource is the instance that sent the work package or NULL.
+	 */
+	static void trace (TraceType theType, CActive* ptheObject, ULONG theInstruction, ULONG theWorkPackID, const void* ptheSource)
+	{
+		if (m_isTracing)
+		{
+			record (theType, ptheObject, theInstruction, theWorkPackID, ptheSource);
+		} // if
+	} // trace
+
+	/**
+	 * Method start turns tracing on for every thread of the process.
+	 * @param[in] theCapacity is the number of events kept for each thread that records
+	 * its first event from now on. The rings of other threads keep their size.
+	 */
+	static void start (ULONG theCapacity = THREADIT_TRACE_EVENTS);
+
+	/**
+	 * Method stop turns tracing off. The events recorded are kept.
+	 */
+	static void stop ();
+
+	/**
+	 * Method isTracing returns true while events are recorded.
+	 */
+	static bool isTracing ();
+
+	/**
+	 * Method clear discards the events recorded and frees the rings of the threads
+	 * that have ended. It should be called while tracing is off.
+	 */
+	static void clear ();
+
+	/**
+	 * Method getEventCount returns the number of events held in the rings.
+	 */
+	static ULONG getEventCount ();
+
+	/**
+	 * Method write writes the events held in the rings in the Chrome trace event format.
+	 * Events overwritten while the rings are read are left out.
+	 * @param[in] theStream is the stream written to.
+	 */
+	static void write (std::ostream& theStream);
+
+	/**
+	 * Method toJson returns the events held in the rings in the Chrome trace event format.
+	 */
+	static std::string toJson ();
+
+	/**
+	 * Method save writes the events held in the rings to a file in the Chrome trace
+	 * event format.
+	 * @param[in] theFileName is the name of the file.
+	 * \return true if the file was written.
+	 */
+	static bool save (const std::string& theFileName);
+
+private:
+	/**
+	 * Method record writes an event to the ring of the calling thread.
+	 */
+	static void record (TraceType theType, CActive* ptheObject, ULONG theInstruction, ULONG theWorkPackID, const void* ptheSource);
+
+	/**
+	 * Method createRing creates the ring of the calling thread.
+	 * @param[in] ptheObject is the instance the first event happened to. Its name is
+	 * given to the ring if the calling thread is its thread of execution.
+	 * \return the ring or NULL if it could not be created.
+	 */
+	static TraceRing* createRing (CActive* ptheObject);
+
+	/**
+	 * Method readRing copies the events of a ring that are not overwritten while it is read.
+	 * @param[in] ptheRing is the ring.
+	 * @param[out] theEvents receives the events from the oldest.
+	 */
+	static void readRing (const TraceRing* ptheRing, std::vector<TraceEvent>& theEvents);
+
+	/**
+	 * Method initialise sets up the static attributes. It always returns zero.
+	 */
+	static int initialise ();
+
+	/// not copiable
+	CThreadItTrace ();
+	CThreadItTrace (const CThreadItTrace&);
+	const CThreadItTrace& operator= (const CThreadItTrace&);
+
+}; // class CThreadItTrace
+
+#endif // !defined (THREADIT_TRACE_H)
@@ -0,0 +1,415 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItWatchdog
+ * Description: Class CThreadItWatchdog scans the CThreadIt instances for worker methods
+ * that overrun and queues that stall. See the header file for the checks.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include <sstream>
+#include <dbghelp.h>
+#include "threaditwatchdog.h"
+
+#pragma comment (lib, "dbghelp.lib")
+
+// Class: CThreadItWatchdog Implementation
+
+// Initialise the static attributes.
+CRITICAL_SECTION CThreadItWatchdog::m_theSymbolAccess;
+bool CThreadItWatchdog::m_isSymbols = false;
+int CThreadItWatchdog::m_theInit = CThreadItWatchdog::initialise ();
+
+/**
+ * Method initialise sets up the static attributes. It always returns zero.
+ */
+int CThreadItWatchdog::initialise ()
+{
+	InitializeCriticalSection (&m_theSymbolAccess);
+	return 0;
+} // initialise
+
+/**
+ * Constructor CThreadItWatchdog starts the periodic scan.
+ */
+CThreadItWatchdog::CThreadItWatchdog (DWORD thePeriod, DWORD theStallTime, DWORD theQueueStallTime) : CThreadIt ("threadit.CThreadItWatchdog")
+{
+	InitializeCriticalSection (&m_theStallAccess);
+	m_theStallTime = theStallTime;
+	m_theQueueStallTime = theQueueStallTime;
+	m_isCaptureStack = false;
+	m_theStallCount = 0;
+	setPeriodicMethod ((PeriodicMethodType)&CThreadItWatchdog::onPeriod);
+	setPeriod (thePeriod);
+} // constructor CThreadItWatchdog
+
+/**
+ * Method ~CThreadItWatchdog stops the thread.
+ */
+CThreadItWatchdog::~CThreadItWatchdog ()
+{
+	stopThread ();
+	waitForThreadToStop ();
+	m_theStallSubject.removeObservers ();
+	DeleteCriticalSection (&m_theStallAccess);
+} // ~CThreadItWatchdog
+
+/**
+ * Method addStallObserver attaches an observer that is sent each stall.
+ */
+void CThreadItWatchdog::addStallObserver (CObserver* ptheObserver)
+{
+	m_theStallSubject.attach (ptheObserver);
+} // addStallObserver
+
+/**
+ * Method removeStallObserver detaches an observer.
+ */
+void CThreadItWatchdog::removeStallObserver (CObserver* ptheObserver)
+{
+	m_theStallSubject.detach (ptheObserver);
+} // removeStallObserver
+
+/**
+ * Method setCaptureStack turns the capture of the stack of a stalled thread on or off.
+ */
+void CThreadItWatchdog::setCaptureStack (bool isCaptureStack)
+{
+	m_isCaptureStack = isCaptureStack;
+} // setCaptureStack
+
+/**
+ * Method isCaptureStack returns true if the stack of a stalled thread is captured.
+ */
+bool CThreadItWatchdog::isCaptureStack () const
+{
+	return m_isCaptureStack;
+} // isCaptureStack
+
+/**
+ * Method getStallCount returns the number of stalls reported.
+ */
+LONG CThreadItWatchdog::getStallCount () const
+{
+	return m_theStallCount;
+} // getStallCount
+
+/**
+ * Method getLastStall returns the latest stall reported.
+ */
+bool CThreadItWatchdog::getLastStall (ThreadItStall& theStall) const
+{
+	bool isSuccess = false;
+
+	EnterCriticalSection (&m_theStallAccess);
+	if (m_theStallCount > 0)
+	{
+		theStall = m_theLastStall;
+		isSuccess = true;
+	} // if
+	LeaveCriticalSection (&m_theStallAccess);
+	return isSuccess;
+} // getLastStall
+
+/**
+ * Method scan checks the CThreadIt instances now. The stalls are found under the lock
+ * of the watches and reported once it has been released, as the capture of a stack
+ * and the observers can take some time.
+ */
+void CThreadItWatchdog::scan ()
+{
+	std::vector<ActiveInfo> theSnapshot;
+	std::vector<ActiveInfo>::const_iterator theInfo;
+	std::vector<ThreadItStall> theStalls;
+	std::vector<ThreadItStall>::iterator theStall;
+	std::map<ULONGLONG, Watch>::iterator theWatch;
+	ThreadItStall theNewStall;
+	Watch theNewWatch;
+	ULONGLONG theKey = 0;
+	DWORD theLimit = 0;
+	DWORD theNow = 0;
+	bool isOverrun = false;
+	bool isQueueStall = false;
+
+	CActive::getRegistrySnapshot (theSnapshot);
+	theNow = GetTickCount ();
+	EnterCriticalSection (&m_theStallAccess);
+	for (theWatch = m_theWatches.begin (); theWatch != m_theWatches.end (); theWatch++)
+	{
+		theWatch->second.isSeen = false;
+	} // for
+	for (theInfo = theSnapshot.begin (); theInfo != theSnapshot.end (); theInfo++)
+	{
+		if (theInfo->isThreadIt && theInfo->isRunning)
+		{
+			theKey = ((ULONGLONG)theInfo->theThreadId << 32) | theInfo->theInstance;
+			theWatch = m_theWatches.find (theKey);
+			if (theWatch == m_theWatches.end ())
+			{
+				theNewWatch.theProcessedCount = theInfo->theProcessedCount;
+				theNewWatch.theProgressTime = theNow;
+				theNewWatch.isOverrunReported = false;
+				theNewWatch.isQueueReported = false;
+				theWatch = m_theWatches.insert (std::make_pair (theKey, theNewWatch)).first;
+			} // if
+			Watch& theState = theWatch->second;
+			theState.isSeen = true;
+			// A work package completed, or there is no work waiting, is progress.
+			if ((theInfo->theProcessedCount != theState.theProcessedCount) || (theInfo->theWorkQDepth <= 0))
+			{
+				if (theInfo->theProcessedCount != theState.theProcessedCount)
+				{
+					theState.isOverrunReported = false;
+				} // if
+				theState.theProcessedCount = theInfo->theProcessedCount;
+				theState.theProgressTime = theNow;
+				theState.isQueueReported = false;
+			} // if
+			if (theInfo->theCurrentInstruction < 0)
+			{
+				theState.isOverrunReported = false;
+			} // if
+			theLimit = (theInfo->theCurrentTimeAllowed != 0) ? theInfo->theCurrentTimeAllowed : m_theStallTime;
+			isOverrun = ((theInfo->theCurrentInstruction >= 0) && (theLimit != 0) && (theInfo->theCurrentTime > theLimit) &&
+				!theState.isOverrunReported);
+			isQueueStall = ((m_theQueueStallTime != 0) && (theInfo->theWorkQDepth > 0) && ((theNow - theState.theProgressTime) > m_theQueueStallTime) &&
+				!theState.isQueueReported);
+			if (isOverrun || isQueueStall)
+			{
+				theNewStall.theType = isOverrun ? STALL_OVERRUN : STALL_QUEUE;
+				theNewStall.theName = theInfo->theName;
+				// An overrun may be on a helper thread of a CThreadItPool.
+				theNewStall.theThreadId = (isOverrun && (theInfo->theCurrentThreadId != 0)) ? theInfo->theCurrentThreadId : theInfo->theThreadId;
+				theNewStall.theInstance = theInfo->theInstance;
+				theNewStall.theInstruction = theInfo->theCurrentInstruction;
+				theNewStall.theRunningTime = (theInfo->theCurrentInstruction >= 0) ? theInfo->theCurrentTime : 0;
+				theNewStall.theTimeAllowed = isOverrun ? theLimit : m_theQueueStallTime;
+				theNewStall.theWorkQDepth = theInfo->theWorkQDepth;
+				theNewStall.theProcessedCount = theInfo->theProcessedCount;
+				theStalls.push_back (theNewStall);
+				// An overrun usually holds up the queue as well and is reported as one stall.
+				theState.isOverrunReported = theState.isOverrunReported || isOverrun;
+				theState.isQueueReported = true;
+			} // if
+		} // if
+	} // for
+	// Forget the instances that have gone.
+	theWatch = m_theWatches.begin ();
+	while (theWatch != m_theWatches.end ())
+	{
+		if (theWatch->second.isSeen)
+		{
+			theWatch++;
+		}
+		else
+		{
+			m_theWatches.erase (theWatch++);
+		} // if
+	} // while
+	LeaveCriticalSection (&m_theStallAccess);
+	for (theStall = theStalls.begin (); theStall != theStalls.end (); theStall++)
+	{
+		report (*theStall);
+	} // for
+} // scan
+
+/**
+ * Method report captures the stack if asked and notifies the observers of a stall.
+ */
+void CThreadItWatchdog::report (ThreadItStall& theStall)
+{
+	if (m_isCaptureStack && captureStack (theStall.theThreadId, theStall.theStack))
+	{
+		theStall.theStackText = getStackText (theStall.theStack);
+	} // if
+	EnterCriticalSection (&m_theStallAccess);
+	m_theLastStall = theStall;
+	InterlockedIncrement (&m_theStallCount);
+	LeaveCriticalSection (&m_theStallAccess);
+	CObserver::VoidRef theSubject (theStall);
+	m_theStallSubject.notifyOnChange (theSubject);
+} // report
+
+/**
+ * Method onPeriod is the periodic method. It scans the instances.
+ */
+bool CThreadItWatchdog::onPeriod (CWorkPackIt theTimedWork, CWorkPackIt*& ptheWorkDone)
+{
+	ptheWorkDone = NULL;
+	scan ();
+	// There is no result to send.
+	return false;
+} // onPeriod
+
+/**
+ * Method initialiseSymbols initialises the symbol handler once. The symbols of a module
+ * are only loaded when an address in it is first looked up, which is after the
+ * stalled thread has been resumed.
+ */
+void CThreadItWatchdog::initialiseSymbols ()
+{
+	if (!m_isSymbols)
+	{
+		SymSetOptions (SymGetOptions () | SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES);
+		m_isSymbols = (SymInitialize (GetCurrentProcess (), NULL, TRUE) != FALSE);
+	} // if
+} // initialiseSymbols
+
+/**
+ * Method captureStack takes the return addresses of another thread of the process.
+ * The addresses are copied to an array on the stack while the thread is suspended
+ * and only the unwind data mapped with the modules is read, so nothing is allocated
+ * and no lock of the debug help library is taken while it is suspended.
+ */
+bool CThreadItWatchdog::captureStack (DWORD theThreadId, std::vector<ULONGLONG>& theStack)
+{
+	bool isSuccess = false;
+#if defined (_M_X64) || defined (_M_IX86)
+	HANDLE htheThread = NULL;
+	CONTEXT theContext;
+	DWORD64 theAddresses[THREADIT_WATCHDOG_STACK_DEPTH];
+	ULONG theDepth = 0;
+	SIZE_T theRead = 0;
+#if defined (_M_X64)
+	PRUNTIME_FUNCTION ptheFunction = NULL;
+	DWORD64 theImageBase = 0;
+	DWORD64 theEstablisherFrame = 0;
+	DWORD64 theReturn = 0;
+	PVOID ptheHandlerData = NULL;
+#else
+	DWORD theFrame[2];
+	DWORD theFramePointer = 0;
+#endif
+
+	theStack.clear ();
+	// A thread cannot walk its own stack while it is suspended.
+	if (theThreadId != GetCurrentThreadId ())
+	{
+		htheThread = OpenThread (THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, theThreadId);
+	} // if
+	if (htheThread != NULL)
+	{
+		if (SuspendThread (htheThread) != (DWORD)-1)
+		{
+			ZeroMemory (&theContext, sizeof (theContext));
+			theContext.ContextFlags = CONTEXT_FULL;
+			if (GetThreadContext (htheThread, &theContext))
+			{
+#if defined (_M_X64)
+				while ((theDepth < THREADIT_WATCHDOG_STACK_DEPTH) && (theContext.Rip != 0))
+				{
+					theAddresses[theDepth] = theContext.Rip;
+					theDepth++;
+					ptheFunction = RtlLookupFunctionEntry (theContext.Rip, &theImageBase, NULL);
+					if (ptheFunction != NULL)
+					{
+						RtlVirtualUnwind (UNW_FLAG_NHANDLER, theImageBase, theContext.Rip, ptheFunction, &theContext,
+							&ptheHandlerData, &theEstablisherFrame, NULL);
+					}
+					else if (ReadProcessMemory (GetCurrentProcess (), (LPCVOID)theContext.Rsp, &theReturn, sizeof (theReturn), &theRead))
+					{
+						// A leaf function has no unwind data and its return address is on the top of the stack.
+						theContext.Rip = theReturn;
+						theContext.Rsp += sizeof (theReturn);
+					}
+					else
+					{
+						theContext.Rip = 0;
+					} // if
+				} // while
+#else
+				// Each frame holds the frame pointer of its caller followed by the return address.
+				// The frames are read with ReadProcessMemory as one may be missing or corrupt.
+				theAddresses[theDepth] = theContext.Eip;
+				theDepth++;
+				theFramePointer = theContext.Ebp;
+				while ((theDepth < THREADIT_WATCHDOG_STACK_DEPTH) && (theFramePointer != 0) && ((theFramePointer & 3) == 0) &&
+					ReadProcessMemory (GetCurrentProcess (), (LPCVOID)(ULONG_PTR)theFramePointer, theFrame, sizeof (theFrame), &theRead) &&
+					(theFrame[1] != 0))
+				{
+					theAddresses[theDepth] = theFrame[1];
+					theDepth++;
+					// The stack grows down so the frame of the caller is at a higher address.
+					theFramePointer = (theFrame[0] > theFramePointer) ? theFrame[0] : 0;
+				} // while
+#endif
+			} // if
+			ResumeThread (htheThread);
+		} // if
+		CloseHandle (htheThread);
+		theStack.assign (theAddresses, theAddresses + theDepth);
+		isSuccess = (theDepth > 0);
+	} // if
+#else
+	theStack.clear ();
+#endif
+	return isSuccess;
+} // captureStack
+
+/**
+ * Method getStackText returns a stack with the module, symbol and line of each return
+ * address that can be found, such as
+ *   #0 0x00007ff6a1c21234 threadittest!CWorker::onWork+0x24 testworker.cpp:57
+ */
+std::string CThreadItWatchdog::getStackText (const std::vector<ULONGLONG>& theStack)
+{
+	std::ostringstream theText;
+	ULONG64 theBuffer[(sizeof (SYMBOL_INFO) + MAX_SYM_NAME + sizeof (ULONG64) - 1) / sizeof (ULONG64)];
+	SYMBOL_INFO* ptheSymbol = (SYMBOL_INFO*)theBuffer;
+	IMAGEHLP_MODULE64 theModule;
+	IMAGEHLP_LINE64 theLine;
+	DWORD64 theDisplacement = 0;
+	DWORD theLineDisplacement = 0;
+	HANDLE theProcess = GetCurrentProcess ();
+	size_t theFrame = 0;
+
+	EnterCriticalSection (&m_theSymbolAccess);
+	initialiseSymbols ();
+	for (theFrame = 0; theFrame < theStack.size (); theFrame++)
+	{
+		theText << "#" << theFrame << " 0x" << std::hex << theStack[theFrame] << std::dec << " ";
+		ZeroMemory (&theModule, sizeof (theModule));
+		theModule.SizeOfStruct = sizeof (theModule);
+		if (m_isSymbols && SymGetModuleInfo64 (theProcess, theStack[theFrame], &theModule))
+		{
+			theText << theModule.ModuleName;
+		} // if
+		ZeroMemory (theBuffer, sizeof (theBuffer));
+		ptheSymbol->SizeOfStruct = sizeof (SYMBOL_INFO);
+		ptheSymbol->MaxNameLen = MAX_SYM_NAME;
+		if (m_isSymbols && SymFromAddr (theProcess, theStack[theFrame], &theDisplacement, ptheSymbol))
+		{
+			theText << "!" << ptheSymbol->Name << "+0x" << std::hex << theDisplacement << std::dec;
+		} // if
+		ZeroMemory (&theLine, sizeof (theLine));
+		theLine.SizeOfStruct = sizeof (theLine);
+		if (m_isSymbols && SymGetLineFromAddr64 (theProcess, theStack[theFrame], &theLineDisplacement, &theLine))
+		{
+			theText << " " << theLine.FileName << ":" << theLine.LineNumber;
+		} // if
+		theText << "\n";
+	} // for
+	LeaveCriticalSection (&m_theSymbolAccess);
+	return theText.str ();
+} // getStackText
@@ -0,0 +1,260 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItWatchdog
+ * Description: Class CThreadItWatchdog is a CThreadIt that scans the CThreadIt instances
+ * of the process each period for two kinds of stall. A worker method has overrun when
+ * it has run for longer than the time given to it, which is the smaller of the time
+ * allowed of its work package and the time slice of the instance, or for longer than
+ * the stall time of the watchdog if it was given no limit. A queue has stalled when work has been waiting
+ * in it for longer than the queue stall time while no work package was completed.
+ *
+ * The scan reads the registry snapshot of the active objects (see
+ * CActive::getRegistrySnapshot), which is made of counters that each thread writes
+ * without a lock, so the threads being watched are never held up by it. Each stall is
+ * reported once. Observers attached with addStallObserver are sent a ThreadItStall
+ * through CObserver::onChange on the watchdog thread, for example
+ *   ThreadItStall& theStall = theSubject.cast<ThreadItStall> ();
+ *
+ * When stack capture is turned on the stack of the stalled thread is taken and
+ * symbols are added where the debug information can be found. The thread is
+ * suspended only while its return addresses are copied to the stack of the watchdog.
+ * Nothing is allocated and the debug help library is not called until it resumes,
+ * as the suspended thread may hold the heap or loader lock they need. On x64 the
+ * stack is unwound with RtlVirtualUnwind from the unwind data the modules already
+ * have mapped. On x86 the frame pointers are followed, so frames of code built
+ * without them are missed. The unwind data of code registered at run time is looked
+ * up under a lock that the stalled thread could hold, so stack capture is off by
+ * default.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_WATCHDOG_H)
+#define THREADIT_WATCHDOG_H
+
+// Includes
+#include <map>
+#include <string>
+#include <vector>
+#include "threadit.h"
+#include "Subject.h"
+
+/** THREADIT_WATCHDOG_PERIOD is the default time in milliseconds between scans. */
+#define THREADIT_WATCHDOG_PERIOD 100
+/** THREADIT_WATCHDOG_STALL_TIME is the default time in milliseconds a worker method
+ * without a time limit may run, and that work may wait without progress, before a
+ * stall is reported. */
+#define THREADIT_WATCHDOG_STALL_TIME 5000
+/** THREADIT_WATCHDOG_STACK_DEPTH is the most frames of a stack captured. */
+#define THREADIT_WATCHDOG_STACK_DEPTH 32
+
+/** ThreadItStall describes a stall found by the watchdog. */
+typedef struct ThreadItStallTag
+{
+	/** theType is the kind of stall (see CThreadItWatchdog::StallType). */
+	ULONG theType;
+	/** theName is the textual identity of the thread. */
+	std::string theName;
+	/** theThreadId is the identity of the thread. For an overrun it is the thread
+	 * running the worker method. */
+	UINT theThreadId;
+	/** theInstance is the instance count of the thread. */
+	UINT theInstance;
+	/** theInstruction is the instruction of the worker method running or -1. */
+	LONG theInstruction;
+	/** theRunningTime is the time in milliseconds the worker method has been running. */
+	DWORD theRunningTime;
+	/** theTimeAllowed is the limit in milliseconds that was passed. */
+	DWORD theTimeAllowed;
+	/** theWorkQDepth is the number of work packages waiting. */
+	LONG theWorkQDepth;
+	/** theProcessedCount is the number of work packages processed. */
+	LONG theProcessedCount;
+	/** theStack are the return addresses of the thread from the innermost, if captured. */
+	std::vector<ULONGLONG> theStack;
+	/** theStackText is the stack with the symbols found, one frame per line. */
+	std::string theStackText;
+} ThreadItStall;
+
+/**
+ * Class CThreadItWatchdog scans the CThreadIt instances for stalls.
+ */
+class CThreadItWatchdog : public CThreadIt
+{
+	// types
+public:
+	/** StallType is the kind of a stall. */
+	enum StallType
+	{
+		/** A worker method has run past the time given to it. */
+		STALL_OVERRUN = 0,
+		/** Work has waited without any work package being completed. */
+		STALL_QUEUE
+	};
+
+private:
+	/** Watch is the state kept for each CThreadIt between scans. */
+	typedef struct WatchTag
+	{
+		/** theProcessedCount is the processed count at the last scan. */
+		LONG theProcessedCount;
+		/** theProgressTime is the tick count at which progress was last seen. */
+		DWORD theProgressTime;
+		/** isOverrunReported is true once the run in progress has been reported. */
+		bool isOverrunReported;
+		/** isQueueReported is true once the lack of progress has been reported. */
+		bool isQueueReported;
+		/** isSeen is true if the instance was in the latest scan. */
+		bool isSeen;
+	} Watch;
+
+	// Attributes
+private:
+	/** m_theStallSubject notifies the observers of stalls. */
+	CSubject m_theStallSubject;
+	/** m_theWatches are the states of the instances by thread ID and instance count. */
+	std::map<ULONGLONG, Watch> m_theWatches;
+	/** m_theStallTime is the time in milliseconds a worker method without a limit may run. */
+	volatile DWORD m_theStallTime;
+	/** m_theQueueStallTime is the time in milliseconds work may wait without progress. */
+	volatile DWORD m_theQueueStallTime;
+	/** m_isCaptureStack is true if the stack of a stalled thread is captured. */
+	volatile bool m_isCaptureStack;
+	/** m_theStallCount is the number of stalls reported. */
+	volatile LONG m_theStallCount;
+	/** m_theLastStall is the latest stall reported. */
+	ThreadItStall m_theLastStall;
+	/** m_theStallAccess protects the watches and the latest stall. */
+	mutable CRITICAL_SECTION m_theStallAccess;
+	/** m_theSymbolAccess serialises the calls of the debug help library, which is not
+	 * thread safe. */
+	static CRITICAL_SECTION m_theSymbolAccess;
+	/** m_isSymbols is true once the symbol handler has been initialised. */
+	static bool m_isSymbols;
+	/** m_theInit is only used to set up the static attributes. */
+	static int m_theInit;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItWatchdog starts the periodic scan.
+	 * @param[in] thePeriod is the time in milliseconds between scans.
+	 * @param[in] theStallTime is the time in milliseconds a worker method without a time
+	 * limit may run. Zero only checks the worker methods that were given a limit.
+	 * @param[in] theQueueStallTime is the time in milliseconds work may wait without any
+	 * work package being completed. Zero turns the check off.
+	 */
+	CThreadItWatchdog (DWORD thePeriod = THREADIT_WATCHDOG_PERIOD, DWORD theStallTime = THREADIT_WATCHDOG_STALL_TIME,
+		DWORD theQueueStallTime = THREADIT_WATCHDOG_STALL_TIME);
+
+	/**
+	 * Method ~CThreadItWatchdog stops the thread.
+	 */
+	virtual ~CThreadItWatchdog ();
+
+	/**
+	 * Method addStallObserver attaches an observer that is sent each stall.
+	 * @param[in] ptheObserver is the observer.
+	 */
+	void addStallObserver (CObserver* ptheObserver);
+
+	/**
+	 * Method removeStallObserver detaches an observer.
+	 * @param[in] ptheObserver is the observer.
+	 */
+	void removeStallObserver (CObserver* ptheObserver);
+
+	/**
+	 * Method setCaptureStack turns the capture of the stack of a stalled thread on or off.
+	 * @param[in] isCaptureStack is true to capture the stack.
+	 */
+	void setCaptureStack (bool isCaptureStack);
+
+	/**
+	 * Method isCaptureStack returns true if the stack of a stalled thread is captured.
+	 */
+	bool isCaptureStack () const;
+
+	/**
+	 * Method getStallCount returns the number of stalls reported.
+	 */
+	LONG getStallCount () const;
+
+	/**
+	 * Method getLastStall returns the latest stall reported.
+	 * @param[out] theStall receives the stall.
+	 * \return false if no stall has been reported.
+	 */
+	bool getLastStall (ThreadItStall& theStall) const;
+
+	/**
+	 * Method scan checks the CThreadIt instances now. It is called each period.
+	 */
+	void scan ();
+
+	/**
+	 * Method captureStack takes the return addresses of another thread of the process.
+	 * It does not allocate or call the debug help library while the thread is suspended.
+	 * @param[in] theThreadId is the thread. It may not be the calling thread.
+	 * @param[out] theStack receives the return addresses from the innermost.
+	 * \return false if the stack could not be taken.
+	 */
+	static bool captureStack (DWORD theThreadId, std::vector<ULONGLONG>& theStack);
+
+	/**
+	 * Method getStackText returns a stack with the module, symbol and line of each
+	 * return address that can be found, one frame per line.
+	 * @param[in] theStack are the return addresses.
+	 */
+	static std::string getStackText (const std::vector<ULONGLONG>& theStack);
+
+protected:
+	/**
+	 * Method onPeriod is the periodic method. It scans the instances.
+	 */
+	bool onPeriod (CWorkPackIt theTimedWork, CWorkPackIt*& ptheWorkDone);
+
+	/**
+	 * Method report captures the stack if asked and notifies the observers of a stall.
+	 * @param[in,out] theStall is the stall.
+	 */
+	void report (ThreadItStall& theStall);
+
+private:
+	/**
+	 * Method initialiseSymbols initialises the symbol handler once. It is called with
+	 * m_theSymbolAccess held.
+	 */
+	static void initialiseSymbols ();
+
+	/**
+	 * Method initialise sets up the static attributes. It always returns zero.
+	 */
+	static int initialise ();
+
+	/// not copiable
+	CThreadItWatchdog (const CThreadItWatchdog&);
+	const CThreadItWatchdog& operator= (const CThreadItWatchdog&);
+
+}; // class CThreadItWatchdog
+
+#endif // !defined (THREADIT_WATCHDOG_H)
@@ -0,0 +1,306 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItWorkerGroup
+ * Description: Class CThreadItWorkerGroup is a group of identical CThreadIt workers
+ * that share the processing of an index range. See the header file for a
+ * description of how the range is shared.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+// Includes
+#include "stdafx.h"
+#include "threaditworkergroup.h"
+#include "strutil.h"
+
+// Class: CThreadItParallelJob Implementation
+
+/**
+ * Constructor CThreadItParallelJob describes the range [theBegin, theEnd).
+ * @param[in] theMinChunk is the smallest number of indexes handed out at a time.
+ */
+CThreadItParallelJob::CThreadItParallelJob (LONGLONG theBegin, LONGLONG theEnd, LONGLONG theMinChunk)
+{
+	m_theNext = theBegin;
+	m_theEnd = theEnd;
+	m_theMinChunk = (theMinChunk > 0) ? theMinChunk : 1;
+	m_theWorkerCount = 0;
+	m_theActive = 0;
+	m_theSlot = 0;
+	m_theChunkCount = 0;
+	m_isFailed = 0;
+	m_theDone = CreateEvent (NULL, TRUE, FALSE, NULL);
+} // constructor CThreadItParallelJob
+
+/**
+ * Method ~CThreadItParallelJob closes the completion event.
+ */
+CThreadItParallelJob::~CThreadItParallelJob ()
+{
+	CloseHandle (m_theDone);
+} // ~CThreadItParallelJob
+
+/**
+ * Method start prepares the job to be shared by theWorkerCount workers.
+ */
+void CThreadItParallelJob::start (LONG theWorkerCount)
+{
+	m_theWorkerCount = theWorkerCount;
+	m_theActive = theWorkerCount;
+	m_theSlot = 0;
+	ResetEvent (m_theDone);
+} // start
+
+/**
+ * Method wait waits for the workers to finish.
+ */
+bool CThreadItParallelJob::wait (DWORD theTimeOut)
+{
+	return (WaitForSingleObject (m_theDone, theTimeOut) == WAIT_OBJECT_0);
+} // wait
+
+/**
+ * Method getChunk hands out the next chunk of the range. The chunk is half of the
+ * share of each worker in what is left of the range, but never less than the
+ * minimum chunk size.
+ * \return false if the range is exhausted.
+ */
+bool CThreadItParallelJob::getChunk (LONGLONG& theBegin, LONGLONG& theEnd)
+{
+	bool isChunk = false;
+	LONGLONG theNext = 0;
+	LONGLONG theSize = 0;
+
+	do
+	{
+		theNext = m_theNext;
+		if (theNext < m_theEnd)
+		{
+			theSize = (m_theEnd - theNext) / (2 * m_theWorkerCount);
+			if (theSize < m_theMinChunk)
+			{
+				theSize = m_theMinChunk;
+			} // if
+			if (theNext + theSize > m_theEnd)
+			{
+				theSize = m_theEnd - theNext;
+			} // if
+			isChunk = (InterlockedCompareExchange64 (&m_theNext, theNext + theSize, theNext) == theNext);
+		} // if
+	} while ((!isChunk) && (theNext < m_theEnd));
+	if (isChunk)
+	{
+		theBegin = theNext;
+		theEnd = theNext + theSize;
+		InterlockedIncrement (&m_theChunkCount);
+	} // if
+	return isChunk;
+} // getChunk
+
+/**
+ * Method execute is called by each worker. It takes chunks from the range until
+ * none are left. The worker that finishes last signals the caller and must be the
+ * last to touch the job as the caller may then destroy it.
+ */
+void CThreadItParallelJob::execute ()
+{
+	LONGLONG theBegin = 0;
+	LONGLONG theEnd = 0;
+	UINT theSlot = (UINT)(InterlockedIncrement (&m_theSlot) - 1);
+
+	try
+	{
+		while (getChunk (theBegin, theEnd))
+		{
+			runRange (theBegin, theEnd, theSlot);
+		} // while
+	} // try
+	catch (...)
+	{
+		InterlockedExchange (&m_isFailed, 1);
+		// Stop the other workers taking any more chunks.
+		InterlockedExchange64 (&m_theNext, m_theEnd);
+	} // catch
+	if (InterlockedDecrement (&m_theActive) == 0)
+	{
+		SetEvent (m_theDone);
+	} // if
+} // execute
+
+/**
+ * Method isFailed returns true if any chunk threw an exception.
+ */
+bool CThreadItParallelJob::isFailed () const
+{
+	return (m_isFailed != 0);
+} // isFailed
+
+/**
+ * Method getChunkCount returns the number of chunks handed out.
+ */
+LONG CThreadItParallelJob::getChunkCount () const
+{
+	return m_theChunkCount;
+} // getChunkCount
+
+// Class: CThreadItParallelWorker Implementation
+
+/**
+ * Constructor CThreadItParallelWorker registers the job worker method and starts the thread.
+ */
+CThreadItParallelWorker::CThreadItParallelWorker (const std::string& theThreadName) : CThreadIt (theThreadName)
+{
+	setWorkerMethod ((WorkerMethodType)&CThreadItParallelWorker::executeJob, PARALLEL_JOB);
+	// There is no periodic work.
+	setPeriod (0);
+} // constructor CThreadItParallelWorker
+
+/**
+ * Method ~CThreadItParallelWorker stops the thread.
+ */
+CThreadItParallelWorker::~CThreadItParallelWorker ()
+{
+	stopThread ();
+	waitForThreadToStop ();
+} // ~CThreadItParallelWorker
+
+/**
+ * Method executeJob is the worker method for PARALLEL_JOB. The m_ptheObject of the
+ * work package is the CThreadItParallelJob.
+ */
+bool CThreadItParallelWorker::executeJob (CWorkPackIt* ptheWorkPack, CWorkPackIt*& ptheWorkDone)
+{
+	CThreadItParallelJob* ptheJob = (CThreadItParallelJob*)ptheWorkPack->m_ptheObject;
+
+	// The job completes when execute returns so nothing is sent back.
+	ptheWorkDone = NULL;
+	delete ptheWorkPack;
+	if (ptheJob != NULL)
+	{
+		ptheJob->execute ();
+	} // if
+	return true;
+} // executeJob
+
+// Class: CThreadItWorkerGroup Implementation
+
+/**
+ * Constructor CThreadItWorkerGroup creates the workers.
+ * @param[in] theWorkerCount is the number of workers. Zero uses one per processor.
+ * @param[in] theName is the name given to the worker threads.
+ */
+CThreadItWorkerGroup::CThreadItWorkerGroup (UINT theWorkerCount, const std::string& theName)
+{
+	SYSTEM_INFO theInfo;
+
+	m_ptheLogger = &(log4cpp::Category::getInstance ("threadit.CThreadItWorkerGroup"));
+	if (theWorkerCount == 0)
+	{
+		GetSystemInfo (&theInfo);
+		theWorkerCount = theInfo.dwNumberOfProcessors;
+	} // if
+	for (UINT theWorker = 0; theWorker < theWorkerCount; theWorker++)
+	{
+		m_theWorkers.push_back (ThreadItPtr (new CThreadItParallelWorker (theName + strutil::toString (theWorker))));
+	} // for
+} // constructor CThreadItWorkerGroup
+
+/**
+ * Method ~CThreadItWorkerGroup stops the workers.
+ */
+CThreadItWorkerGroup::~CThreadItWorkerGroup ()
+{
+	m_theWorkers.clear ();
+} // ~CThreadItWorkerGroup
+
+/**
+ * Method getWorkerCount returns the number of workers in the group.
+ */
+UINT CThreadItWorkerGroup::getWorkerCount () const
+{
+	return (UINT)m_theWorkers.size ();
+} // getWorkerCount
+
+/**
+ * Method isWorkerThread checks if the calling thread is one of the workers of the group.
+ * \return true if the caller is a worker of the group.
+ */
+bool CThreadItWorkerGroup::isWorkerThread () const
+{
+	bool isWorker = false;
+	UINT theThreadId = (UINT)GetCurrentThreadId ();
+
+	for (size_t i = 0; (i < m_theWorkers.size ()) && !isWorker; i++)
+	{
+		isWorker = (m_theWorkers[i]->getThreadId () == theThreadId);
+	} // for
+	return isWorker;
+} // isWorkerThread
+
+/**
+ * Method run shares the job between the workers and waits for it to complete.
+ * A job started from one of the workers of the group is run on the calling thread.
+ * @param[in] theJob is the job to run. It must stay valid until run returns.
+ * @param[in] theWorkerCount limits the number of workers used. Zero uses them all.
+ * \return true if the job completed without an exception.
+ */
+bool CThreadItWorkerGroup::run (CThreadItParallelJob& theJob, UINT theWorkerCount)
+{
+	bool isSuccess = false;
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+
+	if ((theWorkerCount == 0) || (theWorkerCount > m_theWorkers.size ()))
+	{
+		theWorkerCount = (UINT)m_theWorkers.size ();
+	} // if
+	if (isWorkerThread ())
+	{
+		// Called from a worker of this group. Waiting for the workers would wait for
+		// this thread as well, so the job runs here instead.
+		theJob.start (1);
+		theJob.execute ();
+		isSuccess = !theJob.isFailed ();
+		if (!isSuccess)
+		{
+			m_ptheLogger->error ("exception caught while running a parallel job");
+		} // if
+	}
+	else if (theWorkerCount > 0)
+	{
+		theJob.start ((LONG)theWorkerCount);
+		for (UINT theWorker = 0; theWorker < theWorkerCount; theWorker++)
+		{
+			ptheWorkPack = new CWorkPackIt ();
+			ptheWorkPack->m_theInstruction = CThreadItParallelWorker::PARALLEL_JOB;
+			ptheWorkPack->m_ptheObject = &theJob;
+			m_theWorkers[theWorker]->startWork (ptheWorkPack, theWorkPackId);
+		} // for
+		theJob.wait (INFINITE);
+		isSuccess = !theJob.isFailed ();
+		if (!isSuccess)
+		{
+			m_ptheLogger->error ("exception caught while running a parallel job");
+		} // if
+	} // if
+	return isSuccess;
+} // run
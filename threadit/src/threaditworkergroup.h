@@ -0,0 +1,396 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: CThreadItWorkerGroup
+ * Description: Class CThreadItWorkerGroup is a group of identical CThreadIt workers
+ * that share the processing of an index range. It provides parallelFor,
+ * parallelReduce and scatterGather on top of a CThreadItParallelJob.
+ *
+ * A job is sent to every worker in the group as a single work package. The workers
+ * then take chunks of the range from a shared cursor with a compare and exchange.
+ * The chunk size is guided: each chunk is a share of what is left of the range so
+ * the chunks start large and get smaller towards the end, down to the minimum chunk
+ * size given. A worker that runs slow simply takes fewer chunks and the others
+ * pick up the rest of the range, so the work is rebalanced without a queue per
+ * worker. The last worker to run out of chunks signals the caller which waits for
+ * the job to complete.
+ *
+ * Results are written by index into storage allocated before the job starts, so
+ * no lock is taken per result. parallelReduce keeps one partial result per worker
+ * and combines the partial results on the calling thread.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#if !defined (THREADIT_WORKER_GROUP_H)
+#define THREADIT_WORKER_GROUP_H
+
+// Includes
+#include <vector>
+#include "threadit.h"
+
+/**
+ * Class CThreadItParallelJob describes a range of indexes to be processed by the
+ * workers of a CThreadItWorkerGroup. Derived classes provide runRange.
+ */
+class CThreadItParallelJob
+{
+	// Attributes
+private:
+	/** m_theNext is the first index not yet handed out. */
+	volatile LONGLONG m_theNext;
+	/** m_theEnd is one past the last index of the range. */
+	LONGLONG m_theEnd;
+	/** m_theMinChunk is the smallest number of indexes handed out at a time. */
+	LONGLONG m_theMinChunk;
+	/** m_theWorkerCount is the number of workers sharing the job. */
+	LONG m_theWorkerCount;
+	/** m_theActive is the number of workers that have not yet finished the job. */
+	volatile LONG m_theActive;
+	/** m_theSlot hands each worker a slot number from zero. */
+	volatile LONG m_theSlot;
+	/** m_theChunkCount is the number of chunks handed out. */
+	volatile LONG m_theChunkCount;
+	/** m_isFailed is set if runRange throws an exception. */
+	volatile LONG m_isFailed;
+	/** m_theDone is signalled when every worker has finished. */
+	HANDLE m_theDone;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItParallelJob describes the range [theBegin, theEnd).
+	 * @param[in] theMinChunk is the smallest number of indexes handed out at a time.
+	 */
+	CThreadItParallelJob (LONGLONG theBegin, LONGLONG theEnd, LONGLONG theMinChunk);
+
+	/**
+	 * Method ~CThreadItParallelJob closes the completion event.
+	 */
+	virtual ~CThreadItParallelJob ();
+
+	/**
+	 * Method execute is called by each worker. It takes chunks from the range until
+	 * none are left.
+	 */
+	void execute ();
+
+	/**
+	 * Method isFailed returns true if any chunk threw an exception.
+	 */
+	bool isFailed () const;
+
+	/**
+	 * Method getChunkCount returns the number of chunks handed out.
+	 */
+	LONG getChunkCount () const;
+
+protected:
+	/**
+	 * Method runRange processes the indexes [theBegin, theEnd).
+	 * @param[in] theSlot is the slot of the worker from zero to the worker count less one.
+	 */
+	virtual void runRange (LONGLONG theBegin, LONGLONG theEnd, UINT theSlot) = 0;
+
+private:
+	friend class CThreadItWorkerGroup;
+
+	/**
+	 * Method start prepares the job to be shared by theWorkerCount workers.
+	 */
+	void start (LONG theWorkerCount);
+
+	/**
+	 * Method wait waits for the workers to finish.
+	 */
+	bool wait (DWORD theTimeOut);
+
+	/**
+	 * Method getChunk hands out the next chunk of the range.
+	 * \return false if the range is exhausted.
+	 */
+	bool getChunk (LONGLONG& theBegin, LONGLONG& theEnd);
+
+	/// not copiable
+	CThreadItParallelJob (const CThreadItParallelJob&);
+	const CThreadItParallelJob& operator= (const CThreadItParallelJob&);
+
+}; // class CThreadItParallelJob
+
+/**
+ * Class CThreadItParallelWorker is the worker used by CThreadItWorkerGroup.
+ */
+class CThreadItParallelWorker : public CThreadIt
+{
+public:
+	/** PARALLEL_JOB is the work instruction that executes a CThreadItParallelJob.
+	 * The highest instruction is used so that derived classes keep the others. */
+	static const UINT PARALLEL_JOB = MAX_WORK_METHODS - 1;
+
+	/**
+	 * Constructor CThreadItParallelWorker registers the job worker method and starts the thread.
+	 */
+	CThreadItParallelWorker (const std::string& theThreadName);
+
+	/**
+	 * Method ~CThreadItParallelWorker stops the thread.
+	 */
+	virtual ~CThreadItParallelWorker ();
+
+protected:
+	/**
+	 * Method executeJob is the worker method for PARALLEL_JOB. The m_ptheObject of the
+	 * work package is the CThreadItParallelJob.
+	 */
+	bool executeJob (CWorkPackIt* ptheWorkPack, CWorkPackIt*& ptheWorkDone);
+
+}; // class CThreadItParallelWorker
+
+/**
+ * Class CThreadItWorkerGroup is a group of identical workers that share jobs.
+ */
+class CThreadItWorkerGroup
+{
+	// Attributes
+private:
+	/** m_theWorkers are the workers of the group. */
+	std::vector<ThreadItPtr> m_theWorkers;
+	/** m_ptheLogger is the logger used to log information and errors. */
+	log4cpp::Category* m_ptheLogger;
+
+	// Job types used by the helpers.
+	template <class Func> class CForJob;
+	template <class T, class Func, class Combine> class CReduceJob;
+	template <class In, class Out, class Func> class CGatherJob;
+
+	/**
+	 * Method isWorkerThread checks if the calling thread is one of the workers of the group.
+	 */
+	bool isWorkerThread () const;
+
+	// Methods
+public:
+	/**
+	 * Constructor CThreadItWorkerGroup creates the workers.
+	 * @param[in] theWorkerCount is the number of workers. Zero uses one per processor.
+	 * @param[in] theName is the name given to the worker threads.
+	 */
+	CThreadItWorkerGroup (UINT theWorkerCount = 0, const std::string& theName = "threadit.CThreadItWorkerGroup");
+
+	/**
+	 * Method ~CThreadItWorkerGroup stops the workers.
+	 */
+	virtual ~CThreadItWorkerGroup ();
+
+	/**
+	 * Method getWorkerCount returns the number of workers in the group.
+	 */
+	UINT getWorkerCount () const;
+
+	/**
+	 * Method run shares the job between the workers and waits for it to complete.
+	 * A job started from one of the workers of the group is run on the calling thread,
+	 * since waiting for the workers would then wait for the caller.
+	 * @param[in] theJob is the job to run. It must stay valid until run returns.
+	 * @param[in] theWorkerCount limits the number of workers used. Zero uses them all.
+	 * \return true if the job completed without an exception.
+	 */
+	bool run (CThreadItParallelJob& theJob, UINT theWorkerCount = 0);
+
+	/**
+	 * Method parallelFor calls theFunc (i) for every i in [theBegin, theEnd).
+	 * \return true if every call completed without an exception.
+	 */
+	template <class Func> bool parallelFor (LONGLONG theBegin, LONGLONG theEnd, Func theFunc, LONGLONG theMinChunk = 1, UINT theWorkerCount = 0);
+
+	/**
+	 * Method parallelReduce combines theFunc (i) for every i in [theBegin, theEnd)
+	 * using theCombine (T, T). theIdentity is the value that leaves a value unchanged
+	 * when combined with it. The order of combination is not defined. If a call throws
+	 * an exception the value combines only part of the range; use the overload that
+	 * returns a bool to detect this.
+	 * \return the combined value.
+	 */
+	template <class T, class Func, class Combine> T parallelReduce (LONGLONG theBegin, LONGLONG theEnd, T theIdentity, Func theFunc, Combine theCombine, LONGLONG theMinChunk = 1, UINT theWorkerCount = 0);
+
+	/**
+	 * Method parallelReduce combines theFunc (i) for every i in [theBegin, theEnd)
+	 * using theCombine (T, T) and reports whether every call completed.
+	 * @param[out] theResult receives the combined value.
+	 * \return true if every call completed without an exception. Otherwise theResult
+	 * combines only part of the range.
+	 */
+	template <class T, class Func, class Combine> bool parallelReduce (T& theResult, LONGLONG theBegin, LONGLONG theEnd, T theIdentity, Func theFunc, Combine theCombine, LONGLONG theMinChunk = 1, UINT theWorkerCount = 0);
+
+	/**
+	 * Method scatterGather sets theOutputs[i] = theFunc (theInputs[i]) for every input.
+	 * theOutputs is sized before the workers start so each result is written in place.
+	 * \return true if every call completed without an exception.
+	 */
+	template <class In, class Out, class Func> bool scatterGather (const std::vector<In>& theInputs, std::vector<Out>& theOutputs, Func theFunc, LONGLONG theMinChunk = 1, UINT theWorkerCount = 0);
+
+}; // class CThreadItWorkerGroup
+
+/**
+ * Class CForJob calls a function for each index.
+ */
+template <class Func> class CThreadItWorkerGroup::CForJob : public CThreadItParallelJob
+{
+	Func& m_theFunc;
+
+public:
+	CForJob (LONGLONG theBegin, LONGLONG theEnd, LONGLONG theMinChunk, Func& theFunc) : CThreadItParallelJob (theBegin, theEnd, theMinChunk), m_theFunc (theFunc)
+	{
+	} // constructor CForJob
+
+protected:
+	void runRange (LONGLONG theBegin, LONGLONG theEnd, UINT theSlot)
+	{
+		for (LONGLONG theIndex = theBegin; theIndex < theEnd; theIndex++)
+		{
+			m_theFunc (theIndex);
+		} // for
+	} // runRange
+
+}; // class CForJob
+
+/**
+ * Class CReduceJob keeps one partial result for each worker slot. Each partial
+ * result is padded to a cache line so that the workers do not share lines.
+ */
+template <class T, class Func, class Combine> class CThreadItWorkerGroup::CReduceJob : public CThreadItParallelJob
+{
+	typedef struct PartialTag
+	{
+		T theValue;
+		char thePad[64];
+	} Partial;
+
+	Func& m_theFunc;
+	Combine& m_theCombine;
+	std::vector<Partial> m_thePartials;
+
+public:
+	CReduceJob (LONGLONG theBegin, LONGLONG theEnd, LONGLONG theMinChunk, UINT theSlots, const T& theIdentity, Func& theFunc, Combine& theCombine) :
+		CThreadItParallelJob (theBegin, theEnd, theMinChunk), m_theFunc (theFunc), m_theCombine (theCombine), m_thePartials (theSlots)
+	{
+		for (UINT theSlot = 0; theSlot < theSlots; theSlot++)
+		{
+			m_thePartials[theSlot].theValue = theIdentity;
+		} // for
+	} // constructor CReduceJob
+
+	T getResult (T theValue)
+	{
+		for (size_t theSlot = 0; theSlot < m_thePartials.size (); theSlot++)
+		{
+			theValue = m_theCombine (theValue, m_thePartials[theSlot].theValue);
+		} // for
+		return theValue;
+	} // getResult
+
+protected:
+	void runRange (LONGLONG theBegin, LONGLONG theEnd, UINT theSlot)
+	{
+		T theValue = m_theFunc (theBegin);
+
+		for (LONGLONG theIndex = theBegin + 1; theIndex < theEnd; theIndex++)
+		{
+			theValue = m_theCombine (theValue, m_theFunc (theIndex));
+		} // for
+		m_thePartials[theSlot].theValue = m_theCombine (m_thePartials[theSlot].theValue, theValue);
+	} // runRange
+
+}; // class CReduceJob
+
+/**
+ * Class CGatherJob writes the result for each input into the output at the same index.
+ */
+template <class In, class Out, class Func> class CThreadItWorkerGroup::CGatherJob : public CThreadItParallelJob
+{
+	const std::vector<In>& m_theInputs;
+	std::vector<Out>& m_theOutputs;
+	Func& m_theFunc;
+
+public:
+	CGatherJob (LONGLONG theMinChunk, const std::vector<In>& theInputs, std::vector<Out>& theOutputs, Func& theFunc) :
+		CThreadItParallelJob (0, (LONGLONG)theInputs.size (), theMinChunk), m_theInputs (theInputs), m_theOutputs (theOutputs), m_theFunc (theFunc)
+	{
+	} // constructor CGatherJob
+
+protected:
+	void runRange (LONGLONG theBegin, LONGLONG theEnd, UINT theSlot)
+	{
+		for (LONGLONG theIndex = theBegin; theIndex < theEnd; theIndex++)
+		{
+			m_theOutputs[(size_t)theIndex] = m_theFunc (m_theInputs[(size_t)theIndex]);
+		} // for
+	} // runRange
+
+}; // class CGatherJob
+
+/**
+ * Method parallelFor calls theFunc (i) for every i in [theBegin, theEnd).
+ */
+template <class Func> bool CThreadItWorkerGroup::parallelFor (LONGLONG theBegin, LONGLONG theEnd, Func theFunc, LONGLONG theMinChunk, UINT theWorkerCount)
+{
+	CForJob<Func> theJob (theBegin, theEnd, theMinChunk, theFunc);
+
+	return run (theJob, theWorkerCount);
+} // parallelFor
+
+/**
+ * Method parallelReduce combines theFunc (i) for every i in [theBegin, theEnd).
+ */
+template <class T, class Func, class Combine> T CThreadItWorkerGroup::parallelReduce (LONGLONG theBegin, LONGLONG theEnd, T theIdentity, Func theFunc, Combine theCombine, LONGLONG theMinChunk, UINT theWorkerCount)
+{
+	T theResult = theIdentity;
+
+	parallelReduce (theResult, theBegin, theEnd, theIdentity, theFunc, theCombine, theMinChunk, theWorkerCount);
+	return theResult;
+} // parallelReduce
+
+/**
+ * Method parallelReduce combines theFunc (i) for every i in [theBegin, theEnd) and
+ * returns false if a call threw an exception.
+ */
+template <class T, class Func, class Combine> bool CThreadItWorkerGroup::parallelReduce (T& theResult, LONGLONG theBegin, LONGLONG theEnd, T theIdentity, Func theFunc, Combine theCombine, LONGLONG theMinChunk, UINT theWorkerCount)
+{
+	bool isSuccess = false;
+	CReduceJob<T, Func, Combine> theJob (theBegin, theEnd, theMinChunk, getWorkerCount (), theIdentity, theFunc, theCombine);
+
+	isSuccess = run (theJob, theWorkerCount);
+	theResult = theJob.getResult (theIdentity);
+	return isSuccess;
+} // parallelReduce
+
+/**
+ * Method scatterGather sets theOutputs[i] = theFunc (theInputs[i]) for every input.
+ */
+template <class In, class Out, class Func> bool CThreadItWorkerGroup::scatterGather (const std::vector<In>& theInputs, std::vector<Out>& theOutputs, Func theFunc, LONGLONG theMinChunk, UINT theWorkerCount)
+{
+	theOutputs.resize (theInputs.size ());
+	CGatherJob<In, Out, Func> theJob (theMinChunk, theInputs, theOutputs, theFunc);
+
+	return run (theJob, theWorkerCount);
+} // scatterGather
+
+#endif // !defined (THREADIT_WORKER_GROUP_H)
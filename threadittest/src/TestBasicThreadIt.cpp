@@ -0,0 +1,347 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestBasicThreadIt
+ * Description: TestBasicThreadIt contains unit tests for the CMpscRing and
+ * CBasicThreadIt templates. The ring is checked with several producers, the classic
+ * policies are checked to return results as CThreadIt does and a benchmark matrix
+ * logs the messages per second and mean latency of each combination of policies.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "basicthreadit.h"
+
+/** BASIC_WORK is the work instruction processed by the workers. */
+#define BASIC_WORK 1
+/** BASIC_PRODUCERS is the number of producers used to check the ring. */
+#define BASIC_PRODUCERS 4
+/** BASIC_ITEMS is the number of items pushed by each producer. */
+#define BASIC_ITEMS 50000
+
+/** theMpscItems are the items pushed by the producers. */
+static ULONG theMpscItems[BASIC_PRODUCERS * BASIC_ITEMS];
+/** theMpscRing is the ring shared by the producers. */
+static CMpscRing<ULONG>* ptheMpscRing = NULL;
+
+/**
+ * Function mpscProducer pushes the items of one producer in order.
+ */
+static unsigned int __stdcall mpscProducer (void* ptheProducer)
+{
+	ULONG theProducer = (ULONG)(ULONG_PTR)ptheProducer;
+
+	for (ULONG theIndex = 0; theIndex < BASIC_ITEMS; theIndex++)
+	{
+		while (!ptheMpscRing->push (&theMpscItems[(theProducer * BASIC_ITEMS) + theIndex]))
+		{
+			SwitchToThread ();
+		} // while
+	} // for
+	return 0;
+} // mpscProducer
+
+/**
+ * Class CTableWorker is a CBasicThreadIt that uses a worker method table.
+ */
+template <class Q, class W, class C> class CTableWorker : public CBasicThreadIt <Q, W, C, CTableDispatchPolicy <CTableWorker <Q, W, C> > >
+{
+public:
+	CTableWorker () : CBasicThreadIt <Q, W, C, CTableDispatchPolicy <CTableWorker <Q, W, C> > > ("threadit.CTableWorker")
+	{
+		this->setWorkerMethod (&CTableWorker::work, BASIC_WORK);
+		this->start ();
+	} // constructor CTableWorker
+
+	~CTableWorker ()
+	{
+		this->stop ();
+	} // ~CTableWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // work
+
+}; // class CTableWorker
+
+/**
+ * Class CVirtualWorker is a CBasicThreadIt that uses a virtual doWork.
+ */
+template <class Q, class W, class C> class CVirtualWorker : public CBasicThreadIt <Q, W, C, CVirtualDispatchPolicy>
+{
+public:
+	CVirtualWorker () : CBasicThreadIt <Q, W, C, CVirtualDispatchPolicy> ("threadit.CVirtualWorker")
+	{
+		this->start ();
+	} // constructor CVirtualWorker
+
+	~CVirtualWorker ()
+	{
+		this->stop ();
+	} // ~CVirtualWorker
+
+protected:
+	virtual bool doWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // doWork
+
+}; // class CVirtualWorker
+
+/**
+ * Class CStaticWorker is a CBasicThreadIt that uses a doWork resolved at compile time.
+ */
+template <class Q, class W, class C> class CStaticWorker : public CBasicThreadIt <Q, W, C, CStaticDispatchPolicy <CStaticWorker <Q, W, C> > >
+{
+public:
+	CStaticWorker () : CBasicThreadIt <Q, W, C, CStaticDispatchPolicy <CStaticWorker <Q, W, C> > > ("threadit.CStaticWorker")
+	{
+		this->start ();
+	} // constructor CStaticWorker
+
+	~CStaticWorker ()
+	{
+		this->stop ();
+	} // ~CStaticWorker
+
+	bool doWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // doWork
+
+}; // class CStaticWorker
+
+/**
+ * Class CClassicWorker uses the policies that behave as CThreadIt.
+ */
+class CClassicWorker : public CClassicThreadIt <CClassicWorker>
+{
+public:
+	CClassicWorker () : CClassicThreadIt <CClassicWorker> ("threadit.CClassicWorker")
+	{
+		setWorkerMethod (&CClassicWorker::work, BASIC_WORK);
+		start ();
+	} // constructor CClassicWorker
+
+	~CClassicWorker ()
+	{
+		stop ();
+	} // ~CClassicWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // work
+
+}; // class CClassicWorker
+
+/**
+ * Function runBasicBenchmark sends work packages to a new worker as fast as it will
+ * take them, waits for them to be processed and logs the rate and mean latency.
+ * @param[in] theName names the combination of policies in the log.
+ * @param[in] theRequests is the number of work packages sent.
+ * \return the number of work packages processed.
+ */
+template <class Worker> LONG runBasicBenchmark (const char* theName, LONG theRequests)
+{
+	ULONG theWorkPackId = 0;
+	DWORD theStart = 0;
+	DWORD theElapsed = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	Worker theWorker;
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestBasicThreadIt"));
+
+	theStart = GetTickCount ();
+	for (LONG i = 0; i < theRequests; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = BASIC_WORK;
+		while (!theWorker.startWork (ptheWorkPack, theWorkPackId))
+		{
+			SwitchToThread ();
+		} // while
+	} // for
+	while ((theWorker.getProcessedCount () < theRequests) && ((GetTickCount () - theStart) < 20000))
+	{
+		Sleep (1);
+	} // while
+	theElapsed = GetTickCount () - theStart;
+	if (theElapsed == 0)
+	{
+		theElapsed = 1;
+	} // if
+	logger->infoStream () << theName << ": " << ((theWorker.getProcessedCount () * 1000.0) / theElapsed)
+		<< " messages per second, mean latency " << theWorker.getMeanLatency () << "us";
+	return theWorker.getProcessedCount ();
+} // runBasicBenchmark
+
+/**
+ * Test_MpscRing_producers checks that every item pushed by several producers is
+ * popped once and in the order each producer pushed it.
+ */
+TEST (Test_MpscRing_producers)
+{
+	HANDLE theProducers[BASIC_PRODUCERS];
+	ULONG theNext[BASIC_PRODUCERS];
+	ULONG theReceived = 0;
+	ULONG* ptheItem = NULL;
+	ULONG theProducer = 0;
+	bool isOrdered = true;
+	DWORD theStart = 0;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestBasicThreadIt"));
+	logger->info ("Testing - Test_MpscRing_producers");
+
+	UNITTEST_TIME_CONSTRAINT (30000);
+
+	for (ULONG i = 0; i < (BASIC_PRODUCERS * BASIC_ITEMS); i++)
+	{
+		theMpscItems[i] = i;
+	} // for
+	ptheMpscRing = new CMpscRing<ULONG> (1000);
+	CHECK_EQUAL (1024u, ptheMpscRing->capacity ());
+	CHECK (ptheMpscRing->isEmpty ());
+	CHECK (ptheMpscRing->pop () == NULL);
+	for (ULONG i = 0; i < BASIC_PRODUCERS; i++)
+	{
+		theNext[i] = 0;
+		theProducers[i] = (HANDLE)_beginthreadex (NULL, 0, &mpscProducer, (void*)(ULONG_PTR)i, 0, NULL);
+	} // for
+	theStart = GetTickCount ();
+	while ((theReceived < (BASIC_PRODUCERS * BASIC_ITEMS)) && ((GetTickCount () - theStart) < 20000))
+	{
+		ptheItem = ptheMpscRing->pop ();
+		if (ptheItem != NULL)
+		{
+			theProducer = *ptheItem / BASIC_ITEMS;
+			isOrdered = isOrdered && ((*ptheItem % BASIC_ITEMS) == theNext[theProducer]);
+			theNext[theProducer]++;
+			theReceived++;
+		}
+		else
+		{
+			SwitchToThread ();
+		} // if
+	} // while
+	WaitForMultipleObjects (BASIC_PRODUCERS, theProducers, TRUE, INFINITE);
+	for (ULONG i = 0; i < BASIC_PRODUCERS; i++)
+	{
+		CloseHandle (theProducers[i]);
+	} // for
+	CHECK_EQUAL ((ULONG)(BASIC_PRODUCERS * BASIC_ITEMS), theReceived);
+	CHECK (isOrdered);
+	CHECK (ptheMpscRing->isEmpty ());
+	CHECK_EQUAL (0u, ptheMpscRing->size ());
+	delete ptheMpscRing;
+	ptheMpscRing = NULL;
+} // TEST (Test_MpscRing_producers)
+
+/**
+ * Test_BasicThreadIt_classic checks that results are returned through getWork and
+ * that an instruction without a worker method is reported as CThreadIt does.
+ */
+TEST (Test_BasicThreadIt_classic)
+{
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CClassicWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestBasicThreadIt"));
+	logger->info ("Testing - Test_BasicThreadIt_classic");
+
+	ptheWorkPack = new CWorkPackIt ();
+	ptheWorkPack->m_theInstruction = BASIC_WORK;
+	ptheWorkPack->m_isSendResult = true;
+	CHECK (theWorker.startWork (ptheWorkPack, theWorkPackId));
+	CHECK_EQUAL (1u, theWorkPackId);
+	ptheWorkPack = theWorker.getWork (2000);
+	CHECK (ptheWorkPack != NULL);
+	if (ptheWorkPack != NULL)
+	{
+		CHECK_EQUAL ((ULONG)CThreadIt::THREADIT_STATUS_OK, ptheWorkPack->m_theStatus);
+		CHECK_EQUAL (1u, ptheWorkPack->m_theWorkPackID);
+		delete ptheWorkPack;
+	} // if
+	ptheWorkPack = new CWorkPackIt ();
+	ptheWorkPack->m_theInstruction = BASIC_WORK + 1;
+	ptheWorkPack->m_isSendResult = true;
+	CHECK (theWorker.startWork (ptheWorkPack, theWorkPackId));
+	ptheWorkPack = theWorker.getWork (2000);
+	CHECK (ptheWorkPack != NULL);
+	if (ptheWorkPack != NULL)
+	{
+		CHECK_EQUAL ((ULONG)CThreadIt::WORKDONE_NO_METHOD, ptheWorkPack->m_theStatus);
+		delete ptheWorkPack;
+	} // if
+	CHECK (!theWorker.startWork (NULL, theWorkPackId));
+	CHECK_EQUAL (2, theWorker.getProcessedCount ());
+} // TEST (Test_BasicThreadIt_classic)
+
+/**
+ * Test_BasicThreadIt_matrix runs the benchmark over the combinations of queue, wait
+ * and dispatch policies with the performance counter clock, and over the clocks with
+ * the fastest of the other policies.
+ */
+TEST (Test_BasicThreadIt_matrix)
+{
+	const LONG theRequests = 100000;
+	typedef CLockedQueuePolicy <CWorkPackIt> Locked;
+	typedef CMpscRing <CWorkPackIt> Mpsc;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestBasicThreadIt"));
+	logger->info ("Testing - Test_BasicThreadIt_matrix");
+
+	UNITTEST_TIME_CONSTRAINT (300000);
+
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CTableWorker <Locked, CEventWaitPolicy, CCounterClockPolicy> > ("locked/event/counter/table", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CVirtualWorker <Locked, CEventWaitPolicy, CCounterClockPolicy> > ("locked/event/counter/virtual", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CStaticWorker <Locked, CEventWaitPolicy, CCounterClockPolicy> > ("locked/event/counter/static", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CTableWorker <Locked, CHybridWaitPolicy, CCounterClockPolicy> > ("locked/hybrid/counter/table", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CVirtualWorker <Locked, CHybridWaitPolicy, CCounterClockPolicy> > ("locked/hybrid/counter/virtual", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CStaticWorker <Locked, CHybridWaitPolicy, CCounterClockPolicy> > ("locked/hybrid/counter/static", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CTableWorker <Locked, CSpinWaitPolicy, CCounterClockPolicy> > ("locked/spin/counter/table", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CVirtualWorker <Locked, CSpinWaitPolicy, CCounterClockPolicy> > ("locked/spin/counter/virtual", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CStaticWorker <Locked, CSpinWaitPolicy, CCounterClockPolicy> > ("locked/spin/counter/static", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CTableWorker <Mpsc, CEventWaitPolicy, CCounterClockPolicy> > ("mpsc/event/counter/table", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CVirtualWorker <Mpsc, CEventWaitPolicy, CCounterClockPolicy> > ("mpsc/event/counter/virtual", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CStaticWorker <Mpsc, CEventWaitPolicy, CCounterClockPolicy> > ("mpsc/event/counter/static", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CTableWorker <Mpsc, CHybridWaitPolicy, CCounterClockPolicy> > ("mpsc/hybrid/counter/table", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CVirtualWorker <Mpsc, CHybridWaitPolicy, CCounterClockPolicy> > ("mpsc/hybrid/counter/virtual", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CStaticWorker <Mpsc, CHybridWaitPolicy, CCounterClockPolicy> > ("mpsc/hybrid/counter/static", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CTableWorker <Mpsc, CSpinWaitPolicy, CCounterClockPolicy> > ("mpsc/spin/counter/table", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CVirtualWorker <Mpsc, CSpinWaitPolicy, CCounterClockPolicy> > ("mpsc/spin/counter/virtual", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CStaticWorker <Mpsc, CSpinWaitPolicy, CCounterClockPolicy> > ("mpsc/spin/counter/static", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CStaticWorker <Mpsc, CSpinWaitPolicy, CTickClockPolicy> > ("mpsc/spin/tick/static", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CStaticWorker <Mpsc, CSpinWaitPolicy, CTscClockPolicy> > ("mpsc/spin/tsc/static", theRequests)));
+	CHECK_EQUAL (theRequests, (runBasicBenchmark <CClassicWorker> ("classic", theRequests)));
+} // TEST (Test_BasicThreadIt_matrix)
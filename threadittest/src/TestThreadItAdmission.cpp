@@ -0,0 +1,233 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItAdmission
+ * Description: TestThreadItAdmission contains unit tests for the admission control
+ * of CThreadIt. Work is sent at twice the rate it can be done and the queue wait of
+ * the work that is processed is checked to stay bounded.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <vector>
+#include <algorithm>
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+
+/** ADMISSION_WORK is the work instruction processed by the worker. */
+#define ADMISSION_WORK 1
+
+/**
+ * Class CAdmissionWorker busy waits for its service time and records the time each
+ * work package waited in the queue.
+ */
+class CAdmissionWorker : public CThreadIt
+{
+public:
+	/** m_theServiceTime is the time taken by each work package in performance counter ticks. */
+	LONGLONG m_theServiceTime;
+	/** m_theFrequency is the performance counter frequency. */
+	LONGLONG m_theFrequency;
+	/** m_theWaits are the queue waits in microseconds of the work processed. */
+	std::vector<LONGLONG> m_theWaits;
+
+	CAdmissionWorker (LONG theServiceMicroseconds) : CThreadIt ("threadit.CAdmissionWorker")
+	{
+		LARGE_INTEGER theFrequency;
+
+		QueryPerformanceFrequency (&theFrequency);
+		m_theFrequency = theFrequency.QuadPart;
+		m_theServiceTime = (m_theFrequency * theServiceMicroseconds) / 1000000;
+		setWorkerMethod ((WorkerMethodType)&CAdmissionWorker::work, ADMISSION_WORK);
+	} // constructor CAdmissionWorker
+
+	~CAdmissionWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CAdmissionWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		LARGE_INTEGER theStart;
+		LARGE_INTEGER theNow;
+
+		QueryPerformanceCounter (&theStart);
+		m_theWaits.push_back (((theStart.QuadPart - pWorkPack->m_theEnqueueTime) * 1000000) / m_theFrequency);
+		do
+		{
+			QueryPerformanceCounter (&theNow);
+		} while (theNow.QuadPart - theStart.QuadPart < m_theServiceTime);
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // work
+
+}; // class CAdmissionWorker
+
+/**
+ * Test_ThreadItAdmission_overload sends work at twice the rate the worker can do it
+ * and checks that the 99th percentile queue wait of the work processed stays close
+ * to the target while the rest is shed.
+ */
+TEST (Test_ThreadItAdmission_overload)
+{
+	const ULONG theRequests = 4000;
+	const LONG theService = 1000;
+	const LONG theInterval = 500;
+	const ULONG theTarget = 5000;
+	const LONGLONG theBound = 50000;
+	ULONG theWorkPackId = 0;
+	ULONG theReceived = 0;
+	LONG theShed = 0;
+	LONG theProcessed = 0;
+	LONGLONG theIntervalTicks = 0;
+	LONGLONG theP99 = 0;
+	DWORD theStart = 0;
+	LARGE_INTEGER theFrequency;
+	LARGE_INTEGER theNext;
+	LARGE_INTEGER theNow;
+	WorkPackItQ theResults;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CAdmissionWorker theWorker (theService);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItAdmission"));
+	logger->info ("Testing - Test_ThreadItAdmission_overload");
+
+	UNITTEST_TIME_CONSTRAINT (20000);
+
+	theWorker.m_theWaits.reserve (theRequests);
+	theWorker.setAdmissionControl (theTarget, 20000);
+	QueryPerformanceFrequency (&theFrequency);
+	theIntervalTicks = (theFrequency.QuadPart * theInterval) / 1000000;
+	QueryPerformanceCounter (&theNext);
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		// Send at a fixed rate of twice what the worker can do.
+		do
+		{
+			QueryPerformanceCounter (&theNow);
+		} while (theNow.QuadPart < theNext.QuadPart);
+		theNext.QuadPart += theIntervalTicks;
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = ADMISSION_WORK;
+		ptheWorkPack->m_isSendResult = true;
+		ptheWorkPack->m_isUseDefaultQ = false;
+		ptheWorkPack->m_ptheWorkDoneQ = &theResults;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+	} // for
+	theStart = GetTickCount ();
+	while ((theReceived < theRequests) && ((GetTickCount () - theStart) < 10000))
+	{
+		ptheWorkPack = theResults.waitItem (100);
+		if (ptheWorkPack != NULL)
+		{
+			if (ptheWorkPack->m_theStatus == CThreadIt::WORKDONE_SHED)
+			{
+				theShed++;
+			}
+			else
+			{
+				theProcessed++;
+			} // if
+			theReceived++;
+			delete ptheWorkPack;
+		} // if
+	} // while
+	CHECK_EQUAL (theRequests, theReceived);
+	CHECK_EQUAL (theShed, theWorker.getShedCount ());
+	CHECK_EQUAL ((LONG)theWorker.m_theWaits.size (), theProcessed);
+	CHECK (theShed > 0);
+	CHECK (theProcessed > 0);
+	if (!theWorker.m_theWaits.empty ())
+	{
+		std::sort (theWorker.m_theWaits.begin (), theWorker.m_theWaits.end ());
+		theP99 = theWorker.m_theWaits[(theWorker.m_theWaits.size () * 99) / 100];
+		logger->infoStream () << "processed " << theProcessed << " shed " << theShed << " wait p50="
+			<< theWorker.m_theWaits[theWorker.m_theWaits.size () / 2] << "us p99=" << theP99
+			<< "us max=" << theWorker.m_theWaits.back () << "us";
+		CHECK (theP99 < theBound);
+	} // if
+} // TEST (Test_ThreadItAdmission_overload)
+
+/**
+ * Test_ThreadItAdmission_off checks that nothing is shed when admission control is
+ * off or when the work keeps up.
+ */
+TEST (Test_ThreadItAdmission_off)
+{
+	const ULONG theRequests = 200;
+	ULONG theWorkPackId = 0;
+	DWORD theStart = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CAdmissionWorker theWorker (1000);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItAdmission"));
+	logger->info ("Testing - Test_ThreadItAdmission_off");
+
+	// A burst that queues for longer than the target without admission control.
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = ADMISSION_WORK;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+	} // for
+	theStart = GetTickCount ();
+	while ((theWorker.getWorkQDepth () > 0) && ((GetTickCount () - theStart) < 5000))
+	{
+		Sleep (10);
+	} // while
+	CHECK_EQUAL (0, theWorker.getShedCount ());
+	// Work that keeps up is not shed.
+	theWorker.setAdmissionControl (5000, 20000);
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = ADMISSION_WORK;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+		Sleep (2);
+	} // for
+	theStart = GetTickCount ();
+	while ((theWorker.getWorkQDepth () > 0) && ((GetTickCount () - theStart) < 5000))
+	{
+		Sleep (10);
+	} // while
+	CHECK_EQUAL (0, theWorker.getShedCount ());
+} // TEST (Test_ThreadItAdmission_off)
+
+/**
+ * Test_ThreadItAdmission_status checks that the status codes of unprocessed work
+ * packages follow the earlier codes and do not change.
+ */
+TEST (Test_ThreadItAdmission_status)
+{
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItAdmission"));
+	logger->info ("Testing - Test_ThreadItAdmission_status");
+
+	CHECK_EQUAL (157, (int)CThreadIt::WORKDONE_NO_EVENT_METHOD);
+	CHECK_EQUAL (158, (int)CThreadIt::THREADIT_STATUS_OK);
+	CHECK_EQUAL (161, (int)CThreadIt::WORKDONE_SHED);
+	CHECK_EQUAL (162, (int)CThreadIt::WORKDONE_THROTTLED);
+	CHECK_EQUAL (163, (int)CThreadIt::WORKDONE_CONTINUE);
+	CHECK_EQUAL (164, (int)CThreadIt::THREADIT_STATUS_LAST);
+} // TEST (Test_ThreadItAdmission_status)
@@ -0,0 +1,161 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItAlloc
+ * Description: TestThreadItAlloc contains unit tests for the heap allocations charged
+ * to the CThreadIt instances. The counts are only checked when the library is built
+ * with THREADIT_ALLOC_TRACKING, as in the DebugAllocTracking configuration, and are
+ * otherwise checked to be zero.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+#include "threadithistogram.h"
+#include "threaditalloc.h"
+
+/** ALLOC_BLOCKS_WORK allocates ALLOC_BLOCKS blocks and frees them. */
+#define ALLOC_BLOCKS_WORK 1
+/** ALLOC_BLOCKS is the number of blocks allocated by each run. */
+#define ALLOC_BLOCKS 10
+/** ALLOC_BLOCK_SIZE is the size of each block. */
+#define ALLOC_BLOCK_SIZE 256
+
+/**
+ * Class CAllocWorker allocates a known number of blocks in its worker method.
+ */
+class CAllocWorker : public CThreadIt
+{
+public:
+	CAllocWorker () : CThreadIt ("threadit.CAllocWorker")
+	{
+		setWorkerMethod ((WorkerMethodType)&CAllocWorker::blocksWork, ALLOC_BLOCKS_WORK);
+	} // constructor CAllocWorker
+
+	~CAllocWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CAllocWorker
+
+	bool blocksWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		char* ptheBlocks[ALLOC_BLOCKS];
+
+		for (int theIndex = 0; theIndex < ALLOC_BLOCKS; theIndex++)
+		{
+			ptheBlocks[theIndex] = new char[ALLOC_BLOCK_SIZE];
+		} // for
+		for (int theIndex = 0; theIndex < ALLOC_BLOCKS; theIndex++)
+		{
+			delete[] ptheBlocks[theIndex];
+		} // for
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // blocksWork
+
+}; // class CAllocWorker
+
+/**
+ * Test_Alloc_run checks the allocations of nested runs on the calling thread.
+ */
+TEST (Test_Alloc_run)
+{
+	ThreadItAllocRun theOuter;
+	ThreadItAllocRun theInner;
+	char* ptheKept = NULL;
+	char* ptheFreed = NULL;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItAlloc"));
+	logger->info ("Testing - Test_Alloc_run");
+
+	CThreadItAlloc::startRun (theOuter);
+	ptheKept = new char[ALLOC_BLOCK_SIZE];
+	CThreadItAlloc::startRun (theInner);
+	ptheFreed = new char[ALLOC_BLOCK_SIZE];
+	delete[] ptheFreed;
+	CThreadItAlloc::endRun (theInner);
+	delete[] ptheKept;
+	CThreadItAlloc::endRun (theOuter);
+	if (CThreadItAlloc::isEnabled ())
+	{
+		CHECK_EQUAL (1, theInner.theAllocations);
+		CHECK (theInner.theBytes >= ALLOC_BLOCK_SIZE);
+		CHECK_EQUAL (theInner.theBytes, theInner.thePeakBytes);
+		// The outer run includes the inner one and held both blocks at once.
+		CHECK_EQUAL (2, theOuter.theAllocations);
+		CHECK (theOuter.thePeakBytes >= 2 * ALLOC_BLOCK_SIZE);
+	}
+	else
+	{
+		CHECK_EQUAL (0, theOuter.theAllocations);
+		CHECK_EQUAL (0, theOuter.theBytes);
+		CHECK_EQUAL (0, theOuter.thePeakBytes);
+	} // if
+} // TEST (Test_Alloc_run)
+
+/**
+ * Test_Alloc_threadIt checks the allocations charged to an instance and its instruction.
+ */
+TEST (Test_Alloc_threadIt)
+{
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CThreadItLatencyStats theStats;
+	CAllocWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItAlloc"));
+	logger->info ("Testing - Test_Alloc_threadIt");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	for (int theCount = 0; theCount < 2; theCount++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = ALLOC_BLOCKS_WORK;
+		ptheWorkPack->m_isSendResult = true;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+		ptheWorkPack = theWorker.getWork (2000);
+		CHECK (ptheWorkPack != NULL);
+		delete ptheWorkPack;
+	} // for
+	CHECK (theWorker.getStats (ALLOC_BLOCKS_WORK, theStats));
+	if (CThreadItAlloc::isEnabled ())
+	{
+		CHECK_EQUAL (2 * ALLOC_BLOCKS, theWorker.getAllocationCount ());
+		CHECK (theWorker.getAllocatedBytes () >= 2 * ALLOC_BLOCKS * ALLOC_BLOCK_SIZE);
+		// The blocks were freed as they were allocated.
+		CHECK (theWorker.getPeakAllocatedBytes () >= ALLOC_BLOCKS * ALLOC_BLOCK_SIZE);
+		CHECK (theWorker.getPeakAllocatedBytes () < 2 * ALLOC_BLOCKS * ALLOC_BLOCK_SIZE);
+		CHECK_EQUAL (2u, theStats.m_theAllocations.getCount ());
+		CHECK_EQUAL (ALLOC_BLOCKS, theStats.m_theAllocations.getMean ());
+	}
+	else
+	{
+		CHECK_EQUAL (0, theWorker.getAllocationCount ());
+		CHECK_EQUAL (0, theWorker.getAllocatedBytes ());
+		CHECK_EQUAL (0u, theStats.m_theAllocations.getCount ());
+	} // if
+} // TEST (Test_Alloc_threadIt)
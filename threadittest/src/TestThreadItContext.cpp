@@ -0,0 +1,252 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItContext
+ * Description: TestThreadItContext contains unit tests for the trace context carried
+ * by work packages from one CThreadIt to the next and for the critical path of the
+ * requests measured by CThreadItCriticalPath.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+#include "threaditmessage.h"
+#include "threaditcontext.h"
+
+/** CONTEXT_FRONT_REQUEST is the request sent to the front by the client. */
+#define CONTEXT_FRONT_REQUEST 1
+/** CONTEXT_FRONT_REPLY is the reply of the back to the front. */
+#define CONTEXT_FRONT_REPLY 2
+/** CONTEXT_BACK_WORK is the work the front sends to the back. */
+#define CONTEXT_BACK_WORK 1
+/** CONTEXT_FAN_OUT is the number of messages the front sends for each request. */
+#define CONTEXT_FAN_OUT 2
+/** CONTEXT_BACK_TIME is the time in milliseconds the back takes for its work. */
+#define CONTEXT_BACK_TIME 20
+
+/**
+ * Class CContextBack does work for the front and replies to it.
+ */
+class CContextBack : public CThreadIt
+{
+public:
+	/** m_theWork are the contexts of the work done. */
+	ThreadItTraceContext m_theWork[CONTEXT_FAN_OUT];
+	/** m_theWorkCount is the number of work packages done. */
+	volatile LONG m_theWorkCount;
+
+	CContextBack () : CThreadIt ("threadit.CContextBack")
+	{
+		m_theWorkCount = 0;
+		setWorkerMethod ((WorkerMethodType)&CContextBack::work, CONTEXT_BACK_WORK);
+	} // constructor CContextBack
+
+	~CContextBack ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CContextBack
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		LONG theIndex = InterlockedIncrement (&m_theWorkCount) - 1;
+
+		if (theIndex < CONTEXT_FAN_OUT)
+		{
+			getTraceContext (m_theWork[theIndex]);
+		} // if
+		Sleep (CONTEXT_BACK_TIME);
+		CThreadItMessage theReply (CONTEXT_FRONT_REPLY);
+		theReply.sendWithNoReplyTo (pWorkPack->getSource ());
+		pWorkDone = pWorkPack;
+		return true;
+	} // work
+
+}; // class CContextBack
+
+/**
+ * Class CContextFront fans each request out to the back and answers it once the back
+ * has replied to all of it.
+ */
+class CContextFront : public CThreadIt
+{
+public:
+	/** m_ptheBack is the instance the work is sent to. */
+	CContextBack* m_ptheBack;
+	/** m_theRequest is the context of the request. */
+	ThreadItTraceContext m_theRequest;
+	/** m_theReplies are the contexts of the replies. */
+	ThreadItTraceContext m_theReplies[CONTEXT_FAN_OUT];
+	/** m_theReplyCount is the number of replies. */
+	LONG m_theReplyCount;
+
+	CContextFront (CContextBack* ptheBack) : CThreadIt ("threadit.CContextFront")
+	{
+		m_ptheBack = ptheBack;
+		m_theReplyCount = 0;
+		setWorkerMethod ((WorkerMethodType)&CContextFront::request, CONTEXT_FRONT_REQUEST);
+		setWorkerMethod ((WorkerMethodType)&CContextFront::reply, CONTEXT_FRONT_REPLY);
+	} // constructor CContextFront
+
+	~CContextFront ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CContextFront
+
+	bool request (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		getTraceContext (m_theRequest);
+		for (int i = 0; i < CONTEXT_FAN_OUT; i++)
+		{
+			CThreadItMessage theMessage (CONTEXT_BACK_WORK);
+			theMessage.setSourceInfo (this, CONTEXT_FRONT_REPLY);
+			theMessage.sendWithNoReplyTo (m_ptheBack);
+		} // for
+		delete pWorkPack;
+		pWorkDone = NULL;
+		return true;
+	} // request
+
+	bool reply (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		if (m_theReplyCount < CONTEXT_FAN_OUT)
+		{
+			getTraceContext (m_theReplies[m_theReplyCount]);
+		} // if
+		m_theReplyCount++;
+		pWorkDone = pWorkPack;
+		// The last reply answers the client.
+		pWorkDone->m_isSendResult = (m_theReplyCount == CONTEXT_FAN_OUT);
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // reply
+
+}; // class CContextFront
+
+/**
+ * Test_Context_propagation checks that the messages sent while a request is processed
+ * carry its trace ID and that the spans form a tree of hops.
+ */
+TEST (Test_Context_propagation)
+{
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	ThreadItTraceContext theContext;
+	CContextBack theBack;
+	CContextFront theFront (&theBack);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItContext"));
+	logger->info ("Testing - Test_Context_propagation");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CHECK (!CThreadIt::getTraceContext (theContext));
+	ptheWorkPack = new CWorkPackIt ();
+	ptheWorkPack->m_theInstruction = CONTEXT_FRONT_REQUEST;
+	theFront.startWork (ptheWorkPack, theWorkPackId);
+	ptheWorkPack = theFront.getWork (5000);
+	CHECK (ptheWorkPack != NULL);
+	if (ptheWorkPack != NULL)
+	{
+		// The answer is a span of the same request.
+		CHECK (ptheWorkPack->m_theTraceContext.theTraceId == theFront.m_theRequest.theTraceId);
+		delete ptheWorkPack;
+	} // if
+	CHECK (theFront.m_theRequest.theTraceId != 0);
+	CHECK_EQUAL (0u, theFront.m_theRequest.theParentSpanId);
+	CHECK_EQUAL (0u, theFront.m_theRequest.theHopCount);
+	CHECK_EQUAL ((ULONG)CONTEXT_FRONT_REQUEST, theFront.m_theRequest.theRequestType);
+	CHECK_EQUAL (CONTEXT_FAN_OUT, theBack.m_theWorkCount);
+	for (int i = 0; i < CONTEXT_FAN_OUT; i++)
+	{
+		CHECK (theBack.m_theWork[i].theTraceId == theFront.m_theRequest.theTraceId);
+		CHECK_EQUAL (theFront.m_theRequest.theSpanId, theBack.m_theWork[i].theParentSpanId);
+		CHECK_EQUAL (1u, theBack.m_theWork[i].theHopCount);
+		CHECK_EQUAL ((ULONG)CONTEXT_FRONT_REQUEST, theBack.m_theWork[i].theRequestType);
+		CHECK (theBack.m_theWork[i].theOriginTime == theFront.m_theRequest.theOriginTime);
+		CHECK (theFront.m_theReplies[i].theTraceId == theFront.m_theRequest.theTraceId);
+		CHECK_EQUAL (2u, theFront.m_theReplies[i].theHopCount);
+		CHECK ((theFront.m_theReplies[i].theParentSpanId == theBack.m_theWork[0].theSpanId) ||
+			(theFront.m_theReplies[i].theParentSpanId == theBack.m_theWork[1].theSpanId));
+	} // for
+	CHECK (theBack.m_theWork[0].theSpanId != theBack.m_theWork[1].theSpanId);
+} // TEST (Test_Context_propagation)
+
+/**
+ * Test_Context_criticalPath checks that a request is counted once its last span has
+ * ended, with the time, hops and spans of its critical path.
+ */
+TEST (Test_Context_criticalPath)
+{
+	const ULONG theRequests = 3;
+	ULONG theWorkPackId = 0;
+	ULONG theReceived = 0;
+	DWORD theStart = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CThreadItCriticalPathStats theStats;
+	CContextBack theBack;
+	CContextFront theFront (&theBack);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItContext"));
+	logger->info ("Testing - Test_Context_criticalPath");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CThreadItCriticalPath::reset ();
+	CThreadItCriticalPath::start ();
+	CHECK (CThreadItCriticalPath::isEnabled ());
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		theFront.m_theReplyCount = 0;
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = CONTEXT_FRONT_REQUEST;
+		theFront.startWork (ptheWorkPack, theWorkPackId);
+		ptheWorkPack = theFront.getWork (5000);
+		if (ptheWorkPack != NULL)
+		{
+			theReceived++;
+			delete ptheWorkPack;
+		} // if
+	} // for
+	CHECK_EQUAL (theRequests, theReceived);
+	// The last span ends just after its answer is sent.
+	theStart = GetTickCount ();
+	while ((CThreadItCriticalPath::getOpenCount () > 0) && ((GetTickCount () - theStart) < 2000))
+	{
+		Sleep (1);
+	} // while
+	CHECK_EQUAL (0u, CThreadItCriticalPath::getOpenCount ());
+	CHECK (CThreadItCriticalPath::getStats (CONTEXT_FRONT_REQUEST, theStats));
+	logger->infoStream () << "critical path p50 " << theStats.m_theLatency.getPercentile (50.0) << "us max " << theStats.m_theLatency.getMax () << "us";
+	CHECK_EQUAL (theRequests, theStats.m_theLatency.getCount ());
+	// The two messages to the back are done one after the other.
+	CHECK (theStats.m_theLatency.getPercentile (0.0) >= (CONTEXT_FAN_OUT * CONTEXT_BACK_TIME - 5) * 1000);
+	CHECK_EQUAL (2, theStats.m_theHops.getMax ());
+	CHECK_EQUAL (1 + 2 * CONTEXT_FAN_OUT, theStats.m_theSpans.getMax ());
+	CHECK (!CThreadItCriticalPath::getStats (CONTEXT_BACK_WORK + 100, theStats));
+	CThreadItCriticalPath::stop ();
+	CHECK (!CThreadItCriticalPath::isEnabled ());
+	CThreadItCriticalPath::reset ();
+} // TEST (Test_Context_criticalPath)
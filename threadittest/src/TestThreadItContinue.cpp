@@ -0,0 +1,251 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItContinue
+ * Description: TestThreadItContinue contains unit tests for the time checks made by
+ * worker methods with CThreadIt::isTimeLeft and for work packages that return the
+ * status WORKDONE_CONTINUE to let waiting work through before they carry on.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+#include "threadithistogram.h"
+
+/** SLICED_LONG_WORK is a long work instruction done in steps. */
+#define SLICED_LONG_WORK 1
+/** SLICED_QUICK_WORK is a short work instruction. */
+#define SLICED_QUICK_WORK 2
+/** SLICED_BUDGET_WORK works until its time runs out. */
+#define SLICED_BUDGET_WORK 3
+/** SLICED_STEPS is the number of one millisecond steps of the long work. */
+#define SLICED_STEPS 200
+
+/**
+ * Class CSlicedWorker does long work in steps and continues it later when its time
+ * slice runs out.
+ */
+class CSlicedWorker : public CThreadIt
+{
+public:
+	/** m_theRuns is the number of runs of the long work. */
+	volatile LONG m_theRuns;
+	/** m_theSteps is the number of steps taken by the budget work. */
+	volatile LONG m_theSteps;
+
+	CSlicedWorker () : CThreadIt ("threadit.CSlicedWorker")
+	{
+		m_theRuns = 0;
+		m_theSteps = 0;
+		setWorkerMethod ((WorkerMethodType)&CSlicedWorker::longWork, SLICED_LONG_WORK);
+		setWorkerMethod ((WorkerMethodType)&CSlicedWorker::quickWork, SLICED_QUICK_WORK);
+		setWorkerMethod ((WorkerMethodType)&CSlicedWorker::budgetWork, SLICED_BUDGET_WORK);
+	} // constructor CSlicedWorker
+
+	~CSlicedWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CSlicedWorker
+
+	bool longWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		InterlockedIncrement (&m_theRuns);
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		while ((pWorkPack->m_theProgress < SLICED_STEPS) && (pWorkDone->m_theStatus == CThreadIt::THREADIT_STATUS_OK))
+		{
+			if (isTimeLeft (pWorkPack))
+			{
+				Sleep (1);
+				pWorkPack->m_theProgress++;
+			}
+			else
+			{
+				pWorkDone->m_theStatus = CThreadIt::WORKDONE_CONTINUE;
+			} // if
+		} // while
+		return true;
+	} // longWork
+
+	bool quickWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // quickWork
+
+	bool budgetWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		while (isTimeLeft (pWorkPack) && (m_theSteps < 10000))
+		{
+			Sleep (1);
+			m_theSteps++;
+		} // while
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // budgetWork
+
+}; // class CSlicedWorker
+
+/**
+ * Test_ThreadIt_timeLeft checks that isTimeLeft ends the work once the time allowed
+ * of the work package has passed.
+ */
+TEST (Test_ThreadIt_timeLeft)
+{
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CSlicedWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItContinue"));
+	logger->info ("Testing - Test_ThreadIt_timeLeft");
+
+	CHECK_EQUAL (0u, theWorker.getTimeSlice ());
+	ptheWorkPack = new CWorkPackIt ();
+	ptheWorkPack->m_theInstruction = SLICED_BUDGET_WORK;
+	ptheWorkPack->m_theTimeAllowed = 50;
+	ptheWorkPack->m_isSendResult = true;
+	theWorker.startWork (ptheWorkPack, theWorkPackId);
+	ptheWorkPack = theWorker.getWork (5000);
+	CHECK (ptheWorkPack != NULL);
+	if (ptheWorkPack != NULL)
+	{
+		logger->infoStream () << "budget work took " << ptheWorkPack->m_theTimeElapsed << "ms in " << theWorker.m_theSteps << " steps";
+		CHECK_EQUAL ((ULONG)CThreadIt::THREADIT_STATUS_OK, ptheWorkPack->m_theStatus);
+		CHECK (ptheWorkPack->m_theTimeElapsed >= 40);
+		CHECK (ptheWorkPack->m_theTimeElapsed < 1000);
+		CHECK (theWorker.m_theSteps < 10000);
+		delete ptheWorkPack;
+	} // if
+	CHECK_EQUAL (0, theWorker.getContinueCount ());
+} // TEST (Test_ThreadIt_timeLeft)
+
+/**
+ * Test_ThreadIt_continue checks that long work given a time slice lets the work
+ * behind it through and is still finished with all of its progress.
+ */
+TEST (Test_ThreadIt_continue)
+{
+	const ULONG theQuickRequests = 5;
+	ULONG theWorkPackId = 0;
+	ULONG theLongId = 0;
+	ULONG theReceived = 0;
+	ULONG theQuickBeforeLong = 0;
+	bool isLongDone = false;
+	DWORD theStart = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CSlicedWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItContinue"));
+	logger->info ("Testing - Test_ThreadIt_continue");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	theWorker.setTimeSlice (10);
+	CHECK_EQUAL (10u, theWorker.getTimeSlice ());
+	ptheWorkPack = new CWorkPackIt ();
+	ptheWorkPack->m_theInstruction = SLICED_LONG_WORK;
+	ptheWorkPack->m_isSendResult = true;
+	theWorker.startWork (ptheWorkPack, theLongId);
+	for (ULONG i = 0; i < theQuickRequests; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = SLICED_QUICK_WORK;
+		ptheWorkPack->m_isSendResult = true;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+	} // for
+	theStart = GetTickCount ();
+	while ((theReceived < (theQuickRequests + 1)) && ((GetTickCount () - theStart) < 5000))
+	{
+		ptheWorkPack = theWorker.getWork (100);
+		if (ptheWorkPack != NULL)
+		{
+			theReceived++;
+			if (ptheWorkPack->m_theWorkPackID == theLongId)
+			{
+				CHECK_EQUAL ((ULONG)CThreadIt::THREADIT_STATUS_OK, ptheWorkPack->m_theStatus);
+				CHECK_EQUAL ((ULONG)SLICED_STEPS, ptheWorkPack->m_theProgress);
+				isLongDone = true;
+			}
+			else if (!isLongDone)
+			{
+				theQuickBeforeLong++;
+			} // if
+			delete ptheWorkPack;
+		} // if
+	} // while
+	logger->infoStream () << "long work ran " << theWorker.m_theRuns << " times, continued " << theWorker.getContinueCount () << " times";
+	CHECK_EQUAL (theQuickRequests + 1, theReceived);
+	CHECK (isLongDone);
+	CHECK_EQUAL (theQuickRequests, theQuickBeforeLong);
+	CHECK (theWorker.getContinueCount () > 1);
+	CHECK_EQUAL (theWorker.getContinueCount () + 1, theWorker.m_theRuns);
+} // TEST (Test_ThreadIt_continue)
+
+/**
+ * Test_ThreadIt_continueLatency checks that the end to end latency and the elapsed
+ * time of work that continued cover all of its runs rather than the last one.
+ */
+TEST (Test_ThreadIt_continueLatency)
+{
+	ULONG theWorkPackId = 0;
+	DWORD theStart = 0;
+	DWORD theTotal = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CThreadItLatencyStats theStats;
+	CSlicedWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItContinue"));
+	logger->info ("Testing - Test_ThreadIt_continueLatency");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	theWorker.setTimeSlice (10);
+	ptheWorkPack = new CWorkPackIt ();
+	ptheWorkPack->m_theInstruction = SLICED_LONG_WORK;
+	ptheWorkPack->m_isSendResult = true;
+	theStart = GetTickCount ();
+	theWorker.startWork (ptheWorkPack, theWorkPackId);
+	ptheWorkPack = theWorker.getWork (5000);
+	theTotal = GetTickCount () - theStart;
+	CHECK (ptheWorkPack != NULL);
+	if (ptheWorkPack != NULL)
+	{
+		logger->infoStream () << "long work took " << theTotal << "ms with " << ptheWorkPack->m_theTimeElapsed << "ms elapsed in "
+			<< theWorker.m_theRuns << " runs";
+		CHECK_EQUAL ((ULONG)SLICED_STEPS, ptheWorkPack->m_theProgress);
+		CHECK (theWorker.getContinueCount () > 1);
+		// Each step sleeps for at least a millisecond. The elapsed time is the sum of the
+		// runs measured with the tick count, which allows for its resolution.
+		CHECK (ptheWorkPack->m_theTimeElapsed >= (SLICED_STEPS * 3) / 4);
+		delete ptheWorkPack;
+	} // if
+	CHECK (theWorker.getStats (SLICED_LONG_WORK, theStats));
+	CHECK_EQUAL (1u, (ULONG)theStats.m_theEndToEnd.getCount ());
+	CHECK (theStats.m_theEndToEnd.getPercentile (100.0) >= SLICED_STEPS * 1000);
+	// The queue wait is recorded for each run.
+	CHECK_EQUAL ((ULONG)theWorker.m_theRuns, (ULONG)theStats.m_theQueueWait.getCount ());
+} // TEST (Test_ThreadIt_continueLatency)
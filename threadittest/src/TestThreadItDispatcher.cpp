@@ -0,0 +1,271 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItDispatcher
+ * Description: TestThreadItDispatcher contains unit tests for the
+ * CThreadItDispatcher class. The policies are checked against a replica that is
+ * blocked and the tail latency of each policy is logged for replicas with
+ * different service times.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <algorithm>
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threaditdispatcher.h"
+
+/** REPLICA_WORK is the work instruction processed by the replicas. */
+#define REPLICA_WORK  1
+
+/** The number of replicas. */
+const ULONG theReplicaCount = 4;
+
+/**
+ * Class CRequestItem holds the index of a request.
+ */
+class CRequestItem : public CDataItem
+{
+public:
+	ULONG m_theIndex;
+
+	CRequestItem (ULONG theIndex) : m_theIndex (theIndex)
+	{
+	} // constructor CRequestItem
+
+}; // class CRequestItem
+
+/**
+ * Class CReplicaWorker busy waits for its service time and records the latency of
+ * each request from the time it was queued.
+ */
+class CReplicaWorker : public CThreadIt
+{
+public:
+	/** m_theServiceTime is the time taken by each request in performance counter ticks. */
+	LONGLONG m_theServiceTime;
+	/** m_ptheLatencies receives the latency of each request in microseconds. */
+	std::vector<LONGLONG>* m_ptheLatencies;
+	/** m_theBlock is waited on before each request if it is not NULL. */
+	HANDLE m_theBlock;
+	/** m_theProcessed is the number of requests processed. */
+	volatile LONG m_theProcessed;
+	/** m_theFrequency is the performance counter frequency. */
+	LONGLONG m_theFrequency;
+
+	CReplicaWorker (LONG theServiceMicroseconds) : CThreadIt ("threadit.CReplicaWorker")
+	{
+		LARGE_INTEGER theFrequency;
+
+		QueryPerformanceFrequency (&theFrequency);
+		m_theFrequency = theFrequency.QuadPart;
+		m_theServiceTime = (m_theFrequency * theServiceMicroseconds) / 1000000;
+		m_ptheLatencies = NULL;
+		m_theBlock = NULL;
+		m_theProcessed = 0;
+		setWorkerMethod ((WorkerMethodType)&CReplicaWorker::work, REPLICA_WORK);
+	} // constructor CReplicaWorker
+
+	~CReplicaWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CReplicaWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		LARGE_INTEGER theStart;
+		LARGE_INTEGER theNow;
+		CRequestItem* ptheRequest = (CRequestItem*)pWorkPack->m_ptheDataItem.get ();
+
+		if (m_theBlock != NULL)
+		{
+			WaitForSingleObject (m_theBlock, INFINITE);
+		} // if
+		QueryPerformanceCounter (&theStart);
+		do
+		{
+			QueryPerformanceCounter (&theNow);
+		} while (theNow.QuadPart - theStart.QuadPart < m_theServiceTime);
+		if ((m_ptheLatencies != NULL) && (ptheRequest != NULL))
+		{
+			(*m_ptheLatencies)[ptheRequest->m_theIndex] = ((theNow.QuadPart - pWorkPack->m_theEnqueueTime) * 1000000) / m_theFrequency;
+		} // if
+		pWorkDone = NULL;
+		delete pWorkPack;
+		InterlockedIncrement (&m_theProcessed);
+		return true;
+	} // work
+
+}; // class CReplicaWorker
+
+/**
+ * Method getProcessed returns the number of requests processed by the replicas.
+ */
+static LONG getProcessed (CThreadItDispatcher& theDispatcher)
+{
+	LONG theProcessed = 0;
+
+	for (ULONG theReplica = 0; theReplica < theDispatcher.getReplicaCount (); theReplica++)
+	{
+		theProcessed += ((CReplicaWorker*)theDispatcher.getReplica (theReplica).get ())->m_theProcessed;
+	} // for
+	return theProcessed;
+} // getProcessed
+
+/**
+ * Method getOtherDepth returns the number of requests queued by all but the first replica.
+ */
+static LONG getOtherDepth (CThreadItDispatcher& theDispatcher)
+{
+	LONG theDepth = 0;
+
+	for (ULONG theReplica = 1; theReplica < theDispatcher.getReplicaCount (); theReplica++)
+	{
+		theDepth += theDispatcher.getReplica (theReplica)->getWorkQDepth ();
+	} // for
+	return theDepth;
+} // getOtherDepth
+
+/**
+ * Method waitForProcessed waits for the replicas to process theCount requests.
+ */
+static bool waitForProcessed (CThreadItDispatcher& theDispatcher, LONG theCount, DWORD theTimeOut)
+{
+	DWORD theStart = GetTickCount ();
+
+	while ((getProcessed (theDispatcher) < theCount) && ((GetTickCount () - theStart) < theTimeOut))
+	{
+		Sleep (1);
+	} // while
+	return (getProcessed (theDispatcher) >= theCount);
+} // waitForProcessed
+
+/**
+ * Test_ThreadItDispatcher_policies checks that round robin shares the requests
+ * evenly and that the depth based policies avoid a replica that is blocked.
+ */
+TEST (Test_ThreadItDispatcher_policies)
+{
+	const ULONG theRequests = 400;
+	HANDLE theBlock = CreateEvent (NULL, TRUE, FALSE, NULL);
+	LONG theProcessed = 0;
+	CThreadItDispatcher theDispatcher (CThreadItDispatcher::DISPATCH_ROUND_ROBIN);
+	CReplicaWorker* ptheBlocked = NULL;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItDispatcher"));
+	logger->info ("Testing - Test_ThreadItDispatcher_policies");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CHECK (!theDispatcher.sendMessage (REPLICA_WORK, (void*)NULL));
+	for (ULONG theReplica = 0; theReplica < theReplicaCount; theReplica++)
+	{
+		theDispatcher.addReplica (ThreadItPtr (new CReplicaWorker (10)));
+	} // for
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		CHECK (theDispatcher.sendMessage (REPLICA_WORK, DataItemPtr (new CRequestItem (i))));
+	} // for
+	CHECK (waitForProcessed (theDispatcher, theRequests, 5000));
+	for (ULONG theReplica = 0; theReplica < theReplicaCount; theReplica++)
+	{
+		CHECK_EQUAL ((LONG)(theRequests / theReplicaCount), ((CReplicaWorker*)theDispatcher.getReplica (theReplica).get ())->m_theProcessed);
+	} // for
+	// Block the first replica and check that the depth based policies pass it by.
+	ptheBlocked = (CReplicaWorker*)theDispatcher.getReplica (0).get ();
+	ptheBlocked->m_theBlock = theBlock;
+	for (LONG thePolicy = CThreadItDispatcher::DISPATCH_LEAST_DEPTH; thePolicy < CThreadItDispatcher::DISPATCH_LAST; thePolicy++)
+	{
+		theDispatcher.setPolicy ((CThreadItDispatcher::DispatchPolicy)thePolicy);
+		CHECK_EQUAL (thePolicy, (LONG)theDispatcher.getPolicy ());
+		theProcessed = getProcessed (theDispatcher);
+		for (ULONG i = 0; i < theRequests; i++)
+		{
+			CHECK (theDispatcher.sendMessage (REPLICA_WORK, DataItemPtr (new CRequestItem (i))));
+			// Let the other replicas catch up so that only the blocked replica has a queue.
+			while (getOtherDepth (theDispatcher) > 0)
+			{
+				Sleep (0);
+			} // while
+		} // for
+		logger->infoStream () << CThreadItDispatcher::toPolicyStr ((CThreadItDispatcher::DispatchPolicy)thePolicy)
+			<< ": blocked replica queue depth " << ptheBlocked->getWorkQDepth ();
+		CHECK (ptheBlocked->getWorkQDepth () < 4);
+		// Release the blocked replica so that the requests drain.
+		SetEvent (theBlock);
+		CHECK (waitForProcessed (theDispatcher, theProcessed + theRequests, 5000));
+		ResetEvent (theBlock);
+	} // for
+	ptheBlocked->m_theBlock = NULL;
+	SetEvent (theBlock);
+	CloseHandle (theBlock);
+} // TEST (Test_ThreadItDispatcher_policies)
+
+/**
+ * Test_ThreadItDispatcher_tailLatency sends requests at a fixed rate to one slow
+ * and three fast replicas and logs the median and tail latency of each policy.
+ */
+TEST (Test_ThreadItDispatcher_tailLatency)
+{
+	const ULONG theRequests = 20000;
+	const LONG theFastService = 50;
+	const LONG theSlowService = 250;
+	const LONG theInterval = 25;
+	LARGE_INTEGER theFrequency;
+	LARGE_INTEGER theNext;
+	LARGE_INTEGER theNow;
+	LONGLONG theIntervalTicks = 0;
+	std::vector<LONGLONG> theLatencies (theRequests);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItDispatcher"));
+	logger->info ("Testing - Test_ThreadItDispatcher_tailLatency");
+
+	QueryPerformanceFrequency (&theFrequency);
+	theIntervalTicks = (theFrequency.QuadPart * theInterval) / 1000000;
+	for (LONG thePolicy = CThreadItDispatcher::DISPATCH_ROUND_ROBIN; thePolicy < CThreadItDispatcher::DISPATCH_LAST; thePolicy++)
+	{
+		CThreadItDispatcher theDispatcher ((CThreadItDispatcher::DispatchPolicy)thePolicy);
+		for (ULONG theReplica = 0; theReplica < theReplicaCount; theReplica++)
+		{
+			CReplicaWorker* ptheWorker = new CReplicaWorker ((theReplica == 0) ? theSlowService : theFastService);
+			ptheWorker->m_ptheLatencies = &theLatencies;
+			theDispatcher.addReplica (ThreadItPtr (ptheWorker));
+		} // for
+		QueryPerformanceCounter (&theNext);
+		for (ULONG i = 0; i < theRequests; i++)
+		{
+			// Send at a fixed rate so that a slow replica builds a queue.
+			do
+			{
+				QueryPerformanceCounter (&theNow);
+			} while (theNow.QuadPart < theNext.QuadPart);
+			theNext.QuadPart += theIntervalTicks;
+			theDispatcher.sendMessage (REPLICA_WORK, DataItemPtr (new CRequestItem (i)));
+		} // for
+		CHECK (waitForProcessed (theDispatcher, theRequests, 60000));
+		std::sort (theLatencies.begin (), theLatencies.end ());
+		logger->infoStream () << CThreadItDispatcher::toPolicyStr ((CThreadItDispatcher::DispatchPolicy)thePolicy)
+			<< ": p50=" << theLatencies[theRequests / 2] << "us p99=" << theLatencies[(theRequests * 99) / 100]
+			<< "us p99.9=" << theLatencies[(theRequests * 999) / 1000] << "us max=" << theLatencies[theRequests - 1] << "us";
+	} // for
+} // TEST (Test_ThreadItDispatcher_tailLatency)
@@ -0,0 +1,199 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItFlight
+ * Description: TestThreadItFlight contains unit tests for the flight recorder of the
+ * work packages dispatched by each CThreadIt.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <sstream>
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "strutil.h"
+#include "threadit.h"
+#include "threaditflight.h"
+
+/** FLIGHT_QUICK_WORK returns at once. */
+#define FLIGHT_QUICK_WORK 1
+/** FLIGHT_STUCK_WORK waits until it is released. */
+#define FLIGHT_STUCK_WORK 2
+/** FLIGHT_QUICK_COUNT is the number of quick work packages sent, which is more than a slot holds. */
+#define FLIGHT_QUICK_COUNT (THREADIT_FLIGHT_RECORDS + 10)
+
+/**
+ * Class CFlightWorker does quick work and work that gets stuck.
+ */
+class CFlightWorker : public CThreadIt
+{
+public:
+	/** m_theRelease releases the stuck work. */
+	HANDLE m_theRelease;
+	/** m_isStuck is true while the stuck work is in progress. */
+	volatile bool m_isStuck;
+
+	CFlightWorker () : CThreadIt ("threadit.CFlightWorker")
+	{
+		m_theRelease = CreateEvent (NULL, TRUE, FALSE, NULL);
+		m_isStuck = false;
+		setWorkerMethod ((WorkerMethodType)&CFlightWorker::quickWork, FLIGHT_QUICK_WORK);
+		setWorkerMethod ((WorkerMethodType)&CFlightWorker::stuckWork, FLIGHT_STUCK_WORK);
+	} // constructor CFlightWorker
+
+	~CFlightWorker ()
+	{
+		SetEvent (m_theRelease);
+		stopThread ();
+		waitForThreadToStop ();
+		CloseHandle (m_theRelease);
+	} // ~CFlightWorker
+
+	bool quickWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // quickWork
+
+	bool stuckWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		m_isStuck = true;
+		WaitForSingleObject (m_theRelease, 5000);
+		m_isStuck = false;
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // stuckWork
+
+}; // class CFlightWorker
+
+/**
+ * Test_Flight_records checks that the last work packages of an instance are kept and
+ * that the work package in progress shows as running.
+ */
+TEST (Test_Flight_records)
+{
+	ULONG theWorkPackId = 0;
+	ULONG theStuckId = 0;
+	ULONG theReceived = 0;
+	DWORD theStart = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	std::ostringstream theText;
+	std::ostringstream theRunning;
+	std::ostringstream theDone;
+	CFlightWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItFlight"));
+	logger->info ("Testing - Test_Flight_records");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CHECK (CThreadItFlightRecorder::isAvailable ());
+	for (ULONG i = 0; i < FLIGHT_QUICK_COUNT; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = FLIGHT_QUICK_WORK;
+		ptheWorkPack->m_isSendResult = true;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+	} // for
+	theStart = GetTickCount ();
+	while ((theReceived < FLIGHT_QUICK_COUNT) && ((GetTickCount () - theStart) < 5000))
+	{
+		ptheWorkPack = theWorker.getWork (100);
+		if (ptheWorkPack != NULL)
+		{
+			theReceived++;
+			delete ptheWorkPack;
+		} // if
+	} // while
+	CHECK_EQUAL ((ULONG)FLIGHT_QUICK_COUNT, theReceived);
+	ptheWorkPack = new CWorkPackIt ();
+	ptheWorkPack->m_theInstruction = FLIGHT_STUCK_WORK;
+	ptheWorkPack->m_isSendResult = true;
+	theWorker.startWork (ptheWorkPack, theStuckId);
+	theStart = GetTickCount ();
+	while ((!theWorker.m_isStuck) && ((GetTickCount () - theStart) < 2000))
+	{
+		Sleep (1);
+	} // while
+	CThreadItFlightRecorder::write (theText);
+	logger->info (theText.str ());
+	CHECK (theText.str ().find ("threadit.CFlightWorker.CThreadIt thread " + strutil::toString (theWorker.getThreadId ())) != std::string::npos);
+	CHECK (theText.str ().find (strutil::toString (FLIGHT_QUICK_COUNT + 1) + " work packages") != std::string::npos);
+	// The stuck work package is the one in progress.
+	theRunning << "instruction " << FLIGHT_STUCK_WORK << " work pack " << theStuckId << " source 0x0 running\n";
+	CHECK (theText.str ().find (theRunning.str ()) != std::string::npos);
+	SetEvent (theWorker.m_theRelease);
+	ptheWorkPack = theWorker.getWork (5000);
+	CHECK (ptheWorkPack != NULL);
+	delete ptheWorkPack;
+	theText.str ("");
+	CThreadItFlightRecorder::write (theText);
+	theDone << "instruction " << FLIGHT_STUCK_WORK << " work pack " << theStuckId << " source 0x0 status " << CThreadIt::THREADIT_STATUS_OK << " ";
+	CHECK (theText.str ().find (theDone.str ()) != std::string::npos);
+} // TEST (Test_Flight_records)
+
+/**
+ * Test_Flight_region checks that the region can be opened by name as another process
+ * would and that it can be saved to a file.
+ */
+TEST (Test_Flight_region)
+{
+	HANDLE theMapping = NULL;
+	HANDLE theFile = INVALID_HANDLE_VALUE;
+	const CThreadItFlightRecorder::FlightHeader* ptheHeader = NULL;
+	std::string theFileName = "threadit.flight." + strutil::toString (GetCurrentProcessId ()) + ".bin";
+	CFlightWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItFlight"));
+	logger->info ("Testing - Test_Flight_region");
+
+	theMapping = OpenFileMappingA (FILE_MAP_READ, FALSE, CThreadItFlightRecorder::getMappingName (GetCurrentProcessId ()).c_str ());
+	CHECK (theMapping != NULL);
+	if (theMapping != NULL)
+	{
+		ptheHeader = (const CThreadItFlightRecorder::FlightHeader*)MapViewOfFile (theMapping, FILE_MAP_READ, 0, 0, 0);
+		CHECK (ptheHeader != NULL);
+		if (ptheHeader != NULL)
+		{
+			CHECK_EQUAL ((DWORD)THREADIT_FLIGHT_MAGIC, ptheHeader->theMagic);
+			CHECK_EQUAL ((DWORD)THREADIT_FLIGHT_VERSION, ptheHeader->theVersion);
+			CHECK_EQUAL (GetCurrentProcessId (), ptheHeader->theProcessId);
+			CHECK_EQUAL ((DWORD)THREADIT_FLIGHT_RECORDS, ptheHeader->theRecordCount);
+			CHECK_EQUAL ((DWORD)sizeof (CThreadItFlightRecorder::FlightSlot), ptheHeader->theSlotSize);
+			UnmapViewOfFile (ptheHeader);
+		} // if
+		CloseHandle (theMapping);
+	} // if
+	CHECK (CThreadItFlightRecorder::save (theFileName));
+	theFile = CreateFileA (theFileName.c_str (), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	CHECK (theFile != INVALID_HANDLE_VALUE);
+	if (theFile != INVALID_HANDLE_VALUE)
+	{
+		CHECK_EQUAL ((DWORD)(sizeof (CThreadItFlightRecorder::FlightHeader) + THREADIT_FLIGHT_SLOTS * sizeof (CThreadItFlightRecorder::FlightSlot)), GetFileSize (theFile, NULL));
+		CloseHandle (theFile);
+	} // if
+	DeleteFileA (theFileName.c_str ());
+	CHECK (CThreadItFlightRecorder::installCrashHandler (theFileName));
+	CThreadItFlightRecorder::removeCrashHandler ();
+} // TEST (Test_Flight_region)
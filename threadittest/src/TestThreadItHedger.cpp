@@ -0,0 +1,334 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItHedger
+ * Description: TestThreadItHedger contains unit tests for the CThreadItHedger
+ * class. Requests are sent to replicas that stall now and then to check that the
+ * slow requests are hedged within the budget, that each result is returned once
+ * and that instructions that are not idempotent are never hedged. Work packages
+ * that carry an object or name a completion are checked to be processed safely.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <vector>
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadithedger.h"
+
+/** HEDGE_READ is an idempotent work instruction. */
+#define HEDGE_READ  1
+/** HEDGE_WRITE is a work instruction that must not be hedged. */
+#define HEDGE_WRITE 2
+/** HEDGE_OBJECT is an idempotent work instruction whose object is freed by the replica. */
+#define HEDGE_OBJECT 3
+
+/** The number of replicas. */
+const ULONG theHedgeReplicas = 4;
+
+/**
+ * Class CHedgeItem holds the index of a request.
+ */
+class CHedgeItem : public CDataItem
+{
+public:
+	ULONG m_theIndex;
+
+	CHedgeItem (ULONG theIndex) : m_theIndex (theIndex)
+	{
+	} // constructor CHedgeItem
+
+}; // class CHedgeItem
+
+/**
+ * Class CHedgeWorker returns each work package as its result and stalls on every
+ * m_theStallEvery work package it processes.
+ */
+class CHedgeWorker : public CThreadIt
+{
+public:
+	/** m_theStallEvery is the interval between stalls in work packages. */
+	ULONG m_theStallEvery;
+	/** m_theStallTime is the length of a stall in milliseconds. */
+	DWORD m_theStallTime;
+	/** m_theCount is the number of work packages processed by the thread. */
+	ULONG m_theCount;
+	/** m_theProcessed is the number of work packages processed. */
+	volatile LONG m_theProcessed;
+	/** m_theFreed is the number of objects freed. */
+	volatile LONG m_theFreed;
+
+	CHedgeWorker (ULONG theStallEvery, DWORD theStallTime) : CThreadIt ("threadit.CHedgeWorker")
+	{
+		m_theStallEvery = theStallEvery;
+		m_theStallTime = theStallTime;
+		m_theCount = 0;
+		m_theProcessed = 0;
+		m_theFreed = 0;
+		setWorkerMethod ((WorkerMethodType)&CHedgeWorker::work, HEDGE_READ);
+		setWorkerMethod ((WorkerMethodType)&CHedgeWorker::work, HEDGE_WRITE);
+		setWorkerMethod ((WorkerMethodType)&CHedgeWorker::release, HEDGE_OBJECT);
+	} // constructor CHedgeWorker
+
+	~CHedgeWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CHedgeWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		m_theCount++;
+		if ((m_theCount % m_theStallEvery) == 0)
+		{
+			Sleep (m_theStallTime);
+		} // if
+		// The work package is returned as the result.
+		pWorkDone = pWorkPack;
+		InterlockedIncrement (&m_theProcessed);
+		return true;
+	} // work
+
+	bool release (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		// The object belongs to the replica that processes the work package.
+		delete (ULONG*)pWorkPack->m_ptheObject;
+		pWorkPack->m_ptheObject = NULL;
+		InterlockedIncrement (&m_theFreed);
+		return work (pWorkPack, pWorkDone);
+	} // release
+
+}; // class CHedgeWorker
+
+/**
+ * Class CHedgeCompletion counts the calls for each completion tag.
+ */
+class CHedgeCompletion : public CThreadItCompletion
+{
+public:
+	/** m_theCalls is the number of calls for each tag. */
+	std::vector<LONG> m_theCalls;
+
+	CHedgeCompletion (ULONG theCount) : m_theCalls (theCount)
+	{
+	} // constructor CHedgeCompletion
+
+	virtual void onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess)
+	{
+		if (theTag < m_theCalls.size ())
+		{
+			InterlockedIncrement (&m_theCalls[theTag]);
+		} // if
+	} // onWorkDone
+
+}; // class CHedgeCompletion
+
+/**
+ * Method sendRequests sends theCount requests through the hedger and checks that
+ * each result is returned once with the identity given by startWork.
+ */
+static void sendRequests (CThreadItHedger& theHedger, UINT theInstruction, ULONG theCount)
+{
+	ULONG theWorkPackId = 0;
+	ULONG theReceived = 0;
+	DWORD theStart = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CHedgeItem* ptheItem = NULL;
+	WorkPackItQ theResults;
+	std::vector<ULONG> theWorkPackIds (theCount);
+	std::vector<ULONG> theReceivedCount (theCount);
+
+	for (ULONG i = 0; i < theCount; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = theInstruction;
+		ptheWorkPack->m_ptheDataItem = DataItemPtr (new CHedgeItem (i));
+		ptheWorkPack->m_isSendResult = true;
+		ptheWorkPack->m_isUseDefaultQ = false;
+		ptheWorkPack->m_ptheWorkDoneQ = &theResults;
+		CHECK (theHedger.startWork (ptheWorkPack, theWorkPackId));
+		theWorkPackIds[i] = theWorkPackId;
+		// Pace the requests so that the replicas are not kept busy.
+		Sleep (1);
+	} // for
+	theStart = GetTickCount ();
+	while ((theReceived < theCount) && ((GetTickCount () - theStart) < 5000))
+	{
+		ptheWorkPack = theResults.waitItem (100);
+		if (ptheWorkPack != NULL)
+		{
+			ptheItem = (CHedgeItem*)ptheWorkPack->m_ptheDataItem.get ();
+			theReceivedCount[ptheItem->m_theIndex]++;
+			CHECK_EQUAL (theWorkPackIds[ptheItem->m_theIndex], ptheWorkPack->m_theWorkPackID);
+			theReceived++;
+			delete ptheWorkPack;
+		} // if
+	} // while
+	CHECK_EQUAL (theCount, theReceived);
+	// Wait for the losing copies to complete and check that their results were discarded.
+	theStart = GetTickCount ();
+	while ((theHedger.getOutstandingCount () > 0) && ((GetTickCount () - theStart) < 5000))
+	{
+		Sleep (1);
+	} // while
+	CHECK_EQUAL (0u, theHedger.getOutstandingCount ());
+	CHECK (theResults.getItem () == NULL);
+	for (ULONG i = 0; i < theCount; i++)
+	{
+		CHECK_EQUAL (1u, theReceivedCount[i]);
+	} // for
+} // sendRequests
+
+/**
+ * Test_ThreadItHedger_hedge checks that the requests to a stalled replica are hedged
+ * within the budget and that instructions that are not idempotent are not hedged.
+ */
+TEST (Test_ThreadItHedger_hedge)
+{
+	const ULONG theRequests = 600;
+	LONG theHedgesIssued = 0;
+	CThreadItHedger theHedger;
+	CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+	ULONG theWorkPackId = 0;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItHedger"));
+	logger->info ("Testing - Test_ThreadItHedger_hedge");
+
+	UNITTEST_TIME_CONSTRAINT (30000);
+
+	CHECK (!theHedger.startWork (ptheWorkPack, theWorkPackId));
+	delete ptheWorkPack;
+	CHECK (theHedger.setIdempotent (HEDGE_READ, true));
+	CHECK (!theHedger.setIdempotent (CThreadIt::MAX_WORK_METHODS, true));
+	CHECK (theHedger.isIdempotent (HEDGE_READ));
+	CHECK (!theHedger.isIdempotent (HEDGE_WRITE));
+	for (ULONG theReplica = 0; theReplica < theHedgeReplicas; theReplica++)
+	{
+		theHedger.addReplica (ThreadItPtr (new CHedgeWorker (20, 100)));
+	} // for
+	sendRequests (theHedger, HEDGE_READ, theRequests);
+	theHedgesIssued = theHedger.getHedgesIssued ();
+	logger->infoStream () << "requests " << theHedger.getRequestCount () << " hedges issued " << theHedgesIssued
+		<< " hedges won " << theHedger.getHedgesWon () << " hedge delay " << theHedger.getHedgeDelay () << "us";
+	CHECK_EQUAL ((LONG)theRequests, theHedger.getRequestCount ());
+	CHECK (theHedgesIssued > 0);
+	CHECK (theHedgesIssued <= (LONG)(theRequests * 5) / 100);
+	CHECK (theHedger.getHedgesWon () > 0);
+	CHECK (theHedger.getHedgesWon () <= theHedgesIssued);
+	// The replicas still stall but writes must not be hedged.
+	sendRequests (theHedger, HEDGE_WRITE, theRequests / 2);
+	CHECK_EQUAL (theHedgesIssued, theHedger.getHedgesIssued ());
+} // TEST (Test_ThreadItHedger_hedge)
+
+/**
+ * Test_ThreadItHedger_unsafe checks that work packages that carry an object are
+ * not hedged so that the object is freed once, that the completion named by a
+ * work package is called once for each request and that a work package whose
+ * result goes to the default queue is not hedged.
+ */
+TEST (Test_ThreadItHedger_unsafe)
+{
+	const ULONG theRequests = 200;
+	LONG theHedgesIssued = 0;
+	LONG theFreed = 0;
+	ULONG theWorkPackId = 0;
+	DWORD theStart = 0;
+	CThreadItHedger theHedger;
+	CHedgeCompletion theCompletion (theRequests);
+	CWorkPackIt* ptheWorkPack = NULL;
+	WorkPackItQ theResults;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItHedger"));
+	logger->info ("Testing - Test_ThreadItHedger_unsafe");
+
+	UNITTEST_TIME_CONSTRAINT (30000);
+
+	CHECK (theHedger.setIdempotent (HEDGE_READ, true));
+	CHECK (theHedger.setIdempotent (HEDGE_OBJECT, true));
+	for (ULONG theReplica = 0; theReplica < theHedgeReplicas; theReplica++)
+	{
+		theHedger.addReplica (ThreadItPtr (new CHedgeWorker (20, 100)));
+	} // for
+	// Learn the latency so that slow requests would be hedged.
+	sendRequests (theHedger, HEDGE_READ, theRequests);
+	CHECK (theHedger.getHedgeDelay () > 0);
+	theHedgesIssued = theHedger.getHedgesIssued ();
+	// A raw object cannot be shared by two copies.
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = HEDGE_OBJECT;
+		ptheWorkPack->m_ptheObject = new ULONG (i);
+		ptheWorkPack->m_ptheCompletion = &theCompletion;
+		ptheWorkPack->m_theCompletionTag = i;
+		ptheWorkPack->m_isSendResult = true;
+		ptheWorkPack->m_isUseDefaultQ = false;
+		ptheWorkPack->m_ptheWorkDoneQ = &theResults;
+		CHECK (theHedger.startWork (ptheWorkPack, theWorkPackId));
+		Sleep (1);
+	} // for
+	theStart = GetTickCount ();
+	while ((theHedger.getOutstandingCount () > 0) && ((GetTickCount () - theStart) < 5000))
+	{
+		Sleep (1);
+	} // while
+	CHECK_EQUAL (0u, theHedger.getOutstandingCount ());
+	CHECK_EQUAL (theHedgesIssued, theHedger.getHedgesIssued ());
+	for (ULONG theReplica = 0; theReplica < theHedgeReplicas; theReplica++)
+	{
+		theFreed += ((CHedgeWorker*)theHedger.getReplica (theReplica).get ())->m_theFreed;
+	} // for
+	CHECK_EQUAL ((LONG)theRequests, theFreed);
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		CHECK_EQUAL (1, theCompletion.m_theCalls[i]);
+		ptheWorkPack = theResults.getItem ();
+		CHECK (ptheWorkPack != NULL);
+		if (ptheWorkPack != NULL)
+		{
+			CHECK (ptheWorkPack->m_ptheObject == NULL);
+			delete ptheWorkPack;
+		} // if
+	} // for
+	// A result sent to the default queue of a replica is not hedged.
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = HEDGE_READ;
+		ptheWorkPack->m_isSendResult = true;
+		CHECK (theHedger.startWork (ptheWorkPack, theWorkPackId));
+		Sleep (1);
+	} // for
+	theStart = GetTickCount ();
+	while ((theHedger.getOutstandingCount () > 0) && ((GetTickCount () - theStart) < 5000))
+	{
+		Sleep (1);
+	} // while
+	CHECK_EQUAL (theHedgesIssued, theHedger.getHedgesIssued ());
+	for (ULONG theReplica = 0; theReplica < theHedgeReplicas; theReplica++)
+	{
+		while ((ptheWorkPack = theHedger.getReplica (theReplica)->getWork (0)) != NULL)
+		{
+			delete ptheWorkPack;
+		} // while
+	} // for
+} // TEST (Test_ThreadItHedger_unsafe)
@@ -0,0 +1,329 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItHistogram
+ * Description: TestThreadItHistogram contains unit tests for the log-linear buckets
+ * and percentiles of CThreadItHistogram and for the latency histograms that a
+ * CThreadIt keeps for each instruction (see CThreadIt::getStats). The cost of
+ * recording a time is logged.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+#include "threadithistogram.h"
+
+/** HISTOGRAM_QUICK_WORK returns at once. */
+#define HISTOGRAM_QUICK_WORK 1
+/** HISTOGRAM_SLOW_WORK sleeps for HISTOGRAM_SLOW_TIME milliseconds. */
+#define HISTOGRAM_SLOW_WORK 2
+/** HISTOGRAM_SLOW_TIME is the time in milliseconds taken by the slow work. */
+#define HISTOGRAM_SLOW_TIME 20
+/** HISTOGRAM_BUSY_WORK spins for HISTOGRAM_SLOW_TIME milliseconds. */
+#define HISTOGRAM_BUSY_WORK 3
+
+/**
+ * Class CHistogramWorker does quick and slow work.
+ */
+class CHistogramWorker : public CThreadIt
+{
+public:
+	CHistogramWorker () : CThreadIt ("threadit.CHistogramWorker")
+	{
+		setWorkerMethod ((WorkerMethodType)&CHistogramWorker::quickWork, HISTOGRAM_QUICK_WORK);
+		setWorkerMethod ((WorkerMethodType)&CHistogramWorker::slowWork, HISTOGRAM_SLOW_WORK);
+		setWorkerMethod ((WorkerMethodType)&CHistogramWorker::busyWork, HISTOGRAM_BUSY_WORK);
+	} // constructor CHistogramWorker
+
+	~CHistogramWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CHistogramWorker
+
+	bool quickWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // quickWork
+
+	bool slowWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		Sleep (HISTOGRAM_SLOW_TIME);
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // slowWork
+
+	bool busyWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		DWORD theStart = GetTickCount ();
+		volatile ULONG theCount = 0;
+
+		while ((GetTickCount () - theStart) < HISTOGRAM_SLOW_TIME)
+		{
+			theCount++;
+		} // while
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // busyWork
+
+}; // class CHistogramWorker
+
+/**
+ * Test_Histogram_buckets checks that each time falls in a bucket that holds it and
+ * that the buckets are no wider than 1/16 of the times they hold.
+ */
+TEST (Test_Histogram_buckets)
+{
+	ULONG theTime = 0;
+	ULONG theBucket = 0;
+	ULONG theLastBucket = 0;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItHistogram"));
+	logger->info ("Testing - Test_Histogram_buckets");
+
+	for (theTime = 0; theTime < 100000; theTime += 7)
+	{
+		theBucket = CThreadItHistogram::getBucket (theTime);
+		CHECK (theBucket >= theLastBucket);
+		CHECK (CThreadItHistogram::getBucketLow (theBucket) <= theTime);
+		CHECK (CThreadItHistogram::getBucketHigh (theBucket) >= theTime);
+		CHECK ((CThreadItHistogram::getBucketHigh (theBucket) - CThreadItHistogram::getBucketLow (theBucket)) * THREADIT_HISTOGRAM_SUB_BUCKETS <= theTime);
+		theLastBucket = theBucket;
+	} // for
+	CHECK_EQUAL (0u, CThreadItHistogram::getBucket (0));
+	CHECK_EQUAL ((ULONG)(THREADIT_HISTOGRAM_BUCKETS - 1), CThreadItHistogram::getBucket (ULONG_MAX));
+	CHECK_EQUAL ((ULONG)ULONG_MAX, CThreadItHistogram::getBucketHigh (THREADIT_HISTOGRAM_BUCKETS - 1));
+} // TEST (Test_Histogram_buckets)
+
+/**
+ * Test_Histogram_percentiles checks the percentiles, the mean and the merge of
+ * histograms of a known distribution.
+ */
+TEST (Test_Histogram_percentiles)
+{
+	CThreadItHistogram theHistogram;
+	CThreadItHistogram theOther;
+	CThreadItHistogram theSnapshot;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItHistogram"));
+	logger->info ("Testing - Test_Histogram_percentiles");
+
+	CHECK_EQUAL (0u, theHistogram.getCount ());
+	CHECK_EQUAL (0, theHistogram.getPercentile (50.0));
+	// The times 1 to 10000 microseconds once each.
+	for (LONGLONG theTime = 1; theTime <= 10000; theTime++)
+	{
+		theHistogram.record (theTime);
+	} // for
+	CHECK_EQUAL (10000u, theHistogram.getCount ());
+	CHECK_EQUAL (10000, theHistogram.getMax ());
+	CHECK_EQUAL (5000, theHistogram.getMean ());
+	CHECK (theHistogram.getPercentile (50.0) >= 5000);
+	CHECK (theHistogram.getPercentile (50.0) <= 5000 + (5000 / THREADIT_HISTOGRAM_SUB_BUCKETS));
+	CHECK (theHistogram.getPercentile (99.0) >= 9900);
+	CHECK (theHistogram.getPercentile (99.0) <= 10000);
+	CHECK_EQUAL (10000, theHistogram.getPercentile (100.0));
+	CHECK_EQUAL (1, theHistogram.getPercentile (0.0));
+	// A snapshot does not change when more times are recorded.
+	theSnapshot = theHistogram;
+	theHistogram.record (1000000);
+	CHECK_EQUAL (10000u, theSnapshot.getCount ());
+	CHECK_EQUAL (10001u, theHistogram.getCount ());
+	// Merging a slow instance moves the tail.
+	for (ULONG i = 0; i < 10000; i++)
+	{
+		theOther.record (50000);
+	} // for
+	theSnapshot.merge (theOther);
+	CHECK_EQUAL (20000u, theSnapshot.getCount ());
+	CHECK_EQUAL (50000, theSnapshot.getMax ());
+	CHECK (theSnapshot.getPercentile (25.0) <= 5000 + (5000 / THREADIT_HISTOGRAM_SUB_BUCKETS));
+	CHECK (theSnapshot.getPercentile (75.0) >= 50000 - (50000 / THREADIT_HISTOGRAM_SUB_BUCKETS));
+	theSnapshot.reset ();
+	CHECK_EQUAL (0u, theSnapshot.getCount ());
+} // TEST (Test_Histogram_percentiles)
+
+/**
+ * Test_Histogram_recordCost logs the time taken to record a time.
+ */
+TEST (Test_Histogram_recordCost)
+{
+	const ULONG theRecords = 1000000;
+	CThreadItHistogram theHistogram;
+	LARGE_INTEGER theFrequency;
+	LARGE_INTEGER theStart;
+	LARGE_INTEGER theStop;
+	double theCost = 0.0;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItHistogram"));
+	logger->info ("Testing - Test_Histogram_recordCost");
+
+	QueryPerformanceFrequency (&theFrequency);
+	QueryPerformanceCounter (&theStart);
+	for (ULONG i = 0; i < theRecords; i++)
+	{
+		theHistogram.record (i & 0xFFFF);
+	} // for
+	QueryPerformanceCounter (&theStop);
+	theCost = ((theStop.QuadPart - theStart.QuadPart) * 1000000000.0) / (theFrequency.QuadPart * (double)theRecords);
+	logger->infoStream () << "record takes " << theCost << "ns";
+	CHECK_EQUAL (theRecords, theHistogram.getCount ());
+} // TEST (Test_Histogram_recordCost)
+
+/**
+ * Test_ThreadIt_latencyStats checks that a CThreadIt keeps the queue wait, service
+ * time and end to end time of each instruction.
+ */
+TEST (Test_ThreadIt_latencyStats)
+{
+	const ULONG theRequests = 5;
+	ULONG theWorkPackId = 0;
+	ULONG theReceived = 0;
+	DWORD theStart = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CHistogramWorker theWorker;
+	CThreadItLatencyStats theQuick;
+	CThreadItLatencyStats theSlow;
+	std::vector<CThreadItLatencyStats> theStats;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItHistogram"));
+	logger->info ("Testing - Test_ThreadIt_latencyStats");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CHECK (theWorker.isLatencyStats ());
+	CHECK (!theWorker.getStats (HISTOGRAM_QUICK_WORK, theQuick));
+	// The quick work queues behind the slow work.
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = HISTOGRAM_SLOW_WORK;
+		ptheWorkPack->m_isSendResult = true;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = HISTOGRAM_QUICK_WORK;
+		ptheWorkPack->m_isSendResult = true;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+	} // for
+	theStart = GetTickCount ();
+	while ((theReceived < (theRequests * 2)) && ((GetTickCount () - theStart) < 5000))
+	{
+		ptheWorkPack = theWorker.getWork (100);
+		if (ptheWorkPack != NULL)
+		{
+			theReceived++;
+			delete ptheWorkPack;
+		} // if
+	} // while
+	CHECK_EQUAL (theRequests * 2, theReceived);
+	CHECK (theWorker.getStats (HISTOGRAM_QUICK_WORK, theQuick));
+	CHECK (theWorker.getStats (HISTOGRAM_SLOW_WORK, theSlow));
+	CHECK_EQUAL ((ULONG)HISTOGRAM_QUICK_WORK, theQuick.m_theInstruction);
+	CHECK_EQUAL (theRequests, theQuick.m_theQueueWait.getCount ());
+	CHECK_EQUAL (theRequests, theQuick.m_theService.getCount ());
+	CHECK_EQUAL (theRequests, theQuick.m_theEndToEnd.getCount ());
+	CHECK_EQUAL (theRequests, theSlow.m_theService.getCount ());
+	logger->infoStream () << "quick wait p50 " << theQuick.m_theQueueWait.getPercentile (50.0) << "us service p50 "
+		<< theQuick.m_theService.getPercentile (50.0) << "us end to end p99 " << theQuick.m_theEndToEnd.getPercentile (99.0) << "us";
+	logger->infoStream () << "slow wait p50 " << theSlow.m_theQueueWait.getPercentile (50.0) << "us service p50 "
+		<< theSlow.m_theService.getPercentile (50.0) << "us end to end p99 " << theSlow.m_theEndToEnd.getPercentile (99.0) << "us";
+	// The slow work is slow in the worker method and the quick work waits for it.
+	CHECK (theSlow.m_theService.getPercentile (50.0) >= (HISTOGRAM_SLOW_TIME - 5) * 1000);
+	CHECK (theQuick.m_theService.getPercentile (50.0) < theSlow.m_theService.getPercentile (50.0));
+	CHECK (theQuick.m_theQueueWait.getPercentile (50.0) >= (HISTOGRAM_SLOW_TIME - 5) * 1000);
+	CHECK (theQuick.m_theEndToEnd.getPercentile (50.0) >= theQuick.m_theQueueWait.getPercentile (50.0) - (theQuick.m_theQueueWait.getPercentile (50.0) / THREADIT_HISTOGRAM_SUB_BUCKETS));
+	theWorker.getStats (theStats);
+	CHECK_EQUAL (2u, (ULONG)theStats.size ());
+	theWorker.resetStats ();
+	CHECK (theWorker.getStats (HISTOGRAM_QUICK_WORK, theQuick));
+	CHECK_EQUAL (0u, theQuick.m_theService.getCount ());
+} // TEST (Test_ThreadIt_latencyStats)
+
+/**
+ * Test_ThreadIt_cycleStats checks that the CPU cycles of a worker method that spins are
+ * counted and that a worker method that sleeps uses few of them.
+ */
+TEST (Test_ThreadIt_cycleStats)
+{
+	const ULONG theRequests = 3;
+	ULONG theWorkPackId = 0;
+	ULONG theReceived = 0;
+	DWORD theStart = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CHistogramWorker theWorker;
+	CThreadItLatencyStats theBusy;
+	CThreadItLatencyStats theSlow;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItHistogram"));
+	logger->info ("Testing - Test_ThreadIt_cycleStats");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CHECK (!theWorker.isCycleStats ());
+	if (!CThreadIt::isCycleStatsSupported ())
+	{
+		logger->info ("The CPU cycles of a thread can not be counted on this system");
+		return;
+	} // if
+	theWorker.setCycleStats (true);
+	CHECK (theWorker.isCycleStats ());
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = HISTOGRAM_BUSY_WORK;
+		ptheWorkPack->m_isSendResult = true;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = HISTOGRAM_SLOW_WORK;
+		ptheWorkPack->m_isSendResult = true;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+	} // for
+	theStart = GetTickCount ();
+	while ((theReceived < (theRequests * 2)) && ((GetTickCount () - theStart) < 5000))
+	{
+		ptheWorkPack = theWorker.getWork (100);
+		if (ptheWorkPack != NULL)
+		{
+			theReceived++;
+			delete ptheWorkPack;
+		} // if
+	} // while
+	CHECK_EQUAL (theRequests * 2, theReceived);
+	CHECK (theWorker.getStats (HISTOGRAM_BUSY_WORK, theBusy));
+	CHECK (theWorker.getStats (HISTOGRAM_SLOW_WORK, theSlow));
+	CHECK_EQUAL (theRequests, theBusy.m_theCycles.getCount ());
+	CHECK_EQUAL (theRequests, theSlow.m_theCycles.getCount ());
+	logger->infoStream () << "busy cycles p50 " << theBusy.m_theCycles.getPercentile (50.0) << " service p50 "
+		<< theBusy.m_theService.getPercentile (50.0) << "us slow cycles p50 " << theSlow.m_theCycles.getPercentile (50.0)
+		<< " total " << theWorker.getCycleCount ();
+	// Both take as long but only the busy work runs on the processor.
+	CHECK (theBusy.m_theCycles.getPercentile (50.0) > (theSlow.m_theCycles.getPercentile (50.0) * 10));
+	CHECK (theWorker.getCycleCount () >= theBusy.m_theCycles.getPercentile (0.0) * (LONGLONG)theRequests);
+	theWorker.setCycleStats (false);
+	CHECK (!theWorker.isCycleStats ());
+} // TEST (Test_ThreadIt_cycleStats)
@@ -0,0 +1,195 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItLayout
+ * Description: TestThreadItLayout contains unit tests for the memory layout of the
+ * CWorkPackIt and CThreadIt classes. Work packages are checked to start on a cache
+ * line with the attributes used for every work package in the first cache line, and
+ * the groups of CThreadIt attributes written by different threads are checked to be
+ * on different cache lines. A round trip benchmark logs the messages per second so
+ * that layouts can be compared.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+
+/** LAYOUT_WORK is the work instruction processed by the worker. */
+#define LAYOUT_WORK 1
+
+/**
+ * Class CLayoutWorker returns each work package and gives the distance between its
+ * attributes.
+ */
+class CLayoutWorker : public CThreadIt
+{
+public:
+	CLayoutWorker () : CThreadIt ("threadit.CLayoutWorker")
+	{
+		setWorkerMethod ((WorkerMethodType)&CLayoutWorker::work, LAYOUT_WORK);
+	} // constructor CLayoutWorker
+
+	~CLayoutWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CLayoutWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // work
+
+	/**
+	 * Method isApart returns true if the two attributes cannot share a cache line.
+	 */
+	static bool isApart (const volatile void* pFirst, const volatile void* pSecond)
+	{
+		const volatile char* pLow = (const volatile char*)pFirst;
+		const volatile char* pHigh = (const volatile char*)pSecond;
+
+		if (pLow > pHigh)
+		{
+			pLow = (const volatile char*)pSecond;
+			pHigh = (const volatile char*)pFirst;
+		} // if
+		return (pHigh - pLow) >= THREADIT_CACHE_LINE;
+	} // isApart
+
+	/**
+	 * Method checkLayout returns true if the attributes written by the clients that
+	 * send work, the thread of execution and the clients that collect results are
+	 * on different cache lines.
+	 */
+	bool checkLayout ()
+	{
+		bool isSuccess = true;
+
+		isSuccess = isSuccess && isApart (&m_ptheLogger, &m_WorkPackID);
+		isSuccess = isSuccess && isApart (&m_theShedInterval, &m_theWorkQDepth);
+		isSuccess = isSuccess && isApart (&m_theWorkQDepth, &m_isExitThread);
+		isSuccess = isSuccess && isApart (&m_WorkQ, &m_theLatencyEwma);
+		isSuccess = isSuccess && isApart (&m_WorkQ, &m_TStart);
+		isSuccess = isSuccess && isApart (&m_WorkQ, &m_DoneQ);
+		isSuccess = isSuccess && isApart (&m_theCallbackAccess, &m_DoneQ);
+		isSuccess = isSuccess && isApart (&m_theLatencyEwma, &m_DoneQ);
+		return isSuccess;
+	} // checkLayout
+
+}; // class CLayoutWorker
+
+/**
+ * Test_WorkPackIt_layout checks that work packages start on a cache line and that the
+ * attributes used for every work package are in the first cache line.
+ */
+TEST (Test_WorkPackIt_layout)
+{
+	const int theCount = 16;
+	CWorkPackIt* ptheWorkPacks[theCount];
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItLayout"));
+	logger->info ("Testing - Test_WorkPackIt_layout");
+
+	for (int i = 0; i < theCount; i++)
+	{
+		ptheWorkPacks[i] = new CWorkPackIt ();
+		CHECK_EQUAL (0u, (UINT)((ULONG_PTR)ptheWorkPacks[i] % THREADIT_CACHE_LINE));
+	} // for
+	const char* pStart = (const char*)ptheWorkPacks[0];
+	CHECK (((const char*)&ptheWorkPacks[0]->m_theEnqueueTime - pStart) < THREADIT_CACHE_LINE);
+	CHECK (((const char*)&ptheWorkPacks[0]->m_ptheWorkDoneQ - pStart) < THREADIT_CACHE_LINE);
+	CHECK (((const char*)&ptheWorkPacks[0]->m_ptheCompletion - pStart) < THREADIT_CACHE_LINE);
+	CHECK (((const char*)&ptheWorkPacks[0]->m_isUseSharedPtrQ - pStart) < THREADIT_CACHE_LINE);
+	logger->infoStream () << "CWorkPackIt is " << sizeof (CWorkPackIt) << " bytes, CThreadIt is " << sizeof (CThreadIt) << " bytes";
+	for (int i = 0; i < theCount; i++)
+	{
+		delete ptheWorkPacks[i];
+	} // for
+} // TEST (Test_WorkPackIt_layout)
+
+/**
+ * Test_ThreadIt_layout checks that the groups of attributes written by different
+ * threads are on different cache lines.
+ */
+TEST (Test_ThreadIt_layout)
+{
+	CLayoutWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItLayout"));
+	logger->info ("Testing - Test_ThreadIt_layout");
+
+	CHECK (theWorker.checkLayout ());
+} // TEST (Test_ThreadIt_layout)
+
+/**
+ * Test_ThreadIt_roundTrip sends a stream of work packages while the results are
+ * collected and logs the messages per second.
+ */
+TEST (Test_ThreadIt_roundTrip)
+{
+	const ULONG theRequests = 100000;
+	ULONG theWorkPackId = 0;
+	ULONG theSent = 0;
+	ULONG theReceived = 0;
+	DWORD theStart = 0;
+	DWORD theElapsed = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CLayoutWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItLayout"));
+	logger->info ("Testing - Test_ThreadIt_roundTrip");
+
+	UNITTEST_TIME_CONSTRAINT (30000);
+
+	theStart = GetTickCount ();
+	while ((theReceived < theRequests) && ((GetTickCount () - theStart) < 20000))
+	{
+		// Keep a window of work in flight so both threads are busy.
+		while ((theSent < theRequests) && ((theSent - theReceived) < 256))
+		{
+			ptheWorkPack = new CWorkPackIt ();
+			ptheWorkPack->m_theInstruction = LAYOUT_WORK;
+			ptheWorkPack->m_isSendResult = true;
+			theWorker.startWork (ptheWorkPack, theWorkPackId);
+			theSent++;
+		} // while
+		ptheWorkPack = theWorker.getWork (100);
+		if (ptheWorkPack != NULL)
+		{
+			CHECK (ptheWorkPack->m_theStatus == CThreadIt::THREADIT_STATUS_OK);
+			theReceived++;
+			delete ptheWorkPack;
+		} // if
+	} // while
+	theElapsed = GetTickCount () - theStart;
+	if (theElapsed == 0)
+	{
+		theElapsed = 1;
+	} // if
+	logger->infoStream () << theReceived << " round trips in " << theElapsed << "ms, "
+		<< ((theReceived * 1000.0) / theElapsed) << " messages per second";
+	CHECK_EQUAL (theRequests, theReceived);
+} // TEST (Test_ThreadIt_roundTrip)
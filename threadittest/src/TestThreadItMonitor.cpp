@@ -0,0 +1,214 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItMonitor
+ * Description: TestThreadItMonitor contains unit tests for the busy and wait times of
+ * the active objects and the utilisation found by CThreadItMonitor.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+#include "threaditmonitor.h"
+
+/** MONITOR_SPIN_WORK spins for MONITOR_SPIN_TIME milliseconds. */
+#define MONITOR_SPIN_WORK 1
+/** MONITOR_SPIN_TIME is the time in milliseconds taken by the spin work. */
+#define MONITOR_SPIN_TIME 200
+
+/**
+ * Class CMonitorWorker keeps the processor busy for a while.
+ */
+class CMonitorWorker : public CThreadIt
+{
+public:
+	CMonitorWorker (const std::string& theName) : CThreadIt (theName)
+	{
+		setWorkerMethod ((WorkerMethodType)&CMonitorWorker::spinWork, MONITOR_SPIN_WORK);
+	} // constructor CMonitorWorker
+
+	~CMonitorWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CMonitorWorker
+
+	bool spinWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		DWORD theStart = GetTickCount ();
+		volatile ULONG theCount = 0;
+
+		while ((GetTickCount () - theStart) < MONITOR_SPIN_TIME)
+		{
+			theCount++;
+		} // while
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // spinWork
+
+	bool findInfo (ActiveInfo& theInfo)
+	{
+		bool isFound = false;
+		std::vector<ActiveInfo> theSnapshot;
+
+		CActive::getRegistrySnapshot (theSnapshot);
+		for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+		{
+			if (theSnapshot[theIndex].theThreadId == getThreadId ())
+			{
+				theInfo = theSnapshot[theIndex];
+				isFound = true;
+			} // if
+		} // for
+		return isFound;
+	} // findInfo
+
+}; // class CMonitorWorker
+
+/**
+ * findUtilisation returns the utilisation of a thread.
+ */
+static const ActiveUtilisation* findUtilisation (const std::vector<ActiveUtilisation>& theUtilisation, UINT theThreadId)
+{
+	const ActiveUtilisation* ptheEntry = NULL;
+
+	for (size_t theIndex = 0; theIndex < theUtilisation.size (); theIndex++)
+	{
+		if (theUtilisation[theIndex].theThreadId == theThreadId)
+		{
+			ptheEntry = &theUtilisation[theIndex];
+		} // if
+	} // for
+	return ptheEntry;
+} // findUtilisation
+
+/**
+ * Test_Monitor_compare checks the utilisation found from two snapshots.
+ */
+TEST (Test_Monitor_compare)
+{
+	std::vector<ActiveInfo> theOlder (1);
+	std::vector<ActiveInfo> theNewer (2);
+	std::vector<ActiveUtilisation> theUtilisation;
+	std::string theText;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItMonitor"));
+	logger->info ("Testing - Test_Monitor_compare");
+
+	theOlder[0].theName = "idle";
+	theOlder[0].theThreadId = 10;
+	theOlder[0].theInstance = 1;
+	theOlder[0].theWallTime = 1000000;
+	theOlder[0].theWaitTime = 900000;
+	theOlder[0].theWaitCount = 100;
+	theOlder[0].theUserTime = 50000;
+	theNewer[0] = theOlder[0];
+	theNewer[0].theWallTime = 3000000;
+	theNewer[0].theWaitTime = 2700000;
+	theNewer[0].theWaitCount = 300;
+	theNewer[0].theUserTime = 150000;
+	theNewer[0].theKernelTime = 100000;
+	// The second thread started within the window.
+	theNewer[1].theName = "busy";
+	theNewer[1].theThreadId = 20;
+	theNewer[1].theInstance = 2;
+	theNewer[1].theWallTime = 1000000;
+	theNewer[1].theWaitTime = 250000;
+	theNewer[1].theUserTime = 500000;
+	theNewer[1].isThreadIt = true;
+	theNewer[1].theProcessedCount = 40;
+	theNewer[1].theWorkQDepth = 6;
+	CThreadItMonitor::getUtilisation (theOlder, theNewer, 2000, theUtilisation);
+	CHECK_EQUAL (2u, (ULONG)theUtilisation.size ());
+	// The busiest comes first.
+	CHECK_EQUAL (20u, theUtilisation[0].theThreadId);
+	CHECK_CLOSE (75.0, theUtilisation[0].theBusyPercent, 0.01);
+	CHECK_CLOSE (50.0, theUtilisation[0].theCpuPercent, 0.01);
+	CHECK_CLOSE (20.0, theUtilisation[0].theProcessedRate, 0.01);
+	CHECK_EQUAL (6, theUtilisation[0].theWorkQDepth);
+	CHECK_EQUAL (10u, theUtilisation[1].theThreadId);
+	CHECK_CLOSE (10.0, theUtilisation[1].theBusyPercent, 0.01);
+	CHECK_CLOSE (10.0, theUtilisation[1].theCpuPercent, 0.01);
+	CHECK_CLOSE (5.0, theUtilisation[1].theKernelPercent, 0.01);
+	CHECK_CLOSE (100.0, theUtilisation[1].theWaitRate, 0.01);
+	theText = CThreadItMonitor::toTop (theUtilisation, 1);
+	logger->info (theText);
+	CHECK (theText.find ("busy") != std::string::npos);
+	CHECK (theText.find ("idle") == std::string::npos);
+} // TEST (Test_Monitor_compare)
+
+/**
+ * Test_Monitor_utilisation checks that a thread that spins is found busy and on the
+ * processor while a thread without work is found waiting.
+ */
+TEST (Test_Monitor_utilisation)
+{
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	ActiveInfo theInfo;
+	std::vector<ActiveUtilisation> theUtilisation;
+	const ActiveUtilisation* ptheBusy = NULL;
+	const ActiveUtilisation* ptheIdle = NULL;
+	CMonitorWorker theBusy ("threadit.CMonitorWorker.busy");
+	CMonitorWorker theIdle ("threadit.CMonitorWorker.idle");
+	// Only the samples taken by the test are compared.
+	CThreadItMonitor theMonitor (60000);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItMonitor"));
+	logger->info ("Testing - Test_Monitor_utilisation");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CHECK (!theMonitor.getUtilisation (60000, theUtilisation));
+	Sleep (50);
+	CHECK (theIdle.findInfo (theInfo));
+	CHECK (theInfo.isWaiting);
+	CHECK (theInfo.theWaitCount > 0);
+	CHECK (theInfo.theWallTime > 0);
+	theMonitor.sample ();
+	ptheWorkPack = new CWorkPackIt ();
+	ptheWorkPack->m_theInstruction = MONITOR_SPIN_WORK;
+	ptheWorkPack->m_isSendResult = true;
+	theBusy.startWork (ptheWorkPack, theWorkPackId);
+	ptheWorkPack = theBusy.getWork (5000);
+	CHECK (ptheWorkPack != NULL);
+	delete ptheWorkPack;
+	theMonitor.sample ();
+	CHECK_EQUAL (3u, theMonitor.getSampleCount ());
+	// The window starts at the sample taken before the work was sent.
+	CHECK (theMonitor.getUtilisation (1, theUtilisation));
+	logger->info (theMonitor.getTop (1, 5));
+	ptheBusy = findUtilisation (theUtilisation, theBusy.getThreadId ());
+	ptheIdle = findUtilisation (theUtilisation, theIdle.getThreadId ());
+	CHECK (ptheBusy != NULL);
+	CHECK (ptheIdle != NULL);
+	if ((ptheBusy != NULL) && (ptheIdle != NULL))
+	{
+		CHECK (ptheBusy->theBusyPercent > 50.0);
+		CHECK (ptheBusy->theCpuPercent > 25.0);
+		CHECK (ptheIdle->theBusyPercent < 20.0);
+		CHECK (ptheBusy->theProcessedRate > 0.0);
+	} // if
+} // TEST (Test_Monitor_utilisation)
@@ -0,0 +1,200 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItPipeline
+ * Description: TestThreadItPipeline contains unit tests for the CSpscRing and
+ * CThreadItPipeline classes. The tests check that items pass through the stages
+ * in order when the rings are small enough to force back pressure and measure
+ * the throughput of a four stage pipeline.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threaditpipeline.h"
+
+/** The number of items passed through the functional test pipeline. */
+const ULONG thePipelineItems = 10000;
+/** The number of items passed through the benchmark pipeline. */
+const ULONG theBenchmarkItems = 1000000;
+
+/**
+ * Class CIncrementStage is a pipeline stage that adds one to the ULONG item.
+ */
+class CIncrementStage : public CThreadItStage
+{
+public:
+	CIncrementStage (const std::string& theName) : CThreadItStage (theName)
+	{
+		setStageMethod ((StageMethodType)&CIncrementStage::increment);
+	} // constructor CIncrementStage
+
+	bool increment (void* ptheItem, void*& ptheResult)
+	{
+		(*(ULONG*)ptheItem)++;
+		ptheResult = ptheItem;
+		return true;
+	} // increment
+
+}; // class CIncrementStage
+
+/**
+ * Method runPipeline pushes theCount items through the pipeline from the calling
+ * thread and takes them off the other end. The items are checked to arrive in
+ * order and to have been incremented once by each stage.
+ * \return the number of items that arrived correctly.
+ */
+static ULONG runPipeline (CThreadItPipeline& thePipeline, ULONG* ptheItems, ULONG theCount)
+{
+	ULONG thePushed = 0;
+	ULONG thePopped = 0;
+	ULONG theCorrect = 0;
+	ULONG* ptheResult = NULL;
+
+	while (thePopped < theCount)
+	{
+		if ((thePushed < theCount) && (thePipeline.push (&ptheItems[thePushed], 0)))
+		{
+			thePushed++;
+		}
+		else
+		{
+			ptheResult = (ULONG*)thePipeline.pop ((thePushed < theCount) ? 0 : 1000);
+			if (ptheResult != NULL)
+			{
+				if ((ptheResult == &ptheItems[thePopped]) && (*ptheResult == thePipeline.getStageCount ()))
+				{
+					theCorrect++;
+				} // if
+				thePopped++;
+			}
+			else if (thePushed >= theCount)
+			{
+				// Nothing more is coming.
+				break;
+			} // if
+		} // if
+	} // while
+	return theCorrect;
+} // runPipeline
+
+/**
+ * Test_SpscRing_pushBatch checks that the ring hands out credits up to its
+ * capacity and returns the items in order.
+ */
+TEST (Test_SpscRing_pushBatch)
+{
+	ULONG theItems[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	ULONG* ptheItems[8];
+	ULONG* ptheOut[8];
+	CSpscRing<ULONG> theRing (4);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItPipeline"));
+	logger->info ("Testing - Test_SpscRing_pushBatch");
+
+	for (int i = 0; i < 8; i++)
+	{
+		ptheItems[i] = &theItems[i];
+	} // for
+	CHECK_EQUAL (4UL, theRing.capacity ());
+	CHECK_EQUAL (4UL, theRing.pushBatch (ptheItems, 8));
+	CHECK_EQUAL (0UL, theRing.getCredits ());
+	CHECK (!theRing.push (ptheItems[4]));
+	CHECK_EQUAL (4UL, theRing.size ());
+	CHECK_EQUAL (2UL, theRing.popBatch (ptheOut, 2));
+	CHECK (ptheOut[0] == &theItems[0]);
+	CHECK (ptheOut[1] == &theItems[1]);
+	CHECK_EQUAL (2UL, theRing.getCredits ());
+	CHECK_EQUAL (2UL, theRing.pushBatch (&ptheItems[4], 4));
+	CHECK_EQUAL (4UL, theRing.popBatch (ptheOut, 8));
+	CHECK (ptheOut[0] == &theItems[2]);
+	CHECK (ptheOut[3] == &theItems[5]);
+	CHECK (theRing.pop () == NULL);
+	CHECK (theRing.isEmpty ());
+} // TEST (Test_SpscRing_pushBatch)
+
+/**
+ * Test_ThreadItPipeline_order passes items through three stages using rings that
+ * are much smaller than the number of items. The stages must stall for credits and
+ * the items must still arrive in order.
+ */
+TEST (Test_ThreadItPipeline_order)
+{
+	ULONG* ptheItems = new ULONG[thePipelineItems];
+	PipelineStageStats theStats;
+	CThreadItPipeline thePipeline (16);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItPipeline"));
+	logger->info ("Testing - Test_ThreadItPipeline_order");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	memset (ptheItems, 0, sizeof (ULONG) * thePipelineItems);
+	CHECK (thePipeline.addStage (StagePtr (new CIncrementStage ("threadit.stage1")), 4));
+	CHECK (thePipeline.addStage (StagePtr (new CIncrementStage ("threadit.stage2")), 8));
+	CHECK (thePipeline.addStage (StagePtr (new CIncrementStage ("threadit.stage3")), 16));
+	CHECK (thePipeline.build ());
+	CHECK (!thePipeline.addStage (StagePtr (new CIncrementStage ("threadit.stage4"))));
+	CHECK_EQUAL (thePipelineItems, runPipeline (thePipeline, ptheItems, thePipelineItems));
+	CHECK (thePipeline.getStageStats (0, theStats));
+	CHECK_EQUAL ((LONGLONG)thePipelineItems, theStats.theItemCount);
+	CHECK_EQUAL (0UL, theStats.theOccupancy);
+	CHECK (thePipeline.getBottleneck () >= 0);
+	thePipeline.logStats ();
+	thePipeline.stop ();
+	delete [] ptheItems;
+} // TEST (Test_ThreadItPipeline_order)
+
+/**
+ * Test_ThreadItPipeline_benchmark measures the throughput of a four stage pipeline
+ * and writes the items per second to the log.
+ */
+TEST (Test_ThreadItPipeline_benchmark)
+{
+	ULONG* ptheItems = new ULONG[theBenchmarkItems];
+	LARGE_INTEGER theFrequency;
+	LARGE_INTEGER theStart;
+	LARGE_INTEGER theStop;
+	ULONG theCorrect = 0;
+	CThreadItPipeline thePipeline (1024);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItPipeline"));
+	logger->info ("Testing - Test_ThreadItPipeline_benchmark");
+
+	memset (ptheItems, 0, sizeof (ULONG) * theBenchmarkItems);
+	thePipeline.addStage (StagePtr (new CIncrementStage ("threadit.bench1")), 64);
+	thePipeline.addStage (StagePtr (new CIncrementStage ("threadit.bench2")), 64);
+	thePipeline.addStage (StagePtr (new CIncrementStage ("threadit.bench3")), 64);
+	thePipeline.addStage (StagePtr (new CIncrementStage ("threadit.bench4")), 64);
+	CHECK (thePipeline.build ());
+	QueryPerformanceFrequency (&theFrequency);
+	QueryPerformanceCounter (&theStart);
+	theCorrect = runPipeline (thePipeline, ptheItems, theBenchmarkItems);
+	QueryPerformanceCounter (&theStop);
+	CHECK_EQUAL (theBenchmarkItems, theCorrect);
+	logger->infoStream () << "4 stage pipeline: " << ((double)theBenchmarkItems * (double)theFrequency.QuadPart) / (double)(theStop.QuadPart - theStart.QuadPart)
+		<< " items/s";
+	thePipeline.logStats ();
+	thePipeline.stop ();
+	delete [] ptheItems;
+} // TEST (Test_ThreadItPipeline_benchmark)
@@ -0,0 +1,183 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItPool
+ * Description: TestThreadItPool contains unit tests for the CThreadItPool class. A
+ * burst of slow work is checked to grow the pool up to its maximum and the pool is
+ * checked to shrink back to its minimum once the work stops.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threaditpool.h"
+
+/** POOL_WORK is the work instruction processed by the pool. */
+#define POOL_WORK 1
+
+/**
+ * Class CPoolWorker sleeps for its service time and records how many work packages
+ * are processed at once.
+ */
+class CPoolWorker : public CThreadItPool
+{
+public:
+	/** m_theServiceTime is the time taken by each work package in milliseconds. */
+	DWORD m_theServiceTime;
+	/** m_theActive is the number of work packages being processed. */
+	volatile LONG m_theActive;
+	/** m_thePeakActive is the most work packages processed at once. */
+	volatile LONG m_thePeakActive;
+	/** m_theProcessed is the number of work packages processed. */
+	volatile LONG m_theProcessed;
+
+	CPoolWorker (UINT theMinThreads, UINT theMaxThreads, DWORD theServiceTime) : CThreadItPool ("threadit.CPoolWorker", theMinThreads, theMaxThreads)
+	{
+		m_theServiceTime = theServiceTime;
+		m_theActive = 0;
+		m_thePeakActive = 0;
+		m_theProcessed = 0;
+		setWorkerMethod ((WorkerMethodType)&CPoolWorker::work, POOL_WORK);
+	} // constructor CPoolWorker
+
+	~CPoolWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CPoolWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		LONG theActive = InterlockedIncrement (&m_theActive);
+		LONG thePeak = m_thePeakActive;
+
+		while ((theActive > thePeak) && (InterlockedCompareExchange (&m_thePeakActive, theActive, thePeak) != thePeak))
+		{
+			thePeak = m_thePeakActive;
+		} // while
+		Sleep (m_theServiceTime);
+		InterlockedIncrement (&m_theProcessed);
+		InterlockedDecrement (&m_theActive);
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // work
+
+}; // class CPoolWorker
+
+/**
+ * Test_ThreadItPool_grow checks that a burst of slow work grows the pool to its
+ * maximum, that every result is returned through getWork and that the pool shrinks
+ * back to its minimum after the linger time.
+ */
+TEST (Test_ThreadItPool_grow)
+{
+	const ULONG theRequests = 400;
+	ULONG theWorkPackId = 0;
+	ULONG theReceived = 0;
+	DWORD theStart = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CPoolWorker theWorker (1, 4, 5);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItPool"));
+	logger->info ("Testing - Test_ThreadItPool_grow");
+
+	UNITTEST_TIME_CONSTRAINT (20000);
+
+	CHECK_EQUAL (1u, theWorker.getPoolSize ());
+	CHECK_EQUAL (1u, theWorker.getMinPoolSize ());
+	CHECK_EQUAL (4u, theWorker.getMaxPoolSize ());
+	theWorker.setLinger (200);
+	theWorker.setGrowthPolicy (10000, 2, 2);
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = POOL_WORK;
+		ptheWorkPack->m_isSendResult = true;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+	} // for
+	theStart = GetTickCount ();
+	while ((theReceived < theRequests) && ((GetTickCount () - theStart) < 10000))
+	{
+		ptheWorkPack = theWorker.getWork (100);
+		if (ptheWorkPack != NULL)
+		{
+			CHECK (ptheWorkPack->m_theStatus == CThreadIt::THREADIT_STATUS_OK);
+			theReceived++;
+			delete ptheWorkPack;
+		} // if
+	} // while
+	logger->infoStream () << "peak pool size " << theWorker.getPeakPoolSize () << " peak active " << theWorker.m_thePeakActive
+		<< " grown " << theWorker.getGrowCount () << " queue wait " << theWorker.getQueueWait () << "us";
+	CHECK_EQUAL (theRequests, theReceived);
+	CHECK_EQUAL ((LONG)theRequests, theWorker.m_theProcessed);
+	CHECK_EQUAL (4u, theWorker.getPeakPoolSize ());
+	CHECK (theWorker.getGrowCount () >= 3);
+	CHECK (theWorker.m_thePeakActive > 1);
+	CHECK (theWorker.m_thePeakActive <= 4);
+	// The helpers retire once there is no work for the linger time.
+	theStart = GetTickCount ();
+	while ((theWorker.getPoolSize () > 1) && ((GetTickCount () - theStart) < 5000))
+	{
+		Sleep (50);
+	} // while
+	CHECK_EQUAL (1u, theWorker.getPoolSize ());
+	CHECK_EQUAL (theWorker.getGrowCount (), theWorker.getShrinkCount ());
+	CHECK_EQUAL (0, theWorker.getBusyCount ());
+} // TEST (Test_ThreadItPool_grow)
+
+/**
+ * Test_ThreadItPool_minimum checks that the pool starts with its minimum threads,
+ * keeps them when idle and does not grow while it keeps up with the work.
+ */
+TEST (Test_ThreadItPool_minimum)
+{
+	const ULONG theRequests = 50;
+	ULONG theWorkPackId = 0;
+	DWORD theStart = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CPoolWorker theWorker (3, 6, 1);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItPool"));
+	logger->info ("Testing - Test_ThreadItPool_minimum");
+
+	CHECK_EQUAL (3u, theWorker.getPoolSize ());
+	theWorker.setLinger (50);
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = POOL_WORK;
+		theWorker.startWork (ptheWorkPack, theWorkPackId);
+		Sleep (5);
+	} // for
+	theStart = GetTickCount ();
+	while ((theWorker.m_theProcessed < (LONG)theRequests) && ((GetTickCount () - theStart) < 5000))
+	{
+		Sleep (10);
+	} // while
+	Sleep (200);
+	CHECK_EQUAL ((LONG)theRequests, theWorker.m_theProcessed);
+	CHECK_EQUAL (3u, theWorker.getPoolSize ());
+	CHECK_EQUAL (0, theWorker.getGrowCount ());
+	CHECK_EQUAL (0, theWorker.getShrinkCount ());
+} // TEST (Test_ThreadItPool_minimum)
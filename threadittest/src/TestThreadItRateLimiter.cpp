@@ -0,0 +1,406 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItRateLimiter
+ * Description: TestThreadItRateLimiter contains unit tests for the
+ * CThreadItRateLimiter class used by CThreadIt. A chatty sender is checked to be
+ * throttled without affecting a quiet one, the limit of an instruction is checked
+ * over all senders and the delay policy is checked to slow the sender down instead
+ * of throttling it. The sender is also checked to be seen through the interface
+ * classes, to keep its tokens when the instruction limit throttles its work and
+ * to be able to give up its slot.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threaditratelimiter.h"
+#include "isafethreaditinterface.h"
+
+/** LIMITED_WORK is the work instruction processed by the worker. */
+#define LIMITED_WORK 1
+
+/**
+ * Class CLimitedWorker counts the work packages it processes.
+ */
+class CLimitedWorker : public CThreadIt
+{
+public:
+	/** m_theProcessed is the number of work packages processed. */
+	volatile LONG m_theProcessed;
+	/** m_theReleased is the number of objects of unprocessed work packages freed. */
+	volatile LONG m_theReleased;
+
+	CLimitedWorker () : CThreadIt ("threadit.CLimitedWorker")
+	{
+		m_theProcessed = 0;
+		m_theReleased = 0;
+		setWorkerMethod ((WorkerMethodType)&CLimitedWorker::work, LIMITED_WORK);
+	} // constructor CLimitedWorker
+
+	~CLimitedWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CLimitedWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		InterlockedIncrement (&m_theProcessed);
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		delete (ULONG*)pWorkDone->m_ptheObject;
+		pWorkDone->m_ptheObject = NULL;
+		return true;
+	} // work
+
+	virtual void releaseObject (CWorkPackIt* pWorkPack)
+	{
+		delete (ULONG*)pWorkPack->m_ptheObject;
+		pWorkPack->m_ptheObject = NULL;
+		InterlockedIncrement (&m_theReleased);
+	} // releaseObject
+
+}; // class CLimitedWorker
+
+/**
+ * Class CLimitedSender is a component that identifies the sender of work.
+ */
+class CLimitedSender : public CThreadIt
+{
+public:
+	CLimitedSender () : CThreadIt ("threadit.CLimitedSender")
+	{
+	} // constructor CLimitedSender
+
+	~CLimitedSender ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CLimitedSender
+
+}; // class CLimitedSender
+
+/**
+ * Method sendLimited sends a work package from a sender and returns the value of
+ * startWork. The result is returned to theResults if it is given.
+ */
+static bool sendLimited (CThreadIt& theWorker, const ThreadItPtr& ptheSender, WorkPackItQ* ptheResults)
+{
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+
+	ptheWorkPack->m_theInstruction = LIMITED_WORK;
+	ptheWorkPack->m_wptheSource = ptheSender;
+	if (ptheResults != NULL)
+	{
+		ptheWorkPack->m_isSendResult = true;
+		ptheWorkPack->m_isUseDefaultQ = false;
+		ptheWorkPack->m_ptheWorkDoneQ = ptheResults;
+	} // if
+	return theWorker.startWork (ptheWorkPack, theWorkPackId);
+} // sendLimited
+
+/**
+ * Method waitForIdle waits for the worker to process its queue.
+ */
+static void waitForIdle (CThreadIt& theWorker)
+{
+	DWORD theStart = GetTickCount ();
+
+	while ((theWorker.getWorkQDepth () > 0) && ((GetTickCount () - theStart) < 5000))
+	{
+		Sleep (10);
+	} // while
+	Sleep (10);
+} // waitForIdle
+
+/**
+ * Test_ThreadItRateLimiter_sender checks that a chatty sender is throttled to its
+ * limit while a quiet sender is not, and that the throttled work is still queued
+ * and returned with the status WORKDONE_THROTTLED.
+ */
+TEST (Test_ThreadItRateLimiter_sender)
+{
+	const ULONG theChattyRequests = 200;
+	const ULONG theQuietRequests = 50;
+	ULONG theAccepted = 0;
+	ULONG theThrottledResults = 0;
+	ULONG theOkResults = 0;
+	LONG theAdmitted = 0;
+	LONG theThrottled = 0;
+	DWORD theStart = 0;
+	CWorkPackIt* ptheWorkDone = NULL;
+	WorkPackItQ theResults;
+	ThreadItPtr ptheChatty (new CLimitedSender ());
+	ThreadItPtr ptheQuiet (new CLimitedSender ());
+	ThreadItRateLimiterPtr ptheLimiter (new CThreadItRateLimiter ());
+	CLimitedWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItRateLimiter"));
+	logger->info ("Testing - Test_ThreadItRateLimiter_sender");
+
+	CHECK (ptheLimiter->setSenderLimit (ptheChatty.get (), 10, 10));
+	// The quiet sender has no limit of its own and the default is unlimited.
+	ptheLimiter->setDefaultSenderLimit (0, 0);
+	theWorker.setRateLimiter (ptheLimiter);
+	theStart = GetTickCount ();
+	for (ULONG i = 0; i < theChattyRequests; i++)
+	{
+		// A throttled work package that expects a result is still queued.
+		CHECK (sendLimited (theWorker, ptheChatty, &theResults));
+		if (i < theQuietRequests)
+		{
+			CHECK (sendLimited (theWorker, ptheQuiet, &theResults));
+		} // if
+	} // for
+	waitForIdle (theWorker);
+	CHECK (ptheLimiter->getSenderCounts (ptheChatty.get (), theAdmitted, theThrottled));
+	logger->infoStream () << "chatty admitted " << theAdmitted << " throttled " << theThrottled;
+	theAccepted = (ULONG)theAdmitted;
+	// The chatty sender gets its burst and the tokens earned while it was sending.
+	CHECK (theAccepted >= 10);
+	CHECK (theAccepted <= 10 + ((GetTickCount () - theStart) / 100) + 1);
+	CHECK_EQUAL ((LONG)(theChattyRequests - theAccepted), theThrottled);
+	CHECK (ptheLimiter->getSenderCounts (ptheQuiet.get (), theAdmitted, theThrottled));
+	CHECK_EQUAL ((LONG)theQuietRequests, theAdmitted);
+	CHECK_EQUAL (0, theThrottled);
+	CHECK_EQUAL ((LONG)(theAccepted + theQuietRequests), theWorker.m_theProcessed);
+	// Every work package is answered and the throttled ones say so.
+	for (ULONG i = 0; i < theChattyRequests + theQuietRequests; i++)
+	{
+		ptheWorkDone = theResults.waitItem (2000);
+		if (ptheWorkDone != NULL)
+		{
+			if (ptheWorkDone->m_theStatus == CThreadIt::WORKDONE_THROTTLED)
+			{
+				theThrottledResults++;
+			}
+			else if (ptheWorkDone->m_theStatus == CThreadIt::THREADIT_STATUS_OK)
+			{
+				theOkResults++;
+			} // if
+			delete ptheWorkDone;
+		} // if
+	} // for
+	CHECK_EQUAL (theChattyRequests - theAccepted, theThrottledResults);
+	CHECK_EQUAL (theAccepted + theQuietRequests, theOkResults);
+	CHECK (theResults.getItem () == NULL);
+} // TEST (Test_ThreadItRateLimiter_sender)
+
+/**
+ * Test_ThreadItRateLimiter_instruction checks the limit of an instruction over all
+ * senders and the default limit given to each new sender.
+ */
+TEST (Test_ThreadItRateLimiter_instruction)
+{
+	const ULONG theRequests = 100;
+	const ULONG theSenders = 4;
+	ULONG theAccepted = 0;
+	LONG theAdmitted = 0;
+	LONG theThrottled = 0;
+	DWORD theStart = 0;
+	ThreadItPtr ptheSenders[theSenders];
+	ThreadItRateLimiterPtr ptheLimiter (new CThreadItRateLimiter ());
+	CLimitedWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItRateLimiter"));
+	logger->info ("Testing - Test_ThreadItRateLimiter_instruction");
+
+	CHECK (!ptheLimiter->setInstructionLimit (CThreadIt::MAX_WORK_METHODS, 10, 1));
+	CHECK (ptheLimiter->setInstructionLimit (LIMITED_WORK, 20, 5));
+	theWorker.setRateLimiter (ptheLimiter);
+	for (ULONG theSender = 0; theSender < theSenders; theSender++)
+	{
+		ptheSenders[theSender] = ThreadItPtr (new CLimitedSender ());
+	} // for
+	theStart = GetTickCount ();
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		if (sendLimited (theWorker, ptheSenders[i % theSenders], NULL))
+		{
+			theAccepted++;
+		} // if
+	} // for
+	waitForIdle (theWorker);
+	CHECK (theAccepted >= 5);
+	CHECK (theAccepted <= 5 + ((GetTickCount () - theStart) / 50) + 1);
+	CHECK (ptheLimiter->getInstructionCounts (LIMITED_WORK, theAdmitted, theThrottled));
+	CHECK_EQUAL ((LONG)theAccepted, theAdmitted);
+	CHECK_EQUAL ((LONG)(theRequests - theAccepted), theThrottled);
+	CHECK_EQUAL ((LONG)theAccepted, theWorker.m_theProcessed);
+	// Senders are not tracked until a sender limit is set.
+	CHECK (!ptheLimiter->getSenderCounts (ptheSenders[0].get (), theAdmitted, theThrottled));
+	// Each new sender gets its own bucket with the default limit.
+	CHECK (ptheLimiter->setInstructionLimit (LIMITED_WORK, 0, 0));
+	ptheLimiter->setDefaultSenderLimit (10, 3);
+	theAccepted = 0;
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		if (sendLimited (theWorker, ptheSenders[i % theSenders], NULL))
+		{
+			theAccepted++;
+		} // if
+	} // for
+	for (ULONG theSender = 0; theSender < theSenders; theSender++)
+	{
+		CHECK (ptheLimiter->getSenderCounts (ptheSenders[theSender].get (), theAdmitted, theThrottled));
+		CHECK (theAdmitted >= 3);
+		CHECK (theAdmitted <= 4);
+		CHECK_EQUAL ((LONG)(theRequests / theSenders), theAdmitted + theThrottled);
+	} // for
+	CHECK (theAccepted >= 3 * theSenders);
+} // TEST (Test_ThreadItRateLimiter_instruction)
+
+/**
+ * Test_ThreadItRateLimiter_delay checks that the delay policy slows the sender
+ * down to the limit instead of throttling its work.
+ */
+TEST (Test_ThreadItRateLimiter_delay)
+{
+	const ULONG theRequests = 50;
+	ULONG theAccepted = 0;
+	LONG theAdmitted = 0;
+	LONG theThrottled = 0;
+	DWORD theElapsed = 0;
+	ThreadItPtr ptheSender (new CLimitedSender ());
+	ThreadItRateLimiterPtr ptheLimiter (new CThreadItRateLimiter (CThreadItRateLimiter::LIMIT_DELAY, 1000));
+	CLimitedWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItRateLimiter"));
+	logger->info ("Testing - Test_ThreadItRateLimiter_delay");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	CHECK_EQUAL (CThreadItRateLimiter::LIMIT_DELAY, ptheLimiter->getPolicy ());
+	CHECK (ptheLimiter->setSenderLimit (ptheSender.get (), 200, 1));
+	theWorker.setRateLimiter (ptheLimiter);
+	theElapsed = GetTickCount ();
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		if (sendLimited (theWorker, ptheSender, NULL))
+		{
+			theAccepted++;
+		} // if
+	} // for
+	theElapsed = GetTickCount () - theElapsed;
+	waitForIdle (theWorker);
+	logger->infoStream () << "sent " << theRequests << " in " << theElapsed << "ms";
+	CHECK_EQUAL (theRequests, theAccepted);
+	CHECK ((theElapsed * 200) / 1000 >= theRequests - 10);
+	CHECK (ptheLimiter->getSenderCounts (ptheSender.get (), theAdmitted, theThrottled));
+	CHECK_EQUAL ((LONG)theRequests, theAdmitted);
+	CHECK (theThrottled > 0);
+	CHECK_EQUAL ((LONG)theRequests, theWorker.m_theProcessed);
+} // TEST (Test_ThreadItRateLimiter_delay)
+
+/**
+ * Test_ThreadItRateLimiter_interface checks that the sender set on a
+ * CISafeThreadItInterface is limited and that a throttled work package that
+ * expects no response is dropped with its object freed by releaseObject.
+ */
+TEST (Test_ThreadItRateLimiter_interface)
+{
+	const ULONG theRequests = 50;
+	ULONG theSent = 0;
+	LONG theAdmitted = 0;
+	LONG theThrottled = 0;
+	ThreadItPtr ptheSender (new CLimitedSender ());
+	std::shared_ptr<CLimitedWorker> ptheWorker (new CLimitedWorker ());
+	ThreadItRateLimiterPtr ptheLimiter (new CThreadItRateLimiter ());
+	CISafeThreadItInterface theInterface (ptheWorker, ptheSender);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItRateLimiter"));
+	logger->info ("Testing - Test_ThreadItRateLimiter_interface");
+
+	CHECK (ptheLimiter->setSenderLimit (ptheSender.get (), 10, 5));
+	ptheWorker->setRateLimiter (ptheLimiter);
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		if (theInterface.sendMessage (LIMITED_WORK, new ULONG (i)))
+		{
+			theSent++;
+		} // if
+	} // for
+	waitForIdle (*ptheWorker);
+	CHECK_EQUAL (theRequests, theSent);
+	CHECK (ptheLimiter->getSenderCounts (ptheSender.get (), theAdmitted, theThrottled));
+	logger->infoStream () << "interface admitted " << theAdmitted << " throttled " << theThrottled;
+	CHECK_EQUAL ((LONG)theRequests, theAdmitted + theThrottled);
+	CHECK (theAdmitted >= 5);
+	CHECK (theThrottled > 0);
+	// Nothing was left to the limit of the senders with no identity.
+	CHECK (ptheLimiter->getSenderCounts (NULL, theAdmitted, theThrottled));
+	CHECK_EQUAL (0, theAdmitted + theThrottled);
+	CHECK (ptheLimiter->getSenderCounts (ptheSender.get (), theAdmitted, theThrottled));
+	CHECK_EQUAL (theAdmitted, ptheWorker->m_theProcessed);
+	CHECK_EQUAL (theThrottled, ptheWorker->m_theReleased);
+} // TEST (Test_ThreadItRateLimiter_interface)
+
+/**
+ * Test_ThreadItRateLimiter_refund checks that a sender keeps its token when the
+ * instruction limit throttles its work package and that a sender can give up its slot.
+ */
+TEST (Test_ThreadItRateLimiter_refund)
+{
+	const ULONG theRequests = 20;
+	ULONG theAccepted = 0;
+	LONG theAdmitted = 0;
+	LONG theThrottled = 0;
+	ThreadItPtr ptheSender (new CLimitedSender ());
+	ThreadItRateLimiterPtr ptheLimiter (new CThreadItRateLimiter ());
+	CLimitedWorker theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItRateLimiter"));
+	logger->info ("Testing - Test_ThreadItRateLimiter_refund");
+
+	// The sender earns a token a second so the test sees only its burst.
+	CHECK (ptheLimiter->setSenderLimit (ptheSender.get (), 1, 10));
+	CHECK (ptheLimiter->setInstructionLimit (LIMITED_WORK, 1, 2));
+	theWorker.setRateLimiter (ptheLimiter);
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		if (sendLimited (theWorker, ptheSender, NULL))
+		{
+			theAccepted++;
+		} // if
+	} // for
+	CHECK_EQUAL (2u, theAccepted);
+	// The sender has only used the tokens of the work admitted.
+	CHECK (ptheLimiter->setInstructionLimit (LIMITED_WORK, 0, 0));
+	theAccepted = 0;
+	for (ULONG i = 0; i < 8; i++)
+	{
+		if (sendLimited (theWorker, ptheSender, NULL))
+		{
+			theAccepted++;
+		} // if
+	} // for
+	CHECK_EQUAL (8u, theAccepted);
+	CHECK (!sendLimited (theWorker, ptheSender, NULL));
+	waitForIdle (theWorker);
+	// The slot of a removed sender is no longer found.
+	CHECK (ptheLimiter->removeSender (ptheSender.get ()));
+	CHECK (!ptheLimiter->removeSender (ptheSender.get ()));
+	CHECK (!ptheLimiter->getSenderCounts (ptheSender.get (), theAdmitted, theThrottled));
+} // TEST (Test_ThreadItRateLimiter_refund)
@@ -0,0 +1,489 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItResultCache
+ * Description: TestThreadItResultCache contains unit tests for the
+ * CThreadItResultCache class used by CThreadIt. The tests check cache hits, the
+ * coalescing of identical requests sent to replicas that share a cache, the replica
+ * a coalesced request is answered through, the time to live of the results and the
+ * memory budget.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threaditresultcache.h"
+
+/** LOOKUP_WORK is the cached work instruction. */
+#define LOOKUP_WORK 1
+
+/**
+ * Class CLookupItem is a payload that can be cached.
+ */
+class CLookupItem : public CDataItem
+{
+public:
+	ULONG m_theKey;
+
+	CLookupItem (ULONG theKey) : m_theKey (theKey)
+	{
+	} // constructor CLookupItem
+
+	virtual bool getHash (ULONG& theHash) const
+	{
+		theHash = m_theKey * 0x9e3779b9;
+		return true;
+	} // getHash
+
+	virtual bool isEqual (const CDataItem& theOther) const
+	{
+		const CLookupItem* ptheOther = dynamic_cast<const CLookupItem*> (&theOther);
+
+		return ((ptheOther != NULL) && (ptheOther->m_theKey == m_theKey));
+	} // isEqual
+
+	virtual ULONG getSizeHint () const
+	{
+		return sizeof (CLookupItem);
+	} // getSizeHint
+
+}; // class CLookupItem
+
+/**
+ * Class CLookupResultItem is the result of a lookup.
+ */
+class CLookupResultItem : public CDataItem
+{
+public:
+	ULONG m_theValue;
+
+	CLookupResultItem (ULONG theValue) : m_theValue (theValue)
+	{
+	} // constructor CLookupResultItem
+
+}; // class CLookupResultItem
+
+/**
+ * Class CLookupWorker returns twice the key of each request after a delay and counts
+ * the number of times the worker method is called.
+ */
+class CLookupWorker : public CThreadIt
+{
+public:
+	/** m_theDelay is the time taken by each lookup in milliseconds. */
+	DWORD m_theDelay;
+	/** m_ptheCalls counts the calls of the worker method. It may be shared by replicas. */
+	volatile LONG* m_ptheCalls;
+	/** m_theContinues is the number of times each request returns WORKDONE_CONTINUE
+	 * before its result. */
+	ULONG m_theContinues;
+	/** m_theReleased counts the objects freed by releaseObject. */
+	volatile LONG m_theReleased;
+
+	CLookupWorker (DWORD theDelay, volatile LONG* ptheCalls) : CThreadIt ("threadit.CLookupWorker")
+	{
+		m_theDelay = theDelay;
+		m_ptheCalls = ptheCalls;
+		m_theContinues = 0;
+		m_theReleased = 0;
+		setWorkerMethod ((WorkerMethodType)&CLookupWorker::lookup, LOOKUP_WORK);
+	} // constructor CLookupWorker
+
+	~CLookupWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CLookupWorker
+
+	bool lookup (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		CLookupItem* ptheItem = (CLookupItem*)pWorkPack->m_ptheDataItem.get ();
+
+		InterlockedIncrement (m_ptheCalls);
+		if (m_theDelay > 0)
+		{
+			Sleep (m_theDelay);
+		} // if
+		pWorkDone = pWorkPack;
+		if (pWorkPack->m_theProgress < m_theContinues)
+		{
+			pWorkDone->m_theProgress++;
+			pWorkDone->m_theStatus = CThreadIt::WORKDONE_CONTINUE;
+		}
+		else
+		{
+			pWorkDone->m_ptheDataItem = DataItemPtr (new CLookupResultItem (ptheItem->m_theKey * 2));
+			pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		} // if
+		return true;
+	} // lookup
+
+	virtual void releaseObject (CWorkPackIt* pWorkPack)
+	{
+		delete (ULONG*)pWorkPack->m_ptheObject;
+		pWorkPack->m_ptheObject = NULL;
+		InterlockedIncrement (&m_theReleased);
+	} // releaseObject
+
+}; // class CLookupWorker
+
+/**
+ * Method sendLookup sends a lookup request with the result returned to theResults.
+ */
+static void sendLookup (CThreadIt* ptheWorker, ULONG theKey, WorkPackItQ& theResults)
+{
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+
+	ptheWorkPack->m_theInstruction = LOOKUP_WORK;
+	ptheWorkPack->m_ptheDataItem = DataItemPtr (new CLookupItem (theKey));
+	ptheWorkPack->m_isSendResult = true;
+	ptheWorkPack->m_isUseDefaultQ = false;
+	ptheWorkPack->m_ptheWorkDoneQ = &theResults;
+	ptheWorker->startWork (ptheWorkPack, theWorkPackId);
+} // sendLookup
+
+/**
+ * Method receiveLookup waits for a lookup result and returns its value or zero.
+ */
+static ULONG receiveLookup (WorkPackItQ& theResults)
+{
+	ULONG theValue = 0;
+	CWorkPackIt* ptheWorkDone = theResults.waitItem (2000);
+
+	if (ptheWorkDone != NULL)
+	{
+		if (ptheWorkDone->m_theStatus == CThreadIt::THREADIT_STATUS_OK)
+		{
+			theValue = ((CLookupResultItem*)ptheWorkDone->m_ptheDataItem.get ())->m_theValue;
+		} // if
+		delete ptheWorkDone;
+	} // if
+	return theValue;
+} // receiveLookup
+
+/**
+ * Test_ThreadItResultCache_hit checks that repeated requests are answered from the
+ * cache and that results expire after their time to live.
+ */
+TEST (Test_ThreadItResultCache_hit)
+{
+	volatile LONG theCalls = 0;
+	WorkPackItQ theResults;
+	ThreadItResultCachePtr ptheCache (new CThreadItResultCache ());
+	CLookupWorker theWorker (0, &theCalls);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItResultCache"));
+	logger->info ("Testing - Test_ThreadItResultCache_hit");
+
+	CHECK (!ptheCache->enable (CThreadIt::MAX_WORK_METHODS, 100));
+	CHECK (!ptheCache->enable (LOOKUP_WORK, 0));
+	CHECK (ptheCache->enable (LOOKUP_WORK, 100));
+	CHECK (ptheCache->isEnabled (LOOKUP_WORK));
+	theWorker.setResultCache (ptheCache);
+	for (ULONG i = 0; i < 10; i++)
+	{
+		sendLookup (&theWorker, 21, theResults);
+		CHECK_EQUAL (42u, receiveLookup (theResults));
+	} // for
+	CHECK_EQUAL (1, theCalls);
+	CHECK_EQUAL (9, ptheCache->getHitCount ());
+	CHECK_EQUAL (1, ptheCache->getMissCount ());
+	// A different payload is a miss.
+	sendLookup (&theWorker, 5, theResults);
+	CHECK_EQUAL (10u, receiveLookup (theResults));
+	CHECK_EQUAL (2, theCalls);
+	CHECK_EQUAL (2u, ptheCache->getEntryCount ());
+	// The result expires after its time to live.
+	Sleep (200);
+	sendLookup (&theWorker, 21, theResults);
+	CHECK_EQUAL (42u, receiveLookup (theResults));
+	CHECK_EQUAL (3, theCalls);
+	// The instruction is no longer cached once disabled.
+	ptheCache->disable (LOOKUP_WORK);
+	sendLookup (&theWorker, 21, theResults);
+	CHECK_EQUAL (42u, receiveLookup (theResults));
+	CHECK_EQUAL (4, theCalls);
+	ptheCache->clear ();
+	CHECK_EQUAL (0u, ptheCache->getEntryCount ());
+	CHECK_EQUAL (0u, ptheCache->getSize ());
+} // TEST (Test_ThreadItResultCache_hit)
+
+/**
+ * Test_ThreadItResultCache_singleFlight sends identical requests to replicas that
+ * share a cache while the first is in progress and checks that the worker method is
+ * called once and that every request gets the result.
+ */
+TEST (Test_ThreadItResultCache_singleFlight)
+{
+	const ULONG theReplicas = 4;
+	const ULONG theRequests = 16;
+	volatile LONG theCalls = 0;
+	ULONG theCorrect = 0;
+	WorkPackItQ theResults;
+	ThreadItResultCachePtr ptheCache (new CThreadItResultCache ());
+	std::vector<ThreadItPtr> theWorkers;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItResultCache"));
+	logger->info ("Testing - Test_ThreadItResultCache_singleFlight");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	ptheCache->enable (LOOKUP_WORK, INFINITE);
+	for (ULONG theReplica = 0; theReplica < theReplicas; theReplica++)
+	{
+		theWorkers.push_back (ThreadItPtr (new CLookupWorker (200, &theCalls)));
+		theWorkers[theReplica]->setResultCache (ptheCache);
+	} // for
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		sendLookup (theWorkers[i % theReplicas].get (), 7, theResults);
+	} // for
+	for (ULONG i = 0; i < theRequests; i++)
+	{
+		if (receiveLookup (theResults) == 14)
+		{
+			theCorrect++;
+		} // if
+	} // for
+	logger->infoStream () << "hits " << ptheCache->getHitCount () << " coalesced " << ptheCache->getCoalescedCount ();
+	CHECK_EQUAL (theRequests, theCorrect);
+	CHECK_EQUAL (1, theCalls);
+	CHECK_EQUAL (1, ptheCache->getMissCount ());
+	CHECK_EQUAL ((LONG)theRequests - 1, ptheCache->getHitCount () + ptheCache->getCoalescedCount ());
+	CHECK (ptheCache->getCoalescedCount () >= (LONG)(theReplicas - 1));
+	CHECK (theResults.getItem () == NULL);
+} // TEST (Test_ThreadItResultCache_singleFlight)
+
+/**
+ * Test_ThreadItResultCache_budget checks that the cache evicts results to stay
+ * within its memory budget.
+ */
+TEST (Test_ThreadItResultCache_budget)
+{
+	const ULONG theBudget = 32 * 1024;
+	const ULONG theKeys = 2000;
+	volatile LONG theCalls = 0;
+	WorkPackItQ theResults;
+	ThreadItResultCachePtr ptheCache (new CThreadItResultCache (theBudget));
+	CLookupWorker theWorker (0, &theCalls);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItResultCache"));
+	logger->info ("Testing - Test_ThreadItResultCache_budget");
+
+	ptheCache->enable (LOOKUP_WORK, INFINITE);
+	theWorker.setResultCache (ptheCache);
+	for (ULONG theKey = 1; theKey <= theKeys; theKey++)
+	{
+		sendLookup (&theWorker, theKey, theResults);
+		CHECK_EQUAL (theKey * 2, receiveLookup (theResults));
+	} // for
+	logger->infoStream () << "entries " << ptheCache->getEntryCount () << " bytes " << ptheCache->getSize ()
+		<< " evictions " << ptheCache->getEvictionCount ();
+	CHECK (ptheCache->getSize () <= theBudget);
+	CHECK (ptheCache->getEvictionCount () > 0);
+	CHECK_EQUAL ((LONG)theKeys, ptheCache->getEvictionCount () + (LONG)ptheCache->getEntryCount ());
+	// The most recent key is still cached.
+	sendLookup (&theWorker, theKeys, theResults);
+	CHECK_EQUAL (theKeys * 2, receiveLookup (theResults));
+	CHECK_EQUAL ((LONG)theKeys, theCalls);
+} // TEST (Test_ThreadItResultCache_budget)
+
+/**
+ * Class CLookupCompletion records the worker that answered a work package.
+ */
+class CLookupCompletion : public CThreadItCompletion
+{
+public:
+	/** m_ptheWorker is the worker given to the last call. */
+	CThreadIt* volatile m_ptheWorker;
+
+	CLookupCompletion () : m_ptheWorker (NULL)
+	{
+	} // constructor CLookupCompletion
+
+	virtual void onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess)
+	{
+		m_ptheWorker = ptheWorker;
+	} // onWorkDone
+
+}; // class CLookupCompletion
+
+/**
+ * Test_ThreadItResultCache_owner checks that a work package parked by one replica
+ * of a shared cache is answered through that replica when another one produces the
+ * result.
+ */
+TEST (Test_ThreadItResultCache_owner)
+{
+	volatile LONG theCalls = 0;
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CWorkPackIt* ptheWorkDone = NULL;
+	CLookupCompletion theCompletion;
+	ThreadItResultCachePtr ptheCache (new CThreadItResultCache ());
+	CLookupWorker theProducer (200, &theCalls);
+	CLookupWorker theWaiter (200, &theCalls);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItResultCache"));
+	logger->info ("Testing - Test_ThreadItResultCache_owner");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	CHECK (ptheCache->enable (LOOKUP_WORK, INFINITE));
+	theProducer.setResultCache (ptheCache);
+	theWaiter.setResultCache (ptheCache);
+	// Both results go to the default queue of the replica they were sent to.
+	ptheWorkPack = new CWorkPackIt ();
+	ptheWorkPack->m_theInstruction = LOOKUP_WORK;
+	ptheWorkPack->m_ptheDataItem = DataItemPtr (new CLookupItem (7));
+	ptheWorkPack->m_isSendResult = true;
+	theProducer.startWork (ptheWorkPack, theWorkPackId);
+	Sleep (50);
+	ptheWorkPack = new CWorkPackIt ();
+	ptheWorkPack->m_theInstruction = LOOKUP_WORK;
+	ptheWorkPack->m_ptheDataItem = DataItemPtr (new CLookupItem (7));
+	ptheWorkPack->m_isSendResult = true;
+	ptheWorkPack->m_ptheCompletion = &theCompletion;
+	theWaiter.startWork (ptheWorkPack, theWorkPackId);
+	ptheWorkDone = theProducer.getWork (2000);
+	CHECK (ptheWorkDone != NULL);
+	if (ptheWorkDone != NULL)
+	{
+		CHECK (ptheWorkDone->m_ptheSource == &theProducer);
+		delete ptheWorkDone;
+	} // if
+	ptheWorkDone = theWaiter.getWork (2000);
+	CHECK (ptheWorkDone != NULL);
+	if (ptheWorkDone != NULL)
+	{
+		CHECK (ptheWorkDone->m_ptheSource == &theWaiter);
+		CHECK_EQUAL (14u, ((CLookupResultItem*)ptheWorkDone->m_ptheDataItem.get ())->m_theValue);
+		delete ptheWorkDone;
+	} // if
+	CHECK (theCompletion.m_ptheWorker == &theWaiter);
+	CHECK_EQUAL (1, theCalls);
+	CHECK_EQUAL (1, ptheCache->getCoalescedCount ());
+	CHECK (theProducer.getWork (0) == NULL);
+} // TEST (Test_ThreadItResultCache_owner)
+
+/**
+ * Test_ThreadItResultCache_continue checks that identical requests wait for the final
+ * run of a worker method that returns WORKDONE_CONTINUE.
+ */
+TEST (Test_ThreadItResultCache_continue)
+{
+	volatile LONG theCalls = 0;
+	WorkPackItQ theResults;
+	ThreadItResultCachePtr ptheCache (new CThreadItResultCache ());
+	CLookupWorker theWorker (50, &theCalls);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItResultCache"));
+	logger->info ("Testing - Test_ThreadItResultCache_continue");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	theWorker.m_theContinues = 2;
+	CHECK (ptheCache->enable (LOOKUP_WORK, INFINITE));
+	theWorker.setResultCache (ptheCache);
+	sendLookup (&theWorker, 7, theResults);
+	sendLookup (&theWorker, 7, theResults);
+	CHECK_EQUAL (14u, receiveLookup (theResults));
+	CHECK_EQUAL (14u, receiveLookup (theResults));
+	// The first request ran three times and the second waited for its final run.
+	CHECK_EQUAL (3, theCalls);
+	CHECK_EQUAL (1, ptheCache->getMissCount ());
+	CHECK_EQUAL (1, ptheCache->getCoalescedCount ());
+	CHECK_EQUAL (1u, ptheCache->getEntryCount ());
+	// The result is now cached.
+	sendLookup (&theWorker, 7, theResults);
+	CHECK_EQUAL (14u, receiveLookup (theResults));
+	CHECK_EQUAL (3, theCalls);
+	CHECK_EQUAL (1, ptheCache->getHitCount ());
+} // TEST (Test_ThreadItResultCache_continue)
+
+/**
+ * Method sendObjectLookup sends a lookup request that carries an object and expects
+ * no response.
+ */
+static void sendObjectLookup (CThreadIt* ptheWorker, ULONG theKey)
+{
+	ULONG theWorkPackId = 0;
+	CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+
+	ptheWorkPack->m_theInstruction = LOOKUP_WORK;
+	ptheWorkPack->m_ptheDataItem = DataItemPtr (new CLookupItem (theKey));
+	ptheWorkPack->m_ptheObject = new ULONG (theKey);
+	ptheWorker->startWork (ptheWorkPack, theWorkPackId);
+} // sendObjectLookup
+
+/**
+ * Method waitReleased waits for a worker to release a number of objects.
+ */
+static void waitReleased (CLookupWorker& theWorker, LONG theCount)
+{
+	DWORD theStart = GetTickCount ();
+
+	while ((theWorker.m_theReleased < theCount) && ((GetTickCount () - theStart) < 2000))
+	{
+		Sleep (10);
+	} // while
+} // waitReleased
+
+/**
+ * Test_ThreadItResultCache_release checks that the object of a request answered by the
+ * cache, as a hit or as a waiter, is released when no response is sent.
+ */
+TEST (Test_ThreadItResultCache_release)
+{
+	volatile LONG theCalls = 0;
+	WorkPackItQ theResults;
+	ThreadItResultCachePtr ptheCache (new CThreadItResultCache ());
+	CLookupWorker theProducer (200, &theCalls);
+	CLookupWorker theWaiter (0, &theCalls);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItResultCache"));
+	logger->info ("Testing - Test_ThreadItResultCache_release");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	CHECK (ptheCache->enable (LOOKUP_WORK, INFINITE));
+	theProducer.setResultCache (ptheCache);
+	theWaiter.setResultCache (ptheCache);
+	// The requests sent to the other replica wait for the result in progress.
+	sendLookup (&theProducer, 9, theResults);
+	Sleep (50);
+	sendObjectLookup (&theWaiter, 9);
+	sendObjectLookup (&theWaiter, 9);
+	CHECK_EQUAL (18u, receiveLookup (theResults));
+	waitReleased (theWaiter, 2);
+	CHECK_EQUAL (2, theWaiter.m_theReleased);
+	CHECK_EQUAL (2, ptheCache->getCoalescedCount ());
+	// The requests that follow are hits.
+	sendObjectLookup (&theProducer, 9);
+	sendObjectLookup (&theProducer, 9);
+	waitReleased (theProducer, 2);
+	CHECK_EQUAL (2, theProducer.m_theReleased);
+	CHECK_EQUAL (2, ptheCache->getHitCount ());
+	CHECK_EQUAL (1, theCalls);
+} // TEST (Test_ThreadItResultCache_release)
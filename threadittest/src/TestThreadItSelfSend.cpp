@@ -0,0 +1,294 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItSelfSend
+ * Description: TestThreadItSelfSend contains unit tests for work that the thread of
+ * execution sends to its own instance. The work is queued, processed within startWork
+ * up to the nesting limit, or kept in the list of the thread of execution depending
+ * on the mode set with CThreadIt::setSelfSendMode.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+
+/** SELF_CHAIN_WORK sends the next link of a chain of work to its own instance. */
+#define SELF_CHAIN_WORK 1
+/** SELF_CHAIN_LENGTH is the number of links in the chain. */
+#define SELF_CHAIN_LENGTH 10
+/** SELF_TIMED_WORK runs past its time allowed and sends SELF_QUICK_WORK to its own instance. */
+#define SELF_TIMED_WORK 2
+/** SELF_QUICK_WORK returns at once. */
+#define SELF_QUICK_WORK 3
+
+/**
+ * Class CSelfSender processes a chain of work where each link sends the next link
+ * to its own instance and records the order the links are started and finished in.
+ */
+class CSelfSender : public CThreadIt
+{
+public:
+	/** m_theStarted is the order the links were started in. */
+	ULONG m_theStarted[SELF_CHAIN_LENGTH];
+	/** m_theFinished is the order the links were finished in. */
+	ULONG m_theFinished[SELF_CHAIN_LENGTH];
+	/** m_theStartCount is the number of links started. */
+	ULONG m_theStartCount;
+	/** m_theFinishCount is the number of links finished. */
+	volatile LONG m_theFinishCount;
+	/** m_theMaxNesting is the deepest nesting of links seen. */
+	ULONG m_theMaxNesting;
+	/** m_theNesting is the number of links in progress. */
+	ULONG m_theNesting;
+
+	CSelfSender () : CThreadIt ("threadit.CSelfSender")
+	{
+		m_theStartCount = 0;
+		m_theFinishCount = 0;
+		m_theMaxNesting = 0;
+		m_theNesting = 0;
+		setWorkerMethod ((WorkerMethodType)&CSelfSender::chainWork, SELF_CHAIN_WORK);
+	} // constructor CSelfSender
+
+	~CSelfSender ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CSelfSender
+
+	bool chainWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		ULONG theWorkPackId = 0;
+		CWorkPackIt* ptheNext = NULL;
+
+		m_theNesting++;
+		if (m_theNesting > m_theMaxNesting)
+		{
+			m_theMaxNesting = m_theNesting;
+		} // if
+		m_theStarted[m_theStartCount++] = pWorkPack->m_theProgress;
+		if ((pWorkPack->m_theProgress + 1) < SELF_CHAIN_LENGTH)
+		{
+			ptheNext = new CWorkPackIt ();
+			ptheNext->m_theInstruction = SELF_CHAIN_WORK;
+			ptheNext->m_theProgress = pWorkPack->m_theProgress + 1;
+			startWork (ptheNext, theWorkPackId);
+		} // if
+		m_theFinished[m_theFinishCount] = pWorkPack->m_theProgress;
+		InterlockedIncrement (&m_theFinishCount);
+		m_theNesting--;
+		// No result is returned.
+		delete pWorkPack;
+		pWorkDone = NULL;
+		return true;
+	} // chainWork
+
+	/**
+	 * Method runChain starts the chain and waits for all its links to finish.
+	 */
+	bool runChain ()
+	{
+		ULONG theWorkPackId = 0;
+		DWORD theStart = 0;
+		CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+
+		ptheWorkPack->m_theInstruction = SELF_CHAIN_WORK;
+		ptheWorkPack->m_theProgress = 0;
+		startWork (ptheWorkPack, theWorkPackId);
+		theStart = GetTickCount ();
+		while ((m_theFinishCount < SELF_CHAIN_LENGTH) && ((GetTickCount () - theStart) < 5000))
+		{
+			Sleep (10);
+		} // while
+		return m_theFinishCount == SELF_CHAIN_LENGTH;
+	} // runChain
+
+}; // class CSelfSender
+
+/**
+ * Class CTimedSender checks the time left for its worker method after sending work
+ * to its own instance.
+ */
+class CTimedSender : public CThreadIt
+{
+public:
+	/** m_isTimeLeft is the result of isAvailableTime after the work was sent. */
+	bool m_isTimeLeft;
+	/** m_theElapsed is the time elapsed returned by isAvailableTime. */
+	DWORD m_theElapsed;
+	/** m_isDone is set when the timed work has finished. */
+	volatile LONG m_isDone;
+
+	CTimedSender () : CThreadIt ("threadit.CTimedSender")
+	{
+		m_isTimeLeft = true;
+		m_theElapsed = 0;
+		m_isDone = 0;
+		setWorkerMethod ((WorkerMethodType)&CTimedSender::timedWork, SELF_TIMED_WORK);
+		setWorkerMethod ((WorkerMethodType)&CTimedSender::quickWork, SELF_QUICK_WORK);
+	} // constructor CTimedSender
+
+	~CTimedSender ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CTimedSender
+
+	bool timedWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		ULONG theWorkPackId = 0;
+		CWorkPackIt* ptheQuick = new CWorkPackIt ();
+
+		Sleep (100);
+		// The quick work has no time allowed.
+		ptheQuick->m_theInstruction = SELF_QUICK_WORK;
+		startWork (ptheQuick, theWorkPackId);
+		m_isTimeLeft = isAvailableTime (m_theElapsed);
+		InterlockedExchange (&m_isDone, 1);
+		delete pWorkPack;
+		pWorkDone = NULL;
+		return true;
+	} // timedWork
+
+	bool quickWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		delete pWorkPack;
+		pWorkDone = NULL;
+		return true;
+	} // quickWork
+
+	/**
+	 * Method runTimed sends the timed work and waits for it to finish.
+	 */
+	bool runTimed (ULONG theTimeAllowed)
+	{
+		ULONG theWorkPackId = 0;
+		DWORD theStart = 0;
+		CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+
+		ptheWorkPack->m_theInstruction = SELF_TIMED_WORK;
+		ptheWorkPack->m_theTimeAllowed = theTimeAllowed;
+		startWork (ptheWorkPack, theWorkPackId);
+		theStart = GetTickCount ();
+		while ((m_isDone == 0) && ((GetTickCount () - theStart) < 5000))
+		{
+			Sleep (10);
+		} // while
+		return m_isDone != 0;
+	} // runTimed
+
+}; // class CTimedSender
+
+/**
+ * Test_ThreadIt_selfSendQueue checks that by default work sent by the thread of
+ * execution to its own instance goes through the work queue.
+ */
+TEST (Test_ThreadIt_selfSendQueue)
+{
+	CSelfSender theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItSelfSend"));
+	logger->info ("Testing - Test_ThreadIt_selfSendQueue");
+
+	CHECK_EQUAL ((int)CThreadIt::SELF_SEND_QUEUE, (int)theWorker.getSelfSendMode ());
+	CHECK (theWorker.runChain ());
+	CHECK_EQUAL (1u, theWorker.m_theMaxNesting);
+	for (ULONG i = 0; i < SELF_CHAIN_LENGTH; i++)
+	{
+		CHECK_EQUAL (i, theWorker.m_theStarted[i]);
+		CHECK_EQUAL (i, theWorker.m_theFinished[i]);
+	} // for
+	CHECK_EQUAL (0, theWorker.getInlineCount ());
+	CHECK_EQUAL (0, theWorker.getDeferredCount ());
+} // TEST (Test_ThreadIt_selfSendQueue)
+
+/**
+ * Test_ThreadIt_selfSendInline checks that work sent by the thread of execution to
+ * its own instance is processed within startWork until the nesting limit is reached
+ * and is kept in the list of the thread of execution after that.
+ */
+TEST (Test_ThreadIt_selfSendInline)
+{
+	CSelfSender theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItSelfSend"));
+	logger->info ("Testing - Test_ThreadIt_selfSendInline");
+
+	theWorker.setSelfSendMode (CThreadIt::SELF_SEND_INLINE, 3);
+	CHECK_EQUAL ((int)CThreadIt::SELF_SEND_INLINE, (int)theWorker.getSelfSendMode ());
+	CHECK (theWorker.runChain ());
+	for (ULONG i = 0; i < SELF_CHAIN_LENGTH; i++)
+	{
+		CHECK_EQUAL (i, theWorker.m_theStarted[i]);
+	} // for
+	// The first link and three nested links run together before the limit is reached.
+	CHECK_EQUAL (4u, theWorker.m_theMaxNesting);
+	CHECK_EQUAL (3u, theWorker.m_theFinished[0]);
+	logger->infoStream () << "inline " << theWorker.getInlineCount () << ", deferred " << theWorker.getDeferredCount ();
+	CHECK_EQUAL (SELF_CHAIN_LENGTH - 1, theWorker.getInlineCount () + theWorker.getDeferredCount ());
+	CHECK (theWorker.getDeferredCount () > 0);
+} // TEST (Test_ThreadIt_selfSendInline)
+
+/**
+ * Test_ThreadIt_selfSendDeferred checks that work sent by the thread of execution to
+ * its own instance is kept in the list of the thread of execution and processed in
+ * order without nesting.
+ */
+TEST (Test_ThreadIt_selfSendDeferred)
+{
+	CSelfSender theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItSelfSend"));
+	logger->info ("Testing - Test_ThreadIt_selfSendDeferred");
+
+	theWorker.setSelfSendMode (CThreadIt::SELF_SEND_DEFERRED);
+	CHECK (theWorker.runChain ());
+	CHECK_EQUAL (1u, theWorker.m_theMaxNesting);
+	for (ULONG i = 0; i < SELF_CHAIN_LENGTH; i++)
+	{
+		CHECK_EQUAL (i, theWorker.m_theStarted[i]);
+		CHECK_EQUAL (i, theWorker.m_theFinished[i]);
+	} // for
+	CHECK_EQUAL (0, theWorker.getInlineCount ());
+	CHECK_EQUAL (SELF_CHAIN_LENGTH - 1, theWorker.getDeferredCount ());
+} // TEST (Test_ThreadIt_selfSendDeferred)
+
+/**
+ * Test_ThreadIt_selfSendTiming checks that a worker method that runs work inline for
+ * its own instance keeps its own time allowed once the inline run returns.
+ */
+TEST (Test_ThreadIt_selfSendTiming)
+{
+	CTimedSender theWorker;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItSelfSend"));
+	logger->info ("Testing - Test_ThreadIt_selfSendTiming");
+
+	theWorker.setSelfSendMode (CThreadIt::SELF_SEND_INLINE);
+	CHECK (theWorker.runTimed (50));
+	CHECK_EQUAL (1, theWorker.getInlineCount ());
+	// The quick work had no time allowed but the timed work has run out of time.
+	CHECK (!theWorker.m_isTimeLeft);
+	CHECK (theWorker.m_theElapsed >= 90);
+} // TEST (Test_ThreadIt_selfSendTiming)
@@ -0,0 +1,314 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItShardGroup
+ * Description: TestThreadItShardGroup contains unit tests for the
+ * CThreadItShardGroup class. The number of keys that move when a shard is added or
+ * removed is checked and shards are added and removed while work is sent to check
+ * that the work of each key stays in order.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threaditshardgroup.h"
+
+/** SHARD_WORK is the work instruction processed by the shards. */
+#define SHARD_WORK  1
+
+/** The number of keys used by the tests. */
+const ULONG theShardKeys = 256;
+
+/**
+ * Class CShardSequenceItem holds the sequence number of a work package within its key.
+ */
+class CShardSequenceItem : public CDataItem
+{
+public:
+	LONG m_theSequence;
+
+	CShardSequenceItem (LONG theSequence) : m_theSequence (theSequence)
+	{
+	} // constructor CShardSequenceItem
+
+}; // class CShardSequenceItem
+
+/**
+ * Class CShardCheck is shared by the shards to check the order of each key.
+ */
+class CShardCheck
+{
+public:
+	/** m_theLast is the sequence number of the last work package of each key. */
+	LONG m_theLast[theShardKeys];
+	/** m_theBusy is the number of work packages of each key being processed. */
+	volatile LONG m_theBusy[theShardKeys];
+	/** m_theViolations is the number of work packages out of order or run in parallel. */
+	volatile LONG m_theViolations;
+	/** m_theProcessed is the number of work packages processed. */
+	volatile LONG m_theProcessed;
+
+	CShardCheck () : m_theViolations (0), m_theProcessed (0)
+	{
+		for (ULONG theKey = 0; theKey < theShardKeys; theKey++)
+		{
+			m_theLast[theKey] = -1;
+			m_theBusy[theKey] = 0;
+		} // for
+	} // constructor CShardCheck
+
+}; // class CShardCheck
+
+/**
+ * Class CShardWorker checks the order of the work packages of each key.
+ */
+class CShardWorker : public CThreadIt
+{
+public:
+	CShardWorker () : CThreadIt ("threadit.CShardWorker")
+	{
+		setWorkerMethod ((WorkerMethodType)&CShardWorker::work, SHARD_WORK);
+	} // constructor CShardWorker
+
+	~CShardWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CShardWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		CShardCheck* ptheCheck = (CShardCheck*)pWorkPack->m_ptheObject;
+		ULONG theKey = pWorkPack->m_theKey;
+		LONG theSequence = ((CShardSequenceItem*)pWorkPack->m_ptheDataItem.get ())->m_theSequence;
+
+		if (InterlockedIncrement (&ptheCheck->m_theBusy[theKey]) != 1)
+		{
+			InterlockedIncrement (&ptheCheck->m_theViolations);
+		} // if
+		if (ptheCheck->m_theLast[theKey] + 1 != theSequence)
+		{
+			InterlockedIncrement (&ptheCheck->m_theViolations);
+		} // if
+		ptheCheck->m_theLast[theKey] = theSequence;
+		// Give the other shards a chance to run while the key is busy.
+		if ((theSequence % 16) == 0)
+		{
+			Sleep (0);
+		} // if
+		InterlockedDecrement (&ptheCheck->m_theBusy[theKey]);
+		pWorkDone = NULL;
+		delete pWorkPack;
+		InterlockedIncrement (&ptheCheck->m_theProcessed);
+		return true;
+	} // work
+
+}; // class CShardWorker
+
+/**
+ * Test_ThreadItShardGroup_moved checks that adding a shard moves about 1/N of the
+ * keys and only to the new shard, and that removing it moves them back.
+ */
+TEST (Test_ThreadItShardGroup_moved)
+{
+	const ULONG theKeys = 10000;
+	ULONG theMoved = 0;
+	ULONG theNewShard = 0;
+	std::vector<ULONG> theOwners (theKeys);
+	CThreadItShardGroup theGroup;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItShardGroup"));
+	logger->info ("Testing - Test_ThreadItShardGroup_moved");
+
+	CHECK_EQUAL (ULONG_MAX, theGroup.getShardForKey (1));
+	for (ULONG theShard = 0; theShard < 4; theShard++)
+	{
+		CHECK_EQUAL (theShard, theGroup.addShard (ThreadItPtr (new CShardWorker ())));
+	} // for
+	CHECK_EQUAL (4u, theGroup.getShardCount ());
+	for (ULONG theKey = 0; theKey < theKeys; theKey++)
+	{
+		theOwners[theKey] = theGroup.getShardForKey (theKey);
+		CHECK (theOwners[theKey] < 4);
+	} // for
+	theNewShard = theGroup.addShard (ThreadItPtr (new CShardWorker ()));
+	CHECK_EQUAL (4u, theNewShard);
+	CHECK (theGroup.waitForMigration (1000));
+	for (ULONG theKey = 0; theKey < theKeys; theKey++)
+	{
+		if (theGroup.getShardForKey (theKey) != theOwners[theKey])
+		{
+			CHECK_EQUAL (theNewShard, theGroup.getShardForKey (theKey));
+			theMoved++;
+		} // if
+	} // for
+	logger->infoStream () << "keys moved to the fifth shard: " << theMoved << " of " << theKeys;
+	CHECK (theMoved > theKeys / 10);
+	CHECK (theMoved < theKeys * 3 / 10);
+	CHECK (theGroup.removeShard (theNewShard));
+	CHECK (!theGroup.removeShard (theNewShard));
+	CHECK (theGroup.waitForMigration (1000));
+	for (ULONG theKey = 0; theKey < theKeys; theKey++)
+	{
+		CHECK_EQUAL (theOwners[theKey], theGroup.getShardForKey (theKey));
+	} // for
+} // TEST (Test_ThreadItShardGroup_moved)
+
+/**
+ * Test_ThreadItShardGroup_rebalance adds and removes shards while work is sent and
+ * checks that the work packages of every key are processed in order and one at a time.
+ */
+TEST (Test_ThreadItShardGroup_rebalance)
+{
+	const ULONG theCount = 40000;
+	ULONG theWorkPackId = 0;
+	ULONG theKey = 0;
+	DWORD theStart = 0;
+	LONG theSequences[theShardKeys] = { 0 };
+	CShardCheck theCheck;
+	CWorkPackIt* ptheWorkPack = NULL;
+	CThreadItShardGroup theGroup (64);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItShardGroup"));
+	logger->info ("Testing - Test_ThreadItShardGroup_rebalance");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	for (ULONG theShard = 0; theShard < 4; theShard++)
+	{
+		theGroup.addShard (ThreadItPtr (new CShardWorker ()));
+	} // for
+	for (ULONG i = 0; i < theCount; i++)
+	{
+		theKey = (i * 7919) % theShardKeys;
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = SHARD_WORK;
+		ptheWorkPack->m_theKey = theKey;
+		ptheWorkPack->m_ptheDataItem = DataItemPtr (new CShardSequenceItem (theSequences[theKey]++));
+		ptheWorkPack->m_ptheObject = &theCheck;
+		CHECK (theGroup.startWork (ptheWorkPack, theWorkPackId));
+		if ((i % 8000) == 4000)
+		{
+			if (i < 20000)
+			{
+				CHECK (theGroup.addShard (ThreadItPtr (new CShardWorker ())) != ULONG_MAX);
+			}
+			else
+			{
+				CHECK (theGroup.removeShard (1));
+				CHECK (theGroup.addShard (ThreadItPtr (new CShardWorker ())) != ULONG_MAX);
+			} // if
+		} // if
+	} // for
+	theStart = GetTickCount ();
+	while ((theCheck.m_theProcessed < (LONG)theCount) && ((GetTickCount () - theStart) < 8000))
+	{
+		Sleep (1);
+	} // while
+	CHECK_EQUAL ((LONG)theCount, theCheck.m_theProcessed);
+	CHECK_EQUAL (0, theCheck.m_theViolations);
+	CHECK (theGroup.waitForMigration (1000));
+	logger->infoStream () << "shards at the end of the test: " << theGroup.getShardCount ();
+} // TEST (Test_ThreadItShardGroup_rebalance)
+
+/**
+ * Class CShardCompletion counts the completions of the work packages by tag.
+ */
+class CShardCompletion : public CThreadItCompletion
+{
+public:
+	/** m_theCalls counts the calls for each tag. */
+	std::vector<LONG> m_theCalls;
+	/** m_theCompleted is the number of calls. */
+	volatile LONG m_theCompleted;
+
+	CShardCompletion (ULONG theTags) : m_theCalls (theTags, 0), m_theCompleted (0)
+	{
+	} // constructor CShardCompletion
+
+	virtual void onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess)
+	{
+		if (theTag < m_theCalls.size ())
+		{
+			InterlockedIncrement (&m_theCalls[theTag]);
+		} // if
+		InterlockedIncrement (&m_theCompleted);
+	} // onWorkDone
+
+}; // class CShardCompletion
+
+/**
+ * Test_ThreadItShardGroup_completion checks that the completion named by a work package
+ * sent through the group is called once with its own tag, including for work packages
+ * held by a migration.
+ */
+TEST (Test_ThreadItShardGroup_completion)
+{
+	const ULONG theCount = 4000;
+	ULONG theWorkPackId = 0;
+	ULONG theKey = 0;
+	DWORD theStart = 0;
+	LONG theSequences[theShardKeys] = { 0 };
+	CShardCheck theCheck;
+	CShardCompletion theCompletion (theCount);
+	CWorkPackIt* ptheWorkPack = NULL;
+	CThreadItShardGroup theGroup (64);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItShardGroup"));
+	logger->info ("Testing - Test_ThreadItShardGroup_completion");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	for (ULONG theShard = 0; theShard < 2; theShard++)
+	{
+		theGroup.addShard (ThreadItPtr (new CShardWorker ()));
+	} // for
+	for (ULONG i = 0; i < theCount; i++)
+	{
+		theKey = (i * 7919) % theShardKeys;
+		ptheWorkPack = new CWorkPackIt ();
+		ptheWorkPack->m_theInstruction = SHARD_WORK;
+		ptheWorkPack->m_theKey = theKey;
+		ptheWorkPack->m_ptheDataItem = DataItemPtr (new CShardSequenceItem (theSequences[theKey]++));
+		ptheWorkPack->m_ptheObject = &theCheck;
+		ptheWorkPack->m_ptheCompletion = &theCompletion;
+		ptheWorkPack->m_theCompletionTag = i;
+		CHECK (theGroup.startWork (ptheWorkPack, theWorkPackId));
+		if (i == (theCount / 2))
+		{
+			CHECK (theGroup.addShard (ThreadItPtr (new CShardWorker ())) != ULONG_MAX);
+		} // if
+	} // for
+	theStart = GetTickCount ();
+	while ((theCompletion.m_theCompleted < (LONG)theCount) && ((GetTickCount () - theStart) < 5000))
+	{
+		Sleep (1);
+	} // while
+	CHECK_EQUAL ((LONG)theCount, theCompletion.m_theCompleted);
+	for (ULONG i = 0; i < theCount; i++)
+	{
+		CHECK_EQUAL (1, theCompletion.m_theCalls[i]);
+	} // for
+	CHECK_EQUAL (0, theCheck.m_theViolations);
+	CHECK (theGroup.waitForMigration (1000));
+} // TEST (Test_ThreadItShardGroup_completion)
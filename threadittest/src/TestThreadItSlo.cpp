@@ -0,0 +1,232 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItSlo
+ * Description: TestThreadItSlo contains unit tests for the windows of the latency
+ * histograms and the breaches and recoveries found by CThreadItSloMonitor.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+#include "threadithistogram.h"
+#include "threaditslo.h"
+
+/** SLO_DELAY_WORK sleeps for the delay of the worker. */
+#define SLO_DELAY_WORK 1
+/** SLO_EVENT_WORK receives the events of the monitor. */
+#define SLO_EVENT_WORK 1
+/** SLO_SLOW_TIME is the delay in milliseconds of the slow work. */
+#define SLO_SLOW_TIME 40
+
+/**
+ * Class CSloWorker takes a set time to process its work.
+ */
+class CSloWorker : public CThreadIt
+{
+private:
+	volatile DWORD m_theDelay;
+
+public:
+	CSloWorker () : CThreadIt ("threadit.CSloWorker")
+	{
+		m_theDelay = 0;
+		setWorkerMethod ((WorkerMethodType)&CSloWorker::delayWork, SLO_DELAY_WORK);
+	} // constructor CSloWorker
+
+	~CSloWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CSloWorker
+
+	void setDelay (DWORD theDelay)
+	{
+		m_theDelay = theDelay;
+	} // setDelay
+
+	bool delayWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		if (m_theDelay > 0)
+		{
+			Sleep (m_theDelay);
+		} // if
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // delayWork
+
+	void sendWork ()
+	{
+		ULONG theWorkPackId = 0;
+		CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+
+		ptheWorkPack->m_theInstruction = SLO_DELAY_WORK;
+		startWork (ptheWorkPack, theWorkPackId);
+	} // sendWork
+
+}; // class CSloWorker
+
+/**
+ * Class CSloSubscriber counts the events sent by the monitor.
+ */
+class CSloSubscriber : public CThreadIt
+{
+private:
+	volatile LONG m_theBreaches;
+	volatile LONG m_theRecoveries;
+
+public:
+	CSloSubscriber () : CThreadIt ("threadit.CSloSubscriber")
+	{
+		m_theBreaches = 0;
+		m_theRecoveries = 0;
+		setWorkerMethod ((WorkerMethodType)&CSloSubscriber::eventWork, SLO_EVENT_WORK);
+	} // constructor CSloSubscriber
+
+	~CSloSubscriber ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CSloSubscriber
+
+	bool eventWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		CThreadItSloEvent* ptheEvent = CThreadItSloEvent::fromWorkPack (pWorkPack);
+
+		if (ptheEvent != NULL)
+		{
+			if (ptheEvent->m_isBreached)
+			{
+				InterlockedIncrement (&m_theBreaches);
+			}
+			else
+			{
+				InterlockedIncrement (&m_theRecoveries);
+			} // if
+			delete ptheEvent;
+		} // if
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // eventWork
+
+	LONG getBreaches () const
+	{
+		return m_theBreaches;
+	} // getBreaches
+
+	LONG getRecoveries () const
+	{
+		return m_theRecoveries;
+	} // getRecoveries
+
+}; // class CSloSubscriber
+
+/**
+ * Test_Slo_window checks that an older snapshot subtracted from a newer one leaves the
+ * times recorded between them.
+ */
+TEST (Test_Slo_window)
+{
+	CThreadItHistogram theHistogram;
+	CThreadItHistogram theOlder;
+	CThreadItHistogram theWindow;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItSlo"));
+	logger->info ("Testing - Test_Slo_window");
+
+	for (int theIndex = 0; theIndex < 100; theIndex++)
+	{
+		theHistogram.record (10000);
+	} // for
+	theOlder = theHistogram;
+	for (int theIndex = 0; theIndex < 10; theIndex++)
+	{
+		theHistogram.record (10);
+	} // for
+	theWindow = theHistogram;
+	theWindow.subtract (theOlder);
+	CHECK_EQUAL (10u, theWindow.getCount ());
+	CHECK_EQUAL (10, theWindow.getMean ());
+	CHECK_EQUAL (10, theWindow.getPercentile (99.0));
+	// A snapshot taken before a reset leaves nothing.
+	theWindow.subtract (theHistogram);
+	CHECK_EQUAL (0u, theWindow.getCount ());
+} // TEST (Test_Slo_window)
+
+/**
+ * Test_Slo_breach checks that a breach and the recovery are sent to a subscriber.
+ */
+TEST (Test_Slo_breach)
+{
+	ULONG theSloId = 0;
+	DWORD theStart = 0;
+	CThreadItSloEvent theStatus;
+	std::shared_ptr<CSloWorker> sptheWorker (new CSloWorker ());
+	std::shared_ptr<CSloSubscriber> sptheSubscriber (new CSloSubscriber ());
+	CThreadItSloMonitor theMonitor (50);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItSlo"));
+	logger->info ("Testing - Test_Slo_breach");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CHECK_EQUAL (0u, theMonitor.addSlo ("bad", sptheWorker, CThreadIt::MAX_WORK_METHODS, 99.0, 20000, 500));
+	// The p90 of the service time should stay within 20 ms over half a second.
+	theSloId = theMonitor.addSlo ("delay", sptheWorker, SLO_DELAY_WORK, 90.0, 20000, 500, CThreadItSloMonitor::SLO_SERVICE);
+	CHECK (theSloId != 0);
+	theMonitor.subscribe (sptheSubscriber, SLO_EVENT_WORK);
+	sptheWorker->setDelay (SLO_SLOW_TIME);
+	for (int theIndex = 0; theIndex < 10; theIndex++)
+	{
+		sptheWorker->sendWork ();
+	} // for
+	theStart = GetTickCount ();
+	while ((sptheSubscriber->getBreaches () == 0) && ((GetTickCount () - theStart) < 3000))
+	{
+		Sleep (20);
+	} // while
+	CHECK_EQUAL (1, sptheSubscriber->getBreaches ());
+	CHECK (theMonitor.getStatus (theSloId, theStatus));
+	CHECK (theStatus.m_isBreached);
+	CHECK (theStatus.m_theValue > 20000);
+	CHECK_EQUAL (std::string ("delay"), theStatus.m_theName);
+	// Fast work recovers the objective once the slow work has left the window.
+	sptheWorker->setDelay (0);
+	theStart = GetTickCount ();
+	while ((sptheSubscriber->getRecoveries () == 0) && ((GetTickCount () - theStart) < 5000))
+	{
+		sptheWorker->sendWork ();
+		Sleep (20);
+	} // while
+	CHECK_EQUAL (1, sptheSubscriber->getRecoveries ());
+	CHECK_EQUAL (1, theMonitor.getBreachCount ());
+	CHECK_EQUAL (1, theMonitor.getRecoveryCount ());
+	CHECK (theMonitor.getStatus (theSloId, theStatus));
+	CHECK (!theStatus.m_isBreached);
+	theMonitor.unsubscribe (sptheSubscriber);
+	CHECK (theMonitor.removeSlo (theSloId));
+	CHECK (!theMonitor.removeSlo (theSloId));
+} // TEST (Test_Slo_breach)
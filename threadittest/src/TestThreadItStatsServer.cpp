@@ -0,0 +1,250 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItStatsServer
+ * Description: TestThreadItStatsServer contains unit tests for the registry snapshot
+ * of the active objects (see CActive::getRegistrySnapshot) and for the named pipe
+ * that CThreadItStatsServer serves it on.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+#include "threaditstatsserver.h"
+#include "strutil.h"
+
+/** REGISTRY_SLOW_WORK sleeps until it is released. */
+#define REGISTRY_SLOW_WORK 3
+
+/**
+ * Class CRegistryWorker does work that runs until it is released.
+ */
+class CRegistryWorker : public CThreadIt
+{
+public:
+	/** m_isRelease is set to end the slow work. */
+	volatile bool m_isRelease;
+
+	CRegistryWorker () : CThreadIt ("threadit.CRegistryWorker")
+	{
+		m_isRelease = false;
+		setWorkerMethod ((WorkerMethodType)&CRegistryWorker::slowWork, REGISTRY_SLOW_WORK);
+	} // constructor CRegistryWorker
+
+	~CRegistryWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CRegistryWorker
+
+	bool slowWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		while (!m_isRelease)
+		{
+			Sleep (5);
+		} // while
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // slowWork
+
+	/**
+	 * Method findInfo returns the entry of this instance in a registry snapshot.
+	 */
+	bool findInfo (ActiveInfo& theInfo)
+	{
+		bool isFound = false;
+		std::vector<ActiveInfo> theSnapshot;
+
+		CActive::getRegistrySnapshot (theSnapshot);
+		for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+		{
+			if (theSnapshot[theIndex].theThreadId == getThreadId ())
+			{
+				theInfo = theSnapshot[theIndex];
+				isFound = true;
+			} // if
+		} // for
+		return isFound;
+	} // findInfo
+
+}; // class CRegistryWorker
+
+/**
+ * Test_Active_registry checks that the snapshot shows a CThreadIt with the work in
+ * its queue and the instruction in progress, and that the instance leaves the
+ * registry when it is destroyed.
+ */
+TEST (Test_Active_registry)
+{
+	ULONG theWorkPackId = 0;
+	UINT theThreadId = 0;
+	DWORD theStart = 0;
+	bool isFound = false;
+	CWorkPackIt* ptheWorkPack = NULL;
+	ActiveInfo theInfo;
+	std::vector<ActiveInfo> theSnapshot;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItStatsServer"));
+	logger->info ("Testing - Test_Active_registry");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	{
+		CRegistryWorker theWorker;
+		theThreadId = theWorker.getThreadId ();
+		CHECK (theWorker.findInfo (theInfo));
+		CHECK (theInfo.isThreadIt);
+		CHECK (theInfo.isRunning);
+		CHECK_EQUAL (-1, theInfo.theCurrentInstruction);
+		CHECK_EQUAL (0, theInfo.theProcessedCount);
+		for (int i = 0; i < 2; i++)
+		{
+			ptheWorkPack = new CWorkPackIt ();
+			ptheWorkPack->m_theInstruction = REGISTRY_SLOW_WORK;
+			ptheWorkPack->m_isSendResult = true;
+			theWorker.startWork (ptheWorkPack, theWorkPackId);
+		} // for
+		// Wait for the first work package to be in progress.
+		theStart = GetTickCount ();
+		while ((theWorker.findInfo (theInfo)) && (theInfo.theCurrentInstruction != REGISTRY_SLOW_WORK) && ((GetTickCount () - theStart) < 2000))
+		{
+			Sleep (5);
+		} // while
+		Sleep (50);
+		CHECK (theWorker.findInfo (theInfo));
+		CHECK_EQUAL (REGISTRY_SLOW_WORK, theInfo.theCurrentInstruction);
+		CHECK (theInfo.theCurrentTime >= 40);
+		CHECK_EQUAL (1, theInfo.theWorkQDepth);
+		theWorker.m_isRelease = true;
+		theStart = GetTickCount ();
+		while ((theWorker.findInfo (theInfo)) && (theInfo.theDoneQDepth < 2) && ((GetTickCount () - theStart) < 2000))
+		{
+			Sleep (5);
+		} // while
+		CHECK_EQUAL (2, theInfo.theDoneQDepth);
+		CHECK_EQUAL (2, theInfo.theProcessedCount);
+		CHECK_EQUAL (2, theWorker.getProcessedCount ());
+		CHECK_EQUAL (-1, theInfo.theCurrentInstruction);
+		logger->infoStream () << theInfo.theName << " used " << theInfo.theUserTime << "us user " << theInfo.theKernelTime << "us kernel";
+		delete theWorker.getWork (0);
+		delete theWorker.getWork (0);
+	}
+	CActive::getRegistrySnapshot (theSnapshot);
+	for (size_t theIndex = 0; theIndex < theSnapshot.size (); theIndex++)
+	{
+		isFound = isFound || (theSnapshot[theIndex].theThreadId == theThreadId);
+	} // for
+	CHECK (!isFound);
+} // TEST (Test_Active_registry)
+
+/**
+ * Test_StatsServer_format checks the JSON and Prometheus text of a snapshot.
+ */
+TEST (Test_StatsServer_format)
+{
+	std::vector<ActiveInfo> theSnapshot (1);
+	std::string theText;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItStatsServer"));
+	logger->info ("Testing - Test_StatsServer_format");
+
+	theSnapshot[0].theName = "odd \"name\"\\";
+	theSnapshot[0].theThreadId = 42;
+	theSnapshot[0].theInstance = 7;
+	theSnapshot[0].isRunning = true;
+	theSnapshot[0].theKernelTime = 1000;
+	theSnapshot[0].theUserTime = 2500000;
+	theSnapshot[0].theWallTime = 10000000;
+	theSnapshot[0].theWaitTime = 7500000;
+	theSnapshot[0].theWaitCount = 12;
+	theSnapshot[0].isThreadIt = true;
+	theSnapshot[0].theWorkQDepth = 3;
+	theSnapshot[0].theDoneQDepth = 1;
+	theSnapshot[0].theProcessedCount = 99;
+	theSnapshot[0].theCurrentInstruction = 5;
+	theSnapshot[0].theCurrentTime = 1500;
+	theSnapshot[0].theAllocationCount = 198;
+	theSnapshot[0].theAllocatedBytes = 4096;
+	theSnapshot[0].thePeakAllocatedBytes = 512;
+	theText = CThreadItStatsServer::toJson (theSnapshot);
+	logger->info (theText);
+	CHECK (theText.find ("\"name\":\"odd \\\"name\\\"\\\\\"") != std::string::npos);
+	CHECK (theText.find ("\"threadId\":42") != std::string::npos);
+	CHECK (theText.find ("\"workQDepth\":3") != std::string::npos);
+	CHECK (theText.find ("\"processed\":99") != std::string::npos);
+	CHECK (theText.find ("\"currentInstruction\":5") != std::string::npos);
+	CHECK (theText.find ("\"waitUs\":7500000") != std::string::npos);
+	CHECK (theText.find ("\"allocs\":198") != std::string::npos);
+	CHECK (theText.find ("\"allocsPerMsg\":2") != std::string::npos);
+	theText = CThreadItStatsServer::toPrometheus (theSnapshot);
+	logger->info (theText);
+	CHECK (theText.find ("threadit_processed_total{name=\"odd \\\"name\\\"\\\\\",thread_id=\"42\"} 99") != std::string::npos);
+	CHECK (theText.find ("threadit_cpu_user_seconds_total{name=\"odd \\\"name\\\"\\\\\",thread_id=\"42\"} 2.5") != std::string::npos);
+	CHECK (theText.find ("# TYPE threadit_work_queue_depth gauge") != std::string::npos);
+	CHECK (theText.find ("threadit_wait_seconds_total{name=\"odd \\\"name\\\"\\\\\",thread_id=\"42\"} 7.5") != std::string::npos);
+	CHECK (theText.find ("threadit_allocation_peak_bytes{name=\"odd \\\"name\\\"\\\\\",thread_id=\"42\"} 512") != std::string::npos);
+} // TEST (Test_StatsServer_format)
+
+/**
+ * Test_StatsServer_pipe checks that each client of the pipe is sent a snapshot that
+ * includes the server itself.
+ */
+TEST (Test_StatsServer_pipe)
+{
+	std::string thePipeName = "threadittest.stats." + strutil::toString (GetCurrentProcessId ());
+	std::string thePath = CThreadItStatsServer::getPipePath (thePipeName);
+	std::string theText;
+	HANDLE theClient = INVALID_HANDLE_VALUE;
+	char theBuffer[4096];
+	DWORD theRead = 0;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItStatsServer"));
+	logger->info ("Testing - Test_StatsServer_pipe");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CThreadItStatsServer theServer (thePipeName);
+	CHECK (theServer.isListening ());
+	for (int theClientCount = 0; theClientCount < 2; theClientCount++)
+	{
+		theText.clear ();
+		CHECK (WaitNamedPipeA (thePath.c_str (), 2000) != FALSE);
+		theClient = CreateFileA (thePath.c_str (), GENERIC_READ, 0, NULL, OPEN_EXISTING, 0, NULL);
+		CHECK (theClient != INVALID_HANDLE_VALUE);
+		if (theClient != INVALID_HANDLE_VALUE)
+		{
+			// Read until the server disconnects.
+			while (ReadFile (theClient, theBuffer, sizeof (theBuffer), &theRead, NULL) && (theRead > 0))
+			{
+				theText.append (theBuffer, theRead);
+			} // while
+			CloseHandle (theClient);
+		} // if
+		CHECK (theText.find ("\"threads\":[") != std::string::npos);
+		CHECK (theText.find ("CThreadItStatsServer") != std::string::npos);
+	} // for
+	logger->info (theText);
+	CHECK_EQUAL (2, theServer.getServedCount ());
+} // TEST (Test_StatsServer_pipe)
@@ -0,0 +1,373 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItStrand
+ * Description: TestThreadItStrand contains unit tests for the CThreadItStrandGroup
+ * class. Work packages with keys drawn from a Zipf distribution are submitted and
+ * the workers check that the work packages of each key arrive in order and never
+ * run at the same time. The time taken is compared with static sharding of the
+ * keys over the same workers.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <cmath>
+#include <algorithm>
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threaditstrand.h"
+
+/** STRAND_WORK is the work instruction processed by the strand workers. */
+#define STRAND_WORK  1
+
+/** The number of workers in the group. */
+const ULONG theStrandWorkers = 4;
+
+/**
+ * Class CSequenceItem holds the sequence number of a work package within its key.
+ */
+class CSequenceItem : public CDataItem
+{
+public:
+	LONG m_theSequence;
+
+	CSequenceItem (LONG theSequence) : m_theSequence (theSequence)
+	{
+	} // constructor CSequenceItem
+
+}; // class CSequenceItem
+
+/**
+ * Class CStrandCheck is shared by the workers to check the order of each key.
+ */
+class CStrandCheck
+{
+public:
+	/** m_theLast is the sequence number of the last work package of each key. */
+	std::vector<LONG> m_theLast;
+	/** m_theBusy is the number of work packages of each key being processed. */
+	std::vector<LONG> m_theBusy;
+	/** m_theViolations is the number of work packages out of order or run in parallel. */
+	volatile LONG m_theViolations;
+	/** m_theProcessed is the number of work packages processed. */
+	volatile LONG m_theProcessed;
+	/** m_theCost is the number of iterations spent on each work package. */
+	ULONG m_theCost;
+
+	CStrandCheck (ULONG theKeys, ULONG theCost) : m_theLast (theKeys, -1), m_theBusy (theKeys, 0), m_theViolations (0), m_theProcessed (0), m_theCost (theCost)
+	{
+	} // constructor CStrandCheck
+
+	bool waitForProcessed (LONG theCount, DWORD theTimeOut)
+	{
+		DWORD theStart = GetTickCount ();
+
+		while ((m_theProcessed < theCount) && ((GetTickCount () - theStart) < theTimeOut))
+		{
+			Sleep (1);
+		} // while
+		return (m_theProcessed >= theCount);
+	} // waitForProcessed
+
+}; // class CStrandCheck
+
+/**
+ * Class CStrandWorker checks and processes a work package.
+ */
+class CStrandWorker : public CThreadIt
+{
+public:
+	CStrandWorker () : CThreadIt ("threadit.CStrandWorker")
+	{
+		setWorkerMethod ((WorkerMethodType)&CStrandWorker::work, STRAND_WORK);
+	} // constructor CStrandWorker
+
+	~CStrandWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CStrandWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		CStrandCheck* ptheCheck = (CStrandCheck*)pWorkPack->m_ptheObject;
+		ULONG theKey = pWorkPack->m_theKey;
+		LONG theSequence = ((CSequenceItem*)pWorkPack->m_ptheDataItem.get ())->m_theSequence;
+		ULONG theValue = theKey;
+
+		if (InterlockedIncrement (&ptheCheck->m_theBusy[theKey]) != 1)
+		{
+			InterlockedIncrement (&ptheCheck->m_theViolations);
+		} // if
+		if (ptheCheck->m_theLast[theKey] + 1 != theSequence)
+		{
+			InterlockedIncrement (&ptheCheck->m_theViolations);
+		} // if
+		ptheCheck->m_theLast[theKey] = theSequence;
+		for (ULONG i = 0; i < ptheCheck->m_theCost; i++)
+		{
+			theValue = theValue * 1664525 + 1013904223;
+		} // for
+		InterlockedDecrement (&ptheCheck->m_theBusy[theKey]);
+		pWorkDone = NULL;
+		delete pWorkPack;
+		InterlockedIncrement (&ptheCheck->m_theProcessed);
+		return (theValue != 0) || (theKey == 0);
+	} // work
+
+}; // class CStrandWorker
+
+/**
+ * Class CStrandCompletion is the completion given by the caller. The tag holds the
+ * key in the high word and the sequence number in the low word.
+ */
+class CStrandCompletion : public CThreadItCompletion
+{
+public:
+	/** m_theNext is the sequence number expected next for each key. */
+	std::vector<LONG> m_theNext;
+	/** m_theViolations is the number of completions out of order. */
+	volatile LONG m_theViolations;
+	/** m_theCalls is the number of completions. */
+	volatile LONG m_theCalls;
+
+	CStrandCompletion (ULONG theKeys) : m_theNext (theKeys, 0), m_theViolations (0), m_theCalls (0)
+	{
+	} // constructor CStrandCompletion
+
+	virtual void onWorkDone (CThreadIt* ptheWorker, ULONG theTag, CWorkPackIt* ptheWorkDone, bool isSuccess)
+	{
+		ULONG theKey = theTag >> 16;
+
+		if ((theKey >= m_theNext.size ()) || (m_theNext[theKey] != (LONG)(theTag & 0xffff)))
+		{
+			InterlockedIncrement (&m_theViolations);
+		}
+		else
+		{
+			m_theNext[theKey]++;
+		} // if
+		InterlockedIncrement (&m_theCalls);
+	} // onWorkDone
+
+	bool waitForCalls (LONG theCount, DWORD theTimeOut)
+	{
+		DWORD theStart = GetTickCount ();
+
+		while ((m_theCalls < theCount) && ((GetTickCount () - theStart) < theTimeOut))
+		{
+			Sleep (1);
+		} // while
+		return (m_theCalls >= theCount);
+	} // waitForCalls
+
+}; // class CStrandCompletion
+
+/**
+ * Method makeZipfKeys returns theCount keys in [0, theKeys) drawn from a Zipf
+ * distribution with exponent theSkew. The sequence is the same on every call.
+ */
+static std::vector<ULONG> makeZipfKeys (ULONG theKeys, double theSkew, ULONG theCount)
+{
+	std::vector<double> theCdf (theKeys);
+	std::vector<ULONG> theResult (theCount);
+	double theTotal = 0;
+	ULONG theRandom = 12345;
+
+	for (ULONG theKey = 0; theKey < theKeys; theKey++)
+	{
+		theTotal += 1.0 / pow ((double)(theKey + 1), theSkew);
+		theCdf[theKey] = theTotal;
+	} // for
+	for (ULONG i = 0; i < theCount; i++)
+	{
+		theRandom = theRandom * 1664525 + 1013904223;
+		double theSample = theTotal * ((double)(theRandom >> 8) / (double)(1 << 24));
+		theResult[i] = (ULONG)(std::lower_bound (theCdf.begin (), theCdf.end (), theSample) - theCdf.begin ());
+		if (theResult[i] >= theKeys)
+		{
+			theResult[i] = theKeys - 1;
+		} // if
+	} // for
+	return theResult;
+} // makeZipfKeys
+
+/**
+ * Method waitForCompleted waits for the group to complete theCount work packages.
+ * The group must not be destroyed before the last completion has returned.
+ */
+static bool waitForCompleted (CThreadItStrandGroup& theGroup, LONG theCount, DWORD theTimeOut)
+{
+	DWORD theStart = GetTickCount ();
+
+	while ((theGroup.getCompletedCount () < theCount) && ((GetTickCount () - theStart) < theTimeOut))
+	{
+		Sleep (1);
+	} // while
+	return (theGroup.getCompletedCount () >= theCount);
+} // waitForCompleted
+
+/**
+ * Method makeWorkPack creates the next work package for a key.
+ */
+static CWorkPackIt* makeWorkPack (CStrandCheck& theCheck, std::vector<LONG>& theSequences, ULONG theKey)
+{
+	CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+
+	ptheWorkPack->m_theInstruction = STRAND_WORK;
+	ptheWorkPack->m_theKey = theKey;
+	ptheWorkPack->m_ptheObject = &theCheck;
+	ptheWorkPack->m_ptheDataItem = DataItemPtr (new CSequenceItem (theSequences[theKey]++));
+	return ptheWorkPack;
+} // makeWorkPack
+
+/**
+ * Test_ThreadItStrand_order checks that the work packages of each key are processed
+ * one at a time in order and that no strand remains once the work is done.
+ */
+TEST (Test_ThreadItStrand_order)
+{
+	const ULONG theKeys = 64;
+	const ULONG theCount = 20000;
+	CStrandWorker theWorkers[theStrandWorkers];
+	std::vector<CThreadIt*> theGroupWorkers;
+	CStrandCheck theCheck (theKeys, 200);
+	std::vector<LONG> theSequences (theKeys, 0);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItStrand"));
+	logger->info ("Testing - Test_ThreadItStrand_order");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	for (ULONG theWorker = 0; theWorker < theStrandWorkers; theWorker++)
+	{
+		theGroupWorkers.push_back (&theWorkers[theWorker]);
+	} // for
+	CThreadItStrandGroup theGroup (theGroupWorkers);
+	std::vector<ULONG> theKeyList = makeZipfKeys (theKeys, 1.1, theCount);
+	for (ULONG i = 0; i < theCount; i++)
+	{
+		CHECK (theGroup.submit (makeWorkPack (theCheck, theSequences, theKeyList[i])));
+	} // for
+	CHECK (waitForCompleted (theGroup, theCount, 8000));
+	CHECK_EQUAL ((LONG)theCount, theCheck.m_theProcessed);
+	CHECK_EQUAL (0, theCheck.m_theViolations);
+	CHECK_EQUAL ((LONG)theCount, theGroup.getSubmittedCount ());
+	CHECK_EQUAL (0u, theGroup.getActiveKeyCount ());
+} // TEST (Test_ThreadItStrand_order)
+
+/**
+ * Test_ThreadItStrand_benchmark compares the time taken to process Zipf distributed
+ * keys with the strand group and with static modulo sharding of the keys.
+ */
+TEST (Test_ThreadItStrand_benchmark)
+{
+	const ULONG theKeys = 1000;
+	const ULONG theCount = 50000;
+	const ULONG theCost = 5000;
+	LARGE_INTEGER theFrequency;
+	LARGE_INTEGER theStart;
+	LARGE_INTEGER theStop;
+	ULONG theWorkPackId = 0;
+	CStrandWorker theWorkers[theStrandWorkers];
+	std::vector<CThreadIt*> theGroupWorkers;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItStrand"));
+	logger->info ("Testing - Test_ThreadItStrand_benchmark");
+
+	for (ULONG theWorker = 0; theWorker < theStrandWorkers; theWorker++)
+	{
+		theGroupWorkers.push_back (&theWorkers[theWorker]);
+	} // for
+	std::vector<ULONG> theKeyList = makeZipfKeys (theKeys, 1.2, theCount);
+	QueryPerformanceFrequency (&theFrequency);
+	{
+		CStrandCheck theCheck (theKeys, theCost);
+		std::vector<LONG> theSequences (theKeys, 0);
+		CThreadItStrandGroup theGroup (theGroupWorkers);
+		QueryPerformanceCounter (&theStart);
+		for (ULONG i = 0; i < theCount; i++)
+		{
+			theGroup.submit (makeWorkPack (theCheck, theSequences, theKeyList[i]));
+		} // for
+		CHECK (waitForCompleted (theGroup, theCount, 60000));
+		QueryPerformanceCounter (&theStop);
+		CHECK_EQUAL (0, theCheck.m_theViolations);
+		logger->infoStream () << "strand group: " << (1000.0 * (double)(theStop.QuadPart - theStart.QuadPart)) / (double)theFrequency.QuadPart << "ms";
+	}
+	{
+		CStrandCheck theCheck (theKeys, theCost);
+		std::vector<LONG> theSequences (theKeys, 0);
+		CWorkPackIt* ptheWorkPack = NULL;
+		QueryPerformanceCounter (&theStart);
+		for (ULONG i = 0; i < theCount; i++)
+		{
+			ptheWorkPack = makeWorkPack (theCheck, theSequences, theKeyList[i]);
+			theWorkers[theKeyList[i] % theStrandWorkers].startWork (ptheWorkPack, theWorkPackId);
+		} // for
+		CHECK (theCheck.waitForProcessed (theCount, 60000));
+		QueryPerformanceCounter (&theStop);
+		CHECK_EQUAL (0, theCheck.m_theViolations);
+		logger->infoStream () << "modulo sharding: " << (1000.0 * (double)(theStop.QuadPart - theStart.QuadPart)) / (double)theFrequency.QuadPart << "ms";
+	}
+} // TEST (Test_ThreadItStrand_benchmark)
+
+/**
+ * Test_ThreadItStrand_completion checks that the completion given by the caller is
+ * called once for each work package in the order of its key.
+ */
+TEST (Test_ThreadItStrand_completion)
+{
+	const ULONG theKeys = 8;
+	const ULONG theCount = 2000;
+	CStrandWorker theWorkers[theStrandWorkers];
+	std::vector<CThreadIt*> theGroupWorkers;
+	CStrandCheck theCheck (theKeys, 100);
+	CStrandCompletion theCompletion (theKeys);
+	std::vector<LONG> theSequences (theKeys, 0);
+	CWorkPackIt* ptheWorkPack = NULL;
+	ULONG theKey = 0;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItStrand"));
+	logger->info ("Testing - Test_ThreadItStrand_completion");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	for (ULONG theWorker = 0; theWorker < theStrandWorkers; theWorker++)
+	{
+		theGroupWorkers.push_back (&theWorkers[theWorker]);
+	} // for
+	CThreadItStrandGroup theGroup (theGroupWorkers);
+	for (ULONG i = 0; i < theCount; i++)
+	{
+		theKey = i % theKeys;
+		ptheWorkPack = makeWorkPack (theCheck, theSequences, theKey);
+		ptheWorkPack->m_ptheCompletion = &theCompletion;
+		ptheWorkPack->m_theCompletionTag = (theKey << 16) | (ULONG)(theSequences[theKey] - 1);
+		CHECK (theGroup.submit (ptheWorkPack));
+	} // for
+	CHECK (theCompletion.waitForCalls (theCount, 8000));
+	CHECK_EQUAL ((LONG)theCount, theCompletion.m_theCalls);
+	CHECK_EQUAL (0, theCompletion.m_theViolations);
+	CHECK_EQUAL (0, theCheck.m_theViolations);
+	CHECK (waitForCompleted (theGroup, theCount, 1000));
+} // TEST (Test_ThreadItStrand_completion)
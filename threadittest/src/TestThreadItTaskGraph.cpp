@@ -0,0 +1,249 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItTaskGraph
+ * Description: TestThreadItTaskGraph contains unit tests for the CThreadItTaskGraph
+ * class. A graph that loads two values in parallel, joins them and fans the join
+ * out to several nodes is run repeatedly. Failure propagation and cycle detection
+ * are also checked.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadittaskgraph.h"
+
+/** TASK_VALUE returns the data item of the node. */
+#define TASK_VALUE   1
+/** TASK_SUM returns the sum of the inputs of the node. */
+#define TASK_SUM     2
+/** TASK_SCALE returns the first input multiplied by the data item of the node. */
+#define TASK_SCALE   3
+/** TASK_FAIL fails. */
+#define TASK_FAIL    4
+
+/** The number of fan out nodes. */
+const ULONG theFanOut = 4;
+/** The number of times the graph is run. */
+const ULONG theGraphRuns = 100;
+
+/**
+ * Class CLongDataItem is a data item that holds a single value.
+ */
+class CLongDataItem : public CDataItem
+{
+public:
+	LONG m_theValue;
+
+	CLongDataItem (LONG theValue) : m_theValue (theValue)
+	{
+	} // constructor CLongDataItem
+
+}; // class CLongDataItem
+
+/**
+ * Method getValue returns the value of a CLongDataItem or zero if there is none.
+ */
+static LONG getValue (const DataItemPtr& ptheDataItem)
+{
+	CLongDataItem* ptheItem = (CLongDataItem*)ptheDataItem.get ();
+
+	return (ptheItem != NULL) ? ptheItem->m_theValue : 0;
+} // getValue
+
+/**
+ * Class CTaskWorker performs the work of the graph nodes.
+ */
+class CTaskWorker : public CThreadIt
+{
+public:
+	CTaskWorker () : CThreadIt ("threadit.CTaskWorker")
+	{
+		setWorkerMethod ((WorkerMethodType)&CTaskWorker::value, TASK_VALUE);
+		setWorkerMethod ((WorkerMethodType)&CTaskWorker::sum, TASK_SUM);
+		setWorkerMethod ((WorkerMethodType)&CTaskWorker::scale, TASK_SCALE);
+		setWorkerMethod ((WorkerMethodType)&CTaskWorker::fail, TASK_FAIL);
+	} // constructor CTaskWorker
+
+	~CTaskWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CTaskWorker
+
+	bool value (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = new CWorkPackIt ();
+		pWorkDone->m_ptheDataItem = pWorkPack->m_ptheDataItem;
+		delete pWorkPack;
+		return true;
+	} // value
+
+	bool sum (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		LONG theSum = 0;
+		std::vector<DataItemPtr> theInputs;
+
+		CThreadItTaskRun::getRun (pWorkPack)->getInputs (pWorkPack->m_theCompletionTag, theInputs);
+		for (size_t i = 0; i < theInputs.size (); i++)
+		{
+			theSum += getValue (theInputs[i]);
+		} // for
+		pWorkDone = new CWorkPackIt ();
+		pWorkDone->m_ptheDataItem = DataItemPtr (new CLongDataItem (theSum));
+		delete pWorkPack;
+		return true;
+	} // sum
+
+	bool scale (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		std::vector<DataItemPtr> theInputs;
+
+		CThreadItTaskRun::getRun (pWorkPack)->getInputs (pWorkPack->m_theCompletionTag, theInputs);
+		pWorkDone = new CWorkPackIt ();
+		pWorkDone->m_ptheDataItem = DataItemPtr (new CLongDataItem (getValue (theInputs[0]) * getValue (pWorkPack->m_ptheDataItem)));
+		delete pWorkPack;
+		return true;
+	} // scale
+
+	bool fail (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = new CWorkPackIt ();
+		delete pWorkPack;
+		return false;
+	} // fail
+
+}; // class CTaskWorker
+
+/**
+ * Test_ThreadItTaskGraph_fanOut builds load A and B, join C, fan out D1..Dn and
+ * runs the compiled graph many times. The runs must be reused from the pool.
+ */
+TEST (Test_ThreadItTaskGraph_fanOut)
+{
+	ULONG theStatus = 0;
+	ULONG theNode = 0;
+	ULONG theJoin = 0;
+	ULONG theLeaves[theFanOut];
+	CTaskWorker theWorkerA;
+	CTaskWorker theWorkerB;
+	CThreadItTaskGraph theGraph;
+	CThreadItTaskRun* ptheRun = NULL;
+	CThreadItTaskRun* ptheFirstRun = NULL;
+	DataItemPtr ptheResult;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItTaskGraph"));
+	logger->info ("Testing - Test_ThreadItTaskGraph_fanOut");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	ULONG theLoadA = theGraph.addNode (&theWorkerA, TASK_VALUE, DataItemPtr (new CLongDataItem (1)));
+	ULONG theLoadB = theGraph.addNode (&theWorkerB, TASK_VALUE, DataItemPtr (new CLongDataItem (2)));
+	theJoin = theGraph.addNode (&theWorkerA, TASK_SUM);
+	CHECK (theGraph.addEdge (theLoadA, theJoin));
+	CHECK (theGraph.addEdge (theLoadB, theJoin));
+	for (theNode = 0; theNode < theFanOut; theNode++)
+	{
+		theLeaves[theNode] = theGraph.addNode ((theNode % 2) ? &theWorkerA : &theWorkerB, TASK_SCALE, DataItemPtr (new CLongDataItem (theNode + 1)));
+		CHECK (theGraph.addEdge (theJoin, theLeaves[theNode]));
+	} // for
+	CHECK (theGraph.compile ());
+	CHECK_EQUAL (ULONG_MAX, theGraph.addNode (&theWorkerA, TASK_VALUE));
+	for (ULONG theRun = 0; theRun < theGraphRuns; theRun++)
+	{
+		ptheRun = theGraph.start ();
+		CHECK (ptheRun != NULL);
+		if (ptheFirstRun == NULL)
+		{
+			ptheFirstRun = ptheRun;
+		} // if
+		CHECK (ptheRun == ptheFirstRun);
+		CHECK (ptheRun->wait (1000));
+		CHECK (ptheRun->isSuccess ());
+		CHECK (ptheRun->getResult (theJoin, ptheResult, theStatus));
+		CHECK_EQUAL (3, getValue (ptheResult));
+		for (theNode = 0; theNode < theFanOut; theNode++)
+		{
+			CHECK (ptheRun->getResult (theLeaves[theNode], ptheResult, theStatus));
+			CHECK_EQUAL ((LONG)(3 * (theNode + 1)), getValue (ptheResult));
+		} // for
+		theGraph.release (ptheRun);
+	} // for
+} // TEST (Test_ThreadItTaskGraph_fanOut)
+
+/**
+ * Test_ThreadItTaskGraph_failure checks that the nodes that depend on a failed node
+ * are not sent and that the run still completes.
+ */
+TEST (Test_ThreadItTaskGraph_failure)
+{
+	ULONG theStatus = 0;
+	CTaskWorker theWorker;
+	CThreadItTaskGraph theGraph;
+	CThreadItTaskRun* ptheRun = NULL;
+	DataItemPtr ptheResult;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItTaskGraph"));
+	logger->info ("Testing - Test_ThreadItTaskGraph_failure");
+
+	UNITTEST_TIME_CONSTRAINT (2000);
+
+	ULONG theFail = theGraph.addNode (&theWorker, TASK_FAIL);
+	ULONG theValue = theGraph.addNode (&theWorker, TASK_VALUE, DataItemPtr (new CLongDataItem (5)));
+	ULONG theSum = theGraph.addNode (&theWorker, TASK_SUM);
+	ULONG theScale = theGraph.addNode (&theWorker, TASK_SCALE, DataItemPtr (new CLongDataItem (2)));
+	theGraph.addEdge (theFail, theSum);
+	theGraph.addEdge (theValue, theSum);
+	theGraph.addEdge (theSum, theScale);
+	CHECK (theGraph.compile ());
+	ptheRun = theGraph.start ();
+	CHECK (ptheRun->wait (1000));
+	CHECK (!ptheRun->isSuccess ());
+	CHECK (ptheRun->getResult (theValue, ptheResult, theStatus));
+	CHECK_EQUAL (5, getValue (ptheResult));
+	CHECK (ptheRun->getResult (theScale, ptheResult, theStatus));
+	CHECK (!ptheResult);
+	CHECK_EQUAL ((ULONG)CThreadIt::WORKDONE_NO_RESULT, theStatus);
+	theGraph.release (ptheRun);
+} // TEST (Test_ThreadItTaskGraph_failure)
+
+/**
+ * Test_ThreadItTaskGraph_cycle checks that a graph with a cycle does not compile.
+ */
+TEST (Test_ThreadItTaskGraph_cycle)
+{
+	CTaskWorker theWorker;
+	CThreadItTaskGraph theGraph;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItTaskGraph"));
+	logger->info ("Testing - Test_ThreadItTaskGraph_cycle");
+
+	ULONG theFirst = theGraph.addNode (&theWorker, TASK_VALUE);
+	ULONG theSecond = theGraph.addNode (&theWorker, TASK_SUM);
+	ULONG theThird = theGraph.addNode (&theWorker, TASK_SUM);
+	theGraph.addEdge (theFirst, theSecond);
+	theGraph.addEdge (theSecond, theThird);
+	theGraph.addEdge (theThird, theSecond);
+	CHECK (!theGraph.compile ());
+	CHECK (theGraph.start () == NULL);
+} // TEST (Test_ThreadItTaskGraph_cycle)
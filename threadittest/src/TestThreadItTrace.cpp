@@ -0,0 +1,169 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItTrace
+ * Description: TestThreadItTrace contains unit tests for the trace of the work packages
+ * of CThreadIt instances recorded by CThreadItTrace.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+#include "threadittrace.h"
+
+/** TRACED_WORK is the instruction of the traced worker. */
+#define TRACED_WORK 1
+/** TRACED_REQUESTS is the number of work packages sent. */
+#define TRACED_REQUESTS 3
+
+/**
+ * Class CTracedWorker does a little work for each work package.
+ */
+class CTracedWorker : public CThreadIt
+{
+public:
+	CTracedWorker () : CThreadIt ("threadit.CTracedWorker")
+	{
+		setWorkerMethod ((WorkerMethodType)&CTracedWorker::work, TRACED_WORK);
+	} // constructor CTracedWorker
+
+	~CTracedWorker ()
+	{
+		stopThread ();
+		waitForThreadToStop ();
+	} // ~CTracedWorker
+
+	bool work (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		Sleep (2);
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // work
+
+	/**
+	 * Method runWork sends work packages and collects the results.
+	 * \return the number of results collected.
+	 */
+	ULONG runWork ()
+	{
+		ULONG theWorkPackId = 0;
+		ULONG theReceived = 0;
+		CWorkPackIt* ptheWorkPack = NULL;
+
+		for (ULONG i = 0; i < TRACED_REQUESTS; i++)
+		{
+			ptheWorkPack = new CWorkPackIt ();
+			ptheWorkPack->m_theInstruction = TRACED_WORK;
+			ptheWorkPack->m_isSendResult = true;
+			startWork (ptheWorkPack, theWorkPackId);
+		} // for
+		for (ULONG i = 0; i < TRACED_REQUESTS; i++)
+		{
+			ptheWorkPack = getWork (2000);
+			if (ptheWorkPack != NULL)
+			{
+				theReceived++;
+				delete ptheWorkPack;
+			} // if
+		} // for
+		return theReceived;
+	} // runWork
+
+}; // class CTracedWorker
+
+/**
+ * Method countText returns the number of times a text appears in a string.
+ */
+static ULONG countText (const std::string& theText, const std::string& theFind)
+{
+	ULONG theCount = 0;
+	size_t thePosition = theText.find (theFind);
+
+	while (thePosition != std::string::npos)
+	{
+		theCount++;
+		thePosition = theText.find (theFind, thePosition + theFind.size ());
+	} // while
+	return theCount;
+} // countText
+
+/**
+ * Test_Trace_disabled checks that nothing is recorded while tracing is off.
+ */
+TEST (Test_Trace_disabled)
+{
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItTrace"));
+	logger->info ("Testing - Test_Trace_disabled");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CThreadItTrace::stop ();
+	CThreadItTrace::clear ();
+	CHECK (!CThreadItTrace::isTracing ());
+	{
+		CTracedWorker theWorker;
+		CHECK_EQUAL ((ULONG)TRACED_REQUESTS, theWorker.runWork ());
+	}
+	CHECK_EQUAL (0u, CThreadItTrace::getEventCount ());
+	CHECK_EQUAL (0u, countText (CThreadItTrace::toJson (), "\"ph\":\"B\""));
+} // TEST (Test_Trace_disabled)
+
+/**
+ * Test_Trace_export checks that the trace holds a slice for each run of the worker
+ * method on the track of the worker and flows from each enqueue and reply.
+ */
+TEST (Test_Trace_export)
+{
+	std::string theTrace;
+	char theId[64];
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItTrace"));
+	logger->info ("Testing - Test_Trace_export");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CThreadItTrace::clear ();
+	CThreadItTrace::start ();
+	CHECK (CThreadItTrace::isTracing ());
+	{
+		CTracedWorker theWorker;
+		CHECK_EQUAL ((ULONG)TRACED_REQUESTS, theWorker.runWork ());
+		CThreadItTrace::stop ();
+		sprintf_s (theId, sizeof (theId), "\"id\":\"0x%llx.1", (unsigned long long)(ULONG_PTR)(CActive*)&theWorker);
+		theTrace = CThreadItTrace::toJson ();
+		logger->infoStream () << CThreadItTrace::getEventCount () << " events traced";
+		// Enqueue, dequeue, begin, end, reply and receive for each work package.
+		CHECK (CThreadItTrace::getEventCount () >= 6 * TRACED_REQUESTS);
+		CHECK (theTrace.find ("\"name\":\"threadit.CTracedWorker.CThreadIt\"") != std::string::npos);
+		CHECK_EQUAL ((ULONG)TRACED_REQUESTS, countText (theTrace, "\"ph\":\"B\",\"name\":\"instruction 1\""));
+		CHECK_EQUAL ((ULONG)TRACED_REQUESTS, countText (theTrace, "\"ph\":\"E\",\"name\":\"instruction 1\""));
+		CHECK_EQUAL ((ULONG)(2 * TRACED_REQUESTS), countText (theTrace, "\"ph\":\"s\""));
+		CHECK_EQUAL ((ULONG)(2 * TRACED_REQUESTS), countText (theTrace, "\"ph\":\"f\""));
+		// The first work package has a flow to its dequeue and one to its getWork.
+		CHECK_EQUAL (2u, countText (theTrace, std::string (theId) + "\""));
+		CHECK_EQUAL (2u, countText (theTrace, std::string (theId) + ".reply\""));
+	}
+	CThreadItTrace::clear ();
+} // TEST (Test_Trace_export)
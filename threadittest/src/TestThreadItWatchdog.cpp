@@ -0,0 +1,262 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItWatchdog
+ * Description: TestThreadItWatchdog contains unit tests for the stalls found by
+ * CThreadItWatchdog.
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threadit.h"
+#include "threaditwatchdog.h"
+
+/** WATCHDOG_STUCK_WORK waits until it is released. */
+#define WATCHDOG_STUCK_WORK 1
+/** WATCHDOG_NESTED_WORK sends WATCHDOG_QUICK_WORK to itself and then waits until it is released. */
+#define WATCHDOG_NESTED_WORK 2
+/** WATCHDOG_QUICK_WORK returns at once. */
+#define WATCHDOG_QUICK_WORK 3
+/** WATCHDOG_STUCK_TIME is the most time in milliseconds the stuck work waits. */
+#define WATCHDOG_STUCK_TIME 5000
+
+/**
+ * Class CWatchdogWorker has a worker method that is stuck until it is released.
+ */
+class CWatchdogWorker : public CThreadIt
+{
+private:
+	HANDLE m_theRelease;
+
+public:
+	CWatchdogWorker () : CThreadIt ("threadit.CWatchdogWorker")
+	{
+		m_theRelease = CreateEvent (NULL, TRUE, FALSE, NULL);
+		setWorkerMethod ((WorkerMethodType)&CWatchdogWorker::stuckWork, WATCHDOG_STUCK_WORK);
+		setWorkerMethod ((WorkerMethodType)&CWatchdogWorker::nestedWork, WATCHDOG_NESTED_WORK);
+		setWorkerMethod ((WorkerMethodType)&CWatchdogWorker::quickWork, WATCHDOG_QUICK_WORK);
+	} // constructor CWatchdogWorker
+
+	~CWatchdogWorker ()
+	{
+		release ();
+		stopThread ();
+		waitForThreadToStop ();
+		CloseHandle (m_theRelease);
+	} // ~CWatchdogWorker
+
+	void release ()
+	{
+		SetEvent (m_theRelease);
+	} // release
+
+	bool stuckWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		WaitForSingleObject (m_theRelease, WATCHDOG_STUCK_TIME);
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // stuckWork
+
+	bool nestedWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		ULONG theWorkPackId = 0;
+		CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+
+		ptheWorkPack->m_theInstruction = WATCHDOG_QUICK_WORK;
+		startWork (ptheWorkPack, theWorkPackId);
+		return stuckWork (pWorkPack, pWorkDone);
+	} // nestedWork
+
+	bool quickWork (CWorkPackIt* pWorkPack, CWorkPackIt*& pWorkDone)
+	{
+		pWorkDone = pWorkPack;
+		pWorkDone->m_theStatus = CThreadIt::THREADIT_STATUS_OK;
+		return true;
+	} // quickWork
+
+	void sendStuckWork (ULONG theTimeAllowed, LONG theInstruction = WATCHDOG_STUCK_WORK)
+	{
+		ULONG theWorkPackId = 0;
+		CWorkPackIt* ptheWorkPack = new CWorkPackIt ();
+
+		ptheWorkPack->m_theInstruction = theInstruction;
+		ptheWorkPack->m_theTimeAllowed = theTimeAllowed;
+		startWork (ptheWorkPack, theWorkPackId);
+	} // sendStuckWork
+
+}; // class CWatchdogWorker
+
+/**
+ * Class CWatchdogObserver counts the stalls of a thread.
+ */
+class CWatchdogObserver : public CObserver
+{
+private:
+	UINT m_theThreadId;
+	volatile LONG m_theStalls;
+
+public:
+	CWatchdogObserver (UINT theThreadId)
+	{
+		m_theThreadId = theThreadId;
+		m_theStalls = 0;
+	} // constructor CWatchdogObserver
+
+	bool onUpdate (const CSubject& theSubject)
+	{
+		return true;
+	} // onUpdate
+
+	bool onChange (VoidRef ptheSubject)
+	{
+		ThreadItStall& theStall = ptheSubject.cast<ThreadItStall> ();
+
+		if (theStall.theThreadId == m_theThreadId)
+		{
+			InterlockedIncrement (&m_theStalls);
+		} // if
+		return true;
+	} // onChange
+
+	LONG getStalls () const
+	{
+		return m_theStalls;
+	} // getStalls
+
+	bool waitForStall (DWORD theTimeout) const
+	{
+		DWORD theStart = GetTickCount ();
+
+		while ((m_theStalls == 0) && ((GetTickCount () - theStart) < theTimeout))
+		{
+			Sleep (10);
+		} // while
+		return (m_theStalls > 0);
+	} // waitForStall
+
+}; // class CWatchdogObserver
+
+/**
+ * Test_Watchdog_overrun checks that a worker method that runs past its time allowed
+ * is reported once with its stack.
+ */
+TEST (Test_Watchdog_overrun)
+{
+	ThreadItStall theStall;
+	CWatchdogWorker theWorker;
+	CWatchdogObserver theObserver (theWorker.getThreadId ());
+	// Only worker methods with a time allowed are checked.
+	CThreadItWatchdog theWatchdog (20, 0, 0);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItWatchdog"));
+	logger->info ("Testing - Test_Watchdog_overrun");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	CHECK (!theWatchdog.getLastStall (theStall));
+	CHECK (!theWatchdog.isCaptureStack ());
+	theWatchdog.setCaptureStack (true);
+	theWatchdog.addStallObserver (&theObserver);
+	theWorker.sendStuckWork (100);
+	CHECK (theObserver.waitForStall (3000));
+	// The run is only reported once.
+	Sleep (200);
+	CHECK_EQUAL (1, theObserver.getStalls ());
+	CHECK (theWatchdog.getLastStall (theStall));
+	CHECK_EQUAL ((ULONG)CThreadItWatchdog::STALL_OVERRUN, theStall.theType);
+	CHECK_EQUAL (theWorker.getThreadId (), theStall.theThreadId);
+	CHECK_EQUAL (WATCHDOG_STUCK_WORK, theStall.theInstruction);
+	CHECK_EQUAL (100u, theStall.theTimeAllowed);
+	CHECK (theStall.theRunningTime > 100);
+#if defined (_M_X64) || defined (_M_IX86)
+	CHECK (!theStall.theStack.empty ());
+	CHECK (!theStall.theStackText.empty ());
+	logger->info (theStall.theStackText);
+#endif
+	theWorker.release ();
+	theWatchdog.removeStallObserver (&theObserver);
+} // TEST (Test_Watchdog_overrun)
+
+/**
+ * Test_Watchdog_queue checks that work waiting behind a worker method without a limit
+ * is reported once as a stalled queue.
+ */
+TEST (Test_Watchdog_queue)
+{
+	ThreadItStall theStall;
+	CWatchdogWorker theWorker;
+	CWatchdogObserver theObserver (theWorker.getThreadId ());
+	CThreadItWatchdog theWatchdog (20, 0, 200);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItWatchdog"));
+	logger->info ("Testing - Test_Watchdog_queue");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	theWatchdog.addStallObserver (&theObserver);
+	theWorker.sendStuckWork (0);
+	theWorker.sendStuckWork (0);
+	CHECK (theObserver.waitForStall (3000));
+	Sleep (200);
+	CHECK_EQUAL (1, theObserver.getStalls ());
+	CHECK (theWatchdog.getLastStall (theStall));
+	CHECK_EQUAL ((ULONG)CThreadItWatchdog::STALL_QUEUE, theStall.theType);
+	CHECK_EQUAL (theWorker.getThreadId (), theStall.theThreadId);
+	CHECK (theStall.theWorkQDepth > 0);
+	// The stack is only captured when asked.
+	CHECK (theStall.theStack.empty ());
+	theWorker.release ();
+	theWatchdog.removeStallObserver (&theObserver);
+} // TEST (Test_Watchdog_queue)
+
+/**
+ * Test_Watchdog_nested checks that a worker method that runs work inline for its own
+ * thread is still checked against its time allowed once the inline run returns.
+ */
+TEST (Test_Watchdog_nested)
+{
+	ThreadItStall theStall;
+	CWatchdogWorker theWorker;
+	CWatchdogObserver theObserver (theWorker.getThreadId ());
+	CThreadItWatchdog theWatchdog (20, 0, 0);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItWatchdog"));
+	logger->info ("Testing - Test_Watchdog_nested");
+
+	UNITTEST_TIME_CONSTRAINT (10000);
+
+	theWorker.setSelfSendMode (CThreadIt::SELF_SEND_INLINE);
+	theWatchdog.addStallObserver (&theObserver);
+	theWorker.sendStuckWork (100, WATCHDOG_NESTED_WORK);
+	CHECK (theObserver.waitForStall (3000));
+	CHECK (theWatchdog.getLastStall (theStall));
+	CHECK_EQUAL ((ULONG)CThreadItWatchdog::STALL_OVERRUN, theStall.theType);
+	// The outer run is restored after the inline run of WATCHDOG_QUICK_WORK.
+	CHECK_EQUAL (WATCHDOG_NESTED_WORK, theStall.theInstruction);
+	CHECK_EQUAL (100u, theStall.theTimeAllowed);
+	CHECK (theStall.theRunningTime > 100);
+	theWorker.release ();
+	theWatchdog.removeStallObserver (&theObserver);
+} // TEST (Test_Watchdog_nested)
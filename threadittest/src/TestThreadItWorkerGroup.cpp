@@ -0,0 +1,200 @@
+/*-------------------------------------------------------------------------*/
+/* Copyright (C) 2021 by Ashkel Software                                   */
+/* ari@ashkel.com.au                                                       */
+/*                                                                         */
+/* This file is part of the threadit library.                              */
+/*                                                                         */
+/* The threadit library is free software; you can redistribute it and/or   */
+/* modify it under the terms of The Code Project Open License (CPOL) 1.02  */
+/*                                                                         */
+/* The threadit library is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of          */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the CPOL       */
+/* License for more details.                                               */
+/*                                                                         */
+/* You should have received a copy of the CPOL License along with this     */
+/* software.                                                               */
+/*-------------------------------------------------------------------------*/
+
+/**
+ * Title: TestThreadItWorkerGroup
+ * Description: TestThreadItWorkerGroup contains unit tests for the
+ * CThreadItWorkerGroup class. parallelFor, parallelReduce and scatterGather are
+ * checked against the serial result and the speedup of a CPU bound job is logged
+ * for worker counts from one up to the number of processors (at most 64).
+ *
+ * Copyright: Copyright (c) 2021 Ashkel Software
+ * @author Ari Edinburg
+ * @version 1.0
+ */
+
+#include "stdafx.h"
+#include <UnitTest++.h>
+#include <log4cpp/Category.hh>
+#include "threaditworkergroup.h"
+
+/** The number of indexes used by the tests. */
+const LONGLONG theRangeSize = 100000;
+
+/**
+ * Method spin is a CPU bound function whose cost grows with the index so that the
+ * chunks of the range are not of equal cost.
+ */
+static ULONG spin (LONGLONG theIndex)
+{
+	ULONG theValue = (ULONG)theIndex;
+	LONGLONG theCount = 100 + (theIndex % 400);
+
+	for (LONGLONG i = 0; i < theCount; i++)
+	{
+		theValue = theValue * 1664525 + 1013904223;
+	} // for
+	return theValue;
+} // spin
+
+/**
+ * Test_ThreadItWorkerGroup_parallelFor checks that every index is visited once.
+ */
+TEST (Test_ThreadItWorkerGroup_parallelFor)
+{
+	CThreadItWorkerGroup theGroup (4);
+	std::vector<LONG> theVisits ((size_t)theRangeSize, 0);
+	LONGLONG theSum = 0;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItWorkerGroup"));
+	logger->info ("Testing - Test_ThreadItWorkerGroup_parallelFor");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	CHECK_EQUAL (4u, theGroup.getWorkerCount ());
+	CHECK (theGroup.parallelFor (0, theRangeSize, [&theVisits] (LONGLONG i) { InterlockedIncrement (&theVisits[(size_t)i]); }, 16));
+	for (size_t i = 0; i < theVisits.size (); i++)
+	{
+		CHECK_EQUAL (1, theVisits[i]);
+	} // for
+	// An exception in a chunk fails the job.
+	CHECK (!theGroup.parallelFor (0, 1000, [] (LONGLONG i) { if (i == 500) throw std::exception (); }));
+	CHECK (!theGroup.parallelReduce (theSum, 0, 1000, (LONGLONG)0,
+		[] (LONGLONG i) -> LONGLONG { if (i == 500) throw std::exception (); return i; }, [] (LONGLONG a, LONGLONG b) { return a + b; }));
+	CHECK (theSum < 999 * 1000 / 2);
+	// An empty range completes.
+	CHECK (theGroup.parallelFor (10, 10, [] (LONGLONG i) { }));
+} // TEST (Test_ThreadItWorkerGroup_parallelFor)
+
+/**
+ * Test_ThreadItWorkerGroup_parallelReduce checks the sum of a range.
+ */
+TEST (Test_ThreadItWorkerGroup_parallelReduce)
+{
+	CThreadItWorkerGroup theGroup (4);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItWorkerGroup"));
+	logger->info ("Testing - Test_ThreadItWorkerGroup_parallelReduce");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	LONGLONG theSum = theGroup.parallelReduce (1, theRangeSize + 1, (LONGLONG)0,
+		[] (LONGLONG i) { return i; }, [] (LONGLONG a, LONGLONG b) { return a + b; });
+	CHECK_EQUAL (theRangeSize * (theRangeSize + 1) / 2, theSum);
+	theSum = 0;
+	CHECK (theGroup.parallelReduce (theSum, 1, theRangeSize + 1, (LONGLONG)0,
+		[] (LONGLONG i) { return i; }, [] (LONGLONG a, LONGLONG b) { return a + b; }));
+	CHECK_EQUAL (theRangeSize * (theRangeSize + 1) / 2, theSum);
+} // TEST (Test_ThreadItWorkerGroup_parallelReduce)
+
+/**
+ * Test_ThreadItWorkerGroup_nested checks that a job started from a worker of the
+ * group runs on that worker rather than waiting for the group.
+ */
+TEST (Test_ThreadItWorkerGroup_nested)
+{
+	CThreadItWorkerGroup theGroup (2);
+	const LONGLONG theOuterSize = 8;
+	const LONGLONG theInnerSize = 1000;
+	std::vector<LONGLONG> theSums ((size_t)theOuterSize, 0);
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItWorkerGroup"));
+	logger->info ("Testing - Test_ThreadItWorkerGroup_nested");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	CHECK (theGroup.parallelFor (0, theOuterSize, [&theGroup, &theSums, theInnerSize] (LONGLONG i)
+	{
+		theSums[(size_t)i] = theGroup.parallelReduce (1, theInnerSize + 1, (LONGLONG)0,
+			[] (LONGLONG j) { return j; }, [] (LONGLONG a, LONGLONG b) { return a + b; });
+	}));
+	for (size_t i = 0; i < theSums.size (); i++)
+	{
+		CHECK_EQUAL (theInnerSize * (theInnerSize + 1) / 2, theSums[i]);
+	} // for
+} // TEST (Test_ThreadItWorkerGroup_nested)
+
+/**
+ * Test_ThreadItWorkerGroup_scatterGather checks that the results are gathered in
+ * the order of the inputs.
+ */
+TEST (Test_ThreadItWorkerGroup_scatterGather)
+{
+	CThreadItWorkerGroup theGroup (4);
+	std::vector<LONGLONG> theInputs;
+	std::vector<ULONG> theOutputs;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItWorkerGroup"));
+	logger->info ("Testing - Test_ThreadItWorkerGroup_scatterGather");
+
+	UNITTEST_TIME_CONSTRAINT (5000);
+
+	for (LONGLONG i = 0; i < theRangeSize; i++)
+	{
+		theInputs.push_back (theRangeSize - i);
+	} // for
+	CHECK (theGroup.scatterGather (theInputs, theOutputs, spin));
+	CHECK_EQUAL (theInputs.size (), theOutputs.size ());
+	for (size_t i = 0; i < theInputs.size (); i++)
+	{
+		CHECK_EQUAL (spin (theInputs[i]), theOutputs[i]);
+	} // for
+} // TEST (Test_ThreadItWorkerGroup_scatterGather)
+
+/**
+ * Test_ThreadItWorkerGroup_speedup logs the time taken by a CPU bound job for
+ * worker counts 1, 2, 4 and so on up to the number of processors or 64.
+ */
+TEST (Test_ThreadItWorkerGroup_speedup)
+{
+	SYSTEM_INFO theInfo;
+	LARGE_INTEGER theFrequency;
+	LARGE_INTEGER theStart;
+	LARGE_INTEGER theStop;
+	double theSerial = 0;
+	double theElapsed = 0;
+	ULONG theResult = 0;
+	ULONG theExpected = 0;
+
+	log4cpp::Category *logger = &(log4cpp::Category::getInstance ("TestThreadItWorkerGroup"));
+	logger->info ("Testing - Test_ThreadItWorkerGroup_speedup");
+
+	GetSystemInfo (&theInfo);
+	UINT theMaxWorkers = (theInfo.dwNumberOfProcessors < 64) ? theInfo.dwNumberOfProcessors : 64;
+	CThreadItWorkerGroup theGroup (theMaxWorkers);
+	auto theXor = [] (ULONG a, ULONG b) { return a ^ b; };
+
+	for (LONGLONG i = 0; i < 10 * theRangeSize; i++)
+	{
+		theExpected ^= spin (i);
+	} // for
+	QueryPerformanceFrequency (&theFrequency);
+	for (UINT theWorkers = 1; theWorkers <= theMaxWorkers; theWorkers *= 2)
+	{
+		QueryPerformanceCounter (&theStart);
+		theResult = theGroup.parallelReduce (0, 10 * theRangeSize, (ULONG)0, spin, theXor, 64, theWorkers);
+		QueryPerformanceCounter (&theStop);
+		CHECK_EQUAL (theExpected, theResult);
+		theElapsed = (1000.0 * (double)(theStop.QuadPart - theStart.QuadPart)) / (double)theFrequency.QuadPart;
+		if (theWorkers == 1)
+		{
+			theSerial = theElapsed;
+		} // if
+		logger->infoStream () << "workers=" << theWorkers << " elapsed=" << theElapsed << "ms speedup=" << ((theElapsed > 0) ? theSerial / theElapsed : 0);
+	} // for
+} // TEST (Test_ThreadItWorkerGroup_speedup)